@@ -23,6 +23,7 @@
 #include "tmux.h"
 
 int	alerts_fired;
+TAILQ_HEAD(, window) alerts_list = TAILQ_HEAD_INITIALIZER(alerts_list);
 
 void	alerts_timer(int, short, void *);
 int	alerts_enabled(struct window *, int);
@@ -36,16 +37,34 @@ int	alerts_check_activity(struct session *, struct winlink *);
 int	alerts_check_silence(struct session *, struct winlink *);
 void	alerts_ring_bell(struct session *);
 
+/*
+ * The silence timer is not moved on every bit of activity, only started if it
+ * is not already running. When it expires it is started again for what is
+ * left if there has been activity since.
+ */
 void
 alerts_timer(__unused int fd, __unused short events, void *arg)
 {
 	struct window	*w = arg;
+	struct timeval	 now, tv;
+
+	timerclear(&tv);
+	tv.tv_sec = options_get_number(w->options, "monitor-silence");
+
+	event_base_gettimeofday_cached(NULL, &now);
+	timeradd(&w->activity_time, &tv, &tv);
+	if (timercmp(&tv, &now, >)) {
+		timersub(&tv, &now, &tv);
+		event_add(&w->alerts_timer, &tv);
+		return;
+	}
 
 	log_debug("@%u alerts timer expired", w->id);
 	alerts_reset(w);
 	alerts_queue(w, WINDOW_SILENCE);
 }
 
+/* Check the windows which were queued, in each session they are linked to. */
 void
 alerts_callback(__unused int fd, __unused short events, __unused void *arg)
 {
@@ -54,10 +73,14 @@ alerts_callback(__unused int fd, __unused short events, __unused void *arg)
 	struct winlink	*wl;
 	int		 flags, alerts;
 
-	RB_FOREACH(w, windows, &windows) {
+	while ((w = TAILQ_FIRST(&alerts_list)) != NULL) {
+		TAILQ_REMOVE(&alerts_list, w, alerts_entry);
+		w->alerts_queued = 0;
+
 		RB_FOREACH(s, sessions, &sessions) {
-			RB_FOREACH(wl, winlinks, &s->windows) {
-				if (wl->window != w)
+			TAILQ_FOREACH(wl, &w->winlinks, wentry) {
+				if (winlink_find_by_index(&s->windows,
+				    wl->idx) != wl)
 					continue;
 				flags = w->flags;
 
@@ -68,6 +91,7 @@ alerts_callback(__unused int fd, __unused short events, __unused void *arg)
 				    alerts, flags);
 			}
 		}
+		window_remove_ref(w);
 	}
 	alerts_fired = 0;
 }
@@ -134,8 +158,12 @@ alerts_reset_all(void)
 {
 	struct window	*w;
 
-	RB_FOREACH(w, windows, &windows)
+	/* The interval may have changed, so start the timers again. */
+	RB_FOREACH(w, windows, &windows) {
+		if (event_initialized(&w->alerts_timer))
+			event_del(&w->alerts_timer);
 		alerts_reset(w);
+	}
 }
 
 void
@@ -144,14 +172,21 @@ alerts_reset(struct window *w)
 	struct timeval	tv;
 
 	w->flags &= ~WINDOW_SILENCE;
-	event_del(&w->alerts_timer);
+	if (!event_initialized(&w->alerts_timer))
+		return;
 
 	timerclear(&tv);
 	tv.tv_sec = options_get_number(w->options, "monitor-silence");
+	if (tv.tv_sec == 0) {
+		event_del(&w->alerts_timer);
+		return;
+	}
 
-	log_debug("@%u alerts timer reset %u", w->id, (u_int)tv.tv_sec);
-	if (tv.tv_sec != 0)
+	if (!evtimer_pending(&w->alerts_timer, NULL)) {
+		log_debug("@%u alerts timer started %u", w->id,
+		    (u_int)tv.tv_sec);
 		event_add(&w->alerts_timer, &tv);
+	}
 }
 
 void
@@ -160,18 +195,27 @@ alerts_queue(struct window *w, int flags)
 	if (w->flags & WINDOW_ACTIVITY)
 		alerts_reset(w);
 
-	if (!event_initialized(&w->alerts_timer))
+	if (!event_initialized(&w->alerts_timer)) {
 		evtimer_set(&w->alerts_timer, alerts_timer, w);
+		event_priority_set(&w->alerts_timer, EVENT_PRI_BACKGROUND);
+	}
 
-	if (!alerts_fired) {
+	if ((w->flags & flags) != flags) {
 		w->flags |= flags;
 		log_debug("@%u alerts flags added %#x", w->id, flags);
+	}
 
-		if (alerts_enabled(w, flags)) {
-			log_debug("alerts check queued (by @%u)", w->id);
-			event_once(-1, EV_TIMEOUT, alerts_callback, NULL, NULL);
-			alerts_fired = 1;
-		}
+	if (!alerts_enabled(w, flags))
+		return;
+	if (!w->alerts_queued) {
+		w->alerts_queued = 1;
+		TAILQ_INSERT_TAIL(&alerts_list, w, alerts_entry);
+		w->references++;
+	}
+	if (!alerts_fired) {
+		log_debug("alerts check queued (by @%u)", w->id);
+		event_once(-1, EV_TIMEOUT, alerts_callback, NULL, NULL);
+		alerts_fired = 1;
 	}
 }
 
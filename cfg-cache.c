@@ -0,0 +1,313 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tmux.h"
+#include "tmate.h"
+
+/*
+ * Cache of a configuration file split into words, in path.cache. It is used
+ * and kept up to date only if it already exists, creating an empty file
+ * turns it on.
+ *
+ * The cache is a msgpack array: a magic string, the version, the modification
+ * time, size and hash of the configuration file, then one entry per command
+ * line. An entry is the line number and either the words, given straight to
+ * cmd_list_parse, or the line itself when splitting it would read or change
+ * the environment. A cache which does not match is ignored and rewritten.
+ */
+
+#define CFG_CACHE_MAGIC "tmate-cfg-cache-1"
+
+struct cfg_cache {
+	msgpack_sbuffer	 sbuf;
+	msgpack_packer	 pk;
+	u_int		 entries;
+};
+
+static char	*cfg_cache_path(const char *);
+static int	 cfg_cache_str(msgpack_object *, char **);
+static int	 cfg_cache_run(msgpack_object *, const char *, struct cmd_q *,
+		     u_int *);
+static void	 cfg_cache_pack_string(struct cfg_cache *, const char *);
+
+static char *
+cfg_cache_path(const char *path)
+{
+	char	*cache;
+
+	xasprintf(&cache, "%s.cache", path);
+	if (access(cache, R_OK|W_OK) != 0) {
+		free(cache);
+		return (NULL);
+	}
+	return (cache);
+}
+
+static int
+cfg_cache_str(msgpack_object *obj, char **s)
+{
+	if (obj->type != MSGPACK_OBJECT_STR)
+		return (-1);
+	*s = xmalloc(obj->via.str.size + 1);
+	memcpy(*s, obj->via.str.ptr, obj->via.str.size);
+	(*s)[obj->via.str.size] = '\0';
+	return (0);
+}
+
+/* Whether a line needs the environment to be split. */
+int
+cfg_cache_wants_string(const char *s)
+{
+	size_t	n;
+
+	if (strpbrk(s, "$~") != NULL)
+		return (1);
+	n = strcspn(s, " \t");
+	return (memchr(s, '=', n) != NULL);
+}
+
+/* Queue the commands of one entry. */
+static int
+cfg_cache_run(msgpack_object *entry, const char *path, struct cmd_q *cmdq,
+    u_int *found)
+{
+	msgpack_object	*o;
+	struct cmd_list	*cmdlist;
+	char		**argv, *s, *cause;
+	u_int		  line, argc, i;
+	int		  error;
+
+	if (entry->type != MSGPACK_OBJECT_ARRAY || entry->via.array.size != 2)
+		return (-1);
+	o = entry->via.array.ptr;
+	if (o[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+		return (-1);
+	line = o[0].via.u64;
+
+	if (o[1].type == MSGPACK_OBJECT_STR) {
+		cfg_cache_str(&o[1], &s);
+		error = cmd_string_parse(s, &cmdlist, path, line, &cause);
+		free(s);
+	} else if (o[1].type == MSGPACK_OBJECT_ARRAY &&
+	    o[1].via.array.size != 0) {
+		argc = o[1].via.array.size;
+		argv = xcalloc(argc, sizeof *argv);
+		for (i = 0; i < argc; i++) {
+			if (cfg_cache_str(&o[1].via.array.ptr[i],
+			    &argv[i]) != 0) {
+				while (i-- > 0)
+					free(argv[i]);
+				free(argv);
+				return (-1);
+			}
+		}
+		cmdlist = cmd_list_parse(argc, argv, path, line, &cause);
+		error = (cmdlist == NULL) ? -1 : 0;
+		cmd_free_argv(argc, argv);
+	} else
+		return (-1);
+
+	if (error != 0) {
+		if (cause != NULL) {
+			cfg_add_cause("%s:%u: %s", path, line, cause);
+			free(cause);
+		}
+		return (0);
+	}
+	if (cmdlist != NULL) {
+		cmdq_append(cmdq, cmdlist, NULL);
+		cmd_list_free(cmdlist);
+		(*found)++;
+	}
+	return (0);
+}
+
+/*
+ * Queue the commands from the cache of path if it matches. Returns -1 if it
+ * could not be used.
+ */
+int
+cfg_cache_load(const char *path, struct stat *sb, uint64_t hash,
+    struct cmd_q *cmdq, u_int *found)
+{
+	msgpack_unpacked	 result;
+	msgpack_object		*o;
+	struct stat		 csb;
+	char			*cache, *buf = NULL, *version = NULL;
+	size_t			 off = 0;
+	ssize_t			 n;
+	u_int			 i;
+	int			 fd, rval = -1;
+
+	if ((cache = cfg_cache_path(path)) == NULL)
+		return (-1);
+	fd = open(cache, O_RDONLY);
+	free(cache);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &csb) != 0 || csb.st_size == 0) {
+		close(fd);
+		return (-1);
+	}
+	buf = xmalloc(csb.st_size);
+	n = read(fd, buf, csb.st_size);
+	close(fd);
+	if (n != csb.st_size) {
+		free(buf);
+		return (-1);
+	}
+
+	msgpack_unpacked_init(&result);
+	if (msgpack_unpack_next(&result, buf, n, &off) !=
+	    MSGPACK_UNPACK_SUCCESS)
+		goto out;
+	if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+	    result.data.via.array.size != 6)
+		goto out;
+	o = result.data.via.array.ptr;
+
+	if (o[0].type != MSGPACK_OBJECT_STR ||
+	    o[0].via.str.size != strlen(CFG_CACHE_MAGIC) ||
+	    memcmp(o[0].via.str.ptr, CFG_CACHE_MAGIC, o[0].via.str.size) != 0)
+		goto out;
+	if (cfg_cache_str(&o[1], &version) != 0 ||
+	    strcmp(version, VERSION) != 0)
+		goto out;
+	if (o[2].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+	    o[2].via.u64 != (uint64_t)sb->st_mtime ||
+	    o[3].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+	    o[3].via.u64 != (uint64_t)sb->st_size ||
+	    o[4].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+	    o[4].via.u64 != hash ||
+	    o[5].type != MSGPACK_OBJECT_ARRAY)
+		goto out;
+
+	/* Check every entry before running anything. */
+	for (i = 0; i < o[5].via.array.size; i++) {
+		if (o[5].via.array.ptr[i].type != MSGPACK_OBJECT_ARRAY)
+			goto out;
+	}
+	log_debug("loading %s from cache", path);
+	for (i = 0; i < o[5].via.array.size; i++) {
+		if (cfg_cache_run(&o[5].via.array.ptr[i], path, cmdq,
+		    found) != 0)
+			log_debug("%s: bad cache entry %u", path, i);
+	}
+	rval = 0;
+
+out:
+	msgpack_unpacked_destroy(&result);
+	free(version);
+	free(buf);
+	return (rval);
+}
+
+/* Start building a new cache, or return NULL if path has none. */
+struct cfg_cache *
+cfg_cache_start(const char *path)
+{
+	struct cfg_cache	*cc;
+	char			*cache;
+
+	if ((cache = cfg_cache_path(path)) == NULL)
+		return (NULL);
+	free(cache);
+
+	cc = xcalloc(1, sizeof *cc);
+	msgpack_sbuffer_init(&cc->sbuf);
+	msgpack_packer_init(&cc->pk, &cc->sbuf, msgpack_sbuffer_write);
+	return (cc);
+}
+
+static void
+cfg_cache_pack_string(struct cfg_cache *cc, const char *s)
+{
+	size_t	len = strlen(s);
+
+	msgpack_pack_str(&cc->pk, len);
+	msgpack_pack_str_body(&cc->pk, s, len);
+}
+
+void
+cfg_cache_add_argv(struct cfg_cache *cc, u_int line, int argc, char **argv)
+{
+	int	i;
+
+	msgpack_pack_array(&cc->pk, 2);
+	msgpack_pack_unsigned_int(&cc->pk, line);
+	msgpack_pack_array(&cc->pk, argc);
+	for (i = 0; i < argc; i++)
+		cfg_cache_pack_string(cc, argv[i]);
+	cc->entries++;
+}
+
+void
+cfg_cache_add_string(struct cfg_cache *cc, u_int line, const char *s)
+{
+	msgpack_pack_array(&cc->pk, 2);
+	msgpack_pack_unsigned_int(&cc->pk, line);
+	cfg_cache_pack_string(cc, s);
+	cc->entries++;
+}
+
+/* Write the cache out. It is replaced in one go, so never seen half done. */
+void
+cfg_cache_finish(struct cfg_cache *cc, const char *path, struct stat *sb,
+    uint64_t hash)
+{
+	msgpack_sbuffer	 head;
+	msgpack_packer	 pk;
+	char		*cache, *tmp;
+	int		 fd;
+
+	msgpack_sbuffer_init(&head);
+	msgpack_packer_init(&pk, &head, msgpack_sbuffer_write);
+	msgpack_pack_array(&pk, 6);
+	msgpack_pack_str(&pk, strlen(CFG_CACHE_MAGIC));
+	msgpack_pack_str_body(&pk, CFG_CACHE_MAGIC, strlen(CFG_CACHE_MAGIC));
+	msgpack_pack_str(&pk, strlen(VERSION));
+	msgpack_pack_str_body(&pk, VERSION, strlen(VERSION));
+	msgpack_pack_uint64(&pk, sb->st_mtime);
+	msgpack_pack_uint64(&pk, sb->st_size);
+	msgpack_pack_uint64(&pk, hash);
+	msgpack_pack_array(&pk, cc->entries);
+
+	xasprintf(&cache, "%s.cache", path);
+	xasprintf(&tmp, "%s.XXXXXX", cache);
+	if ((fd = mkstemp(tmp)) == -1) {
+		log_debug("%s: %s", tmp, strerror(errno));
+		goto out;
+	}
+	if (write(fd, head.data, head.size) != (ssize_t)head.size ||
+	    write(fd, cc->sbuf.data, cc->sbuf.size) != (ssize_t)cc->sbuf.size) {
+		log_debug("%s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) != 0 || rename(tmp, cache) != 0) {
+		log_debug("%s: %s", cache, strerror(errno));
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(cache);
+	msgpack_sbuffer_destroy(&head);
+	cfg_cache_free(cc);
+}
+
+void
+cfg_cache_free(struct cfg_cache *cc)
+{
+	if (cc == NULL)
+		return;
+	msgpack_sbuffer_destroy(&cc->sbuf);
+	free(cc);
+}
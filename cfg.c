@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -87,12 +88,16 @@ start_cfg(void)
 int
 load_cfg(const char *path, struct cmd_q *cmdq, char **cause)
 {
-	FILE		*f;
-	char		 delim[3] = { '\\', '\\', '\0' };
-	u_int		 found;
-	size_t		 line = 0;
-	char		*buf, *cause1, *p;
-	struct cmd_list	*cmdlist;
+	FILE		 *f;
+	char		  delim[3] = { '\\', '\\', '\0' };
+	u_int		  found;
+	size_t		  line = 0, n;
+	char		 *buf, *cause1, *p, data[BUFSIZ], **argv;
+	struct cmd_list	 *cmdlist;
+	struct cfg_cache *cc;
+	struct stat	  sb;
+	uint64_t	  hash = 0;
+	int		  argc, error;
 
 	log_debug("loading %s", path);
 	if ((f = fopen(path, "rb")) == NULL) {
@@ -101,6 +106,19 @@ load_cfg(const char *path, struct cmd_q *cmdq, char **cause)
 	}
 
 	found = 0;
+	cc = NULL;
+	if (fstat(fileno(f), &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    (cc = cfg_cache_start(path)) != NULL) {
+		while ((n = fread(data, 1, sizeof data, f)) != 0)
+			hash = status_hash(hash, data, n);
+		rewind(f);
+		if (cfg_cache_load(path, &sb, hash, cmdq, &found) == 0) {
+			cfg_cache_free(cc);
+			fclose(f);
+			return (found);
+		}
+	}
+
 	while ((buf = fparseln(f, NULL, &line, delim, 0)) != NULL) {
 		log_debug("%s: %s", path, buf);
 
@@ -114,7 +132,24 @@ load_cfg(const char *path, struct cmd_q *cmdq, char **cause)
 		}
 
 		/* Parse and run the command. */
-		if (cmd_string_parse(p, &cmdlist, path, line, &cause1) != 0) {
+		if (cc == NULL || cfg_cache_wants_string(p)) {
+			if (cc != NULL)
+				cfg_cache_add_string(cc, line, p);
+			error = cmd_string_parse(p, &cmdlist, path, line,
+			    &cause1);
+		} else if (cmd_string_split(p, &argc, &argv, &cause1) == 0) {
+			cfg_cache_add_argv(cc, line, argc, argv);
+			cmdlist = cmd_list_parse(argc, argv, path, line,
+			    &cause1);
+			error = (cmdlist == NULL) ? -1 : 0;
+			cmd_free_argv(argc, argv);
+		} else {
+			/* Keep errors, but not lines with only a comment. */
+			if (cause1 != NULL)
+				cfg_cache_add_string(cc, line, p);
+			error = -1;
+		}
+		if (error != 0) {
 			free(buf);
 			if (cause1 == NULL)
 				continue;
@@ -132,6 +167,9 @@ load_cfg(const char *path, struct cmd_q *cmdq, char **cause)
 	}
 	fclose(f);
 
+	if (cc != NULL)
+		cfg_cache_finish(cc, path, &sb, hash);
+
 	return (found);
 }
 
@@ -159,6 +197,7 @@ cfg_default_done(__unused struct cmd_q *cmdq)
 #ifdef TMATE
 	/* We do it this late, this way, CLI options take precedence over cfg file */
 	tmate_load_cli_options();
+	log_startup("configuration loaded");
 
 	tmate_session_start();
 	if (tmate_foreground && cfg_ncauses) {
@@ -524,7 +524,7 @@ client_stdin_callback(__unused int fd, __unused short events,
 	if (data.size < 0 && (errno == EINTR || errno == EAGAIN))
 		return;
 
-	proc_send(client_peer, MSG_STDIN, -1, &data, sizeof data);
+	proc_send(client_peer, MSG_STDIN, -1, &data, MSG_STDIO_LEN(data.size));
 	if (data.size <= 0)
 		event_del(&client_stdin);
 }
@@ -639,6 +639,7 @@ client_dispatch_wait(struct imsg *imsg, const char *shellcmd)
 {
 	char			*data;
 	ssize_t			 datalen;
+	size_t			 stdiolen;
 	struct msg_stdout_data	 stdoutdata;
 	struct msg_stderr_data	 stderrdata;
 	int			 retval;
@@ -687,17 +688,27 @@ client_dispatch_wait(struct imsg *imsg, const char *shellcmd)
 		event_add(&client_stdin, NULL);
 		break;
 	case MSG_STDOUT:
-		if (datalen != sizeof stdoutdata)
+		if (datalen < 0)
+			fatalx("bad MSG_STDOUT size");
+		stdiolen = datalen;
+		if (stdiolen < MSG_STDIO_LEN(0) || stdiolen > sizeof stdoutdata)
+			fatalx("bad MSG_STDOUT size");
+		memcpy(&stdoutdata, data, stdiolen);
+		if (stdiolen != MSG_STDIO_LEN(stdoutdata.size))
 			fatalx("bad MSG_STDOUT size");
-		memcpy(&stdoutdata, data, sizeof stdoutdata);
 
 		client_write(STDOUT_FILENO, stdoutdata.data,
 		    stdoutdata.size);
 		break;
 	case MSG_STDERR:
-		if (datalen != sizeof stderrdata)
+		if (datalen < 0)
+			fatalx("bad MSG_STDERR size");
+		stdiolen = datalen;
+		if (stdiolen < MSG_STDIO_LEN(0) || stdiolen > sizeof stderrdata)
+			fatalx("bad MSG_STDERR size");
+		memcpy(&stderrdata, data, stdiolen);
+		if (stdiolen != MSG_STDIO_LEN(stderrdata.size))
 			fatalx("bad MSG_STDERR size");
-		memcpy(&stderrdata, data, sizeof stderrdata);
 
 		client_write(STDERR_FILENO, stderrdata.data,
 		    stderrdata.size);
@@ -0,0 +1,387 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tmux.h"
+
+/*
+ * Time the grid and screen-write primitives on headless grids, for ASCII,
+ * wide CJK characters, RGB colours and a deep history. Each result is a line
+ * in the format of Go benchmarks, so it can be compared across commits with
+ * benchstat: the name, the operations, ns/op, the change in grid memory per
+ * operation as B/op and the allocations per operation. Like bench-input, this
+ * is not documented.
+ */
+
+#define BENCH_GRID_HISTORY 50000
+
+enum cmd_retval	 cmd_bench_grid_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_grid_entry = {
+	.name = "bench-grid",
+	.alias = NULL,
+
+	.args = { "n:x:y:", 0, 0 },
+	.usage = "[-n count] [-x width] [-y height]",
+
+	.flags = 0,
+	.exec = cmd_bench_grid_exec
+};
+
+struct bench_grid_workload {
+	const char	*name;
+	void		(*cell)(struct grid_cell *, u_int);
+	u_int		 history;
+};
+
+struct bench_grid {
+	const struct bench_grid_workload *wl;
+	u_int		 sx;
+	u_int		 sy;
+	u_int		 count;
+
+	struct timespec	 start;
+	size_t		 memory;
+	u_long		 allocs;
+
+	u_int		 ops;
+	double		 ns;
+	double		 bytes;
+	double		 nallocs;
+};
+
+struct bench_grid_op {
+	const char	*name;
+	void		(*run)(struct bench_grid *);
+};
+
+static void	bench_grid_ascii(struct grid_cell *, u_int);
+static void	bench_grid_cjk(struct grid_cell *, u_int);
+static void	bench_grid_rgb(struct grid_cell *, u_int);
+
+static const struct bench_grid_workload bench_grid_workloads[] = {
+	{ "ascii", bench_grid_ascii, 0 },
+	{ "cjk", bench_grid_cjk, 0 },
+	{ "rgb", bench_grid_rgb, 0 },
+	{ "history", bench_grid_ascii, BENCH_GRID_HISTORY },
+};
+
+static void	bench_grid_set_cell(struct bench_grid *);
+static void	bench_grid_get_cell(struct bench_grid *);
+static void	bench_grid_scroll_history(struct bench_grid *);
+static void	bench_grid_reflow(struct bench_grid *);
+static void	bench_grid_string_cells(struct bench_grid *);
+static void	bench_grid_string_cells_buffer(struct bench_grid *);
+static void	bench_grid_screen_write_cell(struct bench_grid *);
+
+static const struct bench_grid_op bench_grid_ops[] = {
+	{ "grid_set_cell", bench_grid_set_cell },
+	{ "grid_get_cell", bench_grid_get_cell },
+	{ "grid_scroll_history", bench_grid_scroll_history },
+	{ "grid_reflow", bench_grid_reflow },
+	{ "grid_string_cells", bench_grid_string_cells },
+	{ "grid_string_cells_buffer", bench_grid_string_cells_buffer },
+	{ "screen_write_cell", bench_grid_screen_write_cell },
+};
+
+static void
+bench_grid_ascii(struct grid_cell *gc, u_int i)
+{
+	memcpy(gc, &grid_default_cell, sizeof *gc);
+	utf8_set(&gc->data, 'a' + i % 26);
+}
+
+static void
+bench_grid_cjk(struct grid_cell *gc, u_int i)
+{
+	memcpy(gc, &grid_default_cell, sizeof *gc);
+	utf8_split(0x4e00 + i % 0x5000, &gc->data);
+	gc->data.width = 2;
+}
+
+static void
+bench_grid_rgb(struct grid_cell *gc, u_int i)
+{
+	bench_grid_ascii(gc, i);
+	gc->flags |= GRID_FLAG_FGRGB|GRID_FLAG_BGRGB;
+	gc->fg_rgb.r = i;
+	gc->fg_rgb.g = i >> 3;
+	gc->fg_rgb.b = i >> 6;
+	gc->bg_rgb.r = ~i;
+	gc->bg_rgb.g = 0x40;
+	gc->bg_rgb.b = i >> 2;
+}
+
+/* Fill a line as the workload would, wide characters followed by padding. */
+static void
+bench_grid_line(struct bench_grid *bg, struct grid *gd, u_int py, u_int seed)
+{
+	struct grid_cell	gc, pad;
+	u_int			px;
+
+	memcpy(&pad, &grid_default_cell, sizeof pad);
+	pad.flags |= GRID_FLAG_PADDING;
+
+	for (px = 0; px < bg->sx; px += gc.data.width) {
+		bg->wl->cell(&gc, seed + px);
+		if (px + gc.data.width > bg->sx)
+			break;
+		grid_set_cell(gd, px, py, &gc);
+		if (gc.data.width == 2)
+			grid_set_cell(gd, px + 1, py, &pad);
+	}
+}
+
+/* Create a grid with the workload's history and a full screen. */
+static struct grid *
+bench_grid_create(struct bench_grid *bg)
+{
+	struct grid	*gd;
+	u_int		 hlimit, py;
+
+	hlimit = bg->wl->history != 0 ? bg->wl->history : 2000;
+	gd = grid_create(bg->sx, bg->sy, hlimit);
+	for (py = 0; py < bg->wl->history; py++) {
+		bench_grid_line(bg, gd, gd->hsize, py);
+		grid_scroll_history(gd);
+	}
+	for (py = 0; py < bg->sy; py++)
+		bench_grid_line(bg, gd, gd->hsize + py, py);
+	return (gd);
+}
+
+static void
+bench_grid_start(struct bench_grid *bg)
+{
+	bg->memory = grid_total_memory;
+	bg->allocs = xmalloc_calls;
+	clock_gettime(CLOCK_MONOTONIC, &bg->start);
+}
+
+static void
+bench_grid_stop(struct bench_grid *bg, u_int ops)
+{
+	struct timespec	end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ops == 0)
+		ops = 1;
+	bg->ops = ops;
+	bg->ns = ((end.tv_sec - bg->start.tv_sec) * 1000000000.0 +
+	    (end.tv_nsec - bg->start.tv_nsec)) / ops;
+	bg->bytes = ((double)grid_total_memory - bg->memory) / ops;
+	bg->nallocs = (double)(xmalloc_calls - bg->allocs) / ops;
+}
+
+static void
+bench_grid_set_cell(struct bench_grid *bg)
+{
+	struct grid		*gd;
+	struct grid_cell	 gc;
+	u_int			 i, px, py;
+
+	gd = bench_grid_create(bg);
+	bench_grid_start(bg);
+	px = py = 0;
+	for (i = 0; i < bg->count; i++) {
+		bg->wl->cell(&gc, i);
+		if (px + gc.data.width > bg->sx) {
+			px = 0;
+			py = (py + 1) % bg->sy;
+		}
+		grid_set_cell(gd, px, gd->hsize + py, &gc);
+		px += gc.data.width;
+	}
+	bench_grid_stop(bg, bg->count);
+	grid_destroy(gd);
+}
+
+static void
+bench_grid_get_cell(struct bench_grid *bg)
+{
+	struct grid		*gd;
+	struct grid_cell	 gc;
+	u_int			 i, lines;
+
+	gd = bench_grid_create(bg);
+	lines = gd->hsize + bg->sy;
+	bench_grid_start(bg);
+	for (i = 0; i < bg->count; i++) {
+		grid_get_cell(gd, i % bg->sx, lines - 1 - (i / bg->sx) % lines,
+		    &gc);
+	}
+	bench_grid_stop(bg, bg->count);
+	grid_destroy(gd);
+}
+
+static void
+bench_grid_scroll_history(struct bench_grid *bg)
+{
+	struct grid	*gd;
+	u_int		 i, n;
+
+	gd = bench_grid_create(bg);
+	n = bg->count / bg->sx;
+	bench_grid_start(bg);
+	for (i = 0; i < n; i++) {
+		if (gd->hsize >= gd->hlimit)
+			grid_collect_history(gd);
+		bench_grid_line(bg, gd, gd->hsize + bg->sy - 1, i);
+		grid_scroll_history(gd);
+	}
+	bench_grid_stop(bg, n);
+	grid_destroy(gd);
+}
+
+/*
+ * Reflow to half the width and back, all of the history as well as what
+ * grid_reflow does straight away. An operation is one line reflowed.
+ */
+static void
+bench_grid_reflow(struct bench_grid *bg)
+{
+	struct grid	*gd, *dst;
+	u_int		 i, n, lines, sx;
+
+	gd = bench_grid_create(bg);
+	n = 0;
+	bench_grid_start(bg);
+	for (i = 0; n < bg->count; i++) {
+		sx = i % 2 == 0 ? bg->sx / 2 : bg->sx;
+		lines = gd->hsize + gd->sy;
+		gd->sx = sx;
+		dst = grid_create(sx, gd->sy, gd->hlimit);
+		grid_reflow(dst, gd, sx);
+		grid_reflow_history(dst);
+		gd = dst;
+		n += lines;
+	}
+	bench_grid_stop(bg, n);
+	grid_destroy(gd);
+}
+
+static void
+bench_grid_string_cells(struct bench_grid *bg)
+{
+	struct grid		*gd;
+	struct grid_cell	*lastgc;
+	char			*s;
+	u_int			 i, n, lines;
+
+	gd = bench_grid_create(bg);
+	lines = gd->hsize + bg->sy;
+	n = bg->count / bg->sx;
+	bench_grid_start(bg);
+	for (i = 0; i < n; i++) {
+		lastgc = NULL;
+		s = grid_string_cells(gd, 0, lines - 1 - i % lines, bg->sx,
+		    &lastgc, 1, 0, 0);
+		free(s);
+	}
+	bench_grid_stop(bg, n);
+	grid_destroy(gd);
+}
+
+static void
+bench_grid_string_cells_buffer(struct bench_grid *bg)
+{
+	struct grid		*gd;
+	struct grid_cell	 lastgc;
+	struct evbuffer		*evb;
+	u_int			 i, n, lines;
+
+	gd = bench_grid_create(bg);
+	lines = gd->hsize + bg->sy;
+	n = bg->count / bg->sx;
+	if ((evb = evbuffer_new()) == NULL)
+		fatalx("out of memory");
+	memcpy(&lastgc, &grid_default_cell, sizeof lastgc);
+	bench_grid_start(bg);
+	for (i = 0; i < n; i++) {
+		grid_string_cells_buffer(gd, 0, lines - 1 - i % lines, bg->sx,
+		    &lastgc, 1, 0, 0, evb);
+		evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+	}
+	bench_grid_stop(bg, n);
+	evbuffer_free(evb);
+	grid_destroy(gd);
+}
+
+static void
+bench_grid_screen_write_cell(struct bench_grid *bg)
+{
+	struct screen		 s;
+	struct screen_write_ctx	 ctx;
+	struct grid_cell	 gc;
+	u_int			 i, hlimit;
+
+	hlimit = bg->wl->history != 0 ? bg->wl->history : 2000;
+	screen_init(&s, bg->sx, bg->sy, hlimit);
+	screen_write_start(&ctx, NULL, &s);
+	for (i = 0; i < bg->wl->history * bg->sx; i++) {
+		bg->wl->cell(&gc, i);
+		screen_write_cell(&ctx, &gc);
+	}
+
+	bench_grid_start(bg);
+	for (i = 0; i < bg->count; i++) {
+		bg->wl->cell(&gc, i);
+		screen_write_cell(&ctx, &gc);
+	}
+	bench_grid_stop(bg, bg->count);
+
+	screen_write_stop(&ctx);
+	screen_free(&s);
+}
+
+enum cmd_retval
+cmd_bench_grid_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct bench_grid	 bg;
+	char			*cause;
+	u_int			 i, j;
+
+	memset(&bg, 0, sizeof bg);
+	bg.count = 1000000;
+	bg.sx = 80;
+	bg.sy = 24;
+
+	if (args_has(args, 'n')) {
+		bg.count = args_strtonum(args, 'n', 1, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "count %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'x')) {
+		bg.sx = args_strtonum(args, 'x', PANE_MINIMUM, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "width %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'y')) {
+		bg.sy = args_strtonum(args, 'y', PANE_MINIMUM, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "height %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	for (i = 0; i < nitems(bench_grid_ops); i++) {
+		for (j = 0; j < nitems(bench_grid_workloads); j++) {
+			bg.wl = &bench_grid_workloads[j];
+			bench_grid_ops[i].run(&bg);
+			cmdq_print(cmdq, "Benchmark%s/%s %u %.1f ns/op %.1f B/op "
+			    "%.3f allocs/op", bench_grid_ops[i].name,
+			    bg.wl->name, bg.ops, bg.ns, bg.bytes, bg.nallocs);
+		}
+	}
+	return (CMD_RETURN_NORMAL);
+}
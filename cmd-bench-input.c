@@ -0,0 +1,235 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tmate.h"
+#include "tmate-protocol.h"
+
+/*
+ * Replay recorded output through a headless pane and report the throughput of
+ * input_parse and the grid, and how much the tmate encoder would send for it.
+ * With -T, the pane is also drawn after each chunk to a tty for the given
+ * terminal and the bytes written counted. This is not documented, it exists to
+ * catch regressions in the hot path.
+ */
+
+#define BENCH_INPUT_CHUNK 4096
+
+enum cmd_retval	 cmd_bench_input_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_input_entry = {
+	.name = "bench-input",
+	.alias = NULL,
+
+	.args = { "n:T:x:y:", 1, -1 },
+	.usage = "[-n count] [-T terminal] [-x width] [-y height] file ...",
+
+	.flags = 0,
+	.exec = cmd_bench_input_exec
+};
+
+static int
+bench_count_write(void *data, const char *buf, size_t len)
+{
+	size_t	*count = data;
+
+	*count += len;
+	return (0);
+}
+
+/* Count the bytes TMATE_OUT_PTY_DATA would take for this chunk. */
+static void
+bench_pack_pty_data(msgpack_packer *pk, struct window_pane *wp,
+    const u_char *buf, size_t len)
+{
+	size_t	to_write;
+
+	while (len > 0) {
+		to_write = len < TMATE_MAX_PTY_SIZE ? len : TMATE_MAX_PTY_SIZE;
+
+		msgpack_pack_array(pk, 3);
+		msgpack_pack_int(pk, TMATE_OUT_PTY_DATA);
+		msgpack_pack_int(pk, wp->id);
+		msgpack_pack_str(pk, to_write);
+		msgpack_pack_str_body(pk, buf, to_write);
+
+		buf += to_write;
+		len -= to_write;
+	}
+}
+
+/* Draw the whole pane and return how many bytes it took. */
+static size_t
+bench_tty_draw(struct tty *tty, struct window_pane *wp)
+{
+	struct evbuffer	*out = tty->event->output;
+	size_t		 used;
+	u_int		 i;
+
+	for (i = 0; i < wp->sy; i++)
+		tty_draw_pane(tty, wp, i, 0, 0);
+	tty_flush(tty);
+	used = EVBUFFER_LENGTH(out);
+	evbuffer_drain(out, used);
+	return (used);
+}
+
+static int
+bench_load_file(const char *path, struct evbuffer *evb, char **cause)
+{
+	int	fd, n;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		return (-1);
+	}
+	while ((n = evbuffer_read(evb, fd, BENCH_INPUT_CHUNK)) > 0)
+		/* nothing */;
+	if (n == -1) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	return (0);
+}
+
+enum cmd_retval
+cmd_bench_input_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct window		*w;
+	struct window_pane	*wp;
+	struct evbuffer		*data;
+	struct tty		 tty;
+	msgpack_packer		 pk;
+	struct timeval		 start, end, diff;
+	const u_char		*buf;
+	char			*cause;
+	size_t			 len, off, n, total = 0, encoded = 0, drawn = 0;
+	u_long			 allocs;
+	u_int			 count, sx, sy, hlimit, i;
+	double			 secs, mb;
+
+	count = 1;
+	if (args_has(args, 'n')) {
+		count = args_strtonum(args, 'n', 1, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "count %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	sx = 80;
+	if (args_has(args, 'x')) {
+		sx = args_strtonum(args, 'x', PANE_MINIMUM, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "width %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	sy = 24;
+	if (args_has(args, 'y')) {
+		sy = args_strtonum(args, 'y', PANE_MINIMUM, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "height %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	if (args_has(args, 'T')) {
+		if (bench_tty_open(&tty, args_get(args, 'T'), sx, sy,
+		    &cause) != 0) {
+			cmdq_error(cmdq, "%s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	data = evbuffer_new();
+	if (data == NULL)
+		fatalx("out of memory");
+	for (i = 0; i < (u_int)args->argc; i++) {
+		if (bench_load_file(args->argv[i], data, &cause) != 0) {
+			cmdq_error(cmdq, "%s", cause);
+			free(cause);
+			evbuffer_free(data);
+			if (args_has(args, 'T'))
+				bench_tty_close(&tty);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	buf = EVBUFFER_DATA(data);
+	len = EVBUFFER_LENGTH(data);
+	if (len == 0) {
+		cmdq_error(cmdq, "no data");
+		evbuffer_free(data);
+		if (args_has(args, 'T'))
+			bench_tty_close(&tty);
+		return (CMD_RETURN_ERROR);
+	}
+
+	/*
+	 * The pane has no process and belongs to no session, so nothing is
+	 * drawn to clients or sent to the tmate server.
+	 */
+	hlimit = options_get_number(global_s_options, "history-limit");
+	w = window_create1(sx, sy);
+	wp = window_add_pane(w, hlimit);
+	w->active = wp;
+	wp->event = bufferevent_new(-1, NULL, NULL, NULL, NULL);
+	if (wp->event == NULL)
+		fatalx("out of memory");
+	/* As in window_pane_spawn, the input is filled from outside. */
+	evbuffer_unfreeze(wp->event->input, 0);
+
+	msgpack_packer_init(&pk, &encoded, bench_count_write);
+
+	allocs = xmalloc_calls;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		for (off = 0; off < len; off += n) {
+			n = len - off;
+			if (n > BENCH_INPUT_CHUNK)
+				n = BENCH_INPUT_CHUNK;
+			if (evbuffer_add(wp->event->input, buf + off, n) != 0)
+				fatalx("out of memory");
+			input_parse(wp);
+			bench_pack_pty_data(&pk, wp, buf + off, n);
+			if (args_has(args, 'T'))
+				drawn += bench_tty_draw(&tty, wp);
+		}
+		total += len;
+	}
+	gettimeofday(&end, NULL);
+	allocs = xmalloc_calls - allocs;
+
+	bufferevent_free(wp->event);
+	wp->event = NULL;
+	window_destroy(w);
+	evbuffer_free(data);
+	if (args_has(args, 'T'))
+		bench_tty_close(&tty);
+
+	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	mb = total / (1024.0 * 1024.0);
+	cmdq_print(cmdq, "%zu bytes in %.3f seconds: %.2f MB/s", total, secs,
+	    secs > 0 ? mb / secs : 0);
+	cmdq_print(cmdq, "%lu allocations: %.1f per MB", allocs,
+	    mb > 0 ? allocs / mb : 0);
+	cmdq_print(cmdq, "%zu encoder bytes: %.3f per input byte", encoded,
+	    (double)encoded / total);
+	if (args_has(args, 'T')) {
+		cmdq_print(cmdq, "%zu tty bytes: %.3f per input byte", drawn,
+		    (double)drawn / total);
+	}
+
+	return (CMD_RETURN_NORMAL);
+}
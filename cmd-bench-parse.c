@@ -0,0 +1,126 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Parse the lines of configuration files the way they are loaded, without
+ * running them, and report how long it took. Like bench-input, this is not
+ * documented and exists to catch regressions in command parsing.
+ */
+
+enum cmd_retval	 cmd_bench_parse_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_parse_entry = {
+	.name = "bench-parse",
+	.alias = NULL,
+
+	.args = { "n:", 1, -1 },
+	.usage = "[-n count] file ...",
+
+	.flags = 0,
+	.exec = cmd_bench_parse_exec
+};
+
+static int
+bench_parse_load(const char *path, char ***lines, u_int *nlines, char **cause)
+{
+	FILE	*f;
+	char	 delim[3] = { '\\', '\\', '\0' };
+	char	*buf, *p;
+	size_t	 line = 0;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		return (-1);
+	}
+	while ((buf = fparseln(f, NULL, &line, delim, 0)) != NULL) {
+		p = buf;
+		while (isspace((u_char)*p))
+			p++;
+		if (*p == '\0') {
+			free(buf);
+			continue;
+		}
+		*lines = xreallocarray(*lines, *nlines + 1, sizeof **lines);
+		(*lines)[(*nlines)++] = buf;
+	}
+	fclose(f);
+	return (0);
+}
+
+enum cmd_retval
+cmd_bench_parse_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args	*args = self->args;
+	struct cmd_list	*cmdlist;
+	struct timeval	 start, end, diff;
+	char		**lines = NULL, *cause;
+	u_int		 nlines = 0, count, errors = 0, i, j;
+	enum cmd_retval	 retval = CMD_RETURN_ERROR;
+	u_long		 allocs, total;
+	double		 secs;
+
+	count = 1;
+	if (args_has(args, 'n')) {
+		count = args_strtonum(args, 'n', 1, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "count %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	for (i = 0; i < (u_int)args->argc; i++) {
+		if (bench_parse_load(args->argv[i], &lines, &nlines,
+		    &cause) != 0) {
+			cmdq_error(cmdq, "%s", cause);
+			free(cause);
+			goto out;
+		}
+	}
+	if (nlines == 0) {
+		cmdq_error(cmdq, "no commands");
+		goto out;
+	}
+
+	allocs = xmalloc_calls;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < nlines; j++) {
+			if (cmd_string_parse(lines[j], &cmdlist, "bench", j + 1,
+			    &cause) != 0) {
+				free(cause);
+				errors++;
+				continue;
+			}
+			if (cmdlist != NULL)
+				cmd_list_free(cmdlist);
+		}
+	}
+	gettimeofday(&end, NULL);
+	allocs = xmalloc_calls - allocs;
+
+	total = (u_long)count * nlines;
+	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	cmdq_print(cmdq, "%lu lines in %.3f seconds: %.0f per second", total,
+	    secs, secs > 0 ? total / secs : 0);
+	cmdq_print(cmdq, "%lu allocations: %.1f per line", allocs,
+	    (double)allocs / total);
+	if (errors != 0)
+		cmdq_print(cmdq, "%u lines failed to parse", errors / count);
+	retval = CMD_RETURN_NORMAL;
+
+out:
+	for (i = 0; i < nlines; i++)
+		free(lines[i]);
+	free(lines);
+	return (retval);
+}
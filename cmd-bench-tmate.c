@@ -0,0 +1,594 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tmate.h"
+#include "tmate-protocol.h"
+
+/*
+ * Run the tmate protocol against a sink in the server itself, over a
+ * socketpair rather than libssh. The full state is sent as on a reconnection
+ * and timed until the end of its snapshot; then keys are sent to the target
+ * pane with TMATE_IN_PANE_KEY, each timed until the pane's output comes back;
+ * then, after typing the command given if any, the stream is measured for -d
+ * seconds in frames, messages and bytes per byte of pty data.
+ *
+ * This needs a session not connected to a server, and leaves the encoder with
+ * a fresh full state for when it connects. Like bench-trace, this is not
+ * documented.
+ */
+
+#define BENCH_TMATE_KEY_DELAY 20	/* ms between keys */
+#define BENCH_TMATE_KEY_TIMEOUT 1000	/* ms before giving up on an echo */
+
+enum cmd_retval	 cmd_bench_tmate_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_tmate_entry = {
+	.name = "bench-tmate",
+	.alias = NULL,
+
+	.args = { "d:k:t:", 0, 1 },
+	.usage = "[-d seconds] [-k keys] " CMD_TARGET_PANE_USAGE " [command]",
+
+	.tflag = CMD_PANE,
+
+	.flags = 0,
+	.exec = cmd_bench_tmate_exec
+};
+
+enum bench_tmate_state {
+	BENCH_TMATE_RECONNECT,
+	BENCH_TMATE_KEYS,
+	BENCH_TMATE_LOAD,
+	BENCH_TMATE_DONE,
+};
+
+struct bench_tmate {
+	struct cmd_q		*cmdq;
+	enum bench_tmate_state	 state;
+	int			 pane_id;
+	char			*command;
+	u_int			 seconds;
+
+	/* fds[0] is the end tmate uses, fds[1] the sink's. */
+	int			 fds[2];
+	struct event		 ev_read;
+	struct event		 ev_write;
+	struct event		 ev_sink;
+	struct event		 timer;
+
+	struct tmate_decoder	 decoder;
+	struct evbuffer		*header;
+	int			 header_done;
+#ifdef HAVE_ZLIB
+	z_stream		*zstream;
+#endif
+
+	struct timeval		 reconnect_start;
+	struct timeval		 snapshot_start;
+	double			 reconnect_ms;
+	double			 snapshot_ms;
+	size_t			 reconnect_bytes;
+
+	u_int			 keys;
+	u_int			 keys_sent;
+	u_int			 keys_echoed;
+	int			 key_waiting;
+	struct timeval		 key_time;
+	double			 latency_total;
+	double			 latency_min;
+	double			 latency_max;
+
+	struct timeval		 load_start;
+	u_int			 frames;
+	u_int			 messages;
+	uint64_t		 bytes;
+	uint64_t		 pty_bytes;
+};
+
+static struct bench_tmate *bench_tmate;
+
+static double
+bench_tmate_ms(struct timeval *since)
+{
+	struct timeval	now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, since, &diff);
+	return (diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0);
+}
+
+static void
+bench_tmate_schedule(struct bench_tmate *bt, u_int ms)
+{
+	struct timeval	tv = { .tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000 };
+
+	evtimer_del(&bt->timer);
+	evtimer_add(&bt->timer, &tv);
+}
+
+/* Write what the encoder has to the socketpair, as the ssh client would. */
+static void
+bench_tmate_write(void *userdata, struct evbuffer *buffer)
+{
+	struct bench_tmate	*bt = userdata;
+	int			 n;
+
+	if (EVBUFFER_LENGTH(buffer) != 0)
+		bt->frames++;
+	while (EVBUFFER_LENGTH(buffer) != 0) {
+		n = evbuffer_write(buffer, bt->fds[0]);
+		if (n <= 0) {
+			if (n == -1 && errno == EAGAIN)
+				event_add(&bt->ev_write, NULL);
+			return;
+		}
+		tmate_encoder_drained(&tmate_session.encoder, n);
+	}
+}
+
+static void
+bench_tmate_writable(__unused int fd, __unused short events, void *data)
+{
+	struct bench_tmate	*bt = data;
+
+	bench_tmate_write(bt, tmate_session.encoder.buffer);
+}
+
+static void
+bench_tmate_dispatch(__unused void *userdata, struct tmate_unpacker *uk)
+{
+	tmate_dispatch_slave_message(&tmate_session, uk);
+}
+
+/* What the sink sent, read by tmate as if it came from the server. */
+static void
+bench_tmate_readable(int fd, __unused short events, void *data)
+{
+	struct bench_tmate	*bt = data;
+	char			*buf;
+	size_t			 len;
+	ssize_t			 n;
+
+	tmate_decoder_get_buffer(&tmate_session.decoder, &buf, &len);
+	n = read(fd, buf, len);
+	if (n <= 0) {
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		bt->state = BENCH_TMATE_DONE;
+		bench_tmate_schedule(bt, 0);
+		return;
+	}
+	tmate_decoder_commit(&tmate_session.decoder, n);
+}
+
+/* Send a message from the sink. */
+static int
+bench_tmate_pack_write(void *data, const char *buf, size_t len)
+{
+	struct bench_tmate	*bt = data;
+
+	if (write(bt->fds[1], buf, len) != (ssize_t)len)
+		return (-1);
+	return (0);
+}
+
+static void
+bench_tmate_send_key(struct bench_tmate *bt)
+{
+	msgpack_packer	pk;
+	key_code	key;
+
+	key = bt->keys_sent % 2 == 0 ? 'x' : KEYC_BSPACE;
+	bt->keys_sent++;
+
+	msgpack_packer_init(&pk, bt, bench_tmate_pack_write);
+	msgpack_pack_array(&pk, 3);
+	msgpack_pack_int(&pk, TMATE_IN_PANE_KEY);
+	msgpack_pack_int(&pk, bt->pane_id);
+	msgpack_pack_uint64(&pk, key);
+
+	bt->key_waiting = 1;
+	gettimeofday(&bt->key_time, NULL);
+	bench_tmate_schedule(bt, BENCH_TMATE_KEY_TIMEOUT);
+}
+
+static void
+bench_tmate_send_command(struct bench_tmate *bt)
+{
+	msgpack_packer	 pk;
+	char		*keys;
+	size_t		 len;
+
+	xasprintf(&keys, "%s\r", bt->command);
+	len = strlen(keys);
+
+	msgpack_packer_init(&pk, bt, bench_tmate_pack_write);
+	msgpack_pack_array(&pk, 3);
+	msgpack_pack_int(&pk, TMATE_IN_PANE_KEYS);
+	msgpack_pack_int(&pk, bt->pane_id);
+	msgpack_pack_str(&pk, len);
+	msgpack_pack_str_body(&pk, keys, len);
+	free(keys);
+}
+
+/*
+ * Integers are read in place: unpack_int gives up on the session when the
+ * message is not as expected, which is for messages from the server.
+ */
+static int64_t
+bench_tmate_int(struct tmate_unpacker *uk, int i)
+{
+	if (i >= uk->argc ||
+	    (uk->argv[i].type != MSGPACK_OBJECT_POSITIVE_INTEGER &&
+	    uk->argv[i].type != MSGPACK_OBJECT_NEGATIVE_INTEGER))
+		return (-1);
+	return (uk->argv[i].via.i64);
+}
+
+/* A message reached the sink. */
+static void
+bench_tmate_sink_message(void *userdata, struct tmate_unpacker *uk)
+{
+	struct bench_tmate	*bt = userdata;
+	double			 ms;
+
+	if (uk->argc < 1 || bt->state == BENCH_TMATE_DONE)
+		return;
+	bt->messages++;
+
+	switch (bench_tmate_int(uk, 0)) {
+	case TMATE_OUT_PTY_DATA:
+		if (uk->argc < 3)
+			return;
+		if (uk->argv[2].type == MSGPACK_OBJECT_STR)
+			bt->pty_bytes += uk->argv[2].via.str.size;
+		else if (uk->argv[2].type == MSGPACK_OBJECT_BIN)
+			bt->pty_bytes += uk->argv[2].via.bin.size;
+		/* FALLTHROUGH */
+	case TMATE_OUT_PANE_DIFF:
+		if (bt->state != BENCH_TMATE_KEYS || !bt->key_waiting ||
+		    bench_tmate_int(uk, 1) != bt->pane_id)
+			return;
+		ms = bench_tmate_ms(&bt->key_time);
+		bt->key_waiting = 0;
+		bt->keys_echoed++;
+		bt->latency_total += ms;
+		if (bt->keys_echoed == 1 || ms < bt->latency_min)
+			bt->latency_min = ms;
+		if (ms > bt->latency_max)
+			bt->latency_max = ms;
+		bench_tmate_schedule(bt, BENCH_TMATE_KEY_DELAY);
+		break;
+	case TMATE_OUT_SNAPSHOT_BEGIN:
+		gettimeofday(&bt->snapshot_start, NULL);
+		break;
+	case TMATE_OUT_SNAPSHOT:
+		/* Before protocol 9, the whole snapshot in one message. */
+		gettimeofday(&bt->snapshot_start, NULL);
+		/* FALLTHROUGH */
+	case TMATE_OUT_SNAPSHOT_END:
+		if (bt->state != BENCH_TMATE_RECONNECT)
+			return;
+		bt->snapshot_ms = bench_tmate_ms(&bt->snapshot_start);
+		bt->reconnect_ms = bench_tmate_ms(&bt->reconnect_start);
+		bt->reconnect_bytes = bt->bytes;
+		bt->state = BENCH_TMATE_KEYS;
+		bench_tmate_schedule(bt, 0);
+		break;
+	}
+}
+
+static int
+bench_tmate_sink_decode(struct bench_tmate *bt, const char *buf, size_t len)
+{
+	char	*dbuf;
+	size_t	 dlen;
+
+#ifdef HAVE_ZLIB
+	if (bt->zstream != NULL) {
+		bt->zstream->next_in = (Bytef *)buf;
+		bt->zstream->avail_in = len;
+		do {
+			tmate_decoder_get_buffer(&bt->decoder, &dbuf, &dlen);
+			bt->zstream->next_out = (Bytef *)dbuf;
+			bt->zstream->avail_out = dlen;
+			switch (inflate(bt->zstream, Z_SYNC_FLUSH)) {
+			case Z_OK:
+			case Z_BUF_ERROR:
+				break;
+			default:
+				return (-1);
+			}
+			tmate_decoder_commit(&bt->decoder,
+			    dlen - bt->zstream->avail_out);
+		} while (bt->zstream->avail_in != 0 ||
+		    bt->zstream->avail_out == 0);
+		return (0);
+	}
+#endif
+
+	while (len > 0) {
+		tmate_decoder_get_buffer(&bt->decoder, &dbuf, &dlen);
+		if (dlen > len)
+			dlen = len;
+		memcpy(dbuf, buf, dlen);
+		tmate_decoder_commit(&bt->decoder, dlen);
+		buf += dlen;
+		len -= dlen;
+	}
+	return (0);
+}
+
+/*
+ * The header is never compressed and says whether what follows is, so it is
+ * unpacked on its own first.
+ */
+static int
+bench_tmate_sink_header(struct bench_tmate *bt, const char *buf, size_t len)
+{
+	msgpack_unpacked	 result;
+	msgpack_object		*o;
+	const char		*data;
+	size_t			 off = 0;
+	int			 compressed = 0;
+
+	evbuffer_add(bt->header, buf, len);
+	data = EVBUFFER_DATA(bt->header);
+	len = EVBUFFER_LENGTH(bt->header);
+
+	msgpack_unpacked_init(&result);
+	switch (msgpack_unpack_next(&result, data, len, &off)) {
+	case MSGPACK_UNPACK_CONTINUE:
+		msgpack_unpacked_destroy(&result);
+		return (0);
+	case MSGPACK_UNPACK_SUCCESS:
+	case MSGPACK_UNPACK_EXTRA_BYTES:
+		break;
+	default:
+		msgpack_unpacked_destroy(&result);
+		return (-1);
+	}
+	/* Before protocol 10, the header has no compression. */
+	o = result.data.via.array.ptr;
+	if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+	    result.data.via.array.size < 3 ||
+	    result.data.via.array.size > 4 ||
+	    o[0].via.i64 != TMATE_OUT_HEADER ||
+	    (result.data.via.array.size == 4 &&
+	    o[3].type != MSGPACK_OBJECT_STR)) {
+		msgpack_unpacked_destroy(&result);
+		return (-1);
+	}
+	compressed = result.data.via.array.size == 4 &&
+	    o[3].via.str.size != 0;
+	msgpack_unpacked_destroy(&result);
+
+	if (compressed) {
+#ifdef HAVE_ZLIB
+		bt->zstream = xcalloc(1, sizeof *bt->zstream);
+		if (inflateInit(bt->zstream) != Z_OK)
+			return (-1);
+#else
+		return (-1);
+#endif
+	}
+	bt->header_done = 1;
+	bt->messages++;
+	return (bench_tmate_sink_decode(bt, data + off, len - off));
+}
+
+static void
+bench_tmate_sink_readable(int fd, __unused short events, void *data)
+{
+	struct bench_tmate	*bt = data;
+	char			 buf[65536];
+	ssize_t			 n;
+	int			 error;
+
+	n = read(fd, buf, sizeof buf);
+	if (n <= 0) {
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		error = -1;
+	} else {
+		bt->bytes += n;
+		if (!bt->header_done)
+			error = bench_tmate_sink_header(bt, buf, n);
+		else
+			error = bench_tmate_sink_decode(bt, buf, n);
+	}
+	if (error != 0) {
+		cmdq_error(bt->cmdq, "cannot decode the stream");
+		bt->state = BENCH_TMATE_DONE;
+		bench_tmate_schedule(bt, 0);
+	}
+}
+
+static void
+bench_tmate_report(struct bench_tmate *bt)
+{
+	struct cmd_q	*cmdq = bt->cmdq;
+	double		 secs;
+
+	cmdq_print(cmdq, "reconnect: %.1f ms, snapshot %.1f ms, %zu bytes",
+	    bt->reconnect_ms, bt->snapshot_ms, bt->reconnect_bytes);
+	if (bt->keys_echoed != 0) {
+		cmdq_print(cmdq, "keys: %u of %u echoed, %.2f ms average, "
+		    "%.2f min, %.2f max", bt->keys_echoed, bt->keys_sent,
+		    bt->latency_total / bt->keys_echoed, bt->latency_min,
+		    bt->latency_max);
+	} else
+		cmdq_print(cmdq, "keys: none of %u echoed", bt->keys_sent);
+
+	secs = bench_tmate_ms(&bt->load_start) / 1000.0;
+	if (secs <= 0)
+		return;
+	cmdq_print(cmdq, "load: %u frames in %.1f seconds, %.0f per second",
+	    bt->frames, secs, bt->frames / secs);
+	cmdq_print(cmdq, "%u messages, %llu bytes for %llu pty bytes: %.3f "
+	    "per pty byte", bt->messages, (unsigned long long)bt->bytes,
+	    (unsigned long long)bt->pty_bytes,
+	    bt->pty_bytes ? (double)bt->bytes / bt->pty_bytes : 0);
+}
+
+static void
+bench_tmate_free(struct bench_tmate *bt)
+{
+	struct cmd_q	*cmdq = bt->cmdq;
+
+	if (tmate_session.encoder.userdata == bt)
+		tmate_encoder_set_ready_callback(&tmate_session.encoder, NULL,
+		    NULL);
+	tmate_decoder_destroy(&tmate_session.decoder);
+	tmate_decoder_destroy(&bt->decoder);
+
+	event_del(&bt->ev_read);
+	event_del(&bt->ev_write);
+	event_del(&bt->ev_sink);
+	evtimer_del(&bt->timer);
+	close(bt->fds[0]);
+	close(bt->fds[1]);
+
+#ifdef HAVE_ZLIB
+	if (bt->zstream != NULL) {
+		inflateEnd(bt->zstream);
+		free(bt->zstream);
+	}
+#endif
+	evbuffer_free(bt->header);
+	free(bt->command);
+	free(bt);
+	bench_tmate = NULL;
+
+	/* What the sink had is gone, the server needs the whole state. */
+	tmate_send_reconnection_state(&tmate_session);
+	tmate_trace_pause(false);
+
+	if (!cmdq_free(cmdq))
+		cmdq_continue(cmdq);
+}
+
+static void
+bench_tmate_timer(__unused int fd, __unused short events, void *data)
+{
+	struct bench_tmate	*bt = data;
+
+	switch (bt->state) {
+	case BENCH_TMATE_RECONNECT:
+		cmdq_error(bt->cmdq, "no snapshot");
+		bt->state = BENCH_TMATE_DONE;
+		break;
+	case BENCH_TMATE_KEYS:
+		bt->key_waiting = 0;
+		if (bt->keys_sent < bt->keys) {
+			bench_tmate_send_key(bt);
+			return;
+		}
+		bt->state = BENCH_TMATE_LOAD;
+		bt->frames = bt->messages = 0;
+		bt->bytes = bt->pty_bytes = 0;
+		gettimeofday(&bt->load_start, NULL);
+		if (bt->command != NULL)
+			bench_tmate_send_command(bt);
+		bench_tmate_schedule(bt, bt->seconds * 1000);
+		return;
+	case BENCH_TMATE_LOAD:
+		bt->state = BENCH_TMATE_DONE;
+		break;
+	case BENCH_TMATE_DONE:
+		break;
+	}
+
+	if (!(bt->cmdq->flags & CMD_Q_DEAD))
+		bench_tmate_report(bt);
+	bench_tmate_free(bt);
+}
+
+enum cmd_retval
+cmd_bench_tmate_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct window_pane	*wp = cmdq->state.tflag.wp;
+	struct bench_tmate	*bt;
+	char			*cause;
+	long long		 seconds = 5, keys = 20;
+
+	if (bench_tmate != NULL) {
+		cmdq_error(cmdq, "already running");
+		return (CMD_RETURN_ERROR);
+	}
+	if (tmate_session.encoder.ready_callback != NULL ||
+	    !TAILQ_EMPTY(&tmate_session.clients)) {
+		cmdq_error(cmdq, "connected to a tmate server");
+		return (CMD_RETURN_ERROR);
+	}
+
+	if (args_has(args, 'd')) {
+		seconds = args_strtonum(args, 'd', 0, 3600, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "seconds %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'k')) {
+		keys = args_strtonum(args, 'k', 0, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "keys %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	bt = xcalloc(1, sizeof *bt);
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, bt->fds) != 0) {
+		cmdq_error(cmdq, "socketpair: %s", strerror(errno));
+		free(bt);
+		return (CMD_RETURN_ERROR);
+	}
+	setblocking(bt->fds[0], 0);
+	setblocking(bt->fds[1], 0);
+
+	bt->cmdq = cmdq;
+	bt->pane_id = wp->id;
+	bt->seconds = seconds;
+	bt->keys = keys + keys % 2;	/* each x is rubbed out again */
+	if (args->argc != 0)
+		bt->command = xstrdup(args->argv[0]);
+	if ((bt->header = evbuffer_new()) == NULL)
+		fatalx("out of memory");
+	tmate_decoder_init(&bt->decoder, bench_tmate_sink_message, bt);
+
+	event_set(&bt->ev_read, bt->fds[0], EV_READ|EV_PERSIST,
+	    bench_tmate_readable, bt);
+	event_add(&bt->ev_read, NULL);
+	event_set(&bt->ev_write, bt->fds[0], EV_WRITE, bench_tmate_writable,
+	    bt);
+	event_set(&bt->ev_sink, bt->fds[1], EV_READ|EV_PERSIST,
+	    bench_tmate_sink_readable, bt);
+	event_add(&bt->ev_sink, NULL);
+	evtimer_set(&bt->timer, bench_tmate_timer, bt);
+	bench_tmate = bt;
+
+	/* The sink decodes the stream, it must not go in the trace as input. */
+	tmate_trace_pause(true);
+
+	tmate_decoder_init(&tmate_session.decoder, bench_tmate_dispatch, bt);
+	gettimeofday(&bt->reconnect_start, NULL);
+	tmate_send_reconnection_state(&tmate_session);
+	tmate_encoder_set_ready_callback(&tmate_session.encoder,
+	    bench_tmate_write, bt);
+	bench_tmate_schedule(bt, 10000);
+
+	cmdq->references++;
+	return (CMD_RETURN_WAIT);
+}
@@ -0,0 +1,152 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <string.h>
+
+#include "tmate.h"
+
+/*
+ * Read back a trace recorded with tmate-trace-file: decode both directions
+ * and report what is in it and how long decoding and packing the messages
+ * again took. With -d, the messages from the server are also dispatched to
+ * this session, as if they had just arrived. Like bench-input, this is not
+ * documented.
+ */
+
+enum cmd_retval	 cmd_bench_trace_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_trace_entry = {
+	.name = "bench-trace",
+	.alias = NULL,
+
+	.args = { "d", 1, 1 },
+	.usage = "[-d] file",
+
+	.flags = 0,
+	.exec = cmd_bench_trace_exec
+};
+
+struct bench_trace {
+	int			 dispatch;
+
+	struct tmate_decoder	 in;
+	struct tmate_decoder	 out;
+	msgpack_packer		 pk;
+	size_t			 packed;
+
+	u_int			 records[2];
+	size_t			 bytes[2];
+	u_int			 messages[2];
+	uint64_t		 first, last;
+};
+
+static int
+bench_trace_count_write(void *data, __unused const char *buf, size_t len)
+{
+	size_t	*count = data;
+
+	*count += len;
+	return (0);
+}
+
+static void
+bench_trace_in(void *arg, struct tmate_unpacker *uk)
+{
+	struct bench_trace	*bt = arg;
+
+	bt->messages[TMATE_TRACE_IN]++;
+	if (bt->dispatch)
+		tmate_dispatch_slave_message(&tmate_session, uk);
+}
+
+static void
+bench_trace_out(void *arg, struct tmate_unpacker *uk)
+{
+	struct bench_trace	*bt = arg;
+	msgpack_object		 obj;
+
+	bt->messages[TMATE_TRACE_OUT]++;
+
+	/* Pack it again, as the encoder would. */
+	obj.type = MSGPACK_OBJECT_ARRAY;
+	obj.via.array.size = uk->argc;
+	obj.via.array.ptr = uk->argv;
+	msgpack_pack_object(&bt->pk, obj);
+}
+
+static void
+bench_trace_record(void *arg, int dir, uint64_t ns, const char *buf,
+    size_t len)
+{
+	struct bench_trace	*bt = arg;
+	struct tmate_decoder	*decoder;
+	char			*dbuf;
+	size_t			 dlen;
+
+	if (dir != TMATE_TRACE_IN && dir != TMATE_TRACE_OUT)
+		return;
+
+	if (bt->first == 0)
+		bt->first = ns;
+	bt->last = ns;
+	bt->records[dir]++;
+	bt->bytes[dir] += len;
+
+	decoder = dir == TMATE_TRACE_IN ? &bt->in : &bt->out;
+	while (len > 0) {
+		tmate_decoder_get_buffer(decoder, &dbuf, &dlen);
+		if (dlen > len)
+			dlen = len;
+		memcpy(dbuf, buf, dlen);
+		tmate_decoder_commit(decoder, dlen);
+		buf += dlen;
+		len -= dlen;
+	}
+}
+
+enum cmd_retval
+cmd_bench_trace_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct bench_trace	 bt;
+	struct timeval		 start, end, diff;
+	char			*cause;
+	double			 secs;
+	int			 error;
+
+	memset(&bt, 0, sizeof bt);
+	bt.dispatch = args_has(args, 'd');
+	tmate_decoder_init(&bt.in, bench_trace_in, &bt);
+	tmate_decoder_init(&bt.out, bench_trace_out, &bt);
+	msgpack_packer_init(&bt.pk, &bt.packed, bench_trace_count_write);
+
+	/* Do not record the replay into the trace. */
+	tmate_trace_pause(true);
+	gettimeofday(&start, NULL);
+	error = tmate_trace_read(args->argv[0], bench_trace_record, &bt,
+	    &cause);
+	gettimeofday(&end, NULL);
+	tmate_trace_pause(false);
+
+	tmate_decoder_destroy(&bt.in);
+	tmate_decoder_destroy(&bt.out);
+
+	if (error != 0) {
+		cmdq_error(cmdq, "%s", cause);
+		free(cause);
+		return (CMD_RETURN_ERROR);
+	}
+
+	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	cmdq_print(cmdq, "%.3f seconds recorded, replayed in %.3f seconds",
+	    (bt.last - bt.first) / 1000000000.0, secs);
+	cmdq_print(cmdq, "in: %u records, %zu bytes, %u messages%s",
+	    bt.records[TMATE_TRACE_IN], bt.bytes[TMATE_TRACE_IN],
+	    bt.messages[TMATE_TRACE_IN], bt.dispatch ? " dispatched" : "");
+	cmdq_print(cmdq, "out: %u records, %zu bytes, %u messages, %zu packed",
+	    bt.records[TMATE_TRACE_OUT], bt.bytes[TMATE_TRACE_OUT],
+	    bt.messages[TMATE_TRACE_OUT], bt.packed);
+
+	return (CMD_RETURN_NORMAL);
+}
@@ -0,0 +1,359 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tmux.h"
+
+/*
+ * Measure what is written to a terminal for common updates: a full redraw,
+ * scrolling, colourful output, switching panes and attaching. A client with a
+ * tty for the given terminal (without an fd, the output stays in its buffer)
+ * is attached to a window of two headless panes side by side, each frame is
+ * drawn through the usual paths and its output counted. Each result is a line
+ * in the format of Go benchmarks, like bench-grid: the name, the frames,
+ * ns/op, the bytes written as B/op and the escape sequences as esc/op.
+ *
+ * The status line is off, it changes with the time. Like bench-input, this is
+ * not documented.
+ */
+
+enum cmd_retval	 cmd_bench_tty_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_bench_tty_entry = {
+	.name = "bench-tty",
+	.alias = NULL,
+
+	.args = { "n:T:x:y:", 0, 0 },
+	.usage = "[-n count] [-T terminal] [-x width] [-y height]",
+
+	.flags = 0,
+	.exec = cmd_bench_tty_exec
+};
+
+struct bench_tty {
+	struct client		*c;
+	struct session		*s;
+	struct window		*w;
+	struct window_pane	*wp[2];
+	u_int			 count;
+
+	struct timespec		 start;
+	uint64_t		 bytes;
+	uint64_t		 escapes;
+
+	u_int			 ops;
+	double			 ns;
+};
+
+struct bench_tty_workload {
+	const char	*name;
+	void		(*frame)(struct bench_tty *, u_int);
+};
+
+static void	bench_tty_redraw(struct bench_tty *, u_int);
+static void	bench_tty_scroll(struct bench_tty *, u_int);
+static void	bench_tty_colour(struct bench_tty *, u_int);
+static void	bench_tty_switch(struct bench_tty *, u_int);
+static void	bench_tty_attach(struct bench_tty *, u_int);
+
+static const struct bench_tty_workload bench_tty_workloads[] = {
+	{ "redraw", bench_tty_redraw },
+	{ "scroll", bench_tty_scroll },
+	{ "colour", bench_tty_colour },
+	{ "switch", bench_tty_switch },
+	{ "attach", bench_tty_attach },
+};
+
+/* Set up a tty with no client or fd which draws into its output buffer. */
+int
+bench_tty_open(struct tty *tty, const char *name, u_int sx, u_int sy,
+    char **cause)
+{
+	char	*copy;
+
+	memset(tty, 0, sizeof *tty);
+	copy = xstrdup(name);
+	tty->term = tty_term_find(copy, -1, cause);
+	free(copy);
+	if (tty->term == NULL)
+		return (-1);
+	tty->termname = xstrdup(name);
+	tty->fd = -1;
+	tty->sx = sx;
+	tty->sy = sy;
+	tty->ccolour = xstrdup("");
+	tty->mode = MODE_CURSOR;
+	memcpy(&tty->cell, &grid_default_cell, sizeof tty->cell);
+	tty->cx = tty->cy = UINT_MAX;
+	tty->rupper = tty->rlower = UINT_MAX;
+
+	tty->event = bufferevent_new(-1, NULL, NULL, NULL, NULL);
+	if (tty->event == NULL)
+		fatalx("out of memory");
+	return (0);
+}
+
+void
+bench_tty_close(struct tty *tty)
+{
+	bufferevent_free(tty->event);
+	tty_term_free(tty->term);
+	free(tty->ccolour);
+	free(tty->termname);
+}
+
+/* A cell of the colourful workload, 256 colours and RGB in turn. */
+static void
+bench_tty_cell(struct grid_cell *gc, u_int i)
+{
+	memcpy(gc, &grid_default_cell, sizeof *gc);
+	utf8_set(&gc->data, 'a' + i % 26);
+	if (i % 2 == 0) {
+		gc->flags |= GRID_FLAG_FG256|GRID_FLAG_BG256;
+		gc->fg = i % 256;
+		gc->bg = (i / 7) % 256;
+	} else {
+		gc->flags |= GRID_FLAG_FGRGB;
+		gc->fg_rgb.r = i;
+		gc->fg_rgb.g = i >> 3;
+		gc->fg_rgb.b = i >> 6;
+	}
+	if (i % 5 == 0)
+		gc->attr |= GRID_ATTR_BRIGHT;
+}
+
+/* Write a line to a pane and move to the next. */
+static void
+bench_tty_line(struct window_pane *wp, u_int seed, int colour)
+{
+	struct screen_write_ctx	ctx;
+	struct grid_cell	gc;
+	u_int			i, sx = screen_size_x(&wp->base);
+
+	screen_write_start(&ctx, wp, NULL);
+	for (i = 0; i < sx - 1; i++) {
+		if (colour)
+			bench_tty_cell(&gc, seed + i);
+		else {
+			memcpy(&gc, &grid_default_cell, sizeof gc);
+			utf8_set(&gc.data, (seed + i) % 7 == 0 ?
+			    ' ' : 'a' + (seed + i) % 26);
+		}
+		screen_write_cell(&ctx, &gc);
+	}
+	screen_write_carriagereturn(&ctx);
+	screen_write_linefeed(&ctx, 0);
+	screen_write_stop(&ctx);
+}
+
+static void
+bench_tty_redraw(struct bench_tty *bt, __unused u_int i)
+{
+	screen_redraw_screen(bt->c, 1, 0, 1);
+}
+
+static void
+bench_tty_scroll(struct bench_tty *bt, u_int i)
+{
+	bench_tty_line(bt->w->active, i, 0);
+}
+
+static void
+bench_tty_colour(struct bench_tty *bt, u_int i)
+{
+	bench_tty_line(bt->w->active, i, 1);
+}
+
+/* Select the other pane, which redraws the borders as the server would. */
+static void
+bench_tty_switch(struct bench_tty *bt, u_int i)
+{
+	window_set_active_pane(bt->w, bt->wp[i % 2]);
+	screen_redraw_screen(bt->c, 0, 0, 1);
+}
+
+/* Start the terminal again and draw everything, as for a client attaching. */
+static void
+bench_tty_attach(struct bench_tty *bt, __unused u_int i)
+{
+	tty_start_tty(&bt->c->tty);
+	screen_redraw_screen(bt->c, 1, 1, 1);
+}
+
+/* Count what a frame wrote and throw it away. */
+static void
+bench_tty_collect(struct bench_tty *bt)
+{
+	struct tty	*tty = &bt->c->tty;
+	struct evbuffer	*out = tty->event->output;
+	const u_char	*buf, *end;
+	size_t		 len;
+
+	tty_flush(tty);
+	len = EVBUFFER_LENGTH(out);
+	if (len == 0)
+		return;
+	buf = EVBUFFER_DATA(out);
+	end = buf + len;
+	while ((buf = memchr(buf, '\033', end - buf)) != NULL) {
+		bt->escapes++;
+		buf++;
+	}
+	bt->bytes += len;
+	evbuffer_drain(out, len);
+}
+
+static void
+bench_tty_run(struct bench_tty *bt, const struct bench_tty_workload *wl)
+{
+	struct timespec	end;
+	u_int		i;
+
+	/* Start from a drawn screen, which is what the updates apply to. */
+	window_set_active_pane(bt->w, bt->wp[0]);
+	tty_start_tty(&bt->c->tty);
+	screen_redraw_screen(bt->c, 1, 1, 1);
+	tty_flush(&bt->c->tty);
+	evbuffer_drain(bt->c->tty.event->output,
+	    EVBUFFER_LENGTH(bt->c->tty.event->output));
+
+	bt->bytes = bt->escapes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bt->start);
+	for (i = 0; i < bt->count; i++) {
+		wl->frame(bt, i);
+		bench_tty_collect(bt);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	bt->ops = bt->count;
+	bt->ns = ((end.tv_sec - bt->start.tv_sec) * 1000000000.0 +
+	    (end.tv_nsec - bt->start.tv_nsec)) / bt->ops;
+}
+
+/*
+ * The session and window belong to no list but the client's, so nothing else
+ * sees them. The client is only in the client list while the benchmark runs,
+ * without going back to the event loop.
+ */
+static void
+bench_tty_create(struct bench_tty *bt, u_int sx, u_int sy)
+{
+	struct window_pane	*wp;
+	struct layout_cell	*lc;
+	struct winlink		*wl;
+	u_int			 hlimit, i, j;
+
+	hlimit = options_get_number(global_s_options, "history-limit");
+	bt->w = window_create1(sx, sy);
+	bt->w->name = xstrdup("bench");
+	wp = bt->wp[0] = window_add_pane(bt->w, hlimit);
+	layout_init(bt->w, wp);
+	bt->w->active = wp;
+	lc = layout_split_pane(wp, LAYOUT_LEFTRIGHT, -1, 0);
+	bt->wp[1] = window_add_pane(bt->w, hlimit);
+	layout_assign_pane(lc, bt->wp[1]);
+
+	bt->s = xcalloc(1, sizeof *bt->s);
+	bt->s->name = xstrdup("bench");
+	bt->s->options = options_create(global_s_options);
+	options_set_number(bt->s->options, "status", 0);
+	RB_INIT(&bt->s->windows);
+	TAILQ_INIT(&bt->s->lastw);
+	bt->s->sx = sx;
+	bt->s->sy = sy;
+	wl = winlink_add(&bt->s->windows, 0);
+	winlink_set_window(wl, bt->w);
+	bt->s->curw = wl;
+
+	/* Fill the panes before there is a client to see it. */
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < sy; j++)
+			bench_tty_line(bt->wp[i], j * 3, j % 4 == 0);
+		bt->wp[i]->flags &= ~PANE_REDRAW;
+	}
+	bt->w->flags &= ~WINDOW_REDRAW;
+}
+
+static void
+bench_tty_free(struct bench_tty *bt)
+{
+	winlink_remove(&bt->s->windows, bt->s->curw);
+	options_free(bt->s->options);
+	free(bt->s->name);
+	free(bt->s);
+}
+
+enum cmd_retval
+cmd_bench_tty_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct bench_tty	 bt;
+	struct client		*c;
+	const char		*term = "xterm-256color";
+	char			*cause;
+	u_int			 i, sx = 160, sy = 48;
+
+	memset(&bt, 0, sizeof bt);
+	bt.count = 1000;
+
+	if (args_has(args, 'n')) {
+		bt.count = args_strtonum(args, 'n', 1, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "count %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'x')) {
+		sx = args_strtonum(args, 'x', PANE_MINIMUM * 2 + 1, 10000,
+		    &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "width %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'y')) {
+		sy = args_strtonum(args, 'y', PANE_MINIMUM, 10000, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "height %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 'T'))
+		term = args_get(args, 'T');
+
+	c = xcalloc(1, sizeof *c);
+	if (bench_tty_open(&c->tty, term, sx, sy, &cause) != 0) {
+		cmdq_error(cmdq, "%s", cause);
+		free(cause);
+		free(c);
+		return (CMD_RETURN_ERROR);
+	}
+	c->tty.client = c;
+	bt.c = c;
+	bench_tty_create(&bt, sx, sy);
+	c->session = bt.s;
+
+	TAILQ_INSERT_TAIL(&clients, c, entry);
+	server_client_check_headless();
+
+	for (i = 0; i < nitems(bench_tty_workloads); i++) {
+		bench_tty_run(&bt, &bench_tty_workloads[i]);
+		cmdq_print(cmdq, "BenchmarkTty/%s %u %.1f ns/op %.1f B/op "
+		    "%.1f esc/op", bench_tty_workloads[i].name, bt.ops, bt.ns,
+		    (double)bt.bytes / bt.ops, (double)bt.escapes / bt.ops);
+	}
+
+	TAILQ_REMOVE(&clients, c, entry);
+	server_client_check_headless();
+
+	bench_tty_free(&bt);
+	bench_tty_close(&c->tty);
+	free(c->border_cells);
+	free(c);
+	return (CMD_RETURN_NORMAL);
+}
@@ -155,5 +155,6 @@ cmd_bind_key_mode_table(struct cmd *self, struct cmd_q *cmdq, key_code key)
 	}
 	mbind->cmd = cmd;
 	mbind->arg = arg != NULL ? xstrdup(arg) : NULL;
+	mode_key_changed();
 	return (CMD_RETURN_NORMAL);
 }
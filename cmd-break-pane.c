@@ -78,6 +78,7 @@ cmd_break_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 	TAILQ_REMOVE(&w->panes, wp, entry);
 	window_lost_pane(w, wp);
 	layout_close_pane(wp);
+	window_clear_cellmap(w);
 
 	w = wp->window = window_create1(dst_s->sx, dst_s->sy);
 	TAILQ_INSERT_HEAD(&w->panes, wp, entry);
@@ -87,6 +88,7 @@ cmd_break_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 	free(name);
 	layout_init(w, wp);
 	wp->flags |= PANE_CHANGED;
+	window_enqueue(w);
 
 	if (idx == -1)
 		idx = -1 - options_get_number(dst_s->options, "base-index");
@@ -25,15 +25,47 @@
 
 /*
  * Write the entire contents of a pane to a buffer or stdout.
+ *
+ * A long capture to the stdout of a client is streamed: it is done a chunk
+ * at a time in later event loop iterations, only while little is waiting to
+ * be sent to the client, and the command waits until it is done. Lines are
+ * tracked counting those removed from the top of the history, so output
+ * meanwhile does not disturb what is left to capture.
  */
 
+/* Captures of more lines than this are streamed. */
+#define CAPTURE_PANE_STREAM_LINES 1000
+
+/* Stdout data and messages queued to the client before waiting. */
+#define CAPTURE_PANE_CHUNK 65536
+#define CAPTURE_PANE_QUEUED 16
+
+struct cmd_capture_pane_stream {
+	struct cmd_q		*cmdq;
+	struct client		*c;
+	u_int			 pane_id;
+
+	int			 alternate;
+	int			 with_codes;
+	int			 escape_c0;
+	int			 join_lines;
+	struct grid_cell	 lastgc;
+
+	uint64_t		 next;
+	uint64_t		 last;
+};
+
 enum cmd_retval	 cmd_capture_pane_exec(struct cmd *, struct cmd_q *);
 
 char		*cmd_capture_pane_append(char *, size_t *, char *, size_t);
 char		*cmd_capture_pane_pending(struct args *, struct window_pane *,
 		     size_t *);
+int		 cmd_capture_pane_range(struct args *, struct cmd_q *,
+		     struct window_pane *, struct grid **, u_int *, u_int *);
 char		*cmd_capture_pane_history(struct args *, struct cmd_q *,
 		     struct window_pane *, size_t *);
+void		 cmd_capture_pane_stream(int, short, void *);
+void		 cmd_capture_pane_done(struct cmd_capture_pane_stream *);
 
 const struct cmd_entry cmd_capture_pane_entry = {
 	.name = "capture-pane",
@@ -90,33 +122,36 @@ cmd_capture_pane_pending(struct args *args, struct window_pane *wp,
 	return (buf);
 }
 
-char *
-cmd_capture_pane_history(struct args *args, struct cmd_q *cmdq,
-    struct window_pane *wp, size_t *len)
+/*
+ * Get the grid and lines to capture. Returns -1 on error, or 0 with the grid
+ * set to NULL if there is nothing to capture.
+ */
+int
+cmd_capture_pane_range(struct args *args, struct cmd_q *cmdq,
+    struct window_pane *wp, struct grid **gdp, u_int *topp, u_int *bottomp)
 {
 	struct grid		*gd;
-	const struct grid_line	*gl;
-	struct grid_cell	*gc = NULL;
-	int			 n, with_codes, escape_c0, join_lines;
-	u_int			 i, sx, top, bottom, tmp;
-	char			*cause, *buf, *line;
+	int			 n;
+	u_int			 top, bottom, tmp;
+	char			*cause;
 	const char		*Sflag, *Eflag;
-	size_t			 linelen;
 
-	sx = screen_size_x(&wp->base);
 	if (args_has(args, 'a')) {
 		gd = wp->saved_grid;
 		if (gd == NULL) {
+			*gdp = NULL;
 			if (!args_has(args, 'q')) {
 				cmdq_error(cmdq, "no alternate screen");
-				return (NULL);
+				return (-1);
 			}
-			return (xstrdup(""));
+			return (0);
 		}
 	} else
 		gd = wp->base.grid;
 
 	Sflag = args_get(args, 'S');
+	if (Sflag != NULL)
+		grid_reflow_history(gd);
 	if (Sflag != NULL && strcmp(Sflag, "-") == 0)
 		top = 0;
 	else {
@@ -154,36 +189,167 @@ cmd_capture_pane_history(struct args *args, struct cmd_q *cmdq,
 		top = tmp;
 	}
 
+	*gdp = gd;
+	*topp = top;
+	*bottomp = bottom;
+	return (0);
+}
+
+char *
+cmd_capture_pane_history(struct args *args, struct cmd_q *cmdq,
+    struct window_pane *wp, size_t *len)
+{
+	struct grid		*gd;
+	const struct grid_line	*gl;
+	struct grid_cell	 gc;
+	struct evbuffer		*evb;
+	int			 with_codes, escape_c0, join_lines;
+	u_int			 i, sx, top, bottom;
+	char			*buf;
+
+	if (cmd_capture_pane_range(args, cmdq, wp, &gd, &top, &bottom) != 0)
+		return (NULL);
+	if (gd == NULL)
+		return (xstrdup(""));
+	sx = screen_size_x(&wp->base);
+
 	with_codes = args_has(args, 'e');
 	escape_c0 = args_has(args, 'C');
 	join_lines = args_has(args, 'J');
 
-	buf = NULL;
+	evb = evbuffer_new();
+	if (evb == NULL)
+		fatalx("out of memory");
+	memcpy(&gc, &grid_default_cell, sizeof gc);
 	for (i = top; i <= bottom; i++) {
-		line = grid_string_cells(gd, 0, i, sx, &gc, with_codes,
-		    escape_c0, !join_lines);
-		linelen = strlen(line);
-
-		buf = cmd_capture_pane_append(buf, len, line, linelen);
+		grid_string_cells_buffer(gd, 0, i, sx, &gc, with_codes,
+		    escape_c0, !join_lines, evb);
 
 		gl = grid_peek_line(gd, i);
 		if (!join_lines || !(gl->flags & GRID_LINE_WRAPPED))
-			buf[(*len)++] = '\n';
-
-		free(line);
+			evbuffer_add(evb, "\n", 1);
 	}
+
+	*len = EVBUFFER_LENGTH(evb);
+	buf = xmalloc(*len + 1);
+	memcpy(buf, EVBUFFER_DATA(evb), *len);
+	evbuffer_free(evb);
 	return (buf);
 }
 
+void
+cmd_capture_pane_stream(__unused int fd, __unused short events, void *arg)
+{
+	struct cmd_capture_pane_stream	*cs = arg;
+	struct client			*c = cs->c;
+	struct window_pane		*wp;
+	struct grid			*gd;
+	const struct grid_line		*gl;
+	struct timeval			 tv = { .tv_usec = 10000 };
+	uint64_t			 last;
+	u_int				 py;
+
+	if ((c->flags & CLIENT_DEAD) || (cs->cmdq->flags & CMD_Q_DEAD)) {
+		cmd_capture_pane_done(cs);
+		return;
+	}
+
+	/* Wait for the client to take what was already sent. */
+	if (proc_queued(c->peer) > CAPTURE_PANE_QUEUED) {
+		event_once(-1, EV_TIMEOUT, cmd_capture_pane_stream, cs, &tv);
+		return;
+	}
+
+	wp = window_pane_find_by_id(cs->pane_id);
+	if (wp == NULL) {
+		cmd_capture_pane_done(cs);
+		return;
+	}
+	gd = cs->alternate ? wp->saved_grid : wp->base.grid;
+	if (gd == NULL) {
+		cmd_capture_pane_done(cs);
+		return;
+	}
+
+	/* Skip lines which have gone from the history. */
+	if (cs->next < gd->hremoved)
+		cs->next = gd->hremoved;
+	last = gd->hremoved + gd->hsize + gd->sy - 1;
+	if (last > cs->last)
+		last = cs->last;
+
+	while (cs->next <= last &&
+	    EVBUFFER_LENGTH(c->stdout_data) < CAPTURE_PANE_CHUNK) {
+		py = cs->next++ - gd->hremoved;
+		grid_string_cells_buffer(gd, 0, py, screen_size_x(&wp->base),
+		    &cs->lastgc, cs->with_codes, cs->escape_c0,
+		    !cs->join_lines, c->stdout_data);
+
+		gl = grid_peek_line(gd, py);
+		if (!cs->join_lines || !(gl->flags & GRID_LINE_WRAPPED))
+			evbuffer_add(c->stdout_data, "\n", 1);
+	}
+	server_client_push_stdout(c);
+
+	if (cs->next > last) {
+		cmd_capture_pane_done(cs);
+		return;
+	}
+	event_once(-1, EV_TIMEOUT, cmd_capture_pane_stream, cs, NULL);
+}
+
+void
+cmd_capture_pane_done(struct cmd_capture_pane_stream *cs)
+{
+	struct cmd_q	*cmdq = cs->cmdq;
+
+	if (!cmdq_free(cmdq))
+		cmdq_continue(cmdq);
+	server_client_unref(cs->c);
+	free(cs);
+}
+
 enum cmd_retval
 cmd_capture_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 {
-	struct args		*args = self->args;
-	struct client		*c;
-	struct window_pane	*wp = cmdq->state.tflag.wp;
-	char			*buf, *cause;
-	const char		*bufname;
-	size_t			 len;
+	struct args			*args = self->args;
+	struct client			*c;
+	struct window_pane		*wp = cmdq->state.tflag.wp;
+	struct cmd_capture_pane_stream	*cs;
+	struct grid			*gd;
+	char				*buf, *cause;
+	const char			*bufname;
+	size_t				 len;
+	u_int				 top, bottom;
+
+	c = cmdq->client;
+	if (args_has(args, 'p') && !args_has(args, 'P') &&
+	    c != NULL && c->session == NULL && !(c->flags & CLIENT_CONTROL)) {
+		if (cmd_capture_pane_range(args, cmdq, wp, &gd, &top,
+		    &bottom) != 0)
+			return (CMD_RETURN_ERROR);
+		if (gd != NULL && bottom - top >= CAPTURE_PANE_STREAM_LINES) {
+			cs = xcalloc(1, sizeof *cs);
+			cs->cmdq = cmdq;
+			cmdq->references++;
+			cs->c = c;
+			c->references++;
+			cs->pane_id = wp->id;
+
+			cs->alternate = args_has(args, 'a');
+			cs->with_codes = args_has(args, 'e');
+			cs->escape_c0 = args_has(args, 'C');
+			cs->join_lines = args_has(args, 'J');
+			memcpy(&cs->lastgc, &grid_default_cell,
+			    sizeof cs->lastgc);
+
+			cs->next = gd->hremoved + top;
+			cs->last = gd->hremoved + bottom;
+			event_once(-1, EV_TIMEOUT, cmd_capture_pane_stream, cs,
+			    NULL);
+			return (CMD_RETURN_WAIT);
+		}
+	}
 
 	len = 0;
 	if (args_has(args, 'P'))
@@ -19,13 +19,23 @@
 #include <sys/types.h>
 
 #include <fnmatch.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "tmux.h"
 
 /*
  * Find window containing text.
+ *
+ * Names and titles are matched straight away. For the content, each pane's
+ * lines are copied into a snapshot which is searched afterwards, so with
+ * enough lines the searching is done by a few threads while the server goes
+ * on, and the command waits for them. The threads only read the snapshots
+ * and the compiled pattern, and only write their own job's result.
  */
 
 #define FIND_WINDOW_TEMPLATE					\
@@ -33,6 +43,10 @@
 	"[#{window_width}x#{window_height}] "			\
 	"(#{window_panes} panes) #{window_find_matches}"
 
+/* Below this many lines, searching on the server is quicker than threads. */
+#define FIND_WINDOW_THREAD_LINES 4096
+#define FIND_WINDOW_THREADS 8
+
 enum cmd_retval	 cmd_find_window_exec(struct cmd *, struct cmd_q *);
 
 void	cmd_find_window_callback(struct window_choose_data *);
@@ -51,8 +65,9 @@ const struct cmd_entry cmd_find_window_entry = {
 	.name = "find-window",
 	.alias = "findw",
 
-	.args = { "F:CNt:T", 1, 4 },
-	.usage = "[-CNT] [-F format] " CMD_TARGET_WINDOW_USAGE " match-string",
+	.args = { "F:CHNrt:T", 1, 4 },
+	.usage = "[-CHNrT] [-F format] " CMD_TARGET_WINDOW_USAGE
+		 " match-string",
 
 	.tflag = CMD_WINDOW,
 
@@ -60,17 +75,70 @@ const struct cmd_entry cmd_find_window_entry = {
 	.exec = cmd_find_window_exec
 };
 
+/*
+ * The lines of a pane, each NUL terminated: the visible lines from the top,
+ * then with -H the history from the most recent line.
+ */
+struct cmd_find_window_pane {
+	u_int		 index;
+	char		*text;
+	size_t		 len;
+	u_int		 sy;
+	u_int		 nlines;
+	int		 found;
+};
+
 struct cmd_find_window_data {
-	struct winlink	*wl;
+	u_int		 window_id;
 	char		*list_ctx;
 	u_int		 pane_id;
+
+	/* Panes to search before falling back to list_ctx. */
+	struct cmd_find_window_pane *panes;
+	u_int		 npanes;
+
 	TAILQ_ENTRY(cmd_find_window_data) entry;
 };
 TAILQ_HEAD(cmd_find_window_list, cmd_find_window_data);
 
+struct cmd_find_window_state {
+	struct cmd_q			*cmdq;
+	struct client			*c;
+	struct session			*s;
+	u_int				 window_id;
+	char				*template;
+
+	char				*str;
+	char				*searchstr;
+	regex_t				*re;
+	struct cmd_find_window_list	 list;
+
+	/* Search jobs, one per window with panes to search. */
+	struct cmd_find_window_data	**jobs;
+	u_int				 njobs;
+	u_int				 next;
+
+	pthread_t			*threads;
+	u_int				 nthreads;
+	u_int				 running;
+	int				 fds[2];
+	struct event			 ev;
+};
+
 u_int	cmd_find_window_match_flags(struct args *);
-void	cmd_find_window_match(struct cmd_find_window_list *, int,
-	    struct winlink *, const char *, const char *);
+int	cmd_find_window_compare(const char *, const char *, regex_t *);
+void	cmd_find_window_snapshot(struct cmd_find_window_pane *,
+	    struct window_pane *, int);
+void	cmd_find_window_match(struct cmd_find_window_state *, int,
+	    struct winlink *, int);
+void	cmd_find_window_search(struct cmd_find_window_state *,
+	    struct cmd_find_window_data *);
+void   *cmd_find_window_thread(void *);
+int	cmd_find_window_start(struct cmd_find_window_state *, u_int);
+void	cmd_find_window_done(int, short, void *);
+enum cmd_retval	cmd_find_window_finish(struct cmd_find_window_state *);
+void	cmd_find_window_free_data(struct cmd_find_window_data *);
+void	cmd_find_window_free(struct cmd_find_window_state *);
 
 u_int
 cmd_find_window_match_flags(struct args *args)
@@ -92,113 +160,296 @@ cmd_find_window_match_flags(struct args *args)
 	return (match_flags);
 }
 
+/* Match a name, title or line against the pattern or regular expression. */
+int
+cmd_find_window_compare(const char *s, const char *searchstr, regex_t *re)
+{
+	if (re != NULL)
+		return (regexec(re, s, 0, NULL, 0) == 0);
+	return (fnmatch(searchstr, s, 0) == 0);
+}
+
+/* Copy the lines of a pane to be searched. */
 void
-cmd_find_window_match(struct cmd_find_window_list *find_list,
-    int match_flags, struct winlink *wl, const char *str,
-    const char *searchstr)
+cmd_find_window_snapshot(struct cmd_find_window_pane *fwp,
+    struct window_pane *wp, int history)
+{
+	struct grid	*gd = wp->base.grid;
+	char		*line = NULL;
+	size_t		 size = 0, alloc = 0, len;
+	u_int		 i, py;
+
+	fwp->sy = screen_size_y(&wp->base);
+	fwp->found = -1;
+
+	fwp->nlines = fwp->sy;
+	if (history)
+		fwp->nlines += gd->hsize;
+	for (i = 0; i < fwp->nlines; i++) {
+		if (i < fwp->sy)
+			py = gd->hsize + i;
+		else
+			py = gd->hsize - 1 - (i - fwp->sy);
+		len = grid_string_text(gd, py, &line, &size);
+
+		if (fwp->len + len + 1 > alloc) {
+			alloc = (fwp->len + len + 1) * 2;
+			fwp->text = xrealloc(fwp->text, alloc);
+		}
+		memcpy(fwp->text + fwp->len, line, len + 1);
+		fwp->len += len + 1;
+	}
+	free(line);
+}
+
+void
+cmd_find_window_match(struct cmd_find_window_state *fws, int match_flags,
+    struct winlink *wl, int history)
 {
 	struct cmd_find_window_data	*find_data;
 	struct window_pane		*wp;
-	u_int				 i, line;
-	char				*sres;
+	u_int				 i, n;
 
 	find_data = xcalloc(1, sizeof *find_data);
+	find_data->window_id = wl->window->id;
+
+	if (match_flags & CMD_FIND_WINDOW_BY_CONTENT) {
+		n = window_count_panes(wl->window);
+		find_data->panes = xcalloc(n, sizeof *find_data->panes);
+	}
 
 	i = 0;
 	TAILQ_FOREACH(wp, &wl->window->panes, entry) {
 		i++;
 
 		if ((match_flags & CMD_FIND_WINDOW_BY_NAME) &&
-		    fnmatch(searchstr, wl->window->name, 0) == 0) {
+		    cmd_find_window_compare(wl->window->name, fws->searchstr,
+		    fws->re)) {
 			find_data->list_ctx = xstrdup("");
 			break;
 		}
 
+		/* A title only counts if no earlier pane's content matches. */
 		if ((match_flags & CMD_FIND_WINDOW_BY_TITLE) &&
-		    fnmatch(searchstr, wp->base.title, 0) == 0) {
+		    cmd_find_window_compare(wp->base.title, fws->searchstr,
+		    fws->re)) {
 			xasprintf(&find_data->list_ctx,
 			    "pane %u title: \"%s\"", i - 1, wp->base.title);
 			break;
 		}
 
-		if (match_flags & CMD_FIND_WINDOW_BY_CONTENT &&
-		    (sres = window_pane_search(wp, str, &line)) != NULL) {
-			xasprintf(&find_data->list_ctx,
-			    "pane %u line %u: \"%s\"", i - 1, line + 1, sres);
-			free(sres);
-			break;
+		if (match_flags & CMD_FIND_WINDOW_BY_CONTENT) {
+			find_data->panes[find_data->npanes].index = i - 1;
+			cmd_find_window_snapshot(
+			    &find_data->panes[find_data->npanes++], wp, history);
 		}
 	}
+	find_data->pane_id = i - 1;
 
-	if (find_data->list_ctx != NULL) {
-		find_data->wl = wl;
-		find_data->pane_id = i - 1;
-		TAILQ_INSERT_TAIL(find_list, find_data, entry);
-	} else
-		free(find_data);
+	if (find_data->npanes != 0) {
+		fws->jobs = xreallocarray(fws->jobs, fws->njobs + 1,
+		    sizeof *fws->jobs);
+		fws->jobs[fws->njobs++] = find_data;
+	}
+	TAILQ_INSERT_TAIL(&fws->list, find_data, entry);
 }
 
-enum cmd_retval
-cmd_find_window_exec(struct cmd *self, struct cmd_q *cmdq)
+/* Search the snapshots of a window, stopping at the first pane matching. */
+void
+cmd_find_window_search(struct cmd_find_window_state *fws,
+    struct cmd_find_window_data *find_data)
 {
-	struct args			*args = self->args;
-	struct client			*c = cmdq->state.c;
-	struct window_choose_data	*cdata;
-	struct session			*s = cmdq->state.tflag.s;
-	struct winlink			*wl = cmdq->state.tflag.wl, *wm;
-	struct cmd_find_window_list	 find_list;
-	struct cmd_find_window_data	*find_data;
-	struct cmd_find_window_data	*find_data1;
-	char				*str, *searchstr;
-	const char			*template;
-	u_int				 i, match_flags;
+	struct cmd_find_window_pane	*fwp;
+	const char			*line;
+	u_int				 i;
+	int				 n;
+
+	for (i = 0; i < find_data->npanes; i++) {
+		fwp = &find_data->panes[i];
+		n = 0;
+		for (line = fwp->text; line < fwp->text + fwp->len; n++) {
+			if (cmd_find_window_compare(line, fws->searchstr,
+			    fws->re)) {
+				fwp->found = n;
+				return;
+			}
+			line += strlen(line) + 1;
+		}
+	}
+}
 
-	if (c == NULL) {
-		cmdq_error(cmdq, "no client available");
-		return (CMD_RETURN_ERROR);
+void *
+cmd_find_window_thread(void *arg)
+{
+	struct cmd_find_window_state	*fws = arg;
+	u_int				 i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&fws->next, 1, __ATOMIC_RELAXED);
+		if (i >= fws->njobs)
+			break;
+		cmd_find_window_search(fws, fws->jobs[i]);
 	}
 
-	if ((template = args_get(args, 'F')) == NULL)
-		template = FIND_WINDOW_TEMPLATE;
+	/* The last thread out wakes the server up. */
+	if (__atomic_sub_fetch(&fws->running, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (write(fws->fds[1], "", 1) != 1)
+			fatal("write failed");
+	}
+	return (NULL);
+}
 
-	match_flags = cmd_find_window_match_flags(args);
-	str = args->argv[0];
+/* Start the threads. Returns -1 if they could not be started. */
+int
+cmd_find_window_start(struct cmd_find_window_state *fws, u_int nthreads)
+{
+	sigset_t	set, oldset;
+	u_int		i;
+
+	if (pipe(fws->fds) != 0)
+		return (-1);
+	setblocking(fws->fds[0], 0);
+	event_set(&fws->ev, fws->fds[0], EV_READ, cmd_find_window_done, fws);
+	event_add(&fws->ev, NULL);
+
+	fws->threads = xcalloc(nthreads, sizeof *fws->threads);
+	fws->running = nthreads;
+
+	/* Signals are for the server. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&fws->threads[i], NULL,
+		    cmd_find_window_thread, fws) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	fws->nthreads = i;
 
-	TAILQ_INIT(&find_list);
+	if (i == nthreads)
+		return (0);
 
-	xasprintf(&searchstr, "*%s*", str);
-	RB_FOREACH(wm, winlinks, &s->windows)
-	    cmd_find_window_match(&find_list, match_flags, wm, str, searchstr);
-	free(searchstr);
+	/* Those which did start do the work; none is searched here. */
+	if (__atomic_sub_fetch(&fws->running, nthreads - i,
+	    __ATOMIC_ACQ_REL) == 0) {
+		if (i != 0 && write(fws->fds[1], "", 1) != 1)
+			fatal("write failed");
+	}
+	if (i != 0)
+		return (0);
+	event_del(&fws->ev);
+	close(fws->fds[0]);
+	close(fws->fds[1]);
+	return (-1);
+}
+
+void
+cmd_find_window_done(__unused int fd, __unused short events, void *data)
+{
+	struct cmd_find_window_state	*fws = data;
+	struct cmd_q			*cmdq = fws->cmdq;
+	u_int				 i;
 
-	if (TAILQ_EMPTY(&find_list)) {
-		cmdq_error(cmdq, "no windows matching: %s", str);
+	for (i = 0; i < fws->nthreads; i++)
+		pthread_join(fws->threads[i], NULL);
+	close(fws->fds[0]);
+	close(fws->fds[1]);
+
+	if (!(cmdq->flags & CMD_Q_DEAD))
+		cmd_find_window_finish(fws);
+	cmd_find_window_free(fws);
+
+	if (!cmdq_free(cmdq))
+		cmdq_continue(cmdq);
+}
+
+/* Turn the results into the choice list, or select the only window. */
+enum cmd_retval
+cmd_find_window_finish(struct cmd_find_window_state *fws)
+{
+	struct cmd_q			*cmdq = fws->cmdq;
+	struct client			*c = fws->c;
+	struct session			*s = fws->s;
+	struct window_choose_data	*cdata;
+	struct cmd_find_window_data	*find_data, *find_data1;
+	struct cmd_find_window_pane	*fwp;
+	struct winlink			*wl, *wm;
+	const char			*line;
+	char				*list_ctx;
+	u_int				 i;
+	int				 n;
+
+	/* Everything may have gone while the threads were searching. */
+	if ((c->flags & CLIENT_DEAD) || c->session == NULL || !session_alive(s))
+		return (CMD_RETURN_NORMAL);
+	wl = winlink_find_by_window_id(&s->windows, fws->window_id);
+
+	TAILQ_FOREACH_SAFE(find_data, &fws->list, entry, find_data1) {
+		for (i = 0; i < find_data->npanes; i++) {
+			fwp = &find_data->panes[i];
+			if (fwp->found == -1)
+				continue;
+
+			line = fwp->text;
+			for (n = 0; n < fwp->found; n++)
+				line += strlen(line) + 1;
+			if ((u_int)fwp->found < fwp->sy) {
+				xasprintf(&list_ctx, "pane %u line %d: \"%s\"",
+				    fwp->index, fwp->found + 1, line);
+			} else {
+				xasprintf(&list_ctx, "pane %u line %d: \"%s\"",
+				    fwp->index, -(fwp->found - (int)fwp->sy + 1),
+				    line);
+			}
+			free(find_data->list_ctx);
+			find_data->list_ctx = list_ctx;
+			find_data->pane_id = fwp->index;
+			break;
+		}
+
+		wm = winlink_find_by_window_id(&s->windows,
+		    find_data->window_id);
+		if (find_data->list_ctx == NULL || wm == NULL) {
+			TAILQ_REMOVE(&fws->list, find_data, entry);
+			cmd_find_window_free_data(find_data);
+		}
+	}
+
+	if (TAILQ_EMPTY(&fws->list)) {
+		cmdq_error(cmdq, "no windows matching: %s", fws->str);
 		return (CMD_RETURN_ERROR);
 	}
 
-	if (TAILQ_NEXT(TAILQ_FIRST(&find_list), entry) == NULL) {
-		if (session_select(s, TAILQ_FIRST(&find_list)->wl->idx) == 0)
+	if (TAILQ_NEXT(TAILQ_FIRST(&fws->list), entry) == NULL) {
+		find_data = TAILQ_FIRST(&fws->list);
+		wm = winlink_find_by_window_id(&s->windows,
+		    find_data->window_id);
+		if (session_select(s, wm->idx) == 0)
 			server_redraw_session(s);
 		recalculate_sizes();
-		goto out;
+		return (CMD_RETURN_NORMAL);
 	}
 
-	if (window_pane_set_mode(wl->window->active, &window_choose_mode) != 0)
-		goto out;
+	if (wl == NULL ||
+	    window_pane_set_mode(wl->window->active, &window_choose_mode) != 0)
+		return (CMD_RETURN_NORMAL);
 
 	i = 0;
-	TAILQ_FOREACH(find_data, &find_list, entry) {
+	TAILQ_FOREACH(find_data, &fws->list, entry) {
+		wm = winlink_find_by_window_id(&s->windows,
+		    find_data->window_id);
+
 		cdata = window_choose_data_create(TREE_OTHER, c, c->session);
-		cdata->idx = find_data->wl->idx;
-		cdata->wl = find_data->wl;
+		cdata->idx = wm->idx;
+		cdata->wl = wm;
 
-		cdata->ft_template = xstrdup(template);
+		cdata->ft_template = xstrdup(fws->template);
 		cdata->pane_id = find_data->pane_id;
 
 		format_add(cdata->ft, "line", "%u", i);
 		format_add(cdata->ft, "window_find_matches", "%s",
 		    find_data->list_ctx);
-		format_defaults(cdata->ft, NULL, s, find_data->wl, NULL);
+		format_defaults(cdata->ft, NULL, s, wm, NULL);
 
 		window_choose_add(wl->window->active, cdata);
 
@@ -206,14 +457,122 @@ cmd_find_window_exec(struct cmd *self, struct cmd_q *cmdq)
 	}
 
 	window_choose_ready(wl->window->active, 0, cmd_find_window_callback);
+	return (CMD_RETURN_NORMAL);
+}
+
+void
+cmd_find_window_free_data(struct cmd_find_window_data *find_data)
+{
+	u_int	i;
+
+	free(find_data->list_ctx);
+	for (i = 0; i < find_data->npanes; i++)
+		free(find_data->panes[i].text);
+	free(find_data->panes);
+	free(find_data);
+}
 
-out:
-	TAILQ_FOREACH_SAFE(find_data, &find_list, entry, find_data1) {
-		free(find_data->list_ctx);
-		TAILQ_REMOVE(&find_list, find_data, entry);
-		free(find_data);
+void
+cmd_find_window_free(struct cmd_find_window_state *fws)
+{
+	struct cmd_find_window_data	*find_data, *find_data1;
+
+	TAILQ_FOREACH_SAFE(find_data, &fws->list, entry, find_data1) {
+		TAILQ_REMOVE(&fws->list, find_data, entry);
+		cmd_find_window_free_data(find_data);
 	}
-	return (CMD_RETURN_NORMAL);
+	free(fws->jobs);
+	free(fws->threads);
+
+	if (fws->re != NULL)
+		regex_cache_release(fws->re);
+	server_client_unref(fws->c);
+	session_unref(fws->s);
+	free(fws->template);
+	free(fws->str);
+	free(fws->searchstr);
+	free(fws);
+}
+
+enum cmd_retval
+cmd_find_window_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args			*args = self->args;
+	struct client			*c = cmdq->state.c;
+	struct session			*s = cmdq->state.tflag.s;
+	struct winlink			*wl = cmdq->state.tflag.wl, *wm;
+	struct cmd_find_window_state	*fws;
+	enum cmd_retval			 retval;
+	regex_t				*re = NULL;
+	char				*str, *cause;
+	const char			*template;
+	u_int				 i, j, lines, nthreads, match_flags;
+	long				 ncpu;
+
+	if (c == NULL) {
+		cmdq_error(cmdq, "no client available");
+		return (CMD_RETURN_ERROR);
+	}
+
+	if ((template = args_get(args, 'F')) == NULL)
+		template = FIND_WINDOW_TEMPLATE;
+
+	match_flags = cmd_find_window_match_flags(args);
+	str = args->argv[0];
+
+	if (args_has(args, 'r')) {
+		re = regex_cache_get(str, REG_EXTENDED|REG_NOSUB, &cause);
+		if (re == NULL) {
+			cmdq_error(cmdq, "%s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	fws = xcalloc(1, sizeof *fws);
+	fws->cmdq = cmdq;
+	fws->c = c;
+	c->references++;
+	fws->s = s;
+	s->references++;
+	fws->window_id = wl->window->id;
+	fws->template = xstrdup(template);
+	if ((fws->re = re) != NULL)
+		regex_cache_hold(re);
+	TAILQ_INIT(&fws->list);
+
+	fws->str = xstrdup(str);
+	xasprintf(&fws->searchstr, "*%s*", str);
+	RB_FOREACH(wm, winlinks, &s->windows) {
+		cmd_find_window_match(fws, match_flags, wm,
+		    args_has(args, 'H'));
+	}
+
+	lines = 0;
+	for (i = 0; i < fws->njobs; i++) {
+		for (j = 0; j < fws->jobs[i]->npanes; j++)
+			lines += fws->jobs[i]->panes[j].nlines;
+	}
+
+	nthreads = 1;
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+		nthreads = ncpu;
+	if (nthreads > FIND_WINDOW_THREADS)
+		nthreads = FIND_WINDOW_THREADS;
+	if (nthreads > fws->njobs)
+		nthreads = fws->njobs;
+
+	if (nthreads > 1 && lines >= FIND_WINDOW_THREAD_LINES &&
+	    cmd_find_window_start(fws, nthreads) == 0) {
+		cmdq->references++;
+		return (CMD_RETURN_WAIT);
+	}
+
+	for (i = 0; i < fws->njobs; i++)
+		cmd_find_window_search(fws, fws->jobs[i]);
+	retval = cmd_find_window_finish(fws);
+	cmd_find_window_free(fws);
+	return (retval);
 }
 
 void
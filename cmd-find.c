@@ -41,6 +41,7 @@ struct client	*cmd_find_current_client(struct cmd_q *);
 
 const char	*cmd_find_map_table(const char *[][2], const char *);
 
+int	cmd_find_is_pattern(const char *);
 int	cmd_find_get_session(struct cmd_find_state *, const char *);
 int	cmd_find_get_window(struct cmd_find_state *, const char *);
 int	cmd_find_get_window_with_session(struct cmd_find_state *, const char *);
@@ -395,11 +396,18 @@ cmd_find_map_table(const char *table[][2], const char *s)
 	return (s);
 }
 
+/* Is this a name which fnmatch would treat differently from strcmp? */
+int
+cmd_find_is_pattern(const char *s)
+{
+	return (strpbrk(s, "*?[\\") != NULL);
+}
+
 /* Find session from string. Fills in s. */
 int
 cmd_find_get_session(struct cmd_find_state *fs, const char *session)
 {
-	struct session	*s, *s_loop;
+	struct session	*s, *s_loop, find;
 	struct client	*c;
 
 	log_debug("%s: %s", __func__, session);
@@ -428,20 +436,25 @@ cmd_find_get_session(struct cmd_find_state *fs, const char *session)
 	if (fs->flags & CMD_FIND_EXACT_SESSION)
 		return (-1);
 
-	/* Otherwise look for prefix. */
-	s = NULL;
-	RB_FOREACH(s_loop, sessions, &sessions) {
-		if (strncmp(session, s_loop->name, strlen(session)) == 0) {
-			if (s != NULL)
-				return (-1);
-			s = s_loop;
-		}
-	}
-	if (s != NULL) {
+	/*
+	 * Otherwise look for prefix. Sessions are sorted by name, so any with
+	 * the prefix start from the first name not before it.
+	 */
+	find.name = (char *)session;
+	s = RB_NFIND(sessions, &sessions, &find);
+	if (s != NULL && strncmp(session, s->name, strlen(session)) == 0) {
+		s_loop = RB_NEXT(sessions, &sessions, s);
+		if (s_loop != NULL &&
+		    strncmp(session, s_loop->name, strlen(session)) == 0)
+			return (-1);
 		fs->s = s;
 		return (0);
 	}
 
+	/* Without special characters, a pattern is only an exact match. */
+	if (!cmd_find_is_pattern(session))
+		return (-1);
+
 	/* Then as a pattern. */
 	s = NULL;
 	RB_FOREACH(s_loop, sessions, &sessions) {
@@ -499,9 +512,11 @@ cmd_find_get_window(struct cmd_find_state *fs, const char *window)
 int
 cmd_find_get_window_with_session(struct cmd_find_state *fs, const char *window)
 {
-	struct winlink	*wl;
+	struct winlink	*wl, *wl_exact, *wl_prefix;
 	const char	*errstr;
 	int		 idx, n, exact;
+	u_int		 nexact, nprefix;
+	size_t		 len;
 	struct session	*s;
 
 	log_debug("%s: %s", __func__, window);
@@ -594,16 +609,28 @@ cmd_find_get_window_with_session(struct cmd_find_state *fs, const char *window)
 		}
 	}
 
-	/* Look for exact matches, error if more than one. */
-	fs->wl = NULL;
+	/*
+	 * Look for exact matches, error if more than one, then if none for the
+	 * start of a window name, again error if multiple. Both are found in
+	 * the same walk over the windows.
+	 */
+	wl_exact = wl_prefix = NULL;
+	nexact = nprefix = 0;
+	len = strlen(window);
 	RB_FOREACH(wl, winlinks, &fs->s->windows) {
-		if (strcmp(window, wl->window->name) == 0) {
-			if (fs->wl != NULL)
-				return (-1);
-			fs->wl = wl;
+		if (strncmp(window, wl->window->name, len) != 0)
+			continue;
+		if (wl->window->name[len] == '\0') {
+			if (nexact++ == 0)
+				wl_exact = wl;
 		}
+		if (nprefix++ == 0)
+			wl_prefix = wl;
 	}
-	if (fs->wl != NULL) {
+	if (nexact > 1)
+		return (-1);
+	if (nexact == 1) {
+		fs->wl = wl_exact;
 		fs->idx = fs->wl->idx;
 		fs->w = fs->wl->window;
 		return (0);
@@ -613,21 +640,19 @@ cmd_find_get_window_with_session(struct cmd_find_state *fs, const char *window)
 	if (exact)
 		return (-1);
 
-	/* Try as the start of a window name, error if multiple. */
-	fs->wl = NULL;
-	RB_FOREACH(wl, winlinks, &fs->s->windows) {
-		if (strncmp(window, wl->window->name, strlen(window)) == 0) {
-			if (fs->wl != NULL)
-				return (-1);
-			fs->wl = wl;
-		}
-	}
-	if (fs->wl != NULL) {
+	if (nprefix > 1)
+		return (-1);
+	if (nprefix == 1) {
+		fs->wl = wl_prefix;
 		fs->idx = fs->wl->idx;
 		fs->w = fs->wl->window;
 		return (0);
 	}
 
+	/* Without special characters, a pattern is only an exact match. */
+	if (!cmd_find_is_pattern(window))
+		return (-1);
+
 	/* Now look for pattern matches, again error if multiple. */
 	fs->wl = NULL;
 	RB_FOREACH(wl, winlinks, &fs->s->windows) {
@@ -138,6 +138,7 @@ join_pane(struct cmd *self, struct cmd_q *cmdq, int not_same_window)
 
 	window_lost_pane(src_w, src_wp);
 	TAILQ_REMOVE(&src_w->panes, src_wp, entry);
+	window_clear_cellmap(src_w);
 
 	if (window_count_panes(src_w) == 0)
 		server_kill_window(src_w);
@@ -147,6 +148,7 @@ join_pane(struct cmd *self, struct cmd_q *cmdq, int not_same_window)
 	src_wp->window = dst_w;
 	TAILQ_INSERT_AFTER(&dst_w->panes, dst_wp, src_wp, entry);
 	layout_assign_pane(lc, src_wp);
+	window_clear_cellmap(dst_w);
 
 	recalculate_sizes();
 
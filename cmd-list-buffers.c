@@ -56,16 +56,16 @@ cmd_list_buffers_exec(struct cmd *self, struct cmd_q *cmdq)
 		template = LIST_BUFFERS_TEMPLATE;
 
 	pb = NULL;
+	ft = format_create(cmdq, 0);
 	while ((pb = paste_walk(pb)) != NULL) {
-		ft = format_create(cmdq, 0);
+		format_reset(ft);
 		format_defaults_paste_buffer(ft, pb);
 
 		line = format_expand(ft, template);
 		cmdq_print(cmdq, "%s", line);
 		free(line);
-
-		format_free(ft);
 	}
+	format_free(ft);
 
 	return (CMD_RETURN_NORMAL);
 }
@@ -68,11 +68,12 @@ cmd_list_clients_exec(struct cmd *self, struct cmd_q *cmdq)
 		template = LIST_CLIENTS_TEMPLATE;
 
 	idx = 0;
+	ft = format_create(cmdq, 0);
 	TAILQ_FOREACH(c, &clients, entry) {
 		if (c->session == NULL || (s != NULL && s != c->session))
 			continue;
 
-		ft = format_create(cmdq, 0);
+		format_reset(ft);
 		format_add(ft, "line", "%u", idx);
 		format_defaults(ft, c, NULL, NULL, NULL);
 
@@ -80,10 +81,9 @@ cmd_list_clients_exec(struct cmd *self, struct cmd_q *cmdq)
 		cmdq_print(cmdq, "%s", line);
 		free(line);
 
-		format_free(ft);
-
 		idx++;
 	}
+	format_free(ft);
 
 	return (CMD_RETURN_NORMAL);
 }
@@ -122,8 +122,9 @@ cmd_list_panes_window(struct cmd *self, struct session *s, struct winlink *wl,
 	}
 
 	n = 0;
+	ft = format_create(cmdq, 0);
 	TAILQ_FOREACH(wp, &wl->window->panes, entry) {
-		ft = format_create(cmdq, 0);
+		format_reset(ft);
 		format_add(ft, "line", "%u", n);
 		format_defaults(ft, NULL, s, wl, wp);
 
@@ -131,7 +132,7 @@ cmd_list_panes_window(struct cmd *self, struct session *s, struct winlink *wl,
 		cmdq_print(cmdq, "%s", line);
 		free(line);
 
-		format_free(ft);
 		n++;
 	}
+	format_free(ft);
 }
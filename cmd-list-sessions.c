@@ -63,8 +63,9 @@ cmd_list_sessions_exec(struct cmd *self, struct cmd_q *cmdq)
 		template = LIST_SESSIONS_TEMPLATE;
 
 	n = 0;
+	ft = format_create(cmdq, 0);
 	RB_FOREACH(s, sessions, &sessions) {
-		ft = format_create(cmdq, 0);
+		format_reset(ft);
 		format_add(ft, "line", "%u", n);
 		format_defaults(ft, NULL, s, NULL, NULL);
 
@@ -72,9 +73,9 @@ cmd_list_sessions_exec(struct cmd *self, struct cmd_q *cmdq)
 		cmdq_print(cmdq, "%s", line);
 		free(line);
 
-		format_free(ft);
 		n++;
 	}
+	format_free(ft);
 
 	return (CMD_RETURN_NORMAL);
 }
@@ -104,8 +104,9 @@ cmd_list_windows_session(struct cmd *self, struct session *s,
 	}
 
 	n = 0;
+	ft = format_create(cmdq, 0);
 	RB_FOREACH(wl, winlinks, &s->windows) {
-		ft = format_create(cmdq, 0);
+		format_reset(ft);
 		format_add(ft, "line", "%u", n);
 		format_defaults(ft, NULL, s, wl, NULL);
 
@@ -113,7 +114,7 @@ cmd_list_windows_session(struct cmd *self, struct session *s,
 		cmdq_print(cmdq, "%s", line);
 		free(line);
 
-		format_free(ft);
 		n++;
 	}
+	format_free(ft);
 }
@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -51,11 +52,12 @@ cmd_load_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 	struct args	*args = self->args;
 	struct client	*c = cmdq->client;
 	struct session  *s;
-	FILE		*f;
+	struct stat	 sb;
 	const char	*path, *bufname, *cwd;
 	char		*pdata, *new_pdata, *cause, *file, resolved[PATH_MAX];
-	size_t		 psize;
-	int		 ch, error;
+	size_t		 psize, palloc;
+	ssize_t		 n;
+	int		 fd, error;
 
 	bufname = NULL;
 	if (args_has(args, 'b'))
@@ -89,32 +91,51 @@ cmd_load_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 		cmdq_error(cmdq, "%s: %s", file, strerror(ENAMETOOLONG));
 		return (CMD_RETURN_ERROR);
 	}
-	f = fopen(resolved, "rb");
+	fd = open(resolved, O_RDONLY);
 	free(file);
-	if (f == NULL) {
+	if (fd == -1) {
 		cmdq_error(cmdq, "%s: %s", resolved, strerror(errno));
 		return (CMD_RETURN_ERROR);
 	}
 
+	/*
+	 * Read a regular file in one go into a block of its size; anything
+	 * else grows the block as it goes.
+	 */
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
+		palloc = sb.st_size + 1;
+	else
+		palloc = BUFSIZ;
+
 	pdata = NULL;
 	psize = 0;
-	while ((ch = getc(f)) != EOF) {
-		/* Do not let the server die due to memory exhaustion. */
-		if ((new_pdata = realloc(pdata, psize + 2)) == NULL) {
-			cmdq_error(cmdq, "realloc error: %s", strerror(errno));
+	for (;;) {
+		if (pdata == NULL || psize == palloc - 1) {
+			if (pdata != NULL)
+				palloc *= 2;
+			/* Do not let the server die due to memory exhaustion. */
+			if ((new_pdata = realloc(pdata, palloc)) == NULL) {
+				cmdq_error(cmdq, "realloc error: %s",
+				    strerror(errno));
+				goto error;
+			}
+			pdata = new_pdata;
+		}
+
+		n = read(fd, pdata + psize, palloc - 1 - psize);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			cmdq_error(cmdq, "%s: %s", resolved, strerror(errno));
 			goto error;
 		}
-		pdata = new_pdata;
-		pdata[psize++] = ch;
-	}
-	if (ferror(f)) {
-		cmdq_error(cmdq, "%s: read error", resolved);
-		goto error;
+		if (n == 0)
+			break;
+		psize += n;
 	}
-	if (pdata != NULL)
-		pdata[psize] = '\0';
+	pdata[psize] = '\0';
 
-	fclose(f);
+	close(fd);
 
 	if (paste_set(pdata, psize, bufname, &cause) != 0) {
 		cmdq_error(cmdq, "%s", cause);
@@ -127,8 +148,7 @@ cmd_load_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 
 error:
 	free(pdata);
-	if (f != NULL)
-		fclose(f);
+	close(fd);
 	return (CMD_RETURN_ERROR);
 }
 
@@ -129,6 +129,7 @@ cmd_pipe_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 
 		wp->pipe_fd = pipe_fd[0];
 		wp->pipe_off = EVBUFFER_LENGTH(wp->event->input);
+		wp->pipe_dropped = 0;
 
 		wp->pipe_event = bufferevent_new(wp->pipe_fd,
 		    NULL, NULL, cmd_pipe_pane_error_callback, wp);
@@ -27,6 +27,21 @@
 #include "tmate.h"
 
 static enum cmd_retval	cmdq_continue_one(struct cmd_q *);
+static struct cmd_q_item *cmdq_new_item(void);
+static void		cmdq_free_item(struct cmd_q_item *);
+
+/*
+ * Freed queues and items are kept for the next ones, up to CMDQ_SPARE of each:
+ * every key binding and every command from the tmate server needs both.
+ */
+#define CMDQ_SPARE 16
+
+/* Output from cmdq_print sent to the client straight away. */
+#define CMDQ_PRINT_CHUNK 16384
+static struct cmd_q		*cmdq_spare[CMDQ_SPARE];
+static u_int			 cmdq_nspare;
+static struct cmd_q_item	*cmdq_spare_items[CMDQ_SPARE];
+static u_int			 cmdq_nspare_items;
 
 /* Create new command queue. */
 struct cmd_q *
@@ -34,7 +49,11 @@ cmdq_new(struct client *c)
 {
 	struct cmd_q	*cmdq;
 
-	cmdq = xcalloc(1, sizeof *cmdq);
+	if (cmdq_nspare != 0) {
+		cmdq = cmdq_spare[--cmdq_nspare];
+		memset(cmdq, 0, sizeof *cmdq);
+	} else
+		cmdq = xcalloc(1, sizeof *cmdq);
 	cmdq->references = 1;
 	cmdq->flags = 0;
 
@@ -62,10 +81,37 @@ cmdq_free(struct cmd_q *cmdq)
 	}
 
 	cmdq_flush(cmdq);
-	free(cmdq);
+	if (cmdq_nspare != CMDQ_SPARE)
+		cmdq_spare[cmdq_nspare++] = cmdq;
+	else
+		free(cmdq);
 	return (1);
 }
 
+/* Get an item, a spare one if any. */
+static struct cmd_q_item *
+cmdq_new_item(void)
+{
+	struct cmd_q_item	*item;
+
+	if (cmdq_nspare_items == 0)
+		return (xcalloc(1, sizeof *item));
+	item = cmdq_spare_items[--cmdq_nspare_items];
+	memset(item, 0, sizeof *item);
+	return (item);
+}
+
+/* Free an item, dropping its reference to the command list. */
+static void
+cmdq_free_item(struct cmd_q_item *item)
+{
+	cmd_list_free(item->cmdlist);
+	if (cmdq_nspare_items != CMDQ_SPARE)
+		cmdq_spare_items[cmdq_nspare_items++] = item;
+	else
+		free(item);
+}
+
 /* Show message from command. */
 void
 cmdq_print(struct cmd_q *cmdq, const char *fmt, ...)
@@ -74,12 +120,14 @@ cmdq_print(struct cmd_q *cmdq, const char *fmt, ...)
 	struct window	*w;
 	va_list		 ap;
 	char		*tmp, *msg;
+	size_t		 before;
 
 	va_start(ap, fmt);
 
 	if (c == NULL)
 		/* nothing */;
 	else if (c->session == NULL || (c->flags & CLIENT_CONTROL)) {
+		before = EVBUFFER_LENGTH(c->stdout_data);
 		if (~c->flags & CLIENT_UTF8) {
 			vasprintf(&tmp, fmt, ap);
 			msg = utf8_sanitize(tmp);
@@ -89,7 +137,15 @@ cmdq_print(struct cmd_q *cmdq, const char *fmt, ...)
 		} else
 			evbuffer_add_vprintf(c->stdout_data, fmt, ap);
 		evbuffer_add(c->stdout_data, "\n", 1);
-		server_client_push_stdout(c);
+
+		/*
+		 * Send lines together, once there are CMDQ_PRINT_CHUNK bytes
+		 * or otherwise from the event loop after the command.
+		 */
+		if (EVBUFFER_LENGTH(c->stdout_data) >= CMDQ_PRINT_CHUNK)
+			server_client_push_stdout(c);
+		else if (before == 0)
+			server_client_push_stdout_later(c);
 	} else {
 		w = c->session->curw->window;
 		if (w->active->mode != &window_copy_mode) {
@@ -181,7 +237,7 @@ cmdq_append(struct cmd_q *cmdq, struct cmd_list *cmdlist, struct mouse_event *m)
 {
 	struct cmd_q_item	*item;
 
-	item = xcalloc(1, sizeof *item);
+	item = cmdq_new_item();
 	item->cmdlist = cmdlist;
 	TAILQ_INSERT_TAIL(&cmdq->queue, item, qentry);
 	cmdlist->references++;
@@ -198,6 +254,7 @@ cmdq_continue_one(struct cmd_q *cmdq)
 {
 	struct cmd	*cmd = cmdq->cmd;
 	enum cmd_retval	 retval;
+	struct timeval	 start;
 	char		*tmp;
 	int		 flags = !!(cmd->flags & CMD_CONTROL);
 
@@ -206,9 +263,11 @@ cmdq_continue_one(struct cmd_q *cmdq)
 		tmate_exec_cmd(cmd);
 #endif
 
-	tmp = cmd_print(cmd);
-	log_debug("cmdq %p: %s", cmdq, tmp);
-	free(tmp);
+	if (log_level > LOG_DEBUG) {
+		tmp = cmd_print(cmd);
+		log_debug("cmdq %p: %s", cmdq, tmp);
+		free(tmp);
+	}
 
 	cmdq->time = time(NULL);
 	cmdq->number++;
@@ -217,7 +276,11 @@ cmdq_continue_one(struct cmd_q *cmdq)
 
 	if (cmd_prepare_state(cmd, cmdq, NULL) != 0)
 		goto error;
+	recalculate_pending(cmdq->state.tflag.w);
+	recalculate_pending(cmdq->state.sflag.w);
+	watchdog_start(&start);
 	retval = cmd->entry->exec(cmd, cmdq);
+	watchdog_stop(WATCHDOG_COMMAND, &start, "%s", cmd->entry->name);
 	if (retval == CMD_RETURN_ERROR)
 		goto error;
 
@@ -270,8 +333,7 @@ cmdq_continue(struct cmd_q *cmdq)
 		next = TAILQ_NEXT(cmdq->item, qentry);
 
 		TAILQ_REMOVE(&cmdq->queue, cmdq->item, qentry);
-		cmd_list_free(cmdq->item->cmdlist);
-		free(cmdq->item);
+		cmdq_free_item(cmdq->item);
 
 		cmdq->item = next;
 		if (cmdq->item != NULL)
@@ -300,8 +362,7 @@ cmdq_flush(struct cmd_q *cmdq)
 
 	TAILQ_FOREACH_SAFE(item, &cmdq->queue, qentry, item1) {
 		TAILQ_REMOVE(&cmdq->queue, item, qentry);
-		cmd_list_free(item->cmdlist);
-		free(item);
+		cmdq_free_item(item);
 	}
 	cmdq->item = NULL;
 }
@@ -0,0 +1,248 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmate.h"
+
+/*
+ * Write a recording made with tmate-record-file out as an asciicast (version
+ * 2), to be played with asciinema. A cast has a single terminal, so only one
+ * pane is exported: the one given with -p, otherwise the active pane when the
+ * recording starts. With -s, the first seconds are skipped. Like bench-trace,
+ * this is not documented.
+ */
+
+enum cmd_retval	 cmd_record_export_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_record_export_entry = {
+	.name = "record-export",
+	.alias = NULL,
+
+	.args = { "p:s:", 2, 2 },
+	.usage = "[-p pane-id] [-s seconds] file output",
+
+	.flags = 0,
+	.exec = cmd_record_export_exec
+};
+
+struct record_export {
+	FILE		*f;
+	int		 pane;
+	u_int		 sx, sy;
+	uint64_t	 first;
+
+	char		 partial[4];
+	size_t		 npartial;
+
+	u_int		 events;
+	size_t		 bytes;
+};
+
+static int	record_export_pane(msgpack_object *, int, u_int *, u_int *);
+static void	record_export_string(struct record_export *, const char *,
+		    size_t);
+static void	record_export_event(void *, uint64_t, msgpack_object *);
+
+/* Find the size of a pane in a layout event, or the active pane if id is -1. */
+static int
+record_export_pane(msgpack_object *event, int id, u_int *sx, u_int *sy)
+{
+	msgpack_object	*o, *w, *p;
+	u_int		 i, j;
+	int64_t		 active;
+
+	o = event->via.array.ptr;
+	if (event->via.array.size != 6 ||
+	    o[5].type != MSGPACK_OBJECT_ARRAY)
+		return (-1);
+	active = o[4].via.i64;
+
+	for (i = 0; i < o[5].via.array.size; i++) {
+		w = &o[5].via.array.ptr[i];
+		if (w->type != MSGPACK_OBJECT_ARRAY || w->via.array.size != 4 ||
+		    w->via.array.ptr[3].type != MSGPACK_OBJECT_ARRAY)
+			continue;
+		w = w->via.array.ptr;
+		if (id == -1 && w[0].via.i64 != active)
+			continue;
+
+		for (j = 0; j < w[3].via.array.size; j++) {
+			p = &w[3].via.array.ptr[j];
+			if (p->type != MSGPACK_OBJECT_ARRAY ||
+			    p->via.array.size != 5)
+				continue;
+			p = p->via.array.ptr;
+			if (id == -1 && p[0].via.i64 != w[2].via.i64)
+				continue;
+			if (id != -1 && p[0].via.i64 != id)
+				continue;
+			*sx = p[1].via.u64;
+			*sy = p[2].via.u64;
+			return (p[0].via.u64);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * Write output as a JSON string. A UTF-8 character cut at the end is kept for
+ * the next one, JSON cannot hold half of it.
+ */
+static void
+record_export_string(struct record_export *re, const char *buf, size_t len)
+{
+	char		*data;
+	u_char		 ch;
+	size_t		 size, i, keep;
+
+	size = re->npartial + len;
+	data = xmalloc(size);
+	memcpy(data, re->partial, re->npartial);
+	memcpy(data + re->npartial, buf, len);
+
+	/* Look back for the start of a character which does not fit. */
+	keep = 0;
+	for (i = 1; i <= size && i <= 3; i++) {
+		ch = data[size - i];
+		if ((ch & 0xc0) == 0x80)
+			continue;
+		if ((ch >= 0xc0 && ch <= 0xdf && i < 2) ||
+		    (ch >= 0xe0 && ch <= 0xef && i < 3) ||
+		    (ch >= 0xf0 && ch <= 0xf4 && i < 4))
+			keep = i;
+		break;
+	}
+	size -= keep;
+	memcpy(re->partial, data + size, keep);
+	re->npartial = keep;
+
+	fputc('"', re->f);
+	for (i = 0; i < size; i++) {
+		ch = data[i];
+		if (ch == '"' || ch == '\\')
+			fprintf(re->f, "\\%c", ch);
+		else if (ch == '\n')
+			fputs("\\n", re->f);
+		else if (ch == '\r')
+			fputs("\\r", re->f);
+		else if (ch < 0x20 || ch == 0x7f)
+			fprintf(re->f, "\\u%04x", ch);
+		else
+			fputc(ch, re->f);
+	}
+	fputc('"', re->f);
+	free(data);
+}
+
+static void
+record_export_event(void *arg, uint64_t start, msgpack_object *event)
+{
+	struct record_export	*re = arg;
+	msgpack_object		*o = event->via.array.ptr;
+	uint64_t		 ms;
+	u_int			 sx, sy;
+	int			 pane;
+
+	if (o[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+	    o[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+		return;
+	ms = o[1].via.u64;
+	if (ms < start)
+		return;
+
+	switch (o[0].via.u64) {
+	case TMATE_RECORD_LAYOUT:
+		pane = record_export_pane(event, re->pane, &sx, &sy);
+		if (pane == -1)
+			return;
+		if (re->first == 0) {
+			re->first = ms;
+			re->pane = pane;
+			re->sx = sx;
+			re->sy = sy;
+			fprintf(re->f, "{\"version\": 2, \"width\": %u, "
+			    "\"height\": %u, \"timestamp\": %llu}\n", sx, sy,
+			    (unsigned long long)(ms / 1000));
+		} else if (sx != re->sx || sy != re->sy) {
+			re->sx = sx;
+			re->sy = sy;
+			fprintf(re->f, "[%.3f, \"r\", \"%ux%u\"]\n",
+			    (ms - re->first) / 1000.0, sx, sy);
+		}
+		break;
+	case TMATE_RECORD_PTY:
+		if (re->first == 0 || event->via.array.size != 4 ||
+		    o[2].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+		    o[2].via.u64 != (uint64_t)re->pane ||
+		    o[3].type != MSGPACK_OBJECT_BIN)
+			return;
+		fprintf(re->f, "[%.3f, \"o\", ", (ms - re->first) / 1000.0);
+		record_export_string(re, o[3].via.bin.ptr, o[3].via.bin.size);
+		fputs("]\n", re->f);
+
+		re->events++;
+		re->bytes += o[3].via.bin.size;
+		break;
+	}
+}
+
+enum cmd_retval
+cmd_record_export_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct record_export	 re;
+	const char		*path = args->argv[1];
+	char			*cause;
+	long long		 skip = 0;
+	int			 error;
+
+	memset(&re, 0, sizeof re);
+	re.pane = -1;
+
+	if (args_has(args, 'p')) {
+		re.pane = args_strtonum(args, 'p', 0, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "pane-id %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+	if (args_has(args, 's')) {
+		skip = args_strtonum(args, 's', 0, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "seconds %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	if ((re.f = fopen(path, "w")) == NULL) {
+		cmdq_error(cmdq, "%s: %s", path, strerror(errno));
+		return (CMD_RETURN_ERROR);
+	}
+
+	/* Write out what is still buffered, it is part of the recording. */
+	tmate_record_flush();
+	error = tmate_record_read(args->argv[0], skip * 1000,
+	    record_export_event, &re, &cause);
+
+	if (fclose(re.f) != 0 && error == 0) {
+		cmdq_error(cmdq, "%s: %s", path, strerror(errno));
+		return (CMD_RETURN_ERROR);
+	}
+	if (error != 0) {
+		cmdq_error(cmdq, "%s", cause);
+		free(cause);
+		return (CMD_RETURN_ERROR);
+	}
+	if (re.first == 0) {
+		cmdq_error(cmdq, "no such pane in %s", args->argv[0]);
+		return (CMD_RETURN_ERROR);
+	}
+
+	cmdq_print(cmdq, "%%%d: %u events, %zu bytes", re.pane, re.events,
+	    re.bytes);
+	return (CMD_RETURN_NORMAL);
+}
@@ -30,8 +30,9 @@ const struct cmd_entry cmd_refresh_client_entry = {
 	.name = "refresh-client",
 	.alias = "refresh",
 
-	.args = { "C:St:", 0, 0 },
-	.usage = "[-S] [-C size] " CMD_TARGET_CLIENT_USAGE,
+	.args = { "BC:P:R:St:", 0, 0 },
+	.usage = "[-BS] [-C size] [-P size] [-R target-pane] "
+		 CMD_TARGET_CLIENT_USAGE,
 
 	.tflag = CMD_CLIENT,
 
@@ -44,10 +45,40 @@ cmd_refresh_client_exec(struct cmd *self, struct cmd_q *cmdq)
 {
 	struct args	*args = self->args;
 	struct client	*c = cmdq->state.c;
-	const char	*size;
+	struct window_pane *wp;
+	const char	*size, *errstr;
 	u_int		 w, h;
+	long long	 limit;
 
-	if (args_has(args, 'C')) {
+	if (args_has(args, 'B')) {
+		if (!(c->flags & CLIENT_CONTROL)) {
+			cmdq_error(cmdq, "not a control client");
+			return (CMD_RETURN_ERROR);
+		}
+		c->flags |= CLIENT_CONTROLBASE64;
+	} else if (args_has(args, 'P')) {
+		if (!(c->flags & CLIENT_CONTROL)) {
+			cmdq_error(cmdq, "not a control client");
+			return (CMD_RETURN_ERROR);
+		}
+		limit = strtonum(args_get(args, 'P'), 0, INT_MAX, &errstr);
+		if (errstr != NULL) {
+			cmdq_error(cmdq, "size %s", errstr);
+			return (CMD_RETURN_ERROR);
+		}
+		c->control_pause = limit;
+	} else if (args_has(args, 'R')) {
+		if (!(c->flags & CLIENT_CONTROL)) {
+			cmdq_error(cmdq, "not a control client");
+			return (CMD_RETURN_ERROR);
+		}
+		wp = window_pane_find_by_id_str(args_get(args, 'R'));
+		if (wp == NULL || control_notify_continue(c, wp) != 0) {
+			cmdq_error(cmdq, "pane not paused: %s",
+			    args_get(args, 'R'));
+			return (CMD_RETURN_ERROR);
+		}
+	} else if (args_has(args, 'C')) {
 		if ((size = args_get(args, 'C')) == NULL) {
 			cmdq_error(cmdq, "missing size");
 			return (CMD_RETURN_ERROR);
@@ -90,6 +90,7 @@ cmd_respawn_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 		return (CMD_RETURN_ERROR);
 	}
 	wp->flags |= PANE_REDRAW;
+	window_enqueue(w);
 	server_status_window(w);
 
 	environ_free(env);
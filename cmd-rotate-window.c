@@ -70,6 +70,7 @@ cmd_rotate_window_exec(struct cmd *self, struct cmd_q *cmdq)
 			wp->layout_cell->wp = wp;
 		wp->xoff = xoff; wp->yoff = yoff;
 		window_pane_resize(wp, sx, sy);
+		window_clear_cellmap(w);
 
 		if ((wp = TAILQ_PREV(w->active, window_panes, entry)) == NULL)
 			wp = TAILQ_LAST(&w->panes, window_panes);
@@ -97,6 +98,7 @@ cmd_rotate_window_exec(struct cmd *self, struct cmd_q *cmdq)
 			wp->layout_cell->wp = wp;
 		wp->xoff = xoff; wp->yoff = yoff;
 		window_pane_resize(wp, sx, sy);
+		window_clear_cellmap(w);
 
 		if ((wp = TAILQ_NEXT(w->active, entry)) == NULL)
 			wp = TAILQ_FIRST(&w->panes);
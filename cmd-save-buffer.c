@@ -63,10 +63,10 @@ cmd_save_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 	struct session          *s;
 	struct paste_buffer	*pb;
 	const char		*path, *bufname, *bufdata, *start, *end, *cwd;
-	const char		*flags;
 	char			*msg, *file, resolved[PATH_MAX];
 	size_t			 size, used, msglen, bufsize;
-	FILE			*f;
+	u_int			 i;
+	int			 fd, flags;
 
 	if (!args_has(args, 'b')) {
 		if ((pb = paste_get_top(NULL)) == NULL) {
@@ -81,7 +81,7 @@ cmd_save_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 			return (CMD_RETURN_ERROR);
 		}
 	}
-	bufdata = paste_buffer_data(pb, &bufsize);
+	bufsize = paste_buffer_size(pb);
 
 	if (self->entry == &cmd_show_buffer_entry)
 		path = "-";
@@ -104,9 +104,9 @@ cmd_save_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 	else
 		cwd = ".";
 
-	flags = "wb";
+	flags = O_WRONLY|O_CREAT|O_TRUNC;
 	if (args_has(self->args, 'a'))
-		flags = "ab";
+		flags = O_WRONLY|O_CREAT|O_APPEND;
 
 	if (*path == '/')
 		file = xstrdup(path);
@@ -117,24 +117,25 @@ cmd_save_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 		cmdq_error(cmdq, "%s: %s", file, strerror(ENAMETOOLONG));
 		return (CMD_RETURN_ERROR);
 	}
-	f = fopen(resolved, flags);
+	fd = open(resolved, flags, 0666);
 	free(file);
-	if (f == NULL) {
+	if (fd == -1) {
 		cmdq_error(cmdq, "%s: %s", resolved, strerror(errno));
 		return (CMD_RETURN_ERROR);
 	}
 
-	if (fwrite(bufdata, 1, bufsize, f) != bufsize) {
-		cmdq_error(cmdq, "%s: write error", resolved);
-		fclose(f);
+	if (paste_buffer_write(pb, fd) != 0) {
+		cmdq_error(cmdq, "%s: %s", resolved, strerror(errno));
+		close(fd);
 		return (CMD_RETURN_ERROR);
 	}
-	fclose(f);
+	close(fd);
 
 	return (CMD_RETURN_NORMAL);
 
 do_stdout:
-	evbuffer_add(c->stdout_data, bufdata, bufsize);
+	for (i = 0; (bufdata = paste_buffer_piece(pb, i, &size)) != NULL; i++)
+		evbuffer_add(c->stdout_data, bufdata, size);
 	server_client_push_stdout(c);
 	return (CMD_RETURN_NORMAL);
 
@@ -143,6 +144,7 @@ do_print:
 		cmdq_error(cmdq, "buffer too big");
 		return (CMD_RETURN_ERROR);
 	}
+	bufdata = paste_buffer_data(pb, NULL);
 	msg = NULL;
 
 	used = 0;
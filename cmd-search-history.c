@@ -0,0 +1,73 @@
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Print the history lines of a pane containing a string, numbered as for the
+ * goto-line copy mode command. The search-index option makes this use the
+ * index of the history.
+ */
+
+enum cmd_retval	 cmd_search_history_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_search_history_entry = {
+	.name = "search-history",
+	.alias = "searchh",
+
+	.args = { "t:", 1, 1 },
+	.usage = CMD_TARGET_PANE_USAGE " string",
+
+	.tflag = CMD_PANE,
+
+	.flags = 0,
+	.exec = cmd_search_history_exec
+};
+
+enum cmd_retval
+cmd_search_history_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct window_pane	*wp = cmdq->state.tflag.wp;
+	struct grid		*gd = wp->base.grid;
+	bitstr_t		*lines;
+	const char		*s = args->argv[0], *ptr;
+	char			*line;
+	u_int			 py;
+	int			 indexed, cis;
+
+	if (*s == '\0') {
+		cmdq_error(cmdq, "empty string");
+		return (CMD_RETURN_ERROR);
+	}
+
+	cis = 1;
+	for (ptr = s; *ptr != '\0'; ptr++) {
+		if (*ptr != tolower((u_char)*ptr)) {
+			cis = 0;
+			break;
+		}
+	}
+
+	indexed = 0;
+	if (options_get_number(wp->window->options, "search-index"))
+		indexed = grid_index_query(gd, s, &lines);
+	else
+		grid_index_disable(gd);
+
+	for (py = 0; py < gd->hsize; py++) {
+		if (indexed && !bit_test(lines, py))
+			continue;
+		line = grid_string_cells(gd, 0, py, gd->sx, NULL, 0, 0, 0);
+		if ((cis ? strcasestr(line, s) : strstr(line, s)) != NULL)
+			cmdq_print(cmdq, "%u: %s", gd->hsize - py, line);
+		free(line);
+	}
+
+	if (indexed)
+		free(lines);
+	return (CMD_RETURN_NORMAL);
+}
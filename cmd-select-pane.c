@@ -116,6 +116,7 @@ cmd_select_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 				return (CMD_RETURN_ERROR);
 			}
 			wp->flags |= PANE_REDRAW;
+			window_enqueue(wp->window);
 		}
 		if (args_has(self->args, 'g'))
 			cmdq_print(cmdq, "%s", style_tostring(&wp->colgc));
@@ -28,6 +28,7 @@
  */
 
 enum cmd_retval	 cmd_send_keys_exec(struct cmd *, struct cmd_q *);
+int		 cmd_send_keys_plain(const u_char *, size_t);
 
 const struct cmd_entry cmd_send_keys_entry = {
 	.name = "send-keys",
@@ -55,6 +56,24 @@ const struct cmd_entry cmd_send_prefix_entry = {
 	.exec = cmd_send_keys_exec
 };
 
+/* Is this ASCII or complete UTF-8 only, so it may be written as it is? */
+int
+cmd_send_keys_plain(const u_char *s, size_t len)
+{
+	struct utf8_data	ud;
+	size_t			off, n;
+
+	for (off = 0; off < len; off += n) {
+		if (s[off] < 0x80) {
+			n = 1;
+			continue;
+		}
+		if ((n = utf8_next(s + off, len - off, &ud)) == 0)
+			return (0);
+	}
+	return (1);
+}
+
 enum cmd_retval
 cmd_send_keys_exec(struct cmd *self, struct cmd_q *cmdq)
 {
@@ -63,6 +82,7 @@ cmd_send_keys_exec(struct cmd *self, struct cmd_q *cmdq)
 	struct session		*s = cmdq->state.tflag.s;
 	struct mouse_event	*m = &cmdq->item->mouse;
 	const u_char		*keystr;
+	size_t			 len;
 	int			 i, literal;
 	key_code		 key;
 
@@ -98,6 +118,11 @@ cmd_send_keys_exec(struct cmd *self, struct cmd_q *cmdq)
 				literal = 1;
 		}
 		if (literal) {
+			keystr = args->argv[i];
+			len = strlen(keystr);
+			if (cmd_send_keys_plain(keystr, len) &&
+			    window_pane_key_literal(wp, keystr, len) == 0)
+				continue;
 			for (keystr = args->argv[i]; *keystr != '\0'; keystr++)
 				window_pane_key(wp, NULL, s, *keystr, NULL);
 		}
@@ -57,8 +57,8 @@ cmd_set_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 	struct args		*args = self->args;
 	struct paste_buffer	*pb;
 	char			*bufdata, *cause;
-	const char		*bufname, *olddata;
-	size_t			 bufsize, newsize;
+	const char		*bufname;
+	size_t			 newsize;
 
 	bufname = args_get(args, 'b');
 	if (bufname == NULL)
@@ -99,20 +99,12 @@ cmd_set_buffer_exec(struct cmd *self, struct cmd_q *cmdq)
 	if ((newsize = strlen(args->argv[0])) == 0)
 		return (CMD_RETURN_NORMAL);
 
-	bufsize = 0;
-	bufdata = NULL;
+	bufdata = xmalloc(newsize);
+	memcpy(bufdata, args->argv[0], newsize);
 
-	if (args_has(args, 'a') && pb != NULL) {
-		olddata = paste_buffer_data(pb, &bufsize);
-		bufdata = xmalloc(bufsize);
-		memcpy(bufdata, olddata, bufsize);
-	}
-
-	bufdata = xrealloc(bufdata, bufsize + newsize);
-	memcpy(bufdata + bufsize, args->argv[0], newsize);
-	bufsize += newsize;
-
-	if (paste_set(bufdata, bufsize, bufname, &cause) != 0) {
+	if (!args_has(args, 'a'))
+		pb = NULL;
+	if (paste_append(pb, bufdata, newsize, bufname, &cause) != 0) {
 		cmdq_error(cmdq, "%s", cause);
 		free(bufdata);
 		free(cause);
@@ -22,6 +22,9 @@
 #include <string.h>
 
 #include "tmux.h"
+#ifdef TMATE
+#include "tmate.h"
+#endif
 
 /*
  * Set an option.
@@ -187,8 +190,10 @@ cmd_set_option_exec(struct cmd *self, struct cmd_q *cmdq)
 	/* Start or stop timers if necessary. */
 	if (strcmp(oe->name, "automatic-rename") == 0) {
 		RB_FOREACH(w, windows, &windows) {
-			if (options_get_number(w->options, "automatic-rename"))
+			if (options_get_number(w->options, "automatic-rename")) {
 				w->active->flags |= PANE_CHANGED;
+				window_enqueue(w);
+			}
 		}
 	}
 	if (strcmp(oe->name, "key-table") == 0) {
@@ -200,6 +205,17 @@ cmd_set_option_exec(struct cmd *self, struct cmd_q *cmdq)
 		status_timer_start_all();
 	if (strcmp(oe->name, "monitor-silence") == 0)
 		alerts_reset_all();
+	if (strcmp(oe->name, "shell-pool") == 0)
+		spawn_pool_update();
+#ifdef TMATE
+	if (strcmp(oe->name, "tmate-stats-interval") == 0 ||
+	    strcmp(oe->name, "tmate-latency-interval") == 0)
+		tmate_stats_timer_start();
+	if (strcmp(oe->name, "tmate-heartbeat-interval") == 0)
+		tmate_ssh_heartbeat_start(&tmate_session);
+	if (strcmp(oe->name, "tmate-replicate") == 0)
+		tmate_sync_layout();
+#endif
 
 	/* Update sizes and redraw. May not need it but meh. */
 	recalculate_sizes();
@@ -0,0 +1,91 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include "tmux.h"
+
+/*
+ * Show the places allocating most, in a build with --enable-alloc-stats.
+ */
+
+enum cmd_retval	 cmd_show_allocations_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_show_allocations_entry = {
+	.name = "show-allocations",
+	.alias = "showallocs",
+
+	.args = { "ln:", 0, 0 },
+	.usage = "[-l] [-n count]",
+
+	.flags = 0,
+	.exec = cmd_show_allocations_exec
+};
+
+#ifdef XMALLOC_STATS
+int	cmd_show_allocations_cmp_calls(const void *, const void *);
+int	cmd_show_allocations_cmp_live(const void *, const void *);
+
+int
+cmd_show_allocations_cmp_calls(const void *a0, const void *b0)
+{
+	const struct xmalloc_site	*a = a0, *b = b0;
+
+	if (a->calls != b->calls)
+		return (a->calls > b->calls ? -1 : 1);
+	return (a->bytes > b->bytes ? -1 : a->bytes < b->bytes);
+}
+
+int
+cmd_show_allocations_cmp_live(const void *a0, const void *b0)
+{
+	const struct xmalloc_site	*a = a0, *b = b0;
+
+	if (a->live != b->live)
+		return (a->live > b->live ? -1 : 1);
+	return (a->calls > b->calls ? -1 : a->calls < b->calls);
+}
+#endif
+
+enum cmd_retval
+cmd_show_allocations_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+#ifdef XMALLOC_STATS
+	struct args		*args = self->args;
+	struct xmalloc_site	*sites, *site;
+	size_t			 live, peak;
+	char			*cause;
+	u_int			 i, n, count = 20;
+
+	if (args_has(args, 'n')) {
+		count = args_strtonum(args, 'n', 1, INT_MAX, &cause);
+		if (cause != NULL) {
+			cmdq_error(cmdq, "count %s", cause);
+			free(cause);
+			return (CMD_RETURN_ERROR);
+		}
+	}
+
+	n = xmalloc_stats(&sites, &live, &peak);
+	if (args_has(args, 'l'))
+		qsort(sites, n, sizeof *sites, cmd_show_allocations_cmp_live);
+	else
+		qsort(sites, n, sizeof *sites, cmd_show_allocations_cmp_calls);
+
+	cmdq_print(cmdq, "%lu allocations from %u places, %zu bytes live "
+	    "(peak %zu)", xmalloc_calls, n, live, peak);
+	for (i = 0; i < n && i < count; i++) {
+		site = &sites[i];
+		cmdq_print(cmdq, "%s:%d: %lu calls, %zu bytes; %lu live, "
+		    "%zu bytes", site->file, site->line, site->calls,
+		    site->bytes, site->nlive, site->live);
+	}
+	free(sites);
+	return (CMD_RETURN_NORMAL);
+#else
+	(void)self;
+
+	cmdq_print(cmdq, "%lu allocations", xmalloc_calls);
+	cmdq_error(cmdq, "not built with --enable-alloc-stats");
+	return (CMD_RETURN_ERROR);
+#endif
+}
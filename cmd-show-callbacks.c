@@ -0,0 +1,53 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "tmux.h"
+
+/*
+ * Show how long the main callbacks of the server take, see watchdog.c.
+ */
+
+enum cmd_retval	 cmd_show_callbacks_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_show_callbacks_entry = {
+	.name = "show-callbacks",
+	.alias = "showcb",
+
+	.args = { "r", 0, 0 },
+	.usage = "[-r]",
+
+	.flags = 0,
+	.exec = cmd_show_callbacks_exec
+};
+
+enum cmd_retval
+cmd_show_callbacks_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args		*args = self->args;
+	struct watchdog_stats	*ws;
+	u_int			 i;
+	time_t			 t = time(NULL);
+
+	for (i = 0; i < WATCHDOG_NTYPES; i++) {
+		ws = watchdog_get(i);
+		if (ws->count == 0) {
+			cmdq_print(cmdq, "%s: none", watchdog_name(i));
+			continue;
+		}
+		cmdq_print(cmdq, "%s: %u calls, %.3f ms average, %.3f ms max, "
+		    "%u slow", watchdog_name(i), ws->count,
+		    ws->total_us / 1000.0 / ws->count, ws->max_us / 1000.0,
+		    ws->slow);
+		if (ws->slow != 0) {
+			cmdq_print(cmdq, "  last slow: %.3f ms, %lld seconds ago "
+			    "(%s)", ws->slow_us / 1000.0,
+			    (long long)(t - ws->slow_time), ws->slow_context);
+		}
+	}
+
+	if (args_has(args, 'r'))
+		watchdog_reset();
+	return (CMD_RETURN_NORMAL);
+}
@@ -0,0 +1,120 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include "tmux.h"
+#ifdef TMATE
+#include "tmate.h"
+#endif
+
+/*
+ * Show memory used by panes, sessions and buffers.
+ */
+
+enum cmd_retval	 cmd_show_memory_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_show_memory_entry = {
+	.name = "show-memory",
+	.alias = "showmem",
+
+	.args = { "at:", 0, 0 },
+	.usage = "[-a] " CMD_TARGET_SESSION_USAGE,
+
+	.tflag = CMD_SESSION,
+
+	.flags = 0,
+	.exec = cmd_show_memory_exec
+};
+
+struct cmd_show_memory_pane {
+	struct window_pane	*wp;
+	size_t			 grid;
+	size_t			 buffers;
+};
+
+int	cmd_show_memory_cmp(const void *, const void *);
+void	cmd_show_memory_add(struct cmd_show_memory_pane **, u_int *,
+	    struct window *);
+
+int
+cmd_show_memory_cmp(const void *a0, const void *b0)
+{
+	const struct cmd_show_memory_pane	*a = a0, *b = b0;
+	size_t					 sa, sb;
+
+	sa = a->grid + a->buffers;
+	sb = b->grid + b->buffers;
+	if (sa > sb)
+		return (-1);
+	if (sa < sb)
+		return (1);
+	return (a->wp->id < b->wp->id ? -1 : 1);
+}
+
+void
+cmd_show_memory_add(struct cmd_show_memory_pane **panes, u_int *npanes,
+    struct window *w)
+{
+	struct cmd_show_memory_pane	*smp;
+	struct window_pane		*wp;
+
+	TAILQ_FOREACH(wp, &w->panes, entry) {
+		*panes = xreallocarray(*panes, *npanes + 1, sizeof **panes);
+		smp = &(*panes)[(*npanes)++];
+		smp->wp = wp;
+		smp->grid = window_pane_grid_memory(wp);
+		smp->buffers = window_pane_buffer_memory(wp);
+	}
+}
+
+enum cmd_retval
+cmd_show_memory_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args			*args = self->args;
+	struct session			*s = cmdq->state.tflag.s;
+	struct cmd_show_memory_pane	*panes = NULL, *smp;
+	struct window			*w;
+	struct winlink			*wl, *wl1;
+	u_int				 npanes = 0, i;
+
+	if (args_has(args, 'a')) {
+		RB_FOREACH(w, windows, &windows)
+			cmd_show_memory_add(&panes, &npanes, w);
+	} else {
+		RB_FOREACH(wl, winlinks, &s->windows) {
+			RB_FOREACH(wl1, winlinks, &s->windows) {
+				if (wl1 == wl || wl1->window == wl->window)
+					break;
+			}
+			if (wl1 == wl)
+				cmd_show_memory_add(&panes, &npanes, wl->window);
+		}
+	}
+
+	if (npanes != 0)
+		qsort(panes, npanes, sizeof *panes, cmd_show_memory_cmp);
+	for (i = 0; i < npanes; i++) {
+		smp = &panes[i];
+		cmdq_print(cmdq, "%%%u (@%u %s): %zu bytes (grid %zu, "
+		    "buffers %zu)", smp->wp->id, smp->wp->window->id,
+		    smp->wp->window->name, smp->grid + smp->buffers, smp->grid,
+		    smp->buffers);
+	}
+	free(panes);
+
+	if (args_has(args, 'a')) {
+		RB_FOREACH(s, sessions, &sessions) {
+			cmdq_print(cmdq, "session %s: %zu bytes", s->name,
+			    session_memory(s));
+		}
+	} else
+		cmdq_print(cmdq, "session %s: %zu bytes", s->name,
+		    session_memory(s));
+	cmdq_print(cmdq, "paste buffers: %zu bytes", paste_memory());
+#ifdef TMATE
+	cmdq_print(cmdq, "tmate encoder: %zu bytes",
+	    (size_t)EVBUFFER_LENGTH(tmate_session.encoder.buffer));
+#endif
+
+	return (CMD_RETURN_NORMAL);
+}
@@ -0,0 +1,84 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmate.h"
+
+/*
+ * Show the tmate channel latency histograms and the latency to the viewers,
+ * optionally resetting them.
+ */
+
+enum cmd_retval	 cmd_show_tmate_stats_exec(struct cmd *, struct cmd_q *);
+
+const struct cmd_entry cmd_show_tmate_stats_entry = {
+	.name = "show-tmate-stats",
+	.alias = NULL,
+
+	.args = { "r", 0, 0 },
+	.usage = "[-r]",
+
+	.flags = 0,
+	.exec = cmd_show_tmate_stats_exec
+};
+
+void	cmd_show_tmate_stats_print(struct cmd_q *, const char *,
+	    struct tmate_stats_hist *, const char *(*)(int));
+
+void
+cmd_show_tmate_stats_print(struct cmd_q *cmdq, const char *dir,
+    struct tmate_stats_hist *hists, const char *(*name)(int))
+{
+	struct tmate_stats_hist	*hist;
+	char			 line[1024], tmp[64];
+	int			 i, j;
+
+	for (i = 0; i < TMATE_STATS_TYPES; i++) {
+		hist = &hists[i];
+		if (hist->count == 0)
+			continue;
+
+		cmdq_print(cmdq, "%s %s: %u messages, average %lluus, "
+		    "max %lluus", dir, name(i), hist->count,
+		    (unsigned long long)(hist->total_us / hist->count),
+		    (unsigned long long)hist->max_us);
+
+		*line = '\0';
+		for (j = 0; j < TMATE_STATS_BUCKETS; j++) {
+			if (hist->buckets[j] == 0)
+				continue;
+			if (j == TMATE_STATS_BUCKETS - 1) {
+				xsnprintf(tmp, sizeof tmp, " >=%lluus:%u",
+				    1ULL << (j - 1), hist->buckets[j]);
+			} else {
+				xsnprintf(tmp, sizeof tmp, " <%lluus:%u",
+				    1ULL << j, hist->buckets[j]);
+			}
+			strlcat(line, tmp, sizeof line);
+		}
+		cmdq_print(cmdq, " %s", line);
+	}
+}
+
+enum cmd_retval
+cmd_show_tmate_stats_exec(struct cmd *self, struct cmd_q *cmdq)
+{
+	struct args	*args = self->args;
+
+	cmd_show_tmate_stats_print(cmdq, "in", tmate_stats.in,
+	    tmate_stats_in_name);
+	cmd_show_tmate_stats_print(cmdq, "out", tmate_stats.out,
+	    tmate_stats_out_name);
+
+	if (tmate_stats.latency >= 0) {
+		cmdq_print(cmdq, "latency: %dms (server %dms, viewers %dms), "
+		    "max %dms", tmate_stats.latency, tmate_stats.server_latency,
+		    tmate_stats.viewers_latency, tmate_stats.latency_max);
+	}
+
+	if (args_has(args, 'r'))
+		tmate_stats_reset();
+
+	return (CMD_RETURN_NORMAL);
+}
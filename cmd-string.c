@@ -31,6 +31,38 @@
  * Parse a command from a string.
  */
 
+/*
+ * Commands parsed from strings not from a file are kept, the most recently
+ * used CMD_STRING_CACHE of them, so the same command given again (by
+ * run-shell, if-shell, command-prompt or the tmate server) is not parsed
+ * again. Strings which may expand $ or ~ or set a variable are not kept,
+ * since parsing them depends on or changes the environment. Entries are keyed
+ * by the string and the flags set on each command after parsing.
+ */
+#define CMD_STRING_CACHE 64
+
+struct cmd_string_entry {
+	char				*s;
+	int				 flags;
+	struct cmd_list			*cmdlist;
+
+	RB_ENTRY(cmd_string_entry)	 entry;
+	TAILQ_ENTRY(cmd_string_entry)	 lru_entry;
+};
+RB_HEAD(cmd_string_tree, cmd_string_entry);
+TAILQ_HEAD(cmd_string_lru, cmd_string_entry);
+
+struct cmd_string_tree	cmd_string_cache = RB_INITIALIZER(&cmd_string_cache);
+struct cmd_string_lru	cmd_string_lru = TAILQ_HEAD_INITIALIZER(cmd_string_lru);
+u_int			cmd_string_cached;
+
+int	 cmd_string_cmp(struct cmd_string_entry *, struct cmd_string_entry *);
+RB_PROTOTYPE(cmd_string_tree, cmd_string_entry, entry, cmd_string_cmp);
+RB_GENERATE(cmd_string_tree, cmd_string_entry, entry, cmd_string_cmp);
+
+int	 cmd_string_parse1(const char *, struct cmd_list **, const char *,
+	     u_int, char **);
+void	 cmd_string_evict(void);
 int	 cmd_string_getc(const char *, size_t *);
 void	 cmd_string_ungetc(size_t *);
 void	 cmd_string_copy(char **, char *, size_t *);
@@ -54,6 +86,28 @@ cmd_string_ungetc(size_t *p)
 	(*p)--;
 }
 
+int
+cmd_string_cmp(struct cmd_string_entry *cse1, struct cmd_string_entry *cse2)
+{
+	if (cse1->flags != cse2->flags)
+		return (cse1->flags < cse2->flags ? -1 : 1);
+	return (strcmp(cse1->s, cse2->s));
+}
+
+void
+cmd_string_evict(void)
+{
+	struct cmd_string_entry	*cse;
+
+	cse = TAILQ_LAST(&cmd_string_lru, cmd_string_lru);
+	TAILQ_REMOVE(&cmd_string_lru, cse, lru_entry);
+	RB_REMOVE(cmd_string_tree, &cmd_string_cache, cse);
+	cmd_list_free(cse->cmdlist);
+	free(cse->s);
+	free(cse);
+	cmd_string_cached--;
+}
+
 /*
  * Parse command string. Returns -1 on error. If returning -1, cause is error
  * string, or NULL for empty command.
@@ -61,6 +115,84 @@ cmd_string_ungetc(size_t *p)
 int
 cmd_string_parse(const char *s, struct cmd_list **cmdlist, const char *file,
     u_int line, char **cause)
+{
+	if (file != NULL)
+		return (cmd_string_parse1(s, cmdlist, file, line, cause));
+	return (cmd_string_parse_flags(s, cmdlist, 0, cause));
+}
+
+/* Parse a command string and set flags on each command. */
+int
+cmd_string_parse_flags(const char *s, struct cmd_list **cmdlist, int flags,
+    char **cause)
+{
+	struct cmd_string_entry	 find, *cse;
+	struct cmd		*cmd;
+
+	if (strpbrk(s, "$~=") != NULL) {
+		if (cmd_string_parse1(s, cmdlist, NULL, 0, cause) != 0)
+			return (-1);
+		TAILQ_FOREACH(cmd, &(*cmdlist)->list, qentry)
+			cmd->flags |= flags;
+		return (0);
+	}
+
+	find.s = (char *)s;
+	find.flags = flags;
+	if ((cse = RB_FIND(cmd_string_tree, &cmd_string_cache, &find)) != NULL) {
+		TAILQ_REMOVE(&cmd_string_lru, cse, lru_entry);
+		TAILQ_INSERT_HEAD(&cmd_string_lru, cse, lru_entry);
+
+		*cause = NULL;
+		*cmdlist = cse->cmdlist;
+		(*cmdlist)->references++;
+		return (0);
+	}
+
+	if (cmd_string_parse1(s, cmdlist, NULL, 0, cause) != 0)
+		return (-1);
+	TAILQ_FOREACH(cmd, &(*cmdlist)->list, qentry)
+		cmd->flags |= flags;
+
+	if (cmd_string_cached == CMD_STRING_CACHE)
+		cmd_string_evict();
+
+	cse = xmalloc(sizeof *cse);
+	cse->s = xstrdup(s);
+	cse->flags = flags;
+	cse->cmdlist = *cmdlist;
+	cse->cmdlist->references++;
+	RB_INSERT(cmd_string_tree, &cmd_string_cache, cse);
+	TAILQ_INSERT_HEAD(&cmd_string_lru, cse, lru_entry);
+	cmd_string_cached++;
+	return (0);
+}
+
+int
+cmd_string_parse1(const char *s, struct cmd_list **cmdlist, const char *file,
+    u_int line, char **cause)
+{
+	int	  argc;
+	char	**argv;
+
+	*cmdlist = NULL;
+	if (cmd_string_split(s, &argc, &argv, cause) != 0)
+		return (-1);
+
+	*cmdlist = cmd_list_parse(argc, argv, file, line, cause);
+	cmd_free_argv(argc, argv);
+	if (*cmdlist == NULL)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Split a command string into words, setting any leading variables. Returns
+ * -1 on error or if there is no command, with cause set as for
+ * cmd_string_parse.
+ */
+int
+cmd_string_split(const char *s, int *argcp, char ***argvp, char **cause)
 {
 	size_t		p;
 	int		ch, i, argc, rval;
@@ -75,8 +207,6 @@ cmd_string_parse(const char *s, struct cmd_list **cmdlist, const char *file,
 	len = 0;
 
 	*cause = NULL;
-
-	*cmdlist = NULL;
 	rval = -1;
 
 	p = 0;
@@ -133,10 +263,9 @@ cmd_string_parse(const char *s, struct cmd_list **cmdlist, const char *file,
 			if (argc == 0)
 				goto out;
 
-			*cmdlist = cmd_list_parse(argc, argv, file, line, cause);
-			if (*cmdlist == NULL)
-				goto out;
-
+			*argcp = argc;
+			*argvp = argv;
+			argv = NULL;
 			rval = 0;
 			goto out;
 		case '~':
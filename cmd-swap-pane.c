@@ -105,6 +105,8 @@ cmd_swap_pane_exec(struct cmd *self, struct cmd_q *cmdq)
 	window_pane_resize(src_wp, dst_wp->sx, dst_wp->sy);
 	dst_wp->xoff = xoff; dst_wp->yoff = yoff;
 	window_pane_resize(dst_wp, sx, sy);
+	window_clear_cellmap(src_w);
+	window_clear_cellmap(dst_w);
 
 	if (!args_has(self->args, 'd')) {
 		if (src_w != dst_w) {
@@ -116,8 +116,9 @@ cmd_unbind_key_mode_table(struct cmd *self, struct cmd_q *cmdq, key_code key)
 		while (!RB_EMPTY(mtab->tree)) {
 			mbind = RB_ROOT(mtab->tree);
 			RB_REMOVE(mode_key_tree, mtab->tree, mbind);
-			free(mbind);
+			mode_key_free(mbind);
 		}
+		mode_key_changed();
 		return (CMD_RETURN_NORMAL);
 	}
 
@@ -125,7 +126,8 @@ cmd_unbind_key_mode_table(struct cmd *self, struct cmd_q *cmdq, key_code key)
 	mtmp.mode = !!args_has(args, 'c');
 	if ((mbind = RB_FIND(mode_key_tree, mtab->tree, &mtmp)) != NULL) {
 		RB_REMOVE(mode_key_tree, mtab->tree, mbind);
-		free(mbind);
+		mode_key_free(mbind);
+		mode_key_changed();
 	}
 	return (CMD_RETURN_NORMAL);
 }
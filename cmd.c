@@ -28,6 +28,12 @@
 #include "tmux.h"
 
 extern const struct cmd_entry cmd_attach_session_entry;
+extern const struct cmd_entry cmd_bench_grid_entry;
+extern const struct cmd_entry cmd_bench_input_entry;
+extern const struct cmd_entry cmd_bench_parse_entry;
+extern const struct cmd_entry cmd_bench_tmate_entry;
+extern const struct cmd_entry cmd_bench_trace_entry;
+extern const struct cmd_entry cmd_bench_tty_entry;
 extern const struct cmd_entry cmd_bind_key_entry;
 extern const struct cmd_entry cmd_break_pane_entry;
 extern const struct cmd_entry cmd_capture_pane_entry;
@@ -78,6 +84,7 @@ extern const struct cmd_entry cmd_paste_buffer_entry;
 extern const struct cmd_entry cmd_pipe_pane_entry;
 extern const struct cmd_entry cmd_previous_layout_entry;
 extern const struct cmd_entry cmd_previous_window_entry;
+extern const struct cmd_entry cmd_record_export_entry;
 extern const struct cmd_entry cmd_refresh_client_entry;
 extern const struct cmd_entry cmd_rename_session_entry;
 extern const struct cmd_entry cmd_rename_window_entry;
@@ -87,6 +94,7 @@ extern const struct cmd_entry cmd_respawn_window_entry;
 extern const struct cmd_entry cmd_rotate_window_entry;
 extern const struct cmd_entry cmd_run_shell_entry;
 extern const struct cmd_entry cmd_save_buffer_entry;
+extern const struct cmd_entry cmd_search_history_entry;
 extern const struct cmd_entry cmd_select_layout_entry;
 extern const struct cmd_entry cmd_select_pane_entry;
 extern const struct cmd_entry cmd_select_window_entry;
@@ -98,11 +106,15 @@ extern const struct cmd_entry cmd_set_environment_entry;
 extern const struct cmd_entry cmd_set_hook_entry;
 extern const struct cmd_entry cmd_set_option_entry;
 extern const struct cmd_entry cmd_set_window_option_entry;
+extern const struct cmd_entry cmd_show_allocations_entry;
+extern const struct cmd_entry cmd_show_callbacks_entry;
 extern const struct cmd_entry cmd_show_buffer_entry;
 extern const struct cmd_entry cmd_show_environment_entry;
 extern const struct cmd_entry cmd_show_hooks_entry;
+extern const struct cmd_entry cmd_show_memory_entry;
 extern const struct cmd_entry cmd_show_messages_entry;
 extern const struct cmd_entry cmd_show_options_entry;
+extern const struct cmd_entry cmd_show_tmate_stats_entry;
 extern const struct cmd_entry cmd_show_window_options_entry;
 extern const struct cmd_entry cmd_source_file_entry;
 extern const struct cmd_entry cmd_split_window_entry;
@@ -118,6 +130,12 @@ extern const struct cmd_entry cmd_wait_for_entry;
 
 const struct cmd_entry *cmd_table[] = {
 	&cmd_attach_session_entry,
+	&cmd_bench_grid_entry,
+	&cmd_bench_input_entry,
+	&cmd_bench_parse_entry,
+	&cmd_bench_tmate_entry,
+	&cmd_bench_trace_entry,
+	&cmd_bench_tty_entry,
 	&cmd_bind_key_entry,
 	&cmd_break_pane_entry,
 	&cmd_capture_pane_entry,
@@ -167,6 +185,7 @@ const struct cmd_entry *cmd_table[] = {
 	&cmd_pipe_pane_entry,
 	&cmd_previous_layout_entry,
 	&cmd_previous_window_entry,
+	&cmd_record_export_entry,
 	&cmd_refresh_client_entry,
 	&cmd_rename_session_entry,
 	&cmd_rename_window_entry,
@@ -176,6 +195,7 @@ const struct cmd_entry *cmd_table[] = {
 	&cmd_rotate_window_entry,
 	&cmd_run_shell_entry,
 	&cmd_save_buffer_entry,
+	&cmd_search_history_entry,
 	&cmd_select_layout_entry,
 	&cmd_select_pane_entry,
 	&cmd_select_window_entry,
@@ -187,11 +207,15 @@ const struct cmd_entry *cmd_table[] = {
 	&cmd_set_hook_entry,
 	&cmd_set_option_entry,
 	&cmd_set_window_option_entry,
+	&cmd_show_allocations_entry,
+	&cmd_show_callbacks_entry,
 	&cmd_show_buffer_entry,
 	&cmd_show_environment_entry,
 	&cmd_show_hooks_entry,
+	&cmd_show_memory_entry,
 	&cmd_show_messages_entry,
 	&cmd_show_options_entry,
+	&cmd_show_tmate_stats_entry,
 	&cmd_show_window_options_entry,
 	&cmd_source_file_entry,
 	&cmd_split_window_entry,
@@ -206,6 +230,63 @@ const struct cmd_entry *cmd_table[] = {
 	NULL
 };
 
+/*
+ * Names and aliases of all commands sorted, built on first use: a command
+ * given in full, as in configuration files and from tmate, is found without
+ * going through the whole table.
+ */
+struct cmd_index_entry {
+	const char		*name;
+	const struct cmd_entry	*entry;
+};
+static struct cmd_index_entry	*cmd_index;
+static u_int			 cmd_index_size;
+
+static int	cmd_index_cmp(const void *, const void *);
+static const struct cmd_entry *cmd_index_find(const char *);
+
+static int
+cmd_index_cmp(const void *a, const void *b)
+{
+	const struct cmd_index_entry	*ie1 = a, *ie2 = b;
+
+	return (strcmp(ie1->name, ie2->name));
+}
+
+static const struct cmd_entry *
+cmd_index_find(const char *name)
+{
+	const struct cmd_entry	**entryp;
+	struct cmd_index_entry	 find, *ie;
+
+	if (cmd_index == NULL) {
+		for (entryp = cmd_table; *entryp != NULL; entryp++)
+			cmd_index_size += (*entryp)->alias != NULL ? 2 : 1;
+		cmd_index = xcalloc(cmd_index_size, sizeof *cmd_index);
+
+		ie = cmd_index;
+		for (entryp = cmd_table; *entryp != NULL; entryp++) {
+			ie->name = (*entryp)->name;
+			ie->entry = *entryp;
+			ie++;
+			if ((*entryp)->alias != NULL) {
+				ie->name = (*entryp)->alias;
+				ie->entry = *entryp;
+				ie++;
+			}
+		}
+		qsort(cmd_index, cmd_index_size, sizeof *cmd_index,
+		    cmd_index_cmp);
+	}
+
+	find.name = name;
+	ie = bsearch(&find, cmd_index, cmd_index_size, sizeof *cmd_index,
+	    cmd_index_cmp);
+	if (ie == NULL)
+		return (NULL);
+	return (ie->entry);
+}
+
 int
 cmd_pack_argv(int argc, char **argv, char *buf, size_t len)
 {
@@ -322,24 +403,15 @@ cmd_parse(int argc, char **argv, const char *file, u_int line, char **cause)
 		return (NULL);
 	}
 
-	entry = NULL;
+	/* Exact names and aliases are in the index, look for a prefix. */
+	if ((entry = cmd_index_find(argv[0])) != NULL)
+		goto found;
 	for (entryp = cmd_table; *entryp != NULL; entryp++) {
-		if ((*entryp)->alias != NULL &&
-		    strcmp((*entryp)->alias, argv[0]) == 0) {
-			ambiguous = 0;
-			entry = *entryp;
-			break;
-		}
-
 		if (strncmp((*entryp)->name, argv[0], strlen(argv[0])) != 0)
 			continue;
 		if (entry != NULL)
 			ambiguous = 1;
 		entry = *entryp;
-
-		/* Bail now if an exact match. */
-		if (strcmp(entry->name, argv[0]) == 0)
-			break;
 	}
 	if (ambiguous)
 		goto ambiguous;
@@ -348,6 +420,7 @@ cmd_parse(int argc, char **argv, const char *file, u_int line, char **cause)
 		return (NULL);
 	}
 
+found:
 	args = args_parse(entry->args.template, argc, argv);
 	if (args == NULL)
 		goto usage;
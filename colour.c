@@ -282,6 +282,19 @@ const struct colour_rgb colour_to_256[] = {
 };
 
 int	colour_cmp_rgb(const void *, const void *);
+int	colour_find_rgb1(u_char, u_char, u_char);
+
+/*
+ * Recent results of colour_find_rgb, which is called for every cell drawn in
+ * an RGB colour to a terminal without it. Direct mapped, a slot holds the RGB
+ * value with bit 24 set once used.
+ */
+#define COLOUR_CACHE_SIZE 1024
+struct colour_cache_entry {
+	u_int	rgb;
+	u_char	colour;
+};
+struct colour_cache_entry colour_cache[COLOUR_CACHE_SIZE];
 
 /* Compare function for bsearch(). */
 int
@@ -310,6 +323,21 @@ colour_cmp_rgb(const void *lhs0, const void *rhs0)
 /* Work out the nearest colour from the 256 colour set. */
 int
 colour_find_rgb(u_char r, u_char g, u_char b)
+{
+	struct colour_cache_entry	*ce;
+	u_int				 rgb;
+
+	rgb = 0x1000000 | (r << 16) | (g << 8) | b;
+	ce = &colour_cache[(rgb * 2654435761U) >> 22];
+	if (ce->rgb != rgb) {
+		ce->rgb = rgb;
+		ce->colour = colour_find_rgb1(r, g, b);
+	}
+	return (ce->colour);
+}
+
+int
+colour_find_rgb1(u_char r, u_char g, u_char b)
 {
 	struct colour_rgb	rgb = { .r = r, .g = g, .b = b }, *found;
 	u_int			distance, lowest, colour, i;
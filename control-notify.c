@@ -19,44 +19,224 @@
 
 #include <sys/types.h>
 
+#include <netinet/in.h>
+
+#include <resolv.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "tmux.h"
 
 #define CONTROL_SHOULD_NOTIFY_CLIENT(c) \
 	((c) != NULL && ((c)->flags & CLIENT_CONTROL))
 
+void	control_notify_escape(struct evbuffer *, const u_char *, size_t);
+void	control_notify_base64(struct evbuffer *, const u_char *, size_t);
+int	control_notify_paused(struct client *, struct window_pane *);
+void	control_notify_output(struct client *, struct window_pane *,
+	    const u_char *, size_t);
+
+/*
+ * Escape pane output for %output: control characters and backslash become
+ * octal \xxx. The runs of bytes in between are copied as they are and the
+ * whole line is added to the buffer at once.
+ */
+void
+control_notify_escape(struct evbuffer *message, const u_char *buf,
+    size_t len)
+{
+	static u_char	 escape[256];
+	static int	 escape_init;
+	u_char		*out;
+	size_t		 i, start, n = 0;
+	u_int		 ch;
+
+	if (!escape_init) {
+		for (ch = 0; ch < ' '; ch++)
+			escape[ch] = 1;
+		escape['\\'] = 1;
+		escape_init = 1;
+	}
+
+	out = xmalloc(len * 4);
+	for (i = 0; i < len; /* nothing */) {
+		start = i;
+		while (i < len && !escape[buf[i]])
+			i++;
+		memcpy(out + n, buf + start, i - start);
+		n += i - start;
+
+		for (; i < len && escape[buf[i]]; i++) {
+			ch = buf[i];
+			out[n++] = '\\';
+			out[n++] = '0' + (ch >> 6);
+			out[n++] = '0' + ((ch >> 3) & 7);
+			out[n++] = '0' + (ch & 7);
+		}
+	}
+	evbuffer_add(message, out, n);
+	free(out);
+}
+
+/* Encode pane output as base64 for %output-base64. */
 void
-control_notify_input(struct client *c, struct window_pane *wp,
-    struct evbuffer *input)
+control_notify_base64(struct evbuffer *message, const u_char *buf,
+    size_t len)
+{
+	char	*out;
+	size_t	 size;
+	int	 n;
+
+	size = 4 * ((len + 2) / 3) + 1;
+	out = xmalloc(size);
+	if ((n = b64_ntop(buf, len, out, size)) > 0)
+		evbuffer_add(message, out, n);
+	free(out);
+}
+
+/*
+ * A control client may set a limit on its pending output with refresh-client
+ * -P. Once more than that is waiting, panes producing output are paused for
+ * it: %pause is sent and their output is dropped until the client asks for
+ * them again with refresh-client -R, when it gets %continue and the current
+ * screen of the pane rather than everything it missed.
+ */
+int
+control_notify_paused(struct client *c, struct window_pane *wp)
+{
+	u_int	i;
+
+	for (i = 0; i < c->control_npaused; i++) {
+		if (c->control_paused[i] == wp->id)
+			return (1);
+	}
+	if (c->control_pause == 0 ||
+	    EVBUFFER_LENGTH(c->stdout_data) <= c->control_pause)
+		return (0);
+
+	c->control_paused = xreallocarray(c->control_paused,
+	    c->control_npaused + 1, sizeof *c->control_paused);
+	c->control_paused[c->control_npaused++] = wp->id;
+	control_write(c, "%%pause %%%u", wp->id);
+	return (1);
+}
+
+/* Resume a paused pane, sending its screen as it is now. */
+int
+control_notify_continue(struct client *c, struct window_pane *wp)
 {
+	struct screen		*s = &wp->base;
+	struct grid_cell	*gc = NULL;
+	struct evbuffer		*snapshot;
+	char			*line;
+	u_int			 i;
+
+	for (i = 0; i < c->control_npaused; i++) {
+		if (c->control_paused[i] == wp->id)
+			break;
+	}
+	if (i == c->control_npaused)
+		return (-1);
+	c->control_paused[i] = c->control_paused[--c->control_npaused];
+
+	control_write(c, "%%continue %%%u", wp->id);
+
+	snapshot = evbuffer_new();
+	evbuffer_add_printf(snapshot, "\033[H\033[2J");
+	for (i = 0; i < screen_size_y(s); i++) {
+		line = grid_string_cells(s->grid, 0, s->grid->hsize + i,
+		    screen_size_x(s), &gc, 1, 0, 1);
+		evbuffer_add_printf(snapshot, "\033[%u;1H%s", i + 1, line);
+		free(line);
+	}
+	evbuffer_add_printf(snapshot, "\033[0m\033[%u;%uH", s->cy + 1,
+	    s->cx + 1);
+
+	control_notify_output(c, wp, EVBUFFER_DATA(snapshot),
+	    EVBUFFER_LENGTH(snapshot));
+	evbuffer_free(snapshot);
+	return (0);
+}
+
+/* Send one block of output, escaped or encoded for this client. */
+void
+control_notify_output(struct client *c, struct window_pane *wp,
+    const u_char *buf, size_t len)
+{
+	struct evbuffer	*message;
+
+	message = evbuffer_new();
+	if (c->flags & CLIENT_CONTROLBASE64) {
+		evbuffer_add_printf(message, "%%output-base64 %%%u ", wp->id);
+		control_notify_base64(message, buf, len);
+	} else {
+		evbuffer_add_printf(message, "%%output %%%u ", wp->id);
+		control_notify_escape(message, buf, len);
+	}
+	control_write_buffer(c, message);
+	evbuffer_free(message);
+}
+
+/*
+ * Send pane output to the control clients which can see the pane. The input
+ * buffer is drained once parsed, so it only holds what was read since last
+ * time. It is escaped (or encoded) once, the first time a client needs it,
+ * and the result is shared by all of them.
+ */
+void
+control_notify_input(struct window_pane *wp, struct evbuffer *input)
+{
+	struct client	*c;
 	u_char		*buf;
 	size_t		 len;
-	struct evbuffer *message;
-	u_int		 i;
-
-	if (c->session == NULL)
-	    return;
+	struct evbuffer	*escaped = NULL, *encoded = NULL, *block, *message;
+	const char	*name;
 
 	buf = EVBUFFER_DATA(input);
 	len = EVBUFFER_LENGTH(input);
 
-	/*
-	 * Only write input if the window pane is linked to a window belonging
-	 * to the client's session.
-	 */
-	if (winlink_find_by_window(&c->session->windows, wp->window) != NULL) {
-		message = evbuffer_new();
-		evbuffer_add_printf(message, "%%output %%%u ", wp->id);
-		for (i = 0; i < len; i++) {
-			if (buf[i] < ' ' || buf[i] == '\\')
-			    evbuffer_add_printf(message, "\\%03o", buf[i]);
-			else
-			    evbuffer_add_printf(message, "%c", buf[i]);
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (!CONTROL_SHOULD_NOTIFY_CLIENT(c) || c->session == NULL)
+			continue;
+
+		/*
+		 * Only write input if the window pane is linked to a window
+		 * belonging to the client's session.
+		 */
+		if (winlink_find_by_window(&c->session->windows,
+		    wp->window) == NULL)
+			continue;
+		if (control_notify_paused(c, wp))
+			continue;
+
+		if (c->flags & CLIENT_CONTROLBASE64) {
+			if (encoded == NULL) {
+				encoded = evbuffer_new();
+				control_notify_base64(encoded, buf, len);
+			}
+			block = encoded;
+			name = "output-base64";
+		} else {
+			if (escaped == NULL) {
+				escaped = evbuffer_new();
+				control_notify_escape(escaped, buf, len);
+			}
+			block = escaped;
+			name = "output";
 		}
+
+		message = evbuffer_new();
+		evbuffer_add_printf(message, "%%%s %%%u ", name, wp->id);
+		evbuffer_add(message, EVBUFFER_DATA(block),
+		    EVBUFFER_LENGTH(block));
 		control_write_buffer(c, message);
 		evbuffer_free(message);
 	}
+
+	if (escaped != NULL)
+		evbuffer_free(escaped);
+	if (encoded != NULL)
+		evbuffer_free(encoded);
 }
 
 void
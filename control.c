@@ -55,7 +55,6 @@ control_callback(struct client *c, int closed, __unused void *data)
 {
 	char		*line, *cause;
 	struct cmd_list	*cmdlist;
-	struct cmd	*cmd;
 
 	if (closed)
 		c->flags |= CLIENT_EXIT;
@@ -69,7 +68,8 @@ control_callback(struct client *c, int closed, __unused void *data)
 			break;
 		}
 
-		if (cmd_string_parse(line, &cmdlist, NULL, 0, &cause) != 0) {
+		if (cmd_string_parse_flags(line, &cmdlist, CMD_CONTROL,
+		    &cause) != 0) {
 			c->cmdq->time = time(NULL);
 			c->cmdq->number++;
 
@@ -79,8 +79,6 @@ control_callback(struct client *c, int closed, __unused void *data)
 
 			free(cause);
 		} else {
-			TAILQ_FOREACH(cmd, &cmdlist->list, qentry)
-				cmd->flags |= CMD_CONTROL;
 			cmdq_run(c->cmdq, cmdlist, NULL);
 			cmd_list_free(cmdlist);
 		}
@@ -27,10 +27,16 @@
  * Environment - manipulate a set of environment variables.
  */
 
-RB_HEAD(environ, environ_entry);
+RB_HEAD(environ_tree, environ_entry);
 int	environ_cmp(struct environ_entry *, struct environ_entry *);
-RB_PROTOTYPE(environ, environ_entry, entry, environ_cmp);
-RB_GENERATE(environ, environ_entry, entry, environ_cmp);
+RB_PROTOTYPE(environ_tree, environ_entry, entry, environ_cmp);
+RB_GENERATE(environ_tree, environ_entry, entry, environ_cmp);
+
+/* The generation changes with each variable set, cleared or unset. */
+struct environ {
+	struct environ_tree	tree;
+	u_int			generation;
+};
 
 int
 environ_cmp(struct environ_entry *envent1, struct environ_entry *envent2)
@@ -45,7 +51,7 @@ environ_create(void)
 	struct environ	*env;
 
 	env = xcalloc(1, sizeof *env);
-	RB_INIT(env);
+	RB_INIT(&env->tree);
 
 	return (env);
 }
@@ -56,8 +62,8 @@ environ_free(struct environ *env)
 {
 	struct environ_entry	*envent, *envent1;
 
-	RB_FOREACH_SAFE(envent, environ, env, envent1) {
-		RB_REMOVE(environ, env, envent);
+	RB_FOREACH_SAFE(envent, environ_tree, &env->tree, envent1) {
+		RB_REMOVE(environ_tree, &env->tree, envent);
 		free(envent->name);
 		free(envent->value);
 		free(envent);
@@ -68,13 +74,13 @@ environ_free(struct environ *env)
 struct environ_entry *
 environ_first(struct environ *env)
 {
-	return (RB_MIN(environ, env));
+	return (RB_MIN(environ_tree, &env->tree));
 }
 
 struct environ_entry *
 environ_next(struct environ_entry *envent)
 {
-	return (RB_NEXT(environ, env, envent));
+	return (RB_NEXT(environ_tree, env, envent));
 }
 
 /* Copy one environment into another. */
@@ -83,7 +89,7 @@ environ_copy(struct environ *srcenv, struct environ *dstenv)
 {
 	struct environ_entry	*envent;
 
-	RB_FOREACH(envent, environ, srcenv) {
+	RB_FOREACH(envent, environ_tree, &srcenv->tree) {
 		if (envent->value == NULL)
 			environ_clear(dstenv, envent->name);
 		else
@@ -98,7 +104,7 @@ environ_find(struct environ *env, const char *name)
 	struct environ_entry	envent;
 
 	envent.name = (char *) name;
-	return (RB_FIND(environ, env, &envent));
+	return (RB_FIND(environ_tree, &env->tree, &envent));
 }
 
 /* Set an environment variable. */
@@ -108,6 +114,7 @@ environ_set(struct environ *env, const char *name, const char *fmt, ...)
 	struct environ_entry	*envent;
 	va_list			 ap;
 
+	env->generation++;
 	va_start(ap, fmt);
 	if ((envent = environ_find(env, name)) != NULL) {
 		free(envent->value);
@@ -116,7 +123,7 @@ environ_set(struct environ *env, const char *name, const char *fmt, ...)
 		envent = xmalloc(sizeof *envent);
 		envent->name = xstrdup(name);
 		xvasprintf(&envent->value, fmt, ap);
-		RB_INSERT(environ, env, envent);
+		RB_INSERT(environ_tree, &env->tree, envent);
 	}
 	va_end(ap);
 }
@@ -127,6 +134,7 @@ environ_clear(struct environ *env, const char *name)
 {
 	struct environ_entry	*envent;
 
+	env->generation++;
 	if ((envent = environ_find(env, name)) != NULL) {
 		free(envent->value);
 		envent->value = NULL;
@@ -134,7 +142,7 @@ environ_clear(struct environ *env, const char *name)
 		envent = xmalloc(sizeof *envent);
 		envent->name = xstrdup(name);
 		envent->value = NULL;
-		RB_INSERT(environ, env, envent);
+		RB_INSERT(environ_tree, &env->tree, envent);
 	}
 }
 
@@ -164,7 +172,8 @@ environ_unset(struct environ *env, const char *name)
 
 	if ((envent = environ_find(env, name)) == NULL)
 		return;
-	RB_REMOVE(environ, env, envent);
+	env->generation++;
+	RB_REMOVE(environ_tree, &env->tree, envent);
 	free(envent->name);
 	free(envent->value);
 	free(envent);
@@ -191,23 +200,54 @@ environ_update(const char *vars, struct environ *srcenv,
 	free(copyvars);
 }
 
-/* Push environment into the real environment - use after fork(). */
-void
-environ_push(struct environ *env)
+/* Get the generation, which changes when any variable does. */
+u_int
+environ_generation(struct environ *env)
 {
-	struct environ_entry	 *envent;
-	char			*v;
+	return (env->generation);
+}
 
-	while (*environ != NULL) {
-		v = xstrdup(*environ);
-		v[strcspn(v, "=")] = '\0';
+/* Build a NAME=VALUE array ending in NULL, for exec. */
+char **
+environ_envp(struct environ *env)
+{
+	struct environ_entry	 *envent;
+	char			**envp;
+	u_int			  n = 0;
 
-		unsetenv(v);
-		free(v);
-	}
+	RB_FOREACH(envent, environ_tree, &env->tree)
+		n++;
+	envp = xcalloc(n + 1, sizeof *envp);
 
-	RB_FOREACH(envent, environ, env) {
+	n = 0;
+	RB_FOREACH(envent, environ_tree, &env->tree) {
 		if (envent->value != NULL)
-			setenv(envent->name, envent->value, 1);
+			xasprintf(&envp[n++], "%s=%s", envent->name,
+			    envent->value);
 	}
+	return (envp);
+}
+
+/* Free an array from environ_envp. */
+void
+environ_free_envp(char **envp)
+{
+	char	**ep;
+
+	if (envp == NULL)
+		return;
+	for (ep = envp; *ep != NULL; ep++)
+		free(*ep);
+	free(envp);
+}
+
+/*
+ * Push environment into the real environment - use after fork(). The array
+ * replaces the old environment as a whole rather than clearing and setting
+ * each variable.
+ */
+void
+environ_push(struct environ *env)
+{
+	environ = environ_envp(env);
 }
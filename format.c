@@ -35,12 +35,32 @@
 
 /*
  * Build a list of key-value pairs and use them to expand #{key} entries in a
- * string.
+ * string. Templates are compiled into a list of tokens the first time they are
+ * seen and kept in a cache, so expanding the same template again does not
+ * parse it.
+ *
+ * format_defaults and the format_defaults_* functions only keep pointers to
+ * the objects they are given, and keys are worked out from them when a
+ * template is expanded. So the objects must still exist whenever the tree is
+ * expanded: most trees are expanded and freed (or reset with format_reset)
+ * before the command returns. The only tree kept longer is that of a
+ * choose-mode item, which is either expanded when the item is added and then
+ * reset, or given its session and winlink again just before each expansion
+ * once they are known to still be there.
  */
 
 struct format_entry;
+struct format_template;
+struct format_token;
 typedef void (*format_cb)(struct format_tree *, struct format_entry *);
 
+/* Compiled template token type. */
+enum format_token_type {
+	FORMAT_TOKEN_TEXT,
+	FORMAT_TOKEN_JOB,
+	FORMAT_TOKEN_REPLACE
+};
+
 void	 format_job_callback(struct job *);
 char	*format_job_get(struct format_tree *, const char *);
 void	 format_job_timer(int, short, void *);
@@ -49,20 +69,34 @@ void	 format_cb_host(struct format_tree *, struct format_entry *);
 void	 format_cb_host_short(struct format_tree *, struct format_entry *);
 void	 format_cb_pid(struct format_tree *, struct format_entry *);
 void	 format_cb_session_alerts(struct format_tree *, struct format_entry *);
+void	 format_cb_session_memory(struct format_tree *, struct format_entry *);
 void	 format_cb_window_layout(struct format_tree *, struct format_entry *);
 void	 format_cb_window_visible_layout(struct format_tree *,
 	     struct format_entry *);
 void	 format_cb_start_command(struct format_tree *, struct format_entry *);
+int	 format_pane_stale(struct window_pane *, pid_t *, struct timeval *);
+char	*format_pane_name(struct window_pane *);
+char	*format_pane_path(struct window_pane *);
 void	 format_cb_current_command(struct format_tree *, struct format_entry *);
 void	 format_cb_current_path(struct format_tree *, struct format_entry *);
 void	 format_cb_history_bytes(struct format_tree *, struct format_entry *);
 void	 format_cb_pane_tabs(struct format_tree *, struct format_entry *);
 
 char	*format_find(struct format_tree *, const char *, int);
-void	 format_add_cb(struct format_tree *, const char *, format_cb);
-void	 format_add_tv(struct format_tree *, const char *, struct timeval *);
-int	 format_replace(struct format_tree *, const char *, size_t, char **,
-	     size_t *, size_t *);
+int	 format_table_cmp(const void *, const void *);
+struct format_entry *format_table_find(struct format_tree *, const char *);
+struct format_token *format_compile_token(struct format_template *,
+	     enum format_token_type);
+void	 format_compile_text(struct format_template *, const char *, size_t);
+int	 format_compile_replace(struct format_template *, const char *, size_t);
+struct format_template *format_compile(const char *, size_t);
+void	 format_template_free(struct format_template *);
+struct format_template *format_template_get(const char *);
+void	 format_append(char **, size_t *, size_t *, const char *, size_t);
+void	 format_replace(struct format_tree *, const struct format_token *,
+	     char **, size_t *, size_t *);
+char	*format_evaluate(struct format_tree *, struct format_template *);
+int	 format_template_uses(struct format_template *, const char *);
 char	*format_time_string(time_t);
 
 void	 format_defaults_pane_tabs(struct format_tree *, struct window_pane *);
@@ -71,14 +105,26 @@ void	 format_defaults_client(struct format_tree *, struct client *);
 void	 format_defaults_winlink(struct format_tree *, struct session *,
 	     struct winlink *);
 
-/* Entry in format job tree. */
+/*
+ * Entry in format job tree. There is one per command, whoever asks for it, and
+ * it is run again at most every interval seconds, so long as it is not still
+ * running. The interval doubles (up to FORMAT_JOB_BACKOFF) each time the
+ * command fails or takes FORMAT_JOB_SLOW seconds or more, and goes back to one
+ * second once it does not. No more than FORMAT_JOB_MAX jobs run at once.
+ */
+#define FORMAT_JOB_MAX 8
+#define FORMAT_JOB_SLOW 1
+#define FORMAT_JOB_BACKOFF 64
+
 struct format_job {
 	const char		*cmd;
 
 	time_t			 last;
+	u_int			 interval;
 	char			*out;
 
 	struct job		*job;
+	struct timeval		 started;
 	int			 status;
 
 	RB_ENTRY(format_job)	 entry;
@@ -86,6 +132,7 @@ struct format_job {
 
 /* Format job tree. */
 struct event format_job_event;
+u_int	format_jobs_running;
 int	format_job_cmp(struct format_job *, struct format_job *);
 RB_HEAD(format_job_tree, format_job) format_jobs = RB_INITIALIZER();
 RB_PROTOTYPE(format_job_tree, format_job, entry, format_job_cmp);
@@ -103,6 +150,52 @@ format_job_cmp(struct format_job *fj1, struct format_job *fj2)
 #define FORMAT_BASENAME 0x2
 #define FORMAT_DIRNAME 0x4
 #define FORMAT_SUBSTITUTE 0x8
+#define FORMAT_CONDITIONAL 0x10
+
+/* Token in compiled template. */
+struct format_token {
+	enum format_token_type	 type;
+
+	char			*text;	/* literal text or key */
+	size_t			 textlen;
+
+	int			 modifiers;
+	long			 limit;
+	char			*from;
+	char			*to;
+
+	struct format_template	*cmd;	/* #() command */
+	struct format_template	*yes;	/* #{?} branches */
+	struct format_template	*no;
+};
+
+/* Compiled template. */
+struct format_template {
+	char			*fmt;
+	time_t			 last;
+
+	struct format_token	*tokens;
+	u_int			 ntokens;
+	int			 keys;	/* anything to look up or run */
+
+	RB_ENTRY(format_template) entry;
+};
+
+/* Compiled template cache. Unused templates are removed by the job timer. */
+int	format_template_cmp(struct format_template *, struct format_template *);
+RB_HEAD(format_template_tree, format_template) format_templates =
+    RB_INITIALIZER();
+RB_PROTOTYPE(format_template_tree, format_template, entry,
+    format_template_cmp);
+RB_GENERATE(format_template_tree, format_template, entry, format_template_cmp);
+
+/* Compiled template tree comparison function. */
+int
+format_template_cmp(struct format_template *tmpl1,
+    struct format_template *tmpl2)
+{
+	return (strcmp(tmpl1->fmt, tmpl2->fmt));
+}
 
 /* Entry in format tree. */
 struct format_entry {
@@ -113,13 +206,32 @@ struct format_entry {
 	RB_ENTRY(format_entry)	 entry;
 };
 
+/* Which objects format_defaults has been given. */
+#define FORMAT_DEFAULTS_CLIENT 0x1
+#define FORMAT_DEFAULTS_SESSION 0x2
+#define FORMAT_DEFAULTS_WINLINK 0x4
+#define FORMAT_DEFAULTS_WINDOW 0x8
+#define FORMAT_DEFAULTS_PANE 0x10
+#define FORMAT_DEFAULTS_PASTE 0x20
+
+/* Default key and the callback to find its value. */
+struct format_table_entry {
+	const char	*key;
+	int		 defaults;
+	format_cb	 cb;
+};
+
 /* Format entry tree. */
 struct format_tree {
+	struct client		*c;
 	struct window		*w;
 	struct session		*s;
+	struct winlink		*wl;
 	struct window_pane	*wp;
+	struct paste_buffer	*pb;
 
 	int			 flags;
+	int			 defaults;
 
 	RB_HEAD(format_entry_tree, format_entry) tree;
 };
@@ -202,10 +314,23 @@ format_job_callback(struct job *job)
 	char			*line, *buf;
 	size_t			 len;
 	struct client		*c;
+	struct timeval		 tv;
 
 	fj->job = NULL;
+	format_jobs_running--;
 	free(fj->out);
 
+	gettimeofday(&tv, NULL);
+	timersub(&tv, &fj->started, &tv);
+	if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0 ||
+	    tv.tv_sec >= FORMAT_JOB_SLOW) {
+		if (fj->interval < FORMAT_JOB_BACKOFF)
+			fj->interval *= 2;
+		log_debug("%s: %s: backing off to %us", __func__, fj->cmd,
+		    fj->interval);
+	} else
+		fj->interval = 1;
+
 	buf = NULL;
 	if ((line = evbuffer_readline(job->event->input)) == NULL) {
 		len = EVBUFFER_LENGTH(job->event->input);
@@ -237,6 +362,7 @@ format_job_get(struct format_tree *ft, const char *cmd)
 	if ((fj = RB_FIND(format_job_tree, &format_jobs, &fj0)) == NULL) {
 		fj = xcalloc(1, sizeof *fj);
 		fj->cmd = xstrdup(cmd);
+		fj->interval = 1;
 
 		xasprintf(&fj->out, "<'%s' not ready>", fj->cmd);
 
@@ -244,12 +370,17 @@ format_job_get(struct format_tree *ft, const char *cmd)
 	}
 
 	t = time(NULL);
-	if (fj->job == NULL && ((ft->flags & FORMAT_FORCE) || fj->last != t)) {
+	if (fj->job == NULL && format_jobs_running < FORMAT_JOB_MAX &&
+	    ((ft->flags & FORMAT_FORCE) || fj->last > t ||
+	    t - fj->last >= fj->interval)) {
 		fj->job = job_run(fj->cmd, NULL, NULL, format_job_callback,
 		    NULL, fj);
 		if (fj->job == NULL) {
 			free(fj->out);
 			xasprintf(&fj->out, "<'%s' didn't start>", fj->cmd);
+		} else {
+			format_jobs_running++;
+			gettimeofday(&fj->started, NULL);
 		}
 		fj->last = t;
 	}
@@ -260,11 +391,12 @@ format_job_get(struct format_tree *ft, const char *cmd)
 	return (format_expand(ft, fj->out));
 }
 
-/* Remove old jobs. */
+/* Remove old jobs and compiled templates. */
 void
 format_job_timer(__unused int fd, __unused short events, __unused void *arg)
 {
 	struct format_job	*fj, *fj1;
+	struct format_template	*tmpl, *tmpl1;
 	time_t			 now;
 	struct timeval		 tv = { .tv_sec = 60 };
 
@@ -276,8 +408,10 @@ format_job_timer(__unused int fd, __unused short events, __unused void *arg)
 
 		log_debug("%s: %s", __func__, fj->cmd);
 
-		if (fj->job != NULL)
+		if (fj->job != NULL) {
 			job_free(fj->job);
+			format_jobs_running--;
+		}
 
 		free((void *)fj->cmd);
 		free(fj->out);
@@ -285,6 +419,17 @@ format_job_timer(__unused int fd, __unused short events, __unused void *arg)
 		free(fj);
 	}
 
+	/*
+	 * Templates made by format_expand_time or from job output change
+	 * often, so do not keep anything that has not been used recently.
+	 */
+	RB_FOREACH_SAFE(tmpl, format_template_tree, &format_templates, tmpl1) {
+		if (tmpl->last > now || now - tmpl->last < 60)
+			continue;
+		RB_REMOVE(format_template_tree, &format_templates, tmpl);
+		format_template_free(tmpl);
+	}
+
 	evtimer_del(&format_job_event);
 	evtimer_add(&format_job_event, &tv);
 }
@@ -323,6 +468,17 @@ format_cb_pid(__unused struct format_tree *ft, struct format_entry *fe)
 	xasprintf(&fe->value, "%ld", (long)getpid());
 }
 
+/* Callback for session_memory. */
+void
+format_cb_session_memory(struct format_tree *ft, struct format_entry *fe)
+{
+	struct session	*s = ft->s;
+
+	if (s == NULL)
+		return;
+	xasprintf(&fe->value, "%zu", session_memory(s));
+}
+
 /* Callback for session_alerts. */
 void
 format_cb_session_alerts(struct format_tree *ft, struct format_entry *fe)
@@ -362,10 +518,7 @@ format_cb_window_layout(struct format_tree *ft, struct format_entry *fe)
 	if (w == NULL)
 		return;
 
-	if (w->saved_layout_root != NULL)
-		fe->value = layout_dump(w->saved_layout_root);
-	else
-		fe->value = layout_dump(w->layout_root);
+	fe->value = layout_dump_window(w, 0);
 }
 
 /* Callback for window_visible_layout. */
@@ -377,7 +530,7 @@ format_cb_window_visible_layout(struct format_tree *ft, struct format_entry *fe)
 	if (w == NULL)
 		return;
 
-	fe->value = layout_dump(w->layout_root);
+	fe->value = layout_dump_window(w, 1);
 }
 
 /* Callback for pane_start_command. */
@@ -392,6 +545,60 @@ format_cb_start_command(struct format_tree *ft, struct format_entry *fe)
 	fe->value = cmd_stringify_argv(wp->argc, wp->argv);
 }
 
+/*
+ * Should something looked up for the foreground process of a pane be looked up
+ * again? Looking up can mean reading from /proc, so the last one is kept until
+ * the foreground process group changes or for PANE_LOOKUP_INTERVAL, the
+ * process may exec or change directory in the same group.
+ */
+int
+format_pane_stale(struct window_pane *wp, pid_t *last, struct timeval *tv)
+{
+	struct timeval	now, offset;
+	pid_t		pgrp;
+
+	pgrp = wp->fd == -1 ? -1 : tcgetpgrp(wp->fd);
+	gettimeofday(&now, NULL);
+
+	timersub(&now, tv, &offset);
+	if (pgrp != -1 && pgrp == *last && offset.tv_sec == 0 &&
+	    offset.tv_usec < PANE_LOOKUP_INTERVAL)
+		return (0);
+
+	*last = pgrp;
+	memcpy(tv, &now, sizeof *tv);
+	return (1);
+}
+
+/* Get the name of the foreground process of a pane. */
+char *
+format_pane_name(struct window_pane *wp)
+{
+	if (format_pane_stale(wp, &wp->name_pgrp, &wp->name_time)) {
+		free(wp->name_cmd);
+		wp->name_cmd = osdep_get_name(wp->fd, wp->tty);
+	}
+	if (wp->name_cmd == NULL)
+		return (NULL);
+	return (xstrdup(wp->name_cmd));
+}
+
+/* Get the working directory of the foreground process of a pane. */
+char *
+format_pane_path(struct window_pane *wp)
+{
+	char	*cwd;
+
+	if (format_pane_stale(wp, &wp->path_pgrp, &wp->path_time)) {
+		free(wp->path_cur);
+		cwd = osdep_get_cwd(wp->fd);
+		wp->path_cur = cwd == NULL ? NULL : xstrdup(cwd);
+	}
+	if (wp->path_cur == NULL)
+		return (NULL);
+	return (xstrdup(wp->path_cur));
+}
+
 /* Callback for pane_current_command. */
 void
 format_cb_current_command(struct format_tree *ft, struct format_entry *fe)
@@ -402,7 +609,7 @@ format_cb_current_command(struct format_tree *ft, struct format_entry *fe)
 	if (wp == NULL)
 		return;
 
-	cmd = osdep_get_name(wp->fd, wp->tty);
+	cmd = format_pane_name(wp);
 	if (cmd == NULL || *cmd == '\0') {
 		free(cmd);
 		cmd = cmd_stringify_argv(wp->argc, wp->argv);
@@ -420,14 +627,11 @@ void
 format_cb_current_path(struct format_tree *ft, struct format_entry *fe)
 {
 	struct window_pane	*wp = ft->wp;
-	char			*cwd;
 
 	if (wp == NULL)
 		return;
 
-	cwd = osdep_get_cwd(wp->fd);
-	if (cwd != NULL)
-		fe->value = xstrdup(cwd);
+	fe->value = format_pane_path(wp);
 }
 
 /* Callback for history_bytes. */
@@ -447,6 +651,10 @@ format_cb_history_bytes(struct format_tree *ft, struct format_entry *fe)
 	size = 0;
 	for (i = 0; i < gd->hsize; i++) {
 		gl = &gd->linedata[i];
+		if (gl->zdata != NULL) {
+			size += gl->zsize;
+			continue;
+		}
 		size += gl->cellsize * sizeof *gl->celldata;
 		size += gl->extdsize * sizeof *gl->extddata;
 	}
@@ -481,203 +689,990 @@ format_cb_pane_tabs(struct format_tree *ft, struct format_entry *fe)
 	evbuffer_free(buffer);
 }
 
-/* Create a new tree. */
-struct format_tree *
-format_create(struct cmd_q *cmdq, int flags)
+/* Callback for alternate_on. */
+static void
+format_cb_alternate_on(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_tree	*ft;
+	xasprintf(&fe->value, "%d", ft->wp->saved_grid ? 1 : 0);
+}
 
-	if (!event_initialized(&format_job_event)) {
-		evtimer_set(&format_job_event, format_job_timer, NULL);
-		format_job_timer(-1, 0, NULL);
-	}
+/* Callback for alternate_saved_x. */
+static void
+format_cb_alternate_saved_x(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->saved_cx);
+}
 
-	ft = xcalloc(1, sizeof *ft);
-	RB_INIT(&ft->tree);
-	ft->flags = flags;
+/* Callback for alternate_saved_y. */
+static void
+format_cb_alternate_saved_y(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->saved_cy);
+}
 
-	format_add_cb(ft, "host", format_cb_host);
-	format_add_cb(ft, "host_short", format_cb_host_short);
-	format_add_cb(ft, "pid", format_cb_pid);
-	format_add(ft, "socket_path", "%s", socket_path);
-	format_add_tv(ft, "start_time", &start_time);
+/* Callback for buffer_name. */
+static void
+format_cb_buffer_name(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(paste_buffer_name(ft->pb));
+}
 
-	if (cmdq != NULL && cmdq->cmd != NULL)
-		format_add(ft, "command_name", "%s", cmdq->cmd->entry->name);
+/* Callback for buffer_sample. */
+static void
+format_cb_buffer_sample(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = paste_make_sample(ft->pb);
+}
 
-	return (ft);
+/* Callback for buffer_size. */
+static void
+format_cb_buffer_size(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%zu", paste_buffer_size(ft->pb));
 }
 
-/* Free a tree. */
-void
-format_free(struct format_tree *ft)
+/* Callback for client_activity. */
+static void
+format_cb_client_activity(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_entry	*fe, *fe1;
+	fe->t = ft->c->activity_time.tv_sec;
+}
 
-	RB_FOREACH_SAFE(fe, format_entry_tree, &ft->tree, fe1) {
-		RB_REMOVE(format_entry_tree, &ft->tree, fe);
-		free(fe->value);
-		free(fe->key);
-		free(fe);
-	}
+/* Callback for client_control_mode. */
+static void
+format_cb_client_control_mode(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->c->flags & CLIENT_CONTROL));
+}
 
-	free(ft);
+/* Callback for client_created. */
+static void
+format_cb_client_created(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = ft->c->creation_time.tv_sec;
 }
 
-/* Add a key-value pair. */
-void
-format_add(struct format_tree *ft, const char *key, const char *fmt, ...)
+/* Callback for client_height. */
+static void
+format_cb_client_height(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_entry	*fe;
-	struct format_entry	*fe_now;
-	va_list			 ap;
+	xasprintf(&fe->value, "%u", ft->c->tty.sy);
+}
 
-	fe = xmalloc(sizeof *fe);
-	fe->key = xstrdup(key);
+/* Callback for client_key_table. */
+static void
+format_cb_client_key_table(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(ft->c->keytable->name);
+}
 
-	fe_now = RB_INSERT(format_entry_tree, &ft->tree, fe);
-	if (fe_now != NULL) {
-		free(fe->key);
-		free(fe);
-		free(fe_now->value);
-		fe = fe_now;
-	}
+/* Callback for client_last_session. */
+static void
+format_cb_client_last_session(struct format_tree *ft, struct format_entry *fe)
+{
+	struct session	*s = ft->c->last_session;
 
-	fe->cb = NULL;
-	fe->t = 0;
+	if (s != NULL && session_alive(s))
+		fe->value = xstrdup(s->name);
+}
 
-	va_start(ap, fmt);
-	xvasprintf(&fe->value, fmt, ap);
-	va_end(ap);
+/* Callback for client_pid. */
+static void
+format_cb_client_pid(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%ld", (long) ft->c->pid);
 }
 
-/* Add a key and time. */
-void
-format_add_tv(struct format_tree *ft, const char *key, struct timeval *tv)
+/* Callback for client_prefix. */
+static void
+format_cb_client_prefix(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_entry	*fe;
-	struct format_entry	*fe_now;
+	struct client	*c = ft->c;
+	const char	*name;
 
-	fe = xmalloc(sizeof *fe);
-	fe->key = xstrdup(key);
+	name = server_client_get_key_table(c);
+	xasprintf(&fe->value, "%d", strcmp(c->keytable->name, name) != 0);
+}
 
-	fe_now = RB_INSERT(format_entry_tree, &ft->tree, fe);
-	if (fe_now != NULL) {
-		free(fe->key);
-		free(fe);
-		free(fe_now->value);
-		fe = fe_now;
-	}
+/* Callback for client_readonly. */
+static void
+format_cb_client_readonly(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->c->flags & CLIENT_READONLY));
+}
 
-	fe->cb = NULL;
-	fe->t = tv->tv_sec;
+/* Callback for client_session. */
+static void
+format_cb_client_session(struct format_tree *ft, struct format_entry *fe)
+{
+	if (ft->c->session != NULL)
+		fe->value = xstrdup(ft->c->session->name);
+}
 
-	fe->value = NULL;
+/* Callback for client_termname. */
+static void
+format_cb_client_termname(struct format_tree *ft, struct format_entry *fe)
+{
+	if (ft->c->tty.termname != NULL)
+		fe->value = xstrdup(ft->c->tty.termname);
 }
 
-/* Add a key and function. */
-void
-format_add_cb(struct format_tree *ft, const char *key, format_cb cb)
+/* Callback for client_tty. */
+static void
+format_cb_client_tty(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_entry	*fe;
-	struct format_entry	*fe_now;
+	if (ft->c->tty.path != NULL)
+		fe->value = xstrdup(ft->c->tty.path);
+}
 
-	fe = xmalloc(sizeof *fe);
-	fe->key = xstrdup(key);
+/* Callback for client_utf8. */
+static void
+format_cb_client_utf8(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->c->tty.flags & TTY_UTF8));
+}
 
-	fe_now = RB_INSERT(format_entry_tree, &ft->tree, fe);
-	if (fe_now != NULL) {
-		free(fe->key);
-		free(fe);
-		free(fe_now->value);
-		fe = fe_now;
-	}
+/* Callback for client_width. */
+static void
+format_cb_client_width(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->c->tty.sx);
+}
 
-	fe->cb = cb;
-	fe->t = 0;
+/* Callback for cursor_flag. */
+static void
+format_cb_cursor_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_CURSOR));
+}
 
-	fe->value = NULL;
+/* Callback for cursor_x. */
+static void
+format_cb_cursor_x(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->base.cx);
 }
 
-/* Find a format entry. */
-char *
-format_find(struct format_tree *ft, const char *key, int modifiers)
+/* Callback for cursor_y. */
+static void
+format_cb_cursor_y(struct format_tree *ft, struct format_entry *fe)
 {
-	struct format_entry	*fe, fe_find;
-	struct options_entry	*o;
-	struct environ_entry	*envent;
-	static char		 s[64];
-	const char		*found;
-	char			*copy, *saved;
+	xasprintf(&fe->value, "%u", ft->wp->base.cy);
+}
 
-	found = NULL;
+/* Callback for history_limit. */
+static void
+format_cb_history_limit(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->base.grid->hlimit);
+}
 
-	if (~modifiers & FORMAT_TIMESTRING) {
-		o = options_find(global_options, key);
-		if (o == NULL && ft->w != NULL)
-			o = options_find(ft->w->options, key);
-		if (o == NULL)
-			o = options_find(global_w_options, key);
-		if (o == NULL && ft->s != NULL)
-			o = options_find(ft->s->options, key);
-		if (o == NULL)
-			o = options_find(global_s_options, key);
-		if (o != NULL) {
-			switch (o->type) {
-			case OPTIONS_STRING:
-				found = o->str;
-				goto found;
-			case OPTIONS_NUMBER:
-				xsnprintf(s, sizeof s, "%lld", o->num);
-				found = s;
-				goto found;
-			case OPTIONS_STYLE:
-				found = style_tostring(&o->style);
-				goto found;
-			}
-		}
-	}
+/* Callback for history_size. */
+static void
+format_cb_history_size(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->base.grid->hsize);
+}
 
-	fe_find.key = (char *) key;
-	fe = RB_FIND(format_entry_tree, &ft->tree, &fe_find);
-	if (fe != NULL) {
-		if (modifiers & FORMAT_TIMESTRING) {
-			if (fe->t == 0)
-				return (NULL);
-			ctime_r(&fe->t, s);
-			s[strcspn(s, "\n")] = '\0';
-			found = s;
-			goto found;
-		}
-		if (fe->t != 0) {
-			xsnprintf(s, sizeof s, "%lld", (long long)fe->t);
-			found = s;
-			goto found;
-		}
-		if (fe->value == NULL && fe->cb != NULL)
-			fe->cb(ft, fe);
-		found = fe->value;
-		goto found;
-	}
+/* Callback for insert_flag. */
+static void
+format_cb_insert_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_INSERT));
+}
 
-	if (~modifiers & FORMAT_TIMESTRING) {
-		envent = NULL;
-		if (ft->s != NULL)
-			envent = environ_find(ft->s->environ, key);
-		if (envent == NULL)
-			envent = environ_find(global_environ, key);
-		if (envent != NULL) {
-			found = envent->value;
-			goto found;
-		}
-	}
+/* Callback for keypad_cursor_flag. */
+static void
+format_cb_keypad_cursor_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_KCURSOR));
+}
 
-	return (NULL);
+/* Callback for keypad_flag. */
+static void
+format_cb_keypad_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_KKEYPAD));
+}
 
-found:
-	if (found == NULL)
-		return (NULL);
-	copy = xstrdup(found);
+/* Callback for mouse_any_flag. */
+static void
+format_cb_mouse_any_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d",
+	    !!(ft->wp->base.mode & (MODE_MOUSE_STANDARD|MODE_MOUSE_BUTTON)));
+}
+
+/* Callback for mouse_button_flag. */
+static void
+format_cb_mouse_button_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_MOUSE_BUTTON));
+}
+
+/* Callback for mouse_standard_flag. */
+static void
+format_cb_mouse_standard_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d",
+	    !!(ft->wp->base.mode & MODE_MOUSE_STANDARD));
+}
+
+/* Callback for pane_active. */
+static void
+format_cb_pane_active(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wp == ft->wp->window->active);
+}
+
+/* Callback for pane_bottom. */
+static void
+format_cb_pane_bottom(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	if (window_pane_visible(wp))
+		xasprintf(&fe->value, "%u", wp->yoff + wp->sy - 1);
+}
+
+/* Callback for pane_dead. */
+static void
+format_cb_pane_dead(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wp->fd == -1);
+}
+
+/* Callback for pane_dead_status. */
+static void
+format_cb_pane_dead_status(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	if (wp->fd == -1 && WIFEXITED(wp->status))
+		xasprintf(&fe->value, "%d", WEXITSTATUS(wp->status));
+}
+
+/* Callback for pane_height. */
+static void
+format_cb_pane_height(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->sy);
+}
+
+/* Callback for pane_id. */
+static void
+format_cb_pane_id(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%%%u", ft->wp->id);
+}
+
+/* Callback for pane_in_mode. */
+static void
+format_cb_pane_in_mode(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wp->screen != &ft->wp->base);
+}
+
+/* Callback for pane_index. */
+static void
+format_cb_pane_index(struct format_tree *ft, struct format_entry *fe)
+{
+	u_int	idx;
+
+	if (window_pane_index(ft->wp, &idx) != 0)
+		fatalx("index not found");
+	xasprintf(&fe->value, "%u", idx);
+}
+
+/* Callback for pane_input_off. */
+static void
+format_cb_pane_input_off(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->flags & PANE_INPUTOFF));
+}
+
+/* Callback for pane_left. */
+static void
+format_cb_pane_left(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	if (window_pane_visible(wp))
+		xasprintf(&fe->value, "%u", wp->xoff);
+}
+
+/* Callback for pane_memory. */
+static void
+format_cb_pane_memory(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	xasprintf(&fe->value, "%zu", window_pane_grid_memory(wp) +
+	    window_pane_buffer_memory(wp));
+}
+
+/* Callback for pane_pid. */
+static void
+format_cb_pane_pid(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%ld", (long) ft->wp->pid);
+}
+
+/* Callback for pane_read_mode. */
+static void
+format_cb_pane_read_mode(struct format_tree *ft, struct format_entry *fe)
+{
+	if (ft->wp->read_size > READ_SIZE)
+		fe->value = xstrdup("bulk");
+	else
+		fe->value = xstrdup("interactive");
+}
+
+/* Callback for pane_right. */
+static void
+format_cb_pane_right(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	if (window_pane_visible(wp))
+		xasprintf(&fe->value, "%u", wp->xoff + wp->sx - 1);
+}
+
+/* Callback for pane_synchronized. */
+static void
+format_cb_pane_synchronized(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	xasprintf(&fe->value, "%d",
+	    !!options_get_number(wp->window->options, "synchronize-panes"));
+}
+
+/* Callback for pane_throttled. */
+static void
+format_cb_pane_throttled(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->flags & PANE_THROTTLED));
+}
+
+/* Callback for pane_title. */
+static void
+format_cb_pane_title(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(ft->wp->base.title);
+}
+
+/* Callback for pane_top. */
+static void
+format_cb_pane_top(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+
+	if (window_pane_visible(wp))
+		xasprintf(&fe->value, "%u", wp->yoff);
+}
+
+/* Callback for pane_tty. */
+static void
+format_cb_pane_tty(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(ft->wp->tty);
+}
+
+/* Callback for pane_width. */
+static void
+format_cb_pane_width(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->sx);
+}
+
+/* Callback for scroll_position. */
+static void
+format_cb_scroll_position(struct format_tree *ft, struct format_entry *fe)
+{
+	int	scroll_position;
+
+	scroll_position = window_copy_scroll_position(ft->wp);
+	if (scroll_position != -1)
+		xasprintf(&fe->value, "%d", scroll_position);
+}
+
+/* Callback for scroll_region_lower. */
+static void
+format_cb_scroll_region_lower(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->base.rlower);
+}
+
+/* Callback for scroll_region_upper. */
+static void
+format_cb_scroll_region_upper(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->wp->base.rupper);
+}
+
+/* Callback for session_activity. */
+static void
+format_cb_session_activity(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = ft->s->activity_time.tv_sec;
+}
+
+/* Callback for session_attached. */
+static void
+format_cb_session_attached(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->s->attached);
+}
+
+/* Callback for session_created. */
+static void
+format_cb_session_created(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = ft->s->creation_time.tv_sec;
+}
+
+/* Callback for session_group. */
+static void
+format_cb_session_group(struct format_tree *ft, struct format_entry *fe)
+{
+	struct session_group	*sg;
+
+	if ((sg = session_group_find(ft->s)) != NULL)
+		xasprintf(&fe->value, "%u", session_group_index(sg));
+}
+
+/* Callback for session_grouped. */
+static void
+format_cb_session_grouped(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", session_group_find(ft->s) != NULL);
+}
+
+/* Callback for session_height. */
+static void
+format_cb_session_height(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->s->sy);
+}
+
+/* Callback for session_id. */
+static void
+format_cb_session_id(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "$%u", ft->s->id);
+}
+
+/* Callback for session_last_attached. */
+static void
+format_cb_session_last_attached(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = ft->s->last_attached_time.tv_sec;
+}
+
+/* Callback for session_many_attached. */
+static void
+format_cb_session_many_attached(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->s->attached > 1);
+}
+
+/* Callback for session_name. */
+static void
+format_cb_session_name(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(ft->s->name);
+}
+
+/* Callback for session_width. */
+static void
+format_cb_session_width(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->s->sx);
+}
+
+/* Callback for session_windows. */
+static void
+format_cb_session_windows(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", winlink_count(&ft->s->windows));
+}
+
+/* Callback for socket_path. */
+static void
+format_cb_socket_path(__unused struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(socket_path);
+}
+
+/* Callback for start_time. */
+static void
+format_cb_start_time(__unused struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = start_time.tv_sec;
+}
+
+/* Callback for window_active. */
+static void
+format_cb_window_active(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wl == ft->s->curw);
+}
+
+/* Callback for window_activity. */
+static void
+format_cb_window_activity(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->t = ft->w->activity_time.tv_sec;
+}
+
+/* Callback for window_activity_flag. */
+static void
+format_cb_window_activity_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wl->flags & WINLINK_ACTIVITY));
+}
+
+/* Callback for window_bell_flag. */
+static void
+format_cb_window_bell_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wl->flags & WINLINK_BELL));
+}
+
+/* Callback for window_flags. */
+static void
+format_cb_window_flags(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = window_printable_flags(ft->s, ft->wl);
+}
+
+/* Callback for window_height. */
+static void
+format_cb_window_height(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->w->sy);
+}
+
+/* Callback for window_id. */
+static void
+format_cb_window_id(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "@%u", ft->w->id);
+}
+
+/* Callback for window_index. */
+static void
+format_cb_window_index(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wl->idx);
+}
+
+/* Callback for window_last_flag. */
+static void
+format_cb_window_last_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", ft->wl == TAILQ_FIRST(&ft->s->lastw));
+}
+
+/* Callback for window_linked. */
+static void
+format_cb_window_linked(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", session_is_linked(ft->s, ft->wl->window));
+}
+
+/* Callback for window_name. */
+static void
+format_cb_window_name(struct format_tree *ft, struct format_entry *fe)
+{
+	fe->value = xstrdup(ft->w->name);
+}
+
+/* Callback for window_panes. */
+static void
+format_cb_window_panes(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", window_count_panes(ft->w));
+}
+
+/* Callback for window_silence_flag. */
+static void
+format_cb_window_silence_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wl->flags & WINLINK_SILENCE));
+}
+
+/* Callback for window_width. */
+static void
+format_cb_window_width(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%u", ft->w->sx);
+}
+
+/* Callback for window_zoomed_flag. */
+static void
+format_cb_window_zoomed_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->w->flags & WINDOW_ZOOMED));
+}
+
+/* Callback for wrap_flag. */
+static void
+format_cb_wrap_flag(struct format_tree *ft, struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%d", !!(ft->wp->base.mode & MODE_WRAP));
+}
+
+/*
+ * Default keys, sorted by name. These are only looked up when a template
+ * uses them and then only if format_defaults has been given the object they
+ * need.
+ */
+const struct format_table_entry format_table[] = {
+	{ "alternate_on", FORMAT_DEFAULTS_PANE, format_cb_alternate_on },
+	{ "alternate_saved_x", FORMAT_DEFAULTS_PANE,
+	  format_cb_alternate_saved_x },
+	{ "alternate_saved_y", FORMAT_DEFAULTS_PANE,
+	  format_cb_alternate_saved_y },
+	{ "buffer_name", FORMAT_DEFAULTS_PASTE, format_cb_buffer_name },
+	{ "buffer_sample", FORMAT_DEFAULTS_PASTE, format_cb_buffer_sample },
+	{ "buffer_size", FORMAT_DEFAULTS_PASTE, format_cb_buffer_size },
+	{ "client_activity", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_activity },
+	{ "client_control_mode", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_control_mode },
+	{ "client_created", FORMAT_DEFAULTS_CLIENT, format_cb_client_created },
+	{ "client_height", FORMAT_DEFAULTS_CLIENT, format_cb_client_height },
+	{ "client_key_table", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_key_table },
+	{ "client_last_session", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_last_session },
+	{ "client_pid", FORMAT_DEFAULTS_CLIENT, format_cb_client_pid },
+	{ "client_prefix", FORMAT_DEFAULTS_CLIENT, format_cb_client_prefix },
+	{ "client_readonly", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_readonly },
+	{ "client_session", FORMAT_DEFAULTS_CLIENT, format_cb_client_session },
+	{ "client_termname", FORMAT_DEFAULTS_CLIENT,
+	  format_cb_client_termname },
+	{ "client_tty", FORMAT_DEFAULTS_CLIENT, format_cb_client_tty },
+	{ "client_utf8", FORMAT_DEFAULTS_CLIENT, format_cb_client_utf8 },
+	{ "client_width", FORMAT_DEFAULTS_CLIENT, format_cb_client_width },
+	{ "cursor_flag", FORMAT_DEFAULTS_PANE, format_cb_cursor_flag },
+	{ "cursor_x", FORMAT_DEFAULTS_PANE, format_cb_cursor_x },
+	{ "cursor_y", FORMAT_DEFAULTS_PANE, format_cb_cursor_y },
+	{ "history_bytes", FORMAT_DEFAULTS_PANE, format_cb_history_bytes },
+	{ "history_limit", FORMAT_DEFAULTS_PANE, format_cb_history_limit },
+	{ "history_size", FORMAT_DEFAULTS_PANE, format_cb_history_size },
+	{ "host", 0, format_cb_host },
+	{ "host_short", 0, format_cb_host_short },
+	{ "insert_flag", FORMAT_DEFAULTS_PANE, format_cb_insert_flag },
+	{ "keypad_cursor_flag", FORMAT_DEFAULTS_PANE,
+	  format_cb_keypad_cursor_flag },
+	{ "keypad_flag", FORMAT_DEFAULTS_PANE, format_cb_keypad_flag },
+	{ "mouse_any_flag", FORMAT_DEFAULTS_PANE, format_cb_mouse_any_flag },
+	{ "mouse_button_flag", FORMAT_DEFAULTS_PANE,
+	  format_cb_mouse_button_flag },
+	{ "mouse_standard_flag", FORMAT_DEFAULTS_PANE,
+	  format_cb_mouse_standard_flag },
+	{ "pane_active", FORMAT_DEFAULTS_PANE, format_cb_pane_active },
+	{ "pane_bottom", FORMAT_DEFAULTS_PANE, format_cb_pane_bottom },
+	{ "pane_current_command", FORMAT_DEFAULTS_PANE,
+	  format_cb_current_command },
+	{ "pane_current_path", FORMAT_DEFAULTS_PANE, format_cb_current_path },
+	{ "pane_dead", FORMAT_DEFAULTS_PANE, format_cb_pane_dead },
+	{ "pane_dead_status", FORMAT_DEFAULTS_PANE,
+	  format_cb_pane_dead_status },
+	{ "pane_height", FORMAT_DEFAULTS_PANE, format_cb_pane_height },
+	{ "pane_id", FORMAT_DEFAULTS_PANE, format_cb_pane_id },
+	{ "pane_in_mode", FORMAT_DEFAULTS_PANE, format_cb_pane_in_mode },
+	{ "pane_index", FORMAT_DEFAULTS_PANE, format_cb_pane_index },
+	{ "pane_input_off", FORMAT_DEFAULTS_PANE, format_cb_pane_input_off },
+	{ "pane_left", FORMAT_DEFAULTS_PANE, format_cb_pane_left },
+	{ "pane_memory", FORMAT_DEFAULTS_PANE, format_cb_pane_memory },
+	{ "pane_pid", FORMAT_DEFAULTS_PANE, format_cb_pane_pid },
+	{ "pane_read_mode", FORMAT_DEFAULTS_PANE, format_cb_pane_read_mode },
+	{ "pane_right", FORMAT_DEFAULTS_PANE, format_cb_pane_right },
+	{ "pane_start_command", FORMAT_DEFAULTS_PANE, format_cb_start_command },
+	{ "pane_synchronized", FORMAT_DEFAULTS_PANE,
+	  format_cb_pane_synchronized },
+	{ "pane_tabs", FORMAT_DEFAULTS_PANE, format_cb_pane_tabs },
+	{ "pane_throttled", FORMAT_DEFAULTS_PANE, format_cb_pane_throttled },
+	{ "pane_title", FORMAT_DEFAULTS_PANE, format_cb_pane_title },
+	{ "pane_top", FORMAT_DEFAULTS_PANE, format_cb_pane_top },
+	{ "pane_tty", FORMAT_DEFAULTS_PANE, format_cb_pane_tty },
+	{ "pane_width", FORMAT_DEFAULTS_PANE, format_cb_pane_width },
+	{ "pid", 0, format_cb_pid },
+	{ "scroll_position", FORMAT_DEFAULTS_PANE, format_cb_scroll_position },
+	{ "scroll_region_lower", FORMAT_DEFAULTS_PANE,
+	  format_cb_scroll_region_lower },
+	{ "scroll_region_upper", FORMAT_DEFAULTS_PANE,
+	  format_cb_scroll_region_upper },
+	{ "session_activity", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_activity },
+	{ "session_alerts", FORMAT_DEFAULTS_SESSION, format_cb_session_alerts },
+	{ "session_attached", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_attached },
+	{ "session_created", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_created },
+	{ "session_group", FORMAT_DEFAULTS_SESSION, format_cb_session_group },
+	{ "session_grouped", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_grouped },
+	{ "session_height", FORMAT_DEFAULTS_SESSION, format_cb_session_height },
+	{ "session_id", FORMAT_DEFAULTS_SESSION, format_cb_session_id },
+	{ "session_last_attached", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_last_attached },
+	{ "session_many_attached", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_many_attached },
+	{ "session_memory", FORMAT_DEFAULTS_SESSION, format_cb_session_memory },
+	{ "session_name", FORMAT_DEFAULTS_SESSION, format_cb_session_name },
+	{ "session_width", FORMAT_DEFAULTS_SESSION, format_cb_session_width },
+	{ "session_windows", FORMAT_DEFAULTS_SESSION,
+	  format_cb_session_windows },
+	{ "socket_path", 0, format_cb_socket_path },
+	{ "start_time", 0, format_cb_start_time },
+	{ "window_active", FORMAT_DEFAULTS_WINLINK, format_cb_window_active },
+	{ "window_activity", FORMAT_DEFAULTS_WINDOW,
+	  format_cb_window_activity },
+	{ "window_activity_flag", FORMAT_DEFAULTS_WINLINK,
+	  format_cb_window_activity_flag },
+	{ "window_bell_flag", FORMAT_DEFAULTS_WINLINK,
+	  format_cb_window_bell_flag },
+	{ "window_flags", FORMAT_DEFAULTS_WINLINK, format_cb_window_flags },
+	{ "window_height", FORMAT_DEFAULTS_WINDOW, format_cb_window_height },
+	{ "window_id", FORMAT_DEFAULTS_WINDOW, format_cb_window_id },
+	{ "window_index", FORMAT_DEFAULTS_WINLINK, format_cb_window_index },
+	{ "window_last_flag", FORMAT_DEFAULTS_WINLINK,
+	  format_cb_window_last_flag },
+	{ "window_layout", FORMAT_DEFAULTS_WINDOW, format_cb_window_layout },
+	{ "window_linked", FORMAT_DEFAULTS_WINLINK, format_cb_window_linked },
+	{ "window_name", FORMAT_DEFAULTS_WINDOW, format_cb_window_name },
+	{ "window_panes", FORMAT_DEFAULTS_WINDOW, format_cb_window_panes },
+	{ "window_silence_flag", FORMAT_DEFAULTS_WINLINK,
+	  format_cb_window_silence_flag },
+	{ "window_visible_layout", FORMAT_DEFAULTS_WINDOW,
+	  format_cb_window_visible_layout },
+	{ "window_width", FORMAT_DEFAULTS_WINDOW, format_cb_window_width },
+	{ "window_zoomed_flag", FORMAT_DEFAULTS_WINDOW,
+	  format_cb_window_zoomed_flag },
+	{ "wrap_flag", FORMAT_DEFAULTS_PANE, format_cb_wrap_flag },
+};
+
+/* Default key table comparison function. */
+int
+format_table_cmp(const void *key, const void *value)
+{
+	const struct format_table_entry	*fte = value;
+
+	return (strcmp(key, fte->key));
+}
+
+/*
+ * Find a default key for an object the tree has and add it with its value,
+ * which is worked out now and kept.
+ */
+struct format_entry *
+format_table_find(struct format_tree *ft, const char *key)
+{
+	const struct format_table_entry	*fte;
+	struct format_entry		*fe;
+
+	fte = bsearch(key, format_table, nitems(format_table),
+	    sizeof *format_table, format_table_cmp);
+	if (fte == NULL || (fte->defaults & ~ft->defaults) != 0)
+		return (NULL);
+
+	fe = xcalloc(1, sizeof *fe);
+	fe->cb = fte->cb;
+	fe->cb(ft, fe);
+	if (fe->value == NULL && fe->t == 0) {
+		free(fe);
+		return (NULL);
+	}
+
+	fe->key = xstrdup(key);
+	RB_INSERT(format_entry_tree, &ft->tree, fe);
+	return (fe);
+}
+
+/* Create a new tree. */
+struct format_tree *
+format_create(struct cmd_q *cmdq, int flags)
+{
+	struct format_tree	*ft;
+
+	if (!event_initialized(&format_job_event)) {
+		evtimer_set(&format_job_event, format_job_timer, NULL);
+		event_priority_set(&format_job_event, EVENT_PRI_BACKGROUND);
+		format_job_timer(-1, 0, NULL);
+	}
+
+	ft = xcalloc(1, sizeof *ft);
+	RB_INIT(&ft->tree);
+	ft->flags = flags;
+
+	if (cmdq != NULL && cmdq->cmd != NULL)
+		format_add(ft, "command_name", "%s", cmdq->cmd->entry->name);
+
+	return (ft);
+}
+
+/* Free a tree. */
+void
+format_free(struct format_tree *ft)
+{
+	struct format_entry	*fe, *fe1;
+
+	RB_FOREACH_SAFE(fe, format_entry_tree, &ft->tree, fe1) {
+		RB_REMOVE(format_entry_tree, &ft->tree, fe);
+		free(fe->value);
+		free(fe->key);
+		free(fe);
+	}
+
+	free(ft);
+}
+
+/*
+ * Forget the objects given to format_defaults and what was worked out from
+ * them, so the tree can be used again for the next item of a list. Keys added
+ * with format_add are kept.
+ */
+void
+format_reset(struct format_tree *ft)
+{
+	struct format_entry	*fe, *fe1;
+
+	RB_FOREACH_SAFE(fe, format_entry_tree, &ft->tree, fe1) {
+		if (fe->cb == NULL)
+			continue;
+		RB_REMOVE(format_entry_tree, &ft->tree, fe);
+		free(fe->value);
+		free(fe->key);
+		free(fe);
+	}
+
+	ft->c = NULL;
+	ft->w = NULL;
+	ft->s = NULL;
+	ft->wl = NULL;
+	ft->wp = NULL;
+	ft->pb = NULL;
+	ft->defaults = 0;
+}
+
+/* Add a key-value pair. */
+void
+format_add(struct format_tree *ft, const char *key, const char *fmt, ...)
+{
+	struct format_entry	*fe;
+	struct format_entry	*fe_now;
+	va_list			 ap;
+
+	fe = xmalloc(sizeof *fe);
+	fe->key = xstrdup(key);
+
+	fe_now = RB_INSERT(format_entry_tree, &ft->tree, fe);
+	if (fe_now != NULL) {
+		free(fe->key);
+		free(fe);
+		free(fe_now->value);
+		fe = fe_now;
+	}
+
+	fe->cb = NULL;
+	fe->t = 0;
+
+	va_start(ap, fmt);
+	xvasprintf(&fe->value, fmt, ap);
+	va_end(ap);
+}
+
+/* Find a format entry. */
+char *
+format_find(struct format_tree *ft, const char *key, int modifiers)
+{
+	struct format_entry	*fe, fe_find;
+	struct options_entry	*o;
+	struct environ_entry	*envent;
+	static char		 s[64];
+	const char		*found;
+	char			*copy, *saved;
+
+	found = NULL;
+
+	if (~modifiers & FORMAT_TIMESTRING) {
+		o = options_find(global_options, key);
+		if (o == NULL && ft->w != NULL)
+			o = options_find(ft->w->options, key);
+		if (o == NULL)
+			o = options_find(global_w_options, key);
+		if (o == NULL && ft->s != NULL)
+			o = options_find(ft->s->options, key);
+		if (o == NULL)
+			o = options_find(global_s_options, key);
+		if (o != NULL) {
+			switch (o->type) {
+			case OPTIONS_STRING:
+				found = o->str;
+				goto found;
+			case OPTIONS_NUMBER:
+				xsnprintf(s, sizeof s, "%lld", o->num);
+				found = s;
+				goto found;
+			case OPTIONS_STYLE:
+				found = style_tostring(&o->style);
+				goto found;
+			}
+		}
+	}
+
+	fe_find.key = (char *) key;
+	fe = RB_FIND(format_entry_tree, &ft->tree, &fe_find);
+	if (fe == NULL)
+		fe = format_table_find(ft, key);
+	if (fe != NULL) {
+		if (modifiers & FORMAT_TIMESTRING) {
+			if (fe->t == 0)
+				return (NULL);
+			ctime_r(&fe->t, s);
+			s[strcspn(s, "\n")] = '\0';
+			found = s;
+			goto found;
+		}
+		if (fe->t != 0) {
+			xsnprintf(s, sizeof s, "%lld", (long long)fe->t);
+			found = s;
+			goto found;
+		}
+		if (fe->value == NULL && fe->cb != NULL)
+			fe->cb(ft, fe);
+		found = fe->value;
+		goto found;
+	}
+
+	if (~modifiers & FORMAT_TIMESTRING) {
+#ifdef TMATE
+		if ((found = tmate_format_find(key)) != NULL)
+			goto found;
+#endif
+		envent = NULL;
+		if (ft->s != NULL)
+			envent = environ_find(ft->s->environ, key);
+		if (envent == NULL)
+			envent = environ_find(global_environ, key);
+		if (envent != NULL) {
+			found = envent->value;
+			goto found;
+		}
+	}
+
+	return (NULL);
+
+found:
+	if (found == NULL)
+		return (NULL);
+	copy = xstrdup(found);
 	if (modifiers & FORMAT_BASENAME) {
 		saved = copy;
 		copy = xstrdup(basename(saved));
@@ -691,19 +1686,59 @@ found:
 	return (copy);
 }
 
+/* Add text to a template, merging it into the last token if that is text. */
+void
+format_compile_text(struct format_template *tmpl, const char *s, size_t n)
+{
+	struct format_token	*tok;
+
+	if (n == 0)
+		return;
+
+	tok = NULL;
+	if (tmpl->ntokens != 0)
+		tok = &tmpl->tokens[tmpl->ntokens - 1];
+	if (tok == NULL || tok->type != FORMAT_TOKEN_TEXT) {
+		tok = format_compile_token(tmpl, FORMAT_TOKEN_TEXT);
+		tok->text = xmalloc(1);
+	}
+
+	tok->text = xrealloc(tok->text, tok->textlen + n + 1);
+	memcpy(tok->text + tok->textlen, s, n);
+	tok->textlen += n;
+	tok->text[tok->textlen] = '\0';
+}
+
+/* Add an empty token to a template. */
+struct format_token *
+format_compile_token(struct format_template *tmpl, enum format_token_type type)
+{
+	struct format_token	*tok;
+
+	tmpl->tokens = xreallocarray(tmpl->tokens, tmpl->ntokens + 1,
+	    sizeof *tmpl->tokens);
+	tok = &tmpl->tokens[tmpl->ntokens++];
+	memset(tok, 0, sizeof *tok);
+	tok->type = type;
+
+	if (type != FORMAT_TOKEN_TEXT)
+		tmpl->keys = 1;
+	return (tok);
+}
+
 /*
- * Replace a key/value pair in buffer. #{blah} is expanded directly,
- * #{?blah,a,b} is replace with a if blah exists and is nonzero else b.
+ * Compile a key to be replaced. #{blah} is expanded directly, #{?blah,a,b} is
+ * replaced with a if blah exists and is nonzero else b.
  */
 int
-format_replace(struct format_tree *ft, const char *key, size_t keylen,
-    char **buf, size_t *len, size_t *off)
+format_compile_replace(struct format_template *tmpl, const char *key,
+    size_t keylen)
 {
-	char		*copy, *copy0, *endptr, *ptr, *found, *new, *value;
-	char		*from = NULL, *to = NULL;
-	size_t		 valuelen, newlen, fromlen, tolen, used;
-	long		 limit = 0;
-	int		 modifiers = 0, brackets;
+	struct format_token	*tok;
+	char			*copy, *copy0, *endptr, *ptr;
+	char			*from = NULL, *to = NULL, *value;
+	long			 limit = 0;
+	int			 modifiers = 0, brackets;
 
 	/* Make a copy of the key. */
 	copy0 = copy = xmalloc(keylen + 1);
@@ -749,68 +1784,247 @@ format_replace(struct format_tree *ft, const char *key, size_t keylen,
 			copy = copy0;
 			break;
 		}
-		copy[0] = '\0';
-		to = copy + 1;
-		for (copy = to; *copy != '\0' && *copy != '/'; copy++)
-			/* nothing */;
-		if (copy[0] != '/' || copy[1] != ':') {
-			copy = copy0;
-			break;
+		copy[0] = '\0';
+		to = copy + 1;
+		for (copy = to; *copy != '\0' && *copy != '/'; copy++)
+			/* nothing */;
+		if (copy[0] != '/' || copy[1] != ':') {
+			copy = copy0;
+			break;
+		}
+		copy[0] = '\0';
+
+		modifiers |= FORMAT_SUBSTITUTE;
+		copy += 2;
+		break;
+	}
+
+	/*
+	 * Is this a conditional? If so, split out the key and compile both
+	 * branches.
+	 */
+	value = NULL;
+	if (*copy == '?') {
+		ptr = strchr(copy, ',');
+		if (ptr == NULL)
+			goto fail;
+		*ptr = '\0';
+
+		value = ptr + 1;
+		brackets = 0;
+		for (ptr = ptr + 1; *ptr != '\0'; ptr++) {
+			if (*ptr == '{')
+				brackets++;
+			if (*ptr == '}')
+				brackets--;
+			if (*ptr == ',' && brackets == 0)
+				break;
+		}
+		if (*ptr == '\0')
+			goto fail;
+		copy++;
+		modifiers |= FORMAT_CONDITIONAL;
+	}
+
+	tok = format_compile_token(tmpl, FORMAT_TOKEN_REPLACE);
+	tok->text = xstrdup(copy);
+	tok->textlen = strlen(copy);
+	tok->modifiers = modifiers;
+	tok->limit = limit;
+	if (modifiers & FORMAT_SUBSTITUTE) {
+		tok->from = xstrdup(from);
+		tok->to = xstrdup(to);
+	}
+	if (modifiers & FORMAT_CONDITIONAL) {
+		tok->yes = format_compile(value, ptr - value);
+		tok->no = format_compile(ptr + 1, strlen(ptr + 1));
+	}
+
+	free(copy0);
+	return (0);
+
+fail:
+	free(copy0);
+	return (-1);
+}
+
+/*
+ * Compile a template into a list of tokens. Anything which cannot be parsed
+ * ends the template, like it always has.
+ */
+struct format_template *
+format_compile(const char *fmt, size_t fmtlen)
+{
+	struct format_template	*tmpl;
+	struct format_token	*tok;
+	const char		*ptr, *s, *end = fmt + fmtlen, *start;
+	size_t			 n;
+	int			 ch, brackets;
+
+	tmpl = xcalloc(1, sizeof *tmpl);
+
+	while (fmt != end) {
+		if (*fmt != '#') {
+			for (start = fmt; fmt != end && *fmt != '#'; fmt++)
+				/* nothing */;
+			format_compile_text(tmpl, start, fmt - start);
+			continue;
+		}
+		fmt++;
+		if (fmt == end) {
+			format_compile_text(tmpl, "#", 1);
+			break;
+		}
+
+		ch = (u_char) *fmt++;
+		switch (ch) {
+		case '(':
+			brackets = 1;
+			for (ptr = fmt; ptr != end; ptr++) {
+				if (*ptr == '(')
+					brackets++;
+				if (*ptr == ')' && --brackets == 0)
+					break;
+			}
+			if (ptr == end || brackets != 0)
+				break;
+			n = ptr - fmt;
+
+			tok = format_compile_token(tmpl, FORMAT_TOKEN_JOB);
+			tok->cmd = format_compile(fmt, n);
+
+			fmt += n + 1;
+			continue;
+		case '{':
+			brackets = 1;
+			for (ptr = fmt; ptr != end; ptr++) {
+				if (*ptr == '{')
+					brackets++;
+				if (*ptr == '}' && --brackets == 0)
+					break;
+			}
+			if (ptr == end || brackets != 0)
+				break;
+			n = ptr - fmt;
+
+			if (format_compile_replace(tmpl, fmt, n) != 0)
+				break;
+			fmt += n + 1;
+			continue;
+		case '#':
+			format_compile_text(tmpl, "#", 1);
+			continue;
+		default:
+			s = NULL;
+			if (ch >= 'A' && ch <= 'Z')
+				s = format_upper[ch - 'A'];
+			else if (ch >= 'a' && ch <= 'z')
+				s = format_lower[ch - 'a'];
+			if (s == NULL) {
+				format_compile_text(tmpl, fmt - 2, 2);
+				continue;
+			}
+			if (format_compile_replace(tmpl, s, strlen(s)) != 0)
+				break;
+			continue;
 		}
-		copy[0] = '\0';
 
-		modifiers |= FORMAT_SUBSTITUTE;
-		copy += 2;
 		break;
 	}
 
-	/*
-	 * Is this a conditional? If so, check it exists and extract either the
-	 * first or second element. If not, look up the key directly.
-	 */
-	if (*copy == '?') {
-		ptr = strchr(copy, ',');
-		if (ptr == NULL)
-			goto fail;
-		*ptr = '\0';
+	return (tmpl);
+}
 
-		value = ptr + 1;
-		found = format_find(ft, copy + 1, modifiers);
+/* Free a compiled template. */
+void
+format_template_free(struct format_template *tmpl)
+{
+	struct format_token	*tok;
+	u_int			 i;
 
-		brackets = 0;
-		for (ptr = ptr + 1; *ptr != '\0'; ptr++) {
-			if (*ptr == '{')
-				brackets++;
-			if (*ptr == '}')
-				brackets--;
-			if (*ptr == ',' && brackets == 0)
-				break;
-		}
-		if (*ptr == '\0')
-			goto fail;
+	for (i = 0; i < tmpl->ntokens; i++) {
+		tok = &tmpl->tokens[i];
+		free(tok->text);
+		free(tok->from);
+		free(tok->to);
+		if (tok->cmd != NULL)
+			format_template_free(tok->cmd);
+		if (tok->yes != NULL)
+			format_template_free(tok->yes);
+		if (tok->no != NULL)
+			format_template_free(tok->no);
+	}
+	free(tmpl->tokens);
+
+	free(tmpl->fmt);
+	free(tmpl);
+}
+
+/* Find a template in the cache, compiling it if it is not there. */
+struct format_template *
+format_template_get(const char *fmt)
+{
+	struct format_template	 tmpl0, *tmpl;
+
+	tmpl0.fmt = (char *)fmt;
+	if ((tmpl = RB_FIND(format_template_tree, &format_templates,
+	    &tmpl0)) == NULL) {
+		tmpl = format_compile(fmt, strlen(fmt));
+		tmpl->fmt = xstrdup(fmt);
+		RB_INSERT(format_template_tree, &format_templates, tmpl);
+	}
+	tmpl->last = time(NULL);
+	return (tmpl);
+}
+
+/* Append a string to the expansion buffer. */
+void
+format_append(char **buf, size_t *len, size_t *off, const char *s, size_t n)
+{
+	while (*len - *off < n + 1) {
+		*buf = xreallocarray(*buf, 2, *len);
+		*len *= 2;
+	}
+	memcpy(*buf + *off, s, n);
+	*off += n;
+}
+
+/* Replace a key/value pair in buffer. */
+void
+format_replace(struct format_tree *ft, const struct format_token *tok,
+    char **buf, size_t *len, size_t *off)
+{
+	char		*copy, *found, *new, *value, *ptr;
+	size_t		 newlen, fromlen, tolen, used;
+	int		 modifiers = tok->modifiers;
 
+	/*
+	 * Is this a conditional? If so, check it exists and expand either the
+	 * first or second branch. If not, look up the key directly.
+	 */
+	if (modifiers & FORMAT_CONDITIONAL) {
+		found = format_find(ft, tok->text, modifiers);
 		if (found != NULL && *found != '\0' &&
-		    (found[0] != '0' || found[1] != '\0')) {
-			*ptr = '\0';
-		} else
-			value = ptr + 1;
-		value = format_expand(ft, value);
+		    (found[0] != '0' || found[1] != '\0'))
+			value = format_evaluate(ft, tok->yes);
+		else
+			value = format_evaluate(ft, tok->no);
 		free(found);
 	} else {
-		value = format_find(ft, copy, modifiers);
+		value = format_find(ft, tok->text, modifiers);
 		if (value == NULL)
 			value = xstrdup("");
 	}
 
 	/* Perform substitution if any. */
 	if (modifiers & FORMAT_SUBSTITUTE) {
-		fromlen = strlen(from);
-		tolen = strlen(to);
+		fromlen = strlen(tok->from);
+		tolen = strlen(tok->to);
 
 		newlen = strlen(value) + 1;
 		copy = new = xmalloc(newlen);
 		for (ptr = value; *ptr != '\0'; /* nothing */) {
-			if (strncmp(ptr, from, fromlen) != 0) {
+			if (strncmp(ptr, tok->from, fromlen) != 0) {
 				*new++ = *ptr++;
 				continue;
 			}
@@ -820,7 +2034,7 @@ format_replace(struct format_tree *ft, const char *key, size_t keylen,
 			copy = xrealloc(copy, newlen);
 
 			new = copy + used;
-			memcpy(new, to, tolen);
+			memcpy(new, tok->to, tolen);
 
 			new += tolen;
 			ptr += fromlen;
@@ -831,32 +2045,102 @@ format_replace(struct format_tree *ft, const char *key, size_t keylen,
 	}
 
 	/* Truncate the value if needed. */
-	if (limit > 0) {
-		new = utf8_trimcstr(value, limit);
+	if (tok->limit > 0) {
+		new = utf8_trimcstr(value, tok->limit);
 		free(value);
 		value = new;
-	} else if (limit < 0) {
-		new = utf8_rtrimcstr(value, -limit);
+	} else if (tok->limit < 0) {
+		new = utf8_rtrimcstr(value, -tok->limit);
 		free(value);
 		value = new;
 	}
 
-	/* Expand the buffer and copy in the value. */
-	valuelen = strlen(value);
-	while (*len - *off < valuelen + 1) {
-		*buf = xreallocarray(*buf, 2, *len);
-		*len *= 2;
+	/* Copy the value into the buffer. */
+	format_append(buf, len, off, value, strlen(value));
+	free(value);
+}
+
+/*
+ * Expand a compiled template. Only the keys the template contains are looked
+ * up, so nothing is done for the rest of the tree.
+ */
+char *
+format_evaluate(struct format_tree *ft, struct format_template *tmpl)
+{
+	struct format_token	*tok;
+	char			*buf, *cmd, *out;
+	size_t			 off, len;
+	u_int			 i;
+
+	len = 64;
+	buf = xmalloc(len);
+	off = 0;
+
+	for (i = 0; i < tmpl->ntokens; i++) {
+		tok = &tmpl->tokens[i];
+		switch (tok->type) {
+		case FORMAT_TOKEN_TEXT:
+			format_append(&buf, &len, &off, tok->text,
+			    tok->textlen);
+			break;
+		case FORMAT_TOKEN_JOB:
+			cmd = format_evaluate(ft, tok->cmd);
+			out = format_job_get(ft, cmd);
+			format_append(&buf, &len, &off, out, strlen(out));
+			free(out);
+			free(cmd);
+			break;
+		case FORMAT_TOKEN_REPLACE:
+			format_replace(ft, tok, &buf, &len, &off);
+			break;
+		}
 	}
-	memcpy(*buf + *off, value, valuelen);
-	*off += valuelen;
+	buf[off] = '\0';
 
-	free(value);
-	free(copy0);
+	return (buf);
+}
+
+/* Does a compiled template look up any key starting with prefix? */
+int
+format_template_uses(struct format_template *tmpl, const char *prefix)
+{
+	struct format_token	*tok;
+	u_int			 i;
+
+	for (i = 0; i < tmpl->ntokens; i++) {
+		tok = &tmpl->tokens[i];
+		switch (tok->type) {
+		case FORMAT_TOKEN_TEXT:
+			break;
+		case FORMAT_TOKEN_JOB:
+			if (format_template_uses(tok->cmd, prefix))
+				return (1);
+			break;
+		case FORMAT_TOKEN_REPLACE:
+			if (strncmp(tok->text, prefix, strlen(prefix)) == 0)
+				return (1);
+			if (tok->yes != NULL &&
+			    format_template_uses(tok->yes, prefix))
+				return (1);
+			if (tok->no != NULL &&
+			    format_template_uses(tok->no, prefix))
+				return (1);
+			break;
+		}
+	}
 	return (0);
+}
 
-fail:
-	free(copy0);
-	return (-1);
+/*
+ * Does a template use any of the client keys? If not, it expands the same for
+ * every client of a session.
+ */
+int
+format_uses_client(const char *fmt)
+{
+	if (fmt == NULL || *fmt == '\0')
+		return (0);
+	return (format_template_uses(format_template_get(fmt), "client_"));
 }
 
 /* Expand keys in a template, passing through strftime first. */
@@ -890,122 +2174,29 @@ format_expand_time(struct format_tree *ft, const char *fmt, time_t t)
 char *
 format_expand(struct format_tree *ft, const char *fmt)
 {
-	char		*buf, *tmp, *cmd, *out;
-	const char	*ptr, *s, *saved = fmt;
-	size_t		 off, len, n, outlen;
-	int     	 ch, brackets;
+	struct format_template	*tmpl;
+	char			*buf;
 
 	if (fmt == NULL)
 		return (xstrdup(""));
 
-#ifdef TMATE
-	tmate_format(ft);
-#endif
-
-	len = 64;
-	buf = xmalloc(len);
-	off = 0;
-
-	while (*fmt != '\0') {
-		if (*fmt != '#') {
-			while (len - off < 2) {
-				buf = xreallocarray(buf, 2, len);
-				len *= 2;
-			}
-			buf[off++] = *fmt++;
-			continue;
-		}
-		fmt++;
-
-		ch = (u_char) *fmt++;
-		switch (ch) {
-		case '(':
-			brackets = 1;
-			for (ptr = fmt; *ptr != '\0'; ptr++) {
-				if (*ptr == '(')
-					brackets++;
-				if (*ptr == ')' && --brackets == 0)
-					break;
-			}
-			if (*ptr != ')' || brackets != 0)
-				break;
-			n = ptr - fmt;
-
-			tmp = xmalloc(n + 1);
-			memcpy(tmp, fmt, n);
-			tmp[n] = '\0';
-			cmd = format_expand(ft, tmp);
-
-			out = format_job_get(ft, cmd);
-			outlen = strlen(out);
-
-			free(cmd);
-			free(tmp);
-
-			while (len - off < outlen + 1) {
-				buf = xreallocarray(buf, 2, len);
-				len *= 2;
-			}
-			memcpy(buf + off, out, outlen);
-			off += outlen;
-
-			free(out);
-
-			fmt += n + 1;
-			continue;
-		case '{':
-			brackets = 1;
-			for (ptr = fmt; *ptr != '\0'; ptr++) {
-				if (*ptr == '{')
-					brackets++;
-				if (*ptr == '}' && --brackets == 0)
-					break;
-			}
-			if (*ptr != '}' || brackets != 0)
-				break;
-			n = ptr - fmt;
-
-			if (format_replace(ft, fmt, n, &buf, &len, &off) != 0)
-				break;
-			fmt += n + 1;
-			continue;
-		case '#':
-			while (len - off < 2) {
-				buf = xreallocarray(buf, 2, len);
-				len *= 2;
-			}
-			buf[off++] = '#';
-			continue;
-		default:
-			s = NULL;
-			if (ch >= 'A' && ch <= 'Z')
-				s = format_upper[ch - 'A'];
-			else if (ch >= 'a' && ch <= 'z')
-				s = format_lower[ch - 'a'];
-			if (s == NULL) {
-				while (len - off < 3) {
-					buf = xreallocarray(buf, 2, len);
-					len *= 2;
-				}
-				buf[off++] = '#';
-				buf[off++] = ch;
-				continue;
-			}
-			n = strlen(s);
-			if (format_replace(ft, s, n, &buf, &len, &off) != 0)
-				break;
-			continue;
-		}
-
-		break;
+	/* If there is nothing to look up, the template is all one string. */
+	tmpl = format_template_get(fmt);
+	if (!tmpl->keys) {
+		if (tmpl->ntokens == 0)
+			return (xstrdup(""));
+		return (xstrdup(tmpl->tokens[0].text));
 	}
-	buf[off] = '\0';
 
-	log_debug("format '%s' -> '%s'", saved, buf);
+	buf = format_evaluate(ft, tmpl);
+	log_debug("format '%s' -> '%s'", fmt, buf);
 	return (buf);
 }
 
-/* Set defaults for any of arguments that are not NULL. */
+/*
+ * Set defaults for any of arguments that are not NULL. The objects must live
+ * as long as the tree is expanded with them.
+ */
 void
 format_defaults(struct format_tree *ft, struct client *c, struct session *s,
     struct winlink *wl, struct window_pane *wp)
@@ -1031,77 +2222,18 @@ format_defaults(struct format_tree *ft, struct client *c, struct session *s,
 void
 format_defaults_session(struct format_tree *ft, struct session *s)
 {
-	struct session_group	*sg;
-
 	ft->s = s;
-
-	format_add(ft, "session_name", "%s", s->name);
-	format_add(ft, "session_windows", "%u", winlink_count(&s->windows));
-	format_add(ft, "session_width", "%u", s->sx);
-	format_add(ft, "session_height", "%u", s->sy);
-	format_add(ft, "session_id", "$%u", s->id);
-
-	sg = session_group_find(s);
-	format_add(ft, "session_grouped", "%d", sg != NULL);
-	if (sg != NULL)
-		format_add(ft, "session_group", "%u", session_group_index(sg));
-
-	format_add_tv(ft, "session_created", &s->creation_time);
-	format_add_tv(ft, "session_last_attached", &s->last_attached_time);
-	format_add_tv(ft, "session_activity", &s->activity_time);
-
-	format_add(ft, "session_attached", "%u", s->attached);
-	format_add(ft, "session_many_attached", "%d", s->attached > 1);
-
-	format_add_cb(ft, "session_alerts", format_cb_session_alerts);
+	ft->defaults |= FORMAT_DEFAULTS_SESSION;
 }
 
 /* Set default format keys for a client. */
 void
 format_defaults_client(struct format_tree *ft, struct client *c)
 {
-	struct session	*s;
-	const char	*name;
-
 	if (ft->s == NULL)
 		ft->s = c->session;
-
-	format_add(ft, "client_pid", "%ld", (long) c->pid);
-	format_add(ft, "client_height", "%u", c->tty.sy);
-	format_add(ft, "client_width", "%u", c->tty.sx);
-	if (c->tty.path != NULL)
-		format_add(ft, "client_tty", "%s", c->tty.path);
-	if (c->tty.termname != NULL)
-		format_add(ft, "client_termname", "%s", c->tty.termname);
-	format_add(ft, "client_control_mode", "%d",
-		!!(c->flags & CLIENT_CONTROL));
-
-	format_add_tv(ft, "client_created", &c->creation_time);
-	format_add_tv(ft, "client_activity", &c->activity_time);
-
-	name = server_client_get_key_table(c);
-	if (strcmp(c->keytable->name, name) == 0)
-		format_add(ft, "client_prefix", "%d", 0);
-	else
-		format_add(ft, "client_prefix", "%d", 1);
-	format_add(ft, "client_key_table", "%s", c->keytable->name);
-
-	if (c->tty.flags & TTY_UTF8)
-		format_add(ft, "client_utf8", "%d", 1);
-	else
-		format_add(ft, "client_utf8", "%d", 0);
-
-	if (c->flags & CLIENT_READONLY)
-		format_add(ft, "client_readonly", "%d", 1);
-	else
-		format_add(ft, "client_readonly", "%d", 0);
-
-	s = c->session;
-	if (s != NULL)
-		format_add(ft, "client_session", "%s", s->name);
-	s = c->last_session;
-	if (s != NULL && session_alive(s))
-		format_add(ft, "client_last_session", "%s", s->name);
+	ft->c = c;
+	ft->defaults |= FORMAT_DEFAULTS_CLIENT;
 }
 
 /* Set default format keys for a window. */
@@ -1109,18 +2241,7 @@ void
 format_defaults_window(struct format_tree *ft, struct window *w)
 {
 	ft->w = w;
-
-	format_add_tv(ft, "window_activity", &w->activity_time);
-	format_add(ft, "window_id", "@%u", w->id);
-	format_add(ft, "window_name", "%s", w->name);
-	format_add(ft, "window_width", "%u", w->sx);
-	format_add(ft, "window_height", "%u", w->sy);
-	format_add_cb(ft, "window_layout", format_cb_window_layout);
-	format_add_cb(ft, "window_visible_layout",
-	    format_cb_window_visible_layout);
-	format_add(ft, "window_panes", "%u", window_count_panes(w));
-	format_add(ft, "window_zoomed_flag", "%d",
-	    !!(w->flags & WINDOW_ZOOMED));
+	ft->defaults |= FORMAT_DEFAULTS_WINDOW;
 }
 
 /* Set default format keys for a winlink. */
@@ -1128,128 +2249,27 @@ void
 format_defaults_winlink(struct format_tree *ft, struct session *s,
     struct winlink *wl)
 {
-	struct window	*w = wl->window;
-	char		*flags;
+	format_defaults_window(ft, wl->window);
 
-	if (ft->w == NULL)
-		ft->w = wl->window;
-
-	flags = window_printable_flags(s, wl);
-
-	format_defaults_window(ft, w);
-
-	format_add(ft, "window_index", "%d", wl->idx);
-	format_add(ft, "window_flags", "%s", flags);
-	format_add(ft, "window_active", "%d", wl == s->curw);
-
-	format_add(ft, "window_bell_flag", "%d",
-	    !!(wl->flags & WINLINK_BELL));
-	format_add(ft, "window_activity_flag", "%d",
-	    !!(wl->flags & WINLINK_ACTIVITY));
-	format_add(ft, "window_silence_flag", "%d",
-	    !!(wl->flags & WINLINK_SILENCE));
-	format_add(ft, "window_last_flag", "%d",
-	    !!(wl == TAILQ_FIRST(&s->lastw)));
-	format_add(ft, "window_linked", "%d", session_is_linked(s, wl->window));
-
-	free(flags);
+	ft->s = s;
+	ft->wl = wl;
+	ft->defaults |= FORMAT_DEFAULTS_WINLINK;
 }
 
 /* Set default format keys for a window pane. */
 void
 format_defaults_pane(struct format_tree *ft, struct window_pane *wp)
 {
-	struct grid	*gd = wp->base.grid;
-	u_int		 idx;
-	int  		 status, scroll_position;
-
 	if (ft->w == NULL)
 		ft->w = wp->window;
 	ft->wp = wp;
-
-	format_add(ft, "history_size", "%u", gd->hsize);
-	format_add(ft, "history_limit", "%u", gd->hlimit);
-	format_add_cb(ft, "history_bytes", format_cb_history_bytes);
-
-	if (window_pane_index(wp, &idx) != 0)
-		fatalx("index not found");
-	format_add(ft, "pane_index", "%u", idx);
-
-	format_add(ft, "pane_width", "%u", wp->sx);
-	format_add(ft, "pane_height", "%u", wp->sy);
-	format_add(ft, "pane_title", "%s", wp->base.title);
-	format_add(ft, "pane_id", "%%%u", wp->id);
-	format_add(ft, "pane_active", "%d", wp == wp->window->active);
-	format_add(ft, "pane_input_off", "%d", !!(wp->flags & PANE_INPUTOFF));
-
-	status = wp->status;
-	if (wp->fd == -1 && WIFEXITED(status))
-		format_add(ft, "pane_dead_status", "%d", WEXITSTATUS(status));
-	format_add(ft, "pane_dead", "%d", wp->fd == -1);
-
-	if (window_pane_visible(wp)) {
-		format_add(ft, "pane_left", "%u", wp->xoff);
-		format_add(ft, "pane_top", "%u", wp->yoff);
-		format_add(ft, "pane_right", "%u", wp->xoff + wp->sx - 1);
-		format_add(ft, "pane_bottom", "%u", wp->yoff + wp->sy - 1);
-	}
-
-	format_add(ft, "pane_in_mode", "%d", wp->screen != &wp->base);
-	format_add(ft, "pane_synchronized", "%d",
-	    !!options_get_number(wp->window->options, "synchronize-panes"));
-
-	format_add(ft, "pane_tty", "%s", wp->tty);
-	format_add(ft, "pane_pid", "%ld", (long) wp->pid);
-	format_add_cb(ft, "pane_start_command", format_cb_start_command);
-	format_add_cb(ft, "pane_current_command", format_cb_current_command);
-	format_add_cb(ft, "pane_current_path", format_cb_current_path);
-
-	format_add(ft, "cursor_x", "%u", wp->base.cx);
-	format_add(ft, "cursor_y", "%u", wp->base.cy);
-	format_add(ft, "scroll_region_upper", "%u", wp->base.rupper);
-	format_add(ft, "scroll_region_lower", "%u", wp->base.rlower);
-
-	scroll_position = window_copy_scroll_position(wp);
-	if (scroll_position != -1)
-		format_add(ft, "scroll_position", "%d", scroll_position);
-
-	format_add(ft, "alternate_on", "%d", wp->saved_grid ? 1 : 0);
-	format_add(ft, "alternate_saved_x", "%u", wp->saved_cx);
-	format_add(ft, "alternate_saved_y", "%u", wp->saved_cy);
-
-	format_add(ft, "cursor_flag", "%d",
-	    !!(wp->base.mode & MODE_CURSOR));
-	format_add(ft, "insert_flag", "%d",
-	    !!(wp->base.mode & MODE_INSERT));
-	format_add(ft, "keypad_cursor_flag", "%d",
-	    !!(wp->base.mode & MODE_KCURSOR));
-	format_add(ft, "keypad_flag", "%d",
-	    !!(wp->base.mode & MODE_KKEYPAD));
-	format_add(ft, "wrap_flag", "%d",
-	    !!(wp->base.mode & MODE_WRAP));
-
-	format_add(ft, "mouse_any_flag", "%d",
-	    !!(wp->base.mode & (MODE_MOUSE_STANDARD|MODE_MOUSE_BUTTON)));
-	format_add(ft, "mouse_standard_flag", "%d",
-	    !!(wp->base.mode & MODE_MOUSE_STANDARD));
-	format_add(ft, "mouse_button_flag", "%d",
-	    !!(wp->base.mode & MODE_MOUSE_BUTTON));
-
-	format_add_cb(ft, "pane_tabs", format_cb_pane_tabs);
+	ft->defaults |= FORMAT_DEFAULTS_PANE;
 }
 
 /* Set default format keys for paste buffer. */
 void
 format_defaults_paste_buffer(struct format_tree *ft, struct paste_buffer *pb)
 {
-	size_t	 bufsize;
-	char	*s;
-
-	paste_buffer_data(pb, &bufsize);
-	format_add(ft, "buffer_size", "%zu", bufsize);
-	format_add(ft, "buffer_name", "%s", paste_buffer_name(pb));
-
-	s = paste_make_sample(pb);
-	format_add(ft, "buffer_sample", "%s", s);
-	free(s);
+	ft->pb = pb;
+	ft->defaults |= FORMAT_DEFAULTS_PASTE;
 }
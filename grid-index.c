@@ -0,0 +1,310 @@
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Trigram index over the history of a grid, for the search-index option.
+ *
+ * The text of a line is its cell data with ASCII lowercased and padding cells
+ * left out. Each distinct three byte sequence maps to the sorted list of the
+ * lines containing it. Lines are numbered from the first line ever added,
+ * so trimming the history only moves base and the lists are swept once
+ * enough of them is stale. A query returns the lines containing every
+ * trigram of the search string, which the caller must still check.
+ *
+ * Lines are added as they enter the history, and dropped if they go back
+ * onto the screen. Reflowing the history marks the index stale, and it is
+ * rebuilt by the next query.
+ */
+
+struct grid_index_entry {
+	u_int			 key;
+
+	u_int			*lines;
+	u_int			 first;
+	u_int			 nlines;
+	u_int			 alloc;
+
+	RB_ENTRY(grid_index_entry) entry;
+};
+RB_HEAD(grid_index_tree, grid_index_entry);
+
+struct grid_index {
+	struct grid_index_tree	 tree;
+
+	u_int			 base;	/* number of history line 0 */
+	u_int			 next;	/* number of the next line to add */
+	u_int			 swept;	/* base at the last sweep */
+	int			 stale;
+};
+
+int	grid_index_cmp(struct grid_index_entry *, struct grid_index_entry *);
+RB_PROTOTYPE(grid_index_tree, grid_index_entry, entry, grid_index_cmp);
+RB_GENERATE(grid_index_tree, grid_index_entry, entry, grid_index_cmp);
+
+void	grid_index_clear(struct grid_index *);
+void	grid_index_add(struct grid_index *, u_int, const u_char *, size_t);
+size_t	grid_index_text(struct grid *, u_int, u_char **, size_t *);
+void	grid_index_sweep(struct grid_index *, u_int);
+int	grid_index_find(struct grid_index_entry *, u_int);
+
+int
+grid_index_cmp(struct grid_index_entry *e1, struct grid_index_entry *e2)
+{
+	if (e1->key < e2->key)
+		return (-1);
+	return (e1->key > e2->key);
+}
+
+/* Enable the index and bring it up to date. */
+void
+grid_index_enable(struct grid *gd)
+{
+	if (gd->index == NULL) {
+		gd->index = xcalloc(1, sizeof *gd->index);
+		RB_INIT(&gd->index->tree);
+	}
+	grid_index_update(gd);
+}
+
+void
+grid_index_disable(struct grid *gd)
+{
+	if (gd->index == NULL)
+		return;
+	grid_index_clear(gd->index);
+	free(gd->index);
+	gd->index = NULL;
+}
+
+void
+grid_index_clear(struct grid_index *gi)
+{
+	struct grid_index_entry	*e, *e1;
+
+	RB_FOREACH_SAFE(e, grid_index_tree, &gi->tree, e1) {
+		RB_REMOVE(grid_index_tree, &gi->tree, e);
+		free(e->lines);
+		free(e);
+	}
+	gi->base = gi->next = gi->swept = 0;
+}
+
+/* Forget everything. If stale, do not index again before the next query. */
+void
+grid_index_reset(struct grid *gd, int stale)
+{
+	if (gd->index == NULL)
+		return;
+	grid_index_clear(gd->index);
+	gd->index->stale = stale;
+}
+
+/* The oldest ny lines of history are gone. */
+void
+grid_index_trim(struct grid *gd, u_int ny)
+{
+	struct grid_index	*gi = gd->index;
+
+	if (gi == NULL || gi->stale)
+		return;
+
+	gi->base += ny;
+	if (gi->next < gi->base)
+		gi->next = gi->base;
+
+	/* Sweep once the stale lines are as many as those left. */
+	if (gi->base - gi->swept > gd->hsize)
+		grid_index_sweep(gi, gi->base);
+}
+
+void
+grid_index_sweep(struct grid_index *gi, u_int limit)
+{
+	struct grid_index_entry	*e, *e1;
+	u_int			 i;
+
+	RB_FOREACH_SAFE(e, grid_index_tree, &gi->tree, e1) {
+		while (e->first < e->nlines && e->lines[e->first] < gi->base)
+			e->first++;
+		while (e->nlines > e->first && e->lines[e->nlines - 1] >= limit)
+			e->nlines--;
+		if (e->first == e->nlines) {
+			RB_REMOVE(grid_index_tree, &gi->tree, e);
+			free(e->lines);
+			free(e);
+			continue;
+		}
+		if (e->first != 0) {
+			for (i = e->first; i < e->nlines; i++)
+				e->lines[i - e->first] = e->lines[i];
+			e->nlines -= e->first;
+			e->first = 0;
+		}
+	}
+	gi->swept = gi->base;
+}
+
+/* Get the index text of a line into buf, returning its length. */
+size_t
+grid_index_text(struct grid *gd, u_int py, u_char **buf, size_t *size)
+{
+	const struct grid_line	*gl;
+	struct grid_cell	 gc;
+	size_t			 len = 0;
+	u_int			 px, i;
+
+	gl = grid_peek_line(gd, py);
+	for (px = 0; px < gl->cellsize; px++) {
+		grid_get_cell(gd, px, py, &gc);
+		if (gc.flags & GRID_FLAG_PADDING)
+			continue;
+		if (len + gc.data.size > *size) {
+			*size = (len + gc.data.size) * 2;
+			*buf = xrealloc(*buf, *size);
+		}
+		for (i = 0; i < gc.data.size; i++)
+			(*buf)[len++] = tolower(gc.data.data[i]);
+	}
+	return (len);
+}
+
+void
+grid_index_add(struct grid_index *gi, u_int line, const u_char *text,
+    size_t len)
+{
+	struct grid_index_entry	 find, *e;
+	size_t			 i;
+
+	for (i = 0; i + 3 <= len; i++) {
+		find.key = text[i] << 16 | text[i + 1] << 8 | text[i + 2];
+		e = RB_FIND(grid_index_tree, &gi->tree, &find);
+		if (e == NULL) {
+			e = xcalloc(1, sizeof *e);
+			e->key = find.key;
+			RB_INSERT(grid_index_tree, &gi->tree, e);
+		} else if (e->nlines > e->first &&
+		    e->lines[e->nlines - 1] == line)
+			continue;
+
+		if (e->nlines == e->alloc) {
+			e->alloc = e->alloc == 0 ? 4 : e->alloc * 2;
+			e->lines = xreallocarray(e->lines, e->alloc,
+			    sizeof *e->lines);
+		}
+		e->lines[e->nlines++] = line;
+	}
+}
+
+/* Index the history lines added since last time. */
+void
+grid_index_update(struct grid *gd)
+{
+	struct grid_index	*gi = gd->index;
+	u_char			*buf = NULL;
+	size_t			 size = 0, len;
+	u_int			 py, end;
+
+	if (gi == NULL || gi->stale)
+		return;
+
+	/* Lines went back onto the screen, drop them. */
+	end = gi->base + gd->hsize;
+	if (gi->next > end) {
+		grid_index_sweep(gi, end);
+		gi->next = end;
+	}
+
+	for (py = gi->next - gi->base; py < gd->hsize; py++) {
+		len = grid_index_text(gd, py, &buf, &size);
+		grid_index_add(gi, gi->base + py, buf, len);
+	}
+	gi->next = end;
+	free(buf);
+}
+
+int
+grid_index_find(struct grid_index_entry *e, u_int line)
+{
+	u_int	lo = e->first, hi = e->nlines, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e->lines[mid] < line)
+			lo = mid + 1;
+		else if (e->lines[mid] > line)
+			hi = mid;
+		else
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Set in lines (of hsize bits) the history lines which may contain s.
+ * Returns 0 if the index cannot tell, when s is too short.
+ */
+int
+grid_index_query(struct grid *gd, const char *s, bitstr_t **lines)
+{
+	struct grid_index	*gi;
+	struct grid_index_entry	 find, **e, *shortest;
+	u_char			*text;
+	size_t			 len, i, n = 0;
+	u_int			 j, k, line;
+
+	grid_index_enable(gd);
+	gi = gd->index;
+	if (gi->stale) {
+		gi->stale = 0;
+		grid_index_update(gd);
+	}
+
+	/* Trailing spaces may be past the end of the line, they are not cells. */
+	len = strlen(s);
+	while (len > 0 && s[len - 1] == ' ')
+		len--;
+	if (len < 3)
+		return (0);
+
+	if ((*lines = bit_alloc(gd->hsize + 1)) == NULL)
+		fatal("bit_alloc failed");
+
+	text = xmalloc(len);
+	for (i = 0; i < len; i++)
+		text[i] = tolower((u_char)s[i]);
+
+	e = xreallocarray(NULL, len - 2, sizeof *e);
+	shortest = NULL;
+	for (i = 0; i + 3 <= len; i++) {
+		find.key = text[i] << 16 | text[i + 1] << 8 | text[i + 2];
+		e[n] = RB_FIND(grid_index_tree, &gi->tree, &find);
+		if (e[n] == NULL)
+			goto out;
+		if (shortest == NULL ||
+		    e[n]->nlines - e[n]->first < shortest->nlines - shortest->first)
+			shortest = e[n];
+		n++;
+	}
+
+	for (j = shortest->first; j < shortest->nlines; j++) {
+		line = shortest->lines[j];
+		if (line < gi->base || line - gi->base >= gd->hsize)
+			continue;
+		for (k = 0; k < n; k++) {
+			if (e[k] != shortest && !grid_index_find(e[k], line))
+				break;
+		}
+		if (k == n)
+			bit_set(*lines, line - gi->base);
+	}
+
+out:
+	free(e);
+	free(text);
+	return (1);
+}
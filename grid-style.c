@@ -0,0 +1,169 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Palette of the styles (flags, attributes and colours) of the extended cells
+ * of a grid, so each cell holds a short id rather than the style itself.
+ *
+ * Styles are added as they are first used and never removed; a grid rarely
+ * sees more than a few hundred. Once GRID_STYLE_MAX are in use, cells with a
+ * new style keep it outside the palette. A palette is shared between the
+ * grids which exchange lines wholesale (a screen and its saved alternate
+ * grid, a grid and the one it is reflowed into), so their ids agree.
+ */
+
+#define GRID_STYLE_MAX 0xfff0
+
+struct grid_styles {
+	u_int			 references;
+
+	struct grid_style	*list;
+	u_int			 size;
+	u_int			 alloc;
+
+	u_int			*hash;	/* id + 1, or 0 if empty */
+	u_int			 hashsize;
+};
+
+u_int	grid_styles_hash(const struct grid_style *);
+void	grid_styles_rehash(struct grid_styles *);
+
+/* Fill in a style from the style fields of a cell. */
+void
+grid_style_from_cell(struct grid_style *gs, const struct grid_cell *gc)
+{
+	gs->flags = gc->flags & ~GRID_FLAG_EXTENDED;
+	gs->attr = gc->attr;
+	memcpy(gs->fg, &gc->fg_rgb, sizeof gs->fg);
+	memcpy(gs->bg, &gc->bg_rgb, sizeof gs->bg);
+}
+
+/* Set the style fields of a cell. */
+void
+grid_style_to_cell(const struct grid_style *gs, struct grid_cell *gc)
+{
+	gc->flags = gs->flags;
+	gc->attr = gs->attr;
+	memcpy(&gc->fg_rgb, gs->fg, sizeof gs->fg);
+	memcpy(&gc->bg_rgb, gs->bg, sizeof gs->bg);
+}
+
+u_int
+grid_styles_hash(const struct grid_style *gs)
+{
+	u_int	h;
+
+	h = gs->flags | gs->attr << 8 | gs->fg[0] << 16 | gs->fg[1] << 24;
+	h ^= (gs->fg[2] | gs->bg[0] << 8 | gs->bg[1] << 16 | gs->bg[2] << 24) *
+	    0x9e3779b1U;
+	h ^= h >> 15;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	return (h);
+}
+
+void
+grid_styles_rehash(struct grid_styles *gst)
+{
+	u_int	i, h;
+
+	free(gst->hash);
+	gst->hashsize = gst->hashsize == 0 ? 64 : gst->hashsize * 2;
+	gst->hash = xcalloc(gst->hashsize, sizeof *gst->hash);
+
+	for (i = 0; i < gst->size; i++) {
+		h = grid_styles_hash(&gst->list[i]) & (gst->hashsize - 1);
+		while (gst->hash[h] != 0)
+			h = (h + 1) & (gst->hashsize - 1);
+		gst->hash[h] = i + 1;
+	}
+}
+
+/* Make dst use the palette of src, so lines can move between them. */
+void
+grid_styles_share(struct grid *dst, struct grid *src)
+{
+	if (src->styles == NULL)
+		src->styles = grid_styles_create();
+	grid_styles_free(dst->styles);
+	dst->styles = src->styles;
+	dst->styles->references++;
+}
+
+struct grid_styles *
+grid_styles_create(void)
+{
+	struct grid_styles	*gst;
+
+	gst = xcalloc(1, sizeof *gst);
+	gst->references = 1;
+	return (gst);
+}
+
+void
+grid_styles_free(struct grid_styles *gst)
+{
+	if (gst == NULL || --gst->references != 0)
+		return;
+	grid_total_memory -= gst->alloc * sizeof *gst->list +
+	    gst->hashsize * sizeof *gst->hash;
+	free(gst->list);
+	free(gst->hash);
+	free(gst);
+}
+
+/* Get the id of a style, adding it if needed. */
+u_int
+grid_styles_add(struct grid_styles *gst, const struct grid_style *gs)
+{
+	u_int	h, id, old;
+
+	if (gst->hashsize != 0) {
+		h = grid_styles_hash(gs) & (gst->hashsize - 1);
+		while ((id = gst->hash[h]) != 0) {
+			if (memcmp(&gst->list[id - 1], gs, sizeof *gs) == 0)
+				return (id - 1);
+			h = (h + 1) & (gst->hashsize - 1);
+		}
+	}
+	if (gst->size == GRID_STYLE_MAX)
+		return (GRID_STYLE_NONE);
+
+	if (gst->size == gst->alloc) {
+		old = gst->alloc;
+		gst->alloc = gst->alloc == 0 ? 16 : gst->alloc * 2;
+		if (gst->alloc > GRID_STYLE_MAX)
+			gst->alloc = GRID_STYLE_MAX;
+		gst->list = xreallocarray(gst->list, gst->alloc,
+		    sizeof *gst->list);
+		grid_total_memory += (gst->alloc - old) * sizeof *gst->list;
+	}
+	id = gst->size++;
+	memcpy(&gst->list[id], gs, sizeof *gs);
+
+	/* Keep the table at most half full. */
+	if (gst->size * 2 > gst->hashsize) {
+		old = gst->hashsize;
+		grid_styles_rehash(gst);
+		grid_total_memory += (gst->hashsize - old) * sizeof *gst->hash;
+	} else {
+		h = grid_styles_hash(gs) & (gst->hashsize - 1);
+		while (gst->hash[h] != 0)
+			h = (h + 1) & (gst->hashsize - 1);
+		gst->hash[h] = id + 1;
+	}
+	return (id);
+}
+
+/* Look up a style by id. */
+const struct grid_style *
+grid_styles_get(struct grid_styles *gst, u_int id)
+{
+	if (gst == NULL || id >= gst->size)
+		return (NULL);
+	return (&gst->list[id]);
+}
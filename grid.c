@@ -17,9 +17,16 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "tmux.h"
 
@@ -33,8 +40,107 @@
  * (hsize - 1); from hsize to hsize + (sy - 1) is the viewable data. All
  * functions in this file work on absolute coordinates, grid-view.c has
  * functions which work on the screen data.
+ *
+ * History lines more than hwarm lines above the visible data are compressed
+ * as they scroll past (if built with zlib). A compressed line keeps its
+ * cellsize, extdsize and flags but its cell data lives in zdata. Reading a
+ * compressed line decompresses it into a one line cache on the grid, so
+ * scanning the history (copy mode, capture-pane) leaves it compressed;
+ * modifying it decompresses it in place for good.
+ *
+ * Compressed data is never changed once made, so it is reference counted and
+ * shared rather than copied when lines are duplicated: grid_snapshot copies
+ * a grid in a pointer per compressed line, and only the warm history and the
+ * visible lines are copied. A shared line counts towards the memory of each
+ * grid holding it.
+ *
+ * With hspill set (history-spill), compressed data goes to a file instead of
+ * the heap, so only the line itself stays in memory; see grid_spill_write.
+ *
+ * Line cell buffers grow in steps, to a quarter, a half and then the full
+ * grid width, so short lines do not take a full width buffer. When a line is
+ * freed (collected from the history, cleared or compressed) a full width
+ * buffer is kept on the grid's spare list and reused for the next line which
+ * needs one, so steady scrolling does not go through malloc.
+ *
+ * Reflowing on resize only rewraps the visible data and the most recent
+ * GRID_REFLOW_LINES lines of history. Older lines are moved across as they
+ * are and counted in hpending; grid_reflow_history rewraps them when
+ * something needs the whole history, and grid_reflow_history_step a block
+ * at a time, from the most recent, when there is nothing else to do.
+ *
+ * Destroying a grid or clearing a history of at least GRID_REAP_MIN lines
+ * does not free the lines straight away: they are handed to the reaper,
+ * which frees GRID_REAP_LINES of them each time round the loop. Their memory
+ * is counted in grid_total_memory until they are freed.
+ *
+ * A history line does not change once written, so users of the grid may keep
+ * data made from it in the cache (the tmate encoder keeps each line as it is
+ * sent in snapshots). Entries are by absolute line number, hremoved plus the
+ * line; they go with the line when it is collected, and all of those from a
+ * line on are dropped when that line might be rewritten or renumbered.
  */
 
+/* History lines reflowed straight away on resize. */
+#define GRID_REFLOW_LINES 1000
+
+/* Lines to free later rather than straight away, and how many at a time. */
+#define GRID_REAP_MIN 10000
+#define GRID_REAP_LINES 10000
+
+/* Lines waiting to be freed, and the line array to free after them. */
+struct grid_reap {
+	struct grid_line	*base;
+	size_t			 basesize;
+
+	struct grid_line	*lines;
+	u_int			 n;
+
+	TAILQ_ENTRY(grid_reap)	 entry;
+};
+static TAILQ_HEAD(, grid_reap) grid_reaps = TAILQ_HEAD_INITIALIZER(grid_reaps);
+static struct event grid_reap_timer;
+
+/* Cached data for history lines from the absolute line base. */
+struct grid_cache_entry {
+	void			*data;
+	size_t			 size;
+};
+struct grid_cache {
+	uint64_t		 base;
+	struct grid_cache_entry	*entries;
+	u_int			 n;
+};
+
+/*
+ * A history file is mapped once, GRID_SPILL_SIZE of address space, and only
+ * ever written at the end, so the data of a line stays at the same address for
+ * as long as the file is there. The header before the data, which for data on
+ * the heap is its reference count, has GRID_ZDATA_SPILL and the index of the
+ * file in grid_spills. The file counts the references to all its lines, plus
+ * one for each grid writing to it. It is removed once created, so it is gone
+ * with the last reference or with the server.
+ */
+#if SIZE_MAX > 0xffffffffUL
+#define GRID_SPILL_SIZE ((size_t)16 << 30)
+#else
+#define GRID_SPILL_SIZE ((size_t)256 << 20)
+#endif
+#define GRID_ZDATA_SPILL 0x80000000U
+
+struct grid_spill {
+	u_int			 idx;
+	int			 fd;
+	u_char			*base;
+	size_t			 used;
+	u_int			 references;
+};
+static struct grid_spill **grid_spills;
+static u_int grid_nspills;
+
+/* Source of cache_generation, unique across grids. */
+static u_int grid_cache_generations;
+
 /* Default grid cell data. */
 const struct grid_cell grid_default_cell = {
 	0, 0, { .fg = 8 }, { .bg = 8 }, { { ' ' }, 0, 1, 1 }
@@ -44,17 +150,45 @@ const struct grid_cell_entry grid_default_entry = {
 };
 
 int	grid_check_y(struct grid *, u_int);
-
-void	grid_reflow_copy(struct grid_line *, u_int, struct grid_line *l,
-	    u_int, u_int);
+struct grid_line *grid_get_line(struct grid *, u_int);
+const struct grid_line *grid_read_line(struct grid *, u_int);
+void	grid_compress_line(struct grid *, u_int);
+void	grid_uncompress_line(struct grid *, const struct grid_line *,
+	    struct grid_line *);
+void	grid_free_line(struct grid *, struct grid_line *);
+void	grid_reserve_cells(struct grid *, struct grid_line *, u_int);
+struct grid_spill *grid_spill_open(void);
+void	grid_spill_unref(struct grid_spill *);
+void	grid_spill_share(struct grid *, struct grid *);
+u_char	*grid_spill_write(struct grid *, const u_char *, size_t);
+void	grid_release_cells(struct grid *, struct grid_line *);
+u_int	grid_extd_slots(u_int, u_int);
+void	grid_extd_get(struct grid *, const struct grid_line *, u_int,
+	    struct grid_cell *);
+void	grid_extd_set(struct grid *, struct grid_line *,
+	    struct grid_cell_entry *, const struct grid_cell *);
+
+void	grid_reflow_copy(struct grid *, struct grid_line *, u_int,
+	    struct grid_line *l, u_int, u_int);
 void	grid_reflow_join(struct grid *, u_int *, struct grid_line *, u_int);
 void	grid_reflow_split(struct grid *, u_int *, struct grid_line *, u_int,
 	    u_int);
-void	grid_reflow_move(struct grid *, u_int *, struct grid_line *);
+void	grid_reflow_move(struct grid *, u_int *, struct grid *,
+	    struct grid_line *);
+void	grid_reflow_pending(struct grid *, u_int);
+void	grid_reflow_lines(struct grid *, u_int *, struct grid *, u_int, u_int,
+	    u_int);
+size_t	grid_lines_memory(const struct grid_line *, u_int);
+void	grid_reap_lines(struct grid_line *, size_t, struct grid_line *,
+	    u_int);
+void	grid_reap_callback(int, short, void *);
+void	grid_cache_trim(struct grid *);
 size_t	grid_string_cells_fg(const struct grid_cell *, int *);
 size_t	grid_string_cells_bg(const struct grid_cell *, int *);
 void	grid_string_cells_code(const struct grid_cell *,
 	    const struct grid_cell *, char *, size_t, int);
+int	grid_string_cells_same(const struct grid_cell *,
+	    const struct grid_cell *);
 
 /* Copy default into a cell. */
 static void
@@ -74,6 +208,491 @@ grid_check_y(struct grid *gd, u_int py)
 	return (0);
 }
 
+/* Bytes allocated for all grids. */
+size_t	grid_total_memory;
+
+/* Account for memory allocated for a grid. */
+static void
+grid_add_memory(struct grid *gd, size_t size)
+{
+	gd->memory += size;
+	grid_total_memory += size;
+}
+
+/* Account for memory freed from a grid. */
+static void
+grid_sub_memory(struct grid *gd, size_t size)
+{
+	gd->memory -= size;
+	grid_total_memory -= size;
+}
+
+/*
+ * Make room for at least sx cells in a line, without initialising them. Short
+ * lines grow to a quarter, then half the width; only a line needing the full
+ * width is given a full width buffer, which may be a spare one.
+ */
+void
+grid_reserve_cells(struct grid *gd, struct grid_line *gl, u_int sx)
+{
+	if (sx <= gl->cellalloc)
+		return;
+
+	if (sx < gd->sx / 4)
+		sx = gd->sx / 4;
+	else if (sx < gd->sx / 2)
+		sx = gd->sx / 2;
+	else if (sx < gd->sx)
+		sx = gd->sx;
+
+	if (gl->celldata == NULL && sx == gd->sx) {
+		if (gd->nspare != 0 && gd->spare_sx == gd->sx)
+			gl->celldata = gd->spare[--gd->nspare];
+		else {
+			gl->celldata = xreallocarray(NULL, gd->sx,
+			    sizeof *gl->celldata);
+			grid_add_memory(gd, gd->sx * sizeof *gl->celldata);
+		}
+		gl->cellalloc = gd->sx;
+		return;
+	}
+
+	gl->celldata = xreallocarray(gl->celldata, sx, sizeof *gl->celldata);
+	grid_add_memory(gd, (sx - gl->cellalloc) * sizeof *gl->celldata);
+	gl->cellalloc = sx;
+}
+
+/* Release a line's cells, keeping the buffer if it can be reused. */
+void
+grid_release_cells(struct grid *gd, struct grid_line *gl)
+{
+	u_int	limit;
+
+	if (gl->celldata == NULL)
+		return;
+
+	if (gd->spare_sx != gd->sx)
+		grid_free_spare(gd);
+
+	/* Keep enough for a history collection plus the screen. */
+	limit = gd->hlimit / 10 + gd->sy;
+	if (gl->cellalloc == gd->sx && gd->nspare < limit) {
+		if (gd->nspare == gd->spare_size) {
+			gd->spare = xreallocarray(gd->spare, limit,
+			    sizeof *gd->spare);
+			gd->spare_size = limit;
+		}
+		gd->spare[gd->nspare++] = gl->celldata;
+	} else {
+		free(gl->celldata);
+		grid_sub_memory(gd, gl->cellalloc * sizeof *gl->celldata);
+	}
+
+	gl->celldata = NULL;
+	gl->cellalloc = 0;
+}
+
+/* Free all spare line buffers. */
+void
+grid_free_spare(struct grid *gd)
+{
+	u_int	i;
+
+	for (i = 0; i < gd->nspare; i++)
+		free(gd->spare[i]);
+	grid_sub_memory(gd, gd->nspare * gd->spare_sx * sizeof **gd->spare);
+	free(gd->spare);
+	gd->spare = NULL;
+	gd->spare_size = 0;
+	gd->nspare = 0;
+	gd->spare_sx = gd->sx;
+}
+
+#ifdef HAVE_ZLIB
+/* Compressed data follows its reference count. */
+static u_char *
+grid_zdata_alloc(size_t size)
+{
+	u_int	*refs;
+
+	refs = xmalloc(sizeof *refs + size);
+	*refs = 1;
+	return ((u_char *)(refs + 1));
+}
+#endif
+
+static u_char *
+grid_zdata_ref(u_char *zdata)
+{
+	u_int	*refs = (u_int *)zdata - 1;
+
+	if (*refs & GRID_ZDATA_SPILL)
+		grid_spills[*refs & ~GRID_ZDATA_SPILL]->references++;
+	else
+		(*refs)++;
+	return (zdata);
+}
+
+static void
+grid_zdata_unref(u_char *zdata)
+{
+	u_int	*refs;
+
+	if (zdata == NULL)
+		return;
+	refs = (u_int *)zdata - 1;
+	if (*refs & GRID_ZDATA_SPILL)
+		grid_spill_unref(grid_spills[*refs & ~GRID_ZDATA_SPILL]);
+	else if (--*refs == 0)
+		free(refs);
+}
+
+/* Heap memory held by the compressed data of a line. */
+static size_t
+grid_zdata_memory(const struct grid_line *gl)
+{
+	if (gl->zdata == NULL ||
+	    ((const u_int *)gl->zdata)[-1] & GRID_ZDATA_SPILL)
+		return (0);
+	return (gl->zsize);
+}
+
+/* Create a history file. */
+struct grid_spill *
+grid_spill_open(void)
+{
+	struct grid_spill	*spill;
+	char			*path;
+	void			*base;
+	int			 fd;
+	u_int			 i;
+
+	xasprintf(&path, "%s.history.XXXXXX", socket_path);
+	if ((fd = mkstemp(path)) == -1) {
+		log_debug("%s: %s", path, strerror(errno));
+		free(path);
+		return (NULL);
+	}
+	unlink(path);
+	free(path);
+
+	base = mmap(NULL, GRID_SPILL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		log_debug("mmap history file: %s", strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+
+	for (i = 0; i < grid_nspills; i++) {
+		if (grid_spills[i] == NULL)
+			break;
+	}
+	if (i == grid_nspills) {
+		grid_spills = xreallocarray(grid_spills, grid_nspills + 1,
+		    sizeof *grid_spills);
+		grid_nspills++;
+	}
+
+	spill = xcalloc(1, sizeof *spill);
+	spill->idx = i;
+	spill->fd = fd;
+	spill->base = base;
+	spill->references = 1;
+	grid_spills[i] = spill;
+	return (spill);
+}
+
+/* Drop a reference to a history file, removing it with the last. */
+void
+grid_spill_unref(struct grid_spill *spill)
+{
+	if (--spill->references != 0)
+		return;
+
+	munmap(spill->base, GRID_SPILL_SIZE);
+	close(spill->fd);
+	grid_spills[spill->idx] = NULL;
+	free(spill);
+}
+
+/* Have a grid write to the same history file as another. */
+void
+grid_spill_share(struct grid *dst, struct grid *src)
+{
+	dst->hspill = src->hspill;
+	if (dst->spill != NULL)
+		grid_spill_unref(dst->spill);
+	dst->spill = src->spill;
+	if (dst->spill != NULL)
+		dst->spill->references++;
+}
+
+/*
+ * Append compressed data to the grid's history file; returns where it may be
+ * read or NULL if it must stay on the heap (no file, full or failed).
+ */
+u_char *
+grid_spill_write(struct grid *gd, const u_char *data, size_t size)
+{
+	struct grid_spill	*spill;
+	u_int			 hdr;
+	size_t			 off;
+
+	if (gd->spill == NULL) {
+		if ((gd->spill = grid_spill_open()) == NULL) {
+			gd->hspill = 0;
+			return (NULL);
+		}
+	}
+	spill = gd->spill;
+
+	off = spill->used;
+	if (sizeof hdr + size > GRID_SPILL_SIZE - off)
+		return (NULL);
+	hdr = GRID_ZDATA_SPILL|spill->idx;
+	if (pwrite(spill->fd, &hdr, sizeof hdr, off) != (ssize_t)sizeof hdr ||
+	    pwrite(spill->fd, data, size, off + sizeof hdr) != (ssize_t)size)
+		return (NULL);
+
+	spill->used += sizeof hdr + size;
+	spill->used = (spill->used + sizeof hdr - 1) & ~(sizeof hdr - 1);
+	spill->references++;
+	return (spill->base + off + sizeof hdr);
+}
+
+#ifdef HAVE_ZLIB
+/* Scratch buffer for compressing and decompressing lines. */
+static u_char	*grid_zbuf;
+static size_t	 grid_zbuf_size;
+
+static u_char *
+grid_get_zbuf(size_t size)
+{
+	if (size > grid_zbuf_size) {
+		grid_zbuf = xrealloc(grid_zbuf, size);
+		grid_zbuf_size = size;
+	}
+	return (grid_zbuf);
+}
+#endif
+
+/* Compress a history line, if it is worth it. */
+void
+grid_compress_line(struct grid *gd, u_int py)
+{
+#ifdef HAVE_ZLIB
+	struct grid_line	*gl = &gd->linedata[py];
+	const u_char		*src;
+	u_char			*zbuf;
+	size_t			 csize, esize;
+	uLongf			 zsize;
+
+	if (gl->zdata != NULL || gl->cellsize == 0)
+		return;
+	csize = gl->cellsize * sizeof *gl->celldata;
+	esize = gl->extdsize * sizeof *gl->extddata;
+
+	zsize = compressBound(csize + esize);
+	if (esize == 0)
+		src = (u_char *)gl->celldata;
+	else {
+		zbuf = grid_get_zbuf(zsize + csize + esize);
+		memcpy(zbuf + zsize, gl->celldata, csize);
+		memcpy(zbuf + zsize + csize, gl->extddata, esize);
+		src = zbuf + zsize;
+	}
+	zbuf = grid_get_zbuf(zsize);
+
+	if (compress2(zbuf, &zsize, src, csize + esize, 1) != Z_OK)
+		return;
+	if (zsize >= csize + esize)
+		return;
+
+	gl->zsize = zsize;
+	if (!gd->hspill || (gl->zdata = grid_spill_write(gd, zbuf, zsize)) ==
+	    NULL) {
+		gl->zdata = grid_zdata_alloc(zsize);
+		memcpy(gl->zdata, zbuf, zsize);
+		grid_add_memory(gd, zsize);
+	}
+
+	grid_release_cells(gd, gl);
+	if (gl->extddata != NULL) {
+		free(gl->extddata);
+		gl->extddata = NULL;
+		grid_sub_memory(gd, esize);
+	}
+#endif
+}
+
+/* Decompress a line's data into dst, which may be the same line. */
+void
+grid_uncompress_line(struct grid *gd, const struct grid_line *gl,
+    struct grid_line *dst)
+{
+#ifdef HAVE_ZLIB
+	u_char	*zbuf;
+	size_t	 csize, esize;
+	uLongf	 size;
+
+	csize = gl->cellsize * sizeof *gl->celldata;
+	esize = gl->extdsize * sizeof *gl->extddata;
+	zbuf = grid_get_zbuf(csize + esize);
+
+	size = csize + esize;
+	if (uncompress(zbuf, &size, gl->zdata, gl->zsize) != Z_OK ||
+	    size != csize + esize)
+		fatalx("corrupt compressed history line");
+
+	grid_reserve_cells(gd, dst, gl->cellsize);
+	memcpy(dst->celldata, zbuf, csize);
+	if (esize != 0) {
+		dst->extddata = xreallocarray(dst->extddata, gl->extdsize,
+		    sizeof *dst->extddata);
+		memcpy(dst->extddata, zbuf + csize, esize);
+		if (dst == gl)
+			grid_add_memory(gd, esize);
+	}
+	dst->cellsize = gl->cellsize;
+	dst->extdsize = gl->extdsize;
+	dst->flags = gl->flags;
+#endif
+}
+
+/* Free a line's data. */
+void
+grid_free_line(struct grid *gd, struct grid_line *gl)
+{
+	if (gl->zdata != NULL) {
+		if (gl->zdata == gd->zcache_key)
+			gd->zcache_key = NULL;
+		grid_sub_memory(gd, grid_zdata_memory(gl));
+		grid_zdata_unref(gl->zdata);
+	}
+	grid_release_cells(gd, gl);
+	if (gl->extddata != NULL) {
+		free(gl->extddata);
+		grid_sub_memory(gd, gl->extdsize * sizeof *gl->extddata);
+	}
+}
+
+/* Get the memory held by a line. */
+static size_t
+grid_line_memory(const struct grid_line *gl)
+{
+	size_t	size;
+
+	size = gl->cellalloc * sizeof *gl->celldata + grid_zdata_memory(gl);
+	if (gl->extddata != NULL)
+		size += gl->extdsize * sizeof *gl->extddata;
+	return (size);
+}
+
+/* Get the memory held by some lines. */
+size_t
+grid_lines_memory(const struct grid_line *lines, u_int n)
+{
+	size_t	size = 0;
+	u_int	yy;
+
+	for (yy = 0; yy < n; yy++)
+		size += grid_line_memory(&lines[yy]);
+	return (size);
+}
+
+/*
+ * Hand lines, no longer part of any grid, to the reaper. The array holding
+ * them, of basesize bytes, is freed after them. Their memory must already be
+ * taken out of the grid's but left in grid_total_memory.
+ */
+void
+grid_reap_lines(struct grid_line *base, size_t basesize,
+    struct grid_line *lines, u_int n)
+{
+	struct grid_reap	*gr;
+	struct timeval		 tv = { .tv_sec = 0, .tv_usec = 1000 };
+
+	gr = xmalloc(sizeof *gr);
+	gr->base = base;
+	gr->basesize = basesize;
+	gr->lines = lines;
+	gr->n = n;
+	TAILQ_INSERT_TAIL(&grid_reaps, gr, entry);
+
+	if (!event_initialized(&grid_reap_timer)) {
+		evtimer_set(&grid_reap_timer, grid_reap_callback, NULL);
+		event_priority_set(&grid_reap_timer, EVENT_PRI_BACKGROUND);
+	}
+	if (!evtimer_pending(&grid_reap_timer, NULL))
+		evtimer_add(&grid_reap_timer, &tv);
+}
+
+/* Free the next lines handed to the reaper. */
+void
+grid_reap_callback(__unused int fd, __unused short events, __unused void *arg)
+{
+	struct grid_reap	*gr;
+	struct grid_line	*gl;
+	struct timeval		 tv = { .tv_sec = 0, .tv_usec = 1000 };
+	u_int			 left = GRID_REAP_LINES;
+
+	while (left != 0 && (gr = TAILQ_FIRST(&grid_reaps)) != NULL) {
+		for (; left != 0 && gr->n != 0; left--) {
+			gl = &gr->lines[--gr->n];
+			grid_total_memory -= grid_line_memory(gl);
+			grid_zdata_unref(gl->zdata);
+			free(gl->celldata);
+			free(gl->extddata);
+		}
+		if (gr->n != 0)
+			break;
+
+		free(gr->base);
+		grid_total_memory -= gr->basesize;
+		TAILQ_REMOVE(&grid_reaps, gr, entry);
+		free(gr);
+	}
+
+	if (!TAILQ_EMPTY(&grid_reaps))
+		evtimer_add(&grid_reap_timer, &tv);
+}
+
+/* Get a line for writing, decompressing it if necessary. */
+struct grid_line *
+grid_get_line(struct grid *gd, u_int py)
+{
+	struct grid_line	*gl = &gd->linedata[py];
+
+	if (gl->zdata == NULL)
+		return (gl);
+
+	if (gl->zdata == gd->zcache_key)
+		gd->zcache_key = NULL;
+	grid_uncompress_line(gd, gl, gl);
+	grid_sub_memory(gd, grid_zdata_memory(gl));
+	grid_zdata_unref(gl->zdata);
+	gl->zdata = NULL;
+	gl->zsize = 0;
+	return (gl);
+}
+
+/* Get a line for reading, through the cache if compressed. */
+const struct grid_line *
+grid_read_line(struct grid *gd, u_int py)
+{
+	struct grid_line	*gl = &gd->linedata[py];
+
+	if (gl->zdata == NULL)
+		return (gl);
+
+	if (gl->zdata != gd->zcache_key) {
+		grid_uncompress_line(gd, gl, &gd->zcache);
+		gd->zcache_key = gl->zdata;
+	}
+	gd->zcache.flags = gl->flags;
+	return (&gd->zcache);
+}
+
 /* Create a new grid. */
 struct grid *
 grid_create(u_int sx, u_int sy, u_int hlimit)
@@ -88,8 +707,33 @@ grid_create(u_int sx, u_int sy, u_int hlimit)
 
 	gd->hsize = 0;
 	gd->hlimit = hlimit;
-
-	gd->linedata = xcalloc(gd->sy, sizeof *gd->linedata);
+	gd->hwarm = 0;
+	gd->hspill = 0;
+	gd->spill = NULL;
+	gd->hpending = 0;
+	gd->hremoved = 0;
+	gd->hscrolled = 0;
+
+	gd->linebase = xcalloc(gd->sy, sizeof *gd->linebase);
+	gd->memory = 0;
+	grid_add_memory(gd, sizeof *gd + gd->sy * sizeof *gd->linebase);
+	gd->linedata = gd->linebase;
+	gd->lineoff = 0;
+	gd->linesize = gd->sy;
+	gd->linealloc = gd->sy;
+
+	memset(&gd->zcache, 0, sizeof gd->zcache);
+	gd->zcache_key = NULL;
+
+	gd->spare = NULL;
+	gd->spare_size = 0;
+	gd->nspare = 0;
+	gd->spare_sx = sx;
+
+	gd->index = NULL;
+	gd->cache = NULL;
+	gd->cache_generation = ++grid_cache_generations;
+	gd->styles = NULL;
 
 	return (gd);
 }
@@ -99,15 +743,35 @@ void
 grid_destroy(struct grid *gd)
 {
 	struct grid_line	*gl;
-	u_int			 yy;
-
-	for (yy = 0; yy < gd->hsize + gd->sy; yy++) {
-		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
+	u_int			 yy, n;
+	size_t			 size;
+
+	n = gd->hsize + gd->sy;
+	if (n >= GRID_REAP_MIN) {
+		size = gd->linealloc * sizeof *gd->linebase;
+		gd->memory -= grid_lines_memory(gd->linedata, n) + size;
+		grid_reap_lines(gd->linebase, size, gd->linedata, n);
+	} else {
+		for (yy = 0; yy < n; yy++) {
+			gl = &gd->linedata[yy];
+			grid_zdata_unref(gl->zdata);
+			free(gl->celldata);
+			free(gl->extddata);
+		}
+		free(gd->linebase);
 	}
 
-	free(gd->linedata);
+	free(gd->zcache.celldata);
+	free(gd->zcache.extddata);
+
+	grid_free_spare(gd);
+	grid_index_disable(gd);
+	grid_cache_drop(gd, 0);
+	if (gd->spill != NULL)
+		grid_spill_unref(gd->spill);
+	grid_styles_free(gd->styles);
+
+	grid_total_memory -= gd->memory;
 
 	free(gd);
 }
@@ -139,9 +803,55 @@ grid_compare(struct grid *ga, struct grid *gb)
 	return (0);
 }
 
+/*
+ * Change the number of lines, keeping as many existing lines as possible. New
+ * lines are cleared. When out of room at the end of the array, lines are moved
+ * back to the start if there is at least as much space free there as there
+ * are lines to move; otherwise the array grows. Either way scrolling costs a
+ * constant amount per line on average.
+ */
+void
+grid_resize_lines(struct grid *gd, u_int n)
+{
+	u_int	keep, size;
+	int	full, shrink;
+
+	keep = n < gd->linesize ? n : gd->linesize;
+	full = (gd->lineoff + n > gd->linealloc);
+	shrink = (n < gd->linealloc / 4);
+
+	if (gd->lineoff != 0 && ((full && gd->lineoff >= keep) || shrink)) {
+		memmove(gd->linebase, gd->linedata,
+		    keep * sizeof *gd->linebase);
+		gd->lineoff = 0;
+	}
+
+	if (gd->lineoff + n > gd->linealloc) {
+		size = gd->lineoff + n;
+		size += size / 2;
+		gd->linebase = xreallocarray(gd->linebase, size,
+		    sizeof *gd->linebase);
+		grid_add_memory(gd,
+		    (size - gd->linealloc) * sizeof *gd->linebase);
+		gd->linealloc = size;
+	} else if (shrink && n != 0) {
+		gd->linebase = xreallocarray(gd->linebase, n,
+		    sizeof *gd->linebase);
+		grid_sub_memory(gd, (gd->linealloc - n) * sizeof *gd->linebase);
+		gd->linealloc = n;
+	}
+	gd->linedata = gd->linebase + gd->lineoff;
+
+	if (n > gd->linesize) {
+		memset(&gd->linedata[gd->linesize], 0,
+		    (n - gd->linesize) * sizeof *gd->linedata);
+	}
+	gd->linesize = n;
+}
+
 /*
  * Collect lines from the history if at the limit. Free the top (oldest) 10%
- * and shift up.
+ * and move the start of the lines past them.
  */
 void
 grid_collect_history(struct grid *gd)
@@ -155,8 +865,151 @@ grid_collect_history(struct grid *gd)
 	if (yy < 1)
 		yy = 1;
 
-	grid_move_lines(gd, 0, yy, gd->hsize + gd->sy - yy);
-	gd->hsize -= yy;
+	PROBE2(grid_collect_history, gd->hsize, yy);
+	grid_trim_history(gd, yy);
+}
+
+/* Free the oldest lines of history. */
+void
+grid_trim_history(struct grid *gd, u_int ny)
+{
+	if (ny > gd->hsize)
+		ny = gd->hsize;
+	if (ny == 0)
+		return;
+
+	grid_clear_lines(gd, 0, ny);
+	gd->lineoff += ny;
+	gd->linedata += ny;
+	gd->linesize -= ny;
+	gd->hsize -= ny;
+	gd->hremoved += ny;
+
+	if (ny > gd->hpending)
+		gd->hpending = 0;
+	else
+		gd->hpending -= ny;
+
+	grid_index_trim(gd, ny);
+	grid_cache_trim(gd);
+}
+
+/* Get the data cached for a history line. */
+const void *
+grid_cache_get(struct grid *gd, u_int py, size_t *size)
+{
+	struct grid_cache	*gc = gd->cache;
+	uint64_t		 y = gd->hremoved + py;
+
+	if (gc == NULL || py >= gd->hsize || y < gc->base ||
+	    y >= gc->base + gc->n || gc->entries[y - gc->base].data == NULL)
+		return (NULL);
+	*size = gc->entries[y - gc->base].size;
+	return (gc->entries[y - gc->base].data);
+}
+
+/* Cache data for a history line. The grid frees it when the line goes. */
+void
+grid_cache_set(struct grid *gd, u_int py, void *data, size_t size)
+{
+	struct grid_cache	*gc = gd->cache;
+	struct grid_cache_entry	*e;
+	uint64_t		 y = gd->hremoved + py;
+	u_int			 n, add;
+
+	if (py >= gd->hsize) {
+		free(data);
+		return;
+	}
+
+	if (gc == NULL) {
+		gc = gd->cache = xcalloc(1, sizeof *gc);
+		gc->base = y;
+	}
+
+	if (y < gc->base) {
+		add = gc->base - y;
+		gc->entries = xreallocarray(gc->entries, gc->n + add,
+		    sizeof *gc->entries);
+		memmove(&gc->entries[add], gc->entries,
+		    gc->n * sizeof *gc->entries);
+		memset(gc->entries, 0, add * sizeof *gc->entries);
+		gc->base = y;
+		gc->n += add;
+		grid_add_memory(gd, add * sizeof *gc->entries);
+	} else if (y >= gc->base + gc->n) {
+		n = y - gc->base + 1;
+		gc->entries = xreallocarray(gc->entries, n,
+		    sizeof *gc->entries);
+		memset(&gc->entries[gc->n], 0,
+		    (n - gc->n) * sizeof *gc->entries);
+		grid_add_memory(gd, (n - gc->n) * sizeof *gc->entries);
+		gc->n = n;
+	}
+
+	e = &gc->entries[y - gc->base];
+	grid_sub_memory(gd, e->size);
+	free(e->data);
+	e->data = data;
+	e->size = size;
+	grid_add_memory(gd, size);
+}
+
+/* Drop the data cached for history lines from py on. */
+void
+grid_cache_drop(struct grid *gd, u_int py)
+{
+	struct grid_cache	*gc = gd->cache;
+	uint64_t		 y = gd->hremoved + py;
+	u_int			 i;
+
+	/* Users keeping their own data for history lines check this. */
+	gd->cache_generation = ++grid_cache_generations;
+
+	if (gc == NULL || y >= gc->base + gc->n)
+		return;
+	if (y < gc->base)
+		y = gc->base;
+
+	for (i = y - gc->base; i < gc->n; i++) {
+		grid_sub_memory(gd, gc->entries[i].size);
+		free(gc->entries[i].data);
+	}
+	if (y == gc->base) {
+		grid_sub_memory(gd, gc->n * sizeof *gc->entries);
+		free(gc->entries);
+		free(gc);
+		gd->cache = NULL;
+		return;
+	}
+	grid_sub_memory(gd, (gc->n - (y - gc->base)) * sizeof *gc->entries);
+	gc->n = y - gc->base;
+}
+
+/* Drop the data cached for lines collected from the history. */
+void
+grid_cache_trim(struct grid *gd)
+{
+	struct grid_cache	*gc = gd->cache;
+	u_int			 i, ny;
+
+	if (gc == NULL || gc->base >= gd->hremoved)
+		return;
+
+	ny = gd->hremoved - gc->base;
+	if (ny >= gc->n) {
+		grid_cache_drop(gd, 0);
+		return;
+	}
+	for (i = 0; i < ny; i++) {
+		grid_sub_memory(gd, gc->entries[i].size);
+		free(gc->entries[i].data);
+	}
+	memmove(gc->entries, &gc->entries[ny],
+	    (gc->n - ny) * sizeof *gc->entries);
+	gc->n -= ny;
+	gc->base = gd->hremoved;
+	grid_sub_memory(gd, ny * sizeof *gc->entries);
 }
 
 /*
@@ -169,23 +1022,49 @@ grid_scroll_history(struct grid *gd)
 	u_int	yy;
 
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
-	memset(&gd->linedata[yy], 0, sizeof gd->linedata[yy]);
+	grid_resize_lines(gd, yy + 1);
 
 	gd->hsize++;
+	gd->hscrolled++;
+	if (gd->hwarm != 0 && gd->hsize > gd->hwarm)
+		grid_compress_line(gd, gd->hsize - 1 - gd->hwarm);
+	grid_index_update(gd);
 }
 
 /* Clear the history. */
 void
 grid_clear_history(struct grid *gd)
 {
-	grid_clear_lines(gd, 0, gd->hsize);
-	grid_move_lines(gd, 0, gd->hsize, gd->sy);
+	struct grid_line	*base;
+	size_t			 size;
+
+	if (gd->hsize >= GRID_REAP_MIN) {
+		/* Give the whole line array to the reaper with the history. */
+		base = gd->linebase;
+		size = gd->linealloc * sizeof *gd->linebase;
+		gd->memory -= grid_lines_memory(gd->linedata, gd->hsize) + size;
+
+		gd->linebase = xreallocarray(NULL, gd->sy, sizeof *gd->linebase);
+		memcpy(gd->linebase, &gd->linedata[gd->hsize],
+		    gd->sy * sizeof *gd->linebase);
+		grid_add_memory(gd, gd->sy * sizeof *gd->linebase);
+		grid_reap_lines(base, size, gd->linedata, gd->hsize);
+
+		gd->linedata = gd->linebase;
+		gd->lineoff = 0;
+		gd->linesize = gd->linealloc = gd->sy;
+		gd->zcache_key = NULL;
+	} else {
+		grid_clear_lines(gd, 0, gd->hsize);
+		grid_move_lines(gd, 0, gd->hsize, gd->sy);
+	}
 
+	grid_cache_drop(gd, 0);
+	gd->hremoved += gd->hsize;
 	gd->hsize = 0;
-	gd->linedata = xreallocarray(gd->linedata, gd->sy,
-	    sizeof *gd->linedata);
+	gd->hpending = 0;
+	grid_resize_lines(gd, gd->sy);
+	grid_index_reset(gd, 0);
 }
 
 /* Scroll a region up, moving the top line into the history. */
@@ -197,8 +1076,7 @@ grid_scroll_history_region(struct grid *gd, u_int upper, u_int lower)
 
 	/* Create a space for a new line. */
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
+	grid_resize_lines(gd, yy + 1);
 
 	/* Move the entire screen down to free a space for this line. */
 	gl_history = &gd->linedata[gd->hsize];
@@ -219,6 +1097,10 @@ grid_scroll_history_region(struct grid *gd, u_int upper, u_int lower)
 
 	/* Move the history offset down over the line. */
 	gd->hsize++;
+	gd->hscrolled++;
+	if (gd->hwarm != 0 && gd->hsize > gd->hwarm)
+		grid_compress_line(gd, gd->hsize - 1 - gd->hwarm);
+	grid_index_update(gd);
 }
 
 /* Expand line to fit to cell. */
@@ -228,11 +1110,11 @@ grid_expand_line(struct grid *gd, u_int py, u_int sx)
 	struct grid_line	*gl;
 	u_int			 xx;
 
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 	if (sx <= gl->cellsize)
 		return;
 
-	gl->celldata = xreallocarray(gl->celldata, sx, sizeof *gl->celldata);
+	grid_reserve_cells(gd, gl, sx);
 	for (xx = gl->cellsize; xx < sx; xx++)
 		grid_clear_cell(gd, xx, py);
 	gl->cellsize = sx;
@@ -244,29 +1126,124 @@ grid_peek_line(struct grid *gd, u_int py)
 {
 	if (grid_check_y(gd, py) != 0)
 		return (NULL);
-	return (&gd->linedata[py]);
+	return (grid_read_line(gd, py));
+}
+
+/* Number of entries used by an extended cell. */
+u_int
+grid_extd_slots(u_int style, u_int size)
+{
+	u_int	slots = 1;
+
+	if (style == GRID_STYLE_NONE)
+		slots++;
+	if (size > GRID_EXTD_DATA)
+		slots++;
+	return (slots);
+}
+
+/* Unpack an extended cell. */
+void
+grid_extd_get(struct grid *gd, const struct grid_line *gl, u_int offset,
+    struct grid_cell *gc)
+{
+	const struct grid_extd_entry	*ge = &gl->extddata[offset];
+	const struct grid_style		*gsp;
+	struct grid_style		 gs;
+	u_int				 i, next = offset + 1, size = ge->size;
+
+	memcpy(gc, &grid_default_cell, sizeof *gc);
+	if (offset + grid_extd_slots(ge->style, size) > gl->extdsize)
+		return;
+
+	if (ge->style == GRID_STYLE_NONE) {
+		memcpy(&gs, &gl->extddata[next++], sizeof gs);
+		grid_style_to_cell(&gs, gc);
+	} else if ((gsp = grid_styles_get(gd->styles, ge->style)) != NULL)
+		grid_style_to_cell(gsp, gc);
+
+	gc->data.size = gc->data.have = size;
+	gc->data.width = ge->width;
+	if (size <= GRID_EXTD_DATA)
+		memcpy(gc->data.data, ge->data, size);
+	else {
+		memcpy(gc->data.data, ge->data, GRID_EXTD_DATA);
+		memcpy(gc->data.data + GRID_EXTD_DATA, &gl->extddata[next],
+		    size - GRID_EXTD_DATA);
+	}
+	for (i = size; i < sizeof gc->data.data; i++)
+		gc->data.data[i] = '\0';
+}
+
+/*
+ * Pack a cell into the extended entries of a cell, adding new ones at the end
+ * of the line if it has none or they are too few.
+ */
+void
+grid_extd_set(struct grid *gd, struct grid_line *gl,
+    struct grid_cell_entry *gce, const struct grid_cell *gc)
+{
+	struct grid_extd_entry	*ge;
+	struct grid_style	 gs;
+	u_int			 style, slots, next, size = gc->data.size;
+
+	if (gd->styles == NULL)
+		gd->styles = grid_styles_create();
+	grid_style_from_cell(&gs, gc);
+	style = grid_styles_add(gd->styles, &gs);
+
+	slots = grid_extd_slots(style, size);
+	if (~gce->flags & GRID_FLAG_EXTENDED ||
+	    gce->offset >= gl->extdsize ||
+	    gce->offset + grid_extd_slots(gl->extddata[gce->offset].style,
+	    gl->extddata[gce->offset].size) > gl->extdsize ||
+	    grid_extd_slots(gl->extddata[gce->offset].style,
+	    gl->extddata[gce->offset].size) < slots) {
+		gl->extddata = xreallocarray(gl->extddata,
+		    gl->extdsize + slots, sizeof *gl->extddata);
+		grid_add_memory(gd, slots * sizeof *gl->extddata);
+		gce->offset = gl->extdsize;
+		gl->extdsize += slots;
+	}
+	gce->flags = gc->flags | GRID_FLAG_EXTENDED;
+
+	ge = &gl->extddata[gce->offset];
+	next = gce->offset + 1;
+	ge->style = style;
+	ge->width = gc->data.width;
+	ge->size = size;
+	if (style == GRID_STYLE_NONE)
+		memcpy(&gl->extddata[next++], &gs, sizeof gs);
+
+	if (size <= GRID_EXTD_DATA)
+		memcpy(ge->data, gc->data.data, size);
+	else {
+		memcpy(ge->data, gc->data.data, GRID_EXTD_DATA);
+		memcpy(&gl->extddata[next], gc->data.data + GRID_EXTD_DATA,
+		    size - GRID_EXTD_DATA);
+	}
 }
 
 /* Get cell for reading. */
 void
 grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
 {
-	struct grid_line	*gl;
-	struct grid_cell_entry	*gce;
+	const struct grid_line		*gl;
+	const struct grid_cell_entry	*gce;
 
 	if (grid_check_y(gd, py) != 0 || px >= gd->linedata[py].cellsize) {
 		memcpy(gc, &grid_default_cell, sizeof *gc);
 		return;
 	}
 
-	gl = &gd->linedata[py];
+	gl = grid_read_line(gd, py);
 	gce = &gl->celldata[px];
 
 	if (gce->flags & GRID_FLAG_EXTENDED) {
 		if (gce->offset >= gl->extdsize)
 			memcpy(gc, &grid_default_cell, sizeof *gc);
 		else
-			memcpy(gc, &gl->extddata[gce->offset], sizeof *gc);
+			grid_extd_get(gd, gl, gce->offset, gc);
 		return;
 	}
 
@@ -283,7 +1260,6 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 {
 	struct grid_line	*gl;
 	struct grid_cell_entry	*gce;
-	struct grid_cell 	*gcp;
 	int			 extended;
 
 	if (grid_check_y(gd, py) != 0)
@@ -300,17 +1276,7 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 	if (!extended && (gc->flags & (GRID_FLAG_FGRGB|GRID_FLAG_BGRGB)))
 		extended = 1;
 	if (extended) {
-		if (~gce->flags & GRID_FLAG_EXTENDED) {
-			gl->extddata = xreallocarray(gl->extddata,
-			    gl->extdsize + 1, sizeof *gl->extddata);
-			gce->offset = gl->extdsize++;
-			gce->flags = gc->flags | GRID_FLAG_EXTENDED;
-		}
-
-		if (gce->offset >= gl->extdsize)
-			fatalx("offset too big");
-		gcp = &gl->extddata[gce->offset];
-		memcpy(gcp, gc, sizeof *gcp);
+		grid_extd_set(gd, gl, gce, gc);
 		return;
 	}
 
@@ -321,6 +1287,50 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 	gce->data.data = gc->data.data[0];
 }
 
+/*
+ * Set a run of single-width ASCII cells sharing the attributes of gc. Cells
+ * which are already extended are updated in place through grid_set_cell.
+ */
+void
+grid_set_cells(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc,
+    const u_char *data, u_int n)
+{
+	struct grid_line	*gl;
+	struct grid_cell_entry	*gce;
+	struct grid_cell	 tmp_gc;
+	u_int			 i;
+
+	if (n == 0 || grid_check_y(gd, py) != 0)
+		return;
+
+	if (gc->flags & (GRID_FLAG_FGRGB|GRID_FLAG_BGRGB)) {
+		memcpy(&tmp_gc, gc, sizeof tmp_gc);
+		for (i = 0; i < n; i++) {
+			utf8_set(&tmp_gc.data, data[i]);
+			grid_set_cell(gd, px + i, py, &tmp_gc);
+		}
+		return;
+	}
+
+	grid_expand_line(gd, py, px + n);
+
+	gl = &gd->linedata[py];
+	for (i = 0; i < n; i++) {
+		gce = &gl->celldata[px + i];
+		if (gce->flags & GRID_FLAG_EXTENDED) {
+			memcpy(&tmp_gc, gc, sizeof tmp_gc);
+			utf8_set(&tmp_gc.data, data[i]);
+			grid_set_cell(gd, px + i, py, &tmp_gc);
+			continue;
+		}
+		gce->flags = gc->flags & ~GRID_FLAG_EXTENDED;
+		gce->data.attr = gc->attr;
+		gce->data.fg = gc->fg;
+		gce->data.bg = gc->bg;
+		gce->data.data = data[i];
+	}
+}
+
 /* Clear area. */
 void
 grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny)
@@ -343,6 +1353,7 @@ grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny)
 	for (yy = py; yy < py + ny; yy++) {
 		if (px >= gd->linedata[yy].cellsize)
 			continue;
+		grid_get_line(gd, yy);
 		if (px + nx >= gd->linedata[yy].cellsize) {
 			gd->linedata[yy].cellsize = px;
 			continue;
@@ -372,8 +1383,7 @@ grid_clear_lines(struct grid *gd, u_int py, u_int ny)
 
 	for (yy = py; yy < py + ny; yy++) {
 		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
+		grid_free_line(gd, gl);
 		memset(gl, 0, sizeof *gl);
 	}
 }
@@ -426,7 +1436,7 @@ grid_move_cells(struct grid *gd, u_int dx, u_int px, u_int py, u_int nx)
 
 	if (grid_check_y(gd, py) != 0)
 		return;
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 
 	grid_expand_line(gd, py, px + nx);
 	grid_expand_line(gd, py, dx + nx);
@@ -693,6 +1703,158 @@ grid_string_cells(struct grid *gd, u_int px, u_int py, u_int nx,
 	return (buf);
 }
 
+/* Do two cells have the same attributes and colours? */
+int
+grid_string_cells_same(const struct grid_cell *a, const struct grid_cell *b)
+{
+	int	flags = GRID_FLAG_FG256|GRID_FLAG_BG256|GRID_FLAG_FGRGB|
+		    GRID_FLAG_BGRGB;
+
+	if (a->attr != b->attr || (a->flags & flags) != (b->flags & flags))
+		return (0);
+	if (a->flags & GRID_FLAG_FGRGB) {
+		if (memcmp(&a->fg_rgb, &b->fg_rgb, sizeof a->fg_rgb) != 0)
+			return (0);
+	} else if (a->fg != b->fg)
+		return (0);
+	if (a->flags & GRID_FLAG_BGRGB) {
+		if (memcmp(&a->bg_rgb, &b->bg_rgb, sizeof a->bg_rgb) != 0)
+			return (0);
+	} else if (a->bg != b->bg)
+		return (0);
+	return (1);
+}
+
+/*
+ * Add cells to a buffer as grid_string_cells does, but a run of cells with the
+ * same style at a time: codes are only worked out where the style changes,
+ * and the text goes straight into the buffer without building a string for
+ * the line. Trailing spaces to trim are held back until something follows.
+ */
+void
+grid_string_cells_buffer(struct grid *gd, u_int px, u_int py, u_int nx,
+    struct grid_cell *lastgc, int with_codes, int escape_c0, int trim,
+    struct evbuffer *evb)
+{
+	const struct grid_line	*gl;
+	struct grid_cell	 gc;
+	char			 buf[1024], code[128];
+	size_t			 off, codelen, spaces;
+	u_int			 xx;
+	int			 space;
+
+	gl = grid_peek_line(gd, py);
+	if (gl == NULL)
+		return;
+
+	off = spaces = 0;
+	for (xx = px; xx < px + nx && xx < gl->cellsize; xx++) {
+		grid_get_cell(gd, xx, py, &gc);
+		if (gc.flags & GRID_FLAG_PADDING)
+			continue;
+
+		codelen = 0;
+		if (with_codes && !grid_string_cells_same(lastgc, &gc)) {
+			grid_string_cells_code(lastgc, &gc, code, sizeof code,
+			    escape_c0);
+			codelen = strlen(code);
+			memcpy(lastgc, &gc, sizeof *lastgc);
+		}
+
+		space = (trim && gc.data.size == 1 && *gc.data.data == ' ');
+		if (space && codelen == 0) {
+			spaces++;
+			continue;
+		}
+
+		/* Spaces held back are wanted after all. */
+		for (; spaces != 0; spaces--) {
+			if (off == sizeof buf) {
+				evbuffer_add(evb, buf, off);
+				off = 0;
+			}
+			buf[off++] = ' ';
+		}
+		if (off + codelen + 2 + gc.data.size > sizeof buf) {
+			evbuffer_add(evb, buf, off);
+			off = 0;
+		}
+
+		memcpy(buf + off, code, codelen);
+		off += codelen;
+		if (space)
+			spaces++;
+		else if (escape_c0 && gc.data.size == 1 && *gc.data.data == '\\') {
+			memcpy(buf + off, "\\\\", 2);
+			off += 2;
+		} else {
+			memcpy(buf + off, gc.data.data, gc.data.size);
+			off += gc.data.size;
+		}
+	}
+	evbuffer_add(evb, buf, off);
+}
+
+/*
+ * Get the text of a line, without codes, into a buffer which is grown as
+ * needed so it can be reused for the next line. Returns its length.
+ */
+size_t
+grid_string_text(struct grid *gd, u_int py, char **buf, size_t *size)
+{
+	const struct grid_line	*gl;
+	struct grid_cell	 gc;
+	size_t			 off = 0;
+	u_int			 xx;
+
+	gl = grid_peek_line(gd, py);
+	for (xx = 0; gl != NULL && xx < gl->cellsize; xx++) {
+		grid_get_cell(gd, xx, py, &gc);
+		if (gc.flags & GRID_FLAG_PADDING)
+			continue;
+		if (off + gc.data.size + 1 > *size) {
+			*size = (off + gc.data.size + 1) * 2;
+			*buf = xrealloc(*buf, *size);
+		}
+		memcpy(*buf + off, gc.data.data, gc.data.size);
+		off += gc.data.size;
+	}
+	if (*size == 0) {
+		*size = 1;
+		*buf = xmalloc(1);
+	}
+	(*buf)[off] = '\0';
+
+	return (off);
+}
+
+/*
+ * Swap a set of lines between two grids sharing styles, without copying their
+ * cells. Both grids must have the lines.
+ */
+void
+grid_swap_lines(struct grid *ga, u_int pya, struct grid *gb, u_int pyb,
+    u_int ny)
+{
+	struct grid_line	 gl;
+	size_t			 ma, mb;
+	u_int			 yy;
+
+	ma = grid_lines_memory(&ga->linedata[pya], ny);
+	mb = grid_lines_memory(&gb->linedata[pyb], ny);
+
+	for (yy = 0; yy < ny; yy++) {
+		memcpy(&gl, &ga->linedata[pya + yy], sizeof gl);
+		memcpy(&ga->linedata[pya + yy], &gb->linedata[pyb + yy],
+		    sizeof gl);
+		memcpy(&gb->linedata[pyb + yy], &gl, sizeof gl);
+	}
+
+	ga->memory = ga->memory - ma + mb;
+	gb->memory = gb->memory - mb + ma;
+	ga->zcache_key = gb->zcache_key = NULL;
+}
+
 /*
  * Duplicate a set of lines between two grids. If there aren't enough lines in
  * either source or destination, the number of lines is limited to the number
@@ -702,8 +1864,11 @@ void
 grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
     u_int ny)
 {
-	struct grid_line	*dstl, *srcl;
-	u_int			 yy;
+	struct grid_line	*dstl;
+	const struct grid_line	*srcl;
+	struct grid_cell_entry	*gce;
+	struct grid_cell	 gc;
+	u_int			 yy, xx;
 
 	if (dy + ny > dst->hsize + dst->sy)
 		ny = dst->hsize + dst->sy - dy;
@@ -715,19 +1880,50 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 		srcl = &src->linedata[sy];
 		dstl = &dst->linedata[dy];
 
+		/* A compressed line is shared, if its style ids mean the same. */
+		if (srcl->zdata != NULL &&
+		    (srcl->extdsize == 0 || dst->styles == src->styles)) {
+			memcpy(dstl, srcl, sizeof *dstl);
+			dstl->zdata = grid_zdata_ref(srcl->zdata);
+			grid_add_memory(dst, grid_zdata_memory(dstl));
+			sy++;
+			dy++;
+			continue;
+		}
+
+		srcl = grid_read_line(src, sy);
 		memcpy(dstl, srcl, sizeof *dstl);
+		dstl->celldata = NULL;
+		dstl->cellalloc = 0;
 		if (srcl->cellsize != 0) {
-			dstl->celldata = xreallocarray(NULL,
-			    srcl->cellsize, sizeof *dstl->celldata);
+			grid_reserve_cells(dst, dstl, srcl->cellsize);
 			memcpy(dstl->celldata, srcl->celldata,
 			    srcl->cellsize * sizeof *dstl->celldata);
-		} else
-			dstl->celldata = NULL;
+		}
 
-		if (srcl->extdsize != 0) {
+		dstl->extddata = NULL;
+		dstl->extdsize = 0;
+		if (srcl->extdsize != 0 && dst->styles != src->styles) {
+			/* Style ids differ, so add each cell again. */
+			for (xx = 0; xx < dstl->cellsize; xx++) {
+				gce = &dstl->celldata[xx];
+				if (~gce->flags & GRID_FLAG_EXTENDED)
+					continue;
+				if (gce->offset >= srcl->extdsize) {
+					memcpy(gce, &grid_default_entry,
+					    sizeof *gce);
+					continue;
+				}
+				grid_extd_get(src, srcl, gce->offset, &gc);
+				gce->flags &= ~GRID_FLAG_EXTENDED;
+				grid_extd_set(dst, dstl, gce, &gc);
+			}
+		} else if (srcl->extdsize != 0) {
 			dstl->extdsize = srcl->extdsize;
 			dstl->extddata = xreallocarray(NULL, dstl->extdsize,
 			    sizeof *dstl->extddata);
+			grid_add_memory(dst,
+			    dstl->extdsize * sizeof *dstl->extddata);
 			memcpy(dstl->extddata, srcl->extddata, dstl->extdsize *
 			    sizeof *dstl->extddata);
 		}
@@ -737,13 +1933,37 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 	}
 }
 
+/*
+ * Take a copy of a grid which shares its compressed lines. It is a grid like
+ * any other: changing either leaves the other as it was.
+ */
+struct grid *
+grid_snapshot(struct grid *gd)
+{
+	struct grid	*snap;
+
+	snap = grid_create(gd->sx, gd->sy, gd->hlimit);
+	snap->flags = gd->flags;
+	grid_styles_share(snap, gd);
+
+	grid_resize_lines(snap, gd->hsize + gd->sy);
+	snap->hsize = gd->hsize;
+	snap->hwarm = gd->hwarm;
+	snap->hpending = gd->hpending;
+	snap->hremoved = gd->hremoved;
+	snap->hscrolled = gd->hscrolled;
+
+	grid_duplicate_lines(snap, 0, gd, 0, gd->hsize + gd->sy);
+	return (snap);
+}
+
 /* Copy a section of a line. */
 void
-grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
-    u_int from, u_int to_copy)
+grid_reflow_copy(struct grid *dst, struct grid_line *dst_gl, u_int to,
+    struct grid_line *src_gl, u_int from, u_int to_copy)
 {
 	struct grid_cell_entry	*gce;
-	u_int			 i, was;
+	u_int			 i, was, slots;
 
 	memcpy(&dst_gl->celldata[to], &src_gl->celldata[from],
 	    to_copy * sizeof *dst_gl->celldata);
@@ -753,12 +1973,20 @@ grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
 		if (~gce->flags & GRID_FLAG_EXTENDED)
 			continue;
 		was = gce->offset;
+		slots = grid_extd_slots(src_gl->extddata[was].style,
+		    src_gl->extddata[was].size);
+		if (was + slots > src_gl->extdsize) {
+			memcpy(gce, &grid_default_entry, sizeof *gce);
+			continue;
+		}
 
 		dst_gl->extddata = xreallocarray(dst_gl->extddata,
-		    dst_gl->extdsize + 1, sizeof *dst_gl->extddata);
-		gce->offset = dst_gl->extdsize++;
+		    dst_gl->extdsize + slots, sizeof *dst_gl->extddata);
+		grid_add_memory(dst, slots * sizeof *dst_gl->extddata);
+		gce->offset = dst_gl->extdsize;
+		dst_gl->extdsize += slots;
 		memcpy(&dst_gl->extddata[gce->offset], &src_gl->extddata[was],
-		    sizeof *dst_gl->extddata);
+		    slots * sizeof *dst_gl->extddata);
 	}
 }
 
@@ -767,7 +1995,7 @@ void
 grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
     u_int new_x)
 {
-	struct grid_line	*dst_gl = &dst->linedata[(*py) - 1];
+	struct grid_line	*dst_gl = grid_get_line(dst, (*py) - 1);
 	u_int			 left, to_copy, ox, nx;
 
 	/* How much is left on the old line? */
@@ -781,12 +2009,11 @@ grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
 	nx = ox + to_copy;
 
 	/* Resize the destination line. */
-	dst_gl->celldata = xreallocarray(dst_gl->celldata, nx,
-	    sizeof *dst_gl->celldata);
+	grid_reserve_cells(dst, dst_gl, nx);
 	dst_gl->cellsize = nx;
 
 	/* Append as much as possible. */
-	grid_reflow_copy(dst_gl, ox, src_gl, 0, to_copy);
+	grid_reflow_copy(dst, dst_gl, ox, src_gl, 0, to_copy);
 
 	/* If there is any left in the source, split it. */
 	if (src_gl->cellsize > to_copy) {
@@ -819,13 +2046,12 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 			to_copy = src_gl->cellsize;
 
 		/* Expand destination line. */
-		dst_gl->celldata = xreallocarray(NULL, to_copy,
-		    sizeof *dst_gl->celldata);
+		grid_reserve_cells(dst, dst_gl, to_copy);
 		dst_gl->cellsize = to_copy;
 		dst_gl->flags |= GRID_LINE_WRAPPED;
 
 		/* Copy the data. */
-		grid_reflow_copy(dst_gl, 0, src_gl, offset, to_copy);
+		grid_reflow_copy(dst, dst_gl, 0, src_gl, offset, to_copy);
 
 		/* Move offset and reduce old line size. */
 		offset += to_copy;
@@ -839,9 +2065,11 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 
 /* Move line data. */
 void
-grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
+grid_reflow_move(struct grid *dst, u_int *py, struct grid *src,
+    struct grid_line *src_gl)
 {
 	struct grid_line	*dst_gl;
+	size_t			 size;
 
 	/* Create new line. */
 	if (*py >= dst->hsize + dst->sy)
@@ -852,41 +2080,81 @@ grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
 	/* Copy the old line. */
 	memcpy(dst_gl, src_gl, sizeof *dst_gl);
 	dst_gl->flags &= ~GRID_LINE_WRAPPED;
+	size = grid_line_memory(dst_gl);
+	grid_add_memory(dst, size);
+	grid_sub_memory(src, size);
 
 	/* Clear old line. */
 	src_gl->celldata = NULL;
+	src_gl->cellalloc = 0;
 	src_gl->extddata = NULL;
+	src_gl->zdata = NULL;
+	src_gl->zsize = 0;
 }
 
-/*
- * Reflow lines from src grid into dst grid of width new_x. Returns number of
- * lines fewer in the visible area. The source grid is destroyed.
- */
-u_int
-grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
+/* Reflow lines first to last - 1 from src into dst. */
+void
+grid_reflow_lines(struct grid *dst, u_int *py, struct grid *src, u_int first,
+    u_int last, u_int new_x)
 {
-	u_int			 py, sy, line;
+	u_int			 line;
 	int			 previous_wrapped;
 	struct grid_line	*src_gl;
 
-	py = 0;
-	sy = src->sy;
-
 	previous_wrapped = 0;
-	for (line = 0; line < sy + src->hsize; line++) {
-		src_gl = src->linedata + line;
+	for (line = first; line < last; line++) {
+		src_gl = grid_get_line(src, line);
 		if (!previous_wrapped) {
 			/* Wasn't wrapped. If smaller, move to destination. */
 			if (src_gl->cellsize <= new_x)
-				grid_reflow_move(dst, &py, src_gl);
+				grid_reflow_move(dst, py, src, src_gl);
 			else
-				grid_reflow_split(dst, &py, src_gl, new_x, 0);
+				grid_reflow_split(dst, py, src_gl, new_x, 0);
 		} else {
 			/* Previous was wrapped. Try to join. */
-			grid_reflow_join(dst, &py, src_gl, new_x);
+			grid_reflow_join(dst, py, src_gl, new_x);
 		}
 		previous_wrapped = (src_gl->flags & GRID_LINE_WRAPPED);
 	}
+}
+
+/*
+ * Reflow lines from src grid into dst grid of width new_x. Returns number of
+ * lines fewer in the visible area. The source grid is destroyed.
+ */
+u_int
+grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
+{
+	u_int			 py, sy, line, pending;
+	struct grid_line	*src_gl;
+	int			 flags;
+
+	py = 0;
+	sy = src->sy;
+	dst->hwarm = src->hwarm;
+	grid_spill_share(dst, src);
+	grid_styles_share(dst, src);
+
+	/*
+	 * Leave old history as it is, stopping after a line which is not
+	 * wrapped so the pending lines can be reflowed on their own later.
+	 */
+	pending = 0;
+	if (src->hsize > GRID_REFLOW_LINES) {
+		pending = src->hsize - GRID_REFLOW_LINES;
+		while (pending > 0 &&
+		    src->linedata[pending - 1].flags & GRID_LINE_WRAPPED)
+			pending--;
+	}
+	for (line = 0; line < pending; line++) {
+		src_gl = &src->linedata[line];
+		flags = src_gl->flags;
+		grid_reflow_move(dst, &py, src, src_gl);
+		dst->linedata[py - 1].flags = flags;
+	}
+	dst->hpending = pending;
+
+	grid_reflow_lines(dst, &py, src, pending, sy + src->hsize, new_x);
 
 	grid_destroy(src);
 
@@ -894,3 +2162,95 @@ grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
 		return (0);
 	return (sy - py);
 }
+
+/*
+ * Reflow the pending lines from first, which follows a line that is not
+ * wrapped. The last pending line is not wrapped either, so they can be
+ * reflowed by themselves.
+ */
+void
+grid_reflow_pending(struct grid *gd, u_int first)
+{
+	struct grid		*tmp;
+	struct grid_line	*gl;
+	u_int			 pending, py, n, ny, i;
+	size_t			 size;
+
+	pending = gd->hpending;
+	n = pending - first;
+
+	tmp = grid_create(gd->sx, 1, gd->hlimit);
+	grid_styles_share(tmp, gd);
+	if (gd->hwarm > gd->hsize - pending)
+		tmp->hwarm = gd->hwarm - (gd->hsize - pending);
+	else if (gd->hwarm != 0)
+		tmp->hwarm = 1;
+	grid_spill_share(tmp, gd);
+	py = 0;
+	grid_reflow_lines(tmp, &py, gd, first, pending, gd->sx);
+	grid_clear_lines(gd, first, n);
+
+	/* Make room and move the reflowed lines back in. */
+	ny = gd->hsize + gd->sy - pending;
+	if (py > n)
+		grid_resize_lines(gd, first + py + ny);
+	memmove(&gd->linedata[first + py], &gd->linedata[pending],
+	    ny * sizeof *gd->linedata);
+	if (py < n)
+		grid_resize_lines(gd, first + py + ny);
+	for (i = 0; i < py; i++) {
+		gl = &tmp->linedata[i];
+		memcpy(&gd->linedata[first + i], gl, sizeof *gl);
+		size = grid_line_memory(gl);
+		grid_add_memory(gd, size);
+		grid_sub_memory(tmp, size);
+		memset(gl, 0, sizeof *gl);
+	}
+	grid_cache_drop(gd, first);
+	gd->hsize = gd->hsize - n + py;
+	gd->hpending = first;
+	grid_index_reset(gd, 1);
+
+	/* Do not keep the buffers used to decompress the old lines. */
+	grid_free_spare(gd);
+	grid_destroy(tmp);
+}
+
+/* Reflow the lines left pending at the top of the history by grid_reflow. */
+void
+grid_reflow_history(struct grid *gd)
+{
+	if (gd->hpending != 0)
+		grid_reflow_pending(gd, 0);
+}
+
+/*
+ * Reflow about GRID_REFLOW_LINES of the most recent pending lines, ending
+ * before a line which is not wrapped. Returns how many are left.
+ */
+u_int
+grid_reflow_history_step(struct grid *gd)
+{
+	u_int	first;
+
+	if (gd->hpending == 0)
+		return (0);
+
+	first = 0;
+	if (gd->hpending > GRID_REFLOW_LINES) {
+		first = gd->hpending - GRID_REFLOW_LINES;
+		while (first > 0 &&
+		    gd->linedata[first - 1].flags & GRID_LINE_WRAPPED)
+			first--;
+	}
+	grid_reflow_pending(gd, first);
+	return (gd->hpending);
+}
+
+/* Reflow pending lines until the last n lines of history are reflowed. */
+void
+grid_reflow_history_last(struct grid *gd, u_int n)
+{
+	while (gd->hpending != 0 && gd->hsize < gd->hpending + n)
+		grid_reflow_history_step(gd);
+}
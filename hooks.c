@@ -32,6 +32,12 @@ static int	hooks_cmp(struct hook *, struct hook *);
 RB_PROTOTYPE(hooks_tree, hook, entry, hooks_cmp);
 RB_GENERATE(hooks_tree, hook, entry, hooks_cmp);
 
+/*
+ * Hooks set anywhere. Almost always there are none, and running a hook can
+ * then return without formatting its name or looking for it.
+ */
+static u_int		 hooks_count;
+
 static struct hook	*hooks_find1(struct hooks *, const char *);
 static void		 hooks_free1(struct hooks *, struct hook *);
 static void		 hooks_emptyfn(struct cmd_q *);
@@ -65,6 +71,7 @@ static void
 hooks_free1(struct hooks *hooks, struct hook *hook)
 {
 	RB_REMOVE(hooks_tree, &hooks->tree, hook);
+	hooks_count--;
 	cmd_list_free(hook->cmdlist);
 	free((char *)hook->name);
 	free(hook);
@@ -105,6 +112,7 @@ hooks_add(struct hooks *hooks, const char *name, struct cmd_list *cmdlist)
 	hook->cmdlist = cmdlist;
 	hook->cmdlist->references++;
 	RB_INSERT(hooks_tree, &hooks->tree, hook);
+	hooks_count++;
 }
 
 void
@@ -164,6 +172,9 @@ hooks_run(struct hooks *hooks, struct client *c, struct cmd_find_state *fs,
 	va_list		 ap;
 	char		*name;
 
+	if (hooks_count == 0)
+		return (-1);
+
 	va_start(ap, fmt);
 	xvasprintf(&name, fmt, ap);
 	va_end(ap);
@@ -197,6 +208,9 @@ hooks_wait(struct hooks *hooks, struct cmd_q *cmdq, struct cmd_find_state *fs,
 	va_list		 ap;
 	char		*name;
 
+	if (hooks_count == 0)
+		return (-1);
+
 	va_start(ap, fmt);
 	xvasprintf(&name, fmt, ap);
 	va_end(ap);
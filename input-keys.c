@@ -31,6 +31,7 @@
  */
 
 void	 input_key_mouse(struct window_pane *, struct mouse_event *);
+void	 input_key_build_index(void);
 
 struct input_key_ent {
 	key_code	 key;
@@ -134,6 +135,46 @@ const struct input_key_ent input_keys[] = {
 	{ KEYC_KP_PERIOD,	".",		0 },
 };
 
+/*
+ * The entry used for each special key, by modifiers and by keypad and cursor
+ * mode (the INPUTKEY_* flags), built from input_keys the first time a key is
+ * looked up.
+ */
+const struct input_key_ent *input_key_index[KEYC_BASE_END - KEYC_BASE][8][4];
+int input_key_index_built;
+
+/* Build the index of input_keys. */
+void
+input_key_build_index(void)
+{
+	const struct input_key_ent	*ike;
+	u_int				 i, idx, mode;
+	key_code			 keys[2];
+
+	/* Go backwards, so the first entry which matches wins. */
+	for (i = nitems(input_keys); i > 0; i--) {
+		ike = &input_keys[i - 1];
+
+		idx = (ike->key & KEYC_MASK_KEY) - KEYC_BASE;
+		keys[0] = ike->key;
+		keys[1] = ike->key | KEYC_ESCAPE;
+
+		for (mode = 0; mode < 4; mode++) {
+			if ((ike->flags & INPUTKEY_KEYPAD) &&
+			    !(mode & INPUTKEY_KEYPAD))
+				continue;
+			if ((ike->flags & INPUTKEY_CURSOR) &&
+			    !(mode & INPUTKEY_CURSOR))
+				continue;
+			input_key_index[idx][keys[1] >> KEYC_MOD_SHIFT][mode] =
+			    ike;
+			input_key_index[idx][keys[0] >> KEYC_MOD_SHIFT][mode] =
+			    ike;
+		}
+	}
+	input_key_index_built = 1;
+}
+
 /* Split a character into two UTF-8 bytes. */
 static size_t
 input_split2(u_int c, u_char *dst)
@@ -152,7 +193,7 @@ void
 input_key(struct window_pane *wp, key_code key, struct mouse_event *m)
 {
 	const struct input_key_ent	*ike;
-	u_int				 i;
+	u_int				 mode;
 	size_t				 dlen;
 	char				*out;
 	key_code			 justkey;
@@ -202,22 +243,20 @@ input_key(struct window_pane *wp, key_code key, struct mouse_event *m)
 	}
 
 	/* Otherwise look the key up in the table. */
-	for (i = 0; i < nitems(input_keys); i++) {
-		ike = &input_keys[i];
-
-		if ((ike->flags & INPUTKEY_KEYPAD) &&
-		    !(wp->screen->mode & MODE_KKEYPAD))
-			continue;
-		if ((ike->flags & INPUTKEY_CURSOR) &&
-		    !(wp->screen->mode & MODE_KCURSOR))
-			continue;
-
-		if ((key & KEYC_ESCAPE) && (ike->key | KEYC_ESCAPE) == key)
-			break;
-		if (ike->key == key)
-			break;
-	}
-	if (i == nitems(input_keys)) {
+	if (!input_key_index_built)
+		input_key_build_index();
+	mode = 0;
+	if (wp->screen->mode & MODE_KKEYPAD)
+		mode |= INPUTKEY_KEYPAD;
+	if (wp->screen->mode & MODE_KCURSOR)
+		mode |= INPUTKEY_CURSOR;
+	justkey = key & KEYC_MASK_KEY;
+	if (justkey >= KEYC_BASE && justkey < KEYC_BASE_END) {
+		ike = input_key_index[justkey - KEYC_BASE]
+		    [key >> KEYC_MOD_SHIFT][mode];
+	} else
+		ike = NULL;
+	if (ike == NULL) {
 		log_debug("key 0x%llx missing", key);
 		return;
 	}
@@ -88,12 +88,17 @@ struct input_ctx {
 #define INPUT_DISCARD 0x1
 
 	const struct input_state *state;
+	const struct input_transition **lookup;
 
 	/*
 	 * All input received since we were last in the ground state. Sent to
-	 * control clients on connection.
+	 * control clients on connection. While parsing, it is kept as a span
+	 * of the buffer being parsed and only copied when the read ends.
 	 */
 	struct evbuffer	 	*since_ground;
+	const u_char		*since_buf;
+	size_t			 since_start;
+	size_t			 since_end;
 };
 
 /* Helper functions. */
@@ -102,7 +107,12 @@ int	input_split(struct input_ctx *);
 int	input_get(struct input_ctx *, u_int, int, int);
 void printflike(2, 3) input_reply(struct input_ctx *, const char *, ...);
 void	input_set_state(struct window_pane *, const struct input_transition *);
+void	input_since_ground_flush(struct input_ctx *);
 void	input_reset_cell(struct input_ctx *);
+const struct input_transition **input_get_lookup(const struct input_state *);
+size_t	input_printable_span(const u_char *, size_t);
+void	input_print_run(struct input_ctx *, const u_char *, size_t);
+size_t	input_utf8_run(struct input_ctx *, const u_char *, size_t);
 
 /* Transition entry/exit handlers. */
 void	input_clear(struct input_ctx *);
@@ -729,6 +739,53 @@ const struct input_transition input_state_utf8_one_table[] = {
 	{ -1, -1, NULL, NULL }
 };
 
+/*
+ * Lookup tables, one per state. The transition list of a state is expanded
+ * into a table indexed by character the first time the state is entered, so
+ * that finding a transition is a single lookup.
+ */
+struct input_lookup {
+	const struct input_state	*state;
+	const struct input_transition	*table[256];
+};
+struct input_lookup	input_lookups[32];
+u_int			input_nlookups;
+
+/* Find or build the lookup table for a state. */
+const struct input_transition **
+input_get_lookup(const struct input_state *state)
+{
+	struct input_lookup		*il;
+	const struct input_transition	*itr;
+	u_int				 i;
+	int				 ch;
+
+	for (i = 0; i < input_nlookups; i++) {
+		if (input_lookups[i].state == state)
+			return (input_lookups[i].table);
+	}
+
+	if (input_nlookups == nitems(input_lookups))
+		fatalx("too many input states");
+	il = &input_lookups[input_nlookups++];
+	il->state = state;
+
+	for (ch = 0; ch < (int)nitems(il->table); ch++) {
+		itr = state->transitions;
+		while (itr->first != -1 && itr->last != -1) {
+			if (ch >= itr->first && ch <= itr->last)
+				break;
+			itr++;
+		}
+		if (itr->first == -1 || itr->last == -1)
+			il->table[ch] = NULL;
+		else
+			il->table[ch] = itr;
+	}
+
+	return (il->table);
+}
+
 /* Input table compare. */
 int
 input_table_compare(const void *key, const void *value)
@@ -783,6 +840,16 @@ input_free(struct window_pane *wp)
 	wp->ictx = NULL;
 }
 
+/* Get the memory used by the input parser. */
+size_t
+input_memory(struct window_pane *wp)
+{
+	struct input_ctx	*ictx = wp->ictx;
+
+	return (sizeof *ictx + ictx->input_space +
+	    EVBUFFER_LENGTH(ictx->since_ground));
+}
+
 /* Reset input state and clear screen. */
 void
 input_reset(struct window_pane *wp, int clear)
@@ -810,6 +877,7 @@ input_reset(struct window_pane *wp, int clear)
 	ictx->input_len = 0;
 
 	ictx->state = &input_state_ground;
+	ictx->lookup = input_get_lookup(ictx->state);
 	ictx->flags = 0;
 }
 
@@ -829,10 +897,23 @@ input_set_state(struct window_pane *wp, const struct input_transition *itr)
 	if (ictx->state->exit != NULL)
 		ictx->state->exit(ictx);
 	ictx->state = itr->state;
+	ictx->lookup = input_get_lookup(ictx->state);
 	if (ictx->state->enter != NULL)
 		ictx->state->enter(ictx);
 }
 
+/* Copy the span since ground state into the buffer. */
+void
+input_since_ground_flush(struct input_ctx *ictx)
+{
+	if (ictx->since_end > ictx->since_start) {
+		evbuffer_add(ictx->since_ground,
+		    ictx->since_buf + ictx->since_start,
+		    ictx->since_end - ictx->since_start);
+	}
+	ictx->since_start = ictx->since_end = 0;
+}
+
 /* Parse input. */
 void
 input_parse(struct window_pane *wp)
@@ -841,13 +922,14 @@ input_parse(struct window_pane *wp)
 	const struct input_transition	*itr;
 	struct evbuffer			*evb = wp->event->input;
 	u_char				*buf;
-	size_t				 len, off;
+	size_t				 len, off, n;
 
 	if (EVBUFFER_LENGTH(evb) == 0)
 		return;
 
 	window_update_activity(wp->window);
 	wp->flags |= PANE_CHANGED;
+	window_enqueue(wp->window);
 
 	/*
 	 * Open the screen. Use NULL wp if there is a mode set as don't want to
@@ -863,22 +945,42 @@ input_parse(struct window_pane *wp)
 	len = EVBUFFER_LENGTH(evb);
 	notify_input(wp, evb);
 	off = 0;
+	PROBE2(input_parse_enter, wp->id, len);
+
+	ictx->since_buf = buf;
+	ictx->since_start = ictx->since_end = 0;
 
-	log_debug("%s: %%%u %s, %zu bytes: %.*s", __func__, wp->id,
+	log_debug_input("%s: %%%u %s, %zu bytes: %.*s", __func__, wp->id,
 	    ictx->state->name, len, (int)len, buf);
 
 	/* Parse the input. */
 	while (off < len) {
+		/*
+		 * In the ground state, runs of printable ASCII or of complete
+		 * UTF-8 characters don't change state and are written out
+		 * directly.
+		 */
+		if (ictx->state == &input_state_ground) {
+			n = input_printable_span(buf + off, len - off);
+			if (n != 0) {
+				input_print_run(ictx, buf + off, n);
+				off += n;
+				continue;
+			}
+			if (buf[off] >= 0xc2) {
+				n = input_utf8_run(ictx, buf + off, len - off);
+				if (n != 0) {
+					off += n;
+					continue;
+				}
+			}
+		}
+
 		ictx->ch = buf[off++];
 
 		/* Find the transition. */
-		itr = ictx->state->transitions;
-		while (itr->first != -1 && itr->last != -1) {
-			if (ictx->ch >= itr->first && ictx->ch <= itr->last)
-				break;
-			itr++;
-		}
-		if (itr->first == -1 || itr->last == -1) {
+		itr = ictx->lookup[ictx->ch];
+		if (itr == NULL) {
 			/* No transition? Eh? */
 			fatalx("no transition from state");
 		}
@@ -895,14 +997,24 @@ input_parse(struct window_pane *wp)
 			input_set_state(wp, itr);
 
 		/* If not in ground state, save input. */
-		if (ictx->state != &input_state_ground)
-			evbuffer_add(ictx->since_ground, &ictx->ch, 1);
+		if (ictx->state != &input_state_ground) {
+			if (ictx->since_end != off - 1) {
+				input_since_ground_flush(ictx);
+				ictx->since_start = off - 1;
+			}
+			ictx->since_end = off;
+		}
 	}
 
+	/* Keep what is not yet in ground state for the next read. */
+	input_since_ground_flush(ictx);
+	ictx->since_buf = NULL;
+
 	/* Close the screen. */
 	screen_write_stop(&ictx->ctx);
 
 	evbuffer_drain(evb, len);
+	PROBE2(input_parse_exit, wp->id, len);
 }
 
 /* Split the parameter list (if any). */
@@ -989,6 +1101,7 @@ void
 input_ground(struct input_ctx *ictx)
 {
 	evbuffer_drain(ictx->since_ground, EVBUFFER_LENGTH(ictx->since_ground));
+	ictx->since_start = ictx->since_end = 0;
 
 	if (ictx->input_space > INPUT_BUF_START) {
 		ictx->input_space = INPUT_BUF_START;
@@ -1016,6 +1129,72 @@ input_print(struct input_ctx *ictx)
 	return (0);
 }
 
+/*
+ * Count the printable ASCII characters (0x20 to 0x7e) at the start of the
+ * buffer. Eight bytes are checked at a time while possible: a word is only
+ * accepted if none of its bytes is below 0x20 or above 0x7e.
+ */
+size_t
+input_printable_span(const u_char *buf, size_t len)
+{
+	const uint64_t	ones = 0x0101010101010101ULL;
+	const uint64_t	highs = 0x8080808080808080ULL;
+	uint64_t	w;
+	size_t		n = 0;
+
+	while (len - n >= sizeof w) {
+		memcpy(&w, buf + n, sizeof w);
+		if ((((w - ones * 0x20) & ~w) | ((w + ones) | w)) & highs)
+			break;
+		n += sizeof w;
+	}
+	while (n < len && buf[n] >= 0x20 && buf[n] <= 0x7e)
+		n++;
+	return (n);
+}
+
+/* Output a run of printable ASCII characters to the screen. */
+void
+input_print_run(struct input_ctx *ictx, const u_char *buf, size_t len)
+{
+	struct grid_cell	*gc = &ictx->cell.cell;
+	int			 set;
+
+	set = ictx->cell.set == 0 ? ictx->cell.g0set : ictx->cell.g1set;
+	if (set == 1)
+		gc->attr |= GRID_ATTR_CHARSET;
+	else
+		gc->attr &= ~GRID_ATTR_CHARSET;
+
+	screen_write_cells(&ictx->ctx, gc, buf, len);
+	utf8_set(&gc->data, buf[len - 1]);
+	ictx->ch = buf[len - 1];
+
+	gc->attr &= ~GRID_ATTR_CHARSET;
+}
+
+/*
+ * Output a run of complete UTF-8 characters to the screen, returning the
+ * number of bytes used. Anything else, including a character split between
+ * reads, is left to the state machine.
+ */
+size_t
+input_utf8_run(struct input_ctx *ictx, const u_char *buf, size_t len)
+{
+	struct grid_cell	*gc = &ictx->cell.cell;
+	struct utf8_data	 ud;
+	size_t			 off = 0, n;
+
+	while (off < len && (n = utf8_next(buf + off, len - off, &ud)) != 0) {
+		utf8_copy(&gc->data, &ud);
+		screen_write_cell(&ictx->ctx, gc);
+		off += n;
+	}
+	if (off != 0)
+		ictx->ch = buf[off - 1];
+	return (off);
+}
+
 /* Collect intermediate string. */
 int
 input_intermediate(struct input_ctx *ictx)
@@ -1074,7 +1253,7 @@ input_c0_dispatch(struct input_ctx *ictx)
 	struct window_pane	*wp = ictx->wp;
 	struct screen		*s = sctx->s;
 
-	log_debug("%s: '%c'", __func__, ictx->ch);
+	log_debug_input("%s: '%c'", __func__, ictx->ch);
 
 	switch (ictx->ch) {
 	case '\000':	/* NUL */
@@ -1112,7 +1291,7 @@ input_c0_dispatch(struct input_ctx *ictx)
 		ictx->cell.set = 0;
 		break;
 	default:
-		log_debug("%s: unknown '%c'", __func__, ictx->ch);
+		log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 		break;
 	}
 
@@ -1129,12 +1308,12 @@ input_esc_dispatch(struct input_ctx *ictx)
 
 	if (ictx->flags & INPUT_DISCARD)
 		return (0);
-	log_debug("%s: '%c', %s", __func__, ictx->ch, ictx->interm_buf);
+	log_debug_input("%s: '%c', %s", __func__, ictx->ch, ictx->interm_buf);
 
 	entry = bsearch(ictx, input_esc_table, nitems(input_esc_table),
 	    sizeof input_esc_table[0], input_table_compare);
 	if (entry == NULL) {
-		log_debug("%s: unknown '%c'", __func__, ictx->ch);
+		log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 		return (0);
 	}
 
@@ -1206,13 +1385,13 @@ input_csi_dispatch(struct input_ctx *ictx)
 		return (0);
 	if (input_split(ictx) != 0)
 		return (0);
-	log_debug("%s: '%c' \"%s\" \"%s\"",
+	log_debug_input("%s: '%c' \"%s\" \"%s\"",
 	    __func__, ictx->ch, ictx->interm_buf, ictx->param_buf);
 
 	entry = bsearch(ictx, input_csi_table, nitems(input_csi_table),
 	    sizeof input_csi_table[0], input_table_compare);
 	if (entry == NULL) {
-		log_debug("%s: unknown '%c'", __func__, ictx->ch);
+		log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 		return (0);
 	}
 
@@ -1264,7 +1443,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			input_reply(ictx, "\033[?1;2c");
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1274,7 +1453,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			input_reply(ictx, "\033[>84;0;0c");
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1301,7 +1480,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			input_reply(ictx, "\033[%u;%uR", s->cy + 1, s->cx + 1);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1328,7 +1507,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			}
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1344,7 +1523,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			screen_write_clearline(sctx);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1392,7 +1571,7 @@ input_csi_dispatch(struct input_ctx *ictx)
 			bit_nclear(s->tabs, 0, screen_size_x(s) - 1);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		break;
@@ -1424,7 +1603,7 @@ input_csi_dispatch_rm(struct input_ctx *ictx)
 			screen_write_mode_set(&ictx->ctx, MODE_BLINKING);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 	}
@@ -1479,8 +1658,11 @@ input_csi_dispatch_rm_private(struct input_ctx *ictx)
 		case 2004:
 			screen_write_mode_clear(&ictx->ctx, MODE_BRACKETPASTE);
 			break;
+		case 2026:
+			window_pane_sync_end(wp);
+			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 	}
@@ -1501,7 +1683,7 @@ input_csi_dispatch_sm(struct input_ctx *ictx)
 			screen_write_mode_clear(&ictx->ctx, MODE_BLINKING);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 	}
@@ -1545,6 +1727,7 @@ input_csi_dispatch_sm_private(struct input_ctx *ictx)
 				break;
 			screen_write_mode_set(&ictx->ctx, MODE_FOCUSON);
 			wp->flags |= PANE_FOCUSPUSH; /* force update */
+			window_enqueue(wp->window);
 			break;
 		case 1005:
 			screen_write_mode_set(&ictx->ctx, MODE_MOUSE_UTF8);
@@ -1562,8 +1745,11 @@ input_csi_dispatch_sm_private(struct input_ctx *ictx)
 		case 2004:
 			screen_write_mode_set(&ictx->ctx, MODE_BRACKETPASTE);
 			break;
+		case 2026:
+			window_pane_sync_start(wp);
+			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 	}
@@ -1611,7 +1797,7 @@ input_csi_dispatch_winops(struct input_ctx *ictx)
 			input_reply(ictx, "\033[8;%u;%ut", wp->sy, wp->sx);
 			break;
 		default:
-			log_debug("%s: unknown '%c'", __func__, ictx->ch);
+			log_debug_input("%s: unknown '%c'", __func__, ictx->ch);
 			break;
 		}
 		m++;
@@ -1819,7 +2005,7 @@ input_dcs_dispatch(struct input_ctx *ictx)
 	if (ictx->flags & INPUT_DISCARD)
 		return (0);
 
-	log_debug("%s: \"%s\"", __func__, ictx->input_buf);
+	log_debug_input("%s: \"%s\"", __func__, ictx->input_buf);
 
 	/* Check for tmux prefix. */
 	if (ictx->input_len >= prefix_len &&
@@ -1835,7 +2021,7 @@ input_dcs_dispatch(struct input_ctx *ictx)
 void
 input_enter_osc(struct input_ctx *ictx)
 {
-	log_debug("%s", __func__);
+	log_debug_input("%s", __func__);
 
 	input_clear(ictx);
 }
@@ -1852,7 +2038,7 @@ input_exit_osc(struct input_ctx *ictx)
 	if (ictx->input_len < 1 || *p < '0' || *p > '9')
 		return;
 
-	log_debug("%s: \"%s\"", __func__, p);
+	log_debug_input("%s: \"%s\"", __func__, p);
 
 	option = 0;
 	while (*p >= '0' && *p <= '9')
@@ -1864,7 +2050,8 @@ input_exit_osc(struct input_ctx *ictx)
 	case 0:
 	case 2:
 		screen_set_title(ictx->ctx.s, p);
-		server_status_window(ictx->wp->window);
+		ictx->wp->window->flags |= WINDOW_STATUS;
+		window_enqueue(ictx->wp->window);
 		break;
 	case 12:
 		if (*p != '?') /* ? is colour request */
@@ -1875,7 +2062,7 @@ input_exit_osc(struct input_ctx *ictx)
 			screen_set_cursor_colour(ictx->ctx.s, "");
 		break;
 	default:
-		log_debug("%s: unknown '%u'", __func__, option);
+		log_debug_input("%s: unknown '%u'", __func__, option);
 		break;
 	}
 }
@@ -1884,7 +2071,7 @@ input_exit_osc(struct input_ctx *ictx)
 void
 input_enter_apc(struct input_ctx *ictx)
 {
-	log_debug("%s", __func__);
+	log_debug_input("%s", __func__);
 
 	input_clear(ictx);
 }
@@ -1895,17 +2082,18 @@ input_exit_apc(struct input_ctx *ictx)
 {
 	if (ictx->flags & INPUT_DISCARD)
 		return;
-	log_debug("%s: \"%s\"", __func__, ictx->input_buf);
+	log_debug_input("%s: \"%s\"", __func__, ictx->input_buf);
 
 	screen_set_title(ictx->ctx.s, ictx->input_buf);
-	server_status_window(ictx->wp->window);
+	ictx->wp->window->flags |= WINDOW_STATUS;
+	window_enqueue(ictx->wp->window);
 }
 
 /* Rename string started. */
 void
 input_enter_rename(struct input_ctx *ictx)
 {
-	log_debug("%s", __func__);
+	log_debug_input("%s", __func__);
 
 	input_clear(ictx);
 }
@@ -1918,12 +2106,13 @@ input_exit_rename(struct input_ctx *ictx)
 		return;
 	if (!options_get_number(ictx->wp->window->options, "allow-rename"))
 		return;
-	log_debug("%s: \"%s\"", __func__, ictx->input_buf);
+	log_debug_input("%s: \"%s\"", __func__, ictx->input_buf);
 
 	window_set_name(ictx->wp->window, ictx->input_buf);
 	options_set_number(ictx->wp->window->options, "automatic-rename", 0);
 
-	server_status_window(ictx->wp->window);
+	ictx->wp->window->flags |= WINDOW_STATUS;
+	window_enqueue(ictx->wp->window);
 }
 
 /* Open UTF-8 character. */
@@ -1935,7 +2124,7 @@ input_utf8_open(struct input_ctx *ictx)
 	if (utf8_open(ud, ictx->ch) != UTF8_MORE)
 		fatalx("UTF-8 open invalid %#x", ictx->ch);
 
-	log_debug("%s %hhu", __func__, ud->size);
+	log_debug_input("%s %hhu", __func__, ud->size);
 
 	return (0);
 }
@@ -1949,7 +2138,7 @@ input_utf8_add(struct input_ctx *ictx)
 	if (utf8_append(ud, ictx->ch) != UTF8_MORE)
 		fatalx("UTF-8 add invalid %#x", ictx->ch);
 
-	log_debug("%s", __func__);
+	log_debug_input("%s", __func__);
 
 	return (0);
 }
@@ -1969,7 +2158,7 @@ input_utf8_close(struct input_ctx *ictx)
 		return (0);
 	}
 
-	log_debug("%s %hhu '%*s' (width %hhu)", __func__, ud->size,
+	log_debug_input("%s %hhu '%*s' (width %hhu)", __func__, ud->size,
 	    (int)ud->size, ud->data, ud->width);
 
 	utf8_copy(&ictx->cell.cell.data, ud);
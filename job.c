@@ -19,8 +19,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -34,71 +36,189 @@
 
 void	job_callback(struct bufferevent *, short, void *);
 void	job_write_callback(struct bufferevent *, void *);
+void	job_close_fds(posix_spawn_file_actions_t *);
+char  **job_get_environ(struct session *);
+
+/* Most descriptors to check if they cannot be listed. */
+#define JOB_MAX_FDS 65536
 
 /* All jobs list. */
 struct joblist	all_jobs = LIST_HEAD_INITIALIZER(all_jobs);
 
-/* Start a job running, if it isn't already. */
-struct job *
-job_run(const char *cmd, struct session *s, const char *cwd,
-    void (*callbackfn)(struct job *), void (*freefn)(void *), void *data)
-{
-	struct job	*job;
-	struct environ	*env;
-	pid_t		 pid;
-	int		 nullfd, out[2];
-	const char	*home;
+/*
+ * Jobs are started with posix_spawn rather than fork, so the time taken does
+ * not grow with the size of the server (copying the page tables of a large
+ * history can take longer than the job). What the fork child used to do is
+ * done with spawn attributes and file actions, except changing directory,
+ * which is left to the shell.
+ */
+#define JOB_SCRIPT \
+	"cd -- \"$1\" || cd -- \"$2\" || cd /; " \
+	"exec " _PATH_BSHELL " -c \"$3\""
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, out) != 0)
-		return (NULL);
+/*
+ * The environment jobs are given, for a session or without one. It is built
+ * again only when the global or session environment or default-terminal has
+ * changed since.
+ */
+struct job_environ {
+	char		**envp;
+	u_int		  global_generation;
+	u_int		  session_generation;
+	char		 *term;
+};
+static struct job_environ *job_environ_none;
+
+/* Get the environment for a job, from the cache if still current. */
+char **
+job_get_environ(struct session *s)
+{
+	struct job_environ	**jep, *je;
+	struct environ		 *env;
+	const char		 *term;
+	u_int			  sgen;
+
+	jep = (s != NULL) ? &s->job_environ : &job_environ_none;
+	term = options_get_string(global_options, "default-terminal");
+	sgen = (s != NULL) ? environ_generation(s->environ) : 0;
+
+	je = *jep;
+	if (je != NULL &&
+	    je->global_generation == environ_generation(global_environ) &&
+	    je->session_generation == sgen &&
+	    strcmp(je->term, term) == 0)
+		return (je->envp);
+
+	if (je == NULL)
+		je = *jep = xcalloc(1, sizeof *je);
+	environ_free_envp(je->envp);
+	free(je->term);
 
 	env = environ_create();
 	environ_copy(global_environ, env);
 	if (s != NULL)
 		environ_copy(s->environ, env);
 	server_fill_environ(s, env);
+	je->envp = environ_envp(env);
+	environ_free(env);
 
-	switch (pid = fork()) {
-	case -1:
-		environ_free(env);
-		close(out[0]);
-		close(out[1]);
-		return (NULL);
-	case 0:		/* child */
-		clear_signals(1);
+	je->global_generation = environ_generation(global_environ);
+	je->session_generation = sgen;
+	je->term = xstrdup(term);
+	return (je->envp);
+}
 
-		if (cwd == NULL || chdir(cwd) != 0) {
-			if ((home = find_home()) == NULL || chdir(home) != 0)
-				chdir("/");
-		}
+/* Free a cached job environment. */
+void
+job_free_environ(struct job_environ *je)
+{
+	if (je == NULL)
+		return;
+	environ_free_envp(je->envp);
+	free(je->term);
+	free(je);
+}
 
-		environ_push(env);
-		environ_free(env);
+/* Close every file descriptor above stderr in the child. */
+void
+job_close_fds(posix_spawn_file_actions_t *fa)
+{
+	DIR		*d;
+	struct dirent	*de;
+	int		 fd, *fds = NULL, n = 0, i, max;
+
+	if ((d = opendir("/proc/self/fd")) == NULL)
+		d = opendir("/dev/fd");
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			fd = strtonum(de->d_name, 0, INT_MAX, NULL);
+			if (fd <= STDERR_FILENO || fd == dirfd(d))
+				continue;
+			fds = xreallocarray(fds, n + 1, sizeof *fds);
+			fds[n++] = fd;
+		}
+		closedir(d);
+		for (i = 0; i < n; i++)
+			posix_spawn_file_actions_addclose(fa, fds[i]);
+		free(fds);
+		if (n != 0)
+			return;
+	}
 
-		if (dup2(out[1], STDIN_FILENO) == -1)
-			fatal("dup2 failed");
-		if (dup2(out[1], STDOUT_FILENO) == -1)
-			fatal("dup2 failed");
-		if (out[1] != STDIN_FILENO && out[1] != STDOUT_FILENO)
-			close(out[1]);
-		close(out[0]);
+	/* No list of descriptors (or only 0 to 2 in it), look at them all. */
+	max = getdtablesize();
+	if (max > JOB_MAX_FDS)
+		max = JOB_MAX_FDS;
+	for (fd = STDERR_FILENO + 1; fd < max; fd++) {
+		if (fcntl(fd, F_GETFD) != -1)
+			posix_spawn_file_actions_addclose(fa, fd);
+	}
+}
 
-		nullfd = open(_PATH_DEVNULL, O_RDWR, 0);
-		if (nullfd < 0)
-			fatal("open failed");
-		if (dup2(nullfd, STDERR_FILENO) == -1)
-			fatal("dup2 failed");
-		if (nullfd != STDERR_FILENO)
-			close(nullfd);
+/* Start a job running, if it isn't already. */
+struct job *
+job_run(const char *cmd, struct session *s, const char *cwd,
+    void (*callbackfn)(struct job *), void (*freefn)(void *), void *data)
+{
+	struct job			*job;
+	posix_spawn_file_actions_t	 fa;
+	posix_spawnattr_t		 sa;
+	sigset_t			 set;
+	pid_t				 pid;
+	int				 out[2], error;
+	const char			*home, *argv[8];
 
-		closefrom(STDERR_FILENO + 1);
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, out) != 0)
+		return (NULL);
 
-		execl(_PATH_BSHELL, "sh", "-c", cmd, (char *) NULL);
-		fatal("execl failed");
+	if ((home = find_home()) == NULL)
+		home = "/";
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[2] = JOB_SCRIPT;
+	argv[3] = "sh";
+	argv[4] = cwd == NULL ? home : cwd;
+	argv[5] = home;
+	argv[6] = cmd;
+	argv[7] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, out[1], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, _PATH_DEVNULL,
+	    O_RDWR, 0);
+	job_close_fds(&fa);
+
+	/* What clear_signals would have reset, and nothing blocked. */
+	posix_spawnattr_init(&sa);
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&sa, &set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGPIPE);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGTSTP);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGCONT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGWINCH);
+	posix_spawnattr_setsigdefault(&sa, &set);
+	posix_spawnattr_setflags(&sa, POSIX_SPAWN_SETSIGMASK|
+	    POSIX_SPAWN_SETSIGDEF);
+
+	error = posix_spawn(&pid, _PATH_BSHELL, &fa, &sa, (char **)argv,
+	    job_get_environ(s));
+
+	posix_spawnattr_destroy(&sa);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (error != 0) {
+		log_debug("spawn job failed: %s: %s", cmd, strerror(error));
+		close(out[0]);
+		close(out[1]);
+		return (NULL);
 	}
-
-	/* parent */
-	environ_free(env);
 	close(out[1]);
 
 	job = xmalloc(sizeof *job);
@@ -28,6 +28,19 @@ RB_GENERATE(key_bindings, key_binding, entry, key_bindings_cmp);
 RB_GENERATE(key_tables, key_table, entry, key_table_cmp);
 struct key_tables key_tables = RB_INITIALIZER(&key_tables);
 
+/*
+ * Besides its tree, which keeps them in order for list-keys, each table has
+ * its bindings in an open addressing hash keyed by key code, so that finding
+ * the binding for a key does not depend on how many there are. The hash is
+ * kept at most half full and rebuilt when a binding is removed.
+ */
+#define KEY_BINDINGS_HASH_MIN 16
+
+static struct key_binding	**key_bindings_slot(struct key_table *,
+				      key_code);
+static void			  key_bindings_rehash(struct key_table *,
+				      u_int);
+
 int
 key_table_cmp(struct key_table *e1, struct key_table *e2)
 {
@@ -44,6 +57,36 @@ key_bindings_cmp(struct key_binding *bd1, struct key_binding *bd2)
 	return (0);
 }
 
+static struct key_binding **
+key_bindings_slot(struct key_table *table, key_code key)
+{
+	u_int	mask = table->hashsize - 1, i;
+
+	i = (u_int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+	while (table->hash[i] != NULL && table->hash[i]->key != key)
+		i = (i + 1) & mask;
+	return (&table->hash[i]);
+}
+
+static void
+key_bindings_rehash(struct key_table *table, u_int size)
+{
+	struct key_binding	*bd;
+
+	free(table->hash);
+	table->hash = xcalloc(size, sizeof *table->hash);
+	table->hashsize = size;
+
+	RB_FOREACH(bd, key_bindings, &table->key_bindings)
+		*key_bindings_slot(table, bd->key) = bd;
+}
+
+struct key_binding *
+key_bindings_find(struct key_table *table, key_code key)
+{
+	return (*key_bindings_slot(table, key));
+}
+
 struct key_table *
 key_bindings_get_table(const char *name, int create)
 {
@@ -58,7 +101,12 @@ key_bindings_get_table(const char *name, int create)
 	table->name = xstrdup(name);
 	RB_INIT(&table->key_bindings);
 
+	table->hash = xcalloc(KEY_BINDINGS_HASH_MIN, sizeof *table->hash);
+	table->hashsize = KEY_BINDINGS_HASH_MIN;
+	table->hashused = 0;
+
 	table->references = 1; /* one reference in key_tables */
+	table->removed = 0;
 	RB_INSERT(key_tables, &key_tables, table);
 
 	return (table);
@@ -79,6 +127,7 @@ key_bindings_unref_table(struct key_table *table)
 		free(bd);
 	}
 
+	free(table->hash);
 	free((void *)table->name);
 	free(table);
 }
@@ -88,38 +137,41 @@ key_bindings_add(const char *name, key_code key, int can_repeat,
     struct cmd_list *cmdlist)
 {
 	struct key_table	*table;
-	struct key_binding	 bd_find, *bd;
+	struct key_binding	**slot, *bd;
 
 	table = key_bindings_get_table(name, 1);
 
-	bd_find.key = key;
-	bd = RB_FIND(key_bindings, &table->key_bindings, &bd_find);
-	if (bd != NULL) {
+	slot = key_bindings_slot(table, key);
+	if ((bd = *slot) != NULL) {
 		RB_REMOVE(key_bindings, &table->key_bindings, bd);
 		cmd_list_free(bd->cmdlist);
 		free(bd);
-	}
+	} else
+		table->hashused++;
 
 	bd = xmalloc(sizeof *bd);
 	bd->key = key;
 	RB_INSERT(key_bindings, &table->key_bindings, bd);
+	*slot = bd;
 
 	bd->can_repeat = can_repeat;
 	bd->cmdlist = cmdlist;
+
+	if (table->hashused * 2 > table->hashsize)
+		key_bindings_rehash(table, table->hashsize * 2);
 }
 
 void
 key_bindings_remove(const char *name, key_code key)
 {
 	struct key_table	*table;
-	struct key_binding	 bd_find, *bd;
+	struct key_binding	*bd;
 
 	table = key_bindings_get_table(name, 0);
 	if (table == NULL)
 		return;
 
-	bd_find.key = key;
-	bd = RB_FIND(key_bindings, &table->key_bindings, &bd_find);
+	bd = key_bindings_find(table, key);
 	if (bd == NULL)
 		return;
 
@@ -127,8 +179,12 @@ key_bindings_remove(const char *name, key_code key)
 	cmd_list_free(bd->cmdlist);
 	free(bd);
 
+	table->hashused--;
+	key_bindings_rehash(table, table->hashsize);
+
 	if (RB_EMPTY(&table->key_bindings)) {
 		RB_REMOVE(key_tables, &key_tables, table);
+		table->removed = 1;
 		key_bindings_unref_table(table);
 	}
 }
@@ -141,6 +197,7 @@ key_bindings_remove_table(const char *name)
 	table = key_bindings_get_table(name, 0);
 	if (table != NULL) {
 		RB_REMOVE(key_tables, &key_tables, table);
+		table->removed = 1;
 		key_bindings_unref_table(table);
 	}
 }
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "tmux.h"
@@ -67,6 +68,38 @@ layout_dump(struct layout_cell *root)
 	return (out);
 }
 
+/*
+ * Dump the layout of a window, or its visible layout (the zoomed one when a
+ * pane is zoomed). It is kept until the layout changes, status lines may ask
+ * for it often.
+ */
+char *
+layout_dump_window(struct window *w, int visible)
+{
+	struct layout_cell	*root;
+	u_int			 i;
+
+	if (w->layout_dump_generation != layout_generation) {
+		for (i = 0; i < nitems(w->layout_dump); i++) {
+			free(w->layout_dump[i]);
+			w->layout_dump[i] = NULL;
+		}
+		w->layout_dump_generation = layout_generation;
+	}
+
+	if (!visible && w->saved_layout_root != NULL)
+		root = w->saved_layout_root;
+	else
+		root = w->layout_root;
+	if (root == NULL)
+		return (NULL);
+
+	if (w->layout_dump[visible] == NULL &&
+	    (w->layout_dump[visible] = layout_dump(root)) == NULL)
+		return (NULL);
+	return (xstrdup(w->layout_dump[visible]));
+}
+
 /* Append information for a single cell. */
 int
 layout_append(struct layout_cell *lc, char *buf, size_t len)
@@ -35,11 +35,19 @@
 int	layout_resize_pane_grow(struct layout_cell *, enum layout_type, int);
 int	layout_resize_pane_shrink(struct layout_cell *, enum layout_type, int);
 
+/*
+ * Bumped whenever a cell changes, so that what is worked out from a layout
+ * can be kept until then. It is shared by all windows.
+ */
+u_int	layout_generation = 1;
+
 struct layout_cell *
 layout_create_cell(struct layout_cell *lcparent)
 {
 	struct layout_cell	*lc;
 
+	layout_generation++;
+
 	lc = xmalloc(sizeof *lc);
 	lc->type = LAYOUT_WINDOWPANE;
 	lc->parent = lcparent;
@@ -62,6 +70,8 @@ layout_free_cell(struct layout_cell *lc)
 {
 	struct layout_cell	*lcchild;
 
+	layout_generation++;
+
 	switch (lc->type) {
 	case LAYOUT_LEFTRIGHT:
 	case LAYOUT_TOPBOTTOM:
@@ -103,6 +113,8 @@ void
 layout_set_size(struct layout_cell *lc, u_int sx, u_int sy, u_int xoff,
     u_int yoff)
 {
+	layout_generation++;
+
 	lc->sx = sx;
 	lc->sy = sy;
 
@@ -113,6 +125,8 @@ layout_set_size(struct layout_cell *lc, u_int sx, u_int sy, u_int xoff,
 void
 layout_make_leaf(struct layout_cell *lc, struct window_pane *wp)
 {
+	layout_generation++;
+
 	lc->type = LAYOUT_WINDOWPANE;
 
 	TAILQ_INIT(&lc->cells);
@@ -126,6 +140,7 @@ layout_make_node(struct layout_cell *lc, enum layout_type type)
 {
 	if (type == LAYOUT_WINDOWPANE)
 		fatalx("bad layout type");
+	layout_generation++;
 	lc->type = type;
 
 	TAILQ_INIT(&lc->cells);
@@ -142,6 +157,8 @@ layout_fix_offsets(struct layout_cell *lc)
 	struct layout_cell	*lcchild;
 	u_int			 xoff, yoff;
 
+	layout_generation++;
+
 	if (lc->type == LAYOUT_LEFTRIGHT) {
 		xoff = lc->xoff;
 		TAILQ_FOREACH(lcchild, &lc->cells, entry) {
@@ -163,17 +180,23 @@ layout_fix_offsets(struct layout_cell *lc)
 	}
 }
 
-/* Update pane offsets and sizes based on their cells. */
+/*
+ * Update pane offsets and sizes based on their cells. Panes which did not
+ * move or change size are left alone, and if none did the cell map is kept.
+ */
 void
 layout_fix_panes(struct window *w, u_int wsx, u_int wsy)
 {
 	struct window_pane	*wp;
 	struct layout_cell	*lc;
 	u_int			 sx, sy;
+	int			 changed = 0;
 
 	TAILQ_FOREACH(wp, &w->panes, entry) {
 		if ((lc = wp->layout_cell) == NULL)
 			continue;
+		if (wp->xoff != lc->xoff || wp->yoff != lc->yoff)
+			changed = 1;
 		wp->xoff = lc->xoff;
 		wp->yoff = lc->yoff;
 
@@ -214,7 +237,16 @@ layout_fix_panes(struct window *w, u_int wsx, u_int wsy)
 				sy = lc->sy;
 		}
 
-		window_pane_resize(wp, sx, sy);
+		if (sx != wp->sx || sy != wp->sy) {
+			window_pane_resize(wp, sx, sy);
+			changed = 1;
+		}
+	}
+
+	if (changed) {
+		window_clear_cellmap(w);
+		w->flags |= WINDOW_LAYOUT;
+		window_enqueue(w);
 	}
 }
 
@@ -285,6 +317,8 @@ layout_resize_adjust(struct layout_cell *lc, enum layout_type type, int change)
 {
 	struct layout_cell	*lcchild;
 
+	layout_generation++;
+
 	/* Adjust the cell size. */
 	if (type == LAYOUT_LEFTRIGHT)
 		lc->sx += change;
@@ -329,6 +363,8 @@ layout_destroy_cell(struct layout_cell *lc, struct layout_cell **lcroot)
 {
 	struct layout_cell     *lcother, *lcparent;
 
+	layout_generation++;
+
 	/*
 	 * If no parent, this is the last pane so window close is imminent and
 	 * there is no need to resize anything.
@@ -395,8 +431,19 @@ layout_free(struct window *w)
 void
 layout_resize(struct window *w, u_int sx, u_int sy)
 {
-	struct layout_cell	*lc = w->layout_root;
-	int			 xlimit, ylimit, xchange, ychange;
+	layout_resize_cells(w->layout_root, w->sx, w->sy, sx, sy);
+	layout_fix_panes(w, sx, sy);
+}
+
+/*
+ * Resize a layout from a window size of osx,osy to sx,sy, without resizing the
+ * panes. This is also used for the layout put aside while a window is zoomed.
+ */
+void
+layout_resize_cells(struct layout_cell *lc, u_int osx, u_int osy, u_int sx,
+    u_int sy)
+{
+	int	xlimit, ylimit, xchange, ychange;
 
 	/*
 	 * Adjust horizontally. Do not attempt to reduce the layout lower than
@@ -411,7 +458,7 @@ layout_resize(struct window *w, u_int sx, u_int sy)
 	 * out proportionately - this should leave the layout fitting the new
 	 * window size.
 	 */
-	xchange = sx - w->sx;
+	xchange = sx - osx;
 	xlimit = layout_resize_check(lc, LAYOUT_LEFTRIGHT);
 	if (xchange < 0 && xchange < -xlimit)
 		xchange = -xlimit;
@@ -425,7 +472,7 @@ layout_resize(struct window *w, u_int sx, u_int sy)
 		layout_resize_adjust(lc, LAYOUT_LEFTRIGHT, xchange);
 
 	/* Adjust vertically in a similar fashion. */
-	ychange = sy - w->sy;
+	ychange = sy - osy;
 	ylimit = layout_resize_check(lc, LAYOUT_TOPBOTTOM);
 	if (ychange < 0 && ychange < -ylimit)
 		ychange = -ylimit;
@@ -440,7 +487,6 @@ layout_resize(struct window *w, u_int sx, u_int sy)
 
 	/* Fix cell offsets. */
 	layout_fix_offsets(lc);
-	layout_fix_panes(w, sx, sy);
 }
 
 /* Resize a pane to an absolute size. */
@@ -19,18 +19,51 @@
 #include <sys/types.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tmux.h"
+#include "tmate.h"
+
+/*
+ * Log files are written by a thread of their own: messages are formatted and
+ * escaped into a fixed buffer by the caller and copied into a ring, so
+ * logging costs no allocation and no system call. If the ring is full the
+ * message is dropped and counted. fatal() and fatalx() wait for the ring to
+ * be written out before exiting, as does log_flush(), which also runs at
+ * exit.
+ *
+ * Logging to stdout (in the foreground) stays synchronous, as does logging in
+ * a child after fork(), where the thread does not exist.
+ */
+
+#define LOG_LINE_MAX 4096
+#define LOG_RING_SIZE (1024 * 1024)
 
 static FILE	*log_file;
-static int	 log_level;
+int		 log_level;
+int		 log_categories = LOG_CATEGORIES;
+
+static struct tmate_ring log_ring;
+static pthread_t	 log_thread;
+static pthread_mutex_t	 log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 log_drained = PTHREAD_COND_INITIALIZER;
+static int		 log_async;
+static int		 log_quit;
+static u_int		 log_dropped;
 
 static void	 log_event_cb(int, const char *);
 static void	 log_vwrite(const char *, va_list);
+static void	*log_thread_main(void *);
+static void	 log_atfork_child(void);
+static void	 log_start(void);
+static void	 log_stop(void);
+static void	 log_set_categories(const char *);
 
 static int is_log_stdout(void)
 {
@@ -58,19 +91,156 @@ log_get_level(void)
 	return (log_level);
 }
 
+/* Write out the ring until told to stop. */
+static void *
+log_thread_main(__unused void *arg)
+{
+	char	 msg[64], *buf;
+	size_t	 len;
+	ssize_t	 n;
+	u_int	 dropped;
+	int	 fd = fileno(log_file);
+
+	for (;;) {
+		pthread_mutex_lock(&log_mutex);
+		while (tmate_ring_peek(&log_ring, &buf) == 0 &&
+		    log_dropped == 0) {
+			pthread_cond_broadcast(&log_drained);
+			if (log_quit) {
+				pthread_mutex_unlock(&log_mutex);
+				return (NULL);
+			}
+			pthread_cond_wait(&log_cond, &log_mutex);
+		}
+		dropped = log_dropped;
+		log_dropped = 0;
+		pthread_mutex_unlock(&log_mutex);
+
+		while ((len = tmate_ring_peek(&log_ring, &buf)) != 0) {
+			n = write(fd, buf, len);
+			if (n == -1 && errno == EINTR)
+				continue;
+			tmate_ring_consume(&log_ring, n > 0 ? (size_t)n : len);
+		}
+		if (dropped != 0) {
+			len = snprintf(msg, sizeof msg,
+			    "%u log messages dropped\n", dropped);
+			n = write(fd, msg, len);
+		}
+	}
+}
+
+/* The thread is not in a child, log from there directly. */
+static void
+log_atfork_child(void)
+{
+	log_async = 0;
+	pthread_mutex_init(&log_mutex, NULL);
+	pthread_cond_init(&log_cond, NULL);
+	pthread_cond_init(&log_drained, NULL);
+}
+
+static void
+log_start(void)
+{
+	static int	atfork;
+
+	if (!atfork) {
+		pthread_atfork(NULL, NULL, log_atfork_child);
+		atexit(log_flush);
+		atfork = 1;
+	}
+
+	tmate_ring_free(&log_ring);
+	tmate_ring_init(&log_ring, LOG_RING_SIZE);
+	log_quit = 0;
+	log_dropped = 0;
+	if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+		tmate_ring_free(&log_ring);
+		return;
+	}
+	log_async = 1;
+}
+
+static void
+log_stop(void)
+{
+	if (!log_async)
+		return;
+
+	pthread_mutex_lock(&log_mutex);
+	log_quit = 1;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
+	pthread_join(log_thread, NULL);
+
+	tmate_ring_free(&log_ring);
+	log_async = 0;
+}
+
+/* Wait until everything logged so far is written. */
+void
+log_flush(void)
+{
+	if (!log_async)
+		return;
+
+	pthread_mutex_lock(&log_mutex);
+	pthread_cond_signal(&log_cond);
+	while (log_ring.head != log_ring.tail || log_dropped != 0)
+		pthread_cond_wait(&log_drained, &log_mutex);
+	pthread_mutex_unlock(&log_mutex);
+}
+
 void
 log_open_fp(FILE *f)
 {
 	if (log_file == f)
 		return;
 
+	log_stop();
 	if (log_file != NULL && !is_log_stdout())
 		fclose(log_file);
 
 	log_file = f;
+	log_set_categories(getenv("TMATE_LOG"));
 
 	setvbuf(log_file, NULL, _IOLBF, 0);
 	event_set_log_callback(log_event_cb);
+
+	if (!is_log_stdout())
+		log_start();
+}
+
+/* Enable only the categories named in a comma separated list. */
+static void
+log_set_categories(const char *list)
+{
+	static const struct {
+		const char	*name;
+		int		 category;
+	} table[] = {
+		{ "input", LOG_INPUT },
+		{ "tty", LOG_TTY },
+		{ "proto", LOG_PROTO },
+		{ "ssh", LOG_SSH },
+		{ "startup", LOG_STARTUP },
+	};
+	char	*copy, *next, *s;
+	u_int	 i;
+
+	if (list == NULL)
+		return;
+
+	log_categories = 0;
+	copy = next = xstrdup(list);
+	while ((s = strsep(&next, ",")) != NULL) {
+		for (i = 0; i < nitems(table); i++) {
+			if (strcmp(s, table[i].name) == 0)
+				log_categories |= table[i].category;
+		}
+	}
+	free(copy);
 }
 
 /* Open logging to file. */
@@ -93,6 +263,7 @@ log_open(const char *name)
 void
 log_close(void)
 {
+	log_stop();
 	if (log_file != NULL && !is_log_stdout())
 		fclose(log_file);
 	log_file = NULL;
@@ -105,32 +276,46 @@ __attribute__((__format__(__printf__, 1, 0)))
 static void
 log_vwrite(const char *msg, va_list ap)
 {
-	char		*fmt, *out;
+	char		 fmt[LOG_LINE_MAX], out[LOG_LINE_MAX + 32];
 	struct timeval	 tv;
+	size_t		 len, used;
+	int		 n;
 
 	if (log_file == NULL)
 		return;
 
-	if (vasprintf(&fmt, msg, ap) == -1)
-		exit(1);
-	if (stravis(&out, fmt, VIS_OCTAL|VIS_CSTYLE|VIS_TAB|VIS_NL) == -1)
+	/* Long messages are cut, they are mostly pane data. */
+	if (vsnprintf(fmt, sizeof fmt, msg, ap) < 0)
 		exit(1);
 
-	gettimeofday(&tv, NULL);
+	if (is_log_stdout())
+		len = 0;
+	else {
+		gettimeofday(&tv, NULL);
+		n = snprintf(out, sizeof out, "%lld.%06d ",
+		    (long long)tv.tv_sec, (int)tv.tv_usec);
+		len = n > 0 ? n : 0;
+	}
+	strnvis(out + len, fmt, sizeof out - len - 1,
+	    VIS_OCTAL|VIS_CSTYLE|VIS_TAB|VIS_NL);
+	len += strlen(out + len);
+	out[len++] = '\n';
 
-	if (is_log_stdout()) {
-		if (fprintf(log_file, "%s\n", out) == -1)
-			exit(1);
-	} else {
-		if (fprintf(log_file, "%lld.%06d %s\n", (long long)tv.tv_sec,
-			    (int)tv.tv_usec, out) == -1)
+	if (!log_async) {
+		if (fwrite(out, 1, len, log_file) != len)
 			exit(1);
+		fflush(log_file);
+		return;
 	}
 
-	fflush(log_file);
-
-	free(out);
-	free(fmt);
+	pthread_mutex_lock(&log_mutex);
+	used = log_ring.head - __atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE);
+	if (log_ring.size - used < len)
+		log_dropped++;
+	else
+		tmate_ring_write(&log_ring, out, len);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
 }
 
 /* Log a debug message. */
@@ -147,6 +332,30 @@ log_emit(int level, const char *msg, ...)
 	va_end(ap);
 }
 
+/*
+ * Log how long after the process started a step of startup was reached, and
+ * how long since the previous one. The first call marks the start and is
+ * made before the log is open.
+ */
+void
+log_startup(const char *step)
+{
+	static struct timespec	 first, last;
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (first.tv_sec == 0 && first.tv_nsec == 0)
+		first = last = now;
+
+	log_emit_category(LOG_STARTUP, LOG_DEBUG, "startup: %s at %.3f ms "
+	    "(+%.3f ms)", step,
+	    (now.tv_sec - first.tv_sec) * 1e3 +
+	    (now.tv_nsec - first.tv_nsec) / 1e6,
+	    (now.tv_sec - last.tv_sec) * 1e3 +
+	    (now.tv_nsec - last.tv_nsec) / 1e6);
+	last = now;
+}
+
 /* Log a critical error with error string and die. */
 __attribute__((__format__(__printf__, 1, 0)))
 __dead void
@@ -160,6 +369,7 @@ fatal(const char *msg, ...)
 		exit(1);
 	msg = fmt;
 	log_vwrite(msg, ap);
+	log_flush();
 	exit(1);
 }
 
@@ -176,5 +386,6 @@ fatalx(const char *msg, ...)
 		exit(1);
 	msg = fmt;
 	log_vwrite(msg, ap);
+	log_flush();
 	exit(1);
 }
@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "tmux.h"
@@ -31,7 +32,11 @@
  *
  * The fixed tables of struct mode_key_entry below are the defaults: they are
  * built into a tree of struct mode_key_binding by mode_key_init_trees, which
- * can then be modified.
+ * can then be modified. The defaults of each table are allocated in one
+ * block, so their bindings are not freed individually.
+ *
+ * Lookups go through a small direct-mapped cache in front of the trees, which
+ * is emptied by mode_key_changed whenever a binding is added or removed.
  *
  * vi command mode is handled by having a mode flag in the struct which allows
  * two sets of bindings to be swapped between. A couple of editing commands
@@ -52,6 +57,16 @@ struct mode_key_entry {
 	enum mode_key_cmd	cmd;
 };
 
+/* Entry in the lookup cache, mbind is NULL for a key which is not bound. */
+struct mode_key_cache_entry {
+	struct mode_key_tree	*tree;
+	key_code		 key;
+	int			 mode;
+	struct mode_key_binding	*mbind;
+};
+#define MODE_KEY_CACHE_BITS 8
+static struct mode_key_cache_entry mode_key_cache[1 << MODE_KEY_CACHE_BITS];
+
 /* Edit keys command strings. */
 const struct mode_key_cmdstr mode_key_cmdstr_edit[] = {
 	{ MODEKEYEDIT_BACKSPACE, "backspace" },
@@ -574,18 +589,41 @@ mode_key_init_trees(void)
 	const struct mode_key_table	*mtab;
 	const struct mode_key_entry	*ment;
 	struct mode_key_binding		*mbind;
+	u_int				 n;
 
 	for (mtab = mode_key_tables; mtab->name != NULL; mtab++) {
 		RB_INIT(mtab->tree);
-		for (ment = mtab->table; ment->mode != -1; ment++) {
-			mbind = xmalloc(sizeof *mbind);
+
+		n = 0;
+		for (ment = mtab->table; ment->mode != -1; ment++)
+			n++;
+		mbind = xcalloc(n, sizeof *mbind);
+
+		for (ment = mtab->table; ment->mode != -1; ment++, mbind++) {
 			mbind->key = ment->key;
 			mbind->mode = ment->mode;
 			mbind->cmd = ment->cmd;
 			mbind->arg = NULL;
+			mbind->fixed = 1;
 			RB_INSERT(mode_key_tree, mtab->tree, mbind);
 		}
 	}
+	mode_key_changed();
+}
+
+/* Free a binding removed from its tree. */
+void
+mode_key_free(struct mode_key_binding *mbind)
+{
+	if (!mbind->fixed)
+		free(mbind);
+}
+
+/* Empty the lookup cache, after a binding is added or removed. */
+void
+mode_key_changed(void)
+{
+	memset(mode_key_cache, 0, sizeof mode_key_cache);
 }
 
 void
@@ -598,11 +636,29 @@ mode_key_init(struct mode_key_data *mdata, struct mode_key_tree *mtree)
 enum mode_key_cmd
 mode_key_lookup(struct mode_key_data *mdata, key_code key, const char **arg)
 {
-	struct mode_key_binding	*mbind, mtmp;
-
-	mtmp.key = key;
-	mtmp.mode = mdata->mode;
-	if ((mbind = RB_FIND(mode_key_tree, mdata->tree, &mtmp)) == NULL) {
+	struct mode_key_cache_entry	*mce;
+	struct mode_key_binding		*mbind, mtmp;
+	u_int				 hash;
+
+	hash = (u_int)key ^ ((u_int)mdata->mode << 31) ^
+	    (u_int)((uintptr_t)mdata->tree >> 4);
+	hash = (hash * 2654435761U) >> (32 - MODE_KEY_CACHE_BITS);
+	mce = &mode_key_cache[hash];
+
+	if (mce->tree == mdata->tree && mce->key == key &&
+	    mce->mode == mdata->mode)
+		mbind = mce->mbind;
+	else {
+		mtmp.key = key;
+		mtmp.mode = mdata->mode;
+		mbind = RB_FIND(mode_key_tree, mdata->tree, &mtmp);
+
+		mce->tree = mdata->tree;
+		mce->key = key;
+		mce->mode = mdata->mode;
+		mce->mbind = mbind;
+	}
+	if (mbind == NULL) {
 		if (mdata->mode != 0)
 			return (MODEKEY_NONE);
 		return (MODEKEY_OTHER);
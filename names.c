@@ -22,11 +22,14 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "tmux.h"
 
 void	name_time_callback(int, short, void *);
 int	name_time_expired(struct window *, struct timeval *);
+int	name_format_simple(const char *);
+int	name_unchanged(struct window *, const char *);
 
 void
 name_time_callback(__unused int fd, __unused short events, void *arg)
@@ -35,6 +38,7 @@ name_time_callback(__unused int fd, __unused short events, void *arg)
 
 	/* The event loop will call check_window_name for us on the way out. */
 	log_debug("@%u name timer expired", w->id);
+	window_enqueue(w);
 }
 
 int
@@ -48,6 +52,73 @@ name_time_expired(struct window *w, struct timeval *tv)
 	return (NAME_INTERVAL - offset.tv_usec);
 }
 
+/*
+ * Check if a rename format depends only on the foreground process, mode and
+ * state of the active pane, like the default one.
+ */
+int
+name_format_simple(const char *fmt)
+{
+	static const char	*simple[] = {
+		"pane_current_command", "pane_dead", "pane_in_mode"
+	};
+	const char		*cp, *end;
+	size_t			 len;
+	u_int			 i;
+
+	for (cp = fmt; (cp = strchr(cp, '#')) != NULL; cp = end) {
+		cp++;
+		if (*cp == '#' || *cp == ',' || *cp == '}') {
+			end = cp + 1;
+			continue;
+		}
+		if (*cp++ != '{')
+			return (0);
+		if (*cp == '?')
+			cp++;
+		for (end = cp; islower((u_char)*end) || *end == '_'; end++)
+			/* nothing */;
+		if (*end != ',' && *end != '}')
+			return (0);
+		len = end - cp;
+		for (i = 0; i < nitems(simple); i++) {
+			if (strlen(simple[i]) == len &&
+			    strncmp(cp, simple[i], len) == 0)
+				break;
+		}
+		if (i == nitems(simple))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Check if the name would come out the same as last time, saving the inputs
+ * for next time if not.
+ */
+int
+name_unchanged(struct window *w, const char *fmt)
+{
+	struct window_pane	*wp = w->active;
+	pid_t			 pgrp;
+	int			 state;
+
+	pgrp = wp->fd == -1 ? -1 : tcgetpgrp(wp->fd);
+	state = (wp->mode != NULL) | (wp->fd == -1) << 1;
+
+	if (w->name_format != NULL && strcmp(w->name_format, fmt) == 0 &&
+	    w->name_pane == wp->id && w->name_pgrp == pgrp &&
+	    w->name_state == state && pgrp != -1 && name_format_simple(fmt))
+		return (1);
+
+	free(w->name_format);
+	w->name_format = xstrdup(fmt);
+	w->name_pane = wp->id;
+	w->name_pgrp = pgrp;
+	w->name_state = state;
+	return (0);
+}
+
 void
 check_window_name(struct window *w)
 {
@@ -70,8 +141,10 @@ check_window_name(struct window *w)
 	gettimeofday(&tv, NULL);
 	left = name_time_expired(w, &tv);
 	if (left != 0) {
-		if (!event_initialized(&w->name_event))
+		if (!event_initialized(&w->name_event)) {
 			evtimer_set(&w->name_event, name_time_callback, w);
+			event_priority_set(&w->name_event, EVENT_PRI_BACKGROUND);
+		}
 		if (!evtimer_pending(&w->name_event, NULL)) {
 			log_debug("@%u name timer queued (%d left)", w->id, left);
 			timerclear(&next);
@@ -87,6 +160,12 @@ check_window_name(struct window *w)
 
 	w->active->flags &= ~PANE_CHANGED;
 
+	if (name_unchanged(w,
+	    options_get_string(w->options, "automatic-rename-format"))) {
+		log_debug("@%u name inputs not changed", w->id);
+		return;
+	}
+
 	name = format_window_name(w);
 	if (strcmp(name, w->name) != 0) {
 		log_debug("@%u new name %s (was %s)", w->id, name, w->name);
@@ -92,6 +92,8 @@ notify_drain(void)
 		return;
 
 	TAILQ_FOREACH_SAFE(ne, &notify_queue, entry, ne1) {
+		window_choose_invalidate();
+
 		switch (ne->type) {
 		case NOTIFY_WINDOW_LAYOUT_CHANGED:
 			control_notify_window_layout_changed(ne->window);
@@ -134,8 +136,6 @@ notify_drain(void)
 void
 notify_input(struct window_pane *wp, struct evbuffer *input)
 {
-	struct client	*c;
-
 	/*
 	 * notify_input() is not queued and only does anything when
 	 * notifications are enabled.
@@ -143,10 +143,7 @@ notify_input(struct window_pane *wp, struct evbuffer *input)
 	if (!notify_enabled)
 		return;
 
-	TAILQ_FOREACH(c, &clients, entry) {
-		if (c->flags & CLIENT_CONTROL)
-			control_notify_input(c, wp, input);
-	}
+	control_notify_input(wp, input);
 }
 
 void
@@ -27,18 +27,37 @@
 /*
  * Option handling; each option has a name, type and value and is stored in
  * a red-black tree.
+ *
+ * Lookups through the parents are remembered in a small cache per options,
+ * indexed by the address of the name: callers nearly always pass the same
+ * string constant. Which entry a name resolves to only changes when an entry
+ * is added or removed somewhere, so that bumps a generation number which
+ * empties every cache at once.
  */
 
+#define OPTIONS_CACHE_SIZE 64
+
+struct options_cache {
+	const char		*name;
+	struct options_entry	*o;
+	u_int			 generation;
+};
+
 struct options {
 	RB_HEAD(options_tree, options_entry) tree;
 	struct options	*parent;
+
+	struct options_cache cache[OPTIONS_CACHE_SIZE];
 };
 
+static u_int	options_generation = 1;
+
 static int	options_cmp(struct options_entry *, struct options_entry *);
 RB_PROTOTYPE(options_tree, options_entry, entry, options_cmp);
 RB_GENERATE(options_tree, options_entry, entry, options_cmp);
 
 static void	options_free1(struct options *, struct options_entry *);
+static void	options_insert(struct options *, struct options_entry *);
 
 static int
 options_cmp(struct options_entry *o1, struct options_entry *o2)
@@ -57,10 +76,18 @@ options_create(struct options *parent)
 	return (oo);
 }
 
+static void
+options_insert(struct options *oo, struct options_entry *o)
+{
+	RB_INSERT(options_tree, &oo->tree, o);
+	options_generation++;
+}
+
 static void
 options_free1(struct options *oo, struct options_entry *o)
 {
 	RB_REMOVE(options_tree, &oo->tree, o);
+	options_generation++;
 	free((char *)o->name);
 	if (o->type == OPTIONS_STRING)
 		free(o->str);
@@ -102,6 +129,12 @@ struct options_entry *
 options_find(struct options *oo, const char *name)
 {
 	struct options_entry	*o, p;
+	struct options_cache	*oc;
+
+	oc = &oo->cache[((uintptr_t)name >> 3) % OPTIONS_CACHE_SIZE];
+	if (oc->generation == options_generation && oc->name == name &&
+	    strcmp(oc->o->name, name) == 0)
+		return (oc->o);
 
 	p.name = (char *)name;
 	o = RB_FIND(options_tree, &oo->tree, &p);
@@ -111,6 +144,12 @@ options_find(struct options *oo, const char *name)
 			break;
 		o = RB_FIND(options_tree, &oo->tree, &p);
 	}
+
+	if (o != NULL) {
+		oc->name = name;
+		oc->o = o;
+		oc->generation = options_generation;
+	}
 	return (o);
 }
 
@@ -132,7 +171,7 @@ options_set_string(struct options *oo, const char *name, const char *fmt, ...)
 	if ((o = options_find1(oo, name)) == NULL) {
 		o = xmalloc(sizeof *o);
 		o->name = xstrdup(name);
-		RB_INSERT(options_tree, &oo->tree, o);
+		options_insert(oo, o);
 		memcpy(&o->style, &grid_default_cell, sizeof o->style);
 	} else if (o->type == OPTIONS_STRING)
 		free(o->str);
@@ -164,7 +203,7 @@ options_set_number(struct options *oo, const char *name, long long value)
 	if ((o = options_find1(oo, name)) == NULL) {
 		o = xmalloc(sizeof *o);
 		o->name = xstrdup(name);
-		RB_INSERT(options_tree, &oo->tree, o);
+		options_insert(oo, o);
 		memcpy(&o->style, &grid_default_cell, sizeof o->style);
 	} else if (o->type == OPTIONS_STRING)
 		free(o->str);
@@ -205,7 +244,7 @@ options_set_style(struct options *oo, const char *name, const char *value,
 	if (o == NULL) {
 		o = xmalloc(sizeof *o);
 		o->name = xstrdup(name);
-		RB_INSERT(options_tree, &oo->tree, o);
+		options_insert(oo, o);
 	} else if (o->type == OPTIONS_STRING)
 		free(o->str);
 
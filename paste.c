@@ -18,20 +18,46 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "tmux.h"
 
+/* Pieces smaller than this are copied into evbuffers, not referenced. */
+#define PASTE_COPY_SIZE 4096
+
+/* Pieces given to each writev. */
+#define PASTE_WRITE_PIECES 64
+
 /*
  * Set of paste buffers. Note that paste buffer data is not necessarily a C
  * string!
+ *
+ * The data is a list of pieces of reference counted chunks, so appending
+ * does not copy what is already there and the data can be handed to an
+ * evbuffer without copying. It is only made contiguous when asked for by
+ * paste_buffer_data.
  */
 
-struct paste_buffer {
+struct paste_chunk {
 	char		*data;
 	size_t		 size;
+	u_int		 references;
+};
+
+struct paste_piece {
+	struct paste_chunk *chunk;
+	size_t		 off;
+	size_t		 size;
+};
+
+struct paste_buffer {
+	struct paste_piece *pieces;
+	u_int		 npieces;
+	size_t		 size;
 
 	char		*name;
 	int		 automatic;
@@ -39,14 +65,20 @@ struct paste_buffer {
 
 	RB_ENTRY(paste_buffer) name_entry;
 	RB_ENTRY(paste_buffer) time_entry;
+	TAILQ_ENTRY(paste_buffer) automatic_entry;
 };
 
 u_int	paste_next_index;
 u_int	paste_next_order;
 u_int	paste_num_automatic;
+size_t	paste_total_size;
 RB_HEAD(paste_name_tree, paste_buffer) paste_by_name;
 RB_HEAD(paste_time_tree, paste_buffer) paste_by_time;
 
+/* Automatic buffers, oldest first, for freeing them at buffer-limit. */
+TAILQ_HEAD(, paste_buffer) paste_automatic =
+    TAILQ_HEAD_INITIALIZER(paste_automatic);
+
 int paste_cmp_names(const struct paste_buffer *, const struct paste_buffer *);
 RB_PROTOTYPE(paste_name_tree, paste_buffer, name_entry, paste_cmp_names);
 RB_GENERATE(paste_name_tree, paste_buffer, name_entry, paste_cmp_names);
@@ -55,6 +87,13 @@ int paste_cmp_times(const struct paste_buffer *, const struct paste_buffer *);
 RB_PROTOTYPE(paste_time_tree, paste_buffer, time_entry, paste_cmp_times);
 RB_GENERATE(paste_time_tree, paste_buffer, time_entry, paste_cmp_times);
 
+struct paste_chunk *paste_chunk_create(char *, size_t);
+void	paste_chunk_unref(const void *, size_t, void *);
+void	paste_add_piece(struct paste_buffer *, struct paste_chunk *, size_t,
+	    size_t);
+void	paste_free_pieces(struct paste_buffer *);
+void	paste_insert(struct paste_buffer *, const char *);
+
 int
 paste_cmp_names(const struct paste_buffer *a, const struct paste_buffer *b)
 {
@@ -78,13 +117,164 @@ paste_buffer_name(struct paste_buffer *pb)
 	return (pb->name);
 }
 
-/* Get paste buffer data. */
+/* Create a chunk owning data. */
+struct paste_chunk *
+paste_chunk_create(char *data, size_t size)
+{
+	struct paste_chunk	*chunk;
+
+	chunk = xmalloc(sizeof *chunk);
+	chunk->data = data;
+	chunk->size = size;
+	chunk->references = 1;
+	return (chunk);
+}
+
+/* Drop a chunk reference, also used as an evbuffer cleanup callback. */
+void
+paste_chunk_unref(__unused const void *data, __unused size_t size, void *arg)
+{
+	struct paste_chunk	*chunk = arg;
+
+	if (--chunk->references != 0)
+		return;
+	free(chunk->data);
+	free(chunk);
+}
+
+/* Add a piece of a chunk to the end of the buffer, taking a reference. */
+void
+paste_add_piece(struct paste_buffer *pb, struct paste_chunk *chunk,
+    size_t off, size_t size)
+{
+	struct paste_piece	*pp;
+
+	pb->pieces = xreallocarray(pb->pieces, pb->npieces + 1,
+	    sizeof *pb->pieces);
+	pp = &pb->pieces[pb->npieces++];
+	pp->chunk = chunk;
+	pp->off = off;
+	pp->size = size;
+	chunk->references++;
+
+	pb->size += size;
+}
+
+void
+paste_free_pieces(struct paste_buffer *pb)
+{
+	u_int	i;
+
+	for (i = 0; i < pb->npieces; i++)
+		paste_chunk_unref(NULL, 0, pb->pieces[i].chunk);
+	free(pb->pieces);
+	pb->pieces = NULL;
+	pb->npieces = 0;
+	pb->size = 0;
+}
+
+/* Get paste buffer size. */
+size_t
+paste_buffer_size(struct paste_buffer *pb)
+{
+	return (pb->size);
+}
+
+/* Get paste buffer data, joining the pieces if needed. */
 const char *
 paste_buffer_data(struct paste_buffer *pb, size_t *size)
 {
+	struct paste_chunk	*chunk;
+	char			*data;
+	size_t			 off = 0;
+	u_int			 i;
+
 	if (size != NULL)
 		*size = pb->size;
-	return (pb->data);
+
+	if (pb->npieces > 1) {
+		data = xmalloc(pb->size);
+		for (i = 0; i < pb->npieces; i++) {
+			memcpy(data + off, pb->pieces[i].chunk->data +
+			    pb->pieces[i].off, pb->pieces[i].size);
+			off += pb->pieces[i].size;
+		}
+		paste_free_pieces(pb);
+
+		chunk = paste_chunk_create(data, off);
+		paste_add_piece(pb, chunk, 0, off);
+		paste_chunk_unref(NULL, 0, chunk);
+	}
+	return (pb->pieces[0].chunk->data + pb->pieces[0].off);
+}
+
+/* Get a piece of paste buffer data, to walk it without joining. */
+const char *
+paste_buffer_piece(struct paste_buffer *pb, u_int n, size_t *size)
+{
+	if (n >= pb->npieces)
+		return (NULL);
+	*size = pb->pieces[n].size;
+	return (pb->pieces[n].chunk->data + pb->pieces[n].off);
+}
+
+/* Write paste buffer data to a file descriptor, straight from the pieces. */
+int
+paste_buffer_write(struct paste_buffer *pb, int fd)
+{
+	struct iovec		 iov[PASTE_WRITE_PIECES];
+	struct paste_piece	*pp;
+	size_t			 off = 0, left;
+	ssize_t			 written;
+	u_int			 i = 0, n;
+
+	while (i < pb->npieces) {
+		for (n = 0; n < PASTE_WRITE_PIECES && i + n < pb->npieces; n++) {
+			pp = &pb->pieces[i + n];
+			iov[n].iov_base = pp->chunk->data + pp->off;
+			iov[n].iov_len = pp->size;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + off;
+		iov[0].iov_len -= off;
+
+		if ((written = writev(fd, iov, n)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (-1);
+		}
+		while (written > 0) {
+			left = pb->pieces[i].size - off;
+			if ((size_t)written < left) {
+				off += written;
+				break;
+			}
+			written -= left;
+			off = 0;
+			i++;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Add data from a piece to an evbuffer. Unless it is small enough to be
+ * worth copying, the evbuffer holds a reference to the chunk rather than a
+ * copy, so the buffer may be freed meanwhile.
+ */
+void
+paste_buffer_add(struct paste_buffer *pb, u_int n, const char *data,
+    size_t size, struct evbuffer *evb)
+{
+	struct paste_chunk	*chunk = pb->pieces[n].chunk;
+
+	if (size < PASTE_COPY_SIZE) {
+		evbuffer_add(evb, data, size);
+		return;
+	}
+	chunk->references++;
+	if (evbuffer_add_reference(evb, data, size, paste_chunk_unref,
+	    chunk) != 0)
+		fatalx("out of memory");
 }
 
 /* Walk paste buffers by name. */
@@ -123,20 +313,75 @@ paste_get_name(const char *name)
 	return (RB_FIND(paste_name_tree, &paste_by_name, &pbfind));
 }
 
+/* Get the memory used by all paste buffers. */
+size_t
+paste_memory(void)
+{
+	return (paste_total_size);
+}
+
 /* Free a paste buffer. */
 void
 paste_free(struct paste_buffer *pb)
 {
 	RB_REMOVE(paste_name_tree, &paste_by_name, pb);
 	RB_REMOVE(paste_time_tree, &paste_by_time, pb);
-	if (pb->automatic)
+	if (pb->automatic) {
+		TAILQ_REMOVE(&paste_automatic, pb, automatic_entry);
 		paste_num_automatic--;
+	}
+	paste_total_size -= sizeof *pb + pb->size;
+
+	paste_free_pieces(pb);
+	free(pb->name);
+	free(pb);
+}
+
+/*
+ * Take a copy of a buffer sharing its data, which is not in the list and so
+ * outlives the buffer being deleted or changed. Freed by paste_release.
+ */
+struct paste_buffer *
+paste_hold(struct paste_buffer *pb)
+{
+	struct paste_buffer	*copy;
+	u_int			 i;
+
+	copy = xcalloc(1, sizeof *copy);
+	for (i = 0; i < pb->npieces; i++) {
+		paste_add_piece(copy, pb->pieces[i].chunk, pb->pieces[i].off,
+		    pb->pieces[i].size);
+	}
+	copy->name = xstrdup(pb->name);
+	return (copy);
+}
 
-	free(pb->data);
+void
+paste_release(struct paste_buffer *pb)
+{
+	paste_free_pieces(pb);
 	free(pb->name);
 	free(pb);
 }
 
+/* Put a new buffer at the top, replacing any buffer with the name. */
+void
+paste_insert(struct paste_buffer *pb, const char *name)
+{
+	struct paste_buffer	*old;
+
+	pb->name = xstrdup(name);
+	pb->automatic = 0;
+	pb->order = paste_next_order++;
+	paste_total_size += sizeof *pb + pb->size;
+
+	if ((old = paste_get_name(name)) != NULL)
+		paste_free(old);
+
+	RB_INSERT(paste_name_tree, &paste_by_name, pb);
+	RB_INSERT(paste_time_tree, &paste_by_time, pb);
+}
+
 /*
  * Add an automatic buffer, freeing the oldest automatic item if at limit. Note
  * that the caller is responsible for allocating data.
@@ -144,22 +389,21 @@ paste_free(struct paste_buffer *pb)
 void
 paste_add(char *data, size_t size)
 {
-	struct paste_buffer	*pb, *pb1;
+	struct paste_buffer	*pb;
+	struct paste_chunk	*chunk;
 	u_int			 limit;
 
 	if (size == 0)
 		return;
 
 	limit = options_get_number(global_options, "buffer-limit");
-	RB_FOREACH_REVERSE_SAFE(pb, paste_time_tree, &paste_by_time, pb1) {
-		if (paste_num_automatic < limit)
-			break;
-		if (pb->automatic)
-			paste_free(pb);
-	}
+	while (paste_num_automatic >= limit &&
+	    (pb = TAILQ_FIRST(&paste_automatic)) != NULL)
+		paste_free(pb);
 
-	pb = xmalloc(sizeof *pb);
+	pb = xcalloc(1, sizeof *pb);
 
+	/* Only a buffer named by hand can already have the next name. */
 	pb->name = NULL;
 	do {
 		free(pb->name);
@@ -167,10 +411,13 @@ paste_add(char *data, size_t size)
 		paste_next_index++;
 	} while (paste_get_name(pb->name) != NULL);
 
-	pb->data = data;
-	pb->size = size;
+	chunk = paste_chunk_create(data, size);
+	paste_add_piece(pb, chunk, 0, size);
+	paste_chunk_unref(NULL, 0, chunk);
+	paste_total_size += sizeof *pb + size;
 
 	pb->automatic = 1;
+	TAILQ_INSERT_TAIL(&paste_automatic, pb, automatic_entry);
 	paste_num_automatic++;
 
 	pb->order = paste_next_order++;
@@ -217,8 +464,10 @@ paste_rename(const char *oldname, const char *newname, char **cause)
 	free(pb->name);
 	pb->name = xstrdup(newname);
 
-	if (pb->automatic)
+	if (pb->automatic) {
+		TAILQ_REMOVE(&paste_automatic, pb, automatic_entry);
 		paste_num_automatic--;
+	}
 	pb->automatic = 0;
 
 	RB_INSERT(paste_name_tree, &paste_by_name, pb);
@@ -233,7 +482,8 @@ paste_rename(const char *oldname, const char *newname, char **cause)
 int
 paste_set(char *data, size_t size, const char *name, char **cause)
 {
-	struct paste_buffer	*pb, *old;
+	struct paste_buffer	*pb;
+	struct paste_chunk	*chunk;
 
 	if (cause != NULL)
 		*cause = NULL;
@@ -253,22 +503,52 @@ paste_set(char *data, size_t size, const char *name, char **cause)
 		return (-1);
 	}
 
-	pb = xmalloc(sizeof *pb);
+	pb = xcalloc(1, sizeof *pb);
 
-	pb->name = xstrdup(name);
+	chunk = paste_chunk_create(data, size);
+	paste_add_piece(pb, chunk, 0, size);
+	paste_chunk_unref(NULL, 0, chunk);
 
-	pb->data = data;
-	pb->size = size;
+	paste_insert(pb, name);
+	return (0);
+}
 
-	pb->automatic = 0;
-	pb->order = paste_next_order++;
+/*
+ * Append to a buffer, which then replaces the buffer with the name (as
+ * paste_set would). The existing data is shared, not copied. Note that the
+ * caller is responsible for allocating data.
+ */
+int
+paste_append(struct paste_buffer *old, char *data, size_t size,
+    const char *name, char **cause)
+{
+	struct paste_buffer	*pb;
+	struct paste_chunk	*chunk;
+	u_int			 i;
 
-	if ((old = paste_get_name(name)) != NULL)
-		paste_free(old);
+	if (old == NULL || size == 0)
+		return (paste_set(data, size, name, cause));
 
-	RB_INSERT(paste_name_tree, &paste_by_name, pb);
-	RB_INSERT(paste_time_tree, &paste_by_time, pb);
+	if (cause != NULL)
+		*cause = NULL;
+	if (name == NULL)
+		name = old->name;
+	if (*name == '\0') {
+		if (cause != NULL)
+			*cause = xstrdup("empty buffer name");
+		return (-1);
+	}
 
+	pb = xcalloc(1, sizeof *pb);
+	for (i = 0; i < old->npieces; i++) {
+		paste_add_piece(pb, old->pieces[i].chunk, old->pieces[i].off,
+		    old->pieces[i].size);
+	}
+	chunk = paste_chunk_create(data, size);
+	paste_add_piece(pb, chunk, 0, size);
+	paste_chunk_unref(NULL, 0, chunk);
+
+	paste_insert(pb, name);
 	return (0);
 }
 
@@ -276,17 +556,24 @@ paste_set(char *data, size_t size, const char *name, char **cause)
 char *
 paste_make_sample(struct paste_buffer *pb)
 {
-	char		*buf;
-	size_t		 len, used;
+	char		*buf, start[200];
+	size_t		 len, used, n;
 	const int	 flags = VIS_OCTAL|VIS_TAB|VIS_NL;
-	const size_t	 width = 200;
-
-	len = pb->size;
-	if (len > width)
-		len = width;
+	const size_t	 width = sizeof start;
+	u_int		 i;
+
+	len = 0;
+	for (i = 0; i < pb->npieces && len < width; i++) {
+		n = pb->pieces[i].size;
+		if (n > width - len)
+			n = width - len;
+		memcpy(start + len, pb->pieces[i].chunk->data +
+		    pb->pieces[i].off, n);
+		len += n;
+	}
 	buf = xreallocarray(NULL, len, 4 + 4);
 
-	used = utf8_strvis(buf, pb->data, len, flags);
+	used = utf8_strvis(buf, start, len, flags);
 	if (pb->size > width || used > width)
 		strlcpy(buf + width, "...", 4);
 	return (buf);
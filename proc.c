@@ -136,6 +136,7 @@ proc_update_event(struct tmuxpeer *peer)
 	if (peer->ibuf.w.queued > 0)
 		events |= EV_WRITE;
 	event_set(&peer->event, peer->ibuf.fd, events, proc_event_cb, peer);
+	event_priority_set(&peer->event, EVENT_PRI_INPUT);
 
 	event_add(&peer->event, NULL);
 }
@@ -272,3 +273,10 @@ proc_kill_peer(struct tmuxpeer *peer)
 {
 	peer->flags |= PEER_BAD;
 }
+
+/* Count the messages waiting to be written to a peer. */
+u_int
+proc_queued(struct tmuxpeer *peer)
+{
+	return (peer->ibuf.w.queued);
+}
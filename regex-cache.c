@@ -0,0 +1,105 @@
+#include <sys/types.h>
+
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Compiled regular expressions, kept for the searches repeated with the same
+ * pattern. The most recently used are at the front of the list and the list
+ * is short, so a search which goes over every line or every pane compiles its
+ * pattern once. A pattern stays valid until the next regex_cache_get,
+ * unless held with regex_cache_hold.
+ */
+
+#define REGEX_CACHE_SIZE 8
+
+struct regex_cache_entry {
+	char			*pattern;
+	int			 cflags;
+	regex_t			 re;
+	u_int			 references;
+
+	TAILQ_ENTRY(regex_cache_entry) entry;
+};
+TAILQ_HEAD(regex_cache_list, regex_cache_entry);
+
+struct regex_cache_list	regex_cache = TAILQ_HEAD_INITIALIZER(regex_cache);
+u_int			regex_cache_size;
+
+struct regex_cache_entry *regex_cache_find(regex_t *);
+
+struct regex_cache_entry *
+regex_cache_find(regex_t *re)
+{
+	struct regex_cache_entry	*rce;
+
+	TAILQ_FOREACH(rce, &regex_cache, entry) {
+		if (&rce->re == re)
+			return (rce);
+	}
+	fatalx("regex not in cache");
+}
+
+/* Keep a pattern valid, for a search which waits. */
+void
+regex_cache_hold(regex_t *re)
+{
+	regex_cache_find(re)->references++;
+}
+
+void
+regex_cache_release(regex_t *re)
+{
+	regex_cache_find(re)->references--;
+}
+
+/* Get a compiled pattern, or NULL and the error in cause. */
+regex_t *
+regex_cache_get(const char *pattern, int cflags, char **cause)
+{
+	struct regex_cache_entry	*rce, *last;
+	char				 error[128];
+	int				 retval;
+
+	TAILQ_FOREACH(rce, &regex_cache, entry) {
+		if (rce->cflags == cflags && strcmp(rce->pattern, pattern) == 0)
+			break;
+	}
+	if (rce != NULL) {
+		TAILQ_REMOVE(&regex_cache, rce, entry);
+		TAILQ_INSERT_HEAD(&regex_cache, rce, entry);
+		return (&rce->re);
+	}
+
+	rce = xcalloc(1, sizeof *rce);
+	if ((retval = regcomp(&rce->re, pattern, cflags)) != 0) {
+		regerror(retval, &rce->re, error, sizeof error);
+		xasprintf(cause, "%s: %s", pattern, error);
+		free(rce);
+		return (NULL);
+	}
+	rce->pattern = xstrdup(pattern);
+	rce->cflags = cflags;
+
+	/* Drop the least recently used pattern which is not held. */
+	if (regex_cache_size >= REGEX_CACHE_SIZE) {
+		TAILQ_FOREACH_REVERSE(last, &regex_cache, regex_cache_list,
+		    entry) {
+			if (last->references == 0)
+				break;
+		}
+	} else
+		last = NULL;
+	if (last != NULL) {
+		TAILQ_REMOVE(&regex_cache, last, entry);
+		regfree(&last->re);
+		free(last->pattern);
+		free(last);
+	} else
+		regex_cache_size++;
+	TAILQ_INSERT_HEAD(&regex_cache, rce, entry);
+	return (&rce->re);
+}
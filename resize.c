@@ -35,26 +35,38 @@
  * every window, find the smallest session it is attached to, resize it to that
  * size and clear and redraw every client with it as the current window.
  *
- * This is quite inefficient - better/additional data structures are needed
- * to make it better.
+ * Rather than looking through every session for every window, each attached
+ * session passes its size to the windows linked to it, which keep the
+ * smallest. Windows not reached that way this time round are skipped.
+ *
+ * A window which is not the current window of any attached session is not
+ * resized straight away: reflowing the history of all its panes is wasted
+ * work if the size changes again before anyone looks at it. The size is kept
+ * instead and recalculate_pending applies it when the window is made
+ * current, is the target of a command or is sent in a snapshot.
  *
  * As a side effect, this function updates the SESSION_UNATTACHED flag. This
  * flag is necessary to make sure unattached sessions do not limit the size of
  * windows that are attached both to them and to other (attached) sessions.
  */
 
+static void	recalculate_window(struct window *, u_int, u_int, int);
+
 void
 recalculate_sizes(void)
 {
+	static u_int		 generation;
 	struct session		*s;
 	struct client		*c;
+	struct winlink		*wl;
 	struct window		*w;
-	struct window_pane	*wp;
-	u_int			 ssx, ssy, has, limit;
-	int			 flag, has_status, is_zoomed, forced;
+	u_int			 ssx, ssy, limit;
+	int			 has_status, forced;
 #ifdef TMATE
 	int tmate_sx = tmate_session.min_sx;
 	int tmate_sy = tmate_session.min_sy;
+	int tmate_viewers = options_get_number(global_options,
+	    "tmate-resize-viewers");
 #endif
 
 	RB_FOREACH(s, sessions, &sessions) {
@@ -83,8 +95,15 @@ recalculate_sizes(void)
 		}
 
 #ifdef TMATE
-		/* We assume a single session */
-		if (tmate_sx > 0 && tmate_sy > 0) {
+		/*
+		 * We assume a single session. With tmate-resize-viewers off,
+		 * the viewers' size is only used if there are no local clients,
+		 * a smaller viewer sees part of the windows instead of them
+		 * being resized (and their history reflowed) for each viewer
+		 * joining or leaving.
+		 */
+		if (tmate_sx > 0 && tmate_sy > 0 &&
+		    (tmate_viewers || ssx == UINT_MAX)) {
 			if ((u_int)tmate_sx < ssx)
 				ssx = tmate_sx;
 			if ((u_int)tmate_sy < ssy)
@@ -111,26 +130,38 @@ recalculate_sizes(void)
 		s->sy = ssy;
 	}
 
-	RB_FOREACH(w, windows, &windows) {
-		if (w->active == NULL)
+	generation++;
+	RB_FOREACH(s, sessions, &sessions) {
+		if (s->flags & SESSION_UNATTACHED)
 			continue;
-		flag = options_get_number(w->options, "aggressive-resize");
-
-		ssx = ssy = UINT_MAX;
-		RB_FOREACH(s, sessions, &sessions) {
-			if (s->flags & SESSION_UNATTACHED)
-				continue;
-			if (flag)
-				has = s->curw->window == w;
-			else
-				has = session_has(s, w);
-			if (has) {
-				if (s->sx < ssx)
-					ssx = s->sx;
-				if (s->sy < ssy)
-					ssy = s->sy;
+		RB_FOREACH(wl, winlinks, &s->windows) {
+			w = wl->window;
+			if (w->resize_generation != generation) {
+				w->resize_generation = generation;
+				w->resize_sx = w->resize_sy = UINT_MAX;
+				w->resize_aggressive = options_get_number(
+				    w->options, "aggressive-resize");
+				w->resize_visible = 0;
 			}
+			if (s->curw->window == w)
+				w->resize_visible = 1;
+			if (w->resize_aggressive && s->curw->window != w)
+				continue;
+			if (s->sx < w->resize_sx)
+				w->resize_sx = s->sx;
+			if (s->sy < w->resize_sy)
+				w->resize_sy = s->sy;
 		}
+	}
+
+	RB_FOREACH(w, windows, &windows) {
+		/* Attached sessions may have changed and with them focus. */
+		window_enqueue(w);
+
+		if (w->active == NULL || w->resize_generation != generation)
+			continue;
+		ssx = w->resize_sx;
+		ssy = w->resize_sy;
 		if (ssx == UINT_MAX || ssy == UINT_MAX)
 			continue;
 
@@ -146,36 +177,74 @@ recalculate_sizes(void)
 			forced |= WINDOW_FORCEHEIGHT;
 		}
 
-		if (w->sx == ssx && w->sy == ssy)
+		if (w->sx == ssx && w->sy == ssy) {
+			w->resize_pending = 0;
 			continue;
-		log_debug("window size %u,%u (was %u,%u)", ssx, ssy, w->sx,
-		    w->sy);
-
-		w->flags &= ~(WINDOW_FORCEWIDTH|WINDOW_FORCEHEIGHT);
-		w->flags |= forced;
+		}
+		if (!w->resize_visible) {
+			log_debug("window @%u pending size %u,%u", w->id, ssx,
+			    ssy);
+			w->resize_pending = 1;
+			w->resize_pending_sx = ssx;
+			w->resize_pending_sy = ssy;
+			w->resize_pending_forced = forced;
+			continue;
+		}
+		w->resize_pending = 0;
+		recalculate_window(w, ssx, ssy, forced);
+	}
+}
 
-		is_zoomed = w->flags & WINDOW_ZOOMED;
-		if (is_zoomed)
-			window_unzoom(w);
-		layout_resize(w, ssx, ssy);
-		window_resize(w, ssx, ssy);
-		if (is_zoomed && window_pane_visible(w->active))
-			window_zoom(w->active);
+/* Apply the size kept for a window while it was not current. */
+void
+recalculate_pending(struct window *w)
+{
+	if (w == NULL || !w->resize_pending)
+		return;
+	w->resize_pending = 0;
+	if (w->active == NULL)
+		return;
+	recalculate_window(w, w->resize_pending_sx, w->resize_pending_sy,
+	    w->resize_pending_forced);
+}
 
-		/*
-		 * If the current pane is now not visible, move to the next
-		 * that is.
-		 */
-		wp = w->active;
-		while (!window_pane_visible(w->active)) {
-			w->active = TAILQ_PREV(w->active, window_panes, entry);
-			if (w->active == NULL)
-				w->active = TAILQ_LAST(&w->panes, window_panes);
-			if (w->active == wp)
-			       break;
-		}
+static void
+recalculate_window(struct window *w, u_int ssx, u_int ssy, int forced)
+{
+	struct window_pane	*wp;
 
-		server_redraw_window(w);
-		notify_window_layout_changed(w);
+	if (w->sx == ssx && w->sy == ssy)
+		return;
+	log_debug("window size %u,%u (was %u,%u)", ssx, ssy, w->sx, w->sy);
+
+	w->flags &= ~(WINDOW_FORCEWIDTH|WINDOW_FORCEHEIGHT);
+	w->flags |= forced;
+
+	/*
+	 * While zoomed, the hidden panes keep their size and are only
+	 * resized to fit the layout when the window is unzoomed, so
+	 * they and the zoomed pane are not reflowed twice.
+	 */
+	if (w->flags & WINDOW_ZOOMED) {
+		layout_resize_cells(w->saved_layout_root, w->sx, w->sy,
+		    ssx, ssy);
+	}
+	layout_resize(w, ssx, ssy);
+	window_resize(w, ssx, ssy);
+
+	/*
+	 * If the current pane is now not visible, move to the next
+	 * that is.
+	 */
+	wp = w->active;
+	while (!window_pane_visible(w->active)) {
+		w->active = TAILQ_PREV(w->active, window_panes, entry);
+		if (w->active == NULL)
+			w->active = TAILQ_LAST(&w->panes, window_panes);
+		if (w->active == wp)
+		       break;
 	}
+
+	server_redraw_window(w);
+	notify_window_layout_changed(w);
 }
@@ -18,36 +18,18 @@
 
 #include <sys/types.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "tmux.h"
 
 int	screen_redraw_cell_border1(struct window_pane *, u_int, u_int);
-int	screen_redraw_cell_border(struct client *, u_int, u_int);
-int	screen_redraw_check_cell(struct client *, u_int, u_int,
-	    struct window_pane **);
-int	screen_redraw_check_is(u_int, u_int, int, struct window *,
-	    struct window_pane *, struct window_pane *);
 
-void	screen_redraw_draw_borders(struct client *, int, u_int);
+void	screen_redraw_draw_borders(struct client *, int, u_int, int);
 void	screen_redraw_draw_panes(struct client *, u_int);
-void	screen_redraw_draw_status(struct client *, u_int);
+void	screen_redraw_draw_status(struct client *, u_int, int);
 void	screen_redraw_draw_number(struct client *, struct window_pane *, u_int);
 
-#define CELL_INSIDE 0
-#define CELL_LEFTRIGHT 1
-#define CELL_TOPBOTTOM 2
-#define CELL_TOPLEFT 3
-#define CELL_TOPRIGHT 4
-#define CELL_BOTTOMLEFT 5
-#define CELL_BOTTOMRIGHT 6
-#define CELL_TOPJOIN 7
-#define CELL_BOTTOMJOIN 8
-#define CELL_LEFTJOIN 9
-#define CELL_RIGHTJOIN 10
-#define CELL_JOIN 11
-#define CELL_OUTSIDE 12
-
 #define CELL_BORDERS " xqlkmjwvtun~"
 
 /* Check if cell is on the border of a particular pane. */
@@ -79,102 +61,6 @@ screen_redraw_cell_border1(struct window_pane *wp, u_int px, u_int py)
 	return (-1);
 }
 
-/* Check if a cell is on the pane border. */
-int
-screen_redraw_cell_border(struct client *c, u_int px, u_int py)
-{
-	struct window		*w = c->session->curw->window;
-	struct window_pane	*wp;
-	int			 retval;
-
-	/* Check all the panes. */
-	TAILQ_FOREACH(wp, &w->panes, entry) {
-		if (!window_pane_visible(wp))
-			continue;
-		if ((retval = screen_redraw_cell_border1(wp, px, py)) != -1)
-			return (retval);
-	}
-
-	return (0);
-}
-
-/* Check if cell inside a pane. */
-int
-screen_redraw_check_cell(struct client *c, u_int px, u_int py,
-    struct window_pane **wpp)
-{
-	struct window		*w = c->session->curw->window;
-	struct window_pane	*wp;
-	int			 borders;
-
-	if (px > w->sx || py > w->sy)
-		return (CELL_OUTSIDE);
-
-	TAILQ_FOREACH(wp, &w->panes, entry) {
-		if (!window_pane_visible(wp))
-			continue;
-		*wpp = wp;
-
-		/* If outside the pane and its border, skip it. */
-		if ((wp->xoff != 0 && px < wp->xoff - 1) ||
-		    px > wp->xoff + wp->sx ||
-		    (wp->yoff != 0 && py < wp->yoff - 1) ||
-		    py > wp->yoff + wp->sy)
-			continue;
-
-		/* If definitely inside, return so. */
-		if (!screen_redraw_cell_border(c, px, py))
-			return (CELL_INSIDE);
-
-		/*
-		 * Construct a bitmask of whether the cells to the left (bit
-		 * 4), right, top, and bottom (bit 1) of this cell are borders.
-		 */
-		borders = 0;
-		if (px == 0 || screen_redraw_cell_border(c, px - 1, py))
-			borders |= 8;
-		if (px <= w->sx && screen_redraw_cell_border(c, px + 1, py))
-			borders |= 4;
-		if (py == 0 || screen_redraw_cell_border(c, px, py - 1))
-			borders |= 2;
-		if (py <= w->sy && screen_redraw_cell_border(c, px, py + 1))
-			borders |= 1;
-
-		/*
-		 * Figure out what kind of border this cell is. Only one bit
-		 * set doesn't make sense (can't have a border cell with no
-		 * others connected).
-		 */
-		switch (borders) {
-		case 15:	/* 1111, left right top bottom */
-			return (CELL_JOIN);
-		case 14:	/* 1110, left right top */
-			return (CELL_BOTTOMJOIN);
-		case 13:	/* 1101, left right bottom */
-			return (CELL_TOPJOIN);
-		case 12:	/* 1100, left right */
-			return (CELL_TOPBOTTOM);
-		case 11:	/* 1011, left top bottom */
-			return (CELL_RIGHTJOIN);
-		case 10:	/* 1010, left top */
-			return (CELL_BOTTOMRIGHT);
-		case 9:		/* 1001, left bottom */
-			return (CELL_TOPRIGHT);
-		case 7:		/* 0111, right top bottom */
-			return (CELL_LEFTJOIN);
-		case 6:		/* 0110, right top */
-			return (CELL_BOTTOMLEFT);
-		case 5:		/* 0101, right bottom */
-			return (CELL_TOPLEFT);
-		case 3:		/* 0011, top bottom */
-			return (CELL_LEFTRIGHT);
-		}
-	}
-
-	*wpp = NULL;
-	return (CELL_OUTSIDE);
-}
-
 /* Check if the border of a particular pane. */
 int
 screen_redraw_check_is(u_int px, u_int py, int type, struct window *w,
@@ -244,11 +130,11 @@ screen_redraw_screen(struct client *c, int draw_panes, int draw_status,
 		draw_status = 0;
 
 	if (draw_borders)
-		screen_redraw_draw_borders(c, status, top);
+		screen_redraw_draw_borders(c, status, top, draw_panes);
 	if (draw_panes)
 		screen_redraw_draw_panes(c, top);
 	if (draw_status)
-		screen_redraw_draw_status(c, top);
+		screen_redraw_draw_status(c, top, draw_panes || draw_borders);
 	tty_reset(tty);
 }
 
@@ -270,9 +156,34 @@ screen_redraw_pane(struct client *c, struct window_pane *wp)
 	tty_reset(&c->tty);
 }
 
-/* Draw the borders. */
+/* Draw only the lines of a pane changed since it was last up to date. */
 void
-screen_redraw_draw_borders(struct client *c, int status, u_int top)
+screen_redraw_pane_dirty(struct client *c, struct window_pane *wp)
+{
+	struct screen	*s = wp->screen;
+	u_int		 i, yoff;
+
+	if (!window_pane_visible(wp))
+		return;
+
+	yoff = wp->yoff;
+	if (status_at_line(c) == 0)
+		yoff++;
+
+	for (i = 0; i < wp->sy && i < screen_size_y(s); i++) {
+		if (bit_test(s->dirty, i))
+			tty_draw_pane(&c->tty, wp, i, wp->xoff, yoff);
+	}
+	tty_reset(&c->tty);
+}
+
+/*
+ * Draw the borders. Unless all is set, the cells are drawn over what was drawn
+ * last time, so only those which have changed are written: switching the
+ * active pane draws the borders of the two panes and no others.
+ */
+void
+screen_redraw_draw_borders(struct client *c, int status, u_int top, int all)
 {
 	struct session		*s = c->session;
 	struct window		*w = s->curw->window;
@@ -282,10 +193,15 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 	struct grid_cell	 m_active_gc, active_gc, m_other_gc, other_gc;
 	struct grid_cell	 msg_gc;
 	u_int		 	 i, j, type, msgx = 0, msgy = 0;
-	int			 active, small, flags;
+	int			 active, marked, small, flags;
 	char			 msg[256];
 	const char		*tmp;
 	size_t			 msglen = 0;
+	u_char			 code, *last;
+	uint64_t		 key;
+
+	if (tty->sx == 0 || tty->sy == 0)
+		return;
 
 	small = (tty->sy - status + top > w->sy) || (tty->sx > w->sx);
 	if (small) {
@@ -321,19 +237,40 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 	memcpy(&m_active_gc, &active_gc, sizeof m_active_gc);
 	m_active_gc.attr ^= GRID_ATTR_REVERSE;
 
+	/* What was drawn before is only any use for the same window and styles. */
+	key = status_hash(0, &w->id, sizeof w->id);
+	key = status_hash(key, &top, sizeof top);
+	key = status_hash(key, &other_gc, sizeof other_gc);
+	key = status_hash(key, &active_gc, sizeof active_gc);
+	if (c->border_sx != tty->sx || c->border_sy != tty->sy) {
+		free(c->border_cells);
+		c->border_sx = tty->sx;
+		c->border_sy = tty->sy;
+		c->border_cells = xcalloc(tty->sx, tty->sy);
+	} else if (all || key != c->border_key)
+		memset(c->border_cells, 0, tty->sx * tty->sy);
+	c->border_key = key;
+
 	for (j = 0; j < tty->sy - status; j++) {
 		for (i = 0; i < tty->sx; i++) {
-			type = screen_redraw_check_cell(c, i, j, &wp);
+			type = window_get_cell_type(w, i, j, &wp);
 			if (type == CELL_INSIDE)
 				continue;
 			if (type == CELL_OUTSIDE && small &&
 			    i > msgx && j == msgy)
 				continue;
-			active = screen_redraw_check_is(i, j, type, w,
-			    w->active, wp);
-			if (server_is_marked(s, s->curw, marked_pane.wp) &&
+			active = window_get_cell_active(w, i, j);
+			marked = (server_is_marked(s, s->curw, marked_pane.wp) &&
 			    screen_redraw_check_is(i, j, type, w,
-			    marked_pane.wp, wp)) {
+			    marked_pane.wp, wp));
+
+			last = &c->border_cells[j * tty->sx + i];
+			code = 0x80|type|(active << 4)|(marked << 5);
+			if (*last == code)
+				continue;
+			*last = code;
+
+			if (marked) {
 				if (active)
 					tty_attributes(tty, &m_active_gc, NULL);
 				else
@@ -374,16 +311,26 @@ screen_redraw_draw_panes(struct client *c, u_int top)
 	}
 }
 
-/* Draw the status line. */
+/*
+ * Draw the status line. If only the status line is being drawn, only the part
+ * status_redraw found had changed is needed.
+ */
 void
-screen_redraw_draw_status(struct client *c, u_int top)
+screen_redraw_draw_status(struct client *c, u_int top, int all)
 {
 	struct tty	*tty = &c->tty;
+	u_int		 y;
 
 	if (top)
-		tty_draw_line(tty, NULL, &c->status, 0, 0, 0);
+		y = 0;
 	else
-		tty_draw_line(tty, NULL, &c->status, 0, 0, tty->sy - 1);
+		y = tty->sy - 1;
+
+	if (!all && c->status_dirtynx != 0) {
+		tty_draw_cells(tty, &c->status, 0, c->status_dirtyx,
+		    c->status_dirtynx, 0, y);
+	} else
+		tty_draw_line(tty, NULL, &c->status, 0, 0, y);
 }
 
 /* Draw number on a pane. */
@@ -18,15 +18,22 @@
 
 #include <sys/types.h>
 
+#include <netinet/in.h>
+
+#include <resolv.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "tmux.h"
 
 void	screen_write_initctx(struct screen_write_ctx *, struct tty_ctx *, int);
+void	screen_write_flush_scroll(struct screen_write_ctx *);
 void	screen_write_overwrite(struct screen_write_ctx *, u_int);
 int	screen_write_combine(struct screen_write_ctx *,
 	    const struct utf8_data *);
+int	screen_write_simple_cell(const struct grid_cell *);
+int	screen_write_copy_line(struct screen_write_ctx *, struct screen *,
+	    u_int, u_int, u_int);
 
 /* Initialise writing with a window. */
 void
@@ -38,12 +45,38 @@ screen_write_start(struct screen_write_ctx *ctx, struct window_pane *wp,
 		ctx->s = wp->screen;
 	else
 		ctx->s = s;
+	ctx->scrolled = 0;
 }
 
 /* Finish writing. */
 void
-screen_write_stop(__unused struct screen_write_ctx *ctx)
+screen_write_stop(struct screen_write_ctx *ctx)
 {
+	screen_write_flush_scroll(ctx);
+}
+
+/*
+ * Send the scrolls at the bottom of the region made since the last command
+ * written to the tty, as one command.
+ */
+void
+screen_write_flush_scroll(struct screen_write_ctx *ctx)
+{
+	struct screen	*s = ctx->s;
+	struct tty_ctx	 ttyctx;
+
+	if (ctx->scrolled == 0)
+		return;
+
+	ttyctx.wp = ctx->wp;
+	ttyctx.ocx = 0;
+	ttyctx.ocy = s->rlower;
+	ttyctx.orupper = s->rupper;
+	ttyctx.orlower = s->rlower;
+	ttyctx.num = ctx->scrolled;
+	ctx->scrolled = 0;
+
+	tty_write(tty_cmd_scrollup, &ttyctx);
 }
 
 /* Reset screen state. */
@@ -177,7 +210,7 @@ screen_write_vnputs(struct screen_write_ctx *ctx, ssize_t maxlen,
 	char   		       *msg;
 	struct utf8_data	ud;
 	u_char 		       *ptr;
-	size_t		 	left, size = 0;
+	size_t		 	left, size = 0, n;
 	enum utf8_state		more;
 
 	xvasprintf(&msg, fmt, ap);
@@ -212,13 +245,19 @@ screen_write_vnputs(struct screen_write_ctx *ctx, ssize_t maxlen,
 			if (maxlen > 0 && size + 1 > (size_t) maxlen)
 				break;
 
-			if (*ptr == '\001')
+			if (*ptr == '\001') {
 				gc->attr ^= GRID_ATTR_CHARSET;
-			else if (*ptr > 0x1f && *ptr < 0x7f) {
-				size++;
-				screen_write_putc(ctx, gc, *ptr);
-			}
-			ptr++;
+				ptr++;
+			} else if (*ptr > 0x1f && *ptr < 0x7f) {
+				for (n = 1; ptr[n] > 0x1f && ptr[n] < 0x7f; n++)
+					/* nothing */;
+				if (maxlen > 0 && size + n > (size_t) maxlen)
+					n = maxlen - size;
+				screen_write_cells(ctx, gc, ptr, n);
+				size += n;
+				ptr += n;
+			} else
+				ptr++;
 		}
 	}
 
@@ -299,6 +338,42 @@ screen_write_cnputs(struct screen_write_ctx *ctx, ssize_t maxlen,
 	free(msg);
 }
 
+/* Is this a printable ASCII cell which can be written in a run? */
+int
+screen_write_simple_cell(const struct grid_cell *gc)
+{
+	if (gc->flags & GRID_FLAG_PADDING)
+		return (0);
+	if (gc->data.size != 1 || gc->data.width != 1)
+		return (0);
+	return (gc->data.data[0] > 0x1f && gc->data.data[0] < 0x7f);
+}
+
+/*
+ * Copy a whole line from another screen of the same width as it is, cells and
+ * all, and redraw it at once. Returns 0 if it must be copied cell by cell.
+ */
+int
+screen_write_copy_line(struct screen_write_ctx *ctx, struct screen *src,
+    u_int px, u_int py, u_int nx)
+{
+	struct screen	*s = ctx->s;
+	struct grid	*gd = s->grid;
+	struct tty_ctx	 ttyctx;
+
+	if (px != 0 || nx != screen_size_x(src) || s->cx != 0 ||
+	    screen_size_x(s) != screen_size_x(src))
+		return (0);
+	if (src == s || s->sel.flag || (s->mode & MODE_INSERT) ||
+	    s->cy > screen_size_y(s) - 1)
+		return (0);
+
+	screen_write_initctx(ctx, &ttyctx, 0);
+	grid_duplicate_lines(gd, gd->hsize + s->cy, src->grid, py, 1);
+	tty_write(tty_cmd_drawline, &ttyctx);
+	return (1);
+}
+
 /* Copy from another screen. */
 void
 screen_write_copy(struct screen_write_ctx *ctx,
@@ -307,13 +382,20 @@ screen_write_copy(struct screen_write_ctx *ctx,
 	struct screen		*s = ctx->s;
 	struct grid		*gd = src->grid;
 	struct grid_line	*gl;
-	struct grid_cell	 gc;
-	u_int		 	 xx, yy, cx, cy, ax, bx;
+	struct grid_cell	 gc, next;
+	u_char			 run[128];
+	u_int		 	 xx, yy, cx, cy, ax, bx, n;
 
 	cx = s->cx;
 	cy = s->cy;
 	for (yy = py; yy < py + ny; yy++) {
 		gl = &gd->linedata[yy];
+		if (yy < gd->hsize + gd->sy && screen_write_copy_line(ctx, src,
+		    px, yy, nx)) {
+			cy++;
+			screen_write_cursormove(ctx, cx, cy);
+			continue;
+		}
 		if (yy < gd->hsize + gd->sy) {
 			/*
 			 * Find start and end position and copy between
@@ -330,9 +412,26 @@ screen_write_copy(struct screen_write_ctx *ctx,
 			else
 				bx = px + nx;
 
-			for (xx = ax; xx < bx; xx++) {
+			for (xx = ax; xx < bx; xx += n) {
 				grid_get_cell(gd, xx, yy, &gc);
-				screen_write_cell(ctx, &gc);
+				if (!screen_write_simple_cell(&gc)) {
+					screen_write_cell(ctx, &gc);
+					n = 1;
+					continue;
+				}
+
+				/* Gather a run of cells with the same style. */
+				run[0] = gc.data.data[0];
+				for (n = 1; xx + n < bx && n < sizeof run; n++) {
+					grid_get_cell(gd, xx + n, yy, &next);
+					if (!screen_write_simple_cell(&next) ||
+					    next.flags != gc.flags ||
+					    next.attr != gc.attr ||
+					    next.fg != gc.fg || next.bg != gc.bg)
+						break;
+					run[n] = next.data.data[0];
+				}
+				screen_write_cells(ctx, &gc, run, n);
 			}
 			if (px + nx == gd->sx && px + nx > gl->cellsize)
 				screen_write_clearendofline(ctx);
@@ -353,6 +452,8 @@ screen_write_initctx(struct screen_write_ctx *ctx, struct tty_ctx *ttyctx,
 	struct grid_cell	 gc;
 	u_int			 xx;
 
+	screen_write_flush_scroll(ctx);
+
 	ttyctx->wp = ctx->wp;
 
 	ttyctx->ocx = s->cx;
@@ -361,7 +462,7 @@ screen_write_initctx(struct screen_write_ctx *ctx, struct tty_ctx *ttyctx,
 	ttyctx->orlower = s->rlower;
 	ttyctx->orupper = s->rupper;
 
-	if (!save_last)
+	if (!save_last || server_headless)
 		return;
 
 	/* Save the last cell on the screen. */
@@ -778,6 +879,7 @@ screen_write_scrollregion(struct screen_write_ctx *ctx, u_int rupper,
 		rlower = screen_size_y(s) - 1;
 	if (rupper >= rlower)	/* cannot be one line */
 		return;
+	screen_write_flush_scroll(ctx);
 
 	/* Cursor moves to top-left. */
 	s->cx = 0;
@@ -795,14 +897,26 @@ screen_write_linefeed(struct screen_write_ctx *ctx, int wrapped)
 	struct grid_line	*gl;
 	struct tty_ctx	 	 ttyctx;
 
-	screen_write_initctx(ctx, &ttyctx, 0);
-
 	gl = &s->grid->linedata[s->grid->hsize + s->cy];
 	if (wrapped)
 		gl->flags |= GRID_LINE_WRAPPED;
 	else
 		gl->flags &= ~GRID_LINE_WRAPPED;
 
+	/*
+	 * Scrolls of the pane's own screen are counted and sent to the tty
+	 * together with the next command. Wrapped lines are not, the
+	 * terminal may scroll by itself for them.
+	 */
+	if (s->cy == s->rlower && !wrapped && ctx->wp != NULL &&
+	    ctx->s == &ctx->wp->base) {
+		grid_view_scroll_region_up(s->grid, s->rupper, s->rlower);
+		ctx->scrolled++;
+		return;
+	}
+
+	screen_write_initctx(ctx, &ttyctx, 0);
+
 	if (s->cy == s->rlower)
 		grid_view_scroll_region_up(s->grid, s->rupper, s->rlower);
 	else if (s->cy < screen_size_y(s) - 1)
@@ -895,6 +1009,7 @@ screen_write_clearhistory(struct screen_write_ctx *ctx)
 	struct screen	*s = ctx->s;
 	struct grid	*gd = s->grid;
 
+	grid_cache_drop(gd, 0);
 	grid_move_lines(gd, 0, gd->hsize, gd->sy);
 	gd->hsize = 0;
 }
@@ -1040,6 +1155,64 @@ screen_write_combine(struct screen_write_ctx *ctx, const struct utf8_data *ud)
 	return (0);
 }
 
+/*
+ * Write a run of printable ASCII characters with the attributes of gc. Each
+ * part of the run which fits on the current line is stored in the grid in one
+ * pass and drawn with a single tty command; the awkward cases (insert mode, a
+ * selection, the last column and wrapping) go through screen_write_cell.
+ */
+void
+screen_write_cells(struct screen_write_ctx *ctx, const struct grid_cell *gc,
+    const u_char *data, u_int n)
+{
+	struct screen		*s = ctx->s;
+	struct grid		*gd = s->grid;
+	struct tty_ctx		 ttyctx;
+	struct grid_cell	 tmp_gc;
+	u_int			 sx = screen_size_x(s), run;
+
+	memcpy(&tmp_gc, gc, sizeof tmp_gc);
+	tmp_gc.flags &= ~GRID_FLAG_PADDING;
+
+	while (n > 0) {
+		if ((s->mode & MODE_INSERT) || s->sel.flag ||
+		    s->cx + 1 >= sx || s->cy > screen_size_y(s) - 1) {
+			utf8_set(&tmp_gc.data, *data);
+			screen_write_cell(ctx, &tmp_gc);
+			data++;
+			n--;
+			continue;
+		}
+
+		/*
+		 * Without wrapping, the last column is left to
+		 * screen_write_cell, which decides where the cursor sticks.
+		 */
+		run = sx - s->cx;
+		if (!(s->mode & MODE_WRAP))
+			run--;
+		if (run > n)
+			run = n;
+
+		screen_write_initctx(ctx, &ttyctx, 0);
+
+		/* Handle overwriting of UTF-8 characters. */
+		screen_write_overwrite(ctx, run);
+		grid_view_set_cells(gd, s->cx, s->cy, &tmp_gc, data, run);
+
+		s->cx += run;
+
+		utf8_set(&tmp_gc.data, data[run - 1]);
+		ttyctx.cell = &tmp_gc;
+		ttyctx.ptr = (void *)data;
+		ttyctx.num = run;
+		tty_write(tty_cmd_cells, &ttyctx);
+
+		data += run;
+		n -= run;
+	}
+}
+
 /*
  * UTF-8 wide characters are a bit of an annoyance. They take up more than one
  * cell on the screen, so following cells must not be drawn by marking them as
@@ -1089,16 +1262,30 @@ screen_write_overwrite(struct screen_write_ctx *ctx, u_int width)
 	}
 }
 
+/*
+ * Set the selection of the outside terminals. It is encoded here once, rather
+ * than for each client in tty_cmd_setselection.
+ */
 void
 screen_write_setselection(struct screen_write_ctx *ctx, u_char *str, u_int len)
 {
-	struct tty_ctx	ttyctx;
+	struct tty_ctx	 ttyctx;
+	char		*buf;
+	size_t		 size;
+
+	size = 4 * ((len + 2) / 3) + 1; /* storage for base64 */
+	buf = xmalloc(size);
+	if (b64_ntop(str, len, buf, size) == -1) {
+		free(buf);
+		return;
+	}
 
 	screen_write_initctx(ctx, &ttyctx, 0);
-	ttyctx.ptr = str;
+	ttyctx.ptr = buf;
 	ttyctx.num = len;
 
 	tty_write(tty_cmd_setselection, &ttyctx);
+	free(buf);
 }
 
 void
@@ -37,6 +37,8 @@ screen_init(struct screen *s, u_int sx, u_int sy, u_int hlimit)
 	s->cstyle = 0;
 	s->ccolour = xstrdup("");
 	s->tabs = NULL;
+	if ((s->dirty = bit_alloc(sy)) == NULL)
+		fatal("bit_alloc failed");
 
 	screen_reinit(s);
 }
@@ -65,6 +67,7 @@ void
 screen_free(struct screen *s)
 {
 	free(s->tabs);
+	free(s->dirty);
 	free(s->title);
 	free(s->ccolour);
 	grid_destroy(s->grid);
@@ -92,6 +95,24 @@ screen_set_cursor_style(struct screen *s, u_int style)
 		s->cstyle = style;
 }
 
+/* Mark lines py to py + ny - 1 as needing to be redrawn. */
+void
+screen_set_dirty(struct screen *s, u_int py, u_int ny)
+{
+	if (py >= screen_size_y(s) || ny == 0)
+		return;
+	if (py + ny > screen_size_y(s))
+		ny = screen_size_y(s) - py;
+	bit_nset(s->dirty, py, py + ny - 1);
+}
+
+/* Forget which lines need to be redrawn. */
+void
+screen_clear_dirty(struct screen *s)
+{
+	bit_nclear(s->dirty, 0, screen_size_y(s) - 1);
+}
+
 /* Set screen cursor colour. */
 void
 screen_set_cursor_colour(struct screen *s, const char *colour)
@@ -128,9 +149,15 @@ screen_resize(struct screen *s, u_int sx, u_int sy, int reflow)
 		screen_reset_tabs(s);
 	}
 
-	if (sy != screen_size_y(s))
+	if (sy != screen_size_y(s)) {
 		screen_resize_y(s, sy);
 
+		free(s->dirty);
+		if ((s->dirty = bit_alloc(sy)) == NULL)
+			fatal("bit_alloc failed");
+		bit_nset(s->dirty, 0, sy - 1);
+	}
+
 	if (reflow)
 		screen_reflow(s, sx);
 }
@@ -207,8 +234,7 @@ screen_resize_y(struct screen *s, u_int sy)
 	}
 
 	/* Resize line arrays. */
-	gd->linedata = xreallocarray(gd->linedata, gd->hsize + sy,
-	    sizeof *gd->linedata);
+	grid_resize_lines(gd, gd->hsize + sy);
 
 	/* Size increasing. */
 	if (sy > oldy) {
@@ -216,12 +242,15 @@ screen_resize_y(struct screen *s, u_int sy)
 
 		/*
 		 * Try to pull as much as possible out of the history, if is
-		 * is enabled.
+		 * is enabled. Lines still waiting to be reflowed must not
+		 * become visible.
 		 */
+		grid_reflow_history_last(gd, needed);
 		available = gd->hsize;
 		if (gd->flags & GRID_HISTORY && available > 0) {
 			if (available > needed)
 				available = needed;
+			grid_cache_drop(gd, gd->hsize - available);
 			gd->hsize -= available;
 			s->cy += available;
 		} else
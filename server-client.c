@@ -36,6 +36,9 @@ void		server_client_check_focus(struct window_pane *);
 void		server_client_check_resize(struct window_pane *);
 key_code	server_client_check_mouse(struct client *);
 void		server_client_repeat_timer(int, short, void *);
+void		server_client_frame_timer(int, short, void *);
+void		server_client_status_timer(int, short, void *);
+void		server_client_check_status(void);
 void		server_client_check_exit(struct client *);
 void		server_client_check_redraw(struct client *);
 void		server_client_set_title(struct client *);
@@ -47,6 +50,13 @@ void		server_client_dispatch_command(struct client *, struct imsg *);
 void		server_client_dispatch_identify(struct client *, struct imsg *);
 void		server_client_dispatch_shell(struct client *);
 
+/*
+ * Set when no client is attached with a terminal, as when tmate is run with -F
+ * and only shared. Nothing is drawn then, the grids are only kept up to date,
+ * for the tmate snapshots and for the redraw when a client attaches.
+ */
+int	server_headless;
+
 /* Check if this client is inside this server. */
 int
 server_client_check_nested(struct client *c)
@@ -75,6 +85,14 @@ server_client_set_key_table(struct client *c, const char *name)
 	if (name == NULL)
 		name = server_client_get_key_table(c);
 
+	/*
+	 * Most keys put the client back in the table it is already in, which
+	 * does not need to be looked up again. Unless it has been removed
+	 * since: then new bindings go into a new table with the same name.
+	 */
+	if (!c->keytable->removed && strcmp(c->keytable->name, name) == 0)
+		return;
+
 	key_bindings_unref_table(c->keytable);
 	c->keytable = key_bindings_get_table(name, 1);
 	c->keytable->references++;
@@ -147,6 +165,7 @@ server_client_create(int fd)
 	c->keytable->references++;
 
 	evtimer_set(&c->repeat_timer, server_client_repeat_timer, c);
+	evtimer_set(&c->frame_timer, server_client_frame_timer, c);
 
 	TAILQ_INSERT_TAIL(&clients, c, entry);
 	log_debug("new client %p", c);
@@ -205,15 +224,16 @@ server_client_lost(struct client *c)
 	evbuffer_free(c->stdout_data);
 	if (c->stderr_data != c->stdout_data)
 		evbuffer_free(c->stderr_data);
+	free(c->control_paused);
 
-	if (event_initialized(&c->status_timer))
-		evtimer_del(&c->status_timer);
 	screen_free(&c->status);
+	free(c->border_cells);
 
 	free(c->title);
 	free((void *)c->cwd);
 
 	evtimer_del(&c->repeat_timer);
+	evtimer_del(&c->frame_timer);
 
 	key_bindings_unref_table(c->keytable);
 
@@ -586,7 +606,7 @@ server_client_handle_key(struct client *c, key_code key)
 	struct window_pane	*wp;
 	struct timeval		 tv;
 	struct key_table	*table;
-	struct key_binding	 bd_find, *bd;
+	struct key_binding	*bd;
 	int			 xtimeout;
 
 	/* Check the client is good to accept input. */
@@ -647,8 +667,7 @@ server_client_handle_key(struct client *c, key_code key)
 
 retry:
 	/* Try to see if there is a key binding in the current table. */
-	bd_find.key = key;
-	bd = RB_FIND(key_bindings, &c->keytable->key_bindings, &bd_find);
+	bd = key_bindings_find(c->keytable, key);
 	if (bd != NULL) {
 		/*
 		 * Key was matched in this table. If currently repeating but a
@@ -733,20 +752,93 @@ forward:
 		window_pane_key(wp, c, s, key, m);
 }
 
+/*
+ * Find the pane pasted text from a client can be written straight to, if
+ * nothing would have come between the keys and the pane: this is a bracketed
+ * paste, or assume-paste-time has already decided the keys before it are being
+ * pasted. Returns NULL if it should be handled as keys.
+ */
+struct window_pane *
+server_client_paste_pane(struct client *c, int flags)
+{
+	struct session		*s = c->session;
+	struct window_pane	*wp;
+	struct timeval		 now, tv;
+	int			 t;
+
+	/* Check the client and pane are good to take the text as is. */
+	if (s == NULL || (c->flags & (CLIENT_DEAD|CLIENT_SUSPENDED)) != 0)
+		return (NULL);
+	if (c->flags & (CLIENT_READONLY|CLIENT_IDENTIFY))
+		return (NULL);
+	if (c->prompt_string != NULL)
+		return (NULL);
+	wp = s->curw->window->active;
+	if (wp == NULL || wp->mode != NULL)
+		return (NULL);
+	if (wp->fd == -1 || wp->flags & PANE_INPUTOFF)
+		return (NULL);
+
+	/*
+	 * Without brackets, only take over once server_client_assume_paste has
+	 * started treating keys as pasted, so the first key still goes through
+	 * the key bindings.
+	 */
+	if (~flags & PASTE_BRACKETED) {
+		if (~s->flags & SESSION_PASTING)
+			return (NULL);
+		t = options_get_number(s->options, "assume-paste-time");
+		if (t == 0)
+			return (NULL);
+		if (gettimeofday(&now, NULL) != 0)
+			fatal("gettimeofday failed");
+		timersub(&now, &s->activity_time, &tv);
+		if (tv.tv_sec != 0 || tv.tv_usec >= t * 1000)
+			return (NULL);
+	}
+	return (wp);
+}
+
+/* Write pasted text from a client to the pane found for it. */
+void
+server_client_handle_paste(struct client *c, struct window_pane *wp,
+    const char *buf, size_t len, int flags)
+{
+	struct session	*s = c->session;
+
+	/* Update the activity timer. */
+	if (gettimeofday(&c->activity_time, NULL) != 0)
+		fatal("gettimeofday failed");
+	session_update_activity(s, &c->activity_time);
+
+#ifdef TMATE
+	if (!(c->flags & CLIENT_FORCE_STATUS))
+#endif
+	status_message_clear(c);
+
+	log_debug("%s: %zu bytes to %%%u", __func__, len, wp->id);
+	window_pane_paste(wp, buf, len, flags);
+}
+
 /* Client functions that need to happen every loop. */
 void
 server_client_loop(void)
 {
 	struct client		*c;
-	struct window		*w;
+	struct window		*w, *last;
 	struct window_pane	*wp;
 #ifdef TMATE
 	int tmate_should_sync_layout = 0;
 #endif
 
+	status_generation++;
+	if (!server_headless)
+		server_client_check_status();
 	TAILQ_FOREACH(c, &clients, entry) {
 		server_client_check_exit(c);
 		if (c->session != NULL) {
+			c->frame_rate = options_get_number(c->session->options,
+			    "max-frame-rate");
 			server_client_check_redraw(c);
 			server_client_reset_state(c);
 		}
@@ -754,31 +846,135 @@ server_client_loop(void)
 
 	/*
 	 * Any windows will have been redrawn as part of clients, so clear
-	 * their flags now. Also check pane focus and resize.
+	 * their flags now. Also check pane focus and resize. Only windows
+	 * queued since last time can have anything to do. A window with a
+	 * status redraw still to come or dirty lines held for a client is
+	 * queued again for next time.
 	 */
-	RB_FOREACH(w, windows, &windows) {
+	last = TAILQ_LAST(&dirty_windows, windows_dirty);
+	while (last != NULL) {
+		w = TAILQ_FIRST(&dirty_windows);
+		TAILQ_REMOVE(&dirty_windows, w, dirty_entry);
+		w->dirty_queued = 0;
+		if (w == last)
+			last = NULL;
 #ifdef TMATE
-		if (w->flags & WINDOW_REDRAW)
+		if (w->flags & (WINDOW_REDRAW|WINDOW_LAYOUT))
 			tmate_should_sync_layout = 1;
 		if (w->tmate_last_sync_active_pane != w->active)
 			tmate_should_sync_layout = 1;
 #endif
 
-		w->flags &= ~WINDOW_REDRAW;
+		w->flags &= ~(WINDOW_REDRAW|WINDOW_LAYOUT);
 		TAILQ_FOREACH(wp, &w->panes, entry) {
 			if (wp->fd != -1) {
 				server_client_check_focus(wp);
 				server_client_check_resize(wp);
 			}
-			wp->flags &= ~PANE_REDRAW;
+			/* Keep the dirty lines for clients waiting to draw. */
+			if (wp->flags & PANE_HELD) {
+				wp->flags &= ~(PANE_REDRAW|PANE_HELD);
+				window_enqueue(w);
+			} else {
+				if (wp->flags & PANE_DIRTY)
+					screen_clear_dirty(wp->screen);
+				wp->flags &= ~(PANE_REDRAW|PANE_DIRTY);
+			}
 		}
 		check_window_name(w);
+#ifdef TMATE
+		/* Renames from the pane wait for its status redraw. */
+		if ((w->flags & (WINDOW_RENAMED|WINDOW_STATUS)) ==
+		    WINDOW_RENAMED) {
+			w->flags &= ~WINDOW_RENAMED;
+			tmate_should_sync_layout = 1;
+		}
+#endif
+		if (w->flags & WINDOW_STATUS)
+			window_enqueue(w);
 	}
 
 #ifdef TMATE
 	if (tmate_should_sync_layout)
 		tmate_sync_layout();
 #endif
+
+	/* Hand what was drawn this time round to the ttys. */
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (c->tty.olen != 0)
+			tty_flush(&c->tty);
+	}
+
+	server_client_check_headless();
+}
+
+/*
+ * Check if any client is attached with a terminal. A client attaching in the
+ * meantime is redrawn entirely, so nothing it missed matters.
+ */
+void
+server_client_check_headless(void)
+{
+	struct client	*c;
+
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (c->session != NULL && c->tty.term != NULL) {
+			server_headless = 0;
+			return;
+		}
+	}
+	if (!server_headless)
+		log_debug("no clients attached, not drawing");
+	server_headless = 1;
+}
+
+/* Status timer callback. */
+void
+server_client_status_timer(__unused int fd, __unused short events,
+    __unused void *data)
+{
+	/* The event loop will call server_client_check_status on the way out. */
+}
+
+/*
+ * Redraw the status of windows whose title or name was changed by their panes.
+ * This is done once per loop, and at most every WINDOW_STATUS_INTERVAL for
+ * each window, so titles changing many times a second are not all drawn.
+ */
+void
+server_client_check_status(void)
+{
+	static struct event	 status_timer;
+	struct window		*w;
+	struct timeval		 now, offset, tv;
+	int			 pending = 0;
+
+	gettimeofday(&now, NULL);
+	TAILQ_FOREACH(w, &dirty_windows, dirty_entry) {
+		if (~w->flags & WINDOW_STATUS)
+			continue;
+
+		timersub(&now, &w->status_time, &offset);
+		if (offset.tv_sec == 0 &&
+		    offset.tv_usec < WINDOW_STATUS_INTERVAL) {
+			pending = 1;
+			continue;
+		}
+
+		w->flags &= ~WINDOW_STATUS;
+		w->status_time = now;
+		server_status_window(w);
+	}
+
+	if (!pending)
+		return;
+	if (!event_initialized(&status_timer))
+		evtimer_set(&status_timer, server_client_status_timer, NULL);
+	if (!evtimer_pending(&status_timer, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = WINDOW_STATUS_INTERVAL;
+		evtimer_add(&status_timer, &tv);
+	}
 }
 
 /* Check if pane should be resized. */
@@ -914,6 +1110,34 @@ server_client_reset_state(struct client *c)
 	tty_reset(&c->tty);
 }
 
+/*
+ * Start a frame: until it ends, pane output is not written to the client but
+ * left in the dirty lines of the pane, to be drawn together when it does.
+ */
+void
+server_client_start_frame(struct client *c)
+{
+	struct timeval	tv;
+
+	if (c->frame_rate == 0 || (c->flags & CLIENT_FRAME))
+		return;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000000 / c->frame_rate;
+	evtimer_del(&c->frame_timer);
+	evtimer_add(&c->frame_timer, &tv);
+	c->flags |= CLIENT_FRAME;
+}
+
+/* Frame timer callback. */
+void
+server_client_frame_timer(__unused int fd, __unused short events, void *data)
+{
+	struct client	*c = data;
+
+	c->flags &= ~CLIENT_FRAME;
+}
+
 /* Repeat time callback. */
 void
 server_client_repeat_timer(__unused int fd, __unused short events, void *data)
@@ -956,6 +1180,7 @@ server_client_check_redraw(struct client *c)
 
 	if (c->flags & (CLIENT_CONTROL|CLIENT_SUSPENDED))
 		return;
+	PROBE1(client_check_redraw, c->flags);
 
 	if (c->flags & (CLIENT_REDRAW|CLIENT_STATUS)) {
 		if (options_get_number(s->options, "set-titles"))
@@ -975,10 +1200,12 @@ server_client_check_redraw(struct client *c)
 	tty->flags = (tty->flags & ~TTY_FREEZE) | TTY_NOCURSOR;
 
 	if (c->flags & CLIENT_REDRAW) {
+		tty_sync_start(tty);
 		tty_update_mode(tty, tty->mode, NULL);
 		screen_redraw_screen(c, 1, 1, 1);
 		c->flags &= ~(CLIENT_STATUS|CLIENT_BORDERS);
 	} else if (c->flags & CLIENT_REDRAWWINDOW) {
+		tty_sync_start(tty);
 		tty_update_mode(tty, tty->mode, NULL);
 		TAILQ_FOREACH(wp, &c->session->curw->window->panes, entry)
 			screen_redraw_pane(c, wp);
@@ -986,24 +1213,39 @@ server_client_check_redraw(struct client *c)
 	} else {
 		TAILQ_FOREACH(wp, &c->session->curw->window->panes, entry) {
 			if (wp->flags & PANE_REDRAW) {
+				tty_sync_start(tty);
 				tty_update_mode(tty, tty->mode, NULL);
 				screen_redraw_pane(c, wp);
+			} else if (wp->flags & PANE_DIRTY) {
+				if ((c->flags & CLIENT_FRAME) ||
+				    (wp->flags & PANE_SYNC)) {
+					wp->flags |= PANE_HELD;
+					window_enqueue(wp->window);
+					continue;
+				}
+				tty_sync_start(tty);
+				tty_update_mode(tty, tty->mode, NULL);
+				screen_redraw_pane_dirty(c, wp);
+				server_client_start_frame(c);
 			}
 		}
 	}
 
 	if (c->flags & CLIENT_BORDERS) {
+		tty_sync_start(tty);
 		tty_update_mode(tty, tty->mode, NULL);
 		screen_redraw_screen(c, 0, 0, 1);
 	}
 
 	if (c->flags & CLIENT_STATUS) {
+		tty_sync_start(tty);
 		tty_update_mode(tty, tty->mode, NULL);
 		screen_redraw_screen(c, 0, 1, 0);
 	}
 
 	tty->flags = (tty->flags & ~(TTY_FREEZE|TTY_NOCURSOR)) | flags;
 	tty_update_mode(tty, tty->mode, NULL);
+	tty_sync_end(tty);
 
 	c->flags &= ~(CLIENT_REDRAW|CLIENT_BORDERS|CLIENT_STATUS|
 	    CLIENT_STATUSFORCE);
@@ -1042,6 +1284,7 @@ server_client_dispatch(struct imsg *imsg, void *arg)
 	struct msg_stdin_data	 stdindata;
 	const char		*data;
 	ssize_t			 datalen;
+	size_t			 stdiolen;
 	struct session		*s;
 
 	if (c->flags & CLIENT_DEAD)
@@ -1070,9 +1313,14 @@ server_client_dispatch(struct imsg *imsg, void *arg)
 		server_client_dispatch_command(c, imsg);
 		break;
 	case MSG_STDIN:
-		if (datalen != sizeof stdindata)
+		if (datalen < 0)
+			fatalx("bad MSG_STDIN size");
+		stdiolen = datalen;
+		if (stdiolen < MSG_STDIO_LEN(0) || stdiolen > sizeof stdindata)
+			fatalx("bad MSG_STDIN size");
+		memcpy(&stdindata, data, stdiolen);
+		if (stdiolen != MSG_STDIO_LEN(stdindata.size))
 			fatalx("bad MSG_STDIN size");
-		memcpy(&stdindata, data, sizeof stdindata);
 
 		if (c->stdin_callback == NULL)
 			break;
@@ -1327,6 +1575,17 @@ server_client_stdout_cb(__unused int fd, __unused short events, void *arg)
 	server_client_unref(c);
 }
 
+/*
+ * Push stdout to client from the event loop, so what is written meanwhile is
+ * sent together.
+ */
+void
+server_client_push_stdout_later(struct client *c)
+{
+	c->references++;
+	event_once(-1, EV_TIMEOUT, server_client_stdout_cb, c, NULL);
+}
+
 /* Push stdout to client if possible. */
 void
 server_client_push_stdout(struct client *c)
@@ -1339,10 +1598,11 @@ server_client_push_stdout(struct client *c)
 		sent = left;
 		if (sent > sizeof data.data)
 			sent = sizeof data.data;
-		memcpy(data.data, EVBUFFER_DATA(c->stdout_data), sent);
+		evbuffer_copyout(c->stdout_data, data.data, sent);
 		data.size = sent;
 
-		if (proc_send(c->peer, MSG_STDOUT, -1, &data, sizeof data) != 0)
+		if (proc_send(c->peer, MSG_STDOUT, -1, &data,
+		    MSG_STDIO_LEN(sent)) != 0)
 			break;
 		evbuffer_drain(c->stdout_data, sent);
 
@@ -1385,10 +1645,11 @@ server_client_push_stderr(struct client *c)
 		sent = left;
 		if (sent > sizeof data.data)
 			sent = sizeof data.data;
-		memcpy(data.data, EVBUFFER_DATA(c->stderr_data), sent);
+		evbuffer_copyout(c->stderr_data, data.data, sent);
 		data.size = sent;
 
-		if (proc_send(c->peer, MSG_STDERR, -1, &data, sizeof data) != 0)
+		if (proc_send(c->peer, MSG_STDERR, -1, &data,
+		    MSG_STDIO_LEN(sent)) != 0)
 			break;
 		evbuffer_drain(c->stderr_data, sent);
 
@@ -117,6 +117,7 @@ server_redraw_window(struct window *w)
 			server_redraw_client(c);
 	}
 	w->flags |= WINDOW_REDRAW;
+	window_enqueue(w);
 }
 
 void
@@ -300,14 +301,8 @@ server_destroy_pane(struct window_pane *wp, int hooks)
 	struct cmd_find_state	 fs;
 
 	old_fd = wp->fd;
-	if (wp->fd != -1) {
-#ifdef HAVE_UTEMPTER
-		utempter_remove_record(wp->fd);
-#endif
-		bufferevent_free(wp->event);
-		close(wp->fd);
-		wp->fd = -1;
-	}
+	window_pane_close(wp);
+	window_pane_paste_cancel(wp);
 
 	if (options_get_number(w->options, "remain-on-exit")) {
 		if (old_fd == -1)
@@ -321,6 +316,7 @@ server_destroy_pane(struct window_pane *wp, int hooks)
 		screen_write_puts(&ctx, &gc, "Pane is dead");
 		screen_write_stop(&ctx);
 		wp->flags |= PANE_REDRAW;
+		window_enqueue(wp->window);
 
 		if (hooks && cmd_find_from_pane(&fs, wp) == 0)
 			hooks_run(hooks_get(fs.s), NULL, &fs, "pane-died");
@@ -163,6 +163,10 @@ server_start(struct event_base *base, int lockfd, char *lockfile)
 	}
 
 	close(pair[0]);
+	log_startup("server started");
+
+	if (event_base_priority_init(base, EVENT_PRIORITIES) != 0)
+		fatalx("event_base_priority_init failed");
 
 	if (log_get_level() > 3)
 		tty_create_log();
@@ -182,9 +186,11 @@ server_start(struct event_base *base, int lockfd, char *lockfile)
 
 #ifdef TMATE
 	tmate_session_init(base);
+	log_startup("tmate session initialized");
 #endif
 
 	key_bindings_init();
+	log_startup("default key bindings added");
 
 	gettimeofday(&start_time, NULL);
 
@@ -192,6 +198,7 @@ server_start(struct event_base *base, int lockfd, char *lockfile)
 	if (server_fd == -1)
 		fatal("couldn't create socket");
 	server_update_socket();
+	log_startup("socket created");
 	if (!tmate_foreground)
 		server_client_create(pair[1]);
 
@@ -202,12 +209,11 @@ server_start(struct event_base *base, int lockfd, char *lockfile)
 	}
 
 #ifdef TMATE
+	tmate_exec_cmds_begin();
 	tmate_set_editor_mode();
 #endif
 	start_cfg();
 
-	status_prompt_load_history();
-
 	server_add_accept(0);
 
 	if (tmate_foreground)
@@ -227,8 +233,16 @@ int
 server_loop(void)
 {
 	struct client	*c;
+	struct timeval	 start;
+	u_int		 n = 0;
 
+	TAILQ_FOREACH(c, &clients, entry)
+		n++;
+	watchdog_start(&start);
 	server_client_loop();
+	watchdog_stop(WATCHDOG_CLIENT_LOOP, &start, "%u clients", n);
+	window_check_history_memory();
+	window_pane_reset_budget();
 
 	if (!options_get_number(global_options, "exit-unattached")) {
 		if (!RB_EMPTY(&sessions))
@@ -429,6 +443,7 @@ server_child_exited(pid_t pid, int status)
 			}
 		}
 	}
+	spawn_pool_exited(pid);
 
 	LIST_FOREACH(job, &all_jobs, lentry) {
 		if (pid == job->pid) {
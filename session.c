@@ -198,6 +198,7 @@ session_free(__unused int fd, __unused short events, void *arg)
 
 	if (s->references == 0) {
 		environ_free(s->environ);
+		job_free_environ(s->job_environ);
 
 		options_free(s->options);
 		hooks_free(s->hooks);
@@ -264,6 +265,7 @@ session_destroy(struct session *s)
 	}
 
 	free((void *)s->cwd);
+	status_cache_free(s);
 
 	session_unref(s);
 
@@ -458,13 +460,32 @@ session_detach(struct session *s, struct winlink *wl)
 int
 session_has(struct session *s, struct window *w)
 {
-	struct winlink	*wl;
+	return (winlink_find_by_window(&s->windows, w) != NULL);
+}
+
+/* Get the memory used by the panes in a session. */
+size_t
+session_memory(struct session *s)
+{
+	struct winlink		*wl, *wl1;
+	struct window_pane	*wp;
+	size_t			 size = 0;
 
 	RB_FOREACH(wl, winlinks, &s->windows) {
-		if (wl->window == w)
-			return (1);
+		/* Count windows linked more than once only once. */
+		RB_FOREACH(wl1, winlinks, &s->windows) {
+			if (wl1 == wl || wl1->window == wl->window)
+				break;
+		}
+		if (wl1 != wl)
+			continue;
+
+		TAILQ_FOREACH(wp, &wl->window->panes, entry) {
+			size += window_pane_grid_memory(wp);
+			size += window_pane_buffer_memory(wp);
+		}
 	}
-	return (0);
+	return (size);
 }
 
 /*
@@ -577,10 +598,14 @@ session_set_current(struct session *s, struct winlink *wl)
 	if (wl == s->curw)
 		return (1);
 
+	if (s->curw != NULL)
+		window_enqueue(s->curw->window);
 	winlink_stack_remove(&s->lastw, wl);
 	winlink_stack_push(&s->lastw, s->curw);
 	s->curw = wl;
 	winlink_clear_flags(wl);
+	window_enqueue(wl->window);
+	recalculate_pending(wl->window);
 
 #ifdef TMATE
 	tmate_sync_layout();
@@ -0,0 +1,293 @@
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "tmux.h"
+
+/*
+ * A pool of shells started ahead of time, so a new pane does not wait for a
+ * slow login shell to read its startup files. With shell-pool set, the pool
+ * holds shells like the last pane spawned: the same shell, command, working
+ * directory, environment and terminal settings. A new pane with all of those
+ * the same takes a shell from the pool, which was started with the pane id it
+ * is now given in TMUX_PANE, and the pool is filled again in the background,
+ * a shell each time round the event loop. Anything else empties the pool and
+ * starts it again for the new pane.
+ *
+ * Only panes running a login shell or default-command use the pool. A pane
+ * being respawned already has an id, so it cannot take one from the pool.
+ */
+
+#define SPAWN_POOL_DELAY 10000	/* us between shells */
+
+struct spawn_pool_shell {
+	u_int		 id;
+	pid_t		 pid;
+	int		 fd;
+	char		 tty[TTY_NAME_MAX];
+
+	TAILQ_ENTRY(spawn_pool_shell) entry;
+};
+static TAILQ_HEAD(spawn_pool_shells, spawn_pool_shell) spawn_pool =
+    TAILQ_HEAD_INITIALIZER(spawn_pool);
+static u_int	spawn_pool_count;
+
+/* What the shells in the pool are started with. */
+static struct {
+	uint64_t	 key;
+	int		 argc;
+	char	       **argv;
+	char		*path;
+	char		*shell;
+	char		*cwd;
+	struct environ	*env;
+	struct termios	 tio;
+	int		 has_tio;
+} spawn_pool_template;
+
+static struct event	spawn_pool_timer;
+
+static int	spawn_pool_wanted(struct window_pane *);
+static uint64_t	spawn_pool_hash(uint64_t, const char *);
+static uint64_t	spawn_pool_key(struct window_pane *, const char *,
+		    struct environ *, struct termios *);
+static void	spawn_pool_save(struct window_pane *, uint64_t, const char *,
+		    struct environ *, struct termios *);
+static void	spawn_pool_remove(struct spawn_pool_shell *);
+static void	spawn_pool_kill(struct spawn_pool_shell *);
+static void	spawn_pool_schedule(void);
+static void	spawn_pool_callback(int, short, void *);
+
+/* Whether a pane runs what the pool has: a login shell or default-command. */
+static int
+spawn_pool_wanted(struct window_pane *wp)
+{
+	const char	*cmd;
+
+	if (wp->argc == 0)
+		return (1);
+	cmd = options_get_string(global_s_options, "default-command");
+	return (wp->argc == 1 && *cmd != '\0' && strcmp(wp->argv[0], cmd) == 0);
+}
+
+static uint64_t
+spawn_pool_hash(uint64_t h, const char *s)
+{
+	if (s == NULL)
+		return (status_hash(h, "", 1));
+	return (status_hash(h, s, strlen(s) + 1));
+}
+
+/* Hash of everything that makes a shell from the pool the same as a new one. */
+static uint64_t
+spawn_pool_key(struct window_pane *wp, const char *path, struct environ *env,
+    struct termios *tio)
+{
+	struct environ_entry	*envent;
+	uint64_t		 h;
+	int			 i;
+
+	h = spawn_pool_hash(0, wp->shell);
+	h = spawn_pool_hash(h, wp->cwd);
+	h = spawn_pool_hash(h, path);
+	for (i = 0; i < wp->argc; i++)
+		h = spawn_pool_hash(h, wp->argv[i]);
+	for (envent = environ_first(env); envent != NULL;
+	    envent = environ_next(envent)) {
+		h = spawn_pool_hash(h, envent->name);
+		h = spawn_pool_hash(h, envent->value);
+	}
+	if (tio != NULL)
+		h = status_hash(h, tio->c_cc, sizeof tio->c_cc);
+	return (h);
+}
+
+/* Keep what a pane was spawned with to start the shells of the pool. */
+static void
+spawn_pool_save(struct window_pane *wp, uint64_t key, const char *path,
+    struct environ *env, struct termios *tio)
+{
+	cmd_free_argv(spawn_pool_template.argc, spawn_pool_template.argv);
+	free(spawn_pool_template.path);
+	free(spawn_pool_template.shell);
+	free(spawn_pool_template.cwd);
+	if (spawn_pool_template.env != NULL)
+		environ_free(spawn_pool_template.env);
+
+	spawn_pool_template.key = key;
+	spawn_pool_template.argc = wp->argc;
+	spawn_pool_template.argv = cmd_copy_argv(wp->argc, wp->argv);
+	spawn_pool_template.path = path == NULL ? NULL : xstrdup(path);
+	spawn_pool_template.shell = xstrdup(wp->shell);
+	spawn_pool_template.cwd = xstrdup(wp->cwd);
+	spawn_pool_template.env = environ_create();
+	environ_copy(env, spawn_pool_template.env);
+	spawn_pool_template.has_tio = tio != NULL;
+	if (tio != NULL)
+		memcpy(&spawn_pool_template.tio, tio, sizeof *tio);
+}
+
+/* Take a shell out of the pool and free it. */
+static void
+spawn_pool_remove(struct spawn_pool_shell *sps)
+{
+	TAILQ_REMOVE(&spawn_pool, sps, entry);
+	spawn_pool_count--;
+
+	close(sps->fd);
+	free(sps);
+}
+
+/* Throw away a shell which is still running. */
+static void
+spawn_pool_kill(struct spawn_pool_shell *sps)
+{
+	kill(sps->pid, SIGHUP);
+	spawn_pool_remove(sps);
+}
+
+/* Throw away the shells in the pool. */
+void
+spawn_pool_clear(void)
+{
+	struct spawn_pool_shell	*sps, *sps1;
+
+	TAILQ_FOREACH_SAFE(sps, &spawn_pool, entry, sps1)
+		spawn_pool_kill(sps);
+}
+
+/* The shell-pool option has changed, trim the pool or fill it to the size. */
+void
+spawn_pool_update(void)
+{
+	if (options_get_number(global_options, "shell-pool") == 0)
+		spawn_pool_clear();
+	else
+		spawn_pool_schedule();
+}
+
+/*
+ * A shell in the pool has exited, before any pane took it. It has been
+ * reaped, so the pid may be another process by now and is not signalled.
+ */
+void
+spawn_pool_exited(pid_t pid)
+{
+	struct spawn_pool_shell	*sps;
+
+	TAILQ_FOREACH(sps, &spawn_pool, entry) {
+		if (sps->pid == pid) {
+			log_debug("pool shell %%%u exited", sps->id);
+			spawn_pool_remove(sps);
+			return;
+		}
+	}
+}
+
+/*
+ * Give a pane a shell from the pool. Returns 0 if it has one, with the pty
+ * resized to the pane, or -1 if it should be spawned as usual.
+ */
+int
+spawn_pool_take(struct window_pane *wp, const char *path, struct environ *env,
+    struct termios *tio, struct winsize *ws)
+{
+	struct spawn_pool_shell	*sps;
+	uint64_t		 key;
+
+	if (options_get_number(global_options, "shell-pool") == 0) {
+		spawn_pool_clear();
+		return (-1);
+	}
+	if (wp->pid != 0 || !spawn_pool_wanted(wp))
+		return (-1);
+
+	key = spawn_pool_key(wp, path, env, tio);
+	if (spawn_pool_template.env == NULL ||
+	    key != spawn_pool_template.key) {
+		spawn_pool_clear();
+		spawn_pool_save(wp, key, path, env, tio);
+		spawn_pool_schedule();
+		return (-1);
+	}
+	spawn_pool_schedule();
+
+	while ((sps = TAILQ_FIRST(&spawn_pool)) != NULL) {
+		if (ioctl(sps->fd, TIOCSWINSZ, ws) == 0)
+			break;
+		spawn_pool_kill(sps);
+	}
+	if (sps == NULL)
+		return (-1);
+	TAILQ_REMOVE(&spawn_pool, sps, entry);
+	spawn_pool_count--;
+
+	log_debug("pane %%%u is pool shell %%%u (pid %ld)", wp->id, sps->id,
+	    (long)sps->pid);
+	window_pane_set_id(wp, sps->id);
+	wp->pid = sps->pid;
+	wp->fd = sps->fd;
+	memcpy(wp->tty, sps->tty, sizeof wp->tty);
+	free(sps);
+	return (0);
+}
+
+static void
+spawn_pool_schedule(void)
+{
+	struct timeval	tv = { .tv_sec = 0, .tv_usec = SPAWN_POOL_DELAY };
+
+	if (!event_initialized(&spawn_pool_timer)) {
+		evtimer_set(&spawn_pool_timer, spawn_pool_callback, NULL);
+		event_priority_set(&spawn_pool_timer, EVENT_PRI_BACKGROUND);
+	}
+	if (!evtimer_pending(&spawn_pool_timer, NULL))
+		evtimer_add(&spawn_pool_timer, &tv);
+}
+
+/* Start one more shell for the pool, or throw some away if it is too big. */
+static void
+spawn_pool_callback(__unused int fd, __unused short events,
+    __unused void *data)
+{
+	struct spawn_pool_shell	*sps;
+	struct winsize		 ws;
+	u_int			 size;
+
+	size = options_get_number(global_options, "shell-pool");
+	while (spawn_pool_count > size)
+		spawn_pool_kill(TAILQ_LAST(&spawn_pool, spawn_pool_shells));
+	if (spawn_pool_count == size || spawn_pool_template.env == NULL)
+		return;
+
+	memset(&ws, 0, sizeof ws);
+	ws.ws_col = 80;
+	ws.ws_row = 24;
+
+	sps = xcalloc(1, sizeof *sps);
+	sps->id = next_window_pane_id++;
+	switch (sps->pid = forkpty(&sps->fd, sps->tty, NULL, &ws)) {
+	case -1:
+		log_debug("pool shell: %s", strerror(errno));
+		free(sps);
+		return;
+	case 0:
+		window_pane_exec(sps->id, spawn_pool_template.argc,
+		    spawn_pool_template.argv, spawn_pool_template.path,
+		    spawn_pool_template.shell, spawn_pool_template.cwd,
+		    spawn_pool_template.env, spawn_pool_template.has_tio ?
+		    &spawn_pool_template.tio : NULL);
+	}
+	log_debug("pool shell %%%u started (pid %ld)", sps->id, (long)sps->pid);
+
+	TAILQ_INSERT_TAIL(&spawn_pool, sps, entry);
+	spawn_pool_count++;
+	if (spawn_pool_count < size)
+		spawn_pool_schedule();
+}
@@ -34,26 +34,71 @@ char   *status_redraw_get_left(struct client *, time_t, struct grid_cell *,
 	    size_t *);
 char   *status_redraw_get_right(struct client *, time_t, struct grid_cell *,
 	    size_t *);
+int	status_print_cached(const char *);
+uint64_t status_print_key(struct client *, struct winlink *,
+	    struct grid_cell *);
 char   *status_print(struct client *, struct winlink *, time_t,
 	    struct grid_cell *);
 char   *status_replace(struct client *, struct winlink *, const char *, time_t);
+void	status_redraw_dirty(struct client *, struct screen *);
+int	status_redraw_client(struct client *);
+int	status_redraw_shared(struct client *);
+struct status_cache *status_cache_find(struct session *, u_int, u_int);
+int	status_cache_load(struct client *, struct status_cache *);
+void	status_cache_save(struct status_cache *, struct client *);
 void	status_message_callback(int, short, void *);
 void	status_timer_callback(int, short, void *);
+void	status_timer_next(struct client *, struct timeval *);
+void	status_timer_schedule(void);
 
 const char *status_prompt_up_history(u_int *);
 const char *status_prompt_down_history(u_int *);
+int	status_prompt_add_history1(const char *);
 void	status_prompt_add_history(const char *);
 
+int	status_prompt_complete_cmp(const void *, const void *);
+void	status_prompt_complete_index(void);
 const char **status_prompt_complete_list(u_int *, const char *);
+struct session *status_prompt_complete_session(const char *);
 char   *status_prompt_complete_prefix(const char **, u_int);
 char   *status_prompt_complete(struct session *, const char *);
 
 char   *status_prompt_find_history_file(void);
+void	status_prompt_load_history(void);
+void	status_prompt_write_history(void);
+void	status_prompt_history_callback(int, short, void *);
 
-/* Status prompt history. */
+/*
+ * Bumped on each server loop. A shared status line is only used by other
+ * clients in the loop it was drawn.
+ */
+u_int	status_generation;
+
+/*
+ * One timer for the status-interval redraws of all clients. Redraws are due on
+ * multiples of the interval, so clients with the same interval are drawn in
+ * the same loop and can share the status line.
+ */
+struct event	status_timer_event;
+
+/*
+ * Status prompt history. The history file is a log: lines are appended to it
+ * as they are added, a second after the last one, and it is only written
+ * again from the history in memory once it has PROMPT_HISTORY_COMPACT lines.
+ * It is loaded the first time the history is used.
+ */
 #define PROMPT_HISTORY 100
-char	**status_prompt_hlist;
-u_int	  status_prompt_hsize;
+#define PROMPT_HISTORY_COMPACT (PROMPT_HISTORY * 4)
+char		**status_prompt_hlist;
+u_int		  status_prompt_hsize;
+int		  status_prompt_hloaded;
+u_int		  status_prompt_hlines;
+struct evbuffer	 *status_prompt_hpending;
+struct event	  status_prompt_hevent;
+
+/* Sorted command and option names and layouts, for completion. */
+const char	**status_prompt_complete_names;
+u_int		  status_prompt_complete_nnames;
 
 /* Find the history file to load/save from/to. */
 char *
@@ -84,6 +129,10 @@ status_prompt_load_history(void)
 	char	*history_file, *line, *tmp;
 	size_t	 length;
 
+	if (status_prompt_hloaded)
+		return;
+	status_prompt_hloaded = 1;
+
 	if ((history_file = status_prompt_find_history_file()) == NULL)
 		return;
 	log_debug("loading history from %s", history_file);
@@ -101,14 +150,15 @@ status_prompt_load_history(void)
 			break;
 
 		if (length > 0) {
+			status_prompt_hlines++;
 			if (line[length - 1] == '\n') {
 				line[length - 1] = '\0';
-				status_prompt_add_history(line);
+				status_prompt_add_history1(line);
 			} else {
 				tmp = xmalloc(length + 1);
 				memcpy(tmp, line, length);
 				tmp[length] = '\0';
-				status_prompt_add_history(tmp);
+				status_prompt_add_history1(tmp);
 				free(tmp);
 			}
 		}
@@ -116,56 +166,134 @@ status_prompt_load_history(void)
 	fclose(f);
 }
 
-/* Save status prompt history to file. */
+/*
+ * Append the lines added since the last write to the history file, or write
+ * the history out again if the file has grown too long.
+ */
 void
-status_prompt_save_history(void)
+status_prompt_write_history(void)
 {
-	FILE	*f;
-	u_int	 i;
-	char	*history_file;
+	FILE		*f;
+	struct evbuffer	*evb = status_prompt_hpending;
+	u_int		 i;
+	char		*history_file;
+	int		 compact;
 
-	if ((history_file = status_prompt_find_history_file()) == NULL)
+	if (evb == NULL || EVBUFFER_LENGTH(evb) == 0)
 		return;
-	log_debug("saving history to %s", history_file);
 
-	f = fopen(history_file, "w");
+	if ((history_file = status_prompt_find_history_file()) == NULL) {
+		evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+		return;
+	}
+	compact = (status_prompt_hlines >= PROMPT_HISTORY_COMPACT);
+	log_debug("%s history to %s", compact ? "saving" : "appending",
+	    history_file);
+
+	f = fopen(history_file, compact ? "w" : "a");
 	if (f == NULL) {
 		log_debug("%s: %s", history_file, strerror(errno));
 		free(history_file);
+		evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
 		return;
 	}
 	free(history_file);
 
-	for (i = 0; i < status_prompt_hsize; i++) {
-		fputs(status_prompt_hlist[i], f);
-		fputc('\n', f);
-	}
+	if (compact) {
+		for (i = 0; i < status_prompt_hsize; i++) {
+			fputs(status_prompt_hlist[i], f);
+			fputc('\n', f);
+		}
+		status_prompt_hlines = status_prompt_hsize;
+	} else
+		fwrite(EVBUFFER_DATA(evb), 1, EVBUFFER_LENGTH(evb), f);
 	fclose(f);
 
+	evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
 }
 
-/* Status timer callback. */
+/* Time to write the history. */
 void
-status_timer_callback(__unused int fd, __unused short events, void *arg)
+status_prompt_history_callback(__unused int fd, __unused short events,
+    __unused void *data)
 {
-	struct client	*c = arg;
-	struct session	*s = c->session;
-	struct timeval	 tv;
+	status_prompt_write_history();
+}
 
-	evtimer_del(&c->status_timer);
+/* Write what is left of the history to the file, on exit. */
+void
+status_prompt_save_history(void)
+{
+	if (event_initialized(&status_prompt_hevent))
+		evtimer_del(&status_prompt_hevent);
+	status_prompt_write_history();
+}
+
+/* Mark a client's status for redraw and work out when it is next due. */
+void
+status_timer_next(struct client *c, struct timeval *now)
+{
+	struct session	*s = c->session;
+	time_t		 interval;
 
+	timerclear(&c->status_due);
 	if (s == NULL)
 		return;
 
 	if (c->message_string == NULL && c->prompt_string == NULL)
 		c->flags |= CLIENT_STATUS;
 
-	timerclear(&tv);
-	tv.tv_sec = options_get_number(s->options, "status-interval");
+	interval = options_get_number(s->options, "status-interval");
+	if (interval != 0)
+		c->status_due.tv_sec = (now->tv_sec / interval + 1) * interval;
+	log_debug("client %p, status interval %d", c, (int)interval);
+}
+
+/* Set the timer for the first client due. */
+void
+status_timer_schedule(void)
+{
+	struct client	*c;
+	struct timeval	 now, *first = NULL, tv;
+
+	if (!event_initialized(&status_timer_event)) {
+		evtimer_set(&status_timer_event, status_timer_callback, NULL);
+		event_priority_set(&status_timer_event, EVENT_PRI_BACKGROUND);
+	}
+	evtimer_del(&status_timer_event);
+
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (!timerisset(&c->status_due))
+			continue;
+		if (first == NULL || timercmp(&c->status_due, first, <))
+			first = &c->status_due;
+	}
+	if (first == NULL)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(first, &now, >))
+		timersub(first, &now, &tv);
+	else
+		timerclear(&tv);
+	evtimer_add(&status_timer_event, &tv);
+}
 
-	if (tv.tv_sec != 0)
-		evtimer_add(&c->status_timer, &tv);
-	log_debug("client %p, status interval %d", c, (int)tv.tv_sec);
+/* Status timer callback. */
+void
+status_timer_callback(__unused int fd, __unused short events,
+    __unused void *arg)
+{
+	struct client	*c;
+	struct timeval	 now;
+
+	gettimeofday(&now, NULL);
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (timerisset(&c->status_due) &&
+		    !timercmp(&c->status_due, &now, >))
+			status_timer_next(c, &now);
+	}
+	status_timer_schedule();
 }
 
 /* Start status timer for client. */
@@ -173,14 +301,14 @@ void
 status_timer_start(struct client *c)
 {
 	struct session	*s = c->session;
+	struct timeval	 now;
 
-	if (event_initialized(&c->status_timer))
-		evtimer_del(&c->status_timer);
-	else
-		evtimer_set(&c->status_timer, status_timer_callback, c);
-
-	if (s != NULL && options_get_number(s->options, "status"))
-		status_timer_callback(-1, 0, c);
+	timerclear(&c->status_due);
+	if (s != NULL && options_get_number(s->options, "status")) {
+		gettimeofday(&now, NULL);
+		status_timer_next(c, &now);
+	}
+	status_timer_schedule();
 }
 
 /* Start status timer for all clients. */
@@ -188,9 +316,16 @@ void
 status_timer_start_all(void)
 {
 	struct client	*c;
-
-	TAILQ_FOREACH(c, &clients, entry)
-		status_timer_start(c);
+	struct timeval	 now;
+
+	gettimeofday(&now, NULL);
+	TAILQ_FOREACH(c, &clients, entry) {
+		timerclear(&c->status_due);
+		if (c->session != NULL &&
+		    options_get_number(c->session->options, "status"))
+			status_timer_next(c, &now);
+	}
+	status_timer_schedule();
 }
 
 /* Get screen line of status line. -1 means off. */
@@ -272,11 +407,216 @@ status_get_window_at(struct client *c, u_int x)
 	return (NULL);
 }
 
-/* Draw status for client on the last lines of given context. */
+/*
+ * Hash some data (FNV-1a), continuing from h or starting a new hash if h is
+ * zero.
+ */
+uint64_t
+status_hash(uint64_t h, const void *data, size_t len)
+{
+	const u_char	*cp = data;
+	size_t		 i;
+
+	if (h == 0)
+		h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < len; i++) {
+		h ^= cp[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/*
+ * Work out which cells of the status line are different from the old one, so
+ * only they need to be drawn. Wide characters are drawn whole.
+ */
+void
+status_redraw_dirty(struct client *c, struct screen *old)
+{
+	struct grid	*gd = c->status.grid, *ogd = old->grid;
+	struct grid_cell gc, ogc;
+	u_int		 sx = gd->sx, first, last, x;
+
+	c->status_dirtynx = 0;
+	if (ogd->sx != sx)
+		return;
+
+	first = sx;
+	last = 0;
+	for (x = 0; x < sx; x++) {
+		grid_view_get_cell(gd, x, 0, &gc);
+		grid_view_get_cell(ogd, x, 0, &ogc);
+		if (memcmp(&gc, &ogc, sizeof gc) != 0) {
+			if (first == sx)
+				first = x;
+			last = x;
+		}
+	}
+	if (first == sx)
+		return;
+
+	for (; first > 0; first--) {
+		grid_view_get_cell(gd, first, 0, &gc);
+		grid_view_get_cell(ogd, first, 0, &ogc);
+		if (~(gc.flags | ogc.flags) & GRID_FLAG_PADDING)
+			break;
+	}
+	for (; last < sx - 1; last++) {
+		grid_view_get_cell(gd, last + 1, 0, &gc);
+		grid_view_get_cell(ogd, last + 1, 0, &ogc);
+		if (~(gc.flags | ogc.flags) & GRID_FLAG_PADDING)
+			break;
+	}
+
+	c->status_dirtyx = first;
+	c->status_dirtynx = last - first + 1;
+}
+
+/*
+ * Can the status line for this client be shared with other clients of the
+ * session of the same size? Not if it is off or any of the formats use the
+ * client.
+ */
+int
+status_redraw_shared(struct client *c)
+{
+	struct session	*s = c->session;
+	struct winlink	*wl;
+	struct options	*oo;
+
+	if (c->tty.sy == 0 || !options_get_number(s->options, "status"))
+		return (0);
+
+	if (format_uses_client(options_get_string(s->options, "status-left")))
+		return (0);
+	if (format_uses_client(options_get_string(s->options, "status-right")))
+		return (0);
+	RB_FOREACH(wl, winlinks, &s->windows) {
+		oo = wl->window->options;
+		if (format_uses_client(options_get_string(oo,
+		    "window-status-format")))
+			return (0);
+		if (format_uses_client(options_get_string(oo,
+		    "window-status-current-format")))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Find the shared status line for a size, or an entry for it which is not
+ * valid yet. Entries not used in this loop are reused.
+ */
+struct status_cache *
+status_cache_find(struct session *s, u_int sx, u_int sy)
+{
+	struct status_cache	*sc, *stale = NULL;
+	u_int			 i;
+
+	for (i = 0; i < s->nstatus_cache; i++) {
+		sc = &s->status_cache[i];
+		if (sc->sx == sx && sc->sy == sy)
+			return (sc);
+		if (stale == NULL && sc->generation != status_generation)
+			stale = sc;
+	}
+
+	if (stale == NULL) {
+		s->status_cache = xreallocarray(s->status_cache,
+		    s->nstatus_cache + 1, sizeof *s->status_cache);
+		stale = &s->status_cache[s->nstatus_cache++];
+		screen_init(&stale->screen, sx, 1, 0);
+	}
+	stale->sx = sx;
+	stale->sy = sy;
+	stale->generation = status_generation - 1;
+	return (stale);
+}
+
+/* Copy a shared status line into the client. */
+int
+status_cache_load(struct client *c, struct status_cache *sc)
+{
+	struct screen	old_status;
+	int		valid;
+
+	valid = (c->status_hash[STATUS_LEFT] != 0);
+	if (valid && memcmp(c->status_hash, sc->hash, sizeof sc->hash) == 0)
+		return (0);
+
+	memcpy(&old_status, &c->status, sizeof old_status);
+	screen_init(&c->status, sc->sx, 1, 0);
+	grid_duplicate_lines(c->status.grid, 0, sc->screen.grid, 0, 1);
+	c->wlmouse = sc->wlmouse;
+	memcpy(c->status_hash, sc->hash, sizeof c->status_hash);
+
+	if (grid_compare(c->status.grid, old_status.grid) == 0) {
+		screen_free(&old_status);
+		return (0);
+	}
+	if (valid)
+		status_redraw_dirty(c, &old_status);
+	else
+		c->status_dirtynx = 0;
+	screen_free(&old_status);
+	return (1);
+}
+
+/* Keep the status line the client has just drawn for other clients. */
+void
+status_cache_save(struct status_cache *sc, struct client *c)
+{
+	if (c->status.grid->sx != sc->sx)
+		return;
+
+	screen_free(&sc->screen);
+	screen_init(&sc->screen, sc->sx, 1, 0);
+	grid_duplicate_lines(sc->screen.grid, 0, c->status.grid, 0, 1);
+	sc->wlmouse = c->wlmouse;
+	memcpy(sc->hash, c->status_hash, sizeof sc->hash);
+	sc->generation = status_generation;
+}
+
+/* Free the shared status lines of a session. */
+void
+status_cache_free(struct session *s)
+{
+	u_int	i;
+
+	for (i = 0; i < s->nstatus_cache; i++)
+		screen_free(&s->status_cache[i].screen);
+	free(s->status_cache);
+	s->status_cache = NULL;
+	s->nstatus_cache = 0;
+}
+
+/*
+ * Draw status for client, using the status line already drawn for another
+ * client of the same session and size in this loop if there is one.
+ */
 int
 status_redraw(struct client *c)
 {
-	struct screen_write_ctx	ctx;
+	struct status_cache	*sc;
+	int			 redraw;
+
+	if (!status_redraw_shared(c))
+		return (status_redraw_client(c));
+
+	sc = status_cache_find(c->session, c->tty.sx, c->tty.sy);
+	if (sc->generation == status_generation)
+		return (status_cache_load(c, sc));
+
+	redraw = status_redraw_client(c);
+	status_cache_save(sc, c);
+	return (redraw);
+}
+
+/* Draw status for client on the last lines of given context. */
+int
+status_redraw_client(struct client *c)
+{
+	struct screen_write_ctx	ctx, ctx2;
 	struct session	       *s = c->session;
 	struct winlink	       *wl;
 	struct screen		old_status, window_list;
@@ -286,8 +626,10 @@ status_redraw(struct client *c)
 	char		       *left, *right, *sep;
 	u_int			offset, needed;
 	u_int			wlstart, wlwidth, wlavailable, wloffset, wlsize;
+	u_int			wlfirst, wllast;
 	size_t			llen, rlen, seplen;
-	int			larrow, rarrow;
+	int			larrow, rarrow, justify, valid;
+	uint64_t		hash[STATUS_SEGMENTS], h;
 
 	/* No status line? */
 	if (c->tty.sy == 0 || !options_get_number(s->options, "status"))
@@ -296,6 +638,7 @@ status_redraw(struct client *c)
 #endif
 		return (1);
 	left = right = NULL;
+	llen = rlen = 0;
 	larrow = rarrow = 0;
 
 	/* Store current time. */
@@ -304,6 +647,73 @@ status_redraw(struct client *c)
 	/* Set up default colour. */
 	style_apply(&stdgc, s->options, "status-style");
 
+	/* Work out the left and right strings and the window list entries. */
+	memcpy(&lgc, &stdgc, sizeof lgc);
+	memcpy(&rgc, &stdgc, sizeof rgc);
+	if (c->tty.sy > 1) {
+		left = status_redraw_get_left(c, t, &lgc, &llen);
+		right = status_redraw_get_right(c, t, &rgc, &rlen);
+
+#ifdef TMATE
+		tmate_status(left, right);
+#endif
+
+		RB_FOREACH(wl, winlinks, &s->windows) {
+			h = status_print_key(c, wl, &stdgc);
+			if (h != 0 && h == wl->status_key)
+				continue;
+			wl->status_key = h;
+
+			free(wl->status_text);
+			memcpy(&wl->status_cell, &stdgc,
+			    sizeof wl->status_cell);
+			wl->status_text = status_print(c, wl, t,
+			    &wl->status_cell);
+			wl->status_width = screen_write_cstrlen("%s",
+			    wl->status_text);
+		}
+	}
+
+	/*
+	 * Hash each segment. If none has changed since the last redraw, the
+	 * status line is the same and nothing needs to be done.
+	 */
+	h = status_hash(0, &c->tty.sx, sizeof c->tty.sx);
+	h = status_hash(h, &c->tty.sy, sizeof c->tty.sy);
+	h = status_hash(h, &stdgc, sizeof stdgc);
+
+	hash[STATUS_LEFT] = status_hash(h, &lgc, sizeof lgc);
+	if (left != NULL)
+		hash[STATUS_LEFT] = status_hash(hash[STATUS_LEFT], left, llen);
+
+	hash[STATUS_RIGHT] = status_hash(h, &rgc, sizeof rgc);
+	if (right != NULL) {
+		hash[STATUS_RIGHT] = status_hash(hash[STATUS_RIGHT], right,
+		    rlen);
+	}
+
+	justify = options_get_number(s->options, "status-justify");
+	hash[STATUS_WINDOWS] = status_hash(h, &justify, sizeof justify);
+	RB_FOREACH(wl, winlinks, &s->windows) {
+		h = hash[STATUS_WINDOWS];
+		h = status_hash(h, &wl->status_cell, sizeof wl->status_cell);
+		h = status_hash(h, wl->status_text, strlen(wl->status_text));
+		h = status_hash(h, &wl->flags, sizeof wl->flags);
+		if (wl == s->curw)
+			h = status_hash(h, "*", 1);
+		oo = wl->window->options;
+		sep = options_get_string(oo, "window-status-separator");
+		hash[STATUS_WINDOWS] = status_hash(h, sep, strlen(sep) + 1);
+	}
+
+	valid = (c->status_hash[STATUS_LEFT] != 0);
+	if (valid && memcmp(hash, c->status_hash, sizeof hash) == 0) {
+		free(left);
+		free(right);
+		return (0);
+	}
+	memcpy(c->status_hash, hash, sizeof c->status_hash);
+
 	/* Create the target screen. */
 	memcpy(&old_status, &c->status, sizeof old_status);
 	screen_init(&c->status, c->tty.sx, 1, 0);
@@ -316,16 +726,6 @@ status_redraw(struct client *c)
 	if (c->tty.sy <= 1)
 		goto out;
 
-	/* Work out left and right strings. */
-	memcpy(&lgc, &stdgc, sizeof lgc);
-	left = status_redraw_get_left(c, t, &lgc, &llen);
-	memcpy(&rgc, &stdgc, sizeof rgc);
-	right = status_redraw_get_right(c, t, &rgc, &rlen);
-
-#ifdef TMATE
-	tmate_status(left, right);
-#endif
-
 	/*
 	 * Figure out how much space we have for the window list. If there
 	 * isn't enough space, just show a blank status line.
@@ -342,11 +742,6 @@ status_redraw(struct client *c)
 	/* Calculate the total size needed for the window list. */
 	wlstart = wloffset = wlwidth = 0;
 	RB_FOREACH(wl, winlinks, &s->windows) {
-		free(wl->status_text);
-		memcpy(&wl->status_cell, &stdgc, sizeof wl->status_cell);
-		wl->status_text = status_print(c, wl, t, &wl->status_cell);
-		wl->status_width = screen_write_cstrlen("%s", wl->status_text);
-
 		if (wl == s->curw)
 			wloffset = wlwidth;
 
@@ -356,21 +751,6 @@ status_redraw(struct client *c)
 		wlwidth += wl->status_width + seplen;
 	}
 
-	/* Create a new screen for the window list. */
-	screen_init(&window_list, wlwidth, 1, 0);
-
-	/* And draw the window list into it. */
-	screen_write_start(&ctx, NULL, &window_list);
-	RB_FOREACH(wl, winlinks, &s->windows) {
-		screen_write_cnputs(&ctx, -1, &wl->status_cell, "%s",
-		    wl->status_text);
-
-		oo = wl->window->options;
-		sep = options_get_string(oo, "window-status-separator");
-		screen_write_nputs(&ctx, -1, &stdgc, "%s", sep);
-	}
-	screen_write_stop(&ctx);
-
 	/* If there is enough space for the total width, skip to draw now. */
 	if (wlwidth <= wlavailable)
 		goto draw;
@@ -410,10 +790,8 @@ status_redraw(struct client *c)
 	}
 
 	/* Bail if anything is now too small too. */
-	if (wlwidth == 0 || wlavailable == 0) {
-		screen_free(&window_list);
+	if (wlwidth == 0 || wlavailable == 0)
 		goto out;
-	}
 
 	/*
 	 * Now the start position is known, work out the state of the left and
@@ -465,7 +843,7 @@ draw:
 	else
 		wloffset = 0;
 	if (wlwidth < wlavailable) {
-		switch (options_get_number(s->options, "status-justify")) {
+		switch (justify) {
 		case 1:	/* centred */
 			wloffset += (wlavailable - wlwidth) / 2;
 			break;
@@ -477,10 +855,43 @@ draw:
 	if (larrow != 0)
 		wloffset++;
 
+	/*
+	 * Draw the window list, only the entries which can be seen: those from
+	 * the one at wlstart up to one past wlstart + wlwidth.
+	 */
+	wlfirst = wllast = offset = 0;
+	RB_FOREACH(wl, winlinks, &s->windows) {
+		oo = wl->window->options;
+		sep = options_get_string(oo, "window-status-separator");
+		offset += wl->status_width + screen_write_strlen("%s", sep);
+		if (offset <= wlstart)
+			wlfirst = offset;
+		else if (wllast < wlstart + wlwidth)
+			wllast = offset;
+	}
+	screen_init(&window_list, wllast - wlfirst, 1, 0);
+	screen_write_start(&ctx2, NULL, &window_list);
+	offset = 0;
+	RB_FOREACH(wl, winlinks, &s->windows) {
+		if (offset >= wllast)
+			break;
+		oo = wl->window->options;
+		sep = options_get_string(oo, "window-status-separator");
+		seplen = screen_write_strlen("%s", sep);
+		if (offset >= wlfirst) {
+			screen_write_cnputs(&ctx2, -1, &wl->status_cell, "%s",
+			    wl->status_text);
+			screen_write_nputs(&ctx2, -1, &stdgc, "%s", sep);
+		}
+		offset += wl->status_width + seplen;
+	}
+	screen_write_stop(&ctx2);
+
 	/* Copy the window list. */
 	c->wlmouse = -wloffset + wlstart;
 	screen_write_cursormove(&ctx, wloffset, 0);
-	screen_write_copy(&ctx, &window_list, wlstart, 0, wlwidth, 1);
+	screen_write_copy(&ctx, &window_list, wlstart - wlfirst, 0, wlwidth,
+	    1);
 	screen_free(&window_list);
 
 	screen_write_stop(&ctx);
@@ -493,6 +904,10 @@ out:
 		screen_free(&old_status);
 		return (0);
 	}
+	if (valid)
+		status_redraw_dirty(c, &old_status);
+	else
+		c->status_dirtynx = 0;
 	screen_free(&old_status);
 	return (1);
 }
@@ -519,6 +934,122 @@ status_replace(struct client *c, struct winlink *wl, const char *fmt, time_t t)
 	return (expanded);
 }
 
+/*
+ * Can a window status format be cached? Only if all it uses is known to be in
+ * the key made by status_print_key: no time, no #() and only the variables of
+ * the winlink and window below.
+ */
+int
+status_print_cached(const char *fmt)
+{
+	static const char	*names[] = {
+		"window_active",
+		"window_activity_flag",
+		"window_bell_flag",
+		"window_flags",
+		"window_id",
+		"window_index",
+		"window_last_flag",
+		"window_name",
+		"window_silence_flag",
+		"window_zoomed_flag",
+	};
+	const char		*cp;
+	size_t			 len;
+	u_int			 i;
+
+	for (cp = fmt; *cp != '\0'; cp++) {
+		if (*cp == '%')
+			return (0);
+		if (*cp != '#')
+			continue;
+		cp++;
+		if (strchr("#[,}IWF", *cp) != NULL) {
+			if (*cp == '\0')
+				return (1);
+			continue;
+		}
+		if (*cp != '{')
+			return (0);
+
+		cp++;
+		if (*cp == '?')
+			cp++;
+		else if (*cp == '=') {
+			cp += 1 + strspn(cp + 1, "-0123456789");
+			if (*cp != ':')
+				return (0);
+			cp++;
+		}
+		len = strcspn(cp, ",}");
+		for (i = 0; i < nitems(names); i++) {
+			if (strlen(names[i]) == len &&
+			    strncmp(cp, names[i], len) == 0)
+				break;
+		}
+		if (i == nitems(names))
+			return (0);
+		cp += len - 1;
+	}
+	return (1);
+}
+
+/*
+ * Make a key for all status_print uses for a winlink, so it need not be drawn
+ * again unless something has changed: a rename, new flags or an option. This
+ * is zero if the format cannot be cached.
+ */
+uint64_t
+status_print_key(struct client *c, struct winlink *wl, struct grid_cell *gc)
+{
+	static const char	*styles[] = {
+		"window-status-style",
+		"window-status-current-style",
+		"window-status-last-style",
+		"window-status-bell-style",
+		"window-status-activity-style",
+	};
+	struct options		*oo = wl->window->options;
+	struct session		*s = c->session;
+	struct window		*w = wl->window;
+	const char		*fmt, *style;
+	uint64_t		 h;
+	u_int			 i;
+	int			 flags;
+
+	if (wl == s->curw)
+		fmt = options_get_string(oo, "window-status-current-format");
+	else
+		fmt = options_get_string(oo, "window-status-format");
+	if (!status_print_cached(fmt))
+		return (0);
+
+	h = status_hash(0, fmt, strlen(fmt) + 1);
+	for (i = 0; i < nitems(styles); i++) {
+		style = options_get_string(oo, styles[i]);
+		h = status_hash(h, style, strlen(style) + 1);
+	}
+	h = status_hash(h, gc, sizeof *gc);
+	h = status_hash(h, w->name, strlen(w->name) + 1);
+	h = status_hash(h, &w->id, sizeof w->id);
+	h = status_hash(h, &wl->idx, sizeof wl->idx);
+
+	flags = wl->flags;
+	if (wl == s->curw)
+		flags |= 0x10000;
+	if (wl == TAILQ_FIRST(&s->lastw))
+		flags |= 0x20000;
+	if (w->flags & WINDOW_ZOOMED)
+		flags |= 0x40000;
+	if (c->flags & CLIENT_STATUSFORCE)
+		flags |= 0x80000;
+	if (server_check_marked() && wl == marked_pane.wl)
+		flags |= 0x100000;
+	if (window_throttled(w))
+		flags |= 0x200000;
+	return (status_hash(h, &flags, sizeof flags));
+}
+
 /* Return winlink status line entry and adjust gc as necessary. */
 char *
 status_print(struct client *c, struct winlink *wl, time_t t,
@@ -615,6 +1146,7 @@ status_message_clear(struct client *c)
 	c->flags |= CLIENT_REDRAW; /* screen was frozen and may have changed */
 
 	screen_reinit(&c->status);
+	memset(c->status_hash, 0, sizeof c->status_hash);
 }
 
 /* Clear status line message after timer expires. */
@@ -640,6 +1172,8 @@ status_message_redraw(struct client *c)
 		return (0);
 	memcpy(&old_status, &c->status, sizeof old_status);
 	screen_init(&c->status, c->tty.sx, 1, 0);
+	memset(c->status_hash, 0, sizeof c->status_hash);
+	c->status_dirtynx = 0;
 
 	len = screen_write_strlen("%s", c->message_string);
 	if (len > c->tty.sx)
@@ -726,6 +1260,7 @@ status_prompt_clear(struct client *c)
 	c->flags |= CLIENT_REDRAW; /* screen was frozen and may have changed */
 
 	screen_reinit(&c->status);
+	memset(c->status_hash, 0, sizeof c->status_hash);
 }
 
 /* Update status line prompt with a new prompt string. */
@@ -767,6 +1302,8 @@ status_prompt_redraw(struct client *c)
 		return (0);
 	memcpy(&old_status, &c->status, sizeof old_status);
 	screen_init(&c->status, c->tty.sx, 1, 0);
+	memset(c->status_hash, 0, sizeof c->status_hash);
+	c->status_dirtynx = 0;
 
 	len = screen_write_strlen("%s", c->prompt_string);
 	if (len > c->tty.sx)
@@ -1158,6 +1695,7 @@ status_prompt_up_history(u_int *idx)
 	 * empty.
 	 */
 
+	status_prompt_load_history();
 	if (status_prompt_hsize == 0 || *idx == status_prompt_hsize)
 		return (NULL);
 	(*idx)++;
@@ -1176,15 +1714,15 @@ status_prompt_down_history(u_int *idx)
 	return (status_prompt_hlist[status_prompt_hsize - *idx]);
 }
 
-/* Add line to the history. */
-void
-status_prompt_add_history(const char *line)
+/* Add line to the history in memory. Returns 0 if it was the last already. */
+int
+status_prompt_add_history1(const char *line)
 {
 	size_t	size;
 
 	if (status_prompt_hsize > 0 &&
 	    strcmp(status_prompt_hlist[status_prompt_hsize - 1], line) == 0)
-		return;
+		return (0);
 
 	if (status_prompt_hsize == PROMPT_HISTORY) {
 		free(status_prompt_hlist[0]);
@@ -1193,46 +1731,136 @@ status_prompt_add_history(const char *line)
 		memmove(&status_prompt_hlist[0], &status_prompt_hlist[1], size);
 
 		status_prompt_hlist[status_prompt_hsize - 1] = xstrdup(line);
-		return;
+		return (1);
 	}
 
 	status_prompt_hlist = xreallocarray(status_prompt_hlist,
 	    status_prompt_hsize + 1, sizeof *status_prompt_hlist);
 	status_prompt_hlist[status_prompt_hsize++] = xstrdup(line);
+	return (1);
 }
 
-/* Build completion list. */
-const char **
-status_prompt_complete_list(u_int *size, const char *s)
+/* Add line to the history, and to the file a second from now. */
+void
+status_prompt_add_history(const char *line)
+{
+	struct timeval	tv = { .tv_sec = 1 };
+
+	status_prompt_load_history();
+	if (!status_prompt_add_history1(line))
+		return;
+
+	if (status_prompt_hpending == NULL &&
+	    (status_prompt_hpending = evbuffer_new()) == NULL)
+		fatalx("out of memory");
+	evbuffer_add_printf(status_prompt_hpending, "%s\n", line);
+	status_prompt_hlines++;
+
+	if (!event_initialized(&status_prompt_hevent)) {
+		evtimer_set(&status_prompt_hevent,
+		    status_prompt_history_callback, NULL);
+	}
+	evtimer_del(&status_prompt_hevent);
+	evtimer_add(&status_prompt_hevent, &tv);
+}
+
+/* Compare names for sorting the completion index. */
+int
+status_prompt_complete_cmp(const void *a0, const void *b0)
+{
+	const char *const	*a = a0, *const *b = b0;
+
+	return (strcmp(*a, *b));
+}
+
+/*
+ * Build the completion index: the command names, option names and layouts,
+ * sorted and without duplicates. They never change, so this is done once.
+ */
+void
+status_prompt_complete_index(void)
 {
-	const char				**list = NULL, **layout;
 	const struct cmd_entry			**cmdent;
 	const struct options_table_entry	 *oe;
+	const char				**names, **layout;
+	u_int					  n, i, j;
 	const char				 *layouts[] = {
 		"even-horizontal", "even-vertical", "main-horizontal",
 		"main-vertical", "tiled", NULL
 	};
 
-	*size = 0;
-	for (cmdent = cmd_table; *cmdent != NULL; cmdent++) {
-		if (strncmp((*cmdent)->name, s, strlen(s)) == 0) {
-			list = xreallocarray(list, (*size) + 1, sizeof *list);
-			list[(*size)++] = (*cmdent)->name;
-		}
+	n = 0;
+	for (cmdent = cmd_table; *cmdent != NULL; cmdent++)
+		n++;
+	for (oe = options_table; oe->name != NULL; oe++)
+		n++;
+	for (layout = layouts; *layout != NULL; layout++)
+		n++;
+
+	names = xreallocarray(NULL, n, sizeof *names);
+	n = 0;
+	for (cmdent = cmd_table; *cmdent != NULL; cmdent++)
+		names[n++] = (*cmdent)->name;
+	for (oe = options_table; oe->name != NULL; oe++)
+		names[n++] = oe->name;
+	for (layout = layouts; *layout != NULL; layout++)
+		names[n++] = *layout;
+	qsort(names, n, sizeof *names, status_prompt_complete_cmp);
+
+	for (i = j = 0; i < n; i++) {
+		if (j == 0 || strcmp(names[j - 1], names[i]) != 0)
+			names[j++] = names[i];
 	}
-	for (oe = options_table; oe->name != NULL; oe++) {
-		if (strncmp(oe->name, s, strlen(s)) == 0) {
-			list = xreallocarray(list, (*size) + 1, sizeof *list);
-			list[(*size)++] = oe->name;
-		}
+	status_prompt_complete_names = names;
+	status_prompt_complete_nnames = j;
+}
+
+/*
+ * Find the names starting with s in the completion index. They follow each
+ * other, from the first name not before s. The list is part of the index and
+ * must not be freed.
+ */
+const char **
+status_prompt_complete_list(u_int *size, const char *s)
+{
+	const char	**names;
+	size_t		  len = strlen(s);
+	u_int		  lo, hi, mid, n;
+
+	if (status_prompt_complete_names == NULL)
+		status_prompt_complete_index();
+	names = status_prompt_complete_names;
+	n = status_prompt_complete_nnames;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(names[mid], s) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	for (layout = layouts; *layout != NULL; layout++) {
-		if (strncmp(*layout, s, strlen(s)) == 0) {
-			list = xreallocarray(list, (*size) + 1, sizeof *list);
-			list[(*size)++] = *layout;
-		}
+	for (hi = lo; hi < n; hi++) {
+		if (strncmp(names[hi], s, len) != 0)
+			break;
 	}
-	return (list);
+
+	*size = hi - lo;
+	return (names + lo);
+}
+
+/*
+ * Find the first session with a name starting with s. The sessions tree is
+ * sorted by name, so the others follow.
+ */
+struct session *
+status_prompt_complete_session(const char *s)
+{
+	struct session	find;
+
+	find.name = (char *)s;
+	return (RB_NFIND(sessions, &sessions, &find));
 }
 
 /* Find longest prefix. */
@@ -1260,12 +1888,12 @@ status_prompt_complete_prefix(const char **list, u_int size)
 char *
 status_prompt_complete(struct session *sess, const char *s)
 {
-	const char	**list = NULL, *colon;
+	const char	**list = NULL, *colon, *sep;
 	u_int		  size = 0, i;
-	struct session	 *s_loop;
+	struct session	 *s_loop, *first;
 	struct winlink	 *wl;
 	struct window	 *w;
-	char		 *copy, *out, *tmp;
+	char		 *copy, *out, *tmp, *name;
 
 	if (*s == '\0')
 		return (NULL);
@@ -1279,7 +1907,6 @@ status_prompt_complete(struct session *sess, const char *s)
 			xasprintf(&out, "%s ", list[0]);
 		else
 			out = status_prompt_complete_prefix(list, size);
-		free(list);
 		return (out);
 	}
 	copy = xstrdup(s);
@@ -1291,11 +1918,12 @@ status_prompt_complete(struct session *sess, const char *s)
 		colon = "";
 	s = copy + 2;
 
-	RB_FOREACH(s_loop, sessions, &sessions) {
-		if (strncmp(s_loop->name, s, strlen(s)) == 0) {
-			list = xreallocarray(list, size + 2, sizeof *list);
-			list[size++] = s_loop->name;
-		}
+	s_loop = status_prompt_complete_session(s);
+	for (; s_loop != NULL; s_loop = RB_NEXT(sessions, &sessions, s_loop)) {
+		if (strncmp(s_loop->name, s, strlen(s)) != 0)
+			break;
+		list = xreallocarray(list, size + 2, sizeof *list);
+		list[size++] = s_loop->name;
 	}
 	if (size == 1) {
 		out = xstrdup(list[0]);
@@ -1331,7 +1959,23 @@ status_prompt_complete(struct session *sess, const char *s)
 			free(tmp);
 		}
 	} else {
-		RB_FOREACH(s_loop, sessions, &sessions) {
+		/*
+		 * Only the session before the colon can match, or without a
+		 * colon the sessions with names starting with s.
+		 */
+		if ((sep = strchr(s, ':')) != NULL) {
+			name = xstrdup(s);
+			name[sep - s] = '\0';
+			first = session_find(name);
+			free(name);
+		} else
+			first = status_prompt_complete_session(s);
+		for (s_loop = first; s_loop != NULL;
+		    s_loop = RB_NEXT(sessions, &sessions, s_loop)) {
+			if (sep != NULL && s_loop != first)
+				break;
+			if (sep == NULL && strncmp(s_loop->name, s, strlen(s)) != 0)
+				break;
 			RB_FOREACH(wl, winlinks, &s_loop->windows) {
 				w = wl->window;
 
@@ -0,0 +1,208 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tmate.h"
+#include "tmate-protocol.h"
+
+/*
+ * Read-only local subscribers, on the unix socket named by
+ * tmate-broadcast-socket. They speak the same TMATE_OUT_* stream as the
+ * server, without compression: each one gets its own header, then what the
+ * encoder packs from then on, starting with a full layout and a snapshot.
+ *
+ * What is packed during a loop iteration accumulates in one buffer, which is
+ * handed to all subscribers as a single reference counted chunk when the
+ * encoder flushes. Anything subscribers send is discarded, and a subscriber
+ * falling more than BROADCAST_MAX_PENDING bytes behind is dropped.
+ */
+
+#define BROADCAST_MAX_PENDING (4 * 1024 * 1024)
+
+struct tmate_subscriber {
+	int fd;
+	struct bufferevent *event;
+	TAILQ_ENTRY(tmate_subscriber) entry;
+};
+static TAILQ_HEAD(, tmate_subscriber) subscribers =
+	TAILQ_HEAD_INITIALIZER(subscribers);
+
+struct broadcast_chunk {
+	unsigned int references;
+	char data[];
+};
+
+static int listen_fd = -1;
+static struct event *ev_listen;
+static struct evbuffer *pending;
+
+static void chunk_unref(__unused const void *data, __unused size_t len,
+			void *arg)
+{
+	struct broadcast_chunk *chunk = arg;
+
+	if (--chunk->references == 0)
+		free(chunk);
+}
+
+static void free_subscriber(struct tmate_subscriber *sub)
+{
+	TAILQ_REMOVE(&subscribers, sub, entry);
+	bufferevent_free(sub->event);
+	close(sub->fd);
+	free(sub);
+	tmate_debug("Broadcast subscriber gone");
+}
+
+void tmate_broadcast_write(const char *buf, size_t len)
+{
+	if (TAILQ_EMPTY(&subscribers))
+		return;
+
+	if (evbuffer_add(pending, buf, len) < 0)
+		tmate_fatal("Cannot buffer broadcast data");
+}
+
+void tmate_broadcast_flush(void)
+{
+	struct tmate_subscriber *sub, *sub1;
+	struct broadcast_chunk *chunk;
+	struct evbuffer *out;
+	size_t len;
+
+	if (!pending || !(len = evbuffer_get_length(pending)))
+		return;
+
+	chunk = xmalloc(sizeof(*chunk) + len);
+	chunk->references = 1;
+	evbuffer_remove(pending, chunk->data, len);
+
+	TAILQ_FOREACH_SAFE(sub, &subscribers, entry, sub1) {
+		out = bufferevent_get_output(sub->event);
+		if (evbuffer_get_length(out) > BROADCAST_MAX_PENDING) {
+			free_subscriber(sub);
+			continue;
+		}
+
+		chunk->references++;
+		if (evbuffer_add_reference(out, chunk->data, len,
+					   chunk_unref, chunk) < 0)
+			tmate_fatal("Cannot buffer broadcast data");
+	}
+
+	chunk_unref(NULL, 0, chunk);
+}
+
+static int on_subscriber_pack(void *data, const char *buf, size_t len)
+{
+	return evbuffer_add(data, buf, len);
+}
+
+static void on_subscriber_read(struct bufferevent *event,
+			       __unused void *arg)
+{
+	struct evbuffer *in = bufferevent_get_input(event);
+
+	evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void on_subscriber_error(__unused struct bufferevent *event,
+				__unused short what, void *arg)
+{
+	free_subscriber(arg);
+}
+
+static void on_subscriber_accept(__unused evutil_socket_t fd,
+				 __unused short what, __unused void *arg)
+{
+	struct tmate_subscriber *sub;
+	msgpack_packer pk;
+	int newfd, version;
+
+	newfd = accept(listen_fd, NULL, NULL);
+	if (newfd < 0) {
+		if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+			tmate_debug("Broadcast accept failed: %s",
+				    strerror(errno));
+		return;
+	}
+	setblocking(newfd, 0);
+
+	/* What is pending is for the subscribers already there. */
+	tmate_broadcast_flush();
+
+	sub = xcalloc(1, sizeof(*sub));
+	sub->fd = newfd;
+	sub->event = bufferevent_new(newfd, on_subscriber_read, NULL,
+				     on_subscriber_error, sub);
+	if (!sub->event)
+		tmate_fatal("out of memory");
+	bufferevent_enable(sub->event, EV_READ | EV_WRITE);
+	TAILQ_INSERT_TAIL(&subscribers, sub, entry);
+
+	msgpack_packer_init(&pk, bufferevent_get_output(sub->event),
+			    on_subscriber_pack);
+	version = tmate_protocol_version();
+	msgpack_pack_array(&pk, version >= TMATE_PROTOCOL_COMPRESSION ? 4 : 3);
+	msgpack_pack_int(&pk, TMATE_OUT_HEADER);
+	msgpack_pack_int(&pk, version);
+	msgpack_pack_string(&pk, VERSION);
+	if (version >= TMATE_PROTOCOL_COMPRESSION)
+		msgpack_pack_string(&pk, "");
+
+	tmate_debug("Broadcast subscriber connected");
+	tmate_send_subscriber_state();
+}
+
+void tmate_broadcast_start(void)
+{
+	const char *path;
+	struct sockaddr_un sa;
+	mode_t mask;
+
+	path = options_get_string(global_options, "tmate-broadcast-socket");
+	if (!strlen(path) || listen_fd != -1)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlcpy(sa.sun_path, path, sizeof(sa.sun_path)) >=
+	    sizeof(sa.sun_path)) {
+		tmate_info("Broadcast socket path too long: %s", path);
+		return;
+	}
+	unlink(sa.sun_path);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		tmate_fatal("socket failed");
+
+	mask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
+	if (bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(listen_fd, 16) < 0) {
+		umask(mask);
+		tmate_info("Cannot listen on %s: %s", path, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return;
+	}
+	umask(mask);
+	setblocking(listen_fd, 0);
+
+	pending = evbuffer_new();
+	if (!pending)
+		tmate_fatal("out of memory");
+
+	ev_listen = event_new(tmate_session.ev_base, listen_fd,
+			      EV_READ | EV_PERSIST, on_subscriber_accept, NULL);
+	if (!ev_listen)
+		tmate_fatal("out of memory");
+	event_add(ev_listen, NULL);
+
+	tmate_info("Broadcasting read-only on %s", path);
+}
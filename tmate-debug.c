@@ -83,6 +83,7 @@ void tmate_print_stack_trace(void)
 	}
 
 	free (strings);
+	log_flush();
 }
 
 static void handle_crash(int sig)
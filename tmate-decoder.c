@@ -4,9 +4,8 @@
 static void handle_notify(__unused struct tmate_session *session,
 			  struct tmate_unpacker *uk)
 {
-	char *msg = unpack_string(uk);
+	const char *msg = unpack_cstring(uk);
 	tmate_status_message("%s", msg);
-	free(msg);
 }
 
 static void handle_legacy_pane_key(__unused struct tmate_session *_session,
@@ -18,7 +17,7 @@ static void handle_legacy_pane_key(__unused struct tmate_session *_session,
 
 	int key = unpack_int(uk);
 
-	s = RB_MIN(sessions, &sessions);
+	s = tmate_tmux_session(&tmate_session);
 	if (!s)
 		return;
 
@@ -31,6 +30,7 @@ static void handle_legacy_pane_key(__unused struct tmate_session *_session,
 		return;
 
 	window_pane_key(wp, NULL, s, key, NULL);
+	tmate_echo_keys(wp);
 }
 
 static struct window_pane *find_window_pane(struct session *s, int pane_id)
@@ -56,7 +56,7 @@ static void handle_pane_key(__unused struct tmate_session *_session,
 	int pane_id = unpack_int(uk);
 	key_code key = unpack_int(uk);
 
-	s = RB_MIN(sessions, &sessions);
+	s = tmate_tmux_session(&tmate_session);
 	if (!s)
 		return;
 
@@ -65,14 +65,180 @@ static void handle_pane_key(__unused struct tmate_session *_session,
 		return;
 
 	window_pane_key(wp, NULL, s, key, NULL);
+	tmate_echo_keys(wp);
 }
 
+/*
+ * Keys that input_key would write as they are are gathered and written in one
+ * go; anything else (or everything, when the pane is in a mode) still goes
+ * through window_pane_key.
+ */
+static void pane_keys_array(struct session *s, struct window_pane *wp,
+			    struct tmate_unpacker *uk)
+{
+	struct utf8_data ud;
+	key_code key;
+	char *buf;
+	size_t len = 0;
+
+	buf = xmalloc(uk->argc * UTF8_SIZE + 1);
+	while (uk->argc > 0) {
+		key = unpack_int(uk);
+
+		if (!wp->mode && key <= 0x7f) {
+			buf[len++] = key;
+			continue;
+		}
+		if (!wp->mode && key < KEYC_BASE) {
+			if (utf8_split(key, &ud) == UTF8_DONE) {
+				memcpy(buf + len, ud.data, ud.size);
+				len += ud.size;
+			}
+			continue;
+		}
+
+		if (len) {
+			window_pane_paste(wp, buf, len, 0);
+			len = 0;
+		}
+		window_pane_key(wp, NULL, s, key, NULL);
+	}
+	if (len)
+		window_pane_paste(wp, buf, len, 0);
+	free(buf);
+}
+
+static void pane_keys_string(struct session *s, struct window_pane *wp,
+			     const char *buf, size_t len)
+{
+	struct utf8_data ud;
+	enum utf8_state more;
+	key_code key;
+	wchar_t wc;
+	size_t i;
+
+	if (!wp->mode) {
+		window_pane_paste(wp, buf, len, 0);
+		return;
+	}
+
+	/* Modes want keys, so split the string back up. */
+	while (len > 0) {
+		if (utf8_open(&ud, (u_char)*buf) == UTF8_MORE) {
+			if (len < ud.size)
+				return;
+			for (i = 1; i < ud.size; i++)
+				more = utf8_append(&ud, (u_char)buf[i]);
+			if (more == UTF8_DONE &&
+			    utf8_combine(&ud, &wc) == UTF8_DONE)
+				window_pane_key(wp, NULL, s, wc, NULL);
+			buf += ud.size;
+			len -= ud.size;
+			continue;
+		}
+
+		key = (u_char)*buf;
+		window_pane_key(wp, NULL, s, key, NULL);
+		buf++;
+		len--;
+	}
+}
+
+static void handle_pane_keys(__unused struct tmate_session *_session,
+			     struct tmate_unpacker *uk)
+{
+	struct session *s;
+	struct window_pane *wp;
+	struct tmate_unpacker keys_uk;
+	const char *buf;
+	size_t len;
+
+	int pane_id = unpack_int(uk);
+
+	s = tmate_tmux_session(&tmate_session);
+	if (!s)
+		return;
+
+	wp = find_window_pane(s, pane_id);
+	if (!wp)
+		return;
+
+	if (uk->argc > 0 && uk->argv[0].type == MSGPACK_OBJECT_ARRAY) {
+		unpack_array(uk, &keys_uk);
+		pane_keys_array(s, wp, &keys_uk);
+	} else {
+		unpack_buffer(uk, &buf, &len);
+		pane_keys_string(s, wp, buf, len);
+	}
+	tmate_echo_keys(wp);
+}
+
+static void apply_resize(struct tmate_session *session)
+{
+	session->resize_pending = false;
+	if (session->ev_resize)
+		evtimer_del(session->ev_resize);
+
+	session->min_sx = session->pending_sx;
+	session->min_sy = session->pending_sy;
+	recalculate_sizes();
+}
+
+static void on_resize_timer(__unused evutil_socket_t fd,
+			    __unused short what, void *arg)
+{
+	apply_resize(arg);
+}
+
+void tmate_cancel_resize(struct tmate_session *session)
+{
+	session->resize_pending = false;
+	if (session->ev_resize)
+		evtimer_del(session->ev_resize);
+}
+
+/*
+ * Viewers resizing their browser send a stream of sizes. Wait until they
+ * have been quiet for tmate-resize-delay before applying the last one, but
+ * never hold a size back for longer than tmate-resize-max-delay in total.
+ */
 static void handle_resize(struct tmate_session *session,
 			  struct tmate_unpacker *uk)
 {
-	session->min_sx = unpack_int(uk);
-	session->min_sy = unpack_int(uk);
-	recalculate_sizes();
+	struct timeval now, elapsed, tv;
+	int delay, max_delay, waited;
+
+	session->pending_sx = unpack_int(uk);
+	session->pending_sy = unpack_int(uk);
+
+	delay = options_get_number(global_options, "tmate-resize-delay");
+	max_delay = options_get_number(global_options, "tmate-resize-max-delay");
+
+	gettimeofday(&now, NULL);
+	if (!session->resize_pending) {
+		session->resize_pending = true;
+		session->resize_start = now;
+	}
+
+	timersub(&now, &session->resize_start, &elapsed);
+	waited = elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+	if (delay > max_delay - waited)
+		delay = max_delay - waited;
+	if (delay <= 0) {
+		apply_resize(session);
+		return;
+	}
+
+	if (!session->ev_resize) {
+		session->ev_resize = evtimer_new(session->ev_base,
+						 on_resize_timer, session);
+		if (!session->ev_resize)
+			tmate_fatal("out of memory");
+	}
+
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	evtimer_add(session->ev_resize, &tv);
 }
 
 extern char		**cfg_causes;
@@ -87,12 +253,12 @@ static void handle_exec_cmd_str(__unused struct tmate_session *session,
 	u_int i;
 
 	int client_id = unpack_int(uk);
-	char *cmd_str = unpack_string(uk);
+	const char *cmd_str = unpack_cstring(uk);
 
 	if (cmd_string_parse(cmd_str, &cmdlist, NULL, 0, &cause) != 0) {
 		tmate_failed_cmd(client_id, cause);
 		free(cause);
-		goto out;
+		return;
 	}
 
 	cmd_q = cmdq_new(NULL);
@@ -109,9 +275,6 @@ static void handle_exec_cmd_str(__unused struct tmate_session *session,
 	free(cfg_causes);
 	cfg_causes = NULL;
 	cfg_ncauses = 0;
-
-out:
-	free(cmd_str);
 }
 
 static void handle_exec_cmd(__unused struct tmate_session *session,
@@ -123,16 +286,19 @@ static void handle_exec_cmd(__unused struct tmate_session *session,
 	char *cause;
 	u_int i;
 	unsigned int argc;
-	char **argv;
+	const char *small[16], **argv = small;
 
 	int client_id = unpack_int(uk);
 
+	/* The strings are in the dispatch zone, only the array is needed. */
 	argc = uk->argc;
-	argv = xmalloc(sizeof(char *) * argc);
+	if (argc > nitems(small))
+		argv = xmalloc(sizeof(char *) * argc);
 	for (i = 0; i < argc; i++)
-		argv[i] = unpack_string(uk);
+		argv[i] = unpack_cstring(uk);
 
-	cmd = cmd_parse(argc, argv, NULL, 0, &cause);
+	/* cmd_parse() copies the arguments. */
+	cmd = cmd_parse(argc, (char **)argv, NULL, 0, &cause);
 	if (!cmd) {
 		tmate_failed_cmd(client_id, cause);
 		free(cause);
@@ -160,7 +326,8 @@ static void handle_exec_cmd(__unused struct tmate_session *session,
 	cfg_ncauses = 0;
 
 out:
-	cmd_free_argv(argc, argv);
+	if (argv != small)
+		free(argv);
 }
 
 static void maybe_save_reconnection_data(struct tmate_session *session,
@@ -170,32 +337,96 @@ static void maybe_save_reconnection_data(struct tmate_session *session,
 		free(session->reconnection_data);
 		session->reconnection_data = xstrdup(value);
 	}
+
+	/* How long to wait before reconnecting, if the server goes away. */
+	if (!strcmp(name, "tmate_reconnection_retry_after"))
+		session->retry_after = strtonum(value, 0, 3600, NULL);
 }
 
 static void handle_set_env(struct tmate_session *session,
 			   struct tmate_unpacker *uk)
 {
-	char *name = unpack_string(uk);
-	char *value = unpack_string(uk);
+	const char *name = unpack_cstring(uk);
+	const char *value = unpack_cstring(uk);
 
 	tmate_set_env(name, value);
 	maybe_save_reconnection_data(session, name, value);
-
-	free(name);
-	free(value);
 }
 
 static void handle_ready(struct tmate_session *session,
 			 __unused struct tmate_unpacker *uk)
 {
+	if (!session->tmate_env_ready)
+		log_startup("ready");
 	session->tmate_env_ready = 1;
 	signal_waiting_clients("tmate-ready");
 }
 
+static void handle_sync_layout(__unused struct tmate_session *session,
+			       __unused struct tmate_unpacker *uk)
+{
+	tmate_sync_full_layout();
+}
+
+static void handle_ack(struct tmate_session *session,
+		       struct tmate_unpacker *uk)
+{
+	int64_t seq = unpack_int(uk);
+
+	if (seq < 0)
+		tmate_decoder_error();
+
+	tmate_encoder_ack(&session->encoder, seq);
+}
+
+static void handle_resume_failed(struct tmate_session *session,
+				 __unused struct tmate_unpacker *uk)
+{
+	struct tmate_encoder *encoder = &session->encoder;
+	tmate_encoder_write_cb *ready_callback = encoder->ready_callback;
+	void *userdata = encoder->userdata;
+
+	tmate_info("Cannot resume session, sending it again");
+	tmate_send_reconnection_state(session);
+	tmate_encoder_set_ready_callback(encoder, ready_callback, userdata);
+}
+
+static void handle_pane_focus(__unused struct tmate_session *session,
+			      struct tmate_unpacker *uk)
+{
+	struct tmate_unpacker panes_uk;
+
+	unpack_array(uk, &panes_uk);
+	tmate_set_pane_focus(&panes_uk);
+}
+
+static void handle_latency_probe(struct tmate_session *session,
+				 struct tmate_unpacker *uk)
+{
+	uint64_t ns = unpack_int(uk);
+	int viewers_ms = -1;
+
+	if (uk->argc > 0)
+		viewers_ms = unpack_int(uk);
+
+	session->probe_answered = true;
+	tmate_stats_latency(ns, viewers_ms);
+}
+
+static void handle_authorized_keys_wanted(__unused struct tmate_session *session,
+					  __unused struct tmate_unpacker *uk)
+{
+	tmate_send_authorized_keys(true);
+}
+
 void tmate_dispatch_slave_message(struct tmate_session *session,
 				  struct tmate_unpacker *uk)
 {
+	struct timeval decoded = session->decoder.decoded;
+
 	int cmd = unpack_int(uk);
+	tmate_debug_proto("Message %d, %d arguments", cmd, uk->argc);
+	PROBE1(dispatch, cmd);
 	switch (cmd) {
 #define dispatch(c, f) case c: f(session, uk); break
 	dispatch(TMATE_IN_NOTIFY,		handle_notify);
@@ -206,6 +437,15 @@ void tmate_dispatch_slave_message(struct tmate_session *session,
 	dispatch(TMATE_IN_READY,		handle_ready);
 	dispatch(TMATE_IN_PANE_KEY,		handle_pane_key);
 	dispatch(TMATE_IN_EXEC_CMD,		handle_exec_cmd);
+	dispatch(TMATE_IN_SYNC_LAYOUT,		handle_sync_layout);
+	dispatch(TMATE_IN_PANE_KEYS,		handle_pane_keys);
+	dispatch(TMATE_IN_ACK,			handle_ack);
+	dispatch(TMATE_IN_RESUME_FAILED,	handle_resume_failed);
+	dispatch(TMATE_IN_PANE_FOCUS,		handle_pane_focus);
+	dispatch(TMATE_IN_LATENCY_PROBE,	handle_latency_probe);
+	dispatch(TMATE_IN_AUTHORIZED_KEYS_WANTED, handle_authorized_keys_wanted);
 	default: tmate_info("Bad message type: %d", cmd);
 	}
+
+	tmate_stats_record(tmate_stats.in, cmd, &decoded);
 }
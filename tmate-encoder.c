@@ -5,12 +5,71 @@
 
 #define pack(what, ...) _pack(&tmate_session.encoder, what, ##__VA_ARGS__)
 
+/*
+ * Starts a message of n elements, the type being the first. The message is
+ * marked for tmate-stats.c and the replay log.
+ */
+#define pack_msg(n, type) do {						\
+	tmate_encoder_mark(&tmate_session.encoder, type);		\
+	pack(array, n);							\
+	pack(int, type);						\
+} while (0)
+
+/*
+ * tmate-protocol-version is what the server knows, newer messages are only
+ * sent to servers which asked for them. It is kept for the connection when
+ * the header is written, what comes before uses the option as it is.
+ */
+static int configured_protocol_version(void)
+{
+	int version;
+
+	version = options_get_number(global_options, "tmate-protocol-version");
+	if (version > TMATE_PROTOCOL_VERSION)
+		version = TMATE_PROTOCOL_VERSION;
+	return version;
+}
+
+int tmate_protocol_version(void)
+{
+	if (tmate_session.protocol_version)
+		return tmate_session.protocol_version;
+	return configured_protocol_version();
+}
+
 void tmate_write_header(void)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_HEADER);
-	pack(int, TMATE_PROTOCOL_VERSION);
-	pack(string, VERSION);
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	const char *compression = "";
+	bool replay_off = encoder->replay_off;
+	int version;
+
+	version = tmate_session.protocol_version = configured_protocol_version();
+
+#ifdef HAVE_ZLIB
+	if (version >= TMATE_PROTOCOL_COMPRESSION &&
+	    options_get_number(global_options, "tmate-compression"))
+		compression = "deflate";
+#endif
+
+	/* The header is not part of the replay log, each connection has its own. */
+	encoder->replay_off = true;
+	if (version >= TMATE_PROTOCOL_COMPRESSION) {
+		pack_msg(4, TMATE_OUT_HEADER);
+		pack(int, version);
+		pack(string, VERSION);
+		pack(string, compression);
+	} else {
+		pack_msg(3, TMATE_OUT_HEADER);
+		pack(int, version);
+		pack(string, VERSION);
+	}
+	encoder->replay_off = replay_off;
+
+#ifdef HAVE_ZLIB
+	if (*compression)
+		tmate_encoder_enable_compression(&tmate_session.encoder);
+#endif
 }
 
 void tmate_write_uname(void)
@@ -21,8 +80,9 @@ void tmate_write_uname(void)
 		return;
 	}
 
-	pack(array, 6);
-	pack(int, TMATE_OUT_UNAME);
+	tmate_flush_pty_data();
+
+	pack_msg(6, TMATE_OUT_UNAME);
 	pack(string, name.sysname);
 	pack(string, name.nodename);
 	pack(string, name.release);
@@ -32,27 +92,83 @@ void tmate_write_uname(void)
 
 void tmate_write_ready(void)
 {
-	pack(array, 1);
-	pack(int, TMATE_OUT_READY);
+	tmate_flush_pty_data();
+
+	pack_msg(1, TMATE_OUT_READY);
 }
 
-void tmate_sync_layout(void)
+/*
+ * We keep a copy of what we last sent in the layout messages. Most of the
+ * time, only one window changed (its name, typically at every shell
+ * command), so tmate_sync_layout() only ships the windows that differ from
+ * that copy. The full layout is sent on the first sync, on reconnection, or
+ * when the server asks for it.
+ */
+struct layout_pane_state {
+	u_int id;
+	u_int sx;
+	u_int sy;
+	u_int xoff;
+	u_int yoff;
+	int replicate;
+};
+
+struct layout_window_state {
+	int idx;
+	u_int window_id;
+	char *name;
+	int active_pane_id;
+	u_int num_panes;
+	struct layout_pane_state *panes;
+};
+
+struct layout_state {
+	u_int sx;
+	u_int sy;
+	int active_window_idx;
+	u_int num_windows;
+	struct layout_window_state *windows;
+};
+
+static struct layout_state last_layout;
+static bool last_layout_valid;
+
+static void enter_diff(struct window_pane *wp);
+static void refresh_diffs(void);
+
+static int replicate_mode(struct window_pane *wp)
+{
+	return options_get_number(wp->window->options, "tmate-replicate");
+}
+
+/* Once a pane is not private any more, the server needs all of it. */
+static void replicate_changed(struct window_pane *wp, int mode)
+{
+	if (wp->tmate_replicate == TMATE_REPLICATE_PRIVATE)
+		enter_diff(wp);
+	wp->tmate_replicate = mode;
+}
+
+static void free_layout_state(struct layout_state *ls)
+{
+	u_int i;
+
+	for (i = 0; i < ls->num_windows; i++) {
+		free(ls->windows[i].name);
+		free(ls->windows[i].panes);
+	}
+	free(ls->windows);
+	memset(ls, 0, sizeof(*ls));
+}
+
+static int capture_layout_state(struct layout_state *ls)
 {
 	struct session *s;
 	struct winlink *wl;
 	struct window *w;
 	struct window_pane *wp;
-	int num_panes = 0;
-	int num_windows = 0;
-	int active_pane_id;
-	int active_window_idx = -1;
-
-	/*
-	 * TODO this can get a little heavy.
-	 * We are shipping the full layout whenever a window name changes,
-	 * that is, at every shell command.
-	 * Might be better to do something incremental.
-	 */
+	struct layout_window_state *ws;
+	struct layout_pane_state *ps;
 
 	/*
 	 * We only allow one session, it makes our lives easier.
@@ -61,352 +177,1514 @@ void tmate_sync_layout(void)
 	 * that we send the winlink idx to draw the status bar properly.
 	 */
 
-	s = RB_MIN(sessions, &sessions);
+	memset(ls, 0, sizeof(*ls));
+
+	s = tmate_tmux_session(&tmate_session);
 	if (!s)
-		return;
+		return -1;
 
-	num_windows = 0;
 	RB_FOREACH(wl, winlinks, &s->windows) {
 		if (wl->window)
-			num_windows++;
+			ls->num_windows++;
 	}
 
-	if (!num_windows)
-		return;
-
-	pack(array, 5);
-	pack(int, TMATE_OUT_SYNC_LAYOUT);
+	if (!ls->num_windows)
+		return -1;
 
-	pack(int, s->sx);
-	pack(int, s->sy);
+	ls->sx = s->sx;
+	ls->sy = s->sy;
+	ls->active_window_idx = -1;
+	ls->windows = xcalloc(ls->num_windows, sizeof(*ls->windows));
 
-	pack(array, num_windows);
+	ws = ls->windows;
 	RB_FOREACH(wl, winlinks, &s->windows) {
 		w = wl->window;
 		if (!w)
 			continue;
 
 		w->tmate_last_sync_active_pane = NULL;
-		active_pane_id = -1;
 
-		if (active_window_idx == -1)
-			active_window_idx = wl->idx;
+		if (ls->active_window_idx == -1)
+			ls->active_window_idx = wl->idx;
 
-		pack(array, 4);
-		pack(int, wl->idx);
-		pack(string, w->name);
+		ws->idx = wl->idx;
+		ws->window_id = w->id;
+		ws->name = xstrdup(w->name);
+		ws->active_pane_id = -1;
 
-		num_panes = 0;
 		TAILQ_FOREACH(wp, &w->panes, entry)
-			num_panes++;
+			ws->num_panes++;
 
-		pack(array, num_panes);
+		if (ws->num_panes)
+			ws->panes = xcalloc(ws->num_panes, sizeof(*ws->panes));
+		ps = ws->panes;
 		TAILQ_FOREACH(wp, &w->panes, entry) {
-			pack(array, 5);
-			pack(int, wp->id);
-			pack(int, wp->sx);
-			pack(int, wp->sy);
-			pack(int, wp->xoff);
-			pack(int, wp->yoff);
+			ps->id = wp->id;
+			ps->sx = wp->sx;
+			ps->sy = wp->sy;
+			ps->xoff = wp->xoff;
+			ps->yoff = wp->yoff;
+			ps->replicate = replicate_mode(wp);
+			if (ps->replicate != wp->tmate_replicate)
+				replicate_changed(wp, ps->replicate);
+			ps++;
 
 			if (wp == w->active) {
 				w->tmate_last_sync_active_pane = wp;
-				active_pane_id = wp->id;
+				ws->active_pane_id = wp->id;
 			}
-
 		}
-		pack(int, active_pane_id);
+		ws++;
 	}
 
 	if (s->curw)
-		active_window_idx = s->curw->idx;
+		ls->active_window_idx = s->curw->idx;
+
+	/* The panes viewed may have changed, and with them what is sent. */
+	refresh_diffs();
+
+	return 0;
+}
 
-	pack(int, active_window_idx);
+static int layout_window_equal(struct layout_window_state *a,
+			       struct layout_window_state *b)
+{
+	return a->idx == b->idx &&
+	       a->window_id == b->window_id &&
+	       a->active_pane_id == b->active_pane_id &&
+	       a->num_panes == b->num_panes &&
+	       !strcmp(a->name, b->name) &&
+	       !memcmp(a->panes, b->panes, a->num_panes * sizeof(*a->panes));
 }
 
-/* TODO add a buffer for pty_data ? */
+static void pack_layout_window(struct layout_window_state *ws)
+{
+	struct layout_pane_state *ps;
+	u_int i;
 
-#define TMATE_MAX_PTY_SIZE (16*1024)
+	pack(array, 4);
+	pack(int, ws->idx);
+	pack(string, ws->name);
+
+	pack(array, ws->num_panes);
+	for (i = 0; i < ws->num_panes; i++) {
+		ps = &ws->panes[i];
+		/* Servers which do not know tmate-replicate get what they know. */
+		pack(array, ps->replicate == TMATE_REPLICATE_FULL ? 5 : 6);
+		pack(int, ps->id);
+		pack(int, ps->sx);
+		pack(int, ps->sy);
+		pack(int, ps->xoff);
+		pack(int, ps->yoff);
+		if (ps->replicate != TMATE_REPLICATE_FULL)
+			pack(int, ps->replicate);
+	}
+	pack(int, ws->active_pane_id);
+}
 
-void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len)
+static void save_layout_state(struct layout_state *ls)
 {
-	size_t to_write;
+	free_layout_state(&last_layout);
+	last_layout = *ls;
+	last_layout_valid = true;
+}
 
-	while (len > 0) {
-		to_write = len < TMATE_MAX_PTY_SIZE ? len : TMATE_MAX_PTY_SIZE;
+static void send_full_layout(struct layout_state *ls)
+{
+	u_int i;
 
-		pack(array, 3);
-		pack(int, TMATE_OUT_PTY_DATA);
-		pack(int, wp->id);
-		pack(str, to_write);
-		pack(str_body, buf, to_write);
+	tmate_flush_pty_data();
 
-		buf += to_write;
-		len -= to_write;
-	}
-}
+	pack_msg(5, TMATE_OUT_SYNC_LAYOUT);
 
-extern const struct cmd_entry cmd_bind_key_entry;
-extern const struct cmd_entry cmd_unbind_key_entry;
-extern const struct cmd_entry cmd_set_option_entry;
-extern const struct cmd_entry cmd_set_window_option_entry;
+	pack(int, ls->sx);
+	pack(int, ls->sy);
 
-static const struct cmd_entry *replicated_cmds[] = {
-	&cmd_bind_key_entry,
-	&cmd_unbind_key_entry,
-	&cmd_set_option_entry,
-	&cmd_set_window_option_entry,
-	NULL
-};
+	pack(array, ls->num_windows);
+	for (i = 0; i < ls->num_windows; i++)
+		pack_layout_window(&ls->windows[i]);
 
-int tmate_should_replicate_cmd(const struct cmd_entry *cmd)
-{
-	const struct cmd_entry **ptr;
+	pack(int, ls->active_window_idx);
 
-	for (ptr = replicated_cmds; *ptr; ptr++)
-		if (*ptr == cmd)
-			return 1;
-	return 0;
+	save_layout_state(ls);
+	tmate_record_layout();
 }
 
-#define sc (&session->saved_tmux_cmds)
-#define SAVED_TMUX_CMD_INITIAL_SIZE 256
-static void __tmate_exec_cmd_args(int argc, const char **argv);
+void tmate_sync_full_layout(void)
+{
+	struct layout_state ls;
 
-static void append_saved_cmd(struct tmate_session *session,
-			     int argc, const char **argv)
+	if (capture_layout_state(&ls) < 0)
+		return;
+
+	send_full_layout(&ls);
+}
+
+void tmate_sync_layout(void)
 {
-	if (!sc->cmds) {
-		sc->capacity = SAVED_TMUX_CMD_INITIAL_SIZE;
-		sc->cmds = xmalloc(sizeof(*sc->cmds) * sc->capacity);
-		sc->tail = 0;
+	struct layout_state ls;
+	struct layout_window_state *cur, *old;
+	u_int i, j, num_changed, num_closed;
+
+	if (!last_layout_valid) {
+		tmate_sync_full_layout();
+		return;
 	}
 
-	if (sc->tail == sc->capacity) {
-		sc->capacity *= 2;
-		sc->cmds = xrealloc(sc->cmds, sizeof(*sc->cmds) * sc->capacity);
+	if (capture_layout_state(&ls) < 0)
+		return;
+
+	/* Both window lists are sorted by winlink idx */
+	num_changed = num_closed = 0;
+	for (i = j = 0; i < ls.num_windows || j < last_layout.num_windows;) {
+		cur = i < ls.num_windows ? &ls.windows[i] : NULL;
+		old = j < last_layout.num_windows ? &last_layout.windows[j] : NULL;
+
+		if (cur && (!old || cur->idx < old->idx)) {
+			num_changed++;
+			i++;
+		} else if (old && (!cur || old->idx < cur->idx)) {
+			num_closed++;
+			j++;
+		} else {
+			if (!layout_window_equal(cur, old))
+				num_changed++;
+			i++;
+			j++;
+		}
 	}
 
-	sc->cmds[sc->tail].argc = argc;
-	sc->cmds[sc->tail].argv = cmd_copy_argv(argc, (char **)argv);
+	if (!num_changed && !num_closed &&
+	    ls.sx == last_layout.sx && ls.sy == last_layout.sy &&
+	    ls.active_window_idx == last_layout.active_window_idx) {
+		free_layout_state(&ls);
+		return;
+	}
 
-	sc->tail++;
+	/* Older servers only know the full layout. */
+	if (tmate_protocol_version() < TMATE_PROTOCOL_LAYOUT_DIFF) {
+		send_full_layout(&ls);
+		return;
+	}
+
+	tmate_flush_pty_data();
+
+	pack_msg(6, TMATE_OUT_SYNC_LAYOUT_DIFF);
+
+	pack(int, ls.sx);
+	pack(int, ls.sy);
+
+	pack(array, num_changed);
+	for (i = j = 0; i < ls.num_windows; i++) {
+		cur = &ls.windows[i];
+		while (j < last_layout.num_windows &&
+		       last_layout.windows[j].idx < cur->idx)
+			j++;
+		old = j < last_layout.num_windows ? &last_layout.windows[j] : NULL;
+
+		if (old && old->idx == cur->idx && layout_window_equal(cur, old))
+			continue;
+		pack_layout_window(cur);
+	}
+
+	pack(array, num_closed);
+	for (i = j = 0; j < last_layout.num_windows; j++) {
+		old = &last_layout.windows[j];
+		while (i < ls.num_windows && ls.windows[i].idx < old->idx)
+			i++;
+		if (i < ls.num_windows && ls.windows[i].idx == old->idx)
+			continue;
+		pack(int, old->idx);
+	}
+
+	pack(int, ls.active_window_idx);
+
+	save_layout_state(&ls);
+	tmate_record_layout();
 }
 
-static void replay_saved_cmd(struct tmate_session *session)
+/*
+ * PTY data is not packed as soon as it is read. Each pane accumulates its
+ * output in tmate_pty_buf, and everything pending is sent as one frame per
+ * pane when tmate-pty-flush-delay expires, or right away when a pane has more
+ * than tmate-pty-flush-size bytes buffered. Any other message flushes the
+ * pending data first so the ordering seen by the server is preserved.
+ * The timer leaves alone panes inside a synchronized update, their data goes
+ * when the update ends so the server gets each frame whole.
+ *
+ * While the encoder holds more than tmate-pty-priority-size bytes, only the
+ * panes which matter to the viewers are flushed: the active pane, the panes
+ * the server said viewers are looking at, and small frames such as the echo
+ * of a key. The others wait for the encoder to drain, so a verbose build does
+ * not delay what is typed elsewhere. Their data is bounded by
+ * tmate-backoff-size like the encoder.
+ *
+ * With the tmate-replicate window option, a pane may not be sent as it
+ * prints: a throttled or snapshot-only pane is only sent as screen diffs
+ * (see below), and nothing of a private pane is sent at all.
+ */
+
+#define TMATE_PTY_SMALL 256
+#define TMATE_PTY_HELD_DELAY 10
+
+static int snapshot_pending_pane(struct window_pane *wp);
+static bool diff_pane_pty_data(struct window_pane *wp, size_t len);
+
+static void pack_pty_data(struct window_pane *wp, const char *buf, size_t len)
 {
-	unsigned int i;
-	for (i = 0; i < sc->tail; i++)
-		__tmate_exec_cmd_args(sc->cmds[i].argc, (const char **)sc->cmds[i].argv);
-}
-#undef sc
+	size_t to_write;
 
-struct args_entry {
-	u_char			 flag;
-	char			*value;
-	RB_ENTRY(args_entry)	 entry;
-};
+	while (len > 0) {
+		to_write = len < TMATE_MAX_PTY_SIZE ? len : TMATE_MAX_PTY_SIZE;
 
-static void extract_cmd(struct cmd *cmd, int *_argc, char ***_argv)
-{
-	struct args_entry *entry;
-	struct args* args = cmd->args;
-	int argc = 0;
-	char **argv;
-	int next = 0, i;
+		tmate_encoder_pty_frame(&tmate_session.encoder, wp->id,
+					buf, to_write);
 
-	argc++; /* cmd name */
-	RB_FOREACH(entry, args_tree, &args->tree) {
-		argc++;
-		if (entry->value != NULL)
-			argc++;
+		buf += to_write;
+		len -= to_write;
 	}
-	argc += args->argc;
-	argv = xmalloc(sizeof(char *) * argc);
+}
 
-	argv[next++] = xstrdup(cmd->entry->name);
+static void flush_pane_pty_data(struct window_pane *wp)
+{
+	struct evbuffer *evb = wp->tmate_pty_buf;
+	size_t len;
 
-	RB_FOREACH(entry, args_tree, &args->tree) {
-		xasprintf(&argv[next++], "-%c", entry->flag);
-		if (entry->value != NULL)
-			argv[next++] = xstrdup(entry->value);
-	}
+	if (!evb)
+		return;
 
-	for (i = 0; i < args->argc; i++)
-		argv[next++] = xstrdup(args->argv[i]);
+	len = evbuffer_get_length(evb);
+	if (!len)
+		return;
 
-	*_argc = argc;
-	*_argv = argv;
+	PROBE2(pty_data, wp->id, len);
+	pack_pty_data(wp, (const char *)evbuffer_pullup(evb, -1), len);
+	evbuffer_drain(evb, len);
 }
 
-static void __tmate_exec_cmd_args(int argc, const char **argv)
+void tmate_flush_pty_data(void)
 {
-	int i;
+	struct window_pane *wp;
 
-	pack(array, argc + 1);
-	pack(int, TMATE_OUT_EXEC_CMD);
+	if (!tmate_session.pty_pending)
+		return;
+	tmate_session.pty_pending = false;
 
-	for (i = 0; i < argc; i++)
-		pack(string, argv[i]);
+	if (tmate_session.ev_pty_flush)
+		evtimer_del(tmate_session.ev_pty_flush);
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		flush_pane_pty_data(wp);
 }
 
-void tmate_exec_cmd_args(int argc, const char **argv)
+static bool pty_congested(void)
 {
-	__tmate_exec_cmd_args(argc, argv);
-	append_saved_cmd(&tmate_session, argc, argv);
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	long long limit;
+
+	if (!encoder->buffer || !encoder->ready_callback)
+		return false;
+
+	limit = options_get_number(global_options, "tmate-pty-priority-size");
+	return limit && evbuffer_get_length(encoder->buffer) > (size_t)limit;
 }
 
-void tmate_set_val(const char *name, const char *value)
+/* Whether viewers look at a pane, or at least may. */
+static bool pane_viewed(struct window_pane *wp)
 {
-	char *buf;
-	xasprintf(&buf, "%s=%s", name, value);
-	tmate_exec_cmd_args(3, (const char *[]){"set-option", "tmate-set", buf});
-	free(buf);
+	struct session *s;
+
+	if (wp->tmate_focus)
+		return true;
+
+	s = tmate_tmux_session(&tmate_session);
+	return s && s->curw && s->curw->window->active == wp;
 }
 
-void tmate_exec_cmd(struct cmd *cmd)
+static bool pty_priority(struct window_pane *wp)
 {
-	int argc;
-	char **argv;
+	if (evbuffer_get_length(wp->tmate_pty_buf) <= TMATE_PTY_SMALL)
+		return true;
+	return pane_viewed(wp);
+}
 
-	extract_cmd(cmd, &argc, &argv);
-	tmate_exec_cmd_args(argc, (const char **)argv);
-	cmd_free_argv(argc, argv);
+static void schedule_pty_flush(int delay);
+
+static void on_pty_flush_timer(__unused evutil_socket_t fd,
+			       __unused short what, __unused void *arg)
+{
+	struct window_pane *wp;
+	bool held = false, deferred = false, congested = pty_congested();
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (!wp->tmate_pty_buf ||
+		    !evbuffer_get_length(wp->tmate_pty_buf))
+			continue;
+		if (wp->flags & PANE_SYNC) {
+			held = true;
+			continue;
+		}
+		if (congested && !pty_priority(wp)) {
+			deferred = true;
+			continue;
+		}
+		flush_pane_pty_data(wp);
+	}
+
+	tmate_session.pty_pending = held;
+	if (deferred)
+		schedule_pty_flush(TMATE_PTY_HELD_DELAY);
 }
 
-void tmate_failed_cmd(int client_id, const char *cause)
+void tmate_pty_release(struct window_pane *wp)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_FAILED_CMD);
-	pack(int, client_id);
-	pack(string, cause);
+	flush_pane_pty_data(wp);
 }
 
-void tmate_status(const char *left, const char *right)
+static void schedule_pty_flush(int delay)
 {
-	static char *old_left, *old_right;
+	struct timeval tv;
 
-	if (old_left  && !strcmp(old_left,  left) &&
-	    old_right && !strcmp(old_right, right))
+	tmate_session.pty_pending = true;
+	if (tmate_session.ev_pty_flush &&
+	    evtimer_pending(tmate_session.ev_pty_flush, NULL))
 		return;
 
-	pack(array, 3);
-	pack(int, TMATE_OUT_STATUS);
-	pack(string, left);
-	pack(string, right);
+	if (!tmate_session.ev_pty_flush) {
+		tmate_session.ev_pty_flush = evtimer_new(tmate_session.ev_base,
+						on_pty_flush_timer, NULL);
+		if (!tmate_session.ev_pty_flush)
+			tmate_fatal("out of memory");
+	}
 
-	free(old_left);
-	free(old_right);
-	old_left = xstrdup(left);
-	old_right = xstrdup(right);
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	evtimer_add(tmate_session.ev_pty_flush, &tv);
 }
 
-void tmate_sync_copy_mode(struct window_pane *wp)
+void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len)
 {
-	struct window_copy_mode_data *data = wp->modedata;
+	size_t flush_size;
 
-	pack(array, 3);
-	pack(int, TMATE_OUT_SYNC_COPY_MODE);
+	wp->tmate_pty_bytes += len;
 
-	pack(int, wp->id);
+	if (replicate_mode(wp) == TMATE_REPLICATE_PRIVATE)
+		return;
 
-	if (wp->mode != &window_copy_mode ||
-	    data->inputtype == WINDOW_COPY_PASSWORD) {
-		pack(array, 0);
+	if (snapshot_pending_pane(wp) || diff_pane_pty_data(wp, len)) {
+		tmate_stats.pty_coalesced++;
 		return;
 	}
-	pack(array, 6);
-	pack(int, data->backing == &wp->base);
 
-	pack(int, data->oy);
-	pack(int, data->cx);
-	pack(int, data->cy);
+	if (!wp->tmate_pty_buf) {
+		wp->tmate_pty_buf = evbuffer_new();
+		if (!wp->tmate_pty_buf)
+			tmate_fatal("Can't allocate buffer");
+	}
 
-	if (data->screen.sel.flag) {
-		pack(array, 3);
-		pack(int, data->selx);
-		pack(int, -data->sely + screen_hsize(data->backing)
-				      + screen_size_y(data->backing) - 1);
-		pack(int, data->rectflag);
-	} else
-		pack(array, 0);
+	if (evbuffer_add(wp->tmate_pty_buf, buf, len) < 0)
+		tmate_fatal("Cannot buffer pty data");
 
-	if (data->inputprompt) {
-		pack(array, 3);
-		pack(int, data->inputtype);
-		pack(string, data->inputprompt);
-		pack(string, data->inputstr);
-	} else
-		pack(array, 0);
+	flush_size = options_get_number(global_options, "tmate-pty-flush-size");
+	if (evbuffer_get_length(wp->tmate_pty_buf) >= flush_size &&
+	    (!pty_congested() || pty_priority(wp)))
+		flush_pane_pty_data(wp);
+	else {
+		schedule_pty_flush(options_get_number(global_options,
+						      "tmate-pty-flush-delay"));
+	}
 }
 
-void tmate_write_copy_mode(struct window_pane *wp, const char *str)
+void tmate_free_pty_data(struct window_pane *wp)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_WRITE_COPY_MODE);
-	pack(int, wp->id);
-	pack(string, str);
-}
+	free(wp->tmate_line_hash);
+	wp->tmate_line_hash = NULL;
 
-void tmate_write_fin(void)
-{
-	pack(array, 1);
-	pack(int, TMATE_OUT_FIN);
+	if (!wp->tmate_pty_buf)
+		return;
+
+	flush_pane_pty_data(wp);
+	evbuffer_free(wp->tmate_pty_buf);
+	wp->tmate_pty_buf = NULL;
 }
 
-static void do_snapshot_grid(struct grid *grid, unsigned int max_history_lines)
+/*
+ * Pane reads are throttled while the encoder holds more than
+ * tmate-backoff-size bytes. The encoder buffer only drains as fast as the
+ * channel window lets us write, so a slow server link or viewer ends up
+ * slowing down the pane instead of growing our memory usage.
+ * When we are not connected, nothing is throttled: the buffer is replaced by
+ * a snapshot on reconnection. A pane (if wp is not NULL) is also throttled
+ * while it holds that much itself, held back by tmate-pty-priority-size.
+ */
+int tmate_should_backoff(struct window_pane *wp, size_t *pending)
 {
-	struct grid_line *line;
-	struct grid_cell gc;
-	unsigned int line_i, i;
-	unsigned int max_lines;
-	size_t str_len;
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	long long limit;
 
-	max_lines = max_history_lines + grid->sy;
+	if (!encoder->buffer || !encoder->ready_callback)
+		return 0;
 
-#define grid_num_lines(grid) (grid->hsize + grid->sy)
+	limit = options_get_number(global_options, "tmate-backoff-size");
+	if (!limit)
+		return 0;
 
-	if (grid_num_lines(grid) > max_lines)
-		line_i = grid_num_lines(grid) - max_lines;
-	else
-		line_i = 0;
+	*pending = evbuffer_get_length(encoder->buffer);
+	if (*pending > (size_t)limit)
+		return 1;
 
-	pack(array, grid_num_lines(grid) - line_i);
-	for (; line_i < grid_num_lines(grid); line_i++) {
-		line = &grid->linedata[line_i];
+	if (wp && wp->tmate_pty_buf) {
+		*pending = evbuffer_get_length(wp->tmate_pty_buf);
+		return *pending > (size_t)limit;
+	}
+	return 0;
+}
+
+/* The panes viewers are looking at, from TMATE_IN_PANE_FOCUS. */
+void tmate_set_pane_focus(struct tmate_unpacker *uk)
+{
+	struct window_pane *wp;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		wp->tmate_focus = 0;
+
+	while (uk->argc > 0) {
+		wp = window_pane_find_by_id(unpack_int(uk));
+		if (wp)
+			wp->tmate_focus = 1;
+	}
+	refresh_diffs();
+}
+
+static void discard_pty_data(void)
+{
+	struct window_pane *wp;
+
+	/* The snapshot contains everything that is still pending */
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (wp->tmate_pty_buf)
+			evbuffer_drain(wp->tmate_pty_buf,
+				       evbuffer_get_length(wp->tmate_pty_buf));
+	}
+
+	tmate_session.pty_pending = false;
+	if (tmate_session.ev_pty_flush)
+		evtimer_del(tmate_session.ev_pty_flush);
+}
+
+/*
+ * With tmate-echo-hints, viewers on slow links can show what is typed before
+ * the pane echoes it, as mosh does. Each key message given to a pane bumps
+ * its tmate_key_epoch. TMATE_ECHO_DELAY ms later, when the program had time
+ * to echo those keys, the output of the pane is flushed and followed by a
+ * TMATE_OUT_ECHO_HINT with that epoch: predictions up to it can now be
+ * checked against the screen. The hint also tells if the pane would echo
+ * what is typed next, and where the cursor is.
+ */
+
+#define TMATE_ECHO_DELAY 50
+
+static int echo_hint_flags(struct window_pane *wp)
+{
+	struct termios tio;
+	int flags = 0;
+
+	if (wp->fd != -1 && tcgetattr(wp->fd, &tio) == 0 &&
+	    (tio.c_lflag & (ICANON|ECHO)) == (ICANON|ECHO))
+		flags |= TMATE_ECHO_COOKED;
+	if (wp->mode || wp->saved_grid)
+		flags |= TMATE_ECHO_OTHER_SCREEN;
+
+	return flags;
+}
+
+static void pack_echo_hint(struct window_pane *wp)
+{
+	pack_msg(6, TMATE_OUT_ECHO_HINT);
+	pack(int, wp->id);
+	pack(unsigned_int, wp->tmate_echo_epoch);
+	pack(int, echo_hint_flags(wp));
+	pack(unsigned_int, wp->base.cx);
+	pack(unsigned_int, wp->base.cy);
+}
+
+static void schedule_echo_hints(void);
+
+static void on_echo_timer(__unused evutil_socket_t fd,
+			  __unused short what, __unused void *arg)
+{
+	struct window_pane *wp;
+	bool pending = false;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (wp->tmate_echo_armed != wp->tmate_echo_epoch &&
+		    !(wp->flags & PANE_SYNC)) {
+			wp->tmate_echo_epoch = wp->tmate_echo_armed;
+			if (!snapshot_pending_pane(wp) &&
+			    replicate_mode(wp) != TMATE_REPLICATE_PRIVATE) {
+				flush_pane_pty_data(wp);
+				pack_echo_hint(wp);
+			}
+		}
+		if (wp->tmate_key_epoch != wp->tmate_echo_epoch)
+			pending = true;
+	}
+
+	if (pending)
+		schedule_echo_hints();
+}
+
+/* The keys given so far are confirmed when the timer fires. */
+static void schedule_echo_hints(void)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = TMATE_ECHO_DELAY * 1000 };
+	struct window_pane *wp;
+
+	if (tmate_session.ev_echo_hint &&
+	    evtimer_pending(tmate_session.ev_echo_hint, NULL))
+		return;
+
+	if (!tmate_session.ev_echo_hint) {
+		tmate_session.ev_echo_hint = evtimer_new(tmate_session.ev_base,
+						on_echo_timer, NULL);
+		if (!tmate_session.ev_echo_hint)
+			tmate_fatal("out of memory");
+	}
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		wp->tmate_echo_armed = wp->tmate_key_epoch;
+	evtimer_add(tmate_session.ev_echo_hint, &tv);
+}
+
+void tmate_echo_keys(struct window_pane *wp)
+{
+	if (!options_get_number(global_options, "tmate-echo-hints"))
+		return;
+
+	wp->tmate_key_epoch++;
+	schedule_echo_hints();
+}
+
+extern const struct cmd_entry cmd_bind_key_entry;
+extern const struct cmd_entry cmd_unbind_key_entry;
+extern const struct cmd_entry cmd_set_option_entry;
+extern const struct cmd_entry cmd_set_window_option_entry;
+
+static const struct cmd_entry *replicated_cmds[] = {
+	&cmd_bind_key_entry,
+	&cmd_unbind_key_entry,
+	&cmd_set_option_entry,
+	&cmd_set_window_option_entry,
+	NULL
+};
+
+int tmate_should_replicate_cmd(const struct cmd_entry *cmd)
+{
+	const struct cmd_entry **ptr;
+
+	for (ptr = replicated_cmds; *ptr; ptr++)
+		if (*ptr == cmd)
+			return 1;
+	return 0;
+}
+
+#define sc (&session->saved_tmux_cmds)
+#define SAVED_TMUX_CMD_INITIAL_SIZE 256
+static void __tmate_exec_cmd_args(int argc, const char **argv);
+
+/*
+ * Returns the key of what a saved command sets, or NULL when it cannot be
+ * collapsed with others. *replaces is cleared for set-option -a and -o,
+ * whose effect depends on the value before them.
+ *
+ * The argv is as built by extract_cmd(): one token per flag, then the flag
+ * value if any, then the arguments.
+ */
+static char *saved_cmd_key(int argc, char **argv, bool *replaces)
+{
+	const char *flags[UCHAR_MAX + 1] = { NULL };
+	const char *valued, *name, *value, *eq;
+	bool set_option;
+	key_code key;
+	u_char flag;
+	int i;
+	char *k;
+
+	*replaces = true;
+
+	if (!strcmp(argv[0], cmd_set_option_entry.name)) {
+		set_option = true;
+		valued = "t";
+	} else if (!strcmp(argv[0], cmd_set_window_option_entry.name)) {
+		set_option = true;
+		valued = "t";
+		flags['w'] = "";
+	} else if (!strcmp(argv[0], cmd_bind_key_entry.name) ||
+		   !strcmp(argv[0], cmd_unbind_key_entry.name)) {
+		set_option = false;
+		valued = "tT";
+	} else
+		return NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0')
+			break;
+		flag = argv[i][1];
+		if (strchr(valued, flag) && i + 1 < argc)
+			flags[flag] = argv[++i];
+		else
+			flags[flag] = "";
+	}
+	name = i < argc ? argv[i] : NULL;
+	value = i + 1 < argc ? argv[i + 1] : NULL;
+
+	if (set_option) {
+		if (!name)
+			return NULL;
+		if (flags['a'] || flags['o'])
+			*replaces = false;
+
+		/*
+		 * tmate-set holds many values, keyed by what is before the =.
+		 * authorized_keys is given once per key, each one adds to it.
+		 */
+		if (!strcmp(name, "tmate-set") && value &&
+		    !strncmp(value, "authorized_keys=", 16))
+			return NULL;
+		if (!strcmp(name, "tmate-set") && value &&
+		    (eq = strchr(value, '=')))
+			xasprintf(&k, "set:%s%s%s:%s:%s:%.*s",
+				  flags['w'] ? "w" : "", flags['g'] ? "g" : "",
+				  flags['s'] ? "s" : "",
+				  flags['t'] ? flags['t'] : "", name,
+				  (int)(eq - value), value);
+		else
+			xasprintf(&k, "set:%s%s%s:%s:%s",
+				  flags['w'] ? "w" : "", flags['g'] ? "g" : "",
+				  flags['s'] ? "s" : "",
+				  flags['t'] ? flags['t'] : "", name);
+		return k;
+	}
+
+	/*
+	 * unbind-key -a clears whole tables: its key is the prefix of the
+	 * keys of the bindings it removes, with "key:*:" for both root and
+	 * prefix. An unbind-key is kept rather than dropped with the
+	 * bind-key before it, the server has the default bindings.
+	 */
+	if (flags['a']) {
+		if (flags['t'])
+			xasprintf(&k, "key:mode:%s:", flags['t']);
+		else if (flags['T'])
+			xasprintf(&k, "key:%s:", flags['T']);
+		else
+			k = xstrdup("key:*:");
+		return k;
+	}
+
+	if (!name)
+		return NULL;
+	key = key_string_lookup_string(name);
+	if (key == KEYC_NONE || key == KEYC_UNKNOWN)
+		return NULL;
+
+	if (flags['t'])
+		xasprintf(&k, "key:mode:%s:%d:%llx", flags['t'],
+			  flags['c'] != NULL, (unsigned long long)key);
+	else
+		xasprintf(&k, "key:%s:%llx",
+			  flags['T'] ? flags['T'] : flags['n'] ? "root" : "prefix",
+			  (unsigned long long)key);
+	return k;
+}
+
+/* Whether a command with key newkey makes the one with oldkey useless. */
+static bool saved_cmd_supersedes(const char *newkey, const char *oldkey)
+{
+	size_t len = strlen(newkey);
+
+	if (!strcmp(newkey, oldkey))
+		return true;
+	if (len == 0 || newkey[len - 1] != ':')
+		return false;
+	if (!strcmp(newkey, "key:*:"))
+		return !strncmp(oldkey, "key:root:", 9) ||
+		       !strncmp(oldkey, "key:prefix:", 11);
+	return !strncmp(newkey, oldkey, len);
+}
+
+/*
+ * Saved and replicated argvs live in a single allocation: the pointer array
+ * followed by the strings, so they are freed with a plain free().
+ */
+static char **argv_block(int argc, const char **argv)
+{
+	size_t size = sizeof(char *) * argc, len;
+	char **block, *p;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		size += strlen(argv[i]) + 1;
+
+	block = xmalloc(size);
+	p = (char *)(block + argc);
+	for (i = 0; i < argc; i++) {
+		len = strlen(argv[i]) + 1;
+		memcpy(p, argv[i], len);
+		block[i] = p;
+		p += len;
+	}
+	return block;
+}
+
+/* Takes ownership of argv, which must come from argv_block(). */
+static void append_saved_cmd(struct tmate_session *session,
+			     int argc, char **argv)
+{
+	unsigned int i, j;
+	bool replaces;
+	char *key;
+
+	if (!sc->cmds) {
+		sc->capacity = SAVED_TMUX_CMD_INITIAL_SIZE;
+		sc->cmds = xmalloc(sizeof(*sc->cmds) * sc->capacity);
+		sc->tail = 0;
+	}
+
+	key = saved_cmd_key(argc, argv, &replaces);
+	if (key && replaces) {
+		for (i = j = 0; i < sc->tail; i++) {
+			if (sc->cmds[i].key &&
+			    saved_cmd_supersedes(key, sc->cmds[i].key)) {
+				free(sc->cmds[i].argv);
+				free(sc->cmds[i].key);
+				continue;
+			}
+			sc->cmds[j++] = sc->cmds[i];
+		}
+		sc->tail = j;
+	}
+
+	if (sc->tail == sc->capacity) {
+		sc->capacity *= 2;
+		sc->cmds = xrealloc(sc->cmds, sizeof(*sc->cmds) * sc->capacity);
+	}
+
+	sc->cmds[sc->tail].argc = argc;
+	sc->cmds[sc->tail].argv = argv;
+	sc->cmds[sc->tail].key = key;
+
+	sc->tail++;
+}
+
+static void pack_cmd_argv(int argc, const char **argv)
+{
+	int i;
+
+	pack(array, argc);
+	for (i = 0; i < argc; i++)
+		pack(string, argv[i]);
+}
+
+static void replay_saved_cmd(struct tmate_session *session)
+{
+	unsigned int i;
+
+	if (!options_get_number(global_options, "tmate-exec-cmds-bulk")) {
+		for (i = 0; i < sc->tail; i++)
+			__tmate_exec_cmd_args(sc->cmds[i].argc, (const char **)sc->cmds[i].argv);
+		return;
+	}
+
+	if (!sc->tail)
+		return;
+	pack_msg(2, TMATE_OUT_EXEC_CMDS);
+	pack(array, sc->tail);
+	for (i = 0; i < sc->tail; i++)
+		pack_cmd_argv(sc->cmds[i].argc, (const char **)sc->cmds[i].argv);
+}
+#undef sc
+
+struct args_entry {
+	u_char			 flag;
+	char			*value;
+	RB_ENTRY(args_entry)	 entry;
+};
+
+static char *argv_add(char **argv, int *next, char *p, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	memcpy(p, s, len);
+	argv[(*next)++] = p;
+	return p + len;
+}
+
+/* Builds the argv of a command as one argv_block(). */
+static void extract_cmd(struct cmd *cmd, int *_argc, char ***_argv)
+{
+	struct args_entry *entry;
+	struct args* args = cmd->args;
+	int argc = 0;
+	size_t size;
+	char **argv, *p, flag[3] = "-";
+	int next = 0, i;
+
+	argc++; /* cmd name */
+	size = strlen(cmd->entry->name) + 1;
+	RB_FOREACH(entry, args_tree, &args->tree) {
+		argc++;
+		size += sizeof(flag);
+		if (entry->value != NULL) {
+			argc++;
+			size += strlen(entry->value) + 1;
+		}
+	}
+	argc += args->argc;
+	for (i = 0; i < args->argc; i++)
+		size += strlen(args->argv[i]) + 1;
+
+	argv = xmalloc(sizeof(char *) * argc + size);
+	p = (char *)(argv + argc);
+
+	p = argv_add(argv, &next, p, cmd->entry->name);
+
+	RB_FOREACH(entry, args_tree, &args->tree) {
+		flag[1] = entry->flag;
+		p = argv_add(argv, &next, p, flag);
+		if (entry->value != NULL)
+			p = argv_add(argv, &next, p, entry->value);
+	}
+
+	for (i = 0; i < args->argc; i++)
+		p = argv_add(argv, &next, p, args->argv[i]);
+
+	*_argc = argc;
+	*_argv = argv;
+}
+
+/*
+ * With tmate-exec-cmds-bulk, the commands replicated between
+ * tmate_exec_cmds_begin() and tmate_exec_cmds_end(), while the config file is
+ * read, are held and sent in one TMATE_OUT_EXEC_CMDS at the end, rather than
+ * in hundreds of messages before TMATE_OUT_READY.
+ */
+static struct {
+	bool active;
+	unsigned int count, capacity;
+	struct {
+		int argc;
+		char **argv;
+	} *cmds;
+} exec_batch;
+
+void tmate_exec_cmds_begin(void)
+{
+	exec_batch.active = true;
+}
+
+void tmate_exec_cmds_end(void)
+{
+	unsigned int i;
+
+	exec_batch.active = false;
+	if (!exec_batch.count)
+		return;
+
+	tmate_flush_pty_data();
+
+	pack_msg(2, TMATE_OUT_EXEC_CMDS);
+	pack(array, exec_batch.count);
+	for (i = 0; i < exec_batch.count; i++) {
+		pack_cmd_argv(exec_batch.cmds[i].argc,
+			      (const char **)exec_batch.cmds[i].argv);
+		free(exec_batch.cmds[i].argv);
+	}
+
+	free(exec_batch.cmds);
+	exec_batch.cmds = NULL;
+	exec_batch.count = exec_batch.capacity = 0;
+}
+
+static bool batch_exec_cmd(int argc, const char **argv)
+{
+	if (!exec_batch.active ||
+	    !options_get_number(global_options, "tmate-exec-cmds-bulk"))
+		return false;
+
+	if (exec_batch.count == exec_batch.capacity) {
+		exec_batch.capacity = exec_batch.capacity ?
+				      exec_batch.capacity * 2 : 64;
+		exec_batch.cmds = xreallocarray(exec_batch.cmds,
+						exec_batch.capacity,
+						sizeof(*exec_batch.cmds));
+	}
+	exec_batch.cmds[exec_batch.count].argc = argc;
+	exec_batch.cmds[exec_batch.count].argv = argv_block(argc, argv);
+	exec_batch.count++;
+	return true;
+}
+
+static void __tmate_exec_cmd_args(int argc, const char **argv)
+{
+	int i;
+
+	if (batch_exec_cmd(argc, argv))
+		return;
+
+	tmate_flush_pty_data();
+
+	pack_msg(argc + 1, TMATE_OUT_EXEC_CMD);
+
+	for (i = 0; i < argc; i++)
+		pack(string, argv[i]);
+}
+
+void tmate_exec_cmd_args(int argc, const char **argv)
+{
+	__tmate_exec_cmd_args(argc, argv);
+	append_saved_cmd(&tmate_session, argc, argv_block(argc, argv));
+}
+
+void tmate_set_val(const char *name, const char *value)
+{
+	char *buf;
+	xasprintf(&buf, "%s=%s", name, value);
+	tmate_exec_cmd_args(3, (const char *[]){"set-option", "tmate-set", buf});
+	free(buf);
+}
+
+/*
+ * The file is read twice, to count and hash the keys and then to pack them,
+ * rather than kept in memory. If it changed in between, the count sent is
+ * kept to.
+ */
+void tmate_write_authorized_keys(FILE *f, bool full)
+{
+	uint64_t hash = 0;
+	u_int n = 0;
+	char *line, hex[17];
+	size_t len;
+
+	while ((line = fparseln(f, &len, NULL, NULL, 0)) != NULL) {
+		if (len != 0) {
+			hash = status_hash(hash, line, len);
+			hash = status_hash(hash, "\n", 1);
+			n++;
+		}
+		free(line);
+	}
+	xsnprintf(hex, sizeof hex, "%016llx", (unsigned long long)hash);
+
+	tmate_flush_pty_data();
+
+	pack_msg(3, TMATE_OUT_AUTHORIZED_KEYS);
+	pack(string, hex);
+	if (!full) {
+		pack(nil);
+		return;
+	}
+
+	rewind(f);
+	pack(array, n);
+	while (n > 0 && (line = fparseln(f, &len, NULL, NULL, 0)) != NULL) {
+		if (len != 0) {
+			pack(string, line);
+			n--;
+		}
+		free(line);
+	}
+	for (; n > 0; n--)
+		pack(string, "");
+}
+
+void tmate_exec_cmd(struct cmd *cmd)
+{
+	int argc;
+	char **argv;
+
+	extract_cmd(cmd, &argc, &argv);
+	__tmate_exec_cmd_args(argc, (const char **)argv);
+	append_saved_cmd(&tmate_session, argc, argv);
+}
+
+void tmate_failed_cmd(int client_id, const char *cause)
+{
+	tmate_flush_pty_data();
+
+	pack_msg(3, TMATE_OUT_FAILED_CMD);
+	pack(int, client_id);
+	pack(string, cause);
+}
+
+void tmate_status(const char *left, const char *right)
+{
+	static uint64_t old_left, old_right;
+	uint64_t new_left, new_right;
+
+	new_left = status_hash(0, left, strlen(left));
+	new_right = status_hash(0, right, strlen(right));
+	if (new_left == old_left && new_right == old_right)
+		return;
+
+	tmate_flush_pty_data();
+
+	pack_msg(3, TMATE_OUT_STATUS);
+	pack(string, left);
+	pack(string, right);
+
+	old_left = new_left;
+	old_right = new_right;
+}
+
+/*
+ * Copy mode state is not sent on every key: tmate_sync_copy_mode marks the
+ * pane, and the state of all the marked panes is sent at the end of the loop,
+ * or once tmate-copy-mode-sync-delay has passed since the last time. A held
+ * key then costs a few messages a second rather than one per repeat.
+ */
+
+static void pack_copy_mode(struct window_pane *wp)
+{
+	struct window_copy_mode_data *data = wp->modedata;
+
+	tmate_flush_pty_data();
+
+	pack_msg(3, TMATE_OUT_SYNC_COPY_MODE);
+
+	pack(int, wp->id);
+
+	if (wp->mode != &window_copy_mode ||
+	    data->inputtype == WINDOW_COPY_PASSWORD ||
+	    replicate_mode(wp) == TMATE_REPLICATE_PRIVATE) {
+		pack(array, 0);
+		return;
+	}
+	pack(array, 6);
+	pack(int, data->backing == &wp->base);
+
+	pack(int, data->oy);
+	pack(int, data->cx);
+	pack(int, data->cy);
+
+	if (data->screen.sel.flag) {
+		pack(array, 3);
+		pack(int, data->selx);
+		pack(int, -data->sely + screen_hsize(data->backing)
+				      + screen_size_y(data->backing) - 1);
+		pack(int, data->rectflag);
+	} else
+		pack(array, 0);
+
+	if (data->inputprompt) {
+		pack(array, 3);
+		pack(int, data->inputtype);
+		pack(string, data->inputprompt);
+		pack(string, data->inputstr);
+	} else
+		pack(array, 0);
+}
+
+void tmate_flush_copy_mode(void)
+{
+	struct window_pane *wp;
+
+	if (!tmate_session.copy_mode_pending)
+		return;
+	tmate_session.copy_mode_pending = false;
+	evtimer_del(tmate_session.ev_copy_mode_sync);
+	gettimeofday(&tmate_session.copy_mode_synced, NULL);
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (!wp->tmate_copy_mode_pending)
+			continue;
+		wp->tmate_copy_mode_pending = 0;
+		pack_copy_mode(wp);
+	}
+}
+
+static void on_copy_mode_sync_timer(__unused evutil_socket_t fd,
+				    __unused short what, __unused void *arg)
+{
+	tmate_flush_copy_mode();
+}
+
+void tmate_sync_copy_mode(struct window_pane *wp)
+{
+	struct timeval now, elapsed, tv;
+	int delay;
+
+	wp->tmate_copy_mode_pending = 1;
+	if (tmate_session.copy_mode_pending)
+		return;
+	tmate_session.copy_mode_pending = true;
+
+	if (!tmate_session.ev_copy_mode_sync) {
+		tmate_session.ev_copy_mode_sync = evtimer_new(
+				tmate_session.ev_base, on_copy_mode_sync_timer, NULL);
+		if (!tmate_session.ev_copy_mode_sync)
+			tmate_fatal("out of memory");
+	}
+
+	delay = options_get_number(global_options, "tmate-copy-mode-sync-delay");
+	gettimeofday(&now, NULL);
+	timersub(&now, &tmate_session.copy_mode_synced, &elapsed);
+	delay -= elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+	if (delay < 0 || elapsed.tv_sec < 0)
+		delay = 0;
+
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	evtimer_add(tmate_session.ev_copy_mode_sync, &tv);
+}
+
+void tmate_write_copy_mode(struct window_pane *wp, const char *str)
+{
+	if (replicate_mode(wp) == TMATE_REPLICATE_PRIVATE)
+		return;
+
+	tmate_flush_pty_data();
+	tmate_flush_copy_mode();
+
+	pack_msg(3, TMATE_OUT_WRITE_COPY_MODE);
+	pack(int, wp->id);
+	pack(string, str);
+}
+
+void tmate_write_fin(void)
+{
+	tmate_flush_pty_data();
+
+	pack_msg(1, TMATE_OUT_FIN);
+}
+
+static void pack_stats_hists(struct tmate_stats_hist *hists)
+{
+	struct tmate_stats_hist *hist;
+	int i, j, n = 0;
+
+	for (i = 0; i < TMATE_STATS_TYPES; i++) {
+		if (hists[i].count)
+			n++;
+	}
+
+	pack(array, n);
+	for (i = 0; i < TMATE_STATS_TYPES; i++) {
+		hist = &hists[i];
+		if (!hist->count)
+			continue;
+
+		pack(array, 5);
+		pack(int, i);
+		pack(unsigned_int, hist->count);
+		pack(uint64, hist->total_us);
+		pack(uint64, hist->max_us);
+		pack(array, TMATE_STATS_BUCKETS);
+		for (j = 0; j < TMATE_STATS_BUCKETS; j++)
+			pack(unsigned_int, hist->buckets[j]);
+	}
+}
+
+void tmate_write_latency_probe(uint64_t ns)
+{
+	tmate_flush_pty_data();
+
+	pack_msg(2, TMATE_OUT_LATENCY_PROBE);
+	pack(uint64, ns);
+}
+
+static void pack_stats_host(void)
+{
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	struct window_pane *wp;
+	u_int n = 0;
+
+	pack(array, 8);
+	pack(uint64, encoder->buffer ? evbuffer_get_length(encoder->buffer) : 0);
+	pack(uint64, tmate_stats.encoder_max);
+	pack(uint64, tmate_stats.pty_coalesced);
+	pack(uint64, tmate_stats.loop_lag_us);
+	pack(uint64, tmate_stats_rss());
+	pack(uint64, grid_total_memory);
+	pack(unsigned_int, tmate_stats.reconnects);
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		n++;
+	pack(array, n);
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		pack(array, 2);
+		pack(int, wp->id);
+		pack(uint64, wp->tmate_pty_bytes);
+	}
+}
+
+void tmate_write_stats(void)
+{
+	tmate_flush_pty_data();
+
+	pack_msg(4, TMATE_OUT_STATS);
+	pack_stats_hists(tmate_stats.in);
+	pack_stats_hists(tmate_stats.out);
+	pack_stats_host();
+}
+
+/*
+ * Lines are encoded in a single pass over the cells: the text goes in one
+ * string, and the attributes are run-length encoded as pairs of
+ * (style, run_length) since most cells of a line share the same
+ * attributes. style is an index in the palette of the pane, which lists each
+ * distinct char_attr once and is sent after the grids. Snapshots for servers
+ * older than TMATE_PROTOCOL_SNAPSHOT_STYLES have the char_attr in the runs
+ * and no palette, and before TMATE_PROTOCOL_SNAPSHOT_RUNS one char_attr per
+ * cell.
+ */
+struct snapshot_line_buf {
+	int version; /* protocol version the lines are for */
+
+	char *str;
+	size_t str_size;
+	u_int *runs;
+	u_int runs_size;
+
+	u_int *styles;
+	u_int num_styles;
+	u_int styles_size;
+	u_int *style_hash; /* index + 1, or 0 if empty */
+	u_int style_hash_size;
+};
+
+static struct snapshot_line_buf snapshot_buf;
+
+static void rehash_snapshot_styles(struct snapshot_line_buf *sb)
+{
+	u_int i, h;
+
+	sb->style_hash_size = sb->style_hash_size ? sb->style_hash_size * 2 : 64;
+	free(sb->style_hash);
+	sb->style_hash = xcalloc(sb->style_hash_size, sizeof(*sb->style_hash));
+
+	for (i = 0; i < sb->num_styles; i++) {
+		h = (sb->styles[i] * 0x9e3779b1U) & (sb->style_hash_size - 1);
+		while (sb->style_hash[h])
+			h = (h + 1) & (sb->style_hash_size - 1);
+		sb->style_hash[h] = i + 1;
+	}
+}
 
-		pack(array, 2);
-		str_len = 0;
-		for (i = 0; i < line->cellsize; i++) {
-			grid_get_cell(grid, i, line_i, &gc);
-			str_len += gc.data.size;
+static u_int snapshot_style(struct snapshot_line_buf *sb, u_int attr)
+{
+	u_int h, i;
+
+	if (sb->style_hash_size) {
+		h = (attr * 0x9e3779b1U) & (sb->style_hash_size - 1);
+		while ((i = sb->style_hash[h])) {
+			if (sb->styles[i - 1] == attr)
+				return i - 1;
+			h = (h + 1) & (sb->style_hash_size - 1);
 		}
+	}
 
-		pack(str, str_len);
-		for (i = 0; i < line->cellsize; i++) {
-			grid_get_cell(grid, i, line_i, &gc);
-			pack(str_body, gc.data.data, gc.data.size);
+	if (sb->num_styles == sb->styles_size) {
+		sb->styles_size = sb->styles_size ? sb->styles_size * 2 : 16;
+		sb->styles = xreallocarray(sb->styles, sb->styles_size,
+					   sizeof(*sb->styles));
+	}
+	i = sb->num_styles++;
+	sb->styles[i] = attr;
+
+	if (sb->num_styles * 2 > sb->style_hash_size) {
+		rehash_snapshot_styles(sb);
+	} else {
+		h = (attr * 0x9e3779b1U) & (sb->style_hash_size - 1);
+		while (sb->style_hash[h])
+			h = (h + 1) & (sb->style_hash_size - 1);
+		sb->style_hash[h] = i + 1;
+	}
+	return i;
+}
+
+static void reset_snapshot_styles(struct snapshot_line_buf *sb)
+{
+	sb->version = TMATE_PROTOCOL_VERSION;
+	sb->num_styles = 0;
+	if (sb->style_hash)
+		memset(sb->style_hash, 0,
+		       sb->style_hash_size * sizeof(*sb->style_hash));
+}
+
+/*
+ * A history line as cached in the grid: the runs are pairs of attributes and
+ * cell counts, followed by the text. The attributes are kept rather than the
+ * style indexes, as those are only good for one snapshot.
+ */
+struct snapshot_cached_line {
+	size_t str_len;
+	u_int num_runs;
+};
+
+static void pack_snapshot_line(struct snapshot_line_buf *sb, const char *str,
+			       size_t str_len, const u_int *runs,
+			       u_int num_runs)
+{
+	u_int i, j, num_cells;
+
+	pack(array, 2);
+	pack(str, str_len);
+	pack(str_body, str, str_len);
+
+	if (sb->version < TMATE_PROTOCOL_SNAPSHOT_RUNS) {
+		num_cells = 0;
+		for (i = 0; i < num_runs; i += 2)
+			num_cells += runs[i + 1];
+
+		pack(array, num_cells);
+		for (i = 0; i < num_runs; i += 2) {
+			for (j = 0; j < runs[i + 1]; j++)
+				pack(unsigned_int, runs[i]);
 		}
+		return;
+	}
+
+	pack(array, num_runs);
+	for (i = 0; i < num_runs; i += 2) {
+		if (sb->version < TMATE_PROTOCOL_SNAPSHOT_STYLES)
+			pack(unsigned_int, runs[i]);
+		else
+			pack(unsigned_int, snapshot_style(sb, runs[i]));
+		pack(unsigned_int, runs[i + 1]);
+	}
+}
+
+static void cache_snapshot_line(struct grid *grid, u_int line_i,
+				struct snapshot_line_buf *sb, size_t str_len,
+				u_int num_runs)
+{
+	struct snapshot_cached_line *cl;
+	size_t runs_len = num_runs * sizeof(*sb->runs);
+	size_t size = sizeof(*cl) + runs_len + str_len;
+
+	cl = xmalloc(size);
+	cl->str_len = str_len;
+	cl->num_runs = num_runs;
+	memcpy(cl + 1, sb->runs, runs_len);
+	memcpy((char *)(cl + 1) + runs_len, sb->str, str_len);
+	grid_cache_set(grid, line_i, cl, size);
+}
+
+static void do_snapshot_line(struct grid *grid, u_int line_i)
+{
+	struct snapshot_line_buf *sb = &snapshot_buf;
+	const struct snapshot_cached_line *cl;
+	const struct grid_line *line;
+	const struct grid_cell_entry *gce;
+	struct grid_cell gc;
+	const u_char *data;
+	const u_int *runs;
+	size_t str_len, size;
+	u_int i, num_runs, attr, last_attr = 0;
+
+	/* History lines do not change, they are encoded only once. */
+	if ((cl = grid_cache_get(grid, line_i, &size)) != NULL) {
+		runs = (const u_int *)(cl + 1);
+		pack_snapshot_line(sb, (const char *)(runs + cl->num_runs),
+				   cl->str_len, runs, cl->num_runs);
+		return;
+	}
+
+	line = grid_peek_line(grid, line_i);
+
+	if (line->cellsize * UTF8_SIZE > sb->str_size) {
+		sb->str_size = line->cellsize * UTF8_SIZE;
+		sb->str = xrealloc(sb->str, sb->str_size);
+	}
+	if (line->cellsize * 2 > sb->runs_size) {
+		sb->runs_size = line->cellsize * 2;
+		sb->runs = xreallocarray(sb->runs, sb->runs_size,
+					 sizeof(*sb->runs));
+	}
 
-		pack(array, line->cellsize);
-		for (i = 0; i < line->cellsize; i++) {
+	str_len = 0;
+	num_runs = 0;
+	for (i = 0; i < line->cellsize; i++) {
+		gce = &line->celldata[i];
+		if (gce->flags & GRID_FLAG_EXTENDED) {
 			grid_get_cell(grid, i, line_i, &gc);
-			pack(unsigned_int, ((gc.flags << 24) |
-					    (gc.attr  << 16) |
-					    (gc.bg    << 8)  |
-					     gc.fg        ));
+			data = gc.data.data;
+			size = gc.data.size;
+			attr = (gc.flags << 24) | (gc.attr << 16) |
+			       (gc.bg << 8) | gc.fg;
+		} else {
+			data = &gce->data.data;
+			size = 1;
+			attr = (gce->flags << 24) | (gce->data.attr << 16) |
+			       (gce->data.bg << 8) | gce->data.fg;
+		}
+
+		memcpy(sb->str + str_len, data, size);
+		str_len += size;
+
+		if (num_runs && attr == last_attr) {
+			sb->runs[num_runs - 1]++;
+		} else {
+			sb->runs[num_runs++] = attr;
+			sb->runs[num_runs++] = 1;
+			last_attr = attr;
 		}
 	}
 
+	if (line_i < grid->hsize)
+		cache_snapshot_line(grid, line_i, sb, str_len, num_runs);
+	pack_snapshot_line(sb, sb->str, str_len, sb->runs, num_runs);
+}
+
+static void do_snapshot_grid(struct grid *grid, unsigned int max_history_lines)
+{
+	unsigned int line_i;
+	unsigned int max_lines;
+
+	max_lines = max_history_lines + grid->sy;
+
+#define grid_num_lines(grid) (grid->hsize + grid->sy)
+
+	/* Only the lines sent need reflowing, not all of the history. */
+	grid_reflow_history_last(grid, max_history_lines);
+
+	if (grid_num_lines(grid) > max_lines)
+		line_i = grid_num_lines(grid) - max_lines;
+	else
+		line_i = 0;
+
+	pack(array, grid_num_lines(grid) - line_i);
+	for (; line_i < grid_num_lines(grid); line_i++)
+		do_snapshot_line(grid, line_i);
 }
 
 static void do_snapshot_pane(struct window_pane *wp, unsigned int max_history_lines)
 {
 	struct screen *screen = &wp->base;
+	bool styles;
+	u_int i;
 
-	pack(array, 4);
+	reset_snapshot_styles(&snapshot_buf);
+	snapshot_buf.version = tmate_protocol_version();
+	styles = snapshot_buf.version >= TMATE_PROTOCOL_SNAPSHOT_STYLES;
+
+	pack(array, styles ? 5 : 4);
 	pack(int, wp->id);
 
+	/* A private pane is there, with nothing in it. */
+	if (replicate_mode(wp) == TMATE_REPLICATE_PRIVATE) {
+		pack(unsigned_int, 0);
+		pack(array, 3);
+		pack(int, 0);
+		pack(int, 0);
+		pack(array, 0);
+		pack(nil);
+		if (styles)
+			pack(array, 0);
+		return;
+	}
+
 	pack(unsigned_int, screen->mode);
 
 	pack(array, 3);
@@ -422,42 +1700,628 @@ static void do_snapshot_pane(struct window_pane *wp, unsigned int max_history_li
 	} else {
 		pack(nil);
 	}
+
+	if (!styles)
+		return;
+	pack(array, snapshot_buf.num_styles);
+	for (i = 0; i < snapshot_buf.num_styles; i++)
+		pack(unsigned_int, snapshot_buf.styles[i]);
 }
 
-static void tmate_send_session_snapshot(unsigned int max_history_lines)
+/*
+ * The snapshot is sent as a job that emits one pane per event loop
+ * iteration, so that large histories don't stall the server. Each pane goes
+ * in its own TMATE_OUT_SNAPSHOT_PANE message, tagged with the snapshot id and
+ * a sequence number, between TMATE_OUT_SNAPSHOT_BEGIN and
+ * TMATE_OUT_SNAPSHOT_END.
+ * Panes are visited in id order. Live PTY data keeps flowing for the panes
+ * already sent, while the PTY data of the panes not sent yet is dropped as
+ * their snapshot will contain it.
+ *
+ * With tmate-snapshot-visible-first, a viewer gets something to look at
+ * before the history: the panes are visited in the order they are seen, the
+ * current window first and the active pane of a window before the others,
+ * and only their screen is sent. Then the history of each, in the same
+ * order, newest line first and TMATE_SNAPSHOT_HISTORY_LINES at a time. The
+ * PTY data of a pane flows once its screen is sent, so the history still to
+ * send is found by how far above the screen it was then: each line scrolled
+ * into the history since (grid hscrolled) is one more.
+ *
+ * Servers older than TMATE_PROTOCOL_SNAPSHOT_PANES get all the panes at once
+ * in a TMATE_OUT_SNAPSHOT.
+ */
+
+#define TMATE_SNAPSHOT_HISTORY_LINES 1000
+
+struct snapshot_job_pane {
+	u_int id;
+	struct grid *grid;
+	uint64_t scrolled;
+	u_int lines;
+	u_int sent;
+};
+
+static struct {
+	bool active;
+	int id;
+	int seq;
+	u_int next_pane_id;
+	unsigned int max_history_lines;
+	struct event *ev;
+
+	bool visible_first;
+	struct snapshot_job_pane *panes;
+	u_int num_panes;
+	u_int next_screen;
+	u_int next_history;
+} snapshot_job;
+
+static int snapshot_pending_pane(struct window_pane *wp)
+{
+	if (!snapshot_job.active)
+		return 0;
+	if (snapshot_job.visible_first)
+		return wp->tmate_snapshot_pending;
+	return wp->id >= snapshot_job.next_pane_id;
+}
+
+static void schedule_snapshot_job(void)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
+
+	evtimer_add(snapshot_job.ev, &tv);
+}
+
+static void add_snapshot_pane(struct window_pane *wp)
+{
+	struct snapshot_job_pane *jp;
+
+	/* A window may be in the session more than once. */
+	if (wp->tmate_snapshot_pending)
+		return;
+	wp->tmate_snapshot_pending = 1;
+
+	snapshot_job.panes = xreallocarray(snapshot_job.panes,
+					   snapshot_job.num_panes + 1,
+					   sizeof(*snapshot_job.panes));
+	jp = &snapshot_job.panes[snapshot_job.num_panes++];
+	memset(jp, 0, sizeof(*jp));
+	jp->id = wp->id;
+}
+
+static void add_snapshot_window(struct window *w)
+{
+	struct window_pane *wp;
+
+	if (w->active)
+		add_snapshot_pane(w->active);
+	TAILQ_FOREACH(wp, &w->panes, entry)
+		add_snapshot_pane(wp);
+}
+
+/* The panes of the session, in the order viewers see them. */
+static void order_snapshot_panes(void)
 {
 	struct session *s;
 	struct winlink *wl;
-	struct window *w;
-	struct window_pane *pane;
-	int num_panes;
+	struct window_pane *wp;
 
-	pack(array, 2);
-	pack(int, TMATE_OUT_SNAPSHOT);
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		wp->tmate_snapshot_pending = 0;
+
+	free(snapshot_job.panes);
+	snapshot_job.panes = NULL;
+	snapshot_job.num_panes = 0;
+	snapshot_job.next_screen = 0;
+	snapshot_job.next_history = 0;
 
-	s = RB_MIN(sessions, &sessions);
+	s = tmate_tmux_session(&tmate_session);
 	if (!s)
-		tmate_fatal("no session?");
+		return;
 
-	num_panes = 0;
-	RB_FOREACH(wl, winlinks, &s->windows) {
-		w = wl->window;
-		if (!w)
+	if (s->curw)
+		add_snapshot_window(s->curw->window);
+	RB_FOREACH(wl, winlinks, &s->windows)
+		add_snapshot_window(wl->window);
+}
+
+/*
+ * Send the next lines of the history of a pane after its screen, or return
+ * false if there are none left.
+ */
+static bool pack_snapshot_history(struct window_pane *wp,
+				  struct snapshot_job_pane *jp)
+{
+	struct grid *grid = jp->grid;
+	uint64_t above;
+	u_int i, n;
+
+	/* Lines scrolled or cleared from the history have moved it. */
+	above = grid->hscrolled - jp->scrolled + jp->sent;
+	if (jp->sent == jp->lines || above >= grid->hsize)
+		return false;
+
+	n = jp->lines - jp->sent;
+	if (n > TMATE_SNAPSHOT_HISTORY_LINES)
+		n = TMATE_SNAPSHOT_HISTORY_LINES;
+	if (n > grid->hsize - above)
+		n = grid->hsize - above;
+
+	/* Only the lines sent need reflowing, not all of the history. */
+	grid_reflow_history_last(grid, above + n);
+
+	reset_snapshot_styles(&snapshot_buf);
+
+	pack_msg(5, TMATE_OUT_SNAPSHOT_HISTORY);
+	pack(int, snapshot_job.id);
+	pack(int, wp->id);
+
+	pack(array, n);
+	for (i = 0; i < n; i++)
+		do_snapshot_line(grid, grid->hsize - 1 - (above + i));
+
+	pack(array, snapshot_buf.num_styles);
+	for (i = 0; i < snapshot_buf.num_styles; i++)
+		pack(unsigned_int, snapshot_buf.styles[i]);
+
+	jp->sent += n;
+	return true;
+}
+
+/*
+ * Send the next screen, or the next lines of history once all of them are
+ * sent. Returns false when the snapshot is complete.
+ */
+static bool visible_first_snapshot_step(struct session *s)
+{
+	struct snapshot_job_pane *jp;
+	struct window_pane *wp;
+
+	while (snapshot_job.next_screen < snapshot_job.num_panes) {
+		jp = &snapshot_job.panes[snapshot_job.next_screen++];
+		wp = window_pane_find_by_id(jp->id);
+		if (!wp || !wp->tmate_snapshot_pending)
 			continue;
+		wp->tmate_snapshot_pending = 0;
+		if (!s || !session_has(s, wp->window))
+			continue;
+
+		/* Resized while nobody looked at it, it is sent at its size. */
+		recalculate_pending(wp->window);
+
+		pack_msg(4, TMATE_OUT_SNAPSHOT_PANE);
+		pack(int, snapshot_job.id);
+		pack(int, snapshot_job.seq++);
+		do_snapshot_pane(wp, 0);
+
+		jp->grid = wp->base.grid;
+		jp->scrolled = jp->grid->hscrolled;
+		jp->lines = jp->grid->hsize;
+		if (jp->lines > snapshot_job.max_history_lines)
+			jp->lines = snapshot_job.max_history_lines;
+		if (replicate_mode(wp) == TMATE_REPLICATE_PRIVATE)
+			jp->lines = 0;
+		return true;
+	}
+
+	while (snapshot_job.next_history < snapshot_job.num_panes) {
+		jp = &snapshot_job.panes[snapshot_job.next_history];
+		wp = window_pane_find_by_id(jp->id);
+		/* The history is not the same after a reflow. */
+		if (wp && jp->grid && wp->base.grid == jp->grid &&
+		    pack_snapshot_history(wp, jp))
+			return true;
+		snapshot_job.next_history++;
+	}
+
+	return false;
+}
+
+static void end_snapshot_job(void)
+{
+	pack_msg(3, TMATE_OUT_SNAPSHOT_END);
+	pack(int, snapshot_job.id);
+	pack(int, snapshot_job.seq);
+	snapshot_job.active = false;
+
+	free(snapshot_job.panes);
+	snapshot_job.panes = NULL;
+	snapshot_job.num_panes = 0;
+}
+
+static void on_snapshot_job(__unused evutil_socket_t fd,
+			    __unused short what, __unused void *arg)
+{
+	struct session *s;
+	struct window_pane find, *wp;
+
+	if (!snapshot_job.active)
+		return;
+
+	s = tmate_tmux_session(&tmate_session);
+
+	if (snapshot_job.visible_first) {
+		tmate_flush_pty_data();
+		if (visible_first_snapshot_step(s))
+			schedule_snapshot_job();
+		else
+			end_snapshot_job();
+		return;
+	}
+
+	find.id = snapshot_job.next_pane_id;
+	wp = RB_NFIND(window_pane_tree, &all_window_panes, &find);
+	while (wp && (!s || !session_has(s, wp->window)))
+		wp = RB_NEXT(window_pane_tree, &all_window_panes, wp);
+
+	tmate_flush_pty_data();
+
+	if (!wp) {
+		end_snapshot_job();
+		return;
+	}
+
+	/* A window resized while nobody looked at it is sent at its size. */
+	recalculate_pending(wp->window);
+
+	pack_msg(4, TMATE_OUT_SNAPSHOT_PANE);
+	pack(int, snapshot_job.id);
+	pack(int, snapshot_job.seq++);
+	do_snapshot_pane(wp, snapshot_job.max_history_lines);
+
+	snapshot_job.next_pane_id = wp->id + 1;
+	schedule_snapshot_job();
+}
+
+static void send_whole_snapshot(unsigned int max_history_lines)
+{
+	struct session *s;
+	struct winlink *wl;
+	struct window_pane *wp;
+	u_int num_panes = 0;
+
+	snapshot_job.active = false;
 
-		TAILQ_FOREACH(pane, &w->panes, entry)
-			num_panes++;
+	s = tmate_tmux_session(&tmate_session);
+	if (s) {
+		RB_FOREACH(wl, winlinks, &s->windows) {
+			/* Sent at its size, even if resized while not looked at. */
+			recalculate_pending(wl->window);
+			TAILQ_FOREACH(wp, &wl->window->panes, entry)
+				num_panes++;
+		}
 	}
 
+	tmate_flush_pty_data();
+
+	pack_msg(2, TMATE_OUT_SNAPSHOT);
 	pack(array, num_panes);
+	if (!s)
+		return;
 	RB_FOREACH(wl, winlinks, &s->windows) {
-		w = wl->window;
-		if (!w)
+		TAILQ_FOREACH(wp, &wl->window->panes, entry)
+			do_snapshot_pane(wp, max_history_lines);
+	}
+}
+
+static void tmate_send_session_snapshot(unsigned int max_history_lines)
+{
+	if (tmate_protocol_version() < TMATE_PROTOCOL_SNAPSHOT_PANES) {
+		send_whole_snapshot(max_history_lines);
+		return;
+	}
+
+	if (!snapshot_job.ev) {
+		snapshot_job.ev = evtimer_new(tmate_session.ev_base,
+					      on_snapshot_job, NULL);
+		if (!snapshot_job.ev)
+			tmate_fatal("out of memory");
+	}
+
+	snapshot_job.active = true;
+	snapshot_job.id++;
+	snapshot_job.seq = 0;
+	snapshot_job.next_pane_id = 0;
+	snapshot_job.max_history_lines = max_history_lines;
+	/* The history comes in its own messages, with their palette. */
+	snapshot_job.visible_first = options_get_number(global_options,
+					"tmate-snapshot-visible-first") &&
+		tmate_protocol_version() >= TMATE_PROTOCOL_SNAPSHOT_STYLES;
+
+	if (snapshot_job.visible_first) {
+		order_snapshot_panes();
+
+		pack_msg(4, TMATE_OUT_SNAPSHOT_BEGIN);
+		pack(int, snapshot_job.id);
+		pack(int, max_history_lines);
+		pack(int, TMATE_SNAPSHOT_VISIBLE_FIRST);
+	} else {
+		pack_msg(3, TMATE_OUT_SNAPSHOT_BEGIN);
+		pack(int, snapshot_job.id);
+		pack(int, max_history_lines);
+	}
+
+	schedule_snapshot_job();
+}
+
+/*
+ * With tmate-screen-diff-size, a pane printing more than that many bytes in
+ * TMATE_DIFF_INTERVAL ms stops sending its output as it comes. Every
+ * interval instead, a TMATE_OUT_PANE_DIFF carries the lines of its screen
+ * which changed since the last one (all of them the first time), found by
+ * comparing a hash of each line. Once the pane is back under that rate and
+ * not in the middle of an escape sequence, its output is sent again. Viewers
+ * catching up on a large cat pay for a screen rather than for the file, but
+ * what scrolled by in between is not in their history.
+ *
+ * With tmate-screen-diff-backlog, the link decides too: while the encoder
+ * holds more than that, any pane printing more than its screen size in an
+ * interval, for which a diff is smaller, switches. Panes typed into stay
+ * exact. Panes sending diffs are not throttled by tmate-backoff-size, but
+ * their diffs wait for the encoder to drain below it.
+ *
+ * Throttled and snapshot-only panes (tmate-replicate) always send diffs,
+ * but only when they printed something since the last one: a throttled
+ * pane at most tmate-replicate-rate times a second, a snapshot-only pane
+ * when it is viewed. Nothing else comes between their diffs, so they are
+ * never sent whole again but once a private pane is made public.
+ */
+
+#define TMATE_DIFF_INTERVAL 100
+
+static struct event *ev_diff;
+static uint64_t *diff_hashes;
+static u_int diff_hashes_size;
+
+static size_t diff_backlog(void)
+{
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+
+	if (!encoder->buffer || !encoder->ready_callback)
+		return 0;
+	return evbuffer_get_length(encoder->buffer);
+}
+
+/* Whether what a pane printed in the last interval wants diffs. */
+static bool diff_wanted(struct window_pane *wp)
+{
+	u_int diff_size, backlog;
+
+	/* A pane over pane-rate-limit or pane-cpu-limit only sends diffs. */
+	if (wp->flags & PANE_THROTTLED)
+		return true;
+	if (replicate_mode(wp) != TMATE_REPLICATE_FULL)
+		return true;
+
+	diff_size = options_get_number(global_options, "tmate-screen-diff-size");
+	if (diff_size && wp->tmate_diff_bytes >= diff_size)
+		return true;
+
+	backlog = options_get_number(global_options, "tmate-screen-diff-backlog");
+	if (backlog && diff_backlog() > backlog &&
+	    wp->tmate_diff_bytes >= screen_size_x(&wp->base) *
+				    screen_size_y(&wp->base))
+		return true;
+
+	return false;
+}
+
+static void on_diff_timer(evutil_socket_t fd, short what, void *arg);
+
+static uint64_t diff_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Whether the diff of a pane goes this interval, after its tmate-replicate. */
+static bool diff_due(struct window_pane *wp)
+{
+	u_int rate;
+
+	switch (replicate_mode(wp)) {
+	case TMATE_REPLICATE_THROTTLED:
+		rate = options_get_number(wp->window->options,
+					  "tmate-replicate-rate");
+		return wp->tmate_diff_dirty &&
+		       diff_now() - wp->tmate_diff_sent + TMATE_DIFF_INTERVAL / 2
+				>= 1000 / rate;
+	case TMATE_REPLICATE_SNAPSHOT:
+		return wp->tmate_diff_dirty && pane_viewed(wp);
+	case TMATE_REPLICATE_PRIVATE:
+		return false;
+	}
+	return true;
+}
+
+static void schedule_diff(void)
+{
+	struct timeval tv = { .tv_sec = 0,
+			      .tv_usec = TMATE_DIFF_INTERVAL * 1000 };
+
+	if (!ev_diff) {
+		ev_diff = evtimer_new(tmate_session.ev_base, on_diff_timer, NULL);
+		if (!ev_diff)
+			tmate_fatal("out of memory");
+	}
+	if (!evtimer_pending(ev_diff, NULL))
+		evtimer_add(ev_diff, &tv);
+}
+
+/* Look again at the panes sending diffs, which may be due now. */
+static void refresh_diffs(void)
+{
+	if (ev_diff)
+		schedule_diff();
+}
+
+/* FNV-1a of the text and attributes, never 0 which is for unknown lines. */
+static uint64_t hash_line(struct grid *grid, u_int line_i)
+{
+	const struct grid_line *line = grid_peek_line(grid, line_i);
+	struct grid_cell gc;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	u_int i, attr;
+	size_t j;
+
+	for (i = 0; i < line->cellsize; i++) {
+		grid_get_cell(grid, i, line_i, &gc);
+		for (j = 0; j < gc.data.size; j++)
+			h = (h ^ gc.data.data[j]) * 0x100000001b3ULL;
+		attr = (gc.flags << 24) | (gc.attr << 16) | (gc.bg << 8) | gc.fg;
+		h = (h ^ attr) * 0x100000001b3ULL;
+	}
+	h = (h ^ line->cellsize) * 0x100000001b3ULL;
+
+	return h ? h : 1;
+}
+
+static void pack_pane_diff(struct window_pane *wp)
+{
+	struct screen *s = &wp->base;
+	struct grid *grid = s->grid;
+	u_int y, n, sy = screen_size_y(s);
+
+	if (wp->tmate_line_hash_size != sy) {
+		wp->tmate_line_hash = xreallocarray(wp->tmate_line_hash, sy,
+						    sizeof(*wp->tmate_line_hash));
+		memset(wp->tmate_line_hash, 0,
+		       sy * sizeof(*wp->tmate_line_hash));
+		wp->tmate_line_hash_size = sy;
+	}
+	if (sy > diff_hashes_size) {
+		diff_hashes = xreallocarray(diff_hashes, sy,
+					    sizeof(*diff_hashes));
+		diff_hashes_size = sy;
+	}
+
+	n = 0;
+	for (y = 0; y < sy; y++) {
+		diff_hashes[y] = hash_line(grid, grid->hsize + y);
+		if (diff_hashes[y] != wp->tmate_line_hash[y])
+			n++;
+	}
+
+	reset_snapshot_styles(&snapshot_buf);
+
+	pack_msg(10, TMATE_OUT_PANE_DIFF);
+	pack(int, wp->id);
+	pack(unsigned_int, s->mode);
+	pack(int, wp->saved_grid != NULL);
+	pack(int, s->cx);
+	pack(int, s->cy);
+	pack(int, s->rupper);
+	pack(int, s->rlower);
+
+	pack(array, n);
+	for (y = 0; y < sy; y++) {
+		if (diff_hashes[y] == wp->tmate_line_hash[y])
+			continue;
+		wp->tmate_line_hash[y] = diff_hashes[y];
+		pack(array, 2);
+		pack(int, y);
+		do_snapshot_line(grid, grid->hsize + y);
+	}
+
+	pack(array, snapshot_buf.num_styles);
+	for (y = 0; y < snapshot_buf.num_styles; y++)
+		pack(unsigned_int, snapshot_buf.styles[y]);
+}
+
+static void on_diff_timer(__unused evutil_socket_t fd,
+			  __unused short what, __unused void *arg)
+{
+	struct timeval tv = { .tv_sec = 0,
+			      .tv_usec = TMATE_DIFF_INTERVAL * 1000 };
+	struct window_pane *wp;
+	size_t backlog;
+	bool pending = false, held;
+
+	held = tmate_should_backoff(NULL, &backlog);
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (!wp->tmate_diff)
+			continue;
+
+		/* Leave the screen as it is until the link catches up. */
+		if (held) {
+			pending = true;
+			continue;
+		}
+
+		/* Snapshot-only panes wait to be viewed, which refreshes them. */
+		if (!diff_due(wp)) {
+			if (wp->tmate_diff_dirty &&
+			    replicate_mode(wp) == TMATE_REPLICATE_THROTTLED)
+				pending = true;
 			continue;
+		}
+
+		if (!snapshot_pending_pane(wp))
+			pack_pane_diff(wp);
+		wp->tmate_diff_dirty = 0;
+		wp->tmate_diff_sent = diff_now();
+
+		if (!diff_wanted(wp) &&
+		    EVBUFFER_LENGTH(input_pending(wp)) == 0) {
+			wp->tmate_diff = 0;
+			wp->tmate_diff_start = diff_now();
+		} else if (replicate_mode(wp) == TMATE_REPLICATE_FULL)
+			pending = true;
+		wp->tmate_diff_bytes = 0;
+	}
+
+	if (pending)
+		evtimer_add(ev_diff, &tv);
+}
+
+/*
+ * Count what a pane prints, and return true if it is to be sent as screen
+ * diffs rather than as it is.
+ */
+static bool diff_pane_pty_data(struct window_pane *wp, size_t len)
+{
+	uint64_t now;
+
+	if (wp->tmate_diff) {
+		wp->tmate_diff_bytes += len;
+		wp->tmate_diff_dirty = 1;
+		schedule_diff();
+		return true;
+	}
+
+	if ((wp->flags & PANE_SYNC) &&
+	    replicate_mode(wp) == TMATE_REPLICATE_FULL)
+		return false;
 
-		TAILQ_FOREACH(pane, &w->panes, entry)
-			do_snapshot_pane(pane, max_history_lines);
+	now = diff_now();
+	if (now - wp->tmate_diff_start >= TMATE_DIFF_INTERVAL) {
+		wp->tmate_diff_start = now;
+		wp->tmate_diff_bytes = 0;
 	}
+	wp->tmate_diff_bytes += len;
+	if (!diff_wanted(wp))
+		return false;
+
+	enter_diff(wp);
+	return true;
+}
+
+/* What is pending has not been sent, the first diff replaces it. */
+static void enter_diff(struct window_pane *wp)
+{
+	if (wp->tmate_pty_buf)
+		evbuffer_drain(wp->tmate_pty_buf,
+			       evbuffer_get_length(wp->tmate_pty_buf));
+	if (wp->tmate_line_hash)
+		memset(wp->tmate_line_hash, 0,
+		       wp->tmate_line_hash_size * sizeof(*wp->tmate_line_hash));
+	wp->tmate_diff = 1;
+	wp->tmate_diff_dirty = 1;
+	wp->tmate_diff_bytes = 0;
+	schedule_diff();
 }
 
 static void tmate_send_reconnection_data(struct tmate_session *session)
@@ -465,15 +2329,26 @@ static void tmate_send_reconnection_data(struct tmate_session *session)
 	if (!session->reconnection_data)
 		return;
 
-	pack(array, 2);
-	pack(int, TMATE_OUT_RECONNECT);
+	pack_msg(2, TMATE_OUT_RECONNECT);
 	pack(string, session->reconnection_data);
 }
 
 #define RECONNECTION_MAX_HISTORY_LINE 300
 
+/*
+ * A local subscriber joined, see tmate-broadcast.c. It needs the layout and
+ * the panes, which the server gets again too.
+ */
+void tmate_send_subscriber_state(void)
+{
+	tmate_sync_full_layout();
+	tmate_send_session_snapshot(RECONNECTION_MAX_HISTORY_LINE);
+}
+
 void tmate_send_reconnection_state(struct tmate_session *session)
 {
+	discard_pty_data();
+
 	/* Start with a fresh encoder */
 	tmate_encoder_destroy(&session->encoder);
 	tmate_encoder_init(&session->encoder, NULL, session);
@@ -481,10 +2356,41 @@ void tmate_send_reconnection_state(struct tmate_session *session)
 	tmate_write_header();
 	tmate_send_reconnection_data(session);
 	replay_saved_cmd(session);
+	tmate_send_authorized_keys(false);
 	/* TODO send all option variables */
 	tmate_write_uname();
 	tmate_write_ready();
 
-	tmate_sync_layout();
+	tmate_sync_full_layout();
 	tmate_send_session_snapshot(RECONNECTION_MAX_HISTORY_LINE);
 }
+
+/*
+ * Pick up where the last connection left off: the server already has
+ * everything it acknowledged, so only the rest of the replay log is sent.
+ * Returns false when that is not possible and the full state must be sent.
+ */
+bool tmate_resume_stream(struct tmate_session *session)
+{
+	struct tmate_encoder *encoder = &session->encoder;
+
+	if (!session->reconnection_data || !encoder->replay_acked ||
+	    encoder->replay_overflow)
+		return false;
+
+	/* What was not acknowledged is in the format of the last connection. */
+	if (configured_protocol_version() != session->protocol_version)
+		return false;
+
+	tmate_encoder_restart(encoder);
+	tmate_write_header();
+
+	encoder->replay_off = true;
+	pack_msg(3, TMATE_OUT_RESUME);
+	pack(string, session->reconnection_data);
+	pack(uint64, encoder->replay_seq);
+	encoder->replay_off = false;
+
+	tmate_encoder_replay(encoder);
+	return true;
+}
@@ -1,36 +1,53 @@
 #include "tmate.h"
 
+/*
+ * Variables set by the server, looked up by name from format_find when a
+ * format uses them rather than copied into every format tree.
+ */
 struct tmate_env {
-	TAILQ_ENTRY(tmate_env) entry;
+	RB_ENTRY(tmate_env) entry;
 	char *name;
 	char *value;
 };
 
-TAILQ_HEAD(, tmate_env) tmate_env_list;
+static int tmate_env_cmp(struct tmate_env *a, struct tmate_env *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+RB_HEAD(tmate_env_tree, tmate_env);
+RB_PROTOTYPE(tmate_env_tree, tmate_env, entry, tmate_env_cmp);
+RB_GENERATE(tmate_env_tree, tmate_env, entry, tmate_env_cmp);
+
+static struct tmate_env_tree tmate_env_tree = RB_INITIALIZER(&tmate_env_tree);
 
 void tmate_set_env(const char *name, const char *value)
 {
-	struct tmate_env *tmate_env;
-
-	TAILQ_FOREACH(tmate_env, &tmate_env_list, entry) {
-		if (!strcmp(tmate_env->name, name)) {
-			free(tmate_env->value);
-			tmate_env->value = xstrdup(value);
-			return;
-		}
+	struct tmate_env *tmate_env, find;
+
+	find.name = (char *)name;
+	tmate_env = RB_FIND(tmate_env_tree, &tmate_env_tree, &find);
+	if (tmate_env) {
+		free(tmate_env->value);
+		tmate_env->value = xstrdup(value);
+		return;
 	}
 
 	tmate_env = xmalloc(sizeof(*tmate_env));
 	tmate_env->name = xstrdup(name);
 	tmate_env->value = xstrdup(value);
-	TAILQ_INSERT_HEAD(&tmate_env_list, tmate_env, entry);
+	RB_INSERT(tmate_env_tree, &tmate_env_tree, tmate_env);
 }
 
-void tmate_format(struct format_tree *ft)
+/* Look up a key a format tree does not have: server variables, then stats. */
+const char *tmate_format_find(const char *key)
 {
-	struct tmate_env *tmate_env;
+	struct tmate_env *tmate_env, find;
 
-	TAILQ_FOREACH(tmate_env, &tmate_env_list, entry) {
-		format_add(ft, tmate_env->name, "%s", tmate_env->value);
-	}
+	find.name = (char *)key;
+	tmate_env = RB_FIND(tmate_env_tree, &tmate_env_tree, &find);
+	if (tmate_env)
+		return tmate_env->value;
+
+	return tmate_stats_find(key);
 }
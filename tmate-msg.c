@@ -56,7 +56,7 @@ static void tmate_status_message_session(const char *message)
 		return;
 
 	struct session *s;
-	s = RB_MIN(sessions, &sessions);
+	s = tmate_tmux_session(&tmate_session);
 	if (!s) {
 		cfg_add_cause("%s", message);
 		return;
@@ -1,20 +1,272 @@
 #include "tmate.h"
 #include "tmate-protocol.h"
 
+static int on_encoder_write(void *userdata, const char *buf, size_t len);
+
+/* The next write starts a message, for tmate_trace_record(). */
+static bool trace_start;
+
+#ifdef HAVE_ZLIB
+#define ZSTREAM_CHUNK_SIZE 4096
+
+static void deflate_to_buffer(struct tmate_encoder *encoder,
+			      const char *buf, size_t len, int flush)
+{
+	z_stream *zs = encoder->zstream;
+	struct evbuffer_iovec iov;
+
+	zs->next_in = (Bytef *)buf;
+	zs->avail_in = len;
+
+	do {
+		if (evbuffer_reserve_space(encoder->buffer, ZSTREAM_CHUNK_SIZE,
+					   &iov, 1) < 1)
+			tmate_fatal("Cannot buffer encoded data");
+
+		zs->next_out = iov.iov_base;
+		zs->avail_out = iov.iov_len;
+
+		if (deflate(zs, flush) == Z_STREAM_ERROR)
+			tmate_fatal("Cannot compress encoded data");
+
+		iov.iov_len -= zs->avail_out;
+		if (evbuffer_commit_space(encoder->buffer, &iov, 1) < 0)
+			tmate_fatal("Cannot buffer encoded data");
+	} while (zs->avail_out == 0);
+
+	encoder->zdirty = flush == Z_NO_FLUSH;
+}
+#endif
+
+/*
+ * Messages are marked with their type and the time they were packed. Once
+ * they have been flushed (and when compressed, the deflate sync point is in
+ * the buffer), the position of their last byte is known, and they are timed
+ * when the buffer has been drained that far.
+ */
+#define ENCODER_MAX_MARKS 16384
+
+static void close_marks(struct tmate_encoder *encoder)
+{
+	uint64_t end;
+	unsigned int i;
+
+	end = encoder->written + evbuffer_get_length(encoder->buffer);
+	for (i = encoder->nmarks; i > encoder->first_mark; i--) {
+		if (encoder->marks[i - 1].end != 0)
+			break;
+		encoder->marks[i - 1].end = end;
+	}
+}
+
+/* Drop the n oldest messages from the replay log. */
+static void replay_drop(struct tmate_encoder *encoder, unsigned int n)
+{
+	uint64_t end;
+
+	if (encoder->replay_first + n < encoder->replay_count)
+		end = encoder->replay_starts[encoder->replay_first + n];
+	else
+		end = encoder->replay_dropped +
+		      evbuffer_get_length(encoder->replay);
+
+	evbuffer_drain(encoder->replay, end - encoder->replay_dropped);
+	encoder->replay_dropped = end;
+	encoder->replay_seq += n;
+	encoder->replay_first += n;
+
+	if (encoder->replay_first >= encoder->replay_count)
+		encoder->replay_first = encoder->replay_count = 0;
+}
+
+static void replay_add(struct tmate_encoder *encoder)
+{
+	size_t max = options_get_number(global_options, "tmate-replay-size");
+	unsigned int live;
+
+	if (encoder->replay_first != 0 &&
+	    encoder->replay_first >= encoder->replay_count / 2) {
+		live = encoder->replay_count - encoder->replay_first;
+		memmove(encoder->replay_starts,
+			encoder->replay_starts + encoder->replay_first,
+			live * sizeof(*encoder->replay_starts));
+		encoder->replay_count = live;
+		encoder->replay_first = 0;
+	}
+
+	encoder->replay_starts = xreallocarray(encoder->replay_starts,
+			encoder->replay_count + 1, sizeof(*encoder->replay_starts));
+	encoder->replay_starts[encoder->replay_count++] =
+		encoder->replay_dropped + evbuffer_get_length(encoder->replay);
+
+	/*
+	 * Keep the log bounded. Dropping a message the server has not
+	 * acknowledged means the next reconnection needs the full state.
+	 */
+	live = encoder->replay_count - encoder->replay_first;
+	while (live > 1 && evbuffer_get_length(encoder->replay) > max) {
+		replay_drop(encoder, 1);
+		encoder->replay_overflow = true;
+		live--;
+	}
+}
+
+void tmate_encoder_mark(struct tmate_encoder *encoder, int type)
+{
+	struct tmate_encoder_mark *mark;
+
+	trace_start = true;
+	if (encoder->replay && !encoder->replay_off)
+		replay_add(encoder);
+
+	if (encoder->nmarks - encoder->first_mark >= ENCODER_MAX_MARKS)
+		return;
+
+	if (encoder->first_mark != 0 &&
+	    encoder->first_mark >= encoder->nmarks / 2) {
+		memmove(encoder->marks, encoder->marks + encoder->first_mark,
+			(encoder->nmarks - encoder->first_mark) *
+			sizeof(*encoder->marks));
+		encoder->nmarks -= encoder->first_mark;
+		encoder->first_mark = 0;
+	}
+
+	encoder->marks = xreallocarray(encoder->marks, encoder->nmarks + 1,
+				       sizeof(*encoder->marks));
+	mark = &encoder->marks[encoder->nmarks++];
+	mark->type = type;
+	gettimeofday(&mark->queued, NULL);
+	mark->end = 0;
+}
+
+/* The server has everything up to seq. */
+void tmate_encoder_ack(struct tmate_encoder *encoder, uint64_t seq)
+{
+	unsigned int live;
+	uint64_t n;
+
+	encoder->replay_acked = true;
+
+	if (!encoder->replay || seq < encoder->replay_seq)
+		return;
+
+	live = encoder->replay_count - encoder->replay_first;
+	n = seq - encoder->replay_seq + 1;
+	if (n > live)
+		n = live;
+	if (n)
+		replay_drop(encoder, n);
+}
+
+/*
+ * Throw away what has not been written, and start a new compression stream,
+ * for a new connection. The replay log is kept.
+ */
+void tmate_encoder_restart(struct tmate_encoder *encoder)
+{
+	evbuffer_drain(encoder->buffer, evbuffer_get_length(encoder->buffer));
+#ifdef HAVE_ZLIB
+	if (encoder->zstream) {
+		deflateEnd(encoder->zstream);
+		free(encoder->zstream);
+		encoder->zstream = NULL;
+	}
+	encoder->zdirty = false;
+#endif
+	free(encoder->marks);
+	encoder->marks = NULL;
+	encoder->nmarks = encoder->first_mark = 0;
+}
+
+/* Write the replay log out again. */
+void tmate_encoder_replay(struct tmate_encoder *encoder)
+{
+	struct evbuffer_iovec *iov;
+	bool replay_off = encoder->replay_off;
+	int i, n;
+
+	n = evbuffer_peek(encoder->replay, -1, NULL, NULL, 0);
+	if (n <= 0)
+		return;
+
+	iov = xreallocarray(NULL, n, sizeof(*iov));
+	n = evbuffer_peek(encoder->replay, -1, NULL, iov, n);
+
+	encoder->replay_off = true;
+	for (i = 0; i < n; i++)
+		on_encoder_write(encoder, iov[i].iov_base, iov[i].iov_len);
+	encoder->replay_off = replay_off;
+
+	free(iov);
+}
+
+void tmate_encoder_drained(struct tmate_encoder *encoder, size_t len)
+{
+	struct tmate_encoder_mark *mark;
+
+	encoder->written += len;
+
+	while (encoder->first_mark < encoder->nmarks) {
+		mark = &encoder->marks[encoder->first_mark];
+		if (mark->end == 0 || mark->end > encoder->written)
+			break;
+		tmate_stats_record(tmate_stats.out, mark->type, &mark->queued);
+		encoder->first_mark++;
+	}
+
+	if (encoder->first_mark == encoder->nmarks)
+		encoder->first_mark = encoder->nmarks = 0;
+}
+
 static void on_encoder_buffer_ready(__unused evutil_socket_t fd,
 				    __unused short what, void *arg)
 {
 	struct tmate_encoder *encoder = arg;
+	struct timeval start;
 
+	watchdog_start(&start);
 	encoder->ev_active = false;
+
+#ifdef HAVE_ZLIB
+	/*
+	 * Each flush ends with a sync point, so the server can decode
+	 * everything we have written so far. The compression window is kept
+	 * across flushes.
+	 */
+	if (encoder->zstream && encoder->zdirty)
+		deflate_to_buffer(encoder, NULL, 0, Z_SYNC_FLUSH);
+#endif
+
+	close_marks(encoder);
+	tmate_stats_flushed(encoder);
+	tmate_broadcast_flush();
+
 	if (encoder->ready_callback)
 		encoder->ready_callback(encoder->userdata, encoder->buffer);
+
+	watchdog_stop(WATCHDOG_TMATE_FLUSH, &start, "%zu bytes left",
+		      evbuffer_get_length(encoder->buffer));
 }
 
 static int on_encoder_write(void *userdata, const char *buf, size_t len)
 {
 	struct tmate_encoder *encoder = userdata;
 
+	tmate_stats.packed += len;
+	tmate_trace_record(TMATE_TRACE_OUT, trace_start, buf, len);
+	trace_start = false;
+
+	if (!encoder->replay_off) {
+		if (encoder->replay && evbuffer_add(encoder->replay, buf, len) < 0)
+			tmate_fatal("Cannot buffer encoded data");
+		tmate_broadcast_write(buf, len);
+	}
+
+#ifdef HAVE_ZLIB
+	if (encoder->zstream)
+		deflate_to_buffer(encoder, buf, len, Z_NO_FLUSH);
+	else
+#endif
 	if (evbuffer_add(encoder->buffer, buf, len) < 0)
 		tmate_fatal("Cannot buffer encoded data");
 
@@ -26,6 +278,85 @@ static int on_encoder_write(void *userdata, const char *buf, size_t len)
 	return 0;
 }
 
+static int on_scratch_write(void *userdata, const char *buf, size_t len)
+{
+	struct evbuffer_iovec *iov = userdata;
+
+	memcpy((char *)iov->iov_base + iov->iov_len, buf, len);
+	iov->iov_len += len;
+	return 0;
+}
+
+static void copy_iov(struct evbuffer *evb, const struct evbuffer_iovec *iov,
+		     int n, size_t len)
+{
+	struct evbuffer_iovec space;
+	char *p;
+	int i;
+
+	if (evbuffer_reserve_space(evb, len, &space, 1) < 1)
+		tmate_fatal("Cannot buffer encoded data");
+
+	for (p = space.iov_base, i = 0; i < n; p += iov[i].iov_len, i++)
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+
+	space.iov_len = len;
+	if (evbuffer_commit_space(evb, &space, 1) < 0)
+		tmate_fatal("Cannot buffer encoded data");
+}
+
+/*
+ * Packs [TMATE_OUT_PTY_DATA, int: pane_id, binary: buf] as pack() would, but
+ * the header is built on the stack and copied with the body into space
+ * reserved at once, rather than going through on_encoder_write() five times.
+ */
+#define PTY_FRAME_HEADER_MAX 16
+
+void tmate_encoder_pty_frame(struct tmate_encoder *encoder, int pane_id,
+			     const char *buf, size_t len)
+{
+	char header[PTY_FRAME_HEADER_MAX];
+	struct evbuffer_iovec iov[2];
+	msgpack_packer pk;
+	size_t total;
+
+	tmate_encoder_mark(encoder, TMATE_OUT_PTY_DATA);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = 0;
+	msgpack_packer_init(&pk, &iov[0], on_scratch_write);
+	msgpack_pack_array(&pk, 3);
+	msgpack_pack_int(&pk, TMATE_OUT_PTY_DATA);
+	msgpack_pack_int(&pk, pane_id);
+	msgpack_pack_str(&pk, len);
+
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	total = iov[0].iov_len + len;
+
+	tmate_stats.packed += total;
+
+	if (!encoder->replay_off) {
+		if (encoder->replay)
+			copy_iov(encoder->replay, iov, 2, total);
+		tmate_broadcast_write(header, iov[0].iov_len);
+		tmate_broadcast_write(buf, len);
+	}
+
+#ifdef HAVE_ZLIB
+	if (encoder->zstream) {
+		deflate_to_buffer(encoder, header, iov[0].iov_len, Z_NO_FLUSH);
+		deflate_to_buffer(encoder, buf, len, Z_NO_FLUSH);
+	} else
+#endif
+	copy_iov(encoder->buffer, iov, 2, total);
+
+	if (!encoder->ev_active) {
+		event_active(encoder->ev_buffer, EV_READ, 0);
+		encoder->ev_active = true;
+	}
+}
+
 /* Really sad hack, but we can get away with it */
 #define tmate_encoder_from_pk(pk) ((struct tmate_encoder *)pk)
 
@@ -51,10 +382,11 @@ void tmate_encoder_init(struct tmate_encoder *encoder,
 {
 	msgpack_packer_init(&encoder->pk, encoder, &on_encoder_write);
 	encoder->buffer = evbuffer_new();
+	encoder->replay = evbuffer_new();
 	encoder->ready_callback = callback;
 	encoder->userdata = userdata;
 
-	if (!encoder->buffer)
+	if (!encoder->buffer || !encoder->replay)
 		tmate_fatal("Can't allocate buffer");
 
 	encoder->ev_buffer = event_new(tmate_session.ev_base, -1,
@@ -70,6 +402,15 @@ void tmate_encoder_init(struct tmate_encoder *encoder,
 void tmate_encoder_destroy(struct tmate_encoder *encoder)
 {
 	/* encoder->pk doesn't need any cleanup */
+#ifdef HAVE_ZLIB
+	if (encoder->zstream) {
+		deflateEnd(encoder->zstream);
+		free(encoder->zstream);
+	}
+#endif
+	free(encoder->marks);
+	free(encoder->replay_starts);
+	evbuffer_free(encoder->replay);
 	evbuffer_free(encoder->buffer);
 	event_del(encoder->ev_buffer);
 	event_free(encoder->ev_buffer);
@@ -86,6 +427,52 @@ void tmate_encoder_set_ready_callback(struct tmate_encoder *encoder,
 		encoder->ready_callback(encoder->userdata, encoder->buffer);
 }
 
+#ifdef HAVE_ZLIB
+/* Everything written after this call is deflate compressed. */
+void tmate_encoder_enable_compression(struct tmate_encoder *encoder)
+{
+	if (encoder->zstream)
+		return;
+
+	encoder->zstream = xcalloc(1, sizeof(*encoder->zstream));
+	if (deflateInit(encoder->zstream, Z_DEFAULT_COMPRESSION) != Z_OK)
+		tmate_fatal("Cannot initialize compression");
+	encoder->zdirty = false;
+}
+#endif
+
+/*
+ * Runs write_fn() on an empty buffer, and then writes back what was
+ * buffered so far. This is how the header ends up in front of the messages
+ * queued while parsing the config files.
+ */
+void tmate_encoder_write_first(struct tmate_encoder *encoder,
+			       void (*write_fn)(void))
+{
+	struct evbuffer *pending = encoder->buffer;
+	struct evbuffer_iovec iov;
+	unsigned int i;
+
+	encoder->buffer = evbuffer_new();
+	if (!encoder->buffer)
+		tmate_fatal("Can't allocate buffer");
+
+	write_fn();
+
+	/* Already in the replay log. */
+	encoder->replay_off = true;
+	while (evbuffer_peek(pending, -1, NULL, &iov, 1) > 0) {
+		on_encoder_write(encoder, iov.iov_base, iov.iov_len);
+		evbuffer_drain(pending, iov.iov_len);
+	}
+	encoder->replay_off = false;
+	evbuffer_free(pending);
+
+	/* The header went in front, so where the messages end has moved. */
+	for (i = encoder->first_mark; i < encoder->nmarks; i++)
+		encoder->marks[i].end = 0;
+}
+
 void tmate_decoder_error(void)
 {
 	/* TODO Don't kill the session, disconnect */
@@ -170,6 +557,36 @@ char *unpack_string(struct tmate_unpacker *uk)
 	return alloc_buf;
 }
 
+/*
+ * The zone of the message being dispatched. Strings unpacked with
+ * unpack_cstring() are allocated there and go away with the message.
+ */
+static msgpack_zone *dispatch_zone;
+
+/*
+ * Like unpack_string(), but the string is only valid until the handler
+ * returns and must not be freed. It costs no malloc.
+ */
+const char *unpack_cstring(struct tmate_unpacker *uk)
+{
+	const char *buf;
+	char *str;
+	size_t len;
+
+	unpack_buffer(uk, &buf, &len);
+
+	if (!dispatch_zone)
+		tmate_fatal("unpack_cstring() outside of a dispatch");
+
+	str = msgpack_zone_malloc(dispatch_zone, len + 1);
+	if (!str)
+		tmate_fatal("out of memory");
+	memcpy(str, buf, len);
+	str[len] = '\0';
+
+	return str;
+}
+
 void unpack_array(struct tmate_unpacker *uk, struct tmate_unpacker *nested)
 {
 	if (uk->argc == 0)
@@ -181,7 +598,14 @@ void unpack_array(struct tmate_unpacker *uk, struct tmate_unpacker *nested)
 	uk->argc--;
 }
 
+/*
+ * How much is reserved for each read adapts to the traffic: it doubles when a
+ * read fills it or a message is bigger, and halves back after a while of
+ * small reads.
+ */
 #define UNPACKER_RESERVE_SIZE 1024
+#define UNPACKER_MAX_RESERVE_SIZE (1024 * 1024)
+#define UNPACKER_SHRINK_READS 64
 
 void tmate_decoder_init(struct tmate_decoder *decoder, tmate_decoder_reader *reader,
 			void *userdata)
@@ -190,6 +614,8 @@ void tmate_decoder_init(struct tmate_decoder *decoder, tmate_decoder_reader *rea
 		tmate_fatal("Cannot initialize the unpacker");
 	decoder->reader = reader;
 	decoder->userdata = userdata;
+	decoder->reserve = UNPACKER_RESERVE_SIZE;
+	decoder->small_reads = 0;
 }
 
 void tmate_decoder_destroy(struct tmate_decoder *decoder)
@@ -201,24 +627,61 @@ void tmate_decoder_destroy(struct tmate_decoder *decoder)
 void tmate_decoder_get_buffer(struct tmate_decoder *decoder,
 			      char **buf, size_t *len)
 {
-	if (!msgpack_unpacker_reserve_buffer(&decoder->unpacker, UNPACKER_RESERVE_SIZE))
+	if (!msgpack_unpacker_reserve_buffer(&decoder->unpacker, decoder->reserve))
 		tmate_fatal("cannot expand decoder buffer");
 
 	*buf = msgpack_unpacker_buffer(&decoder->unpacker);
 	*len = msgpack_unpacker_buffer_capacity(&decoder->unpacker);
 }
 
+static void resize_reserve(struct tmate_decoder *decoder, size_t len)
+{
+	size_t pending;
+
+	/* Destroyed by a handler */
+	if (!decoder->reserve)
+		return;
+
+	pending = msgpack_unpacker_message_size(&decoder->unpacker);
+
+	if (len >= decoder->reserve || pending > decoder->reserve) {
+		while (decoder->reserve < UNPACKER_MAX_RESERVE_SIZE &&
+		       (decoder->reserve <= len || decoder->reserve < pending))
+			decoder->reserve *= 2;
+		decoder->small_reads = 0;
+	} else if (len < decoder->reserve / 4 &&
+		   decoder->reserve > UNPACKER_RESERVE_SIZE) {
+		if (++decoder->small_reads == UNPACKER_SHRINK_READS) {
+			decoder->reserve /= 2;
+			decoder->small_reads = 0;
+		}
+	} else
+		decoder->small_reads = 0;
+}
+
 void tmate_decoder_commit(struct tmate_decoder *decoder, size_t len)
 {
 	struct tmate_unpacker _uk, *uk = &_uk;
 	msgpack_unpacked result;
 
+	tmate_trace_record(TMATE_TRACE_IN,
+			   !msgpack_unpacker_message_size(&decoder->unpacker),
+			   msgpack_unpacker_buffer(&decoder->unpacker), len);
 	msgpack_unpacker_buffer_consumed(&decoder->unpacker, len);
+	gettimeofday(&decoder->decoded, NULL);
 
+	/*
+	 * Strings and binaries in the messages point into the unpacker
+	 * buffer, nothing is copied before the handlers.
+	 */
 	msgpack_unpacked_init(&result);
 	while (msgpack_unpacker_next(&decoder->unpacker, &result)) {
 		init_unpacker(uk, result.data);
+		dispatch_zone = result.zone;
 		decoder->reader(decoder->userdata, uk);
+		dispatch_zone = NULL;
 	}
 	msgpack_unpacked_destroy(&result);
+
+	resize_reserve(decoder, len);
 }
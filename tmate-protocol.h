@@ -57,13 +57,60 @@ enum tmate_daemon_out_msg_types {
 	TMATE_OUT_SNAPSHOT,
 	TMATE_OUT_EXEC_CMD,
 	TMATE_OUT_UNAME,
+	TMATE_OUT_SYNC_LAYOUT_DIFF,
+	TMATE_OUT_SNAPSHOT_BEGIN,
+	TMATE_OUT_SNAPSHOT_PANE,
+	TMATE_OUT_SNAPSHOT_END,
+	TMATE_OUT_STATS,
+	TMATE_OUT_RESUME,
+	TMATE_OUT_ECHO_HINT,
+	TMATE_OUT_PANE_DIFF,
+	TMATE_OUT_LATENCY_PROBE,
+	TMATE_OUT_AUTHORIZED_KEYS,
+	TMATE_OUT_EXEC_CMDS,
+	TMATE_OUT_SNAPSHOT_HISTORY,
+};
+
+enum tmate_snapshot_flags {
+	TMATE_SNAPSHOT_VISIBLE_FIRST = 0x1,
+};
+
+enum tmate_replicate_mode {
+	TMATE_REPLICATE_FULL,
+	TMATE_REPLICATE_THROTTLED,
+	TMATE_REPLICATE_SNAPSHOT,
+	TMATE_REPLICATE_PRIVATE,
+};
+
+enum tmate_echo_flags {
+	TMATE_ECHO_COOKED = 0x1,
+	TMATE_ECHO_OTHER_SCREEN = 0x2,
 };
 
 /*
-[TMATE_OUT_HEADER, int: proto_version, string: version]
+[TMATE_OUT_HEADER, int: proto_version, string: version, string: compression]
+	// proto_version: tmate-protocol-version, 6 unless set to what the
+	// server knows. What a later version added is only sent when the
+	// version is at least that, as noted below; the rest is as in 6.
+	// compression: "" or "deflate". When set, everything after the header
+	// is a single deflate stream, sync flushed after each write. Version
+	// 10, the header of older versions stops at version and is never
+	// compressed.
 [TMATE_OUT_SYNC_LAYOUT, [int: sx, int: sy, [[int: win_id, string: win_name,
-			  [[int: pane_id, int: sx, int: sy, int: xoff, int: yoff], ...],
+			  [[int: pane_id, int: sx, int: sy, int: xoff, int: yoff,
+			    int: replicate], ...],
 			  int: active_pane_id], ...], int: active_win_id]
+	// replicate: the tmate_replicate_mode of the pane, from the
+	// tmate-replicate window option. It is left out for
+	// TMATE_REPLICATE_FULL: output is sent as it comes, as servers not
+	// knowing the option expect. TMATE_REPLICATE_THROTTLED: only as
+	// TMATE_OUT_PANE_DIFF, at most tmate-replicate-rate a second.
+	// TMATE_REPLICATE_SNAPSHOT: only as TMATE_OUT_PANE_DIFF, while a
+	// viewer looks at the pane (its focus, or the active pane of the
+	// current window). In both, the history is only what snapshots have.
+	// TMATE_REPLICATE_PRIVATE: nothing of the pane is sent, it is empty in
+	// snapshots; once it is not private any more, the first
+	// TMATE_OUT_PANE_DIFF has all of it.
 [TMATE_OUT_PTY_DATA, int: pane_id, binary: buffer]
 [TMATE_OUT_EXEC_CMD_STR, string: cmd]
 [TMATE_OUT_FAILED_CMD, int: client_id, string: cause]
@@ -76,10 +123,104 @@ enum tmate_daemon_out_msg_types {
 [TMATE_OUT_FIN]
 [TMATE_OUT_READY]
 [TMATE_OUT_RECONNECT, string: reconnection_data]
-[TMATE_OUT_SNAPSHOT, ...]
+[TMATE_OUT_SNAPSHOT, [pane, ...]]
+	// Before version 9, instead of TMATE_OUT_SNAPSHOT_BEGIN and what
+	// follows it. pane is as in TMATE_OUT_SNAPSHOT_PANE, all of them are
+	// in the one message.
 [TMATE_OUT_EXEC_CMD, string: cmd_name, ...string: args]
 [TMATE_OUT_UNAME, string: name.sysname, string: name.nodename,
                   string: name.release, string: name.version, string: name.machine]
+[TMATE_OUT_SYNC_LAYOUT_DIFF, int: sx, int: sy, [[int: win_id, string: win_name,
+			       [[int: pane_id, int: sx, int: sy, int: xoff, int: yoff,
+				 int: replicate], ...],
+			       int: active_pane_id], ...], [int: closed_win_id, ...],
+			       int: active_win_id]
+			       // Only the windows that changed since the last sync.
+			       // Version 7, before that TMATE_OUT_SYNC_LAYOUT
+[TMATE_OUT_SNAPSHOT_BEGIN, int: snapshot_id, int: max_history_lines, int: flags]
+	// flags is only there with tmate-snapshot-visible-first, from version
+	// 11, and is then TMATE_SNAPSHOT_VISIBLE_FIRST: the panes come in the
+	// order viewers see them (the current window first, the active pane of
+	// each window before the others) and their TMATE_OUT_SNAPSHOT_PANE has
+	// only the screen, which can be drawn straight away. The history follows in
+	// TMATE_OUT_SNAPSHOT_HISTORY, after all the screens.
+[TMATE_OUT_SNAPSHOT_PANE, int: snapshot_id, int: seq,
+			  [int: pane_id, int: mode,
+			   [int: cur_x, int: cur_y, [line, ...]],
+			   [int: saved_cx, int: saved_cy, [line, ...]] | nil,
+			   [int: char_attr, ...]: styles]]
+	// line: [string: line_utf8, [int: style, int: run_length, ...]]
+	// style: index in styles, which has each char_attr of the pane once
+	// Before version 11, there are no styles and line is
+	// [string: line_utf8, [int: char_attr, int: run_length, ...]]; before
+	// version 8, [string: line_utf8, [int: char_attr, ...]], with the
+	// char_attr of each cell.
+	// char_attr: flags << 24 | attr << 16 | bg << 8 | fg
+	// No PTY data is sent for a pane until its TMATE_OUT_SNAPSHOT_PANE
+	// has been sent.
+[TMATE_OUT_SNAPSHOT_END, int: snapshot_id, int: num_panes]
+[TMATE_OUT_SNAPSHOT_HISTORY, int: snapshot_id, int: pane_id, [line, ...],
+			     [int: char_attr, ...]: styles]
+	// With TMATE_SNAPSHOT_VISIBLE_FIRST, the history of a pane from the
+	// newest line to the oldest, in a few messages of up to 1000 lines.
+	// The lines go above the history the pane has; that is older than
+	// what its PTY data scrolled into the history since its screen was
+	// sent. line and styles are as in TMATE_OUT_SNAPSHOT_PANE.
+[TMATE_OUT_STATS, [hist, ...]: in, [hist, ...]: out, host]
+	// hist: [int: msg_type, int: count, int: total_us, int: max_us,
+	//        [int: count, ...]]
+	// Bucket i counts latencies under 2^i microseconds, the last one
+	// everything above. In: from decoding to the handler returning. Out:
+	// from packing to being written to the channel. Sent every
+	// tmate-stats-interval seconds, the counts never reset.
+	// host: [int: encoder_length, int: encoder_max_length,
+	//        int: pty_coalesced, int: loop_lag_us, int: rss,
+	//        int: grid_bytes, int: reconnects,
+	//        [[int: pane_id, int: pty_bytes], ...]]
+	// pty_coalesced: pty writes not sent as TMATE_OUT_PTY_DATA because a
+	// snapshot or a TMATE_OUT_PANE_DIFF covers them. loop_lag_us: how late
+	// the timer sending this message fired, the event loop was busy that
+	// long. rss and grid_bytes (history and screens) are in bytes, rss is 0
+	// where it cannot be known. pty_bytes: all the output of the pane.
+[TMATE_OUT_RESUME, string: reconnection_data, uint64: seq]
+	// Sent after the header instead of the full state when reconnecting.
+	// Messages after the header are numbered from 0, not counting
+	// TMATE_OUT_RESUME itself. What follows continues from message seq,
+	// the first one not acknowledged with TMATE_IN_ACK. If the server
+	// cannot resume, it replies TMATE_IN_RESUME_FAILED and the client
+	// sends a new header and the full state, on a new deflate stream.
+[TMATE_OUT_ECHO_HINT, int: pane_id, int: epoch, int: flags, int: cx, int: cy]
+	// Sent with tmate-echo-hints, after the output of a pane which was
+	// given keys. epoch counts the TMATE_IN_PANE_KEY and TMATE_IN_PANE_KEYS
+	// messages for the pane, up to which the output is now complete.
+	// TMATE_ECHO_COOKED: the terminal echoes and edits lines itself.
+	// TMATE_ECHO_OTHER_SCREEN: a mode or the alternate screen is shown,
+	// typing cannot be predicted. cx, cy: the cursor in the pane.
+[TMATE_OUT_PANE_DIFF, int: pane_id, int: mode, int: alternate_on,
+		      int: cx, int: cy, int: rupper, int: rlower,
+		      [[int: y, line], ...], [int: char_attr, ...]: styles]
+	// Sent with tmate-screen-diff-size or tmate-screen-diff-backlog instead
+	// of the TMATE_OUT_PTY_DATA of a pane printing too fast, see
+	// tmate-encoder.c. Only the visible lines which changed since the
+	// previous TMATE_OUT_PANE_DIFF of the pane are there, all of them in
+	// the first. line and styles are as in TMATE_OUT_SNAPSHOT_PANE.
+	// TMATE_OUT_PTY_DATA for the pane resumes after the last one, with the
+	// parser in the ground state.
+[TMATE_OUT_LATENCY_PROBE, uint64: ns] // Monotonic time on the host
+	// Sent every tmate-latency-interval seconds, after the pending
+	// TMATE_OUT_PTY_DATA. The server replies TMATE_IN_LATENCY_PROBE.
+	// Also sent every tmate-heartbeat-interval seconds while nothing
+	// comes from the server, to tell a dead connection quickly.
+[TMATE_OUT_AUTHORIZED_KEYS, string: hash, [string: key, ...] | nil]
+	// Sent with tmate-authorized-keys-bulk instead of a tmate-set of
+	// authorized_keys per key. The keys are nil when reconnecting: the
+	// server replies TMATE_IN_AUTHORIZED_KEYS_WANTED if it does not have
+	// keys with that hash. Empty keys are ignored.
+[TMATE_OUT_EXEC_CMDS, [[string: cmd_name, ...string: args], ...]]
+	// Sent with tmate-exec-cmds-bulk instead of a TMATE_OUT_EXEC_CMD for
+	// each of the commands replicated while the config file is read, and
+	// of those replayed on reconnection. The server runs them all, in
+	// order, before the next message.
 */
 
 enum tmate_daemon_in_msg_types {
@@ -91,6 +232,13 @@ enum tmate_daemon_in_msg_types {
 	TMATE_IN_READY,
 	TMATE_IN_PANE_KEY,
 	TMATE_IN_EXEC_CMD,
+	TMATE_IN_SYNC_LAYOUT,
+	TMATE_IN_PANE_KEYS,
+	TMATE_IN_ACK,
+	TMATE_IN_RESUME_FAILED,
+	TMATE_IN_PANE_FOCUS,
+	TMATE_IN_LATENCY_PROBE,
+	TMATE_IN_AUTHORIZED_KEYS_WANTED,
 };
 
 /*
@@ -99,9 +247,25 @@ enum tmate_daemon_in_msg_types {
 [TMATE_IN_RESIZE, int: sx, int: sy] // sx == -1: no clients
 [TMATE_IN_EXEC_CMD_STR, int: client_id, string: cmd]
 [TMATE_IN_SET_ENV, string: name, string: value]
+	// tmate_reconnection_data is given back when reconnecting, and
+	// tmate_reconnection_retry_after is how many seconds to wait first
+	// (with some jitter) the next time the connection is lost.
 [TMATE_IN_READY]
 [TMATE_IN_PANE_KEY, int: pane_id, uint64 keycode] // pane_id == -1: active pane
 [TMATE_IN_EXEC_CMD, int: client_id, ...string: args]
+[TMATE_IN_SYNC_LAYOUT] // Requests a full TMATE_OUT_SYNC_LAYOUT
+[TMATE_IN_PANE_KEYS, int: pane_id, [uint64: keycode, ...] | string: keys]
+	// pane_id == -1: active pane. A string is written to the pane as
+	// typed text; keycodes are as in TMATE_IN_PANE_KEY.
+[TMATE_IN_ACK, uint64: seq] // All messages up to seq were received
+[TMATE_IN_RESUME_FAILED]
+[TMATE_IN_PANE_FOCUS, [int: pane_id, ...]] // Panes viewers are looking at
+	// Their output goes first when the link is busy, with the active pane.
+	// Each message replaces the previous list.
+[TMATE_IN_LATENCY_PROBE, uint64: ns, int: viewers_ms]
+	// ns from TMATE_OUT_LATENCY_PROBE. viewers_ms: the highest latency
+	// from the server to a viewer, as in TMATE_CTL_LATENCY, -1 if unknown.
+[TMATE_IN_AUTHORIZED_KEYS_WANTED] // Send TMATE_OUT_AUTHORIZED_KEYS in full
 */
 
 #endif
@@ -0,0 +1,479 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tmate.h"
+
+/*
+ * Recorder of what the panes print, into the file named by tmate-record-file,
+ * so that a session can be kept without piping every pane into a shell.
+ *
+ * The file is a header followed by frames, and is only ever appended to. A
+ * frame is a struct record_frame then a msgpack stream of events, deflated
+ * when tmate-record-compress is on. An event is an array of its type and
+ * the wall clock time in milliseconds, then:
+ *
+ *   RECORD_LAYOUT: sx, sy, active window idx,
+ *		    [[idx, name, active pane id, [[id, sx, sy, xoff, yoff]]]]
+ *   RECORD_PTY:    pane id, data
+ *
+ * Every frame starts with the layout, so it can be read on its own, and the
+ * layout is recorded again each time tmate_sync_layout() sends it. Output is
+ * buffered until a frame holds RECORD_FRAME_SIZE bytes or a second has
+ * passed. For each frame, path.idx gets a struct record_index, to find where
+ * to start reading from a given time. The files are synced every
+ * tmate-record-sync seconds rather than at every frame.
+ *
+ * record-export turns a recording into an asciicast.
+ */
+
+#define RECORD_MAGIC "TMREC001"
+#define RECORD_VERSION 1
+#define RECORD_FRAME_SIZE (64 * 1024)
+#define RECORD_FRAME_MAX (64 * 1024 * 1024)
+
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+};
+
+struct record_frame {
+	uint32_t len;
+	uint32_t raw_len;	/* len if not compressed */
+	uint64_t ms;
+};
+
+struct record_index {
+	uint64_t ms;
+	uint64_t offset;
+};
+
+static int record_fd = -1;
+static int index_fd = -1;
+static uint64_t record_offset;
+static msgpack_sbuffer record_sbuf;
+static msgpack_packer record_pk;
+static uint64_t frame_ms;
+static time_t last_sync;
+static struct event *record_timer;
+
+static uint64_t record_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void pack_string(msgpack_packer *pk, const char *s)
+{
+	size_t len = strlen(s);
+
+	msgpack_pack_str(pk, len);
+	msgpack_pack_str_body(pk, s, len);
+}
+
+static void pack_layout(uint64_t ms)
+{
+	msgpack_packer *pk = &record_pk;
+	struct session *s;
+	struct winlink *wl;
+	struct window_pane *wp;
+	u_int n;
+
+	s = tmate_tmux_session(&tmate_session);
+	if (!s)
+		return;
+
+	msgpack_pack_array(pk, 6);
+	msgpack_pack_int(pk, TMATE_RECORD_LAYOUT);
+	msgpack_pack_uint64(pk, ms);
+	msgpack_pack_unsigned_int(pk, s->sx);
+	msgpack_pack_unsigned_int(pk, s->sy);
+	msgpack_pack_int(pk, s->curw ? s->curw->idx : -1);
+
+	n = 0;
+	RB_FOREACH(wl, winlinks, &s->windows)
+		n++;
+	msgpack_pack_array(pk, n);
+	RB_FOREACH(wl, winlinks, &s->windows) {
+		msgpack_pack_array(pk, 4);
+		msgpack_pack_int(pk, wl->idx);
+		pack_string(pk, wl->window->name);
+		msgpack_pack_int(pk, wl->window->active ?
+				 (int)wl->window->active->id : -1);
+
+		n = window_count_panes(wl->window);
+		msgpack_pack_array(pk, n);
+		TAILQ_FOREACH(wp, &wl->window->panes, entry) {
+			msgpack_pack_array(pk, 5);
+			msgpack_pack_unsigned_int(pk, wp->id);
+			msgpack_pack_unsigned_int(pk, wp->sx);
+			msgpack_pack_unsigned_int(pk, wp->sy);
+			msgpack_pack_unsigned_int(pk, wp->xoff);
+			msgpack_pack_unsigned_int(pk, wp->yoff);
+		}
+	}
+}
+
+static void record_stop(const char *what)
+{
+	tmate_info("Stopped recording panes, cannot %s: %s", what,
+		   strerror(errno));
+	close(record_fd);
+	close(index_fd);
+	record_fd = index_fd = -1;
+	msgpack_sbuffer_clear(&record_sbuf);
+}
+
+static void record_sync(bool force)
+{
+	time_t now = time(NULL);
+	int interval;
+
+	interval = options_get_number(global_options, "tmate-record-sync");
+	if (!force && now - last_sync < interval)
+		return;
+	last_sync = now;
+
+	fdatasync(record_fd);
+	fdatasync(index_fd);
+}
+
+static void flush_frame(void)
+{
+	struct record_frame frame;
+	struct record_index index;
+	const char *payload = record_sbuf.data;
+	char *zbuf = NULL;
+	size_t len = record_sbuf.size;
+
+	if (record_fd < 0 || !len)
+		return;
+
+	frame.raw_len = len;
+	frame.ms = frame_ms;
+
+#ifdef HAVE_ZLIB
+	if (options_get_number(global_options, "tmate-record-compress")) {
+		uLongf zlen = compressBound(len);
+
+		zbuf = xmalloc(zlen);
+		if (compress2((Bytef *)zbuf, &zlen, (const Bytef *)payload,
+			      len, Z_DEFAULT_COMPRESSION) == Z_OK &&
+		    zlen < len) {
+			payload = zbuf;
+			len = zlen;
+		}
+	}
+#endif
+	frame.len = len;
+
+	if (write(record_fd, &frame, sizeof(frame)) != sizeof(frame) ||
+	    write(record_fd, payload, len) != (ssize_t)len) {
+		free(zbuf);
+		record_stop("write the recording");
+		return;
+	}
+	free(zbuf);
+
+	index.ms = frame_ms;
+	index.offset = record_offset;
+	if (write(index_fd, &index, sizeof(index)) != sizeof(index)) {
+		record_stop("write the recording index");
+		return;
+	}
+	record_offset += sizeof(frame) + len;
+
+	msgpack_sbuffer_clear(&record_sbuf);
+	record_sync(false);
+}
+
+static void on_record_timer(__unused evutil_socket_t fd, __unused short what,
+			    __unused void *arg)
+{
+	flush_frame();
+}
+
+/* Returns the time of the event about to be packed. */
+static uint64_t begin_event(void)
+{
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	uint64_t ms = record_now();
+
+	if (!record_sbuf.size) {
+		frame_ms = ms;
+		pack_layout(ms);
+		evtimer_add(record_timer, &tv);
+	}
+	return ms;
+}
+
+void tmate_record_pty(struct window_pane *wp, const char *buf, size_t len)
+{
+	uint64_t ms;
+
+	if (record_fd < 0 || !len)
+		return;
+
+	ms = begin_event();
+	msgpack_pack_array(&record_pk, 4);
+	msgpack_pack_int(&record_pk, TMATE_RECORD_PTY);
+	msgpack_pack_uint64(&record_pk, ms);
+	msgpack_pack_unsigned_int(&record_pk, wp->id);
+	msgpack_pack_bin(&record_pk, len);
+	msgpack_pack_bin_body(&record_pk, buf, len);
+
+	if (record_sbuf.size >= RECORD_FRAME_SIZE)
+		flush_frame();
+}
+
+void tmate_record_layout(void)
+{
+	size_t size = record_sbuf.size;
+	uint64_t ms;
+
+	if (record_fd < 0)
+		return;
+
+	/* A new frame starts with the layout already. */
+	ms = begin_event();
+	if (size)
+		pack_layout(ms);
+}
+
+void tmate_record_flush(void)
+{
+	if (record_fd < 0)
+		return;
+
+	flush_frame();
+	if (record_fd >= 0)
+		record_sync(true);
+}
+
+void tmate_record_start(void)
+{
+	struct record_header hdr;
+	struct stat sb;
+	const char *path;
+	char *index_path;
+
+	path = options_get_string(global_options, "tmate-record-file");
+	if (!strlen(path) || record_fd >= 0)
+		return;
+
+	record_fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if (record_fd < 0 || fstat(record_fd, &sb) < 0) {
+		tmate_info("Cannot open recording %s: %s", path,
+			   strerror(errno));
+		if (record_fd >= 0)
+			close(record_fd);
+		record_fd = -1;
+		return;
+	}
+
+	if (sb.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+		hdr.version = RECORD_VERSION;
+		if (write(record_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			tmate_info("Cannot write recording %s: %s", path,
+				   strerror(errno));
+			close(record_fd);
+			record_fd = -1;
+			return;
+		}
+		sb.st_size = sizeof(hdr);
+	} else if (pread(record_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		   memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) ||
+		   hdr.version != RECORD_VERSION) {
+		tmate_info("Not appending to %s, it is not a recording", path);
+		close(record_fd);
+		record_fd = -1;
+		return;
+	}
+	record_offset = sb.st_size;
+
+	xasprintf(&index_path, "%s.idx", path);
+	index_fd = open(index_path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (index_fd < 0) {
+		tmate_info("Cannot open recording index %s: %s", index_path,
+			   strerror(errno));
+		free(index_path);
+		close(record_fd);
+		record_fd = -1;
+		return;
+	}
+	free(index_path);
+
+	msgpack_sbuffer_init(&record_sbuf);
+	msgpack_packer_init(&record_pk, &record_sbuf, msgpack_sbuffer_write);
+	record_timer = evtimer_new(tmate_session.ev_base, on_record_timer,
+				   NULL);
+	if (!record_timer)
+		tmate_fatal("out of memory");
+	last_sync = time(NULL);
+	atexit(tmate_record_flush);
+
+	tmate_info("Recording panes to %s", path);
+}
+
+/*
+ * Find where the frame covering a time starts, from the index. Without an
+ * index, reading starts at the beginning.
+ */
+static off_t find_frame(const char *path, uint64_t skip, uint64_t *start)
+{
+	struct record_index *index;
+	struct stat sb;
+	char *index_path;
+	size_t n, lo, hi, mid;
+	off_t offset = sizeof(struct record_header);
+	int fd;
+
+	*start = 0;
+
+	xasprintf(&index_path, "%s.idx", path);
+	fd = open(index_path, O_RDONLY);
+	free(index_path);
+	if (fd < 0)
+		return offset;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(*index)) {
+		close(fd);
+		return offset;
+	}
+
+	n = sb.st_size / sizeof(*index);
+	index = xreallocarray(NULL, n, sizeof(*index));
+	if (read(fd, index, n * sizeof(*index)) != (ssize_t)(n * sizeof(*index))) {
+		close(fd);
+		free(index);
+		return offset;
+	}
+	close(fd);
+
+	*start = index[0].ms + skip;
+
+	/* The last frame starting at or before the time. */
+	lo = 0;
+	hi = n;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (index[mid].ms <= *start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	offset = index[lo].offset;
+	free(index);
+	return offset;
+}
+
+static int read_frame(int fd, struct record_frame *frame, char **data)
+{
+	char *buf;
+
+	if (read(fd, frame, sizeof(*frame)) != sizeof(*frame))
+		return -1;
+	if (frame->len > RECORD_FRAME_MAX || frame->raw_len > RECORD_FRAME_MAX)
+		return -1;
+
+	buf = xmalloc(frame->len);
+	if (read(fd, buf, frame->len) != (ssize_t)frame->len) {
+		free(buf);
+		return -1;
+	}
+
+	if (frame->len != frame->raw_len) {
+#ifdef HAVE_ZLIB
+		uLongf raw_len = frame->raw_len;
+		char *raw = xmalloc(raw_len);
+
+		if (uncompress((Bytef *)raw, &raw_len, (const Bytef *)buf,
+			       frame->len) != Z_OK ||
+		    raw_len != frame->raw_len) {
+			free(raw);
+			free(buf);
+			return -1;
+		}
+		free(buf);
+		buf = raw;
+#else
+		free(buf);
+		return -1;
+#endif
+	}
+
+	*data = buf;
+	return 0;
+}
+
+/*
+ * Call cb for each event of a recording, starting skip milliseconds after the
+ * first frame. Reading may start a little earlier, at the frame covering that
+ * time; cb is given the wanted start time to tell which events are before.
+ */
+int tmate_record_read(const char *path, uint64_t skip, tmate_record_cb *cb,
+		      void *arg, char **cause)
+{
+	struct record_header hdr;
+	struct record_frame frame;
+	msgpack_unpacked result;
+	uint64_t start;
+	off_t offset;
+	size_t off;
+	char *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != RECORD_VERSION) {
+		close(fd);
+		xasprintf(cause, "%s: not a recording", path);
+		return -1;
+	}
+
+	offset = find_frame(path, skip, &start);
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	msgpack_unpacked_init(&result);
+	while (read_frame(fd, &frame, &data) == 0) {
+		/* Without an index, the first frame gives the start. */
+		if (!start)
+			start = frame.ms + skip;
+
+		off = 0;
+		while (msgpack_unpack_next(&result, data, frame.raw_len,
+					   &off) == MSGPACK_UNPACK_SUCCESS) {
+			if (result.data.type != MSGPACK_OBJECT_ARRAY ||
+			    result.data.via.array.size < 2)
+				continue;
+			cb(arg, start, &result.data);
+		}
+		free(data);
+	}
+	msgpack_unpacked_destroy(&result);
+
+	close(fd);
+	return 0;
+}
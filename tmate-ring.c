@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmate.h"
+
+/*
+ * Single producer, single consumer byte ring, for handing data between the
+ * event loop and the SSH I/O thread without locks. head is only written by
+ * the producer and tail by the consumer; both grow forever and are reduced
+ * modulo the size, which is a power of two.
+ */
+
+void tmate_ring_init(struct tmate_ring *ring, size_t size)
+{
+	assert(size && !(size & (size - 1)));
+
+	ring->buf = xmalloc(size);
+	ring->size = size;
+	ring->head = ring->tail = 0;
+}
+
+void tmate_ring_free(struct tmate_ring *ring)
+{
+	free(ring->buf);
+	ring->buf = NULL;
+}
+
+/* Producer: contiguous free space, to be followed by tmate_ring_commit(). */
+size_t tmate_ring_reserve(struct tmate_ring *ring, char **buf)
+{
+	size_t head = ring->head;
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t off = head & (ring->size - 1);
+	size_t len = ring->size - (head - tail);
+
+	if (len > ring->size - off)
+		len = ring->size - off;
+
+	*buf = ring->buf + off;
+	return len;
+}
+
+void tmate_ring_commit(struct tmate_ring *ring, size_t len)
+{
+	__atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+/* Producer: copies what fits, returns how much that was. */
+size_t tmate_ring_write(struct tmate_ring *ring, const char *data, size_t len)
+{
+	size_t done = 0, n;
+	char *buf;
+
+	while (done < len) {
+		n = tmate_ring_reserve(ring, &buf);
+		if (!n)
+			break;
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf, data + done, n);
+		tmate_ring_commit(ring, n);
+		done += n;
+	}
+
+	return done;
+}
+
+/* Consumer: contiguous data, to be followed by tmate_ring_consume(). */
+size_t tmate_ring_peek(struct tmate_ring *ring, char **buf)
+{
+	size_t tail = ring->tail;
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t off = tail & (ring->size - 1);
+	size_t len = head - tail;
+
+	if (len > ring->size - off)
+		len = ring->size - off;
+
+	*buf = ring->buf + off;
+	return len;
+}
+
+void tmate_ring_consume(struct tmate_ring *ring, size_t len)
+{
+	__atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
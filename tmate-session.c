@@ -4,22 +4,216 @@
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tmate.h"
 
 #define TMATE_DNS_RETRY_TIMEOUT 2
 #define TMATE_RECONNECT_RETRY_TIMEOUT 2
+#define TMATE_RETRY_MAX_TIMEOUT 60
+#define TMATE_RECONNECT_RESET_TIME 60 /* connected long enough to start over */
+#define TMATE_CONNECT_ATTEMPT_DELAY 250 /* ms */
 
 struct tmate_session tmate_session;
 
 static void lookup_and_connect(void);
 
+/*
+ * Files kept in ~/.tmate. The directory is created when writing.
+ */
+static char *get_state_path(const char *name, bool create)
+{
+	const char *home = find_home();
+	char *path;
+
+	if (!home)
+		return NULL;
+
+	if (create) {
+		xasprintf(&path, "%s/.tmate", home);
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			tmate_debug("Cannot create %s: %s", path, strerror(errno));
+			free(path);
+			return NULL;
+		}
+		free(path);
+	}
+
+	xasprintf(&path, "%s/.tmate/%s", home, name);
+	return path;
+}
+
+/*
+ * The addresses tmate-server-host resolved to are cached in ~/.tmate/servers,
+ * in the order to try them, with how long their TCP connection took last time:
+ *	<tmate-server-host> <time resolved>
+ *	<ip> <latency in ms, or -1>
+ *	...
+ * The server we ended up on goes first. While the cache is younger than
+ * tmate-dns-cache-ttl, we connect straight away and the lookup done in the
+ * background only refreshes it.
+ */
+static bool load_servers(struct tmate_session *session, const char *host)
+{
+	struct tmate_server_addr *server;
+	char *path, line[512], ip[INET6_ADDRSTRLEN];
+	long long resolved;
+	int latency;
+	size_t len;
+	FILE *f;
+
+	if (!(path = get_state_path("servers", false)))
+		return false;
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return false;
+
+	if (!fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return false;
+	}
+	len = strlen(host);
+	if (strncmp(line, host, len) || line[len] != ' ' ||
+	    sscanf(line + len + 1, "%lld", &resolved) != 1) {
+		fclose(f);
+		return false;
+	}
+
+	free(session->servers);
+	session->servers = NULL;
+	session->num_servers = 0;
+	session->servers_resolved = resolved;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%45s %d", ip, &latency) != 2)
+			continue;
+		session->servers = xreallocarray(session->servers,
+				session->num_servers + 1, sizeof(*server));
+		server = &session->servers[session->num_servers++];
+		strlcpy(server->ip, ip, sizeof(server->ip));
+		server->latency_ms = latency;
+	}
+
+	fclose(f);
+	return session->num_servers != 0;
+}
+
+static void save_servers(struct tmate_session *session)
+{
+	const char *host;
+	char *path, *tmp;
+	unsigned int i;
+	FILE *f;
+
+	if (!(path = get_state_path("servers", true)))
+		return;
+
+	/* Other tmate processes may be reading it, replace it in one go. */
+	xasprintf(&tmp, "%s.%ld", path, (long)getpid());
+	host = options_get_string(global_options, "tmate-server-host");
+	if ((f = fopen(tmp, "w"))) {
+		fprintf(f, "%s %lld\n", host, (long long)session->servers_resolved);
+		for (i = 0; i < session->num_servers; i++) {
+			fprintf(f, "%s %d\n", session->servers[i].ip,
+				session->servers[i].latency_ms);
+		}
+		if (fclose(f) == 0 && rename(tmp, path) == 0)
+			tmp[0] = '\0';
+	}
+	if (tmp[0])
+		unlink(tmp);
+
+	free(tmp);
+	free(path);
+}
+
+static struct tmate_server_addr *find_server(struct tmate_session *session,
+					     const char *ip)
+{
+	unsigned int i;
+
+	for (i = 0; i < session->num_servers; i++) {
+		if (!strcmp(session->servers[i].ip, ip))
+			return &session->servers[i];
+	}
+	return NULL;
+}
+
+void tmate_server_latency(struct tmate_session *session, const char *ip,
+			  int latency_ms)
+{
+	struct tmate_server_addr *server;
+
+	if ((server = find_server(session, ip)))
+		server->latency_ms = latency_ms;
+}
+
+/* The first one goes first, then the rest by latency, unknown ones last. */
+static void sort_servers(struct tmate_session *session, const char *first_ip)
+{
+	struct tmate_server_addr *servers = session->servers, tmp;
+	unsigned int i, j;
+
+	for (i = 1; i < session->num_servers; i++) {
+		tmp = servers[i];
+		for (j = i; j > 0; j--) {
+			if (!strcmp(servers[j - 1].ip, first_ip))
+				break;
+			if (strcmp(tmp.ip, first_ip) &&
+			    (tmp.latency_ms < 0 ||
+			     (servers[j - 1].latency_ms >= 0 &&
+			      servers[j - 1].latency_ms <= tmp.latency_ms)))
+				break;
+			servers[j] = servers[j - 1];
+		}
+		servers[j] = tmp;
+	}
+}
+
+void tmate_save_servers(struct tmate_session *session, const char *winner_ip)
+{
+	sort_servers(session, winner_ip);
+	save_servers(session);
+}
+
+static void connect_servers(struct tmate_session *session)
+{
+	unsigned int i;
+
+	for (i = 0; i < session->num_servers; i++)
+		tmate_ssh_client_alloc(session, session->servers[i].ip);
+	tmate_connect_next_client(session);
+}
+
+/*
+ * Retries back off exponentially with decorrelated jitter: each delay is
+ * picked at random between the base and three times the previous one, up to
+ * TMATE_RETRY_MAX_TIMEOUT. Clients dropped together, when a server goes away,
+ * spread out rather than coming back in lockstep.
+ */
+static int next_retry_delay(int *prev_ms, int base)
+{
+	int max_ms = TMATE_RETRY_MAX_TIMEOUT * 1000, ms;
+
+	base *= 1000;
+	if (*prev_ms < base)
+		*prev_ms = base;
+	ms = base + random() % (*prev_ms * 3 - base + 1);
+	if (ms > max_ms)
+		ms = max_ms;
+	*prev_ms = ms;
+	return ms;
+}
+
 static void on_dns_retry(__unused evutil_socket_t fd, __unused short what,
 			 void *arg)
 {
@@ -34,6 +228,9 @@ static void on_dns_retry(__unused evutil_socket_t fd, __unused short what,
 
 static void dns_cb(int errcode, struct evutil_addrinfo *addr, void *ptr)
 {
+	struct tmate_session *session = &tmate_session;
+	struct tmate_server_addr *servers, *old;
+	struct tmate_ssh_client *client;
 	struct evutil_addrinfo *ai;
 	const char *host = ptr;
 
@@ -41,12 +238,19 @@ static void dns_cb(int errcode, struct evutil_addrinfo *addr, void *ptr)
 	tmate_session.ev_dnsbase = NULL;
 
 	if (errcode) {
-		struct tmate_session *session = &tmate_session;
+		if (session->servers_from_cache) {
+			tmate_debug("%s lookup failure, keeping the cached addresses (%s)",
+				    host, evutil_gai_strerror(errcode));
+			return;
+		}
 
 		if (session->ev_dns_retry)
 			return;
 
-		struct timeval tv = { .tv_sec = TMATE_DNS_RETRY_TIMEOUT, .tv_usec = 0 };
+		int ms = next_retry_delay(&session->dns_retry_delay,
+					  TMATE_DNS_RETRY_TIMEOUT);
+		struct timeval tv = { .tv_sec = ms / 1000,
+				      .tv_usec = (ms % 1000) * 1000 };
 
 		session->ev_dns_retry = evtimer_new(session->ev_base, on_dns_retry, session);
 		if (!session->ev_dns_retry)
@@ -54,45 +258,216 @@ static void dns_cb(int errcode, struct evutil_addrinfo *addr, void *ptr)
 		evtimer_add(session->ev_dns_retry, &tv);
 
 		tmate_status_message("%s lookup failure. Retrying in %d seconds (%s)",
-				     host, TMATE_DNS_RETRY_TIMEOUT,
+				     host, (ms + 999) / 1000,
 				     evutil_gai_strerror(errcode));
 		return;
 	}
+	session->dns_retry_delay = 0;
 
-	tmate_status_message("Connecting to %s...", host);
+	log_startup("server addresses resolved");
 
-	int i, num_clients = 0;
+	int i, num_addrs = 0;
 	for (ai = addr; ai; ai = ai->ai_next)
-		num_clients++;
+		num_addrs++;
 
-	struct tmate_ssh_client *ssh_clients[num_clients];
+	char ips6[num_addrs][INET6_ADDRSTRLEN], ips4[num_addrs][INET6_ADDRSTRLEN];
+	int num6 = 0, num4 = 0;
 
-	for (ai = addr, i = 0; ai; ai = ai->ai_next, i++) {
-		char buf[128];
-		const char *ip = NULL;
+	for (ai = addr; ai; ai = ai->ai_next) {
 		if (ai->ai_family == AF_INET) {
 			struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
-			ip = evutil_inet_ntop(AF_INET, &sin->sin_addr, buf, 128);
+			if (evutil_inet_ntop(AF_INET, &sin->sin_addr,
+					     ips4[num4], INET6_ADDRSTRLEN))
+				num4++;
 		} else if (ai->ai_family == AF_INET6) {
 			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ai->ai_addr;
-			ip = evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, buf, 128);
+			if (evutil_inet_ntop(AF_INET6, &sin6->sin6_addr,
+					     ips6[num6], INET6_ADDRSTRLEN))
+				num6++;
 		}
+	}
+	evutil_freeaddrinfo(addr);
 
-		ssh_clients[i] = tmate_ssh_client_alloc(&tmate_session, ip);
+	/*
+	 * Addresses are tried in turn, alternating families and starting with
+	 * IPv6 (RFC 8305). Those we know the latency of go first, fastest
+	 * first, and the server we ended up on last time before them.
+	 */
+	int num_servers = 0;
+	servers = xcalloc(num6 + num4 + 1, sizeof(*servers));
+	for (i = 0; i < num6 || i < num4; i++) {
+		if (i < num6)
+			strlcpy(servers[num_servers++].ip, ips6[i], INET6_ADDRSTRLEN);
+		if (i < num4)
+			strlcpy(servers[num_servers++].ip, ips4[i], INET6_ADDRSTRLEN);
+	}
+	for (i = 0; i < num_servers; i++) {
+		old = find_server(session, servers[i].ip);
+		servers[i].latency_ms = old ? old->latency_ms : -1;
 	}
 
-	for (i = 0; i < num_clients; i++)
-		connect_ssh_client(ssh_clients[i]);
+	char first_ip[INET6_ADDRSTRLEN] = "";
+	if (session->num_servers)
+		strlcpy(first_ip, session->servers[0].ip, sizeof(first_ip));
 
-	evutil_freeaddrinfo(addr);
+	free(session->servers);
+	session->servers = servers;
+	session->num_servers = num_servers;
+	session->servers_resolved = time(NULL);
+	sort_servers(session, first_ip);
+	save_servers(session);
+
+	if (!session->servers_from_cache) {
+		tmate_status_message("Connecting to %s...", host);
+		connect_servers(session);
+		return;
+	}
+
+	/*
+	 * We are already connecting to the cached addresses. Queue the new
+	 * ones behind them, unless it is too late: either every attempt has
+	 * failed and we are waiting to reconnect, or we have a server.
+	 */
+	if (TAILQ_EMPTY(&session->clients))
+		return;
+	TAILQ_FOREACH(client, &session->clients, node) {
+		if (client->state > SSH_AUTH_SERVER)
+			return;
+	}
+
+	bool added = false;
+	for (i = 0; i < num_servers; i++) {
+		TAILQ_FOREACH(client, &session->clients, node) {
+			if (!strcmp(client->server_ip, servers[i].ip))
+				break;
+		}
+		if (!client) {
+			tmate_ssh_client_alloc(session, servers[i].ip);
+			added = true;
+		}
+	}
+	if (added)
+		tmate_connect_next_client(session);
+}
+
+/*
+ * With tmate-standby, a second connection is kept to the next address of
+ * tmate-server-host, authenticated and idle. When the connection in use dies,
+ * failing over to it skips the lookup, the key exchange and the
+ * authentication that a reconnection goes through.
+ */
+static void on_standby(__unused evutil_socket_t fd, __unused short what,
+		       void *arg)
+{
+	struct tmate_session *session = arg;
+	struct tmate_ssh_client *client;
+	unsigned int i;
+
+	if (session->standby ||
+	    !options_get_number(global_options, "tmate-standby"))
+		return;
+
+	client = TAILQ_FIRST(&session->clients);
+	if (!client || client->state != SSH_READY)
+		return;
+
+	/* The servers are sorted, the one in use first. */
+	for (i = 0; i < session->num_servers; i++) {
+		if (strcmp(session->servers[i].ip, client->server_ip))
+			break;
+	}
+	if (i == session->num_servers) {
+		tmate_debug("No other address of %s for a standby connection",
+			    options_get_string(global_options, "tmate-server-host"));
+		return;
+	}
+
+	tmate_debug("Starting a standby connection to %s",
+		    session->servers[i].ip);
+	connect_ssh_client(tmate_ssh_standby_alloc(session,
+						   session->servers[i].ip));
+}
+
+void tmate_schedule_standby(struct tmate_session *session, int delay)
+{
+	struct timeval tv = { .tv_sec = delay, .tv_usec = 0 };
+
+	if (!options_get_number(global_options, "tmate-standby"))
+		return;
+
+	if (!session->ev_standby) {
+		session->ev_standby = evtimer_new(session->ev_base, on_standby,
+						  session);
+		if (!session->ev_standby)
+			tmate_fatal("out of memory");
+	}
+	evtimer_add(session->ev_standby, &tv);
+}
+
+static void on_connect_next(__unused evutil_socket_t fd, __unused short what,
+			    void *arg)
+{
+	tmate_connect_next_client(arg);
+}
+
+/*
+ * Start the next client that has not been connected yet, then give it
+ * TMATE_CONNECT_ATTEMPT_DELAY to get somewhere before starting another.
+ * Nothing more is started once a TCP connection is up.
+ */
+void tmate_connect_next_client(struct tmate_session *session)
+{
+	struct tmate_ssh_client *client, *next = NULL;
+	struct timeval tv = { .tv_sec = 0,
+			      .tv_usec = TMATE_CONNECT_ATTEMPT_DELAY * 1000 };
+
+	if (session->ev_connect_next)
+		evtimer_del(session->ev_connect_next);
+
+	TAILQ_FOREACH(client, &session->clients, node) {
+		if (client->tcp_connected)
+			return;
+		if (!next && client->state == SSH_NONE)
+			next = client;
+	}
+	if (!next)
+		return;
+
+	if (!session->ev_connect_next) {
+		session->ev_connect_next = evtimer_new(session->ev_base,
+						       on_connect_next, session);
+		if (!session->ev_connect_next)
+			tmate_fatal("out of memory");
+	}
+	evtimer_add(session->ev_connect_next, &tv);
+
+	connect_ssh_client(next);
 }
 
 static void lookup_and_connect(void)
 {
+	struct tmate_session *session = &tmate_session;
 	struct evutil_addrinfo hints;
 	const char *tmate_server_host;
+	int ttl;
+
+	tmate_server_host = options_get_string(global_options,
+					       "tmate-server-host");
+
+	session->servers_from_cache = false;
+	ttl = options_get_number(global_options, "tmate-dns-cache-ttl");
+	if ((session->num_servers || load_servers(session, tmate_server_host)) &&
+	    time(NULL) - session->servers_resolved < ttl) {
+		tmate_debug("Using the cached addresses of %s", tmate_server_host);
+		tmate_status_message("Connecting to %s...", tmate_server_host);
+		session->servers_from_cache = true;
+		connect_servers(session);
+	}
+
+	/* A lookup may still be going since the last attempt. */
+	if (tmate_session.ev_dnsbase)
+		return;
 
-	assert(!tmate_session.ev_dnsbase);
 	tmate_session.ev_dnsbase = evdns_base_new(tmate_session.ev_base, 1);
 	if (!tmate_session.ev_dnsbase)
 		tmate_fatal("Cannot initialize the DNS lookup service");
@@ -103,8 +478,6 @@ static void lookup_and_connect(void)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	tmate_server_host = options_get_string(global_options,
-					       "tmate-server-host");
 	tmate_debug("Looking up %s...", tmate_server_host);
 	(void)evdns_getaddrinfo(tmate_session.ev_dnsbase, tmate_server_host, NULL,
 				&hints, dns_cb, (void *)tmate_server_host);
@@ -116,6 +489,7 @@ static void __tmate_session_init(struct tmate_session *session,
 	memset(session, 0, sizeof(*session));
 
 	session->ev_base = base;
+	session->tmux_session_id = -1;
 
 	/*
 	 * Early initialization of encoder because we need to parse
@@ -130,23 +504,55 @@ static void __tmate_session_init(struct tmate_session *session,
 	session->min_sy = -1;
 
 	TAILQ_INIT(&session->clients);
+
+	/* For the retry jitter, it only has to differ between clients. */
+	srandom(time(NULL) ^ getpid());
+}
+
+/*
+ * The tmux session shared by a tmate session. session_create() only allows
+ * one, but the lookup is kept here rather than having each caller assume it
+ * is RB_MIN(sessions).
+ */
+struct session *tmate_tmux_session(struct tmate_session *session)
+{
+	struct session *s;
+
+	if (session->tmux_session_id != -1 &&
+	    (s = session_find_by_id(session->tmux_session_id)))
+		return s;
+
+	s = RB_MIN(sessions, &sessions);
+	session->tmux_session_id = s ? (int)s->id : -1;
+	return s;
 }
 
 void tmate_session_init(struct event_base *base)
 {
 	__tmate_session_init(&tmate_session, base);
-	tmate_write_header();
 }
 
-static void send_authorized_keys(void)
+/*
+ * With tmate-authorized-keys-bulk, the keys go in a single
+ * TMATE_OUT_AUTHORIZED_KEYS rather than one tmate-set each. On reconnection
+ * only their hash is sent, and the file is read again if the server asks for
+ * the keys with TMATE_IN_AUTHORIZED_KEYS_WANTED.
+ */
+void tmate_send_authorized_keys(bool full)
 {
 	char *path;
+	bool bulk;
+
 	path = options_get_string(global_options, "tmate-authorized-keys");
 	if (strlen(path) == 0)
 		return;
+	bulk = options_get_number(global_options, "tmate-authorized-keys-bulk");
+	if (!bulk && !full)
+		return;
 
 	path = xstrdup(path);
-	tmate_info("Using %s for access control", path);
+	if (full)
+		tmate_info("Using %s for access control", path);
 
 	FILE *f;
 	char *line;
@@ -168,11 +574,14 @@ static void send_authorized_keys(void)
 		return;
 	}
 
-	while ((line = fparseln(f, &len, NULL, NULL, 0)) != NULL) {
-		if (len == 0)
-			continue;
-		tmate_set_val("authorized_keys", line);
-		free(line);
+	if (bulk)
+		tmate_write_authorized_keys(f, full);
+	else {
+		while ((line = fparseln(f, &len, NULL, NULL, 0)) != NULL) {
+			if (len != 0)
+				tmate_set_val("authorized_keys", line);
+			free(line);
+		}
 	}
 
 	if (ferror(f))
@@ -190,7 +599,15 @@ void tmate_session_start(void)
 	 *   we are setting up the tmate identity.
 	 * - While we are parsing the config file, we need to be able to
 	 *   serialize it, and so we need a worker encoder.
+	 * The header goes in front of what was serialized while parsing the
+	 * config file, now that we know if the stream should be compressed.
 	 */
+	tmate_encoder_write_first(&tmate_session.encoder, tmate_write_header);
+	tmate_stats_timer_start();
+	tmate_broadcast_start();
+	tmate_trace_start();
+	tmate_record_start();
+
 	if (tmate_foreground) {
 		tmate_set_val("foreground", "true");
 		tmate_info("To connect to the session locally, run: tmate -S %s attach", socket_path);
@@ -201,7 +618,8 @@ void tmate_session_start(void)
 		cfg_add_cause("%s", "---------------------------------------------------------------------");
 	}
 
-	send_authorized_keys();
+	tmate_exec_cmds_end();
+	tmate_send_authorized_keys(true);
 	tmate_write_uname();
 	tmate_write_ready();
 	lookup_and_connect();
@@ -215,6 +633,10 @@ static void on_reconnect_retry(__unused evutil_socket_t fd, __unused short what,
 	event_free(session->ev_connection_retry);
 	session->ev_connection_retry = NULL;
 
+	/* The standby may have got ready since the connection was lost. */
+	if (tmate_ssh_promote_standby(session))
+		return;
+
 	if (session->last_server_ip) {
 		/*
 		 * We have a previous server ip. Let's try that again first,
@@ -238,11 +660,40 @@ void tmate_reconnect_session(struct tmate_session *session, const char *message)
 	 * and we'll try to reconnect to the same server if possible,
 	 * to avoid an SSH connection string change.
 	 */
-	struct timeval tv = { .tv_sec = TMATE_RECONNECT_RETRY_TIMEOUT, .tv_usec = 0 };
+	struct timeval tv;
+	int ms;
 
 	if (session->ev_connection_retry)
 		return;
 
+	/* Only a connection which lasted starts the backoff over. */
+	if (session->connected_since &&
+	    time(NULL) - session->connected_since >= TMATE_RECONNECT_RESET_TIME)
+		session->retry_delay = 0;
+	session->connected_since = 0;
+	tmate_stats.reconnects++;
+
+	/*
+	 * The server may have told us when to come back, when it is going
+	 * away for a while. Otherwise, the first retry is straight away to
+	 * the same server, in case it was only this connection that broke.
+	 */
+	if (session->retry_after > 0) {
+		ms = session->retry_after * 1000;
+		ms += random() % (ms / 2 + 1);
+		session->retry_delay = ms;
+		session->retry_after = 0;
+	} else if (session->retry_delay == 0 && session->last_server_ip) {
+		ms = 0;
+		session->retry_delay = TMATE_RECONNECT_RETRY_TIMEOUT * 1000;
+	} else {
+		ms = next_retry_delay(&session->retry_delay,
+				      TMATE_RECONNECT_RETRY_TIMEOUT);
+	}
+	tmate_debug("Reconnecting in %d ms", ms);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
 	session->ev_connection_retry = evtimer_new(session->ev_base, on_reconnect_retry, session);
 	if (!session->ev_connection_retry)
 		tmate_fatal("out of memory");
@@ -6,6 +6,17 @@
 #include <stdlib.h>
 #include <event.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #include "tmate.h"
 #include "window-copy.h"
@@ -18,7 +29,9 @@ static void printflike(2, 3) kill_ssh_client(struct tmate_ssh_client *client,
 static void printflike(2, 3) kill_ssh_client(struct tmate_ssh_client *client,
 						  const char *fmt, ...);
 
-static void read_channel(struct tmate_ssh_client *client)
+static void io_write(struct tmate_ssh_client *client, struct evbuffer *buffer);
+
+static int read_channel(struct tmate_ssh_client *client)
 {
 	struct tmate_decoder *decoder = &client->tmate_session->decoder;
 	char *buf;
@@ -30,7 +43,7 @@ static void read_channel(struct tmate_ssh_client *client)
 		if (len < 0) {
 			kill_ssh_client(client, "Error reading from channel: %s",
 					ssh_get_error(client->session));
-			break;
+			return -1;
 		}
 
 		if (len == 0)
@@ -38,39 +51,407 @@ static void read_channel(struct tmate_ssh_client *client)
 
 		tmate_decoder_commit(decoder, len);
 	}
+
+	return 0;
 }
 
 static void on_decoder_read(void *userdata, struct tmate_unpacker *uk)
 {
 	struct tmate_ssh_client *client = userdata;
+
+	client->heartbeat_read = true;
+	client->heartbeat_misses = 0;
 	tmate_dispatch_slave_message(client->tmate_session, uk);
 }
 
+/*
+ * TCP keepalives take over a minute to notice a connection which died without
+ * a word. Every tmate-heartbeat-interval seconds with nothing read from the
+ * server, a TMATE_OUT_LATENCY_PROBE is sent, its reply being a latency sample
+ * like any other. After tmate-heartbeat-misses of them in a row go unanswered,
+ * the connection is given up and we reconnect. Misses count only once the
+ * server has answered a probe on this connection, older servers do not.
+ */
+static void on_heartbeat_timer(__unused evutil_socket_t fd,
+			       __unused short what, void *arg)
+{
+	struct tmate_ssh_client *client = arg;
+	struct tmate_session *session = client->tmate_session;
+	struct timeval tv;
+	int misses;
+
+	if (client->heartbeat_read)
+		client->heartbeat_read = false;
+	else {
+		misses = options_get_number(global_options,
+					    "tmate-heartbeat-misses");
+		if (session->probe_answered &&
+		    client->heartbeat_misses >= misses) {
+			kill_ssh_client(client, "Server not responding");
+			return;
+		}
+		client->heartbeat_misses++;
+		tmate_write_latency_probe(tmate_stats_now());
+	}
+
+	tv.tv_sec = options_get_number(global_options, "tmate-heartbeat-interval");
+	tv.tv_usec = 0;
+	evtimer_add(client->ev_heartbeat, &tv);
+}
+
+static void heartbeat_start(struct tmate_ssh_client *client)
+{
+	struct timeval tv;
+	int interval;
+
+	if (client->ev_heartbeat)
+		evtimer_del(client->ev_heartbeat);
+	client->heartbeat_read = false;
+	client->heartbeat_misses = 0;
+
+	interval = options_get_number(global_options, "tmate-heartbeat-interval");
+	if (!interval)
+		return;
+
+	if (!client->ev_heartbeat) {
+		client->ev_heartbeat = evtimer_new(client->tmate_session->ev_base,
+						   on_heartbeat_timer, client);
+		if (!client->ev_heartbeat)
+			tmate_fatal("Can't allocate event");
+	}
+
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	evtimer_add(client->ev_heartbeat, &tv);
+}
+
+/* Called when tmate-heartbeat-interval changes. */
+void tmate_ssh_heartbeat_start(struct tmate_session *session)
+{
+	struct tmate_ssh_client *client = TAILQ_FIRST(&session->clients);
+
+	if (client && client->state == SSH_READY)
+		heartbeat_start(client);
+}
+
+#define ENCODER_WRITE_IOVECS 16
+
+/*
+ * The encoder buffer is written chunk by chunk, without linearizing it. We
+ * never write more than the channel window: whatever doesn't fit stays in the
+ * buffer, and we resume once the server has adjusted the window (which we
+ * notice when reading from the channel).
+ */
 static void on_encoder_write(void *userdata, struct evbuffer *buffer)
 {
 	struct tmate_ssh_client *client = userdata;
-	ssize_t len, written;
-	unsigned char *buf;
+	struct evbuffer_iovec iov[ENCODER_WRITE_IOVECS];
+	size_t len, drained, total = 0;
+	ssize_t written;
+	uint32_t window;
+	int i, n;
 
 	if (!client->channel)
 		return;
 
-	for(;;) {
-		len = evbuffer_get_length(buffer);
-		if (!len)
+	if (client->io) {
+		io_write(client, buffer);
+		return;
+	}
+
+	while (evbuffer_get_length(buffer) > 0) {
+		window = ssh_channel_window_size(client->channel);
+		tmate_stats.window = window;
+		if (!window)
 			break;
 
-		buf = evbuffer_pullup(buffer, -1);
+		n = evbuffer_peek(buffer, -1, NULL, iov, ENCODER_WRITE_IOVECS);
+		if (n > ENCODER_WRITE_IOVECS)
+			n = ENCODER_WRITE_IOVECS;
+
+		drained = 0;
+		for (i = 0; i < n && window > 0; i++) {
+			len = iov[i].iov_len;
+			if (len > window)
+				len = window;
+
+			written = ssh_channel_write(client->channel,
+						    iov[i].iov_base, len);
+			if (written < 0) {
+				kill_ssh_client(client, "Error writing to channel: %s",
+						ssh_get_error(client->session));
+				return;
+			}
 
-		written = ssh_channel_write(client->channel, buf, len);
-		if (written < 0) {
-			kill_ssh_client(client, "Error writing to channel: %s",
-					ssh_get_error(client->session));
+			drained += written;
+			window -= written;
+			if ((size_t)written < len) {
+				tmate_stats.partial_writes++;
+				break;
+			}
+		}
+
+		if (!drained)
+			break;
+
+		evbuffer_drain(buffer, drained);
+		tmate_encoder_drained(&client->tmate_session->encoder, drained);
+		tmate_stats.written += drained;
+		total += drained;
+	}
+
+	PROBE2(encoder_write, total, evbuffer_get_length(buffer));
+}
+
+/*
+ * With tmate-io-thread, once the channel is ready the libssh session belongs
+ * to a thread, so the encryption is done on another core than input_parse()
+ * and the drawing. The encoder output goes to the thread through one ring,
+ * what is read from the channel comes back through another. Each side wakes
+ * the other up with a byte on a pipe. The event loop no longer calls libssh
+ * on that session, until the thread is stopped in kill_ssh_client().
+ */
+#define IO_RING_SIZE (256 * 1024)
+
+struct tmate_ssh_io {
+	pthread_t thread;
+	ssh_session session;
+	ssh_channel channel;
+
+	struct tmate_ring out;
+	struct tmate_ring in;
+
+	int wake_fds[2];	/* To the thread */
+	int notify_fds[2];	/* To the event loop */
+	struct event *ev_notify;
+
+	int stop;
+	int failed;
+	char error[256];	/* Set before failed */
+};
+
+static void io_poke(int fd)
+{
+	/* A full pipe means a wake up is pending already. */
+	if (write(fd, "", 1) < 0 && errno != EAGAIN && errno != EINTR)
+		tmate_fatal("Cannot write to pipe");
+}
+
+static void io_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void io_fail(struct tmate_ssh_io *io, const char *what)
+{
+	snprintf(io->error, sizeof(io->error), "%s: %s", what,
+		 ssh_get_error(io->session));
+	__atomic_store_n(&io->failed, 1, __ATOMIC_RELEASE);
+	io_poke(io->notify_fds[1]);
+}
+
+static void *io_thread(void *arg)
+{
+	struct tmate_ssh_io *io = arg;
+	struct pollfd pfd[2];
+	bool progress;
+	uint32_t window;
+	ssize_t len;
+	size_t n;
+	char *buf;
+
+	pfd[0].fd = io->wake_fds[0];
+	pfd[1].fd = ssh_get_fd(io->session);
+
+	while (!__atomic_load_n(&io->stop, __ATOMIC_ACQUIRE)) {
+		progress = false;
+
+		n = tmate_ring_reserve(&io->in, &buf);
+		if (n) {
+			len = ssh_channel_read_nonblocking(io->channel, buf, n, 0);
+			if (len < 0) {
+				io_fail(io, "Error reading from channel");
+				break;
+			}
+			if (len > 0) {
+				tmate_ring_commit(&io->in, len);
+				progress = true;
+			}
+		}
+
+		n = tmate_ring_peek(&io->out, &buf);
+		window = n ? ssh_channel_window_size(io->channel) : 0;
+		if (n && window) {
+			if (n > window)
+				n = window;
+			len = ssh_channel_write(io->channel, buf, n);
+			if (len < 0) {
+				io_fail(io, "Error writing to channel");
+				break;
+			}
+			if (len > 0) {
+				tmate_ring_consume(&io->out, len);
+				progress = true;
+			}
+		}
+
+		if (progress) {
+			io_poke(io->notify_fds[1]);
+			continue;
+		}
+
+		/*
+		 * Only watch the socket when there is room for what it has,
+		 * otherwise we would spin until the event loop catches up.
+		 */
+		pfd[0].events = POLLIN;
+		pfd[1].events = tmate_ring_reserve(&io->in, &buf) ? POLLIN : 0;
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			snprintf(io->error, sizeof(io->error), "poll: %s",
+				 strerror(errno));
+			__atomic_store_n(&io->failed, 1, __ATOMIC_RELEASE);
+			io_poke(io->notify_fds[1]);
 			break;
 		}
+		if (pfd[0].revents & POLLIN)
+			io_drain(io->wake_fds[0]);
+	}
+
+	return NULL;
+}
 
+static void io_write(struct tmate_ssh_client *client, struct evbuffer *buffer)
+{
+	struct tmate_ssh_io *io = client->io;
+	struct evbuffer_iovec iov;
+	size_t written;
+	bool wake = false;
+
+	while (evbuffer_peek(buffer, -1, NULL, &iov, 1) > 0) {
+		written = tmate_ring_write(&io->out, iov.iov_base, iov.iov_len);
+		if (!written)
+			break;
+
+		/* Latencies are measured to the thread picking the bytes up. */
 		evbuffer_drain(buffer, written);
+		tmate_encoder_drained(&client->tmate_session->encoder, written);
+		tmate_stats.written += written;
+		wake = true;
+
+		if (written < iov.iov_len)
+			break;
+	}
+
+	if (wake)
+		io_poke(io->wake_fds[1]);
+}
+
+static void io_read(struct tmate_ssh_client *client)
+{
+	struct tmate_ssh_io *io = client->io;
+	struct tmate_decoder *decoder = &client->tmate_session->decoder;
+	char *buf, *dbuf;
+	size_t n, dlen;
+	bool wake = false;
+
+	while ((n = tmate_ring_peek(&io->in, &buf)) > 0) {
+		tmate_decoder_get_buffer(decoder, &dbuf, &dlen);
+		if (dlen > n)
+			dlen = n;
+		memcpy(dbuf, buf, dlen);
+		tmate_ring_consume(&io->in, dlen);
+		tmate_decoder_commit(decoder, dlen);
+		wake = true;
+	}
+
+	/* There is room for the socket again. */
+	if (wake)
+		io_poke(io->wake_fds[1]);
+}
+
+static void on_io_notify(__unused evutil_socket_t fd, __unused short what,
+			 void *arg)
+{
+	struct tmate_ssh_client *client = arg;
+	struct tmate_ssh_io *io = client->io;
+
+	io_drain(io->notify_fds[0]);
+
+	if (__atomic_load_n(&io->failed, __ATOMIC_ACQUIRE)) {
+		kill_ssh_client(client, "%s", io->error);
+		return;
 	}
+
+	io_read(client);
+
+	/* The thread consumed some output, there may be more. */
+	on_encoder_write(client, client->tmate_session->encoder.buffer);
+}
+
+static void io_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+		tmate_fatal("pipe failed");
+	setblocking(fds[0], 0);
+	setblocking(fds[1], 0);
+}
+
+static void start_io_thread(struct tmate_ssh_client *client)
+{
+	struct tmate_ssh_io *io;
+	sigset_t set, oldset;
+
+	io = xcalloc(1, sizeof(*io));
+	io->session = client->session;
+	io->channel = client->channel;
+	tmate_ring_init(&io->out, IO_RING_SIZE);
+	tmate_ring_init(&io->in, IO_RING_SIZE);
+	io_pipe(io->wake_fds);
+	io_pipe(io->notify_fds);
+
+	io->ev_notify = event_new(client->tmate_session->ev_base,
+				  io->notify_fds[0], EV_READ | EV_PERSIST,
+				  on_io_notify, client);
+	if (!io->ev_notify)
+		tmate_fatal("out of memory");
+	event_add(io->ev_notify, NULL);
+
+	/* The socket is the thread's now. */
+	event_del(client->ev_ssh);
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	if (pthread_create(&io->thread, NULL, io_thread, io) != 0)
+		tmate_fatal("Cannot start thread");
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	client->io = io;
+	tmate_debug_ssh("Channel served by the I/O thread");
+}
+
+static void stop_io_thread(struct tmate_ssh_client *client)
+{
+	struct tmate_ssh_io *io = client->io;
+
+	if (!io)
+		return;
+
+	__atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+	io_poke(io->wake_fds[1]);
+	pthread_join(io->thread, NULL);
+
+	event_free(io->ev_notify);
+	close(io->wake_fds[0]);
+	close(io->wake_fds[1]);
+	close(io->notify_fds[0]);
+	close(io->notify_fds[1]);
+	tmate_ring_free(&io->out);
+	tmate_ring_free(&io->in);
+	free(io);
+	client->io = NULL;
 }
 
 static void on_ssh_auth_server_complete(struct tmate_ssh_client *connected_client)
@@ -83,6 +464,9 @@ static void on_ssh_auth_server_complete(struct tmate_ssh_client *connected_clien
 	struct tmate_session *session = connected_client->tmate_session;
 	struct tmate_ssh_client *client, *tmp_client;
 
+	if (connected_client->standby)
+		return;
+
 	TAILQ_FOREACH_SAFE(client, &session->clients, node, tmp_client) {
 		if (client == connected_client)
 			continue;
@@ -91,6 +475,15 @@ static void on_ssh_auth_server_complete(struct tmate_ssh_client *connected_clien
 	}
 }
 
+static char *ssh_path(const char *name)
+{
+	const char *home = find_home();
+	char *path;
+
+	xasprintf(&path, "%s/.ssh/%s", home ? home : "", name);
+	return path;
+}
+
 static char *get_identity(void)
 {
 	char *identity;
@@ -102,31 +495,195 @@ static char *get_identity(void)
 	if (strchr(identity, '/'))
 		identity = xstrdup(identity);
 	else
-		xasprintf(&identity, "%%d/%s", identity);
+		identity = ssh_path(identity);
 
 	return identity;
 }
 
+/*
+ * Decrypting a private key can take seconds (bcrypt_pbkdf with the new
+ * OpenSSH format), so keys are loaded in a thread rather than by
+ * ssh_userauth_publickey_auto() on the event loop. Apart from libssh
+ * logging, the thread only touches the struct below, and it wakes the event
+ * loop up through the pipe. It cannot
+ * be stopped: when the client is killed meanwhile, client is set to NULL
+ * and the struct is freed once the thread is done.
+ */
+struct tmate_ssh_keys {
+	struct tmate_ssh_client *client;
+
+	pthread_t thread;
+	int fds[2];
+	struct event *ev;
+	bool done;
+
+	char **paths;
+	int npaths;
+	char *passphrase;
+
+	/* Results */
+	bool need_passphrase;
+	ssh_key *keys;
+	int nkeys;
+};
+
+static const char *default_identities[] = {
+	"id_ed25519", "id_ecdsa", "id_rsa", NULL
+};
+
+static void free_ssh_keys(struct tmate_ssh_keys *keys)
+{
+	int i;
+
+	for (i = 0; i < keys->nkeys; i++)
+		ssh_key_free(keys->keys[i]);
+	free(keys->keys);
+	for (i = 0; i < keys->npaths; i++)
+		free(keys->paths[i]);
+	free(keys->paths);
+	free(keys->passphrase);
+	free(keys);
+}
+
 static int passphrase_callback(__unused const char *prompt, char *buf, size_t len,
 			       __unused int echo, __unused int verify, void *userdata)
 {
-	struct tmate_ssh_client *client = userdata;
+	struct tmate_ssh_keys *keys = userdata;
 
-	client->tmate_session->need_passphrase = 1;
+	keys->need_passphrase = true;
 
-	if (client->tmate_session->passphrase)
-		strlcpy(buf, client->tmate_session->passphrase, len);
+	if (keys->passphrase)
+		strlcpy(buf, keys->passphrase, len);
 	else
 		strcpy(buf, "");
 
 	return 0;
 }
 
+static void *load_keys_thread(void *arg)
+{
+	struct tmate_ssh_keys *keys = arg;
+	ssh_key key;
+	int i;
+
+	for (i = 0; i < keys->npaths; i++) {
+		if (access(keys->paths[i], R_OK) < 0)
+			continue;
+
+		if (ssh_pki_import_privkey_file(keys->paths[i], keys->passphrase,
+						passphrase_callback, keys,
+						&key) != SSH_OK)
+			continue;
+
+		/* Not xreallocarray(), its counter is not for threads. */
+		keys->keys = realloc(keys->keys,
+				     (keys->nkeys + 1) * sizeof(*keys->keys));
+		if (!keys->keys)
+			tmate_fatal("out of memory");
+		keys->keys[keys->nkeys++] = key;
+	}
+
+	if (write(keys->fds[1], "", 1) < 0)
+		tmate_fatal("Cannot wake up the event loop");
+
+	return NULL;
+}
+
+static void on_keys_loaded(__unused evutil_socket_t fd, __unused short what,
+			   void *arg)
+{
+	struct tmate_ssh_keys *keys = arg;
+	struct tmate_ssh_client *client = keys->client;
+
+	pthread_join(keys->thread, NULL);
+	event_free(keys->ev);
+	close(keys->fds[0]);
+	close(keys->fds[1]);
+	keys->done = true;
+
+	if (!client) {
+		free_ssh_keys(keys);
+		return;
+	}
+
+	tmate_debug_ssh("Loaded %d SSH keys", keys->nkeys);
+
+	if (keys->need_passphrase)
+		client->tmate_session->need_passphrase = 1;
+
+	event_add(client->ev_ssh, NULL);
+	on_ssh_client_event(client);
+}
+
+static void load_keys(struct tmate_ssh_client *client)
+{
+	struct tmate_ssh_keys *keys;
+	const char **name;
+	char *identity;
+	sigset_t set, oldset;
+
+	keys = xcalloc(1, sizeof(*keys));
+	keys->client = client;
+
+	if ((identity = get_identity())) {
+		keys->paths = xmalloc(sizeof(*keys->paths));
+		keys->paths[keys->npaths++] = identity;
+	} else {
+		for (name = default_identities; *name; name++) {
+			keys->paths = xreallocarray(keys->paths,
+					keys->npaths + 1, sizeof(*keys->paths));
+			keys->paths[keys->npaths++] = ssh_path(*name);
+		}
+	}
+
+	if (client->tmate_session->passphrase)
+		keys->passphrase = xstrdup(client->tmate_session->passphrase);
+
+	if (pipe(keys->fds) < 0)
+		tmate_fatal("pipe failed");
+	setblocking(keys->fds[0], 0);
+
+	keys->ev = event_new(client->tmate_session->ev_base, keys->fds[0],
+			     EV_READ, on_keys_loaded, keys);
+	if (!keys->ev)
+		tmate_fatal("out of memory");
+	event_add(keys->ev, NULL);
+
+	/*
+	 * Nothing happens on the connection until the keys are there, and
+	 * the socket must not wake the event loop up meanwhile.
+	 */
+	event_del(client->ev_ssh);
+
+	/* Signals are for the event loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	if (pthread_create(&keys->thread, NULL, load_keys_thread, keys) != 0)
+		tmate_fatal("Cannot start thread");
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	client->keys = keys;
+	client->next_key = 0;
+}
+
+static void release_keys(struct tmate_ssh_client *client)
+{
+	if (!client->keys)
+		return;
+
+	if (client->keys->done)
+		free_ssh_keys(client->keys);
+	else
+		client->keys->client = NULL;
+	client->keys = NULL;
+}
+
 static void on_passphrase_read(const char *passphrase, void *private)
 {
 	struct tmate_ssh_client *client = private;
 
 	client->tmate_session->passphrase = xstrdup(passphrase);
+	release_keys(client);
 	on_ssh_client_event(client);
 }
 
@@ -230,6 +787,70 @@ static void tune_socket_opts(int fd)
 #undef SSO
 }
 
+/*
+ * Once one TCP connection is up, the attempts still connecting to other
+ * servers are cancelled (RFC 8305); any that got there too race on through the
+ * key exchange. Attempts not yet started are kept in case this one fails.
+ */
+static void check_tcp_connected(struct tmate_ssh_client *connected_client)
+{
+	struct tmate_session *session = connected_client->tmate_session;
+	struct tmate_ssh_client *client, *tmp_client;
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	struct timeval now, tv;
+	int fd, latency_ms;
+
+	if (connected_client->tcp_connected)
+		return;
+
+	if ((fd = ssh_get_fd(connected_client->session)) < 0)
+		return;
+	if (getpeername(fd, (struct sockaddr *)&ss, &len) < 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &connected_client->connect_start, &tv);
+	latency_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	tmate_server_latency(session, connected_client->server_ip, latency_ms);
+
+	tmate_debug_ssh("TCP connected to %s in %d ms", connected_client->server_ip,
+		    latency_ms);
+	connected_client->tcp_connected = true;
+
+	if (connected_client->standby)
+		return;
+
+	TAILQ_FOREACH_SAFE(client, &session->clients, node, tmp_client) {
+		if (client == connected_client || client->tcp_connected)
+			continue;
+		if (client->state == SSH_NONE)
+			continue;
+
+		kill_ssh_client(client, NULL);
+	}
+}
+
+/*
+ * Nothing is expected on an idle standby connection. It is replaced when the
+ * server closes it, or says anything: it would have to be answered, and
+ * libssh only reads from a session on behalf of a channel or an
+ * authentication.
+ */
+static void check_standby(struct tmate_ssh_client *client)
+{
+	ssize_t n;
+	char c;
+
+	n = recv(ssh_get_fd(client->session), &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	tmate_debug_ssh("Standby connection to %s %s", client->server_ip,
+			n == 0 ? "closed" : n < 0 ? strerror(errno) : "not idle");
+	kill_ssh_client(client, NULL);
+}
+
 static void init_conn_fd(struct tmate_ssh_client *client)
 {
 	int fd;
@@ -250,6 +871,69 @@ static void init_conn_fd(struct tmate_ssh_client *client)
 	event_add(client->ev_ssh, NULL);
 }
 
+/*
+ * Without AES instructions, chacha20-poly1305 is several times faster than
+ * AES-GCM, with them it is the other way around. With tmate-ssh-ciphers set
+ * to auto, the faster one goes first: the CPU says which, libssh does not
+ * give its ciphers out to be timed. Returns -1 when the CPU cannot tell.
+ */
+static int have_aes_instructions(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return -1;
+	return !!(ecx & bit_AES);
+#elif defined(__aarch64__) && defined(__linux__)
+	return !!(getauxval(AT_HWCAP) & HWCAP_AES);
+#elif defined(__aarch64__) && defined(__APPLE__)
+	return 1;
+#else
+	return -1;
+#endif
+}
+
+#define SSH_CIPHERS_AES "aes128-gcm@openssh.com,aes256-gcm@openssh.com," \
+			"chacha20-poly1305@openssh.com,aes128-ctr,aes256-ctr"
+#define SSH_CIPHERS_CHACHA "chacha20-poly1305@openssh.com," \
+			   "aes128-gcm@openssh.com,aes256-gcm@openssh.com," \
+			   "aes128-ctr,aes256-ctr"
+#define SSH_HMACS "hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com," \
+		  "hmac-sha2-256,hmac-sha2-512,hmac-sha1"
+
+static void set_ciphers(ssh_session session)
+{
+	static int aes = -2;
+	const char *ciphers, *hmacs = NULL;
+
+	ciphers = options_get_string(global_options, "tmate-ssh-ciphers");
+	if (!*ciphers)
+		return;
+
+	if (!strcmp(ciphers, "auto")) {
+		if (aes == -2) {
+			aes = have_aes_instructions();
+			tmate_debug("AES instructions: %s", aes == -1 ? "unknown" :
+				    aes ? "yes" : "no");
+		}
+		if (aes == -1)
+			return;
+		ciphers = aes ? SSH_CIPHERS_AES : SSH_CIPHERS_CHACHA;
+		hmacs = SSH_HMACS;
+	}
+
+	if (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, ciphers) < 0 ||
+	    ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, ciphers) < 0)
+		tmate_info("Cannot set ciphers %s: %s", ciphers,
+			   ssh_get_error(session));
+	if (hmacs &&
+	    (ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, hmacs) < 0 ||
+	     ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, hmacs) < 0))
+		tmate_info("Cannot set MACs %s: %s", hmacs,
+			   ssh_get_error(session));
+}
+
 static void on_ssh_client_event(struct tmate_ssh_client *client)
 {
 	ssh_session session = client->session;
@@ -263,8 +947,6 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 			return;
 		}
 
-		ssh_set_callbacks(session, &client->ssh_callbacks);
-
 		int verbosity = SSH_LOG_NOLOG + log_get_level();
 		int port = options_get_number(global_options, "tmate-server-port");
 
@@ -274,19 +956,11 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 		ssh_options_set(session, SSH_OPTIONS_PORT, &port);
 		ssh_options_set(session, SSH_OPTIONS_USER, "tmate");
 		ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
+		set_ciphers(session);
 
-		char *identity;
-		if ((identity = get_identity())) {
-			/*
-			 * FIXME libssh will continue with the next set of
-			 * keys if the identity has a passphrase and the
-			 * regular one doesn't.
-			 */
-			ssh_options_set(session, SSH_OPTIONS_IDENTITY, identity);
-
+		if (strlen(options_get_string(global_options, "tmate-identity"))) {
 			/* Do not use keys from ssh-agent. */
 			unsetenv("SSH_AUTH_SOCK");
-			free(identity);
 		}
 
 		client->state = SSH_CONNECT;
@@ -297,6 +971,7 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 		switch (ssh_connect(session)) {
 		case SSH_AGAIN:
 			init_conn_fd(client);
+			check_tcp_connected(client);
 			return;
 		case SSH_ERROR:
 			kill_ssh_client(client, "Error connecting: %s",
@@ -304,8 +979,9 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 			return;
 		case SSH_OK:
 			init_conn_fd(client);
+			check_tcp_connected(client);
 
-			tmate_debug("Establishing connection to %s", client->server_ip);
+			tmate_debug_ssh("Establishing connection to %s", client->server_ip);
 			client->state = SSH_AUTH_SERVER;
 		}
 		// fall through
@@ -381,7 +1057,9 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 		 * We need to do it before we ask the user its passphrase,
 		 * otherwise the speed test would be biased.
 		 */
-		tmate_debug("Connected to %s", client->server_ip);
+		tmate_debug_ssh("Connected to %s", client->server_ip);
+		if (!client->tmate_session->reconnected && !client->standby)
+			log_startup("connected");
 		on_ssh_auth_server_complete(client);
 
 		client->state = SSH_AUTH_CLIENT_NONE;
@@ -396,46 +1074,95 @@ static void on_ssh_client_event(struct tmate_ssh_client *client)
 			kill_ssh_client(client, "Auth error: %s", ssh_get_error(session));
 			return;
 		case SSH_AUTH_SUCCESS:
-			tmate_debug("Auth successful via none method");
+			tmate_debug_ssh("Auth successful via none method");
 			client->state = SSH_NEW_CHANNEL;
 			goto SSH_NEW_CHANNEL;
 		case SSH_AUTH_PARTIAL:
 		case SSH_AUTH_DENIED:
-			client->state = SSH_AUTH_CLIENT_PUBKEY;
+			client->state = SSH_AUTH_CLIENT_AGENT;
+		}
+		// fall through
+
+	case SSH_AUTH_CLIENT_AGENT:
+		if (getenv("SSH_AUTH_SOCK")) {
+			switch (ssh_userauth_agent(session, NULL)) {
+			case SSH_AUTH_AGAIN:
+				return;
+			case SSH_AUTH_ERROR:
+				kill_ssh_client(client, "Auth error: %s",
+						ssh_get_error(session));
+				return;
+			case SSH_AUTH_SUCCESS:
+				tmate_debug_ssh("Auth successful via ssh-agent");
+				client->state = SSH_NEW_CHANNEL;
+				goto SSH_NEW_CHANNEL;
+			default:
+				break;
+			}
 		}
+		client->state = SSH_AUTH_CLIENT_PUBKEY;
 		// fall through
 
 	case SSH_AUTH_CLIENT_PUBKEY:
-		client->tried_passphrase = client->tmate_session->passphrase;
-		switch (ssh_userauth_publickey_auto(session, NULL, client->tried_passphrase)) {
-		case SSH_AUTH_AGAIN:
+		if (!client->keys) {
+			client->tried_passphrase = client->tmate_session->passphrase;
+			load_keys(client);
 			return;
-		case SSH_AUTH_PARTIAL:
-		case SSH_AUTH_INFO:
-		case SSH_AUTH_DENIED:
-			if (client->tmate_session->need_passphrase) {
-				request_passphrase(client);
-			} else {
-				kill_ssh_client(client, "SSH keys not found."
-				" Run 'ssh-keygen' to create keys.");
+		}
+		if (!client->keys->done)
+			return;
+
+		for (; client->next_key < client->keys->nkeys; client->next_key++) {
+			switch (ssh_userauth_publickey(session, NULL,
+					client->keys->keys[client->next_key])) {
+			case SSH_AUTH_AGAIN:
+				return;
+			case SSH_AUTH_ERROR:
+				kill_ssh_client(client, "Auth error: %s",
+						ssh_get_error(session));
 				return;
+			case SSH_AUTH_SUCCESS:
+				tmate_debug_ssh("Auth successful with pubkey");
+				release_keys(client);
+				client->state = SSH_NEW_CHANNEL;
+				goto SSH_NEW_CHANNEL;
+			default:
+				continue;
 			}
+		}
 
-			if (client->tried_passphrase)
-				tmate_status_message("Can't load SSH key."
-				" Try typing passphrase again in case of typo. ctrl-c to abort.");
+		if (client->standby) {
+			/* Only the connection in use asks for a passphrase. */
+			kill_ssh_client(client, NULL);
 			return;
-		case SSH_AUTH_ERROR:
-			kill_ssh_client(client, "Auth error: %s", ssh_get_error(session));
+		}
+
+		if (client->tmate_session->need_passphrase) {
+			request_passphrase(client);
+		} else {
+			kill_ssh_client(client, "SSH keys not found."
+			" Run 'ssh-keygen' to create keys.");
 			return;
-		case SSH_AUTH_SUCCESS:
-			tmate_debug("Auth successful with pubkey");
-			client->state = SSH_NEW_CHANNEL;
 		}
-		// fall through
+
+		if (client->tried_passphrase)
+			tmate_status_message("Can't load SSH key."
+			" Try typing passphrase again in case of typo. ctrl-c to abort.");
+		return;
+
+	case SSH_STANDBY:
+		check_standby(client);
+		return;
 
 SSH_NEW_CHANNEL:
 	case SSH_NEW_CHANNEL:
+		if (client->standby) {
+			tmate_debug_ssh("Standby connection to %s ready",
+					client->server_ip);
+			client->state = SSH_STANDBY;
+			return;
+		}
+
 		client->channel = channel = ssh_channel_new(session);
 		if (!channel) {
 			tmate_fatal("cannot ssh_channel_new()");
@@ -453,7 +1180,7 @@ SSH_NEW_CHANNEL:
 					ssh_get_error(session));
 			return;
 		case SSH_OK:
-			tmate_debug("Session opened, initializing tmate");
+			tmate_debug_ssh("Session opened, initializing tmate");
 			client->state = SSH_BOOTSTRAP;
 		}
 		// fall through
@@ -467,34 +1194,62 @@ SSH_NEW_CHANNEL:
 					ssh_get_error(session));
 			return;
 		case SSH_OK:
-			tmate_debug("Ready");
+			tmate_debug_ssh("Ready");
+			if (!client->tmate_session->reconnected)
+				log_startup("ssh channel open");
 
 			/* Writes are now performed in a blocking fashion */
 			ssh_set_blocking(session, 1);
 
 			client->state = SSH_READY;
 
-			if (client->tmate_session->reconnected)
+			if (client->tmate_session->reconnected &&
+			    !tmate_resume_stream(client->tmate_session))
 				tmate_send_reconnection_state(client->tmate_session);
 
 			tmate_encoder_set_ready_callback(&client->tmate_session->encoder,
 							 on_encoder_write, client);
 			tmate_decoder_init(&client->tmate_session->decoder,
 					   on_decoder_read, client);
+			client->tmate_session->probe_answered = false;
+			heartbeat_start(client);
+
+			if (options_get_number(global_options, "tmate-io-thread"))
+				start_io_thread(client);
 
 			free(client->tmate_session->last_server_ip);
 			client->tmate_session->last_server_ip = xstrdup(client->server_ip);
+			tmate_save_servers(client->tmate_session, client->server_ip);
+			client->tmate_session->connected_since = time(NULL);
+			tmate_schedule_standby(client->tmate_session,
+					       TMATE_STANDBY_DELAY);
 		}
 		// fall through
 
 	case SSH_READY:
-		read_channel(client);
+		if (client->io) {
+			on_encoder_write(client, client->tmate_session->encoder.buffer);
+			return;
+		}
+
+		if (read_channel(client) < 0)
+			return;
+
+		/* The channel window may have opened up */
+		on_encoder_write(client, client->tmate_session->encoder.buffer);
 	}
 }
 
 static void __on_ssh_client_event(__unused evutil_socket_t fd, __unused short what, void *arg)
 {
-	on_ssh_client_event(arg);
+	struct tmate_ssh_client *client = arg;
+	struct timeval start;
+	int state = client->state;
+
+	watchdog_start(&start);
+	on_ssh_client_event(client);
+	/* The client may be gone. */
+	watchdog_stop(WATCHDOG_TMATE_SSH, &start, "state %d", state);
 }
 
 static void kill_ssh_client(struct tmate_ssh_client *client,
@@ -504,8 +1259,13 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 	va_list ap;
 	char *message = NULL;
 
-	TAILQ_REMOVE(&client->tmate_session->clients, client, node);
-	last_client = TAILQ_EMPTY(&client->tmate_session->clients);
+	if (client->standby) {
+		client->tmate_session->standby = NULL;
+		last_client = false;
+	} else {
+		TAILQ_REMOVE(&client->tmate_session->clients, client, node);
+		last_client = TAILQ_EMPTY(&client->tmate_session->clients);
+	}
 
 	if (fmt && last_client) {
 		va_start(ap, fmt);
@@ -514,7 +1274,10 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 		tmate_status_message("%s", message);
 	}
 
-	tmate_debug("SSH client killed (%s)", client->server_ip);
+	tmate_debug_ssh("SSH client killed (%s)", client->server_ip);
+
+	release_keys(client);
+	stop_io_thread(client);
 
 	if (client->ev_ssh) {
 		event_del(client->ev_ssh);
@@ -522,10 +1285,16 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 		client->ev_ssh = NULL;
 	}
 
+	if (client->ev_heartbeat) {
+		event_free(client->ev_heartbeat);
+		client->ev_heartbeat = NULL;
+	}
+
 	if (client->state == SSH_READY) {
 		tmate_encoder_set_ready_callback(&client->tmate_session->encoder, NULL, NULL);
 		tmate_decoder_destroy(&client->tmate_session->decoder);
 
+		tmate_cancel_resize(client->tmate_session);
 		client->tmate_session->min_sx = -1;
 		client->tmate_session->min_sy = -1;
 		recalculate_sizes();
@@ -538,8 +1307,13 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 		client->channel = NULL;
 	}
 
-	if (last_client)
-		tmate_reconnect_session(client->tmate_session, message);
+	if (client->standby)
+		tmate_schedule_standby(client->tmate_session, TMATE_STANDBY_RETRY);
+	else if (last_client) {
+		if (!tmate_ssh_promote_standby(client->tmate_session))
+			tmate_reconnect_session(client->tmate_session, message);
+	} else if (fmt)
+		tmate_connect_next_client(client->tmate_session);
 
 	free(client->server_ip);
 	free(client);
@@ -548,6 +1322,7 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 void connect_ssh_client(struct tmate_ssh_client *client)
 {
 	assert(!client->session);
+	gettimeofday(&client->connect_start, NULL);
 	client->state = SSH_INIT;
 	on_ssh_client_event(client);
 }
@@ -555,12 +1330,11 @@ void connect_ssh_client(struct tmate_ssh_client *client)
 static void ssh_log_function(int priority, const char *function,
 			     const char *buffer, __unused void *userdata)
 {
-	tmate_debug("[%d] [%s] %s", priority, function, buffer);
+	tmate_debug_ssh("[%d] [%s] %s", priority, function, buffer);
 }
 
-struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *session,
-						const char *server_ip)
- 
+static struct tmate_ssh_client *ssh_client_new(struct tmate_session *session,
+					       const char *server_ip)
 {
 	struct tmate_ssh_client *client;
 	client = xmalloc(sizeof(*client));
@@ -568,13 +1342,7 @@ struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *session,
 
 	ssh_set_log_callback(ssh_log_function);
 
-	memset(&client->ssh_callbacks, 0, sizeof(client->ssh_callbacks));
-	ssh_callbacks_init(&client->ssh_callbacks);
-	client->ssh_callbacks.userdata = client;
-	client->ssh_callbacks.auth_function = passphrase_callback;
-
 	client->tmate_session = session;
-	TAILQ_INSERT_TAIL(&session->clients, client, node);
 
 	client->server_ip = xstrdup(server_ip);
 	client->state = SSH_NONE;
@@ -583,3 +1351,52 @@ struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *session,
 
 	return client;
 }
+
+struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *session,
+						const char *server_ip)
+{
+	struct tmate_ssh_client *client = ssh_client_new(session, server_ip);
+
+	TAILQ_INSERT_TAIL(&session->clients, client, node);
+	return client;
+}
+
+/*
+ * The standby goes through the key exchange and authentication like any
+ * client, then stops short of opening a channel, which would start a session
+ * on the server. It stays out of session->clients so that it does not take
+ * part in picking the fastest server.
+ */
+struct tmate_ssh_client *tmate_ssh_standby_alloc(struct tmate_session *session,
+						 const char *server_ip)
+{
+	struct tmate_ssh_client *client = ssh_client_new(session, server_ip);
+
+	client->standby = true;
+	session->standby = client;
+	return client;
+}
+
+/*
+ * Fail over to the standby once the connection in use is gone: only the
+ * channel is left to open, then the stream is resumed as on a reconnection.
+ */
+bool tmate_ssh_promote_standby(struct tmate_session *session)
+{
+	struct tmate_ssh_client *client = session->standby;
+
+	if (!client || client->state != SSH_STANDBY)
+		return false;
+
+	tmate_debug_ssh("Failing over to %s", client->server_ip);
+	tmate_status_message("Failing over to %s...", client->server_ip);
+
+	session->standby = NULL;
+	client->standby = false;
+	TAILQ_INSERT_TAIL(&session->clients, client, node);
+
+	session->reconnected = true;
+	client->state = SSH_NEW_CHANNEL;
+	on_ssh_client_event(client);
+	return true;
+}
@@ -0,0 +1,342 @@
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tmate.h"
+#include "tmate-protocol.h"
+
+/*
+ * Where the time goes on the tmate channel. Inbound messages are timed from
+ * when they were read off the channel until their handler returns, outbound
+ * ones from when they were packed until their last byte was written to the
+ * channel (see tmate_encoder_mark()). Each message type has a log2 histogram,
+ * shown by show-tmate-stats and sent to the server every tmate-stats-interval
+ * seconds.
+ *
+ * The encoder and channel counters are there to tell where bytes are stuck:
+ * in the encoder buffer, waiting on the channel window, or in libssh. They are
+ * the tmate_* formats.
+ *
+ * Every tmate-latency-interval seconds, a TMATE_OUT_LATENCY_PROBE goes after
+ * the pending pty data, so it waits behind the same buffers. The server sends
+ * it back with the latency it sees to the viewers, which makes
+ * #{tmate_latency}: what is printed in a pane takes this long to reach them.
+ *
+ * TMATE_OUT_STATS also has what the host alone can tell, so that a lag can be
+ * put down to it or to the network: how late the stats timer fires, the
+ * encoder backlog, the memory used and the output of each pane.
+ */
+
+struct tmate_stats tmate_stats = { .latency = -1 };
+
+static const char *in_names[] = {
+	[TMATE_IN_NOTIFY] = "notify",
+	[TMATE_IN_LEGACY_PANE_KEY] = "legacy-pane-key",
+	[TMATE_IN_RESIZE] = "resize",
+	[TMATE_IN_EXEC_CMD_STR] = "exec-cmd-str",
+	[TMATE_IN_SET_ENV] = "set-env",
+	[TMATE_IN_READY] = "ready",
+	[TMATE_IN_PANE_KEY] = "pane-key",
+	[TMATE_IN_EXEC_CMD] = "exec-cmd",
+	[TMATE_IN_SYNC_LAYOUT] = "sync-layout",
+	[TMATE_IN_PANE_KEYS] = "pane-keys",
+	[TMATE_IN_ACK] = "ack",
+	[TMATE_IN_RESUME_FAILED] = "resume-failed",
+	[TMATE_IN_PANE_FOCUS] = "pane-focus",
+	[TMATE_IN_LATENCY_PROBE] = "latency-probe",
+	[TMATE_IN_AUTHORIZED_KEYS_WANTED] = "authorized-keys-wanted",
+};
+
+static const char *out_names[] = {
+	[TMATE_OUT_HEADER] = "header",
+	[TMATE_OUT_SYNC_LAYOUT] = "sync-layout",
+	[TMATE_OUT_PTY_DATA] = "pty-data",
+	[TMATE_OUT_EXEC_CMD_STR] = "exec-cmd-str",
+	[TMATE_OUT_FAILED_CMD] = "failed-cmd",
+	[TMATE_OUT_STATUS] = "status",
+	[TMATE_OUT_SYNC_COPY_MODE] = "sync-copy-mode",
+	[TMATE_OUT_WRITE_COPY_MODE] = "write-copy-mode",
+	[TMATE_OUT_FIN] = "fin",
+	[TMATE_OUT_READY] = "ready",
+	[TMATE_OUT_RECONNECT] = "reconnect",
+	[TMATE_OUT_SNAPSHOT] = "snapshot",
+	[TMATE_OUT_EXEC_CMD] = "exec-cmd",
+	[TMATE_OUT_UNAME] = "uname",
+	[TMATE_OUT_SYNC_LAYOUT_DIFF] = "sync-layout-diff",
+	[TMATE_OUT_SNAPSHOT_BEGIN] = "snapshot-begin",
+	[TMATE_OUT_SNAPSHOT_PANE] = "snapshot-pane",
+	[TMATE_OUT_SNAPSHOT_END] = "snapshot-end",
+	[TMATE_OUT_STATS] = "stats",
+	[TMATE_OUT_RESUME] = "resume",
+	[TMATE_OUT_ECHO_HINT] = "echo-hint",
+	[TMATE_OUT_PANE_DIFF] = "pane-diff",
+	[TMATE_OUT_LATENCY_PROBE] = "latency-probe",
+	[TMATE_OUT_AUTHORIZED_KEYS] = "authorized-keys",
+	[TMATE_OUT_EXEC_CMDS] = "exec-cmds",
+	[TMATE_OUT_SNAPSHOT_HISTORY] = "snapshot-history",
+};
+
+static const char *type_name(const char **names, size_t n, int type)
+{
+	if (type < 0 || (size_t)type >= n || !names[type])
+		return "unknown";
+	return names[type];
+}
+
+const char *tmate_stats_in_name(int type)
+{
+	return type_name(in_names, nitems(in_names), type);
+}
+
+const char *tmate_stats_out_name(int type)
+{
+	return type_name(out_names, nitems(out_names), type);
+}
+
+void tmate_stats_record(struct tmate_stats_hist *hists, int type,
+			const struct timeval *start)
+{
+	struct tmate_stats_hist *hist;
+	struct timeval now, tv;
+	uint64_t us;
+	int bucket;
+
+	if (type < 0 || type >= TMATE_STATS_TYPES)
+		return;
+	hist = &hists[type];
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &tv);
+	if (tv.tv_sec < 0)
+		us = 0;
+	else
+		us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	for (bucket = 0; bucket < TMATE_STATS_BUCKETS - 1; bucket++) {
+		if (us < (1ULL << bucket))
+			break;
+	}
+
+	hist->count++;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->buckets[bucket]++;
+}
+
+void tmate_stats_reset(void)
+{
+	memset(tmate_stats.in, 0, sizeof(tmate_stats.in));
+	memset(tmate_stats.out, 0, sizeof(tmate_stats.out));
+	tmate_stats.latency_max = tmate_stats.latency;
+}
+
+/* Called each time the encoder hands its buffer to the channel. */
+void tmate_stats_flushed(struct tmate_encoder *encoder)
+{
+	size_t len = evbuffer_get_length(encoder->buffer);
+	time_t now = time(NULL);
+
+	tmate_stats.flushes++;
+	if (len > tmate_stats.encoder_max)
+		tmate_stats.encoder_max = len;
+
+	/* Bytes packed per second, over the last whole second. */
+	if (now != tmate_stats.packed_sec) {
+		if (now == tmate_stats.packed_sec + 1)
+			tmate_stats.packed_rate = tmate_stats.packed -
+						  tmate_stats.packed_mark;
+		else
+			tmate_stats.packed_rate = 0;
+		tmate_stats.packed_mark = tmate_stats.packed;
+		tmate_stats.packed_sec = now;
+	}
+}
+
+/* The value of a stats format key, or NULL if key is not one. */
+const char *tmate_stats_find(const char *key)
+{
+	static char s[32];
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	uint64_t rate = tmate_stats.packed_rate;
+	time_t now = time(NULL);
+
+	if (strncmp(key, "tmate_", 6) != 0)
+		return NULL;
+	key += 6;
+
+	if (!strcmp(key, "encoder_length")) {
+		xsnprintf(s, sizeof(s), "%zu", encoder->buffer ?
+			  evbuffer_get_length(encoder->buffer) : 0);
+	} else if (!strcmp(key, "encoder_max_length"))
+		xsnprintf(s, sizeof(s), "%zu", tmate_stats.encoder_max);
+	else if (!strcmp(key, "encoder_packed")) {
+		xsnprintf(s, sizeof(s), "%llu",
+			  (unsigned long long)tmate_stats.packed);
+	} else if (!strcmp(key, "encoder_rate")) {
+		/* Nothing packed for a while, the last rate is stale. */
+		if (now > tmate_stats.packed_sec + 1)
+			rate = 0;
+		xsnprintf(s, sizeof(s), "%llu", (unsigned long long)rate);
+	} else if (!strcmp(key, "encoder_flushes")) {
+		xsnprintf(s, sizeof(s), "%llu",
+			  (unsigned long long)tmate_stats.flushes);
+	} else if (!strcmp(key, "channel_written")) {
+		xsnprintf(s, sizeof(s), "%llu",
+			  (unsigned long long)tmate_stats.written);
+	} else if (!strcmp(key, "channel_partial_writes")) {
+		xsnprintf(s, sizeof(s), "%llu",
+			  (unsigned long long)tmate_stats.partial_writes);
+	} else if (!strcmp(key, "channel_window"))
+		xsnprintf(s, sizeof(s), "%u", tmate_stats.window);
+	else if (!strcmp(key, "latency") && tmate_stats.latency >= 0)
+		xsnprintf(s, sizeof(s), "%d", tmate_stats.latency);
+	else if (!strcmp(key, "latency_max") && tmate_stats.latency >= 0)
+		xsnprintf(s, sizeof(s), "%d", tmate_stats.latency_max);
+	else
+		return NULL;
+	return s;
+}
+
+uint64_t tmate_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A probe came back from the server. */
+void tmate_stats_latency(uint64_t ns, int viewers_ms)
+{
+	uint64_t now = tmate_stats_now();
+	int ms;
+
+	if (ns > now)
+		return;
+
+	tmate_stats.server_latency = (now - ns) / 1000000;
+	tmate_stats.viewers_latency = viewers_ms;
+
+	ms = tmate_stats.server_latency;
+	if (viewers_ms > 0)
+		ms += viewers_ms;
+	tmate_stats.latency = ms;
+	if (ms > tmate_stats.latency_max)
+		tmate_stats.latency_max = ms;
+}
+
+/*
+ * The resident set size, from /proc where there is one. Elsewhere, the peak is
+ * as close as it gets.
+ */
+size_t tmate_stats_rss(void)
+{
+	struct rusage ru;
+	unsigned long size, resident;
+	FILE *f;
+	int n;
+
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		n = fscanf(f, "%lu %lu", &size, &resident);
+		fclose(f);
+		if (n == 2)
+			return (size_t)resident * sysconf(_SC_PAGESIZE);
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss;
+#else
+	return (size_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+static void on_stats_timer(__unused evutil_socket_t fd,
+			   __unused short what, __unused void *arg)
+{
+	struct timeval now, tv;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &tmate_stats.send_due, &tv);
+	if (tv.tv_sec < 0)
+		tmate_stats.loop_lag_us = 0;
+	else
+		tmate_stats.loop_lag_us = (uint64_t)tv.tv_sec * 1000000 +
+					  tv.tv_usec;
+
+	/* Nothing is sent while disconnected, it would only pile up. */
+	if (tmate_session.encoder.ready_callback)
+		tmate_write_stats();
+	tmate_stats_timer_start();
+}
+
+static void on_probe_timer(__unused evutil_socket_t fd,
+			   __unused short what, __unused void *arg)
+{
+	struct timeval tv;
+
+	if (tmate_session.encoder.ready_callback)
+		tmate_write_latency_probe(tmate_stats_now());
+
+	tv.tv_sec = options_get_number(global_options, "tmate-latency-interval");
+	tv.tv_usec = 0;
+	evtimer_add(tmate_stats.ev_probe, &tv);
+}
+
+static void probe_timer_start(void)
+{
+	struct timeval tv;
+	int interval;
+
+	if (tmate_stats.ev_probe)
+		evtimer_del(tmate_stats.ev_probe);
+
+	interval = options_get_number(global_options, "tmate-latency-interval");
+	if (!interval)
+		return;
+
+	if (!tmate_stats.ev_probe) {
+		tmate_stats.ev_probe = evtimer_new(tmate_session.ev_base,
+						   on_probe_timer, NULL);
+		if (!tmate_stats.ev_probe)
+			tmate_fatal("Can't allocate event");
+	}
+
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	evtimer_add(tmate_stats.ev_probe, &tv);
+}
+
+void tmate_stats_timer_start(void)
+{
+	struct timeval tv;
+	int interval;
+
+	probe_timer_start();
+
+	if (tmate_stats.ev_send)
+		evtimer_del(tmate_stats.ev_send);
+
+	interval = options_get_number(global_options, "tmate-stats-interval");
+	if (!interval)
+		return;
+
+	if (!tmate_stats.ev_send) {
+		tmate_stats.ev_send = evtimer_new(tmate_session.ev_base,
+						  on_stats_timer, NULL);
+		if (!tmate_stats.ev_send)
+			tmate_fatal("Can't allocate event");
+	}
+
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	evtimer_add(tmate_stats.ev_send, &tv);
+
+	gettimeofday(&tmate_stats.send_due, NULL);
+	timeradd(&tmate_stats.send_due, &tv, &tmate_stats.send_due);
+}
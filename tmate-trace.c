@@ -0,0 +1,234 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tmate.h"
+
+/*
+ * Recorder of the tmate protocol stream, into the file named by
+ * tmate-trace-file. What is read from the server before decoding and what is
+ * packed before compression are appended as records, with their direction
+ * and a monotonic time in nanoseconds.
+ *
+ * The file is mapped, so what was recorded survives a crash. It is a header
+ * followed by a ring of tmate-trace-size bytes: head and tail are absolute
+ * positions, records never wrap (a padding record fills the end instead),
+ * and the oldest records are dropped to make room. Records which start a
+ * message are flagged, so that reading can begin at the first one of them
+ * once the start of the stream is gone. bench-trace reads it back.
+ */
+
+#define TRACE_MAGIC "TMTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_ALIGN(n) (((n) + 15) & ~(size_t)15)
+#define TRACE_MIN_SIZE (64 * 1024)
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	char pad[24];
+};
+
+struct trace_record {
+	uint32_t len;
+	uint16_t dir;
+	uint16_t flags;
+	uint64_t ns;
+};
+
+#define TRACE_PAD 0xffff
+#define TRACE_START 0x1
+
+static struct trace_header *trace;
+static char *trace_data;
+static size_t trace_map_size;
+static bool trace_paused;
+
+static struct trace_record *record_at(struct trace_header *hdr, char *data,
+				      uint64_t pos)
+{
+	return (struct trace_record *)(data + pos % hdr->size);
+}
+
+static void make_room(size_t need)
+{
+	struct trace_record *rec;
+
+	while (trace->head + need - trace->tail > trace->size) {
+		rec = record_at(trace, trace_data, trace->tail);
+		trace->tail += TRACE_ALIGN(sizeof(*rec) + rec->len);
+	}
+}
+
+static void trace_add(int dir, int flags, uint64_t ns, const char *buf,
+		      size_t len)
+{
+	struct trace_record *rec;
+	size_t need = TRACE_ALIGN(sizeof(*rec) + len);
+	size_t end = trace->size - trace->head % trace->size;
+
+	if (end < need) {
+		make_room(end);
+		rec = record_at(trace, trace_data, trace->head);
+		rec->len = end - sizeof(*rec);
+		rec->dir = TRACE_PAD;
+		rec->flags = 0;
+		rec->ns = ns;
+		trace->head += end;
+	}
+
+	make_room(need);
+	rec = record_at(trace, trace_data, trace->head);
+	rec->len = len;
+	rec->dir = dir;
+	rec->flags = flags;
+	rec->ns = ns;
+	memcpy(rec + 1, buf, len);
+	trace->head += need;
+}
+
+void tmate_trace_record(int dir, bool start, const char *buf, size_t len)
+{
+	struct timespec ts;
+	uint64_t ns;
+	size_t max, n;
+	int flags = start ? TRACE_START : 0;
+
+	if (!trace || trace_paused || !len)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	/* Big writes are split, keeping a few records in the ring. */
+	max = trace->size / 4 - sizeof(struct trace_record);
+	while (len) {
+		n = len < max ? len : max;
+		trace_add(dir, flags, ns, buf, n);
+		flags = 0;
+		buf += n;
+		len -= n;
+	}
+}
+
+void tmate_trace_pause(bool paused)
+{
+	trace_paused = paused;
+}
+
+void tmate_trace_start(void)
+{
+	const char *path;
+	size_t size;
+	int fd;
+
+	path = options_get_string(global_options, "tmate-trace-file");
+	if (!strlen(path) || trace)
+		return;
+
+	size = options_get_number(global_options, "tmate-trace-size");
+	size &= ~(size_t)15;
+	if (size < TRACE_MIN_SIZE)
+		size = TRACE_MIN_SIZE;
+	trace_map_size = sizeof(*trace) + size;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, trace_map_size) < 0) {
+		tmate_info("Cannot create trace %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	trace = mmap(NULL, trace_map_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		tmate_info("Cannot map trace %s: %s", path, strerror(errno));
+		trace = NULL;
+		return;
+	}
+
+	memcpy(trace->magic, TRACE_MAGIC, sizeof(trace->magic));
+	trace->version = TRACE_VERSION;
+	trace->header_size = sizeof(*trace);
+	trace->size = size;
+	trace->head = trace->tail = 0;
+	trace_data = (char *)(trace + 1);
+
+	tmate_info("Recording the tmate protocol to %s", path);
+}
+
+/* Call cb for each record of a trace file, oldest first. */
+int tmate_trace_read(const char *path, tmate_trace_cb *cb, void *arg,
+		     char **cause)
+{
+	struct trace_header *hdr;
+	struct trace_record *rec;
+	struct stat sb;
+	uint64_t pos;
+	bool started[2] = { false, false };
+	char *data;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if ((size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		xasprintf(cause, "%s: not a trace", path);
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = map;
+	data = (char *)map + sizeof(*hdr);
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->header_size != sizeof(*hdr) ||
+	    hdr->size == 0 || hdr->size % 16 ||
+	    hdr->size > (uint64_t)sb.st_size - sizeof(*hdr) ||
+	    hdr->tail > hdr->head || hdr->head - hdr->tail > hdr->size) {
+		munmap(map, sb.st_size);
+		xasprintf(cause, "%s: not a trace", path);
+		return -1;
+	}
+
+	for (pos = hdr->tail; pos < hdr->head;
+	     pos += TRACE_ALIGN(sizeof(*rec) + rec->len)) {
+		rec = record_at(hdr, data, pos);
+		if (pos % hdr->size + sizeof(*rec) + rec->len > hdr->size)
+			break;
+		if (rec->dir > TMATE_TRACE_OUT)
+			continue;
+		if (rec->flags & TRACE_START)
+			started[rec->dir] = true;
+		if (started[rec->dir])
+			cb(arg, rec->dir, rec->ns, (const char *)(rec + 1),
+			   rec->len);
+	}
+
+	munmap(map, sb.st_size);
+	return 0;
+}
@@ -2,21 +2,37 @@
 #define TMATE_H
 
 #include <sys/types.h>
+#include <netinet/in.h>
 #include <msgpack.h>
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
 #include <event.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "tmux.h"
 
-#define tmate_debug(...) log_emit(LOG_DEBUG, __VA_ARGS__)
-#define tmate_info(...)  log_emit(LOG_INFO,  __VA_ARGS__)
+#define tmate_debug(...) log_emit_level(LOG_DEBUG, __VA_ARGS__)
+#define tmate_info(...)  log_emit_level(LOG_INFO,  __VA_ARGS__)
+#define tmate_debug_proto(...) \
+	log_emit_category(LOG_PROTO, LOG_DEBUG, __VA_ARGS__)
+#define tmate_debug_ssh(...) \
+	log_emit_category(LOG_SSH, LOG_DEBUG, __VA_ARGS__)
 #define tmate_fatal(...) fatalx( __VA_ARGS__)
 
 /* tmate-msgpack.c */
 
 typedef void tmate_encoder_write_cb(void *userdata, struct evbuffer *buffer);
 
+/* A message waiting to be written to the channel, see tmate-stats.c */
+struct tmate_encoder_mark {
+	int type;
+	struct timeval queued;
+	/* Value of written once the message is out, 0 until flushed */
+	uint64_t end;
+};
+
 struct tmate_encoder {
 	msgpack_packer pk;
 	tmate_encoder_write_cb *ready_callback;
@@ -24,6 +40,37 @@ struct tmate_encoder {
 	struct evbuffer *buffer;
 	struct event *ev_buffer;
 	bool ev_active;
+#ifdef HAVE_ZLIB
+	/* Set when the stream is compressed, see TMATE_OUT_HEADER */
+	z_stream *zstream;
+	bool zdirty;
+#endif
+
+	/* Bytes drained from the buffer so far */
+	uint64_t written;
+	struct tmate_encoder_mark *marks;
+	unsigned int nmarks;
+	unsigned int first_mark;
+
+	/*
+	 * The messages the server has not acknowledged yet, uncompressed, so
+	 * that a reconnection can resume the stream, see tmate_resume_stream().
+	 * Messages are numbered from 0 after TMATE_OUT_HEADER; replay_seq is
+	 * the number of the first one in the log. replay_starts holds where
+	 * each one begins, counted in bytes since the log was created.
+	 */
+	struct evbuffer *replay;
+	uint64_t replay_seq;
+	uint64_t *replay_starts;
+	unsigned int replay_count;
+	unsigned int replay_first;
+	uint64_t replay_dropped;
+	/* Set while writing what must not go in the log */
+	bool replay_off;
+	/* The server sent TMATE_IN_ACK, so it can resume */
+	bool replay_acked;
+	/* Unacknowledged messages were dropped, resuming is not possible */
+	bool replay_overflow;
 };
 
 extern void tmate_encoder_init(struct tmate_encoder *encoder,
@@ -33,6 +80,18 @@ extern void tmate_encoder_destroy(struct tmate_encoder *encoder);
 extern void tmate_encoder_set_ready_callback(struct tmate_encoder *encoder,
 					     tmate_encoder_write_cb *callback,
 					     void *userdata);
+#ifdef HAVE_ZLIB
+extern void tmate_encoder_enable_compression(struct tmate_encoder *encoder);
+#endif
+extern void tmate_encoder_write_first(struct tmate_encoder *encoder,
+				      void (*write_fn)(void));
+extern void tmate_encoder_mark(struct tmate_encoder *encoder, int type);
+extern void tmate_encoder_drained(struct tmate_encoder *encoder, size_t len);
+extern void tmate_encoder_ack(struct tmate_encoder *encoder, uint64_t seq);
+extern void tmate_encoder_pty_frame(struct tmate_encoder *encoder, int pane_id,
+				    const char *buf, size_t len);
+extern void tmate_encoder_restart(struct tmate_encoder *encoder);
+extern void tmate_encoder_replay(struct tmate_encoder *encoder);
 
 extern void msgpack_pack_string(msgpack_packer *pk, const char *str);
 extern void msgpack_pack_boolean(msgpack_packer *pk, bool value);
@@ -47,6 +106,11 @@ struct tmate_decoder {
 	struct msgpack_unpacker unpacker;
 	tmate_decoder_reader *reader;
 	void *userdata;
+	/* When the messages being dispatched were read */
+	struct timeval decoded;
+	/* Bytes reserved for the next read, see tmate_decoder_commit() */
+	size_t reserve;
+	unsigned int small_reads;
 };
 
 extern void tmate_decoder_init(struct tmate_decoder *decoder, tmate_decoder_reader *reader, void *userdata);
@@ -65,6 +129,7 @@ extern int64_t unpack_int(struct tmate_unpacker *uk);
 extern bool unpack_bool(struct tmate_unpacker *uk);
 extern void unpack_buffer(struct tmate_unpacker *uk, const char **buf, size_t *len);
 extern char *unpack_string(struct tmate_unpacker *uk);
+extern const char *unpack_cstring(struct tmate_unpacker *uk);
 extern void unpack_array(struct tmate_unpacker *uk, struct tmate_unpacker *nested);
 
 #define unpack_each(nested_uk, tmp_uk, uk)						\
@@ -74,31 +139,62 @@ extern void unpack_array(struct tmate_unpacker *uk, struct tmate_unpacker *neste
 
 /* tmate-encoder.c */
 
-#define TMATE_PROTOCOL_VERSION 6
+#define TMATE_PROTOCOL_VERSION 11
+
+/*
+ * What each version of the protocol added. Only what tmate-protocol-version
+ * allows is sent, by default what version 6 servers know.
+ */
+#define TMATE_PROTOCOL_BASELINE 6
+#define TMATE_PROTOCOL_LAYOUT_DIFF 7
+#define TMATE_PROTOCOL_SNAPSHOT_RUNS 8
+#define TMATE_PROTOCOL_SNAPSHOT_PANES 9
+#define TMATE_PROTOCOL_COMPRESSION 10
+#define TMATE_PROTOCOL_SNAPSHOT_STYLES 11
 
 struct tmate_session;
 
+extern int tmate_protocol_version(void);
+
 extern void tmate_write_header(void);
 extern void tmate_write_uname(void);
 extern void tmate_write_ready(void);
 extern void tmate_sync_layout(void);
+extern void tmate_sync_full_layout(void);
+extern void tmate_send_subscriber_state(void);
+
+#define TMATE_MAX_PTY_SIZE (16*1024)
 extern void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len);
+extern void tmate_pty_release(struct window_pane *wp);
+extern void tmate_flush_pty_data(void);
+extern void tmate_free_pty_data(struct window_pane *wp);
+extern void tmate_echo_keys(struct window_pane *wp);
+extern int tmate_should_backoff(struct window_pane *wp, size_t *pending);
+extern void tmate_set_pane_focus(struct tmate_unpacker *uk);
+extern void tmate_write_latency_probe(uint64_t ns);
+extern void tmate_write_authorized_keys(FILE *f, bool full);
 extern int tmate_should_replicate_cmd(const struct cmd_entry *cmd);
 extern void tmate_set_val(const char *name, const char *value);
 extern void tmate_exec_cmd_args(int argc, const char **argv);
 extern void tmate_exec_cmd(struct cmd *cmd);
+extern void tmate_exec_cmds_begin(void);
+extern void tmate_exec_cmds_end(void);
 extern void tmate_failed_cmd(int client_id, const char *cause);
 extern void tmate_status(const char *left, const char *right);
 extern void tmate_sync_copy_mode(struct window_pane *wp);
+extern void tmate_flush_copy_mode(void);
 extern void tmate_write_copy_mode(struct window_pane *wp, const char *str);
 extern void tmate_write_fin(void);
 extern void tmate_send_reconnection_state(struct tmate_session *session);
+extern void tmate_write_stats(void);
+extern bool tmate_resume_stream(struct tmate_session *session);
 
 /* tmate-decoder.c */
 
 struct tmate_session;
 extern void tmate_dispatch_slave_message(struct tmate_session *session,
 					 struct tmate_unpacker *uk);
+extern void tmate_cancel_resize(struct tmate_session *session);
 
 /* tmate-ssh-client.c */
 
@@ -108,7 +204,9 @@ enum tmate_ssh_client_state_types {
 	SSH_CONNECT,
 	SSH_AUTH_SERVER,
 	SSH_AUTH_CLIENT_NONE,
+	SSH_AUTH_CLIENT_AGENT,
 	SSH_AUTH_CLIENT_PUBKEY,
+	SSH_STANDBY,
 	SSH_NEW_CHANNEL,
 	SSH_OPEN_CHANNEL,
 	SSH_BOOTSTRAP,
@@ -132,25 +230,49 @@ struct tmate_ssh_client {
 
 	int state;
 
-	/*
-	 * ssh_callbacks is allocated because the libssh API sucks (userdata
-	 * has to be in the struct itself).
-	 */
-	struct ssh_callbacks_struct ssh_callbacks;
 	char *tried_passphrase;
+	/* Private keys, loaded off the event loop */
+	struct tmate_ssh_keys *keys;
+	int next_key;
+	/* Set when the channel is served by its own thread */
+	struct tmate_ssh_io *io;
 	ssh_session session;
 	ssh_channel channel;
 
 	struct event *ev_ssh;
+
+	/* The TCP connection is up, we are now exchanging keys */
+	bool tcp_connected;
+	struct timeval connect_start;
+
+	/* Kept authenticated in session->standby, not in session->clients */
+	bool standby;
+
+	/* Latency probes sent with nothing read since, see heartbeat_start() */
+	struct event *ev_heartbeat;
+	bool heartbeat_read;
+	int heartbeat_misses;
 };
 TAILQ_HEAD(tmate_ssh_clients, tmate_ssh_client);
 
+#define TMATE_STANDBY_DELAY 5 /* seconds after connecting */
+#define TMATE_STANDBY_RETRY 30 /* seconds after the standby failed */
+
 extern void connect_ssh_client(struct tmate_ssh_client *client);
 extern struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *session,
 						       const char *server_ip);
+extern struct tmate_ssh_client *tmate_ssh_standby_alloc(struct tmate_session *session,
+							const char *server_ip);
+extern bool tmate_ssh_promote_standby(struct tmate_session *session);
+extern void tmate_ssh_heartbeat_start(struct tmate_session *session);
 
 /* tmate-session.c */
 
+struct tmate_server_addr {
+	char ip[INET6_ADDRSTRLEN];
+	int latency_ms; /* TCP connect time last time, -1 if unknown */
+};
+
 struct tmate_session {
 	struct event_base *ev_base;
 	struct evdns_base *ev_dnsbase;
@@ -159,30 +281,76 @@ struct tmate_session {
 	struct tmate_encoder encoder;
 	struct tmate_decoder decoder;
 
+	/* From tmate-protocol-version when the header was written */
+	int protocol_version;
+
 	/* True when the slave has sent all the environment variables */
 	int tmate_env_ready;
 
 	int min_sx;
 	int min_sy;
 
+	/* Last TMATE_IN_RESIZE, waiting for the viewers to settle */
+	bool resize_pending;
+	int pending_sx;
+	int pending_sy;
+	struct timeval resize_start;
+	struct event *ev_resize;
+
+	/* PTY data waiting in the panes tmate_pty_buf */
+	bool pty_pending;
+	struct event *ev_pty_flush;
+
+	/* Panes given keys since their last TMATE_OUT_ECHO_HINT */
+	struct event *ev_echo_hint;
+
+	/* Panes with tmate_copy_mode_pending set, and when they were last sent */
+	bool copy_mode_pending;
+	struct timeval copy_mode_synced;
+	struct event *ev_copy_mode_sync;
+
 	/*
 	 * This list contains one connection per IP. The first connected
 	 * client wins, and saved in *client. When we have a winner, the
 	 * losers are disconnected and killed.
 	 */
 	struct tmate_ssh_clients clients;
+	/* Starts the next client that has not been connected yet */
+	struct event *ev_connect_next;
+	/* With tmate-standby, a connection to fail over to */
+	struct tmate_ssh_client *standby;
+	struct event *ev_standby;
+
+	/*
+	 * What tmate-server-host resolves to, in the order to try, also
+	 * kept in ~/.tmate/servers.
+	 */
+	struct tmate_server_addr *servers;
+	unsigned int num_servers;
+	time_t servers_resolved;
+	bool servers_from_cache;
+
 	int need_passphrase;
 	char *passphrase;
 
 	bool reconnected;
+	/* The server of this connection has answered a latency probe */
+	bool probe_answered;
 	struct event *ev_connection_retry;
+	/* Last retry delays in ms, 0 to start over */
+	int retry_delay;
+	int dns_retry_delay;
+	/* tmate_reconnection_retry_after, in seconds */
+	int retry_after;
+	time_t connected_since;
 	char *last_server_ip;
 	char *reconnection_data;
 	/*
 	 * When we reconnect, instead of serializing the key bindings and
 	 * options, we replay all the tmux commands we replicated.
 	 * It may be a little innacurate to replicate the state, but
-	 * it's much easier.
+	 * it's much easier. Commands setting the same option or key
+	 * binding share a key, and only the last of them is kept.
 	 */
 	struct {
 		unsigned int capacity;
@@ -190,14 +358,135 @@ struct tmate_session {
 		struct {
 			int argc;
 			char **argv;
+			char *key;
 		} *cmds;
 	} saved_tmux_cmds;
+
+	/* The tmux session being shared, -1 until there is one */
+	int tmux_session_id;
 };
 
 extern struct tmate_session tmate_session;
+extern struct session *tmate_tmux_session(struct tmate_session *session);
 extern void tmate_session_init(struct event_base *base);
 extern void tmate_session_start(void);
+extern void tmate_send_authorized_keys(bool full);
+extern void tmate_schedule_standby(struct tmate_session *session, int delay);
 extern void tmate_reconnect_session(struct tmate_session *session, const char *message);
+extern void tmate_connect_next_client(struct tmate_session *session);
+extern void tmate_server_latency(struct tmate_session *session,
+				 const char *ip, int latency_ms);
+extern void tmate_save_servers(struct tmate_session *session,
+			       const char *winner_ip);
+
+/* tmate-stats.c */
+
+#define TMATE_STATS_TYPES 32
+#define TMATE_STATS_BUCKETS 24
+
+/* Latencies in microseconds, bucket i counts those below 2^i */
+struct tmate_stats_hist {
+	unsigned int count;
+	uint64_t total_us;
+	uint64_t max_us;
+	unsigned int buckets[TMATE_STATS_BUCKETS];
+};
+
+struct tmate_stats {
+	struct tmate_stats_hist in[TMATE_STATS_TYPES];
+	struct tmate_stats_hist out[TMATE_STATS_TYPES];
+	struct event *ev_send;
+
+	/* Encoder and channel counters, kept across reconnections */
+	size_t encoder_max;
+	uint64_t packed;
+	uint64_t packed_rate;
+	uint64_t packed_mark;
+	time_t packed_sec;
+	uint64_t flushes;
+	uint64_t written;
+	uint64_t partial_writes;
+	uint32_t window;
+
+	/* From the last TMATE_IN_LATENCY_PROBE in ms, -1 if none yet */
+	struct event *ev_probe;
+	int latency;
+	int latency_max;
+	int server_latency;
+	int viewers_latency;
+
+	/* For the host part of TMATE_OUT_STATS */
+	struct timeval send_due;
+	uint64_t loop_lag_us;
+	uint64_t pty_coalesced;
+	unsigned int reconnects;
+};
+
+extern struct tmate_stats tmate_stats;
+extern void tmate_stats_timer_start(void);
+extern void tmate_stats_record(struct tmate_stats_hist *hist, int type,
+			       const struct timeval *start);
+extern const char *tmate_stats_in_name(int type);
+extern const char *tmate_stats_out_name(int type);
+extern void tmate_stats_reset(void);
+extern void tmate_stats_flushed(struct tmate_encoder *encoder);
+extern const char *tmate_stats_find(const char *key);
+extern void tmate_stats_latency(uint64_t ns, int viewers_ms);
+extern uint64_t tmate_stats_now(void);
+extern size_t tmate_stats_rss(void);
+
+/* tmate-broadcast.c */
+
+extern void tmate_broadcast_start(void);
+extern void tmate_broadcast_write(const char *buf, size_t len);
+extern void tmate_broadcast_flush(void);
+
+/* tmate-trace.c */
+
+#define TMATE_TRACE_IN 0
+#define TMATE_TRACE_OUT 1
+
+typedef void tmate_trace_cb(void *arg, int dir, uint64_t ns,
+			    const char *buf, size_t len);
+
+extern void tmate_trace_start(void);
+extern void tmate_trace_record(int dir, bool start, const char *buf,
+			       size_t len);
+extern void tmate_trace_pause(bool paused);
+extern int tmate_trace_read(const char *path, tmate_trace_cb *cb, void *arg,
+			    char **cause);
+
+/* tmate-record.c */
+
+#define TMATE_RECORD_LAYOUT 0
+#define TMATE_RECORD_PTY 1
+
+typedef void tmate_record_cb(void *arg, uint64_t start, msgpack_object *event);
+
+extern void tmate_record_start(void);
+extern void tmate_record_pty(struct window_pane *wp, const char *buf,
+			     size_t len);
+extern void tmate_record_layout(void);
+extern void tmate_record_flush(void);
+extern int tmate_record_read(const char *path, uint64_t skip,
+			     tmate_record_cb *cb, void *arg, char **cause);
+
+/* tmate-ring.c */
+
+struct tmate_ring {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+};
+
+extern void tmate_ring_init(struct tmate_ring *ring, size_t size);
+extern void tmate_ring_free(struct tmate_ring *ring);
+extern size_t tmate_ring_reserve(struct tmate_ring *ring, char **buf);
+extern void tmate_ring_commit(struct tmate_ring *ring, size_t len);
+extern size_t tmate_ring_write(struct tmate_ring *ring, const char *data, size_t len);
+extern size_t tmate_ring_peek(struct tmate_ring *ring, char **buf);
+extern void tmate_ring_consume(struct tmate_ring *ring, size_t len);
 
 /* tmate-debug.c */
 extern void tmate_print_stack_trace(void);
@@ -213,6 +502,6 @@ extern void printflike(1, 2) tmate_status_message(const char *fmt, ...);
 
 extern int tmate_has_received_env(void);
 extern void tmate_set_env(const char *name, const char *value);
-extern void tmate_format(struct format_tree *ft);
+extern const char *tmate_format_find(const char *key);
 
 #endif
@@ -242,6 +242,8 @@ main(int argc, char **argv)
 	const char	*s;
 	int		 opt, flags, keys;
 
+	log_startup("main");
+
 	if (setlocale(LC_CTYPE, "en_US.UTF-8") == NULL &&
 	    setlocale(LC_CTYPE, "C.UTF-8") == NULL) {
 		if (setlocale(LC_CTYPE, "") == NULL)
@@ -21,13 +21,14 @@
 
 #define TMATE
 
-#define PROTOCOL_VERSION 8
+#define PROTOCOL_VERSION 9
 
 #include <sys/time.h>
 #include <sys/uio.h>
 
 #include <event.h>
 #include <limits.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <termios.h>
@@ -37,6 +38,10 @@
 #include <utempter.h>
 #endif
 
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#endif
+
 #include "compat.h"
 #include "xmalloc.h"
 
@@ -46,12 +51,27 @@ extern char   **environ;
 struct client;
 struct environ;
 struct input_ctx;
+struct job_environ;
 struct mouse_event;
 struct options;
 struct session;
 struct tmuxpeer;
 struct tmuxproc;
 
+/*
+ * Static probes in the tmate provider, for bpftrace or perf with
+ * --enable-usdt. Each is a nop until something attaches to it.
+ */
+#ifdef HAVE_USDT
+#define PROBE(name) DTRACE_PROBE(tmate, name)
+#define PROBE1(name, a) DTRACE_PROBE1(tmate, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(tmate, name, a, b)
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#endif
+
 /* Default global configuration file. */
 #ifndef TMUX_CONF
 #define TMUX_CONF "/etc/tmux.conf"
@@ -66,15 +86,51 @@ struct tmuxproc;
 /* Automatic name refresh interval, in microseconds. Must be < 1 second. */
 #define NAME_INTERVAL 500000
 
+/*
+ * How long the name and path of the foreground process of a pane are kept, in
+ * microseconds. Must be < 1 second.
+ */
+#define PANE_LOOKUP_INTERVAL 250000
+
+/* Minimum interval between title redraws of a window, in microseconds. */
+#define WINDOW_STATUS_INTERVAL 100000
+
 /*
  * READ_SIZE is the maximum size of data to hold from a pty (the event high
  * watermark). READ_BACKOFF is the amount of data waiting to be output to a tty
  * before pty reads will be backed off. READ_TIME is how long to back off
  * before the next read (in microseconds) if a tty is above READ_BACKOFF.
+ *
+ * These are the values for interactive panes. A pane filling its read size
+ * READ_FULL times in a row has it (and its backoff) doubled, up to
+ * READ_SIZE_MAX; a short read halves them again.
  */
 #define READ_SIZE 1024
 #define READ_BACKOFF 512
 #define READ_TIME 100
+#define READ_SIZE_MAX 65536
+#define READ_FULL 4
+
+/*
+ * The pane-rate-limit and pane-cpu-limit budgets are for each THROTTLE_PERIOD
+ * (in microseconds). A pane over them is looked at again every THROTTLE_TIME.
+ */
+#define THROTTLE_PERIOD 100000
+#define THROTTLE_TIME 10000
+
+/*
+ * Priorities of server events. libevent runs only the most urgent active
+ * events before polling again, so keys and client messages come ahead of pane
+ * output, and pane output (and other things at the default) ahead of names,
+ * alerts and status timers. Redraws happen in the loop callback between.
+ * READ_BUDGET is how long pane output may be parsed in one loop (in
+ * microseconds) before the remaining panes are left to the next.
+ */
+#define EVENT_PRI_INPUT 0
+#define EVENT_PRI_OUTPUT 1
+#define EVENT_PRI_BACKGROUND 2
+#define EVENT_PRIORITIES 3
+#define READ_BUDGET 20000
 
 /* Attribute to make gcc check printf-like arguments. */
 #define printflike(a, b) __attribute__ ((format (printf, a, b)))
@@ -103,6 +159,7 @@ struct tmuxproc;
 /* Mask to obtain key w/o modifiers. */
 #define KEYC_MASK_MOD (KEYC_ESCAPE|KEYC_CTRL|KEYC_SHIFT)
 #define KEYC_MASK_KEY (~KEYC_MASK_MOD)
+#define KEYC_MOD_SHIFT 45
 
 /* Is this a mouse key? */
 #define KEYC_IS_MOUSE(key) (((key) & KEYC_MASK_KEY) >= KEYC_MOUSE &&	\
@@ -194,6 +251,9 @@ enum {
 	KEYC_KP_ENTER,
 	KEYC_KP_ZERO,
 	KEYC_KP_PERIOD,
+
+	/* End of special keys. */
+	KEYC_BASE_END
 };
 
 /* Termcap codes. */
@@ -206,6 +266,7 @@ enum tty_code_code {
 	TTYC_BOLD,	/* enter_bold_mode, md */
 	TTYC_CIVIS,	/* cursor_invisible, vi */
 	TTYC_CLEAR,	/* clear_screen, cl */
+	TTYC_CMG,	/* set left and right margins, Cmg */
 	TTYC_CNORM,	/* cursor_normal, ve */
 	TTYC_COLORS,	/* max_colors, Co */
 	TTYC_CR,	/* restore cursor colour, Cr */
@@ -226,11 +287,13 @@ enum tty_code_code {
 	TTYC_DIM,	/* enter_dim_mode, mh */
 	TTYC_DL,	/* parm_delete_line, DL */
 	TTYC_DL1,	/* delete_line, dl */
+	TTYC_DSMG,	/* disable left and right margins, Dsmg */
 	TTYC_E3,
 	TTYC_ECH,	/* erase_chars, ec */
 	TTYC_EL,	/* clr_eol, ce */
 	TTYC_EL1,	/* clr_bol, cb */
 	TTYC_ENACS,	/* ena_acs, eA */
+	TTYC_ENMG,	/* enable left and right margins, Enmg */
 	TTYC_FSL,	/* from_status_line, fsl */
 	TTYC_HOME,	/* cursor_home, ho */
 	TTYC_HPA,	/* column_address, ch */
@@ -238,6 +301,7 @@ enum tty_code_code {
 	TTYC_ICH1,	/* insert_character, ic */
 	TTYC_IL,	/* parm_insert_line, IL */
 	TTYC_IL1,	/* insert_line, il */
+	TTYC_INDN,	/* parm_index, SF */
 	TTYC_INVIS,	/* enter_secure_mode, mk */
 	TTYC_IS1,	/* init_1string, i1 */
 	TTYC_IS2,	/* init_2string, i2 */
@@ -395,6 +459,7 @@ enum tty_code_code {
 	TTYC_SMSO,	/* enter_standout_mode, so */
 	TTYC_SMUL,	/* enter_underline_mode, us */
 	TTYC_SS,	/* set cursor style, Ss */
+	TTYC_SYNC,	/* synchronized update, Sync */
 	TTYC_TC,	/* 24-bit "true" colour, Tc */
 	TTYC_TSL,	/* to_status_line, tsl */
 	TTYC_VPA,	/* row_address, cv */
@@ -444,20 +509,29 @@ struct msg_command_data {
 	int	argc;
 }; /* followed by packed argv */
 
+/*
+ * Standard input, output and error are sent with only size bytes of data
+ * after the size, as much as fits in one imsg. The three have the same
+ * layout.
+ */
+#define MSG_STDIO_MAX (MAX_IMSGSIZE - IMSG_HEADER_SIZE - sizeof (ssize_t))
+
 struct msg_stdin_data {
 	ssize_t	size;
-	char	data[BUFSIZ];
+	char	data[MSG_STDIO_MAX];
 };
 
 struct msg_stdout_data {
 	ssize_t	size;
-	char	data[BUFSIZ];
+	char	data[MSG_STDIO_MAX];
 };
 
 struct msg_stderr_data {
 	ssize_t	size;
-	char	data[BUFSIZ];
+	char	data[MSG_STDIO_MAX];
 };
+#define MSG_STDIO_LEN(size) \
+	(offsetof(struct msg_stdin_data, data) + ((size) > 0 ? (size) : 0))
 
 /* Mode key commands. */
 enum mode_key_cmd {
@@ -582,6 +656,7 @@ struct mode_key_binding {
 	int				 mode;
 	enum mode_key_cmd		 cmd;
 	const char			*arg;
+	int				 fixed;	/* allocated with the defaults */
 
 	RB_ENTRY(mode_key_binding)	 entry;
 };
@@ -618,6 +693,11 @@ struct mode_key_table {
 
 #define ALL_MOUSE_MODES (MODE_MOUSE_STANDARD|MODE_MOUSE_BUTTON)
 
+/* Pasted text written directly to a pane. */
+#define PASTE_BRACKETED 0x1
+#define PASTE_START 0x2
+#define PASTE_END 0x4
+
 /*
  * A single UTF-8 character. UTF8_SIZE must be big enough to hold at least one
  * combining character as well.
@@ -693,13 +773,42 @@ struct grid_cell_entry {
 	};
 } __packed;
 
+/* Style of a cell, as kept in the palette of a grid. */
+struct grid_style {
+	u_char			flags;
+	u_char			attr;
+	u_char			fg[3];
+	u_char			bg[3];
+} __packed;
+#define GRID_STYLE_NONE 0xffff
+
+/*
+ * Grid cell which does not fit in a grid_cell_entry: wide or multibyte, or
+ * with RGB colours. The style is an id in the palette of the grid; if it is
+ * GRID_STYLE_NONE, the style itself is in the next entry. Up to
+ * GRID_EXTD_DATA bytes of UTF-8 are kept here, a longer sequence continues in
+ * the entry after that.
+ */
+#define GRID_EXTD_DATA 4
+struct grid_extd_entry {
+	u_short			style;
+	u_char			width;
+	u_char			size;
+	u_char			data[GRID_EXTD_DATA];
+} __packed;
+
 /* Grid line. */
 struct grid_line {
 	u_int			 cellsize;
+	u_int			 cellalloc;
 	struct grid_cell_entry	*celldata;
 
 	u_int			 extdsize;
-	struct grid_cell	*extddata;
+	struct grid_extd_entry	*extddata;
+
+	/* Cell and extended data when compressed, or NULL. */
+	u_char			*zdata;
+	u_int			 zsize;
 
 	int			 flags;
 } __packed;
@@ -715,7 +824,54 @@ struct grid {
 	u_int			 hsize;
 	u_int			 hlimit;
 
+	/* Bytes allocated for this grid. */
+	size_t			 memory;
+
+	/* History lines kept uncompressed, 0 to never compress. */
+	u_int			 hwarm;
+
+	/* Compressed history written to spill rather than kept in memory. */
+	int			 hspill;
+	struct grid_spill	*spill;
+
+	/* Lines at the top of the history not yet reflowed to sx. */
+	u_int			 hpending;
+
+	/* Lines ever removed from the top of the history. */
+	uint64_t		 hremoved;
+
+	/* Lines ever scrolled into the history. */
+	uint64_t		 hscrolled;
+
+	/*
+	 * Lines are a window of linesize entries into linebase, starting at
+	 * lineoff; collecting history just moves the start forward.
+	 */
 	struct grid_line	*linedata;
+	struct grid_line	*linebase;
+	u_int			 lineoff;
+	u_int			 linesize;
+	u_int			 linealloc;
+
+	/* Last compressed line read, decompressed. */
+	struct grid_line	 zcache;
+	const u_char		*zcache_key;
+
+	/* Freed line cell buffers of spare_sx cells, kept for reuse. */
+	struct grid_cell_entry	**spare;
+	u_int			 spare_size;
+	u_int			 nspare;
+	u_int			 spare_sx;
+
+	/* Trigram index of the history, see grid-index.c. */
+	struct grid_index	*index;
+
+	/* Data kept by users of the grid for history lines. */
+	struct grid_cache	*cache;
+	u_int			 cache_generation; /* changed by grid_cache_drop */
+
+	/* Styles of extended cells, see grid-style.c. */
+	struct grid_styles	*styles;
 };
 
 /* Hook data structures. */
@@ -807,6 +963,7 @@ struct screen {
 	int		 mode;
 
 	bitstr_t	*tabs;
+	bitstr_t	*dirty;		/* lines to redraw if PANE_DIRTY */
 
 	struct screen_sel sel;
 };
@@ -815,6 +972,8 @@ struct screen {
 struct screen_write_ctx {
 	struct window_pane *wp;
 	struct screen	*s;
+
+	u_int		 scrolled;	/* scrolls not yet sent to the tty */
 };
 
 /* Screen size. */
@@ -853,6 +1012,10 @@ struct window_choose_data {
 
 	char			*ft_template;
 	struct format_tree	*ft;
+	int			 tree_defaults;	/* from tree_session and wl */
+
+	char			*name;	/* expanded when first drawn */
+	u_int			 name_generation;
 
 	char			*command;
 };
@@ -881,6 +1044,12 @@ struct window_pane {
 #define PANE_FOCUSPUSH 0x10
 #define PANE_INPUTOFF 0x20
 #define PANE_CHANGED 0x40
+#define PANE_DIRTY 0x80
+#define PANE_HELD 0x100
+#define PANE_SYNC 0x200
+#define PANE_READSTOP 0x400
+#define PANE_READFULL 0x800
+#define PANE_THROTTLED 0x1000
 
 	int		 argc;
 	char	       **argv;
@@ -893,7 +1062,24 @@ struct window_pane {
 
 	int		 fd;
 	struct bufferevent *event;
+	struct event	 read_event;
 	struct event	 timer;
+	struct event	 sync_timer;
+
+	size_t		 read_size;
+	size_t		 read_backoff;
+	u_int		 read_full;
+
+	struct timeval	 throttle_time;	/* start of this period */
+	uint64_t	 throttle_bytes;
+	uint64_t	 throttle_us;
+
+	pid_t		 name_pgrp;	/* foreground group name_cmd is for */
+	struct timeval	 name_time;
+	char		*name_cmd;
+	pid_t		 path_pgrp;	/* and path_cur */
+	struct timeval	 path_time;
+	char		*path_cur;
 
 	struct input_ctx *ictx;
 
@@ -902,9 +1088,29 @@ struct window_pane {
 	int		 pipe_fd;
 	struct bufferevent *pipe_event;
 	size_t		 pipe_off;
+	size_t		 pipe_dropped;
+
+	TAILQ_HEAD(, window_pane_paste) pastes;
 
 #ifdef TMATE
 	size_t		 tmate_off;
+	struct evbuffer	*tmate_pty_buf;
+	int		 tmate_copy_mode_pending;
+	u_int		 tmate_key_epoch;
+	u_int		 tmate_echo_armed;
+	u_int		 tmate_echo_epoch;
+	int		 tmate_focus;
+	int		 tmate_snapshot_pending;
+
+	int		 tmate_diff;
+	int		 tmate_diff_dirty;
+	u_int		 tmate_diff_bytes;
+	uint64_t	 tmate_diff_start;
+	uint64_t	 tmate_diff_sent;
+	int		 tmate_replicate;
+	uint64_t	 tmate_pty_bytes;
+	uint64_t	*tmate_line_hash;
+	u_int		 tmate_line_hash_size;
 #endif
 
 	struct screen	*screen;
@@ -914,6 +1120,7 @@ struct window_pane {
 	u_int		 saved_cx;
 	u_int		 saved_cy;
 	struct grid	*saved_grid;
+	struct grid	*spare_grid;	/* empty, for the next saved_grid */
 	struct grid_cell saved_cell;
 
 	const struct window_mode *mode;
@@ -925,6 +1132,33 @@ struct window_pane {
 TAILQ_HEAD(window_panes, window_pane);
 RB_HEAD(window_pane_tree, window_pane);
 
+/* Cell types for borders. */
+#define CELL_INSIDE 0
+#define CELL_LEFTRIGHT 1
+#define CELL_TOPBOTTOM 2
+#define CELL_TOPLEFT 3
+#define CELL_TOPRIGHT 4
+#define CELL_BOTTOMLEFT 5
+#define CELL_BOTTOMRIGHT 6
+#define CELL_TOPJOIN 7
+#define CELL_BOTTOMJOIN 8
+#define CELL_LEFTJOIN 9
+#define CELL_RIGHTJOIN 10
+#define CELL_JOIN 11
+#define CELL_OUTSIDE 12
+
+/*
+ * Window cell map entry. Panes are numbered from 1 in the order of the
+ * window's pane list, 0 is no pane.
+ */
+struct window_cell {
+	u_int		 pane;		/* pane for border drawing */
+	u_int		 hit;		/* pane at this position */
+	u_char		 border;
+	u_char		 type;
+	u_char		 active;	/* border of cellmap_active */
+};
+
 /* Window structure. */
 struct window {
 	u_int		 id;
@@ -932,8 +1166,18 @@ struct window {
 	char		*name;
 	struct event	 name_event;
 	struct timeval	 name_time;
+	struct timeval	 status_time;
+	char		*name_format;	/* what the name was last made from */
+	u_int		 name_pane;
+	pid_t		 name_pgrp;
+	int		 name_state;
 
 	struct event	 alerts_timer;
+	int		 alerts_queued;
+	TAILQ_ENTRY(window) alerts_entry;
+
+	int		 dirty_queued;
+	TAILQ_ENTRY(window) dirty_entry;
 
 	struct timeval	 activity_time;
 
@@ -949,14 +1193,41 @@ struct window {
 	struct layout_cell *saved_layout_root;
 	char		*old_layout;
 
+	/* layout_dump of the layout and of the visible one, while unchanged. */
+	char		*layout_dump[2];
+	u_int		 layout_dump_generation;
+
 	u_int		 sx;
 	u_int		 sy;
 
+	/* Smallest attached session, worked out by recalculate_sizes. */
+	u_int		 resize_generation;
+	u_int		 resize_sx;
+	u_int		 resize_sy;
+	int		 resize_aggressive;
+	int		 resize_visible;
+
+	/* Size to take when next looked at, if not current anywhere. */
+	int		 resize_pending;
+	u_int		 resize_pending_sx;
+	u_int		 resize_pending_sy;
+	int		 resize_pending_forced;
+
+	/* Cell map, built when needed and freed when the layout changes. */
+	struct window_cell *cellmap;
+	struct window_pane **cellpanes;
+	u_int		 cellmap_sx;
+	u_int		 cellmap_sy;
+	struct window_pane *cellmap_active;
+
 	int		 flags;
 #define WINDOW_BELL 0x1
 #define WINDOW_ACTIVITY 0x2
 #define WINDOW_REDRAW 0x4
 #define WINDOW_SILENCE 0x8
+#define WINDOW_LAYOUT 0x10
+#define WINDOW_STATUS 0x20
+#define WINDOW_RENAMED 0x40
 #define WINDOW_ZOOMED 0x1000
 #define WINDOW_FORCEWIDTH 0x2000
 #define WINDOW_FORCEHEIGHT 0x4000
@@ -965,10 +1236,12 @@ struct window {
 	struct options	*options;
 
 	u_int		 references;
+	TAILQ_HEAD(, winlink) winlinks;
 
 	RB_ENTRY(window) entry;
 };
 RB_HEAD(windows, window);
+TAILQ_HEAD(windows_dirty, window);
 
 /* Entry on local window list. */
 struct winlink {
@@ -978,6 +1251,7 @@ struct winlink {
 	size_t		 status_width;
 	struct grid_cell status_cell;
 	char		*status_text;
+	uint64_t	 status_key;
 
 	int		 flags;
 #define WINLINK_BELL 0x1
@@ -987,6 +1261,7 @@ struct winlink {
 
 	RB_ENTRY(winlink) entry;
 	TAILQ_ENTRY(winlink) sentry;
+	TAILQ_ENTRY(winlink) wentry;
 };
 RB_HEAD(winlinks, winlink);
 TAILQ_HEAD(winlink_stack, winlink);
@@ -1035,6 +1310,25 @@ struct session_group {
 };
 TAILQ_HEAD(session_groups, session_group);
 
+/* Status line segments, hashed to find what has changed. */
+enum status_segment {
+	STATUS_LEFT,
+	STATUS_WINDOWS,
+	STATUS_RIGHT
+};
+#define STATUS_SEGMENTS 3
+
+/* Status line drawn for one size, shared by the clients of a session. */
+struct status_cache {
+	u_int		 sx;
+	u_int		 sy;
+	u_int		 generation;
+
+	struct screen	 screen;
+	int		 wlmouse;
+	uint64_t	 hash[STATUS_SEGMENTS];
+};
+
 struct session {
 	u_int		 id;
 
@@ -1067,6 +1361,10 @@ struct session {
 	struct termios	*tio;
 
 	struct environ	*environ;
+	struct job_environ *job_environ;
+
+	struct status_cache *status_cache;
+	u_int		 nstatus_cache;
 
 	int		 references;
 
@@ -1130,6 +1428,7 @@ struct tty_key {
 struct tty_code;
 struct tty_term {
 	char		*name;
+	uint64_t	 overrides;	/* hash of terminal-overrides */
 	u_int		 references;
 
 	char		 acs[UCHAR_MAX + 1][2];
@@ -1138,9 +1437,17 @@ struct tty_term {
 
 #define TERM_256COLOURS 0x1
 #define TERM_EARLYWRAP 0x2
+#define TERM_SGR 0x4
 	int		 flags;
 
+	u_char		 sgr_attrs;	/* attributes set with plain SGR */
+
+	struct tty_key	*key_tree;
+	struct tty_key	*key_first[UCHAR_MAX + 1];
+	struct tty_key	*key_escape[UCHAR_MAX + 1];
+
 	LIST_ENTRY(tty_term) entry;
+	TAILQ_ENTRY(tty_term) unused_entry;
 };
 LIST_HEAD(tty_terms, tty_term);
 
@@ -1167,6 +1474,10 @@ struct tty {
 	int		 fd;
 	struct bufferevent *event;
 
+#define TTY_OBUF_SIZE 4096
+	u_char		 obuf[TTY_OBUF_SIZE];	/* staged for event */
+	size_t		 olen;
+
 	struct termios	 tio;
 
 	struct grid_cell cell;
@@ -1178,6 +1489,8 @@ struct tty {
 #define TTY_STARTED 0x10
 #define TTY_OPENED 0x20
 #define TTY_FOCUS 0x40
+#define TTY_PASTING 0x80
+#define TTY_SYNCING 0x100
 	int		 flags;
 
 	int		 term_flags;
@@ -1190,7 +1503,6 @@ struct tty {
 			    struct mouse_event *);
 
 	struct event	 key_timer;
-	struct tty_key	*key_tree;
 };
 
 /* TTY command context. */
@@ -1257,10 +1569,26 @@ struct client {
 	struct evbuffer	*stdout_data;
 	struct evbuffer	*stderr_data;
 
+	size_t		 control_pause;	/* stdout size to pause panes at */
+	u_int		*control_paused;
+	u_int		 control_npaused;
+
 	struct event	 repeat_timer;
 
-	struct event	 status_timer;
+	struct event	 frame_timer;
+	int		 frame_rate;
+
+	struct timeval	 status_due;	/* next status-interval redraw */
 	struct screen	 status;
+	uint64_t	 status_hash[STATUS_SEGMENTS];
+	u_int		 status_dirtyx;
+	u_int		 status_dirtynx; /* 0 to draw it all */
+
+	/* Border cells as last drawn, to draw only those which change. */
+	u_char		*border_cells;
+	u_int		 border_sx;
+	u_int		 border_sy;
+	uint64_t	 border_key;
 
 #define CLIENT_TERMINAL 0x1
 #define CLIENT_LOGIN 0x2
@@ -1269,7 +1597,7 @@ struct client {
 #define CLIENT_STATUS 0x10
 #define CLIENT_REPEAT 0x20
 #define CLIENT_SUSPENDED 0x40
-/* 0x80 unused */
+#define CLIENT_FRAME 0x80
 #define CLIENT_IDENTIFY 0x100
 #define CLIENT_DEAD 0x200
 #define CLIENT_BORDERS 0x400
@@ -1282,6 +1610,7 @@ struct client {
 #define CLIENT_256COLOURS 0x20000
 #define CLIENT_IDENTIFIED 0x40000
 #define CLIENT_STATUSFORCE 0x80000
+#define CLIENT_CONTROLBASE64 0x100000
 #ifdef TMATE
 /* TODO investigate if we can merge with CLIENT_STATUSFORCE */
 #define CLIENT_FORCE_STATUS 0x800000
@@ -1489,7 +1818,13 @@ struct key_table {
 	const char		 *name;
 	struct key_bindings	 key_bindings;
 
+	/* The same bindings, hashed by key for key_bindings_find. */
+	struct key_binding	**hash;
+	u_int			  hashsize;
+	u_int			  hashused;
+
 	u_int			 references;
+	int			 removed;	/* no longer in key_tables */
 
 	RB_ENTRY(key_table)	 entry;
 };
@@ -1573,6 +1908,7 @@ struct tmuxpeer *proc_add_peer(struct tmuxproc *, int,
 	    void (*)(struct imsg *, void *), void *);
 void	proc_remove_peer(struct tmuxpeer *);
 void	proc_kill_peer(struct tmuxpeer *);
+u_int	proc_queued(struct tmuxpeer *);
 
 /* cfg.c */
 extern int cfg_finished;
@@ -1587,17 +1923,40 @@ void printflike(1, 2) cfg_add_cause(const char *, ...);
 void		 cfg_print_causes(struct cmd_q *);
 void		 cfg_show_causes(struct session *);
 
+/* cfg-cache.c */
+struct cfg_cache;
+struct stat;
+int		 cfg_cache_wants_string(const char *);
+int		 cfg_cache_load(const char *, struct stat *, uint64_t,
+		     struct cmd_q *, u_int *);
+struct cfg_cache *cfg_cache_start(const char *);
+void		 cfg_cache_add_argv(struct cfg_cache *, u_int, int, char **);
+void		 cfg_cache_add_string(struct cfg_cache *, u_int, const char *);
+void		 cfg_cache_finish(struct cfg_cache *, const char *, struct stat *,
+		     uint64_t);
+void		 cfg_cache_free(struct cfg_cache *);
+
 /* paste.c */
 struct paste_buffer;
 const char	*paste_buffer_name(struct paste_buffer *);
+size_t		 paste_buffer_size(struct paste_buffer *);
 const char	*paste_buffer_data(struct paste_buffer *, size_t *);
+const char	*paste_buffer_piece(struct paste_buffer *, u_int, size_t *);
+int		 paste_buffer_write(struct paste_buffer *, int);
+void		 paste_buffer_add(struct paste_buffer *, u_int, const char *,
+		     size_t, struct evbuffer *);
 struct paste_buffer *paste_walk(struct paste_buffer *);
 struct paste_buffer *paste_get_top(const char **);
 struct paste_buffer *paste_get_name(const char *);
+size_t		 paste_memory(void);
 void		 paste_free(struct paste_buffer *);
+struct paste_buffer *paste_hold(struct paste_buffer *);
+void		 paste_release(struct paste_buffer *);
 void		 paste_add(char *, size_t);
 int		 paste_rename(const char *, const char *, char **);
 int		 paste_set(char *, size_t, const char *, char **);
+int		 paste_append(struct paste_buffer *, char *, size_t,
+		     const char *, char **);
 char		*paste_make_sample(struct paste_buffer *);
 
 /* format.c */
@@ -1606,10 +1965,12 @@ char		*paste_make_sample(struct paste_buffer *);
 struct format_tree;
 struct format_tree *format_create(struct cmd_q *, int);
 void		 format_free(struct format_tree *);
+void		 format_reset(struct format_tree *);
 void printflike(3, 4) format_add(struct format_tree *, const char *,
 		     const char *, ...);
 char		*format_expand_time(struct format_tree *, const char *, time_t);
 char		*format_expand(struct format_tree *, const char *);
+int		 format_uses_client(const char *);
 void		 format_defaults(struct format_tree *, struct client *,
 		     struct session *, struct winlink *, struct window_pane *);
 void		 format_defaults_window(struct format_tree *, struct window *);
@@ -1650,6 +2011,8 @@ enum mode_key_cmd mode_key_fromstring(const struct mode_key_cmdstr *,
 	    const char *);
 const struct mode_key_table *mode_key_findtable(const char *);
 void	mode_key_init_trees(void);
+void	mode_key_free(struct mode_key_binding *);
+void	mode_key_changed(void);
 void	mode_key_init(struct mode_key_data *, struct mode_key_tree *);
 enum mode_key_cmd mode_key_lookup(struct mode_key_data *, key_code,
 	    const char **);
@@ -1698,6 +2061,7 @@ struct job *job_run(const char *, struct session *, const char *,
 	    void (*)(struct job *), void (*)(void *), void *);
 void	job_free(struct job *);
 void	job_died(struct job *, int);
+void	job_free_environ(struct job_environ *);
 
 /* environ.c */
 struct environ *environ_create(void);
@@ -1712,6 +2076,9 @@ void	environ_clear(struct environ *, const char *);
 void	environ_put(struct environ *, const char *);
 void	environ_unset(struct environ *, const char *);
 void	environ_update(const char *, struct environ *, struct environ *);
+u_int	environ_generation(struct environ *);
+char  **environ_envp(struct environ *);
+void	environ_free_envp(char **);
 void	environ_push(struct environ *);
 
 /* tty.c */
@@ -1734,6 +2101,9 @@ void	tty_putcode_ptr2(struct tty *, enum tty_code_code, const void *,
 void	tty_puts(struct tty *, const char *);
 void	tty_putc(struct tty *, u_char);
 void	tty_putn(struct tty *, const void *, size_t, u_int);
+void	tty_flush(struct tty *);
+void	tty_sync_start(struct tty *);
+void	tty_sync_end(struct tty *);
 int	tty_init(struct tty *, struct client *, int, char *);
 int	tty_resize(struct tty *);
 int	tty_set_size(struct tty *, u_int, u_int);
@@ -1746,6 +2116,8 @@ void	tty_draw_pane(struct tty *, const struct window_pane *, u_int, u_int,
 	    u_int);
 void	tty_draw_line(struct tty *, const struct window_pane *, struct screen *,
 	    u_int, u_int, u_int);
+void	tty_draw_cells(struct tty *, struct screen *, u_int, u_int, u_int,
+	    u_int, u_int);
 int	tty_open(struct tty *, char **);
 void	tty_close(struct tty *);
 void	tty_free(struct tty *);
@@ -1754,6 +2126,7 @@ void	tty_write(void (*)(struct tty *, const struct tty_ctx *),
 int	tty_client_ready(struct client *, struct window_pane *wp);
 void	tty_cmd_alignmenttest(struct tty *, const struct tty_ctx *);
 void	tty_cmd_cell(struct tty *, const struct tty_ctx *);
+void	tty_cmd_cells(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearendofline(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearendofscreen(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearline(struct tty *, const struct tty_ctx *);
@@ -1767,13 +2140,23 @@ void	tty_cmd_erasecharacter(struct tty *, const struct tty_ctx *);
 void	tty_cmd_insertcharacter(struct tty *, const struct tty_ctx *);
 void	tty_cmd_insertline(struct tty *, const struct tty_ctx *);
 void	tty_cmd_linefeed(struct tty *, const struct tty_ctx *);
+void	tty_cmd_scrollup(struct tty *, const struct tty_ctx *);
+void	tty_cmd_drawline(struct tty *, const struct tty_ctx *);
 void	tty_cmd_utf8character(struct tty *, const struct tty_ctx *);
 void	tty_cmd_reverseindex(struct tty *, const struct tty_ctx *);
 void	tty_cmd_setselection(struct tty *, const struct tty_ctx *);
 void	tty_cmd_rawstring(struct tty *, const struct tty_ctx *);
 
 /* tty-term.c */
+struct tty_term_sgr {
+	u_char			 attr;
+	enum tty_code_code	 code;
+	const char		*on;
+	const char		*off;
+};
 extern struct tty_terms tty_terms;
+extern const struct tty_term_sgr tty_term_sgr[];
+u_int		 tty_term_nsgr(void);
 u_int		 tty_term_ncodes(void);
 struct tty_term *tty_term_find(char *, int, char **);
 void		 tty_term_free(struct tty_term *);
@@ -1795,7 +2178,7 @@ const char	*tty_acs_get(struct tty *, u_char);
 
 /* tty-keys.c */
 void		tty_keys_build(struct tty *);
-void		tty_keys_free(struct tty *);
+void		tty_keys_free(struct tty_term *);
 key_code	tty_keys_next(struct tty *);
 
 /* arguments.c */
@@ -1854,6 +2237,11 @@ extern const struct cmd_entry *cmd_table[];
 enum cmd_retval	 cmd_attach_session(struct cmd_q *, int, int, const char *,
     int);
 
+/* cmd-bench-tty.c */
+int		 bench_tty_open(struct tty *, const char *, u_int, u_int,
+		     char **);
+void		 bench_tty_close(struct tty *);
+
 /* cmd-list.c */
 struct cmd_list	*cmd_list_parse(int, char **, const char *, u_int, char **);
 void		 cmd_list_free(struct cmd_list *);
@@ -1873,6 +2261,8 @@ int		 cmdq_continue(struct cmd_q *);
 void		 cmdq_flush(struct cmd_q *);
 
 /* cmd-string.c */
+int	cmd_string_split(const char *, int *, char ***, char **);
+int	cmd_string_parse_flags(const char *, struct cmd_list **, int, char **);
 int	cmd_string_parse(const char *, struct cmd_list **, const char *,
 	    u_int, char **);
 
@@ -1896,6 +2286,7 @@ int	 key_table_cmp(struct key_table *, struct key_table *);
 int	 key_bindings_cmp(struct key_binding *, struct key_binding *);
 struct key_table *key_bindings_get_table(const char *, int);
 void	 key_bindings_unref_table(struct key_table *);
+struct key_binding *key_bindings_find(struct key_table *, key_code);
 void	 key_bindings_add(const char *, key_code, int, struct cmd_list *);
 void	 key_bindings_remove(const char *, key_code);
 void	 key_bindings_remove_table(const char *);
@@ -1928,17 +2319,24 @@ void	 server_update_socket(void);
 void	 server_add_accept(int);
 
 /* server-client.c */
+extern int server_headless;
 void	 server_client_set_key_table(struct client *, const char *);
 const char *server_client_get_key_table(struct client *);
 int	 server_client_check_nested(struct client *);
 void	 server_client_handle_key(struct client *, key_code);
+struct window_pane *server_client_paste_pane(struct client *, int);
+void	 server_client_handle_paste(struct client *, struct window_pane *,
+	     const char *, size_t, int);
 void	 server_client_create(int);
 int	 server_client_open(struct client *, char **);
 void	 server_client_unref(struct client *);
 void	 server_client_lost(struct client *);
 void	 server_client_detach(struct client *, enum msgtype);
 void	 server_client_loop(void);
+void	 server_client_check_headless(void);
+void	 server_client_start_frame(struct client *);
 void	 server_client_push_stdout(struct client *);
+void	 server_client_push_stdout_later(struct client *);
 void	 server_client_push_stderr(struct client *);
 
 /* server-fn.c */
@@ -1974,6 +2372,9 @@ void	 status_timer_start(struct client *);
 void	 status_timer_start_all(void);
 int	 status_at_line(struct client *);
 struct window *status_get_window_at(struct client *, u_int);
+extern u_int status_generation;
+uint64_t status_hash(uint64_t, const void *, size_t);
+void	 status_cache_free(struct session *);
 int	 status_redraw(struct client *);
 void printflike(2, 3) status_message_set(struct client *, const char *, ...);
 void	 status_message_clear(struct client *);
@@ -1984,15 +2385,21 @@ void	 status_prompt_clear(struct client *);
 int	 status_prompt_redraw(struct client *);
 void	 status_prompt_key(struct client *, key_code);
 void	 status_prompt_update(struct client *, const char *, const char *);
-void	 status_prompt_load_history(void);
 void	 status_prompt_save_history(void);
 
+/* regex-cache.c */
+regex_t	*regex_cache_get(const char *, int, char **);
+void	 regex_cache_hold(regex_t *);
+void	 regex_cache_release(regex_t *);
+
 /* resize.c */
 void	 recalculate_sizes(void);
+void	 recalculate_pending(struct window *);
 
 /* input.c */
 void	 input_init(struct window_pane *);
 void	 input_free(struct window_pane *);
+size_t	 input_memory(struct window_pane *);
 void	 input_reset(struct window_pane *, int);
 struct evbuffer *input_pending(struct window_pane *);
 void	 input_parse(struct window_pane *);
@@ -2021,28 +2428,64 @@ extern const struct grid_cell grid_default_cell;
 struct grid *grid_create(u_int, u_int, u_int);
 void	 grid_destroy(struct grid *);
 int	 grid_compare(struct grid *, struct grid *);
+extern size_t grid_total_memory;
 void	 grid_collect_history(struct grid *);
+void	 grid_trim_history(struct grid *, u_int);
+const void *grid_cache_get(struct grid *, u_int, size_t *);
+void	 grid_cache_set(struct grid *, u_int, void *, size_t);
+void	 grid_cache_drop(struct grid *, u_int);
+void	 grid_free_spare(struct grid *);
 void	 grid_scroll_history(struct grid *);
 void	 grid_scroll_history_region(struct grid *, u_int, u_int);
 void	 grid_clear_history(struct grid *);
 void	 grid_expand_line(struct grid *, u_int, u_int);
+void	 grid_resize_lines(struct grid *, u_int);
 const struct grid_line *grid_peek_line(struct grid *, u_int);
 void	 grid_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
 void	 grid_set_cell(struct grid *, u_int, u_int, const struct grid_cell *);
+void	 grid_set_cells(struct grid *, u_int, u_int, const struct grid_cell *,
+	     const u_char *, u_int);
 void	 grid_clear(struct grid *, u_int, u_int, u_int, u_int);
 void	 grid_clear_lines(struct grid *, u_int, u_int);
 void	 grid_move_lines(struct grid *, u_int, u_int, u_int);
 void	 grid_move_cells(struct grid *, u_int, u_int, u_int, u_int);
 char	*grid_string_cells(struct grid *, u_int, u_int, u_int,
 	     struct grid_cell **, int, int, int);
+void	 grid_string_cells_buffer(struct grid *, u_int, u_int, u_int,
+	     struct grid_cell *, int, int, int, struct evbuffer *);
+size_t	 grid_string_text(struct grid *, u_int, char **, size_t *);
 void	 grid_duplicate_lines(struct grid *, u_int, struct grid *, u_int,
 	     u_int);
+void	 grid_swap_lines(struct grid *, u_int, struct grid *, u_int, u_int);
 u_int	 grid_reflow(struct grid *, struct grid *, u_int);
+void	 grid_reflow_history(struct grid *);
+struct grid *grid_snapshot(struct grid *);
+u_int	 grid_reflow_history_step(struct grid *);
+void	 grid_reflow_history_last(struct grid *, u_int);
+
+/* grid-index.c */
+void	 grid_index_enable(struct grid *);
+void	 grid_index_disable(struct grid *);
+void	 grid_index_reset(struct grid *, int);
+void	 grid_index_trim(struct grid *, u_int);
+void	 grid_index_update(struct grid *);
+int	 grid_index_query(struct grid *, const char *, bitstr_t **);
+
+/* grid-style.c */
+void	 grid_style_from_cell(struct grid_style *, const struct grid_cell *);
+void	 grid_style_to_cell(const struct grid_style *, struct grid_cell *);
+void	 grid_styles_share(struct grid *, struct grid *);
+struct grid_styles *grid_styles_create(void);
+void	 grid_styles_free(struct grid_styles *);
+u_int	 grid_styles_add(struct grid_styles *, const struct grid_style *);
+const struct grid_style *grid_styles_get(struct grid_styles *, u_int);
 
 /* grid-view.c */
 void	 grid_view_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
 void	 grid_view_set_cell(struct grid *, u_int, u_int,
 	     const struct grid_cell *);
+void	 grid_view_set_cells(struct grid *, u_int, u_int,
+	     const struct grid_cell *, const u_char *, u_int);
 void	 grid_view_clear_history(struct grid *);
 void	 grid_view_clear(struct grid *, u_int, u_int, u_int, u_int);
 void	 grid_view_scroll_region_up(struct grid *, u_int, u_int);
@@ -2100,18 +2543,25 @@ void	 screen_write_clearstartofscreen(struct screen_write_ctx *);
 void	 screen_write_clearscreen(struct screen_write_ctx *);
 void	 screen_write_clearhistory(struct screen_write_ctx *);
 void	 screen_write_cell(struct screen_write_ctx *, const struct grid_cell *);
+void	 screen_write_cells(struct screen_write_ctx *,
+	     const struct grid_cell *, const u_char *, u_int);
 void	 screen_write_setselection(struct screen_write_ctx *, u_char *, u_int);
 void	 screen_write_rawstring(struct screen_write_ctx *, u_char *, u_int);
 
 /* screen-redraw.c */
+int	 screen_redraw_check_is(u_int, u_int, int, struct window *,
+	     struct window_pane *, struct window_pane *);
 void	 screen_redraw_screen(struct client *, int, int, int);
 void	 screen_redraw_pane(struct client *, struct window_pane *);
+void	 screen_redraw_pane_dirty(struct client *, struct window_pane *);
 
 /* screen.c */
 void	 screen_init(struct screen *, u_int, u_int, u_int);
 void	 screen_reinit(struct screen *);
 void	 screen_free(struct screen *);
 void	 screen_reset_tabs(struct screen *);
+void	 screen_set_dirty(struct screen *, u_int, u_int);
+void	 screen_clear_dirty(struct screen *);
 void	 screen_set_cursor_style(struct screen *, u_int);
 void	 screen_set_cursor_colour(struct screen *, const char *);
 void	 screen_set_title(struct screen *, const char *);
@@ -2124,7 +2574,9 @@ void	 screen_reflow(struct screen *, u_int);
 
 /* window.c */
 extern struct windows windows;
+extern struct windows_dirty dirty_windows;
 extern struct window_pane_tree all_window_panes;
+extern u_int	next_window_pane_id;
 int		 window_cmp(struct window *, struct window *);
 RB_PROTOTYPE(windows, window, entry, window_cmp);
 int		 winlink_cmp(struct winlink *, struct winlink *);
@@ -2150,12 +2602,17 @@ void		 winlink_stack_remove(struct winlink_stack *, struct winlink *);
 struct window	*window_find_by_id_str(const char *);
 struct window	*window_find_by_id(u_int);
 void		 window_update_activity(struct window *);
+void		 window_enqueue(struct window *);
 struct window	*window_create1(u_int, u_int);
 struct window	*window_create(const char *, int, char **, const char *,
 		     const char *, const char *, struct environ *,
 		     struct termios *, u_int, u_int, u_int, char **);
 void		 window_destroy(struct window *);
 struct window_pane *window_get_active_at(struct window *, u_int, u_int);
+void		 window_clear_cellmap(struct window *);
+int		 window_get_cell_active(struct window *, u_int, u_int);
+int		 window_get_cell_type(struct window *, u_int, u_int,
+		     struct window_pane **);
 struct window_pane *window_find_string(struct window *, const char *);
 int		 window_has_pane(struct window *, struct window_pane *);
 int		 window_set_active_pane(struct window *, struct window_pane *);
@@ -2178,7 +2635,12 @@ void		 window_destroy_panes(struct window *);
 struct window_pane *window_pane_find_by_id_str(const char *);
 struct window_pane *window_pane_find_by_id(u_int);
 struct window_pane *window_pane_create(struct window *, u_int, u_int, u_int);
+void		 window_pane_add_id(struct window_pane *);
+void		 window_pane_set_id(struct window_pane *, u_int);
 void		 window_pane_destroy(struct window_pane *);
+__dead void	 window_pane_exec(u_int, int, char **, const char *,
+		     const char *, const char *, struct environ *,
+		     struct termios *);
 int		 window_pane_spawn(struct window_pane *, int, char **,
 		     const char *, const char *, const char *, struct environ *,
 		     struct termios *, char **);
@@ -2187,14 +2649,28 @@ void		 window_pane_alternate_on(struct window_pane *,
 		     struct grid_cell *, int);
 void		 window_pane_alternate_off(struct window_pane *,
 		     struct grid_cell *, int);
+void		 window_pane_reset_budget(void);
+int		 window_throttled(struct window *);
+void		 window_pane_read_enable(struct window_pane *, int);
+void		 window_pane_close(struct window_pane *);
+void		 window_pane_sync_start(struct window_pane *);
+void		 window_pane_sync_end(struct window_pane *);
 int		 window_pane_set_mode(struct window_pane *,
 		     const struct window_mode *);
 void		 window_pane_reset_mode(struct window_pane *);
 void		 window_pane_key(struct window_pane *, struct client *,
 		     struct session *, key_code, struct mouse_event *);
+int		 window_pane_key_literal(struct window_pane *, const char *,
+		     size_t);
+void		 window_pane_paste(struct window_pane *, const char *, size_t,
+		     int);
+void		 window_pane_paste_buffer(struct window_pane *,
+		     struct paste_buffer *, const char *, int);
+void		 window_pane_paste_cancel(struct window_pane *);
 int		 window_pane_visible(struct window_pane *);
-char		*window_pane_search(struct window_pane *, const char *,
-		     u_int *);
+size_t		 window_pane_grid_memory(struct window_pane *);
+size_t		 window_pane_buffer_memory(struct window_pane *);
+void		 window_check_history_memory(void);
 char		*window_printable_flags(struct session *, struct winlink *);
 struct window_pane *window_pane_find_up(struct window_pane *);
 struct window_pane *window_pane_find_down(struct window_pane *);
@@ -2206,6 +2682,7 @@ void		 winlink_clear_flags(struct winlink *);
 int		 winlink_shuffle_up(struct session *, struct winlink *);
 
 /* layout.c */
+extern u_int	 layout_generation;
 u_int		 layout_count_cells(struct layout_cell *);
 struct layout_cell *layout_create_cell(struct layout_cell *);
 void		 layout_free_cell(struct layout_cell *);
@@ -2224,6 +2701,8 @@ void		 layout_resize_adjust(struct layout_cell *, enum layout_type,
 void		 layout_init(struct window *, struct window_pane *);
 void		 layout_free(struct window *);
 void		 layout_resize(struct window *, u_int, u_int);
+void		 layout_resize_cells(struct layout_cell *, u_int, u_int, u_int,
+		     u_int);
 void		 layout_resize_pane(struct window_pane *, enum layout_type,
 		     int);
 void		 layout_resize_pane_to(struct window_pane *, enum layout_type,
@@ -2235,6 +2714,7 @@ void		 layout_close_pane(struct window_pane *);
 
 /* layout-custom.c */
 char		*layout_dump(struct layout_cell *);
+char		*layout_dump_window(struct window *, int);
 int		 layout_parse(struct window *, const char *);
 
 /* layout-set.c */
@@ -2276,6 +2756,33 @@ struct window_choose_data	*window_choose_add_session(struct window_pane *,
 void	window_choose_expand_all(struct window_pane *);
 void	window_choose_collapse_all(struct window_pane *);
 void	window_choose_set_current(struct window_pane *, u_int);
+void	window_choose_invalidate(void);
+
+/* watchdog.c */
+enum watchdog_type {
+	WATCHDOG_PANE_READ,
+	WATCHDOG_CLIENT_LOOP,
+	WATCHDOG_COMMAND,
+	WATCHDOG_TMATE_FLUSH,
+	WATCHDOG_TMATE_SSH,
+};
+#define WATCHDOG_NTYPES 5
+struct watchdog_stats {
+	u_int		 count;
+	uint64_t	 total_us;
+	uint64_t	 max_us;
+
+	u_int		 slow;
+	uint64_t	 slow_us;
+	time_t		 slow_time;
+	char		 slow_context[64];
+};
+const char	*watchdog_name(enum watchdog_type);
+struct watchdog_stats *watchdog_get(enum watchdog_type);
+void		 watchdog_reset(void);
+void		 watchdog_start(struct timeval *);
+void printflike(3, 4) watchdog_stop(enum watchdog_type, struct timeval *,
+		     const char *, ...);
 
 /* names.c */
 void	 check_window_name(struct window *);
@@ -2283,6 +2790,13 @@ char	*default_window_name(struct window *);
 char	*format_window_name(struct window *);
 char	*parse_window_name(const char *);
 
+/* spawn-pool.c */
+void	spawn_pool_clear(void);
+void	spawn_pool_update(void);
+void	spawn_pool_exited(pid_t);
+int	spawn_pool_take(struct window_pane *, const char *, struct environ *,
+	    struct termios *, struct winsize *);
+
 /* signal.c */
 void	set_signals(void(*)(int, short, void *), void *);
 void	clear_signals(int);
@@ -2293,8 +2807,8 @@ void printflike(2, 3) control_write(struct client *, const char *, ...);
 void	control_write_buffer(struct client *, struct evbuffer *);
 
 /* control-notify.c */
-void	control_notify_input(struct client *, struct window_pane *,
-	    struct evbuffer *);
+void	control_notify_input(struct window_pane *, struct evbuffer *);
+int	control_notify_continue(struct client *, struct window_pane *);
 void	control_notify_window_layout_changed(struct window *);
 void	control_notify_window_unlinked(struct session *, struct window *);
 void	control_notify_window_linked(struct session *, struct window *);
@@ -2328,6 +2842,7 @@ struct winlink	*session_attach(struct session *, struct window *, int,
 		     char **);
 int		 session_detach(struct session *, struct winlink *);
 int		 session_has(struct session *, struct window *);
+size_t		 session_memory(struct session *);
 int		 session_is_linked(struct session *, struct window *);
 int		 session_next(struct session *, int);
 int		 session_previous(struct session *, int);
@@ -2344,11 +2859,16 @@ void		 session_group_synchronize_from(struct session *);
 void		 session_group_synchronize1(struct session *, struct session *);
 void		 session_renumber_windows(struct session *);
 
+/* utf8-width.c */
+extern const u_char utf8_width_index[];
+extern const u_char utf8_width_blocks[][64];
+
 /* utf8.c */
 void		 utf8_set(struct utf8_data *, u_char);
 void		 utf8_copy(struct utf8_data *, const struct utf8_data *);
 enum utf8_state	 utf8_open(struct utf8_data *, u_char);
 enum utf8_state	 utf8_append(struct utf8_data *, u_char);
+size_t		 utf8_next(const u_char *, size_t, struct utf8_data *);
 enum utf8_state	 utf8_combine(const struct utf8_data *, wchar_t *);
 enum utf8_state	 utf8_split(wchar_t, struct utf8_data *);
 int		 utf8_strvis(char *, const char *, size_t, int);
@@ -2371,11 +2891,38 @@ int	log_get_level(void);
 void	log_open_fp(FILE *f);
 void	log_open(const char *);
 void	log_close(void);
+void	log_flush(void);
 #define LOG_ERROR	0
 #define LOG_INFO	1
 #define LOG_DEBUG	2
-#define log_debug(...) log_emit(LOG_DEBUG+1, __VA_ARGS__)
+extern int log_level;
+extern int log_categories;
 void printflike(2, 3) log_emit(int level, const char *, ...);
+void	log_startup(const char *);
+
+/*
+ * The level is checked before the arguments are evaluated. Messages in a
+ * category are also dropped unless the category is enabled, and can be left
+ * out entirely by building with a smaller LOG_CATEGORIES.
+ */
+#define LOG_INPUT	0x1
+#define LOG_TTY		0x2
+#define LOG_PROTO	0x4
+#define LOG_SSH		0x8
+#define LOG_STARTUP	0x10
+#ifndef LOG_CATEGORIES
+#define LOG_CATEGORIES	(LOG_INPUT|LOG_TTY|LOG_PROTO|LOG_SSH|LOG_STARTUP)
+#endif
+#define log_emit_level(level, ...) \
+	(log_level >= (level) ? log_emit(level, __VA_ARGS__) : (void)0)
+#define log_emit_category(cat, level, ...) \
+	((LOG_CATEGORIES & (cat)) && (log_categories & (cat)) ? \
+	log_emit_level(level, __VA_ARGS__) : (void)0)
+#define log_debug(...) log_emit_level(LOG_DEBUG+1, __VA_ARGS__)
+#define log_debug_input(...) \
+	log_emit_category(LOG_INPUT, LOG_DEBUG+1, __VA_ARGS__)
+#define log_debug_tty(...) \
+	log_emit_category(LOG_TTY, LOG_DEBUG+1, __VA_ARGS__)
 __dead void printflike(1, 2) fatal(const char *, ...);
 __dead void printflike(1, 2) fatalx(const char *, ...);
 
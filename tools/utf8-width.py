@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#
+# Generate utf8-width.c, the character width table used by utf8_width, from
+# the Unicode database built into Python:
+#
+#	python3 tools/utf8-width.py >utf8-width.c
+#
+# Widths follow wcwidth(3) as in glibc: combining marks, most format
+# characters and the Hangul medial vowels and final consonants are zero width;
+# East Asian Wide and Fullwidth characters, the unassigned parts of planes 2
+# and 3 and a few CJK symbol blocks are two; C1 controls, UTF-16 surrogates
+# and other unassigned characters are invalid; everything else is one.
+
+import unicodedata
+
+BLOCK = 256
+PER_BYTE = 4
+
+# Format characters which are visible, so not zero width.
+PREPENDED = set(list(range(0x0600, 0x0606)) +
+		[0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd])
+
+
+def width(cp):
+	if 0x80 <= cp < 0xa0 or 0xd800 <= cp <= 0xdfff:
+		return 3
+	if cp == 0x00ad or cp in PREPENDED:
+		return 1
+	if 0x20000 <= cp <= 0x2fffd or 0x30000 <= cp <= 0x3fffd:
+		return 2
+	c = chr(cp)
+	category = unicodedata.category(c)
+	# Python gives unassigned characters an East Asian width of F.
+	if category == 'Cn':
+		return 3
+	if 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff or cp == 0x200b:
+		return 0
+	if category in ('Mn', 'Me', 'Cf'):
+		return 0
+	if unicodedata.east_asian_width(c) in ('W', 'F'):
+		return 2
+	if 0x3248 <= cp <= 0x324f or 0x4dc0 <= cp <= 0x4dff:
+		return 2
+	return 1
+
+
+blocks = []
+index = {}
+stage1 = []
+for base in range(0, 0x110000, BLOCK):
+	data = bytearray(BLOCK // PER_BYTE)
+	for cp in range(base, base + BLOCK):
+		off = cp - base
+		data[off // PER_BYTE] |= width(cp) << (off % PER_BYTE * 2)
+	data = bytes(data)
+	if data not in index:
+		index[data] = len(blocks)
+		blocks.append(data)
+	stage1.append(index[data])
+assert len(blocks) <= 256
+
+print('/* Generated by tools/utf8-width.py from Unicode %s, do not edit. */' %
+      unicodedata.unidata_version)
+print()
+print('#include <sys/types.h>')
+print()
+print('#include "tmux.h"')
+print()
+print('/*')
+print(' * Two stage table of character widths: utf8_width_index maps the top 13')
+print(' * bits of a character to a block of utf8_width_blocks, which holds the')
+print(' * width of each of the 256 characters in two bits, 3 meaning invalid.')
+print(' */')
+print()
+print('const u_char utf8_width_index[%d] = {' % len(stage1))
+for i in range(0, len(stage1), 12):
+	print('\t' + ', '.join('%3u' % n for n in stage1[i:i + 12]) + ',')
+print('};')
+print()
+print('const u_char utf8_width_blocks[%d][%d] = {' % (len(blocks), BLOCK // PER_BYTE))
+for data in blocks:
+	print('\t{')
+	for i in range(0, len(data), 8):
+		print('\t\t' + ', '.join('0x%02x' % b for b in data[i:i + 8]) + ',')
+	print('\t},')
+print('};')
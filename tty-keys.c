@@ -30,17 +30,24 @@
 /*
  * Handle keys input from the outside terminal. tty_default_*_keys[] are a base
  * table of supported keys which are looked up in terminfo(5) and translated
- * into a ternary tree.
+ * into a ternary tree. The tree is built once for each terminal and shared by
+ * every tty using it, and the nodes for the first character and for the
+ * character after an escape are also kept in tables so finding them does not
+ * need to walk the tree.
  */
 
 void		tty_keys_add1(struct tty_key **, const char *, key_code);
-void		tty_keys_add(struct tty *, const char *, key_code);
+void		tty_keys_add(struct tty_term *, const char *, key_code);
+void		tty_keys_flatten(struct tty_key *, struct tty_key **);
 void		tty_keys_free1(struct tty_key *);
 struct tty_key *tty_keys_find1(struct tty_key *, const char *, size_t,
 		    size_t *);
 struct tty_key *tty_keys_find(struct tty *, const char *, size_t, size_t *);
 void		tty_keys_callback(int, short, void *);
+int		tty_keys_paste(struct tty *, const char *, size_t, size_t *);
 int		tty_keys_mouse(struct tty *, const char *, size_t, size_t *);
+void		tty_keys_mouse_coalesce(struct tty *, const char *, size_t,
+		    size_t *);
 
 /* Default raw keys. */
 struct tty_default_key_raw {
@@ -317,18 +324,19 @@ const struct tty_default_key_code tty_default_code_keys[] = {
 
 /* Add key to tree. */
 void
-tty_keys_add(struct tty *tty, const char *s, key_code key)
+tty_keys_add(struct tty_term *term, const char *s, key_code key)
 {
 	struct tty_key	*tk;
 	size_t		 size;
 	const char     	*keystr;
 
 	keystr = key_string_lookup_key(key);
-	if ((tk = tty_keys_find(tty, s, strlen(s), &size)) == NULL) {
-		log_debug("new key %s: 0x%llx (%s)", s, key, keystr);
-		tty_keys_add1(&tty->key_tree, s, key);
+	size = 0;
+	if ((tk = tty_keys_find1(term->key_tree, s, strlen(s), &size)) == NULL) {
+		log_debug_tty("new key %s: 0x%llx (%s)", s, key, keystr);
+		tty_keys_add1(&term->key_tree, s, key);
 	} else {
-		log_debug("replacing key %s: 0x%llx (%s)", s, key, keystr);
+		log_debug_tty("replacing key %s: 0x%llx (%s)", s, key, keystr);
 		tk->key = key;
 	}
 }
@@ -371,41 +379,62 @@ tty_keys_add1(struct tty_key **tkp, const char *s, key_code key)
 	tty_keys_add1(tkp, s, key);
 }
 
-/* Initialise a key tree from the table. */
+/* Fill a table with the nodes of one level of the tree. */
+void
+tty_keys_flatten(struct tty_key *tk, struct tty_key **table)
+{
+	if (tk == NULL)
+		return;
+	table[(u_char)tk->ch] = tk;
+	tty_keys_flatten(tk->left, table);
+	tty_keys_flatten(tk->right, table);
+}
+
+/* Initialise the key tree for the terminal from the table if not done yet. */
 void
 tty_keys_build(struct tty *tty)
 {
+	struct tty_term				*term = tty->term;
 	const struct tty_default_key_raw	*tdkr;
 	const struct tty_default_key_code	*tdkc;
+	struct tty_key				*tk;
 	u_int		 			 i;
 	const char				*s;
 
-	if (tty->key_tree != NULL)
-		tty_keys_free(tty);
-	tty->key_tree = NULL;
+	if (term->key_tree != NULL)
+		return;
 
 	for (i = 0; i < nitems(tty_default_raw_keys); i++) {
 		tdkr = &tty_default_raw_keys[i];
 
 		s = tdkr->string;
 		if (*s != '\0')
-			tty_keys_add(tty, s, tdkr->key);
+			tty_keys_add(term, s, tdkr->key);
 	}
 	for (i = 0; i < nitems(tty_default_code_keys); i++) {
 		tdkc = &tty_default_code_keys[i];
 
-		s = tty_term_string(tty->term, tdkc->code);
+		s = tty_term_string(term, tdkc->code);
 		if (*s != '\0')
-			tty_keys_add(tty, s, tdkc->key);
+			tty_keys_add(term, s, tdkc->key);
 
 	}
+
+	tty_keys_flatten(term->key_tree, term->key_first);
+	if ((tk = term->key_first['\033']) != NULL)
+		tty_keys_flatten(tk->next, term->key_escape);
 }
 
 /* Free the entire key tree. */
 void
-tty_keys_free(struct tty *tty)
+tty_keys_free(struct tty_term *term)
 {
-	tty_keys_free1(tty->key_tree);
+	if (term->key_tree != NULL)
+		tty_keys_free1(term->key_tree);
+	term->key_tree = NULL;
+
+	memset(term->key_first, 0, sizeof term->key_first);
+	memset(term->key_escape, 0, sizeof term->key_escape);
 }
 
 /* Free a single key. */
@@ -421,12 +450,35 @@ tty_keys_free1(struct tty_key *tk)
 	free(tk);
 }
 
-/* Lookup a key in the tree. */
+/*
+ * Lookup a key in the tree, using the tables for the first character and for
+ * the character after an escape.
+ */
 struct tty_key *
 tty_keys_find(struct tty *tty, const char *buf, size_t len, size_t *size)
 {
+	struct tty_term	*term = tty->term;
+	struct tty_key	*tk;
+
 	*size = 0;
-	return (tty_keys_find1(tty->key_tree, buf, len, size));
+
+	if ((tk = term->key_first[(u_char)*buf]) == NULL)
+		return (NULL);
+	buf++; len--;
+	(*size)++;
+	if (len == 0 || (tk->next == NULL && tk->key != KEYC_UNKNOWN))
+		return (tk);
+
+	if (tk == term->key_first['\033']) {
+		if ((tk = term->key_escape[(u_char)*buf]) == NULL)
+			return (NULL);
+		buf++; len--;
+		(*size)++;
+		if (len == 0 || (tk->next == NULL && tk->key != KEYC_UNKNOWN))
+			return (tk);
+	}
+
+	return (tty_keys_find1(tk->next, buf, len, size));
 }
 
 /* Find the next node. */
@@ -485,12 +537,24 @@ tty_keys_next(struct tty *tty)
 
 	if (len == 0)
 		return (0);
-	log_debug("keys are %zu (%.*s)", len, (int) len, buf);
+	log_debug_tty("keys are %zu (%.*s)", len, (int) len, buf);
+
+	/* Is this pasted text? */
+	switch (tty_keys_paste(tty, buf, len, &size)) {
+	case 0:		/* yes, and it has been written */
+		evbuffer_drain(tty->event->input, size);
+		return (1);
+	case -1:	/* no */
+		break;
+	case 1:		/* partial */
+		goto partial_key;
+	}
 
 	/* Is this a mouse key press? */
 	switch (tty_keys_mouse(tty, buf, len, &size)) {
 	case 0:		/* yes */
 		key = KEYC_MOUSE;
+		tty_keys_mouse_coalesce(tty, buf, len, &size);
 		goto complete_key;
 	case -1:	/* no, or not valid */
 		break;
@@ -558,7 +622,7 @@ first_key:
 			goto discard_key;
 		key = wc;
 
-		log_debug("UTF-8 key %.*s %#llx", (int)size, buf, key);
+		log_debug_tty("UTF-8 key %.*s %#llx", (int)size, buf, key);
 		goto complete_key;
 	}
 
@@ -578,7 +642,7 @@ first_key:
 	goto complete_key;
 
 partial_key:
-	log_debug("partial key %.*s", (int) len, buf);
+	log_debug_tty("partial key %.*s", (int) len, buf);
 
 	/* If timer is going, check for expiration. */
 	if (tty->flags & TTY_TIMER) {
@@ -599,13 +663,14 @@ partial_key:
 	if (event_initialized(&tty->key_timer))
 		evtimer_del(&tty->key_timer);
 	evtimer_set(&tty->key_timer, tty_keys_callback, tty);
+	event_priority_set(&tty->key_timer, EVENT_PRI_INPUT);
 	evtimer_add(&tty->key_timer, &tv);
 
 	tty->flags |= TTY_TIMER;
 	return (0);
 
 complete_key:
-	log_debug("complete key %.*s %#llx", (int)size, buf, key);
+	log_debug_tty("complete key %.*s %#llx", (int)size, buf, key);
 
 	/* Remove data from buffer. */
 	evbuffer_drain(tty->event->input, size);
@@ -618,9 +683,13 @@ complete_key:
 	/* Check for focus events. */
 	if (key == KEYC_FOCUS_OUT) {
 		tty->client->flags &= ~CLIENT_FOCUSED;
+		if (tty->client->session != NULL)
+			window_enqueue(tty->client->session->curw->window);
 		return (1);
 	} else if (key == KEYC_FOCUS_IN) {
 		tty->client->flags |= CLIENT_FOCUSED;
+		if (tty->client->session != NULL)
+			window_enqueue(tty->client->session->curw->window);
 		return (1);
 	}
 
@@ -631,7 +700,7 @@ complete_key:
 	return (1);
 
 discard_key:
-	log_debug("discard key %.*s %#llx", (int)size, buf, key);
+	log_debug_tty("discard key %.*s %#llx", (int)size, buf, key);
 
 	/* Remove data from buffer. */
 	evbuffer_drain(tty->event->input, size);
@@ -651,6 +720,101 @@ tty_keys_callback(__unused int fd, __unused short events, void *data)
 	}
 }
 
+/*
+ * Handle pasted text, which is written to the pane as it is rather than a key
+ * at a time. Inside a bracketed paste everything up to the closing marker is
+ * taken; otherwise the leading run of bytes which would be sent unchanged as
+ * keys is taken if assume-paste-time says the session is pasting. Returns 0
+ * for success, -1 for failure, 1 for partial (the closing marker may be
+ * split).
+ */
+int
+tty_keys_paste(struct tty *tty, const char *buf, size_t len, size_t *size)
+{
+	struct client		*c = tty->client;
+	struct window_pane	*wp;
+	struct utf8_data	 ud;
+	enum utf8_state		 more;
+	wchar_t			 wc;
+	const char		*end = "\033[201~";
+	size_t			 n, i, endlen = 6;
+	u_char			 ch;
+	cc_t			 bspace;
+	int			 flags;
+
+	*size = 0;
+
+	if (tty->flags & TTY_PASTING) {
+		/* Find the closing marker, or as much of it as has arrived. */
+		flags = PASTE_BRACKETED;
+		for (n = 0; n < len; n++) {
+			if (buf[n] != '\033')
+				continue;
+			i = len - n;
+			if (i > endlen)
+				i = endlen;
+			if (memcmp(buf + n, end, i) == 0)
+				break;
+		}
+		if (len - n >= endlen) {
+			flags |= PASTE_END;
+			*size = n + endlen;
+		} else {
+			if (n == 0)
+				return (1);
+			*size = n;
+		}
+		if ((wp = server_client_paste_pane(c, flags)) == NULL) {
+			tty->flags &= ~TTY_PASTING;
+			return (-1);
+		}
+		server_client_handle_paste(c, wp, buf, n, flags);
+		if (flags & PASTE_END)
+			tty->flags &= ~TTY_PASTING;
+		return (0);
+	}
+
+	if (len >= endlen && memcmp(buf, "\033[200~", endlen) == 0) {
+		flags = PASTE_BRACKETED|PASTE_START;
+		if ((wp = server_client_paste_pane(c, flags)) == NULL)
+			return (-1);
+		server_client_handle_paste(c, wp, NULL, 0, flags);
+		tty->flags |= TTY_PASTING;
+		*size = endlen;
+		return (0);
+	}
+
+	/*
+	 * Not bracketed, so stop at anything tty_keys_next would turn into
+	 * something other than the same bytes: escape sequences, backspace and
+	 * invalid UTF-8.
+	 */
+	if ((wp = server_client_paste_pane(c, 0)) == NULL)
+		return (-1);
+	bspace = tty->tio.c_cc[VERASE];
+	for (n = 0; n < len; n++) {
+		ch = buf[n];
+		if (ch == '\0' || ch == '\033')
+			break;
+		if (bspace != _POSIX_VDISABLE && ch == bspace && ch != '\177')
+			break;
+		if (ch < 0x80)
+			continue;
+		if (utf8_open(&ud, ch) != UTF8_MORE || len - n < ud.size)
+			break;
+		for (i = 1; i < ud.size; i++)
+			more = utf8_append(&ud, (u_char)buf[n + i]);
+		if (more != UTF8_DONE || utf8_combine(&ud, &wc) != UTF8_DONE)
+			break;
+		n += ud.size - 1;
+	}
+	if (n == 0)
+		return (-1);
+	server_client_handle_paste(c, wp, buf, n, 0);
+	*size = n;
+	return (0);
+}
+
 /*
  * Handle mouse key input. Returns 0 for success, -1 for failure, 1 for partial
  * (probably a mouse sequence but need more data).
@@ -707,7 +871,7 @@ tty_keys_mouse(struct tty *tty, const char *buf, size_t len, size_t *size)
 			else
 				y = c;
 		}
-		log_debug("mouse input: %.*s", (int)*size, buf);
+		log_debug_tty("mouse input: %.*s", (int)*size, buf);
 
 		/* Check and return the mouse input. */
 		if (b < 32)
@@ -754,7 +918,7 @@ tty_keys_mouse(struct tty *tty, const char *buf, size_t len, size_t *size)
 				return (-1);
 			y = 10 * y + (c - '0');
 		}
-		log_debug("mouse input (SGR): %.*s", (int)*size, buf);
+		log_debug_tty("mouse input (SGR): %.*s", (int)*size, buf);
 
 		/* Check and return the mouse input. */
 		if (x < 1 || y < 1)
@@ -791,3 +955,41 @@ tty_keys_mouse(struct tty *tty, const char *buf, size_t len, size_t *size)
 
 	return (0);
 }
+
+/*
+ * While tmux is dragging a selection or a pane border itself, only where the
+ * mouse ends up matters, so take any further motion for the same buttons
+ * already in the buffer along with this one. The last position is kept from
+ * the first, so the drag update moves by the whole distance at once.
+ */
+void
+tty_keys_mouse_coalesce(struct tty *tty, const char *buf, size_t len,
+    size_t *size)
+{
+	struct mouse_event	*m = &tty->mouse, saved;
+	size_t			 next;
+	u_int			 lx, ly, lb;
+
+	if (!tty->mouse_drag_flag || tty->mouse_drag_update == NULL)
+		return;
+	if (!MOUSE_DRAG(m->b))
+		return;
+	lx = m->lx;
+	ly = m->ly;
+	lb = m->lb;
+
+	while (*size < len) {
+		memcpy(&saved, m, sizeof saved);
+		if (tty_keys_mouse(tty, buf + *size, len - *size, &next) != 0 ||
+		    m->b != saved.b) {
+			memcpy(m, &saved, sizeof *m);
+			break;
+		}
+		log_debug_tty("mouse motion to %u,%u skipped", saved.x, saved.y);
+		*size += next;
+	}
+
+	m->lx = lx;
+	m->ly = ly;
+	m->lb = lb;
+}
@@ -32,9 +32,22 @@
 
 void	 tty_term_override(struct tty_term *, const char *);
 char	*tty_term_strip(const char *);
+void	 tty_term_destroy(struct tty_term *);
 
 struct tty_terms tty_terms = LIST_HEAD_INITIALIZER(tty_terms);
 
+/*
+ * Terms no longer used by any client are kept for a while, most recently
+ * used first, so that attaching again does not go through terminfo and
+ * rebuild the key tree. A term is only reused if terminal-overrides has not
+ * changed since it was set up.
+ */
+#define TTY_TERM_CACHE 8
+
+TAILQ_HEAD(tty_terms_unused, tty_term) tty_terms_unused =
+    TAILQ_HEAD_INITIALIZER(tty_terms_unused);
+u_int	tty_terms_nunused;
+
 enum tty_code_type {
 	TTYCODE_NONE = 0,
 	TTYCODE_STRING,
@@ -65,6 +78,7 @@ const struct tty_term_code_entry tty_term_codes[] = {
 	[TTYC_BOLD] = { TTYCODE_STRING, "bold" },
 	[TTYC_CIVIS] = { TTYCODE_STRING, "civis" },
 	[TTYC_CLEAR] = { TTYCODE_STRING, "clear" },
+	[TTYC_CMG] = { TTYCODE_STRING, "Cmg" },
 	[TTYC_CNORM] = { TTYCODE_STRING, "cnorm" },
 	[TTYC_COLORS] = { TTYCODE_NUMBER, "colors" },
 	[TTYC_CR] = { TTYCODE_STRING, "Cr" },
@@ -85,11 +99,13 @@ const struct tty_term_code_entry tty_term_codes[] = {
 	[TTYC_DIM] = { TTYCODE_STRING, "dim" },
 	[TTYC_DL] = { TTYCODE_STRING, "dl" },
 	[TTYC_DL1] = { TTYCODE_STRING, "dl1" },
+	[TTYC_DSMG] = { TTYCODE_STRING, "Dsmg" },
 	[TTYC_E3] = { TTYCODE_STRING, "E3" },
 	[TTYC_ECH] = { TTYCODE_STRING, "ech" },
 	[TTYC_EL] = { TTYCODE_STRING, "el" },
 	[TTYC_EL1] = { TTYCODE_STRING, "el1" },
 	[TTYC_ENACS] = { TTYCODE_STRING, "enacs" },
+	[TTYC_ENMG] = { TTYCODE_STRING, "Enmg" },
 	[TTYC_FSL] = { TTYCODE_STRING, "fsl" },
 	[TTYC_HOME] = { TTYCODE_STRING, "home" },
 	[TTYC_HPA] = { TTYCODE_STRING, "hpa" },
@@ -97,6 +113,7 @@ const struct tty_term_code_entry tty_term_codes[] = {
 	[TTYC_ICH1] = { TTYCODE_STRING, "ich1" },
 	[TTYC_IL] = { TTYCODE_STRING, "il" },
 	[TTYC_IL1] = { TTYCODE_STRING, "il1" },
+	[TTYC_INDN] = { TTYCODE_STRING, "indn" },
 	[TTYC_INVIS] = { TTYCODE_STRING, "invis" },
 	[TTYC_IS1] = { TTYCODE_STRING, "is1" },
 	[TTYC_IS2] = { TTYCODE_STRING, "is2" },
@@ -254,6 +271,7 @@ const struct tty_term_code_entry tty_term_codes[] = {
 	[TTYC_SMSO] = { TTYCODE_STRING, "smso" },
 	[TTYC_SMUL] = { TTYCODE_STRING, "smul" },
 	[TTYC_SS] = { TTYCODE_STRING, "Ss" },
+	[TTYC_SYNC] = { TTYCODE_STRING, "Sync" },
 	[TTYC_TC] = { TTYCODE_FLAG, "Tc" },
 	[TTYC_TSL] = { TTYCODE_STRING, "tsl" },
 	[TTYC_VPA] = { TTYCODE_STRING, "vpa" },
@@ -267,6 +285,25 @@ tty_term_ncodes(void)
 	return (nitems(tty_term_codes));
 }
 
+/*
+ * Attributes which may be combined into one SGR sequence, with the parameters
+ * to set and clear them. Italics are left out as tmux may draw them with smso.
+ */
+const struct tty_term_sgr tty_term_sgr[] = {
+	{ GRID_ATTR_BRIGHT, TTYC_BOLD, "1", "22" },
+	{ GRID_ATTR_DIM, TTYC_DIM, "2", "22" },
+	{ GRID_ATTR_UNDERSCORE, TTYC_SMUL, "4", "24" },
+	{ GRID_ATTR_BLINK, TTYC_BLINK, "5", "25" },
+	{ GRID_ATTR_REVERSE, TTYC_REV, "7", "27" },
+	{ GRID_ATTR_HIDDEN, TTYC_INVIS, "8", "28" },
+};
+
+u_int
+tty_term_nsgr(void)
+{
+	return (nitems(tty_term_sgr));
+}
+
 char *
 tty_term_strip(const char *s)
 {
@@ -338,7 +375,7 @@ tty_term_override(struct tty_term *term, const char *overrides)
 			} else
 				val = xstrdup("");
 
-			log_debug("%s override: %s %s",
+			log_debug_tty("%s override: %s %s",
 			    term->name, entstr, removeflag ? "@" : val);
 			for (i = 0; i < tty_term_ncodes(); i++) {
 				ent = &tty_term_codes[i];
@@ -387,22 +424,32 @@ tty_term_find(char *name, int fd, char **cause)
 	const struct tty_term_code_entry	*ent;
 	struct tty_code				*code;
 	u_int					 i;
-	int		 			 n, error;
-	char					*s;
-	const char				*acs;
+	int		 			 n, error, plain;
+	char					*s, sgr[16];
+	const char				*acs, *sgr0, *overrides;
+	uint64_t				 hash;
+
+	overrides = options_get_string(global_options, "terminal-overrides");
+	hash = status_hash(0, overrides, strlen(overrides));
 
 	LIST_FOREACH(term, &tty_terms, entry) {
-		if (strcmp(term->name, name) == 0) {
-			term->references++;
+		if (term->overrides == hash && strcmp(term->name, name) == 0) {
+			if (term->references++ == 0) {
+				TAILQ_REMOVE(&tty_terms_unused, term,
+				    unused_entry);
+				tty_terms_nunused--;
+			}
 			return (term);
 		}
 	}
 
-	log_debug("new term: %s", name);
+	log_debug_tty("new term: %s", name);
 	term = xmalloc(sizeof *term);
 	term->name = xstrdup(name);
+	term->overrides = hash;
 	term->references = 1;
 	term->flags = 0;
+	term->sgr_attrs = 0;
 	term->codes = xcalloc (tty_term_ncodes(), sizeof *term->codes);
 	LIST_INSERT_HEAD(&tty_terms, term, entry);
 
@@ -461,8 +508,7 @@ tty_term_find(char *name, int fd, char **cause)
 	}
 
 	/* Apply terminal overrides. */
-	s = options_get_string(global_options, "terminal-overrides");
-	tty_term_override(term, s);
+	tty_term_override(term, overrides);
 
 	/* Delete curses data. */
 #if !defined(NCURSES_VERSION_MAJOR) || NCURSES_VERSION_MAJOR > 5 || \
@@ -524,23 +570,65 @@ tty_term_find(char *name, int fd, char **cause)
 		code->type = TTYCODE_STRING;
 	}
 
+	/*
+	 * If sgr0, setaf and setab are the usual ECMA-48 SGR sequences, tty.c
+	 * can merge attribute and colour changes into one sequence. Only the
+	 * attributes whose own capability is the plain SGR may be merged.
+	 */
+	plain = 0;
+	if (tty_term_has(term, TTYC_SGR0) &&
+	    tty_term_has(term, TTYC_SETAF) &&
+	    tty_term_has(term, TTYC_SETAB)) {
+		sgr0 = tty_term_string(term, TTYC_SGR0);
+		n = strlen(sgr0);
+		if ((n >= 3 && strcmp(sgr0 + n - 3, "\033[m") == 0) ||
+		    (n >= 4 && strcmp(sgr0 + n - 4, "\033[0m") == 0))
+			plain = 1;
+	}
+	if (plain &&
+	    strcmp(tty_term_string1(term, TTYC_SETAF, 1), "\033[31m") == 0 &&
+	    strcmp(tty_term_string1(term, TTYC_SETAB, 1), "\033[41m") == 0) {
+		term->flags |= TERM_SGR;
+		for (i = 0; i < nitems(tty_term_sgr); i++) {
+			if (!tty_term_has(term, tty_term_sgr[i].code))
+				continue;
+			xsnprintf(sgr, sizeof sgr, "\033[%sm", tty_term_sgr[i].on);
+			if (strcmp(tty_term_string(term, tty_term_sgr[i].code),
+			    sgr) == 0)
+				term->sgr_attrs |= tty_term_sgr[i].attr;
+		}
+	}
+
 	return (term);
 
 error:
-	tty_term_free(term);
+	tty_term_destroy(term);
 	return (NULL);
 }
 
 void
 tty_term_free(struct tty_term *term)
 {
-	u_int	i;
-
 	if (--term->references != 0)
 		return;
 
+	TAILQ_INSERT_HEAD(&tty_terms_unused, term, unused_entry);
+	if (++tty_terms_nunused > TTY_TERM_CACHE) {
+		term = TAILQ_LAST(&tty_terms_unused, tty_terms_unused);
+		TAILQ_REMOVE(&tty_terms_unused, term, unused_entry);
+		tty_terms_nunused--;
+		tty_term_destroy(term);
+	}
+}
+
+void
+tty_term_destroy(struct tty_term *term)
+{
+	u_int	i;
+
 	LIST_REMOVE(term, entry);
 
+	tty_keys_free(term);
 	for (i = 0; i < tty_term_ncodes(); i++) {
 		if (term->codes[i].type == TTYCODE_STRING)
 			free(term->codes[i].value.string);
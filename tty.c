@@ -33,8 +33,45 @@
 
 static int tty_log_fd = -1;
 
+/*
+ * Clients with the same terminal, size and state are sent the same bytes for
+ * a command. When more than one is looking at a pane, tty_write groups them:
+ * the command runs for the first of each group with what it writes also kept
+ * here, then the rest of the group get a copy of the bytes and are left in the
+ * state the first was left in.
+ */
+#define TTY_WRITE_GROUPS 4
+#define TTY_WRITE_FLAGS (TTY_NOCURSOR|TTY_UTF8|TTY_SYNCING)
+
+struct tty_write_state {
+	struct tty_term	*term;
+	u_int		 sx;
+	u_int		 sy;
+	u_int		 cx;
+	u_int		 cy;
+	u_int		 cstyle;
+	int		 mode;
+	u_int		 rlower;
+	u_int		 rupper;
+	int		 flags;
+	int		 term_flags;
+	u_int		 yoff;
+	struct grid_cell cell;
+};
+
+struct tty_write_group {
+	struct tty		*tty;
+	struct tty_write_state	 state;
+	const char		*ccolour;
+	struct evbuffer		*out;
+};
+static struct tty_write_group tty_write_groups[TTY_WRITE_GROUPS];
+static struct tty	*tty_capture;
+static struct evbuffer	*tty_capture_out;
+
 void	tty_read_callback(struct bufferevent *, void *);
 void	tty_error_callback(struct bufferevent *, short, void *);
+void	tty_add(struct tty *, const void *, size_t);
 
 static int tty_same_fg(const struct grid_cell *, const struct grid_cell *);
 static int tty_same_bg(const struct grid_cell *, const struct grid_cell *);
@@ -46,6 +83,9 @@ void	tty_set_italics(struct tty *);
 int	tty_try_256(struct tty *, u_char, const char *);
 int	tty_try_rgb(struct tty *, const struct grid_cell_rgb *, const char *);
 
+void	tty_attributes_put(struct tty *, u_char);
+void	tty_attributes_sgr(struct tty *, const struct grid_cell *);
+void	tty_sgr_colour(const struct grid_cell *, int, char *, size_t);
 void	tty_colours(struct tty *, const struct grid_cell *);
 void	tty_check_fg(struct tty *, struct grid_cell *);
 void	tty_check_bg(struct tty *, struct grid_cell *);
@@ -55,9 +95,19 @@ void	tty_colours_bg(struct tty *, const struct grid_cell *);
 int	tty_large_region(struct tty *, const struct tty_ctx *);
 int	tty_fake_bce(const struct tty *, const struct window_pane *);
 void	tty_redraw_region(struct tty *, const struct tty_ctx *);
+void	tty_dirty_region(const struct tty_ctx *);
+void	tty_write_dirty(void (*)(struct tty *, const struct tty_ctx *),
+	    const struct tty_ctx *);
+void	tty_write_state(struct tty *, const struct tty_ctx *,
+	    struct tty_write_state *);
+void	tty_write_copy(struct tty *, struct tty_write_group *);
 void	tty_emulate_repeat(struct tty *, enum tty_code_code, enum tty_code_code,
 	    u_int);
 void	tty_repeat_space(struct tty *, u_int);
+int	tty_blank_cell(const struct grid_cell *);
+u_int	tty_draw_blank_run(struct screen *, u_int, u_int, u_int);
+int	tty_margin_pane(struct tty *, const struct tty_ctx *);
+void	tty_margin(struct tty *, u_int, u_int);
 void	tty_cell(struct tty *, const struct grid_cell *,
 	    const struct window_pane *);
 void	tty_default_colours(struct grid_cell *, const struct window_pane *);
@@ -68,6 +118,15 @@ void	tty_default_colours(struct grid_cell *, const struct window_pane *);
 #define tty_pane_full_width(tty, ctx) \
 	((ctx)->xoff == 0 && screen_size_x((ctx)->wp->screen) >= (tty)->sx)
 
+/* Can scrolling be limited to the columns of a pane (DECSLRM)? */
+#define tty_use_margin(tty) \
+	(tty_term_has((tty)->term, TTYC_CMG) && \
+	tty_term_has((tty)->term, TTYC_ENMG) && \
+	tty_term_has((tty)->term, TTYC_DSMG))
+
+/* Fewest blank cells worth erasing and moving over instead of writing. */
+#define TTY_ERASE_MINIMUM 12
+
 static int
 tty_same_fg(const struct grid_cell *gc1, const struct grid_cell *gc2)
 {
@@ -238,6 +297,7 @@ tty_open(struct tty *tty, char **cause)
 
 	tty->event = bufferevent_new(tty->fd, tty_read_callback, NULL,
 	    tty_error_callback, tty);
+	bufferevent_priority_set(tty->event, EVENT_PRI_INPUT);
 
 	tty_start_tty(tty);
 
@@ -304,6 +364,8 @@ tty_start_tty(struct tty *tty)
 	tty_putcode(tty, TTYC_CNORM);
 	if (tty_term_has(tty->term, TTYC_KMOUS))
 		tty_puts(tty, "\033[?1000l\033[?1002l\033[?1006l\033[?1005l");
+	if (tty_use_margin(tty))
+		tty_putcode(tty, TTYC_ENMG);
 
 	if (tty_term_flag(tty->term, TTYC_XT)) {
 		if (options_get_number(global_options, "focus-events")) {
@@ -338,6 +400,7 @@ tty_stop_tty(struct tty *tty)
 		return;
 	tty->flags &= ~TTY_STARTED;
 
+	tty_flush(tty);
 	bufferevent_disable(tty->event, EV_READ|EV_WRITE);
 
 	/*
@@ -369,6 +432,8 @@ tty_stop_tty(struct tty *tty)
 	tty_raw(tty, tty_term_string(tty->term, TTYC_CNORM));
 	if (tty_term_has(tty->term, TTYC_KMOUS))
 		tty_raw(tty, "\033[?1000l\033[?1002l\033[?1006l\033[?1005l");
+	if (tty_use_margin(tty))
+		tty_raw(tty, tty_term_string(tty->term, TTYC_DSMG));
 
 	if (tty_term_flag(tty->term, TTYC_XT)) {
 		if (tty->flags & TTY_FOCUS) {
@@ -390,10 +455,10 @@ tty_close(struct tty *tty)
 	tty_stop_tty(tty);
 
 	if (tty->flags & TTY_OPENED) {
+		tty->olen = 0;
 		bufferevent_free(tty->event);
 
 		tty_term_free(tty->term);
-		tty_keys_free(tty);
 
 		tty->flags &= ~TTY_OPENED;
 	}
@@ -471,12 +536,60 @@ tty_putcode_ptr2(struct tty *tty, enum tty_code_code code, const void *a,
 		tty_puts(tty, tty_term_ptr2(tty->term, code, a, b));
 }
 
+/*
+ * Output is staged in obuf and handed to the bufferevent when it fills or
+ * once per server loop, rather than a few bytes at a time, so the output
+ * buffer is a few large chunks written with one writev each time the tty is
+ * writable.
+ *
+ * When nothing is waiting in the bufferevent, what is left at the end of the
+ * loop is written straight away instead: most updates are small and the tty
+ * takes all of them, which saves adding the fd to the event loop for one
+ * write and removing it again.
+ */
+void
+tty_add(struct tty *tty, const void *buf, size_t len)
+{
+	if (tty == tty_capture)
+		evbuffer_add(tty_capture_out, buf, len);
+
+	if (tty->olen + len > sizeof tty->obuf) {
+		bufferevent_write(tty->event, tty->obuf, tty->olen);
+		tty->olen = 0;
+	}
+	if (len > sizeof tty->obuf) {
+		bufferevent_write(tty->event, buf, len);
+		return;
+	}
+	memcpy(tty->obuf + tty->olen, buf, len);
+	tty->olen += len;
+}
+
+void
+tty_flush(struct tty *tty)
+{
+	ssize_t	n;
+
+	if (tty->olen == 0)
+		return;
+
+	n = 0;
+	if (tty->fd != -1 && EVBUFFER_LENGTH(tty->event->output) == 0) {
+		n = write(tty->fd, tty->obuf, tty->olen);
+		if (n == -1)
+			n = 0;
+	}
+	if ((size_t)n < tty->olen)
+		bufferevent_write(tty->event, tty->obuf + n, tty->olen - n);
+	tty->olen = 0;
+}
+
 void
 tty_puts(struct tty *tty, const char *s)
 {
 	if (*s == '\0')
 		return;
-	bufferevent_write(tty->event, s, strlen(s));
+	tty_add(tty, s, strlen(s));
 
 	if (tty_log_fd != -1)
 		write(tty_log_fd, s, strlen(s));
@@ -491,11 +604,11 @@ tty_putc(struct tty *tty, u_char ch)
 	if (tty->cell.attr & GRID_ATTR_CHARSET) {
 		acs = tty_acs_get(tty, ch);
 		if (acs != NULL)
-			bufferevent_write(tty->event, acs, strlen(acs));
+			tty_add(tty, acs, strlen(acs));
 		else
-			bufferevent_write(tty->event, &ch, 1);
+			tty_add(tty, &ch, 1);
 	} else
-		bufferevent_write(tty->event, &ch, 1);
+		tty_add(tty, &ch, 1);
 
 	if (ch >= 0x20 && ch != 0x7f) {
 		sx = tty->sx;
@@ -517,12 +630,36 @@ tty_putc(struct tty *tty, u_char ch)
 void
 tty_putn(struct tty *tty, const void *buf, size_t len, u_int width)
 {
-	bufferevent_write(tty->event, buf, len);
+	tty_add(tty, buf, len);
 	if (tty_log_fd != -1)
 		write(tty_log_fd, buf, len);
 	tty->cx += width;
 }
 
+/*
+ * Wrap a redraw in a synchronized update if the terminal has one, so it is
+ * shown all at once.
+ */
+void
+tty_sync_start(struct tty *tty)
+{
+	if (tty->flags & TTY_SYNCING)
+		return;
+	if (tty_term_has(tty->term, TTYC_SYNC)) {
+		tty_putcode1(tty, TTYC_SYNC, 1);
+		tty->flags |= TTY_SYNCING;
+	}
+}
+
+void
+tty_sync_end(struct tty *tty)
+{
+	if (tty->flags & TTY_SYNCING) {
+		tty_putcode1(tty, TTYC_SYNC, 2);
+		tty->flags &= ~TTY_SYNCING;
+	}
+}
+
 void
 tty_set_italics(struct tty *tty)
 {
@@ -694,11 +831,11 @@ tty_redraw_region(struct tty *tty, const struct tty_ctx *ctx)
 	u_int		 	 i;
 
 	/*
-	 * If region is large, schedule a window redraw. In most cases this is
-	 * likely to be followed by some more scrolling.
+	 * If region is large, schedule a redraw of the lines in it. In most
+	 * cases this is likely to be followed by some more scrolling.
 	 */
 	if (tty_large_region(tty, ctx)) {
-		wp->flags |= PANE_REDRAW;
+		tty_dirty_region(ctx);
 		return;
 	}
 
@@ -711,6 +848,56 @@ tty_redraw_region(struct tty *tty, const struct tty_ctx *ctx)
 	}
 }
 
+/*
+ * Mark the lines tty_redraw_region would draw as dirty and stop writing to the
+ * pane until they have been redrawn.
+ */
+void
+tty_dirty_region(const struct tty_ctx *ctx)
+{
+	struct window_pane	*wp = ctx->wp;
+	struct screen		*s = wp->screen;
+
+	if (ctx->ocy < ctx->orupper || ctx->ocy > ctx->orlower)
+		screen_set_dirty(s, ctx->ocy, screen_size_y(s) - ctx->ocy);
+	else {
+		screen_set_dirty(s, ctx->orupper,
+		    ctx->orlower - ctx->orupper + 1);
+	}
+	wp->flags |= PANE_DIRTY;
+	window_enqueue(wp->window);
+}
+
+/* Mark the lines changed by a command not written while the pane is dirty. */
+void
+tty_write_dirty(void (*cmdfn)(struct tty *, const struct tty_ctx *),
+    const struct tty_ctx *ctx)
+{
+	struct screen	*s = ctx->wp->screen;
+	u_int		 sy = screen_size_y(s);
+
+	if (cmdfn == tty_cmd_setselection || cmdfn == tty_cmd_rawstring)
+		return;
+
+	if (cmdfn == tty_cmd_linefeed || cmdfn == tty_cmd_scrollup) {
+		if (ctx->ocy == ctx->orlower)
+			tty_dirty_region(ctx);
+	} else if (cmdfn == tty_cmd_reverseindex) {
+		if (ctx->ocy == ctx->orupper)
+			tty_dirty_region(ctx);
+	} else if (cmdfn == tty_cmd_insertline || cmdfn == tty_cmd_deleteline)
+		tty_dirty_region(ctx);
+	else if (cmdfn == tty_cmd_clearendofscreen)
+		screen_set_dirty(s, ctx->ocy, sy - ctx->ocy);
+	else if (cmdfn == tty_cmd_clearstartofscreen)
+		screen_set_dirty(s, 0, ctx->ocy + 1);
+	else if (cmdfn == tty_cmd_clearscreen ||
+	    cmdfn == tty_cmd_alignmenttest)
+		screen_set_dirty(s, 0, sy);
+	else
+		screen_set_dirty(s, ctx->ocy, 1);
+}
+
 void
 tty_draw_pane(struct tty *tty, const struct window_pane *wp, u_int py, u_int ox,
     u_int oy)
@@ -724,8 +911,8 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 {
 	struct grid_cell	 gc;
 	struct grid_line	*gl;
-	u_int			 i, sx;
-	int			 flags;
+	u_int			 i, n, sx;
+	int			 flags, erase;
 
 	flags = tty->flags & TTY_NOCURSOR;
 	tty->flags |= TTY_NOCURSOR;
@@ -749,12 +936,28 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 	    (oy + py != tty->cy + 1 && tty->cy != s->rlower + oy))
 		tty_cursor(tty, ox, oy + py);
 
+	/*
+	 * Long runs of blank cells are erased with ECH and skipped over rather
+	 * than written out, if the background can be erased to.
+	 */
+	erase = tty_term_has(tty->term, TTYC_ECH) && !tty_fake_bce(tty, wp);
+
 	for (i = 0; i < sx; i++) {
 		grid_view_get_cell(s->grid, i, py, &gc);
 		if (screen_check_selection(s, i, py)) {
 			gc.flags &= ~(GRID_FLAG_FG256|GRID_FLAG_BG256);
 			gc.flags |= s->sel.cell.flags &
 			    (GRID_FLAG_FG256|GRID_FLAG_BG256);
+		} else if (erase && tty_blank_cell(&gc)) {
+			n = tty_draw_blank_run(s, i, py, sx);
+			if (n >= TTY_ERASE_MINIMUM) {
+				tty_attributes(tty, &grid_default_cell, wp);
+				tty_putcode1(tty, TTYC_ECH, n);
+				i += n - 1;
+				if (i + 1 < sx)
+					tty_cursor(tty, ox + i + 1, oy + py);
+				continue;
+			}
 		}
 		tty_cell(tty, &gc, wp);
 	}
@@ -776,6 +979,57 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 	tty_update_mode(tty, tty->mode, s);
 }
 
+/* Is this a space with no attributes or colours? */
+int
+tty_blank_cell(const struct grid_cell *gc)
+{
+	if (gc->data.size != 1 || *gc->data.data != ' ')
+		return (0);
+	if (gc->attr != 0 || gc->flags & ~GRID_FLAG_EXTENDED)
+		return (0);
+	return (gc->fg == 8 && gc->bg == 8);
+}
+
+/* Count the blank cells from px, up to sx. */
+u_int
+tty_draw_blank_run(struct screen *s, u_int px, u_int py, u_int sx)
+{
+	struct grid_cell	gc;
+	u_int			i;
+
+	for (i = px + 1; i < sx; i++) {
+		if (screen_check_selection(s, i, py))
+			break;
+		grid_view_get_cell(s->grid, i, py, &gc);
+		if (!tty_blank_cell(&gc))
+			break;
+	}
+	return (i - px);
+}
+
+/* Draw nx cells of a line starting at px, which must not be padding. */
+void
+tty_draw_cells(struct tty *tty, struct screen *s, u_int py, u_int px,
+    u_int nx, u_int ox, u_int oy)
+{
+	struct grid_cell	 gc;
+	u_int			 i;
+	int			 flags;
+
+	flags = tty->flags & TTY_NOCURSOR;
+	tty->flags |= TTY_NOCURSOR;
+	tty_update_mode(tty, tty->mode, s);
+
+	tty_cursor(tty, ox + px, oy + py);
+	for (i = px; i < px + nx && i < tty->sx; i++) {
+		grid_view_get_cell(s->grid, i, py, &gc);
+		tty_cell(tty, &gc, NULL);
+	}
+
+	tty->flags = (tty->flags & ~TTY_NOCURSOR) | flags;
+	tty_update_mode(tty, tty->mode, s);
+}
+
 int
 tty_client_ready(struct client *c, struct window_pane *wp)
 {
@@ -796,16 +1050,46 @@ tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
 {
 	struct window_pane	*wp = ctx->wp;
 	struct client		*c;
+	struct tty_write_group	*twg = NULL;
+	struct tty_write_state	 state;
+	u_int			 n, ngroups, i;
 
 	/* wp can be NULL if updating the screen but not the terminal. */
-	if (wp == NULL)
+	if (wp == NULL || server_headless)
 		return;
 
 	if (wp->window->flags & WINDOW_REDRAW || wp->flags & PANE_REDRAW)
 		return;
 	if (!window_pane_visible(wp) || wp->flags & PANE_DROP)
 		return;
+	if (wp->flags & PANE_DIRTY) {
+		tty_write_dirty(cmdfn, ctx);
+		return;
+	}
+	if (wp->flags & PANE_SYNC) {
+		wp->flags |= PANE_DIRTY;
+		window_enqueue(wp->window);
+		tty_write_dirty(cmdfn, ctx);
+		return;
+	}
+
+	/* If a client is in a frame, leave this for it to draw at the end. */
+	TAILQ_FOREACH(c, &clients, entry) {
+		if ((c->flags & CLIENT_FRAME) && tty_client_ready(c, wp)) {
+			wp->flags |= PANE_DIRTY;
+			window_enqueue(wp->window);
+			tty_write_dirty(cmdfn, ctx);
+			return;
+		}
+	}
+
+	n = 0;
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (tty_client_ready(c, wp))
+			n++;
+	}
 
+	ngroups = 0;
 	TAILQ_FOREACH(c, &clients, entry) {
 		if (!tty_client_ready(c, wp))
 			continue;
@@ -815,10 +1099,86 @@ tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
 		if (status_at_line(c) == 0)
 			ctx->yoff++;
 
-		cmdfn(&c->tty, ctx);
+		if (n == 1) {
+			cmdfn(&c->tty, ctx);
+			server_client_start_frame(c);
+			continue;
+		}
+
+		tty_write_state(&c->tty, ctx, &state);
+		for (i = 0; i < ngroups; i++) {
+			twg = &tty_write_groups[i];
+			if (twg->ccolour != twg->tty->ccolour ||
+			    strcmp(twg->ccolour, c->tty.ccolour) != 0)
+				continue;
+			if (memcmp(&twg->state, &state, sizeof state) == 0)
+				break;
+		}
+		if (i != ngroups)
+			tty_write_copy(&c->tty, twg);
+		else if (ngroups != TTY_WRITE_GROUPS) {
+			twg = &tty_write_groups[ngroups++];
+			twg->tty = &c->tty;
+			memcpy(&twg->state, &state, sizeof twg->state);
+			twg->ccolour = c->tty.ccolour;
+			if (twg->out == NULL)
+				twg->out = evbuffer_new();
+			else
+				evbuffer_drain(twg->out, EVBUFFER_LENGTH(twg->out));
+
+			tty_capture = &c->tty;
+			tty_capture_out = twg->out;
+			cmdfn(&c->tty, ctx);
+			tty_capture = NULL;
+		} else
+			cmdfn(&c->tty, ctx);
+		server_client_start_frame(c);
 	}
 }
 
+/* The state of a tty which decides what a command writes to it. */
+void
+tty_write_state(struct tty *tty, const struct tty_ctx *ctx,
+    struct tty_write_state *state)
+{
+	memset(state, 0, sizeof *state);
+	state->term = tty->term;
+	state->sx = tty->sx;
+	state->sy = tty->sy;
+	state->cx = tty->cx;
+	state->cy = tty->cy;
+	state->cstyle = tty->cstyle;
+	state->mode = tty->mode;
+	state->rlower = tty->rlower;
+	state->rupper = tty->rupper;
+	state->flags = tty->flags & TTY_WRITE_FLAGS;
+	state->term_flags = tty->term_flags;
+	state->yoff = ctx->yoff;
+	memcpy(&state->cell, &tty->cell, sizeof state->cell);
+}
+
+/* Give a tty what the command wrote to the first of its group. */
+void
+tty_write_copy(struct tty *tty, struct tty_write_group *twg)
+{
+	struct tty	*first = twg->tty;
+	size_t		 len = EVBUFFER_LENGTH(twg->out);
+
+	tty_add(tty, EVBUFFER_DATA(twg->out), len);
+	if (tty_log_fd != -1)
+		write(tty_log_fd, EVBUFFER_DATA(twg->out), len);
+
+	tty->cx = first->cx;
+	tty->cy = first->cy;
+	tty->cstyle = first->cstyle;
+	tty->mode = first->mode;
+	tty->rlower = first->rlower;
+	tty->rupper = first->rupper;
+	tty->flags = (tty->flags & ~TTY_WRITE_FLAGS) |
+	    (first->flags & TTY_WRITE_FLAGS);
+	memcpy(&tty->cell, &first->cell, sizeof tty->cell);
+}
+
 void
 tty_cmd_insertcharacter(struct tty *tty, const struct tty_ctx *ctx)
 {
@@ -881,12 +1241,17 @@ tty_cmd_clearcharacter(struct tty *tty, const struct tty_ctx *ctx)
 void
 tty_cmd_insertline(struct tty *tty, const struct tty_ctx *ctx)
 {
-	if (!tty_pane_full_width(tty, ctx) || tty_fake_bce(tty, ctx->wp) ||
-	    !tty_term_has(tty->term, TTYC_CSR) ||
+	int	margin;
+
+	if (tty_fake_bce(tty, ctx->wp) || !tty_term_has(tty->term, TTYC_CSR) ||
 	    !tty_term_has(tty->term, TTYC_IL1)) {
 		tty_redraw_region(tty, ctx);
 		return;
 	}
+	if ((margin = tty_margin_pane(tty, ctx)) == -1) {
+		tty_redraw_region(tty, ctx);
+		return;
+	}
 
 	tty_attributes(tty, &grid_default_cell, ctx->wp);
 
@@ -894,17 +1259,24 @@ tty_cmd_insertline(struct tty *tty, const struct tty_ctx *ctx)
 	tty_cursor_pane(tty, ctx, ctx->ocx, ctx->ocy);
 
 	tty_emulate_repeat(tty, TTYC_IL, TTYC_IL1, ctx->num);
+	if (margin)
+		tty_margin(tty, 0, tty->sx - 1);
 }
 
 void
 tty_cmd_deleteline(struct tty *tty, const struct tty_ctx *ctx)
 {
-	if (!tty_pane_full_width(tty, ctx) || tty_fake_bce(tty, ctx->wp) ||
-	    !tty_term_has(tty->term, TTYC_CSR) ||
+	int	margin;
+
+	if (tty_fake_bce(tty, ctx->wp) || !tty_term_has(tty->term, TTYC_CSR) ||
 	    !tty_term_has(tty->term, TTYC_DL1)) {
 		tty_redraw_region(tty, ctx);
 		return;
 	}
+	if ((margin = tty_margin_pane(tty, ctx)) == -1) {
+		tty_redraw_region(tty, ctx);
+		return;
+	}
 
 	tty_attributes(tty, &grid_default_cell, ctx->wp);
 
@@ -912,6 +1284,14 @@ tty_cmd_deleteline(struct tty *tty, const struct tty_ctx *ctx)
 	tty_cursor_pane(tty, ctx, ctx->ocx, ctx->ocy);
 
 	tty_emulate_repeat(tty, TTYC_DL, TTYC_DL1, ctx->num);
+	if (margin)
+		tty_margin(tty, 0, tty->sx - 1);
+}
+
+void
+tty_cmd_drawline(struct tty *tty, const struct tty_ctx *ctx)
+{
+	tty_draw_pane(tty, ctx->wp, ctx->ocy, ctx->xoff, ctx->yoff);
 }
 
 void
@@ -966,55 +1346,99 @@ tty_cmd_clearstartofline(struct tty *tty, const struct tty_ctx *ctx)
 void
 tty_cmd_reverseindex(struct tty *tty, const struct tty_ctx *ctx)
 {
+	int	margin;
+
 	if (ctx->ocy != ctx->orupper)
 		return;
 
-	if (!tty_pane_full_width(tty, ctx) || tty_fake_bce(tty, ctx->wp) ||
-	    !tty_term_has(tty->term, TTYC_CSR) ||
+	if (tty_fake_bce(tty, ctx->wp) || !tty_term_has(tty->term, TTYC_CSR) ||
 	    !tty_term_has(tty->term, TTYC_RI)) {
 		tty_redraw_region(tty, ctx);
 		return;
 	}
+	if ((margin = tty_margin_pane(tty, ctx)) == -1) {
+		tty_redraw_region(tty, ctx);
+		return;
+	}
 
 	tty_attributes(tty, &grid_default_cell, ctx->wp);
 
 	tty_region_pane(tty, ctx, ctx->orupper, ctx->orlower);
-	tty_cursor_pane(tty, ctx, ctx->ocx, ctx->orupper);
+	tty_cursor_pane(tty, ctx, margin ? 0 : ctx->ocx, ctx->orupper);
 
 	tty_putcode(tty, TTYC_RI);
+	if (margin)
+		tty_margin(tty, 0, tty->sx - 1);
 }
 
 void
 tty_cmd_linefeed(struct tty *tty, const struct tty_ctx *ctx)
 {
 	struct window_pane	*wp = ctx->wp;
+	int			 margin;
 
 	if (ctx->ocy != ctx->orlower)
 		return;
 
-	if (!tty_pane_full_width(tty, ctx) || tty_fake_bce(tty, wp) ||
-	    !tty_term_has(tty->term, TTYC_CSR)) {
-		if (tty_large_region(tty, ctx))
-			wp->flags |= PANE_REDRAW;
-		else
-			tty_redraw_region(tty, ctx);
+	if (tty_fake_bce(tty, wp) || !tty_term_has(tty->term, TTYC_CSR)) {
+		tty_redraw_region(tty, ctx);
 		return;
 	}
 
 	/*
 	 * If this line wrapped naturally (ctx->num is nonzero), don't do
 	 * anything - the cursor can just be moved to the last cell and wrap
-	 * naturally.
+	 * naturally. A pane narrower than the terminal does not wrap by
+	 * itself, so it is scrolled inside its margins instead.
 	 */
-	if (ctx->num && !(tty->term->flags & TERM_EARLYWRAP))
+	if (tty_pane_full_width(tty, ctx) && ctx->num &&
+	    !(tty->term->flags & TERM_EARLYWRAP))
+		return;
+	if ((margin = tty_margin_pane(tty, ctx)) == -1) {
+		tty_redraw_region(tty, ctx);
 		return;
+	}
 
 	tty_attributes(tty, &grid_default_cell, wp);
 
 	tty_region_pane(tty, ctx, ctx->orupper, ctx->orlower);
-	tty_cursor_pane(tty, ctx, ctx->ocx, ctx->ocy);
+	tty_cursor_pane(tty, ctx, margin ? 0 : ctx->ocx, ctx->ocy);
 
 	tty_putc(tty, '\n');
+	if (margin)
+		tty_margin(tty, 0, tty->sx - 1);
+}
+
+/* Scroll the region up by ctx->num lines, with the cursor at the bottom. */
+void
+tty_cmd_scrollup(struct tty *tty, const struct tty_ctx *ctx)
+{
+	struct window_pane	*wp = ctx->wp;
+	int			 margin;
+	u_int			 i;
+
+	if (tty_fake_bce(tty, wp) || !tty_term_has(tty->term, TTYC_CSR)) {
+		tty_redraw_region(tty, ctx);
+		return;
+	}
+	if ((margin = tty_margin_pane(tty, ctx)) == -1) {
+		tty_redraw_region(tty, ctx);
+		return;
+	}
+
+	tty_attributes(tty, &grid_default_cell, wp);
+
+	tty_region_pane(tty, ctx, ctx->orupper, ctx->orlower);
+	tty_cursor_pane(tty, ctx, 0, ctx->orlower);
+
+	if (ctx->num > 1 && tty_term_has(tty->term, TTYC_INDN))
+		tty_putcode1(tty, TTYC_INDN, ctx->num);
+	else {
+		for (i = 0; i < ctx->num; i++)
+			tty_putc(tty, '\n');
+	}
+	if (margin)
+		tty_margin(tty, 0, tty->sx - 1);
 }
 
 void
@@ -1164,6 +1588,34 @@ tty_cmd_cell(struct tty *tty, const struct tty_ctx *ctx)
 	tty_cell(tty, ctx->cell, wp);
 }
 
+void
+tty_cmd_cells(struct tty *tty, const struct tty_ctx *ctx)
+{
+	struct window_pane	*wp = ctx->wp;
+	const u_char		*data = ctx->ptr;
+	u_int			 i, n = ctx->num;
+
+	tty_region_pane(tty, ctx, ctx->orupper, ctx->orlower);
+	tty_cursor_pane(tty, ctx, ctx->ocx, ctx->ocy);
+
+	/* Skip last character if terminal is stupid. */
+	if (tty->term->flags & TERM_EARLYWRAP && tty->cy == tty->sy - 1 &&
+	    tty->cx + n >= tty->sx) {
+		if (tty->cx >= tty->sx - 1)
+			return;
+		n = tty->sx - 1 - tty->cx;
+	}
+
+	tty_attributes(tty, ctx->cell, wp);
+
+	/* Write with putc if ACS translation may be needed. */
+	if (tty->cell.attr & GRID_ATTR_CHARSET) {
+		for (i = 0; i < n; i++)
+			tty_putc(tty, data[i]);
+	} else
+		tty_putn(tty, data, n, n);
+}
+
 void
 tty_cmd_utf8character(struct tty *tty, const struct tty_ctx *ctx)
 {
@@ -1176,22 +1628,13 @@ tty_cmd_utf8character(struct tty *tty, const struct tty_ctx *ctx)
 	tty_draw_pane(tty, wp, ctx->ocy, ctx->xoff, ctx->yoff);
 }
 
+/* The selection is already base64, from screen_write_setselection. */
 void
 tty_cmd_setselection(struct tty *tty, const struct tty_ctx *ctx)
 {
-	char	*buf;
-	size_t	 off;
-
 	if (!tty_term_has(tty->term, TTYC_MS))
 		return;
-
-	off = 4 * ((ctx->num + 2) / 3) + 1; /* storage for base64 */
-	buf = xmalloc(off);
-
-	b64_ntop(ctx->ptr, ctx->num, buf, off);
-	tty_putcode_ptr2(tty, TTYC_MS, "", buf);
-
-	free(buf);
+	tty_putcode_ptr2(tty, TTYC_MS, "", ctx->ptr);
 }
 
 void
@@ -1294,6 +1737,37 @@ tty_region(struct tty *tty, u_int rupper, u_int rlower)
 	tty_cursor(tty, 0, 0);
 }
 
+/*
+ * Limit scrolling to the columns of a pane which is not the full width of the
+ * terminal. Returns 0 if there is no need, 1 if the margins were set and
+ * should be put back with tty_margin once the scroll is done, or -1 if the
+ * terminal cannot do it.
+ */
+int
+tty_margin_pane(struct tty *tty, const struct tty_ctx *ctx)
+{
+	u_int	sx = screen_size_x(ctx->wp->screen);
+
+	if (tty_pane_full_width(tty, ctx))
+		return (0);
+	if (!tty_use_margin(tty) || ctx->xoff + sx > tty->sx)
+		return (-1);
+	tty_margin(tty, ctx->xoff, ctx->xoff + sx - 1);
+	return (1);
+}
+
+/* Set left and right margins at absolute position. */
+void
+tty_margin(struct tty *tty, u_int rleft, u_int rright)
+{
+	if (tty->cx >= tty->sx && tty->cy < tty->sy)
+		tty_cursor(tty, 0, tty->cy);
+
+	/* Setting the margins moves the cursor to the top left. */
+	tty_putcode2(tty, TTYC_CMG, rleft, rright);
+	tty->cx = tty->cy = UINT_MAX;
+}
+
 /* Move cursor inside pane. */
 void
 tty_cursor_pane(struct tty *tty, const struct tty_ctx *ctx, u_int cx, u_int cy)
@@ -1457,6 +1931,11 @@ tty_attributes(struct tty *tty, const struct grid_cell *gc,
 	tty_check_fg(tty, &gc2);
 	tty_check_bg(tty, &gc2);
 
+	if (tty->term->flags & TERM_SGR) {
+		tty_attributes_sgr(tty, &gc2);
+		return;
+	}
+
 	/* If any bits are being cleared, reset everything. */
 	if (tc->attr & ~gc2.attr)
 		tty_reset(tty);
@@ -1471,7 +1950,13 @@ tty_attributes(struct tty *tty, const struct grid_cell *gc,
 	changed = gc2.attr & ~tc->attr;
 	tc->attr = gc2.attr;
 
-	/* Set the attributes. */
+	tty_attributes_put(tty, changed);
+}
+
+/* Set the attributes in changed one at a time. */
+void
+tty_attributes_put(struct tty *tty, u_char changed)
+{
 	if (changed & GRID_ATTR_BRIGHT)
 		tty_putcode(tty, TTYC_BOLD);
 	if (changed & GRID_ATTR_DIM)
@@ -1494,6 +1979,160 @@ tty_attributes(struct tty *tty, const struct grid_cell *gc,
 		tty_putcode(tty, TTYC_SMACS);
 }
 
+/*
+ * Change to the attributes and colours of gc with a single SGR sequence,
+ * either from the current state (clearing the attributes not wanted with
+ * their own parameters) or from a reset, whichever is shorter. Attributes
+ * which are not plain SGR for this terminal are set separately afterwards.
+ */
+void
+tty_attributes_sgr(struct tty *tty, const struct grid_cell *gc)
+{
+	struct grid_cell	*tc = &tty->cell;
+	u_char			 sgr = tty->term->sgr_attrs, removed, added;
+	char			 reset[128], incr[128], s[32];
+	int			 incremental;
+	u_int			 i;
+
+	/* The alternate charset is not part of SGR. */
+	if ((tc->attr & GRID_ATTR_CHARSET) && (~gc->attr & GRID_ATTR_CHARSET)) {
+		if (tty_use_acs(tty))
+			tty_putcode(tty, TTYC_RMACS);
+		tc->attr &= ~GRID_ATTR_CHARSET;
+	}
+	removed = tc->attr & ~gc->attr;
+
+	/* Build the sequence starting from a reset. */
+	strlcpy(reset, "0", sizeof reset);
+	for (i = 0; i < tty_term_nsgr(); i++) {
+		if (gc->attr & sgr & tty_term_sgr[i].attr) {
+			strlcat(reset, ";", sizeof reset);
+			strlcat(reset, tty_term_sgr[i].on, sizeof reset);
+		}
+	}
+	if (!tty_is_fg(gc, 8)) {
+		tty_sgr_colour(gc, 1, s, sizeof s);
+		strlcat(reset, ";", sizeof reset);
+		strlcat(reset, s, sizeof reset);
+	}
+	if (!tty_is_bg(gc, 8)) {
+		tty_sgr_colour(gc, 0, s, sizeof s);
+		strlcat(reset, ";", sizeof reset);
+		strlcat(reset, s, sizeof reset);
+	}
+
+	/*
+	 * And from the current state. Only possible if everything being
+	 * removed has its own parameter and default colours can be set.
+	 */
+	*incr = '\0';
+	incremental = (removed & ~sgr) == 0;
+	added = gc->attr & ~tc->attr;
+	if (incremental) {
+		for (i = 0; i < tty_term_nsgr(); i++) {
+			if (~removed & tty_term_sgr[i].attr)
+				continue;
+			/* Bright and dim share their parameter. */
+			if (tty_term_sgr[i].attr == GRID_ATTR_DIM &&
+			    (removed & GRID_ATTR_BRIGHT))
+				continue;
+			if (*incr != '\0')
+				strlcat(incr, ";", sizeof incr);
+			strlcat(incr, tty_term_sgr[i].off, sizeof incr);
+		}
+		if (removed & (GRID_ATTR_BRIGHT|GRID_ATTR_DIM))
+			added |= gc->attr & (GRID_ATTR_BRIGHT|GRID_ATTR_DIM);
+		for (i = 0; i < tty_term_nsgr(); i++) {
+			if (added & sgr & tty_term_sgr[i].attr) {
+				if (*incr != '\0')
+					strlcat(incr, ";", sizeof incr);
+				strlcat(incr, tty_term_sgr[i].on, sizeof incr);
+			}
+		}
+	}
+	if (incremental && !tty_same_fg(gc, tc)) {
+		if (tty_is_fg(gc, 8) && !tty_term_flag(tty->term, TTYC_AX))
+			incremental = 0;
+		else {
+			tty_sgr_colour(gc, 1, s, sizeof s);
+			if (*incr != '\0')
+				strlcat(incr, ";", sizeof incr);
+			strlcat(incr, s, sizeof incr);
+		}
+	}
+	if (incremental && !tty_same_bg(gc, tc)) {
+		if (tty_is_bg(gc, 8) && !tty_term_flag(tty->term, TTYC_AX))
+			incremental = 0;
+		else {
+			tty_sgr_colour(gc, 0, s, sizeof s);
+			if (*incr != '\0')
+				strlcat(incr, ";", sizeof incr);
+			strlcat(incr, s, sizeof incr);
+		}
+	}
+
+	if (incremental && strlen(incr) <= strlen(reset)) {
+		if (*incr != '\0') {
+			xsnprintf(s, sizeof s, "\033[%sm", incr);
+			tty_puts(tty, s);
+		}
+	} else {
+		/* ESC [ plus up to 127 characters does not fit in s. */
+		tty_puts(tty, "\033[");
+		tty_puts(tty, reset);
+		tty_puts(tty, "m");
+		tc->attr &= GRID_ATTR_CHARSET;
+	}
+
+	/* The terminal now has the colours and the SGR attributes of gc. */
+	tc->fg = gc->fg;
+	tc->bg = gc->bg;
+	memcpy(&tc->fg_rgb, &gc->fg_rgb, sizeof tc->fg_rgb);
+	memcpy(&tc->bg_rgb, &gc->bg_rgb, sizeof tc->bg_rgb);
+	tc->flags &= ~(GRID_FLAG_FG256|GRID_FLAG_FGRGB|GRID_FLAG_BG256|
+	    GRID_FLAG_BGRGB);
+	tc->flags |= gc->flags & (GRID_FLAG_FG256|GRID_FLAG_FGRGB|
+	    GRID_FLAG_BG256|GRID_FLAG_BGRGB);
+	tc->attr = (tc->attr & ~sgr) | (gc->attr & sgr);
+
+	added = gc->attr & ~tc->attr;
+	tc->attr = gc->attr;
+	tty_attributes_put(tty, added);
+}
+
+/* Get the SGR parameters for the foreground or background colour of gc. */
+void
+tty_sgr_colour(const struct grid_cell *gc, int fg, char *s, size_t len)
+{
+	const struct grid_cell_rgb	*rgb;
+	u_char				 colour;
+	int				 base, is256, isrgb;
+
+	if (fg) {
+		colour = gc->fg;
+		rgb = &gc->fg_rgb;
+		is256 = gc->flags & GRID_FLAG_FG256;
+		isrgb = gc->flags & GRID_FLAG_FGRGB;
+		base = 30;
+	} else {
+		colour = gc->bg;
+		rgb = &gc->bg_rgb;
+		is256 = gc->flags & GRID_FLAG_BG256;
+		isrgb = gc->flags & GRID_FLAG_BGRGB;
+		base = 40;
+	}
+
+	if (isrgb) {
+		xsnprintf(s, len, "%d;2;%hhu;%hhu;%hhu", base + 8, rgb->r,
+		    rgb->g, rgb->b);
+	} else if (is256 && colour >= 8)
+		xsnprintf(s, len, "%d;5;%hhu", base + 8, colour);
+	else if (!is256 && colour >= 90 && colour <= 97)
+		xsnprintf(s, len, "%d", colour + base - 30);
+	else
+		xsnprintf(s, len, "%d", base + colour);
+}
+
 void
 tty_colours(struct tty *tty, const struct grid_cell *gc)
 {
@@ -108,14 +108,62 @@ utf8_append(struct utf8_data *ud, u_char ch)
 	return (UTF8_DONE);
 }
 
-/* Get width of Unicode character. */
+/*
+ * Decode one complete UTF-8 character at the start of buf into ud, returning
+ * its size. Returns 0 for anything else: ASCII, an invalid or incomplete
+ * sequence or a character with no width.
+ */
+size_t
+utf8_next(const u_char *buf, size_t len, struct utf8_data *ud)
+{
+	u_char	ch = buf[0];
+	size_t	size, i;
+	wchar_t	wc;
+	int	width;
+
+	if (ch >= 0xc2 && ch <= 0xdf)
+		size = 2;
+	else if (ch >= 0xe0 && ch <= 0xef)
+		size = 3;
+	else if (ch >= 0xf0 && ch <= 0xf4)
+		size = 4;
+	else
+		return (0);
+	if (len < size)
+		return (0);
+	for (i = 1; i < size; i++) {
+		if ((buf[i] & 0xc0) != 0x80)
+			return (0);
+	}
+
+	memcpy(ud->data, buf, size);
+	ud->have = ud->size = size;
+	if (utf8_combine(ud, &wc) != UTF8_DONE)
+		return (0);
+	if ((width = utf8_width(wc)) < 0)
+		return (0);
+	ud->width = width;
+	return (size);
+}
+
+/*
+ * Get width of Unicode character, from the table in utf8-width.c rather than
+ * wcwidth(3) so it does not depend on the locale or the C library and is the
+ * same on every host.
+ */
 static int
 utf8_width(wchar_t wc)
 {
-	int	width;
+	u_int	cp = wc, block, width;
 
-	width = wcwidth(wc);
-	if (width < 0 || width > 0xff)
+	if (wc < 0 || cp > 0x10ffff)
+		return (-1);
+	if (cp < 0x80)
+		return (cp < 0x20 || cp == 0x7f ? -1 : 1);
+
+	block = utf8_width_index[cp >> 8];
+	width = (utf8_width_blocks[block][(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;
+	if (width == 3)
 		return (-1);
 	return (width);
 }
@@ -124,30 +172,75 @@ utf8_width(wchar_t wc)
 enum utf8_state
 utf8_combine(const struct utf8_data *ud, wchar_t *wc)
 {
-	switch (mbtowc(wc, ud->data, ud->size)) {
-	case -1:
-		mbtowc(NULL, NULL, MB_CUR_MAX);
-		return (UTF8_ERROR);
-	case 0:
-		return (UTF8_ERROR);
+	const u_char	*p = ud->data;
+	u_int		 cp, i;
+
+	switch (ud->size) {
+	case 1:
+		cp = p[0];
+		if (cp >= 0x80)
+			return (UTF8_ERROR);
+		break;
+	case 2:
+		cp = p[0] & 0x1f;
+		break;
+	case 3:
+		cp = p[0] & 0x0f;
+		break;
+	case 4:
+		cp = p[0] & 0x07;
+		break;
 	default:
-		return (UTF8_DONE);
+		return (UTF8_ERROR);
 	}
+	for (i = 1; i < ud->size; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return (UTF8_ERROR);
+		cp = (cp << 6) | (p[i] & 0x3f);
+	}
+
+	/* Reject NUL, overlong forms, surrogates and beyond U+10FFFF. */
+	if (cp == 0)
+		return (UTF8_ERROR);
+	if ((ud->size == 2 && cp < 0x80) ||
+	    (ud->size == 3 && cp < 0x800) ||
+	    (ud->size == 4 && cp < 0x10000))
+		return (UTF8_ERROR);
+	if ((cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return (UTF8_ERROR);
+
+	*wc = cp;
+	return (UTF8_DONE);
 }
 
 /* Split Unicode into UTF-8. */
 enum utf8_state
 utf8_split(wchar_t wc, struct utf8_data *ud)
 {
-	char	s[MB_LEN_MAX];
-	int	slen;
+	u_int	cp = wc;
 
-	slen = wctomb(s, wc);
-	if (slen <= 0 || slen > (int)sizeof ud->data)
+	if (wc <= 0 || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
 		return (UTF8_ERROR);
 
-	memcpy(ud->data, s, slen);
-	ud->size = slen;
+	if (cp < 0x80) {
+		ud->data[0] = cp;
+		ud->size = 1;
+	} else if (cp < 0x800) {
+		ud->data[0] = 0xc0 | (cp >> 6);
+		ud->data[1] = 0x80 | (cp & 0x3f);
+		ud->size = 2;
+	} else if (cp < 0x10000) {
+		ud->data[0] = 0xe0 | (cp >> 12);
+		ud->data[1] = 0x80 | ((cp >> 6) & 0x3f);
+		ud->data[2] = 0x80 | (cp & 0x3f);
+		ud->size = 3;
+	} else {
+		ud->data[0] = 0xf0 | (cp >> 18);
+		ud->data[1] = 0x80 | ((cp >> 12) & 0x3f);
+		ud->data[2] = 0x80 | ((cp >> 6) & 0x3f);
+		ud->data[3] = 0x80 | (cp & 0x3f);
+		ud->size = 4;
+	}
 
 	ud->width = utf8_width(wc);
 	return (UTF8_DONE);
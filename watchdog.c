@@ -0,0 +1,91 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmux.h"
+
+/*
+ * Time the callbacks which do most of the work of the server, to tell which
+ * one held up the event loop when typing stutters. Each kind has a count, the
+ * time spent and the longest run. A run longer than slow-callback-time is
+ * written to the log with what it was working on (a pane, a command) and kept
+ * as the last slow one, shown by show-callbacks with the rest.
+ *
+ * Callbacks may run inside others (a command from a pane read, say), their
+ * time is then in both.
+ */
+
+static struct watchdog_stats watchdog_stats[WATCHDOG_NTYPES];
+
+static const char *watchdog_names[WATCHDOG_NTYPES] = {
+	"pane-read",
+	"client-loop",
+	"command",
+	"tmate-flush",
+	"tmate-ssh",
+};
+
+const char *
+watchdog_name(enum watchdog_type type)
+{
+	return (watchdog_names[type]);
+}
+
+struct watchdog_stats *
+watchdog_get(enum watchdog_type type)
+{
+	return (&watchdog_stats[type]);
+}
+
+void
+watchdog_reset(void)
+{
+	memset(watchdog_stats, 0, sizeof watchdog_stats);
+}
+
+void
+watchdog_start(struct timeval *start)
+{
+	gettimeofday(start, NULL);
+}
+
+/* The context is only formatted for a slow run. */
+void
+watchdog_stop(enum watchdog_type type, struct timeval *start,
+    const char *fmt, ...)
+{
+	struct watchdog_stats	*ws = &watchdog_stats[type];
+	struct timeval		 now, tv;
+	va_list			 ap;
+	uint64_t		 us;
+	u_int			 limit;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &tv);
+	if (tv.tv_sec < 0)
+		return;
+	us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	ws->count++;
+	ws->total_us += us;
+	if (us > ws->max_us)
+		ws->max_us = us;
+
+	limit = options_get_number(global_options, "slow-callback-time");
+	if (limit == 0 || us < (uint64_t)limit * 1000)
+		return;
+
+	ws->slow++;
+	ws->slow_us = us;
+	ws->slow_time = now.tv_sec;
+	va_start(ap, fmt);
+	vsnprintf(ws->slow_context, sizeof ws->slow_context, fmt, ap);
+	va_end(ap);
+
+	log_debug("slow %s: %llu ms (%s)", watchdog_names[type],
+	    (unsigned long long)(us / 1000), ws->slow_context);
+}
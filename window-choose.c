@@ -61,7 +61,6 @@ const struct window_mode window_choose_mode = {
 
 struct window_choose_mode_item {
 	struct window_choose_data	*wcd;
-	char				*name;
 	int				 pos;
 	int				 state;
 #define TREE_EXPANDED 0x1
@@ -90,6 +89,15 @@ int     window_choose_index_key(struct window_choose_mode_data *, key_code);
 void	window_choose_prompt_input(enum window_choose_input_type,
 	    const char *, struct window_pane *, key_code);
 void	window_choose_reset_top(struct window_pane *, u_int);
+const char *window_choose_name(struct window_choose_data *);
+
+/*
+ * Names of sessions and windows are expanded only when the item is drawn, and
+ * kept until any notification bumps the generation. The tree of any other
+ * item only has pointers to a paste buffer, client or window which may be
+ * gone by then, so its name is expanded when it is added.
+ */
+u_int	window_choose_generation;
 
 void
 window_choose_add(struct window_pane *wp, struct window_choose_data *wcd)
@@ -101,14 +109,50 @@ window_choose_add(struct window_pane *wp, struct window_choose_data *wcd)
 	ARRAY_EXPAND(&data->list, 1);
 	item = &ARRAY_LAST(&data->list);
 
-	item->name = format_expand(wcd->ft, wcd->ft_template);
 	item->wcd = wcd;
 	item->pos = ARRAY_LENGTH(&data->list) - 1;
 	item->state = 0;
 
+	if (!wcd->tree_defaults) {
+		window_choose_name(wcd);
+		format_reset(wcd->ft);
+	}
+
 	data->width = xsnprintf(tmp, sizeof tmp , "%d", item->pos);
 }
 
+void
+window_choose_invalidate(void)
+{
+	window_choose_generation++;
+}
+
+const char *
+window_choose_name(struct window_choose_data *wcd)
+{
+	struct session	*s = wcd->tree_session;
+
+	if (wcd->name != NULL && (!wcd->tree_defaults ||
+	    wcd->name_generation == window_choose_generation))
+		return (wcd->name);
+	wcd->name_generation = window_choose_generation;
+
+	if (wcd->tree_defaults) {
+		/* Keep the last name of a session or window which has gone. */
+		if (!session_alive(s) || (wcd->wl != NULL &&
+		    winlink_find_by_index(&s->windows, wcd->idx) != wcd->wl)) {
+			if (wcd->name == NULL)
+				wcd->name = xstrdup("");
+			return (wcd->name);
+		}
+		format_defaults(wcd->ft, NULL, s, wcd->wl, NULL);
+	}
+
+	free(wcd->name);
+	wcd->name = format_expand(wcd->ft, wcd->ft_template);
+	return (wcd->name);
+}
+
 void
 window_choose_set_current(struct window_pane *wp, u_int cur)
 {
@@ -188,6 +232,9 @@ window_choose_data_create(int type, struct client *c, struct session *s)
 
 	wcd->ft = format_create(NULL, 0);
 	wcd->ft_template = NULL;
+	wcd->tree_defaults = 0;
+	wcd->name = NULL;
+	wcd->name_generation = 0;
 
 	wcd->command = NULL;
 
@@ -216,6 +263,7 @@ window_choose_data_free(struct window_choose_data *wcd)
 
 	free(wcd->ft_template);
 	format_free(wcd->ft);
+	free(wcd->name);
 
 	free(wcd->command);
 	free(wcd);
@@ -277,7 +325,6 @@ window_choose_free1(struct window_choose_mode_data *data)
 	for (i = 0; i < ARRAY_LENGTH(&data->old_list); i++) {
 		item = &ARRAY_ITEM(&data->old_list, i);
 		window_choose_data_free(item->wcd);
-		free(item->name);
 	}
 	ARRAY_FREE(&data->list);
 	ARRAY_FREE(&data->old_list);
@@ -783,7 +830,7 @@ window_choose_write_line(struct window_pane *wp, struct screen_write_ctx *ctx,
 		     * expanded or not.
 		     */
 		    (item->wcd->type & TREE_SESSION) ?
-		    (item->state & TREE_EXPANDED ? "-" : "+") : "", item->name);
+		    (item->state & TREE_EXPANDED ? "-" : "+") : "", window_choose_name(item->wcd));
 	}
 	while (s->cx < screen_size_x(s) - 1)
 		screen_write_putc(ctx, &gc, ' ');
@@ -908,7 +955,7 @@ window_choose_add_session(struct window_pane *wp, struct client *c,
 
 	wcd->ft_template = xstrdup(template);
 	format_add(wcd->ft, "line", "%u", idx);
-	format_defaults(wcd->ft, NULL, s, NULL, NULL);
+	wcd->tree_defaults = 1;
 
 	wcd->command = cmd_template_replace(action, s->name, 1);
 
@@ -935,7 +982,7 @@ window_choose_add_window(struct window_pane *wp, struct client *c,
 
 	wcd->ft_template = xstrdup(template);
 	format_add(wcd->ft, "line", "%u", idx);
-	format_defaults(wcd->ft, NULL, s, wl, NULL);
+	wcd->tree_defaults = 1;
 
 	xasprintf(&expanded, "%s:%d", s->name, wl->idx);
 	wcd->command = cmd_template_replace(action, expanded, 1);
@@ -43,12 +43,48 @@ void	window_copy_write_lines(struct window_pane *,
 	    struct screen_write_ctx *, u_int, u_int);
 
 void	window_copy_scroll_to(struct window_pane *, u_int, u_int);
-int	window_copy_search_compare(struct grid *, u_int, u_int, struct grid *,
-	    u_int, int);
-int	window_copy_search_lr(struct grid *, struct grid *, u_int *, u_int,
-	    u_int, u_int, int);
-int	window_copy_search_rl(struct grid *, struct grid *, u_int *, u_int,
-	    u_int, u_int, int);
+
+/*
+ * A search flattens each line into bytes, one cell after another, and looks
+ * for the search string flattened the same way. An ASCII cell is its byte
+ * (lowercased for a case insensitive search), any other cell is 0xff, a byte
+ * with its size and width, then its data. A match only counts if it starts
+ * at a cell, which offs tells; the matching cells then line up.
+ *
+ * With search-regex, the line is flattened to its text instead and the
+ * regular expression run over that.
+ */
+struct window_copy_search {
+	int		 cis;
+	regex_t		*re;
+
+	char		*needle;
+	size_t		 needlelen;
+	u_int		 needlecells;
+	size_t		 skip[256];
+
+	char		*line;
+	size_t		 linelen;
+	u_int		*offs;
+	u_int		 sx;
+};
+
+void	window_copy_search_init(struct window_copy_search *, struct grid *,
+	    int, regex_t *);
+void	window_copy_search_free(struct window_copy_search *);
+void	window_copy_search_flatten(struct window_copy_search *, struct grid *,
+	    u_int);
+int	window_copy_search_find(struct window_copy_search *, size_t, u_int *);
+int	window_copy_search_regex(struct window_copy_search *, size_t,
+	    u_int *);
+int	window_copy_search_compile(struct window_pane *, const char *,
+	    int, regex_t **);
+int	window_copy_search_lr(struct window_copy_search *, struct grid *,
+	    u_int *, u_int, u_int, u_int);
+int	window_copy_search_rl(struct window_copy_search *, struct grid *,
+	    u_int *, u_int, u_int, u_int);
+int	window_copy_search_index(struct window_pane *, struct grid *,
+	    const char *, bitstr_t **);
 void	window_copy_search_up(struct window_pane *, const char *);
 void	window_copy_search_down(struct window_pane *, const char *);
 void	window_copy_goto_line(struct window_pane *, const char *);
@@ -66,6 +102,9 @@ void	window_copy_clear_selection(struct window_pane *);
 void	window_copy_copy_line(struct window_pane *, char **, size_t *, u_int,
 	    u_int, u_int);
 int	window_copy_in_set(struct window_pane *, u_int, u_int, const char *);
+void	window_copy_free_classes(struct window_pane *);
+const u_char *window_copy_line_classes(struct window_pane *, u_int,
+	    const char *, u_int *);
 u_int	window_copy_find_length(struct window_pane *, u_int);
 void	window_copy_cursor_start_of_line(struct window_pane *);
 void	window_copy_cursor_back_to_indentation(struct window_pane *);
@@ -84,6 +123,10 @@ void	window_copy_cursor_next_word_end(struct window_pane *, const char *);
 void	window_copy_cursor_previous_word(struct window_pane *, const char *);
 void	window_copy_scroll_up(struct window_pane *, u_int);
 void	window_copy_scroll_down(struct window_pane *, u_int);
+void	window_copy_defer(struct window_pane *);
+void	window_copy_defer_scroll(struct window_pane *, int);
+void	window_copy_defer_cancel(struct window_pane *);
+void	window_copy_redraw_callback(int, short, void *);
 void	window_copy_rectangle_toggle(struct window_pane *);
 void	window_copy_drag_update(struct client *, struct mouse_event *);
 void	window_copy_drag_release(struct client *, struct mouse_event *);
@@ -112,6 +155,9 @@ window_copy_init(struct window_pane *wp)
 	data->lastcx = 0;
 	data->lastsx = 0;
 
+	data->dirty = NULL;
+	data->scrolled = 0;
+
 	data->backing_written = 0;
 
 	data->rectflag = 0;
@@ -125,12 +171,18 @@ window_copy_init(struct window_pane *wp)
 	data->searchtype = WINDOW_COPY_OFF;
 	data->searchstr = NULL;
 
-	if (wp->fd != -1)
-		bufferevent_disable(wp->event, EV_READ|EV_WRITE);
+	/* With a snapshot, the pane can go on while it is looked at. */
+	if (wp->fd != -1 &&
+	    !options_get_number(wp->window->options, "copy-mode-snapshot"))
+		window_pane_read_enable(wp, 0);
 
 	data->jumptype = WINDOW_COPY_OFF;
 	data->jumpchar = '\0';
 
+	data->classes = NULL;
+	data->class_separators = NULL;
+	data->class_generation = 0;
+
 	s = &data->screen;
 	screen_init(s, screen_size_x(&wp->base), screen_size_y(&wp->base), 0);
 
@@ -161,7 +213,17 @@ window_copy_init_from_pane(struct window_pane *wp, int scroll_exit)
 	if (wp->mode != &window_copy_mode)
 		fatalx("not in copy mode");
 
-	data->backing = &wp->base;
+	if (options_get_number(wp->window->options, "copy-mode-snapshot")) {
+		data->backing = xmalloc(sizeof *data->backing);
+		screen_init(data->backing, screen_size_x(&wp->base),
+		    screen_size_y(&wp->base), 0);
+		grid_destroy(data->backing->grid);
+		data->backing->grid = grid_snapshot(wp->base.grid);
+		data->backing->cx = wp->base.cx;
+		data->backing->cy = wp->base.cy;
+	} else
+		data->backing = &wp->base;
+	grid_reflow_history(data->backing->grid);
 	data->cx = data->backing->cx;
 	data->cy = data->backing->cy;
 	data->scroll_exit = scroll_exit;
@@ -196,11 +258,16 @@ window_copy_free(struct window_pane *wp)
 	struct window_copy_mode_data	*data = wp->modedata;
 
 	if (wp->fd != -1)
-		bufferevent_enable(wp->event, EV_READ|EV_WRITE);
+		window_pane_read_enable(wp, 1);
+
+	window_copy_defer_cancel(wp);
 
 	free(data->searchstr);
 	free(data->inputstr);
 
+	window_copy_free_classes(wp);
+	free(data->class_separators);
+
 	if (data->backing != &wp->base) {
 		screen_free(data->backing);
 		free(data->backing);
@@ -367,6 +434,8 @@ window_copy_resize(struct window_pane *wp, u_int sx, u_int sy)
 	struct screen			*s = &data->screen;
 	struct screen_write_ctx	 	 ctx;
 
+	window_copy_defer_cancel(wp);
+
 	screen_resize(s, sx, sy, 1);
 	if (data->backing != &wp->base)
 		screen_resize(data->backing, sx, sy, 1);
@@ -970,88 +1039,268 @@ window_copy_scroll_to(struct window_pane *wp, u_int px, u_int py)
 	window_copy_redraw_screen(wp);
 }
 
-int
-window_copy_search_compare(struct grid *gd, u_int px, u_int py,
-    struct grid *sgd, u_int spx, int cis)
-{
-	struct grid_cell	 gc, sgc;
-	const struct utf8_data	*ud, *sud;
+#define WINDOW_COPY_SEARCH_CELL (2 + UTF8_SIZE)
 
-	grid_get_cell(gd, px, py, &gc);
-	ud = &gc.data;
-	grid_get_cell(sgd, spx, 0, &sgc);
-	sud = &sgc.data;
+static size_t
+window_copy_search_encode(const struct grid_cell *gc, int cis, char *out)
+{
+	const struct utf8_data	*ud = &gc->data;
 
-	if (ud->size != sud->size || ud->width != sud->width)
-		return (0);
+	if (ud->size == 1 && ud->width == 1 && ud->data[0] < 0x80) {
+		out[0] = cis ? tolower(ud->data[0]) : ud->data[0];
+		return (1);
+	}
 
+	out[0] = 0xff;
+	out[1] = 0x80 | (ud->width << 4) | ud->size;
+	memcpy(out + 2, ud->data, ud->size);
 	if (cis && ud->size == 1)
-		return (tolower(ud->data[0]) == sud->data[0]);
+		out[2] = tolower(ud->data[0]);
+	return (2 + ud->size);
+}
+
+void
+window_copy_search_init(struct window_copy_search *ws, struct grid *sgd,
+    int cis, regex_t *re)
+{
+	struct grid_cell	 gc;
+	size_t			 i;
+	u_int			 x;
 
-	return (memcmp(ud->data, sud->data, ud->size) == 0);
+	memset(ws, 0, sizeof *ws);
+	ws->cis = cis;
+	if ((ws->re = re) != NULL)
+		return;
+
+	/* The search string is as typed, it is not folded. */
+	ws->needlecells = sgd->sx;
+	ws->needle = xmalloc(sgd->sx * WINDOW_COPY_SEARCH_CELL);
+	for (x = 0; x < sgd->sx; x++) {
+		grid_get_cell(sgd, x, 0, &gc);
+		ws->needlelen += window_copy_search_encode(&gc, 0,
+		    ws->needle + ws->needlelen);
+	}
+
+	/* Horspool's bad character table. */
+	for (i = 0; i < 256; i++)
+		ws->skip[i] = ws->needlelen;
+	for (i = 0; i + 1 < ws->needlelen; i++)
+		ws->skip[(u_char)ws->needle[i]] = ws->needlelen - 1 - i;
+}
+
+void
+window_copy_search_free(struct window_copy_search *ws)
+{
+	free(ws->needle);
+	free(ws->line);
+	free(ws->offs);
+}
+
+void
+window_copy_search_flatten(struct window_copy_search *ws, struct grid *gd,
+    u_int py)
+{
+	struct grid_cell	 gc;
+	u_int			 x;
+
+	if (ws->sx != gd->sx) {
+		ws->sx = gd->sx;
+		ws->line = xrealloc(ws->line,
+		    gd->sx * WINDOW_COPY_SEARCH_CELL + 1);
+		ws->offs = xreallocarray(ws->offs, gd->sx + 1,
+		    sizeof *ws->offs);
+	}
+
+	ws->linelen = 0;
+	for (x = 0; x < gd->sx; x++) {
+		ws->offs[x] = ws->linelen;
+		grid_get_cell(gd, x, py, &gc);
+		if (ws->re == NULL) {
+			ws->linelen += window_copy_search_encode(&gc, ws->cis,
+			    ws->line + ws->linelen);
+		} else if (~gc.flags & GRID_FLAG_PADDING) {
+			memcpy(ws->line + ws->linelen, gc.data.data,
+			    gc.data.size);
+			ws->linelen += gc.data.size;
+		}
+	}
+	ws->offs[x] = ws->linelen;
+	ws->line[ws->linelen] = '\0';
 }
 
+/* Find the first match starting on a cell at or after byte from. */
 int
-window_copy_search_lr(struct grid *gd,
-    struct grid *sgd, u_int *ppx, u_int py, u_int first, u_int last, int cis)
+window_copy_search_find(struct window_copy_search *ws, size_t from,
+    u_int *px)
 {
-	u_int	ax, bx, px;
-	int	matched;
+	const u_char	*line = ws->line, *needle = ws->needle;
+	size_t		 n = ws->needlelen, pos, i;
+	u_int		 lo, hi, mid;
 
-	for (ax = first; ax < last; ax++) {
-		if (ax + sgd->sx >= gd->sx)
-			break;
-		for (bx = 0; bx < sgd->sx; bx++) {
-			px = ax + bx;
-			matched = window_copy_search_compare(gd, px, py, sgd,
-			    bx, cis);
-			if (!matched)
-				break;
+	if (ws->re != NULL)
+		return (window_copy_search_regex(ws, from, px));
+	if (n == 0)
+		return (0);
+
+	for (pos = from; pos + n <= ws->linelen;) {
+		for (i = n; i > 0 && line[pos + i - 1] == needle[i - 1]; i--)
+			/* nothing */;
+		if (i > 0) {
+			pos += ws->skip[line[pos + n - 1]];
+			continue;
+		}
+
+		lo = 0;
+		hi = ws->sx;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (ws->offs[mid] < pos)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		if (bx == sgd->sx) {
-			*ppx = ax;
+		if (lo < ws->sx && ws->offs[lo] == pos) {
+			*px = lo;
 			return (1);
 		}
+		pos++;
 	}
 	return (0);
 }
 
+/* Find the first regular expression match starting on a cell. */
 int
-window_copy_search_rl(struct grid *gd,
-    struct grid *sgd, u_int *ppx, u_int py, u_int first, u_int last, int cis)
+window_copy_search_regex(struct window_copy_search *ws, size_t from,
+    u_int *px)
 {
-	u_int	ax, bx, px;
-	int	matched;
-
-	for (ax = last + 1; ax > first; ax--) {
-		if (gd->sx - (ax - 1) < sgd->sx)
-			continue;
-		for (bx = 0; bx < sgd->sx; bx++) {
-			px = ax - 1 + bx;
-			matched = window_copy_search_compare(gd, px, py, sgd,
-			    bx, cis);
-			if (!matched)
-				break;
+	regmatch_t	m;
+	size_t		pos;
+	u_int		lo, hi, mid;
+
+	while (from <= ws->linelen) {
+		if (regexec(ws->re, ws->line + from, 1, &m,
+		    from == 0 ? 0 : REG_NOTBOL) != 0)
+			return (0);
+		pos = from + m.rm_so;
+
+		lo = 0;
+		hi = ws->sx;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (ws->offs[mid] < pos)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		if (bx == sgd->sx) {
-			*ppx = ax - 1;
+		/* Padding cells take no bytes, skip to the cell after. */
+		while (lo + 1 < ws->sx && ws->offs[lo + 1] == pos)
+			lo++;
+		if (lo < ws->sx && ws->offs[lo] == pos) {
+			*px = lo;
 			return (1);
 		}
+		from = pos + 1;
 	}
 	return (0);
 }
 
+int
+window_copy_search_lr(struct window_copy_search *ws, struct grid *gd,
+    u_int *ppx, u_int py, u_int first, u_int last)
+{
+	u_int	ax;
+
+	if (first >= gd->sx)
+		return (0);
+
+	window_copy_search_flatten(ws, gd, py);
+	if (!window_copy_search_find(ws, ws->offs[first], &ax))
+		return (0);
+	if (ax >= last || ax + ws->needlecells >= gd->sx)
+		return (0);
+	*ppx = ax;
+	return (1);
+}
+
+int
+window_copy_search_rl(struct window_copy_search *ws, struct grid *gd,
+    u_int *ppx, u_int py, u_int first, u_int last)
+{
+	u_int	ax, found;
+	int	n = 0;
+
+	window_copy_search_flatten(ws, gd, py);
+	for (ax = first; ax < gd->sx; ax++) {
+		if (!window_copy_search_find(ws, ws->offs[ax], &ax))
+			break;
+		if (ax > last || gd->sx - ax < ws->needlecells)
+			break;
+		found = ax;
+		n = 1;
+	}
+	if (n)
+		*ppx = found;
+	return (n);
+}
+
+/*
+ * A search string is a regular expression if search-regex is on, otherwise re
+ * is set to NULL. Returns -1 if it does not compile.
+ */
+int
+window_copy_search_compile(struct window_pane *wp, const char *searchstr,
+    int cis, regex_t **re)
+{
+	char	*cause;
+	int	 cflags;
+
+	*re = NULL;
+	if (!options_get_number(wp->window->options, "search-regex"))
+		return (0);
+
+	cflags = REG_EXTENDED;
+	if (cis)
+		cflags |= REG_ICASE;
+	if ((*re = regex_cache_get(searchstr, cflags, &cause)) == NULL) {
+		log_debug("%s", cause);
+		free(cause);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Get the history lines which may match from the index, if search-index is
+ * on. Returns 0 if all lines must be searched, including for a regular
+ * expression.
+ */
+int
+window_copy_search_index(struct window_pane *wp, struct grid *gd,
+    const char *searchstr, bitstr_t **lines)
+{
+	if (options_get_number(wp->window->options, "search-regex"))
+		return (0);
+	if (!options_get_number(wp->window->options, "search-index")) {
+		grid_index_disable(gd);
+		return (0);
+	}
+	return (grid_index_query(gd, searchstr, lines));
+}
+
 void
 window_copy_search_up(struct window_pane *wp, const char *searchstr)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct screen			*s = data->backing, ss;
 	struct screen_write_ctx		 ctx;
-	struct grid			*gd = s->grid, *sgd;
+	struct grid			*gd = s->grid;
 	struct grid_cell	 	 gc;
+	struct window_copy_search	 ws;
+	regex_t				*re;
+	bitstr_t			*lines;
 	size_t				 searchlen;
 	u_int				 i, last, fx, fy, px;
-	int				 n, wrapped, wrapflag, cis;
+	int				 n, wrapped, wrapflag, cis, indexed;
 	const char			*ptr;
 
 #ifdef TMATE
@@ -1090,13 +1339,22 @@ window_copy_search_up(struct window_pane *wp, const char *searchstr)
 		}
 	}
 
+	if (window_copy_search_compile(wp, searchstr, cis, &re) != 0) {
+		screen_free(&ss);
+		return;
+	}
+	window_copy_search_init(&ws, ss.grid, cis, re);
+	screen_free(&ss);
+	indexed = window_copy_search_index(wp, gd, searchstr, &lines);
+
 retry:
-	sgd = ss.grid;
 	for (i = fy + 1; i > 0; i--) {
+		if (indexed && i - 1 < gd->hsize && !bit_test(lines, i - 1))
+			continue;
 		last = screen_size_x(s);
 		if (i == fy + 1)
 			last = fx;
-		n = window_copy_search_rl(gd, sgd, &px, i - 1, 0, last, cis);
+		n = window_copy_search_rl(&ws, gd, &px, i - 1, 0, last);
 		if (n) {
 			window_copy_scroll_to(wp, px, i - 1);
 			break;
@@ -1109,7 +1367,9 @@ retry:
 		goto retry;
 	}
 
-	screen_free(&ss);
+	if (indexed)
+		free(lines);
+	window_copy_search_free(&ws);
 }
 
 void
@@ -1118,11 +1378,14 @@ window_copy_search_down(struct window_pane *wp, const char *searchstr)
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct screen			*s = data->backing, ss;
 	struct screen_write_ctx		 ctx;
-	struct grid			*gd = s->grid, *sgd;
+	struct grid			*gd = s->grid;
 	struct grid_cell	 	 gc;
+	struct window_copy_search	 ws;
+	regex_t				*re;
+	bitstr_t			*lines;
 	size_t				 searchlen;
 	u_int				 i, first, fx, fy, px;
-	int				 n, wrapped, wrapflag, cis;
+	int				 n, wrapped, wrapflag, cis, indexed;
 	const char			*ptr;
 
 #ifdef TMATE
@@ -1161,14 +1424,22 @@ window_copy_search_down(struct window_pane *wp, const char *searchstr)
 		}
 	}
 
+	if (window_copy_search_compile(wp, searchstr, cis, &re) != 0) {
+		screen_free(&ss);
+		return;
+	}
+	window_copy_search_init(&ws, ss.grid, cis, re);
+	screen_free(&ss);
+	indexed = window_copy_search_index(wp, gd, searchstr, &lines);
+
 retry:
-	sgd = ss.grid;
 	for (i = fy + 1; i < gd->hsize + gd->sy + 1; i++) {
+		if (indexed && i - 1 < gd->hsize && !bit_test(lines, i - 1))
+			continue;
 		first = 0;
 		if (i == fy + 1)
 			first = fx;
-		n = window_copy_search_lr(gd, sgd, &px, i - 1, first, gd->sx,
-		    cis);
+		n = window_copy_search_lr(&ws, gd, &px, i - 1, first, gd->sx);
 		if (n) {
 			window_copy_scroll_to(wp, px, i - 1);
 			break;
@@ -1181,7 +1452,9 @@ retry:
 		goto retry;
 	}
 
-	screen_free(&ss);
+	if (indexed)
+		free(lines);
+	window_copy_search_free(&ws);
 }
 
 void
@@ -1302,6 +1575,12 @@ window_copy_redraw_lines(struct window_pane *wp, u_int py, u_int ny)
 	struct screen_write_ctx	 	 ctx;
 	u_int				 i;
 
+	if (data->dirty != NULL) {
+		for (i = py; i < py + ny && i < screen_size_y(&data->screen); i++)
+			bit_set(data->dirty, i);
+		return;
+	}
+
 	screen_write_start(&ctx, wp, NULL);
 	for (i = py; i < py + ny; i++)
 		window_copy_write_line(wp, &ctx, i);
@@ -1331,7 +1610,7 @@ window_copy_update_cursor(struct window_pane *wp, u_int cx, u_int cy)
 		window_copy_redraw_lines(wp, old_cy, 1);
 	if (data->cx == screen_size_x(s))
 		window_copy_redraw_lines(wp, data->cy, 1);
-	else {
+	else if (data->dirty == NULL) {
 		screen_write_start(&ctx, wp, NULL);
 		screen_write_cursormove(&ctx, data->cx, data->cy);
 		screen_write_stop(&ctx);
@@ -1570,8 +1849,7 @@ window_copy_append_selection(struct window_pane *wp, const char *bufname)
 {
 	char				*buf;
 	struct paste_buffer		*pb;
-	const char			*bufdata;
-	size_t				 len, bufsize;
+	size_t				 len;
 	struct screen_write_ctx		 ctx;
 
 	buf = window_copy_get_selection(wp, &len);
@@ -1588,14 +1866,7 @@ window_copy_append_selection(struct window_pane *wp, const char *bufname)
 		pb = paste_get_top(&bufname);
 	else
 		pb = paste_get_name(bufname);
-	if (pb != NULL) {
-		bufdata = paste_buffer_data(pb, &bufsize);
-		buf = xrealloc(buf, len + bufsize);
-		memmove(buf + bufsize, buf, len);
-		memcpy(buf, bufdata, bufsize);
-		len += bufsize;
-	}
-	if (paste_set(buf, len, bufname, NULL) != 0)
+	if (paste_append(pb, buf, len, bufname, NULL) != 0)
 		free(buf);
 }
 
@@ -1690,6 +1961,75 @@ window_copy_in_set(struct window_pane *wp, u_int px, u_int py, const char *set)
 	return (strchr(set, *ud->data) != NULL);
 }
 
+void
+window_copy_free_classes(struct window_pane *wp)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+	u_int				 i;
+
+	if (data->classes == NULL)
+		return;
+	for (i = 0; i < WINDOW_COPY_CLASS_LINES + 1; i++)
+		free(data->classes[i].classes);
+	free(data->classes);
+	data->classes = NULL;
+}
+
+/*
+ * Get whether each cell of a line up to and including its length is in the
+ * separators, and the length. History lines do not change, so these are kept
+ * for the last lines used until the separators change or the grid's history
+ * is rewritten or renumbered (its cache_generation changes); a visible line,
+ * in the last slot, is done again each time. The result is good until the
+ * next call.
+ */
+const u_char *
+window_copy_line_classes(struct window_pane *wp, u_int py,
+    const char *separators, u_int *length)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+	struct grid			*gd = data->backing->grid;
+	struct window_copy_classes	*wcc;
+	uint64_t			 line = 0;
+	u_int				 px, i;
+
+	if (data->classes == NULL) {
+		data->classes = xcalloc(WINDOW_COPY_CLASS_LINES + 1,
+		    sizeof *data->classes);
+	}
+	if (data->class_separators == NULL ||
+	    strcmp(data->class_separators, separators) != 0 ||
+	    data->class_generation != gd->cache_generation) {
+		for (i = 0; i < WINDOW_COPY_CLASS_LINES; i++)
+			data->classes[i].line = 0;
+		free(data->class_separators);
+		data->class_separators = xstrdup(separators);
+		data->class_generation = gd->cache_generation;
+	}
+
+	if (py < gd->hsize) {
+		line = gd->hremoved + py + 1;
+		wcc = &data->classes[line % WINDOW_COPY_CLASS_LINES];
+		if (wcc->line == line) {
+			*length = wcc->length;
+			return (wcc->classes);
+		}
+	} else
+		wcc = &data->classes[WINDOW_COPY_CLASS_LINES];
+
+	wcc->length = window_copy_find_length(wp, py);
+	if (wcc->length + 1 > wcc->size) {
+		wcc->size = wcc->length + 1;
+		wcc->classes = xrealloc(wcc->classes, wcc->size);
+	}
+	for (px = 0; px <= wcc->length; px++)
+		wcc->classes[px] = window_copy_in_set(wp, px, py, separators);
+	wcc->line = line;
+
+	*length = wcc->length;
+	return (wcc->classes);
+}
+
 u_int
 window_copy_find_length(struct window_pane *wp, u_int py)
 {
@@ -2079,12 +2419,13 @@ window_copy_cursor_next_word(struct window_pane *wp, const char *separators)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct screen			*back_s = data->backing;
+	const u_char			*classes;
 	u_int				 px, py, xx, yy;
 	int				 expected = 0;
 
 	px = data->cx;
 	py = screen_hsize(back_s) + data->cy - data->oy;
-	xx = window_copy_find_length(wp, py);
+	classes = window_copy_line_classes(wp, py, separators, &xx);
 	yy = screen_hsize(back_s) + screen_size_y(back_s) - 1;
 
 	/*
@@ -2094,8 +2435,7 @@ window_copy_cursor_next_word(struct window_pane *wp, const char *separators)
 	 * latter.
 	 */
 	do {
-		while (px > xx ||
-		    window_copy_in_set(wp, px, py, separators) == expected) {
+		while (px > xx || classes[px] == expected) {
 			/* Move down if we're past the end of the line. */
 			if (px > xx) {
 				if (py == yy)
@@ -2104,7 +2444,8 @@ window_copy_cursor_next_word(struct window_pane *wp, const char *separators)
 				px = 0;
 
 				py = screen_hsize(back_s) + data->cy - data->oy;
-				xx = window_copy_find_length(wp, py);
+				classes = window_copy_line_classes(wp, py,
+				    separators, &xx);
 			} else
 				px++;
 		}
@@ -2123,12 +2464,13 @@ window_copy_cursor_next_word_end(struct window_pane *wp,
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct options			*oo = wp->window->options;
 	struct screen			*back_s = data->backing;
+	const u_char			*classes;
 	u_int				 px, py, xx, yy;
 	int				 keys, expected = 1;
 
 	px = data->cx;
 	py = screen_hsize(back_s) + data->cy - data->oy;
-	xx = window_copy_find_length(wp, py);
+	classes = window_copy_line_classes(wp, py, separators, &xx);
 	yy = screen_hsize(back_s) + screen_size_y(back_s) - 1;
 
 	keys = options_get_number(oo, "mode-keys");
@@ -2142,8 +2484,7 @@ window_copy_cursor_next_word_end(struct window_pane *wp,
 	 * latter.
 	 */
 	do {
-		while (px > xx ||
-		    window_copy_in_set(wp, px, py, separators) == expected) {
+		while (px > xx || classes[px] == expected) {
 			/* Move down if we're past the end of the line. */
 			if (px > xx) {
 				if (py == yy)
@@ -2152,7 +2493,8 @@ window_copy_cursor_next_word_end(struct window_pane *wp,
 				px = 0;
 
 				py = screen_hsize(back_s) + data->cy - data->oy;
-				xx = window_copy_find_length(wp, py);
+				classes = window_copy_line_classes(wp, py,
+				    separators, &xx);
 			} else
 				px++;
 		}
@@ -2173,16 +2515,19 @@ window_copy_cursor_previous_word(struct window_pane *wp,
     const char *separators)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
-	u_int				 px, py;
+	const u_char			*classes;
+	u_int				 px, py, xx;
 
 	px = data->cx;
 	py = screen_hsize(data->backing) + data->cy - data->oy;
+	classes = window_copy_line_classes(wp, py, separators, &xx);
 
 	/* Move back to the previous word character. */
 	for (;;) {
 		if (px > 0) {
 			px--;
-			if (!window_copy_in_set(wp, px, py, separators))
+			if (px <= xx ? !classes[px] :
+			    !window_copy_in_set(wp, px, py, separators))
 				break;
 		} else {
 			if (data->cy == 0 &&
@@ -2192,12 +2537,15 @@ window_copy_cursor_previous_word(struct window_pane *wp,
 			window_copy_cursor_up(wp, 0);
 
 			py = screen_hsize(data->backing) + data->cy - data->oy;
-			px = window_copy_find_length(wp, py);
+			classes = window_copy_line_classes(wp, py, separators,
+			    &xx);
+			px = xx;
 		}
 	}
 
 	/* Move back to the beginning of this word. */
-	while (px > 0 && !window_copy_in_set(wp, px - 1, py, separators))
+	while (px > 0 && (px - 1 <= xx ? !classes[px - 1] :
+	    !window_copy_in_set(wp, px - 1, py, separators)))
 		px--;
 
 out:
@@ -2211,7 +2559,6 @@ window_copy_scroll_up(struct window_pane *wp, u_int ny)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct screen			*s = &data->screen;
-	struct screen_write_ctx		 ctx;
 
 	if (data->oy < ny)
 		ny = data->oy;
@@ -2221,19 +2568,14 @@ window_copy_scroll_up(struct window_pane *wp, u_int ny)
 
 	window_copy_update_selection(wp, 0);
 
-	screen_write_start(&ctx, wp, NULL);
-	screen_write_cursormove(&ctx, 0, 0);
-	screen_write_deleteline(&ctx, ny);
-	window_copy_write_lines(wp, &ctx, screen_size_y(s) - ny, ny);
-	window_copy_write_line(wp, &ctx, 0);
+	window_copy_defer_scroll(wp, -(int)ny);
+	window_copy_redraw_lines(wp, 0, 1);
 	if (screen_size_y(s) > 1)
-		window_copy_write_line(wp, &ctx, 1);
+		window_copy_redraw_lines(wp, 1, 1);
 	if (screen_size_y(s) > 3)
-		window_copy_write_line(wp, &ctx, screen_size_y(s) - 2);
+		window_copy_redraw_lines(wp, screen_size_y(s) - 2, 1);
 	if (s->sel.flag && screen_size_y(s) > ny)
-		window_copy_write_line(wp, &ctx, screen_size_y(s) - ny - 1);
-	screen_write_cursormove(&ctx, data->cx, data->cy);
-	screen_write_stop(&ctx);
+		window_copy_redraw_lines(wp, screen_size_y(s) - ny - 1, 1);
 }
 
 void
@@ -2241,7 +2583,6 @@ window_copy_scroll_down(struct window_pane *wp, u_int ny)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct screen			*s = &data->screen;
-	struct screen_write_ctx		 ctx;
 
 	if (ny > screen_hsize(data->backing))
 		return;
@@ -2254,16 +2595,107 @@ window_copy_scroll_down(struct window_pane *wp, u_int ny)
 
 	window_copy_update_selection(wp, 0);
 
-	screen_write_start(&ctx, wp, NULL);
-	screen_write_cursormove(&ctx, 0, 0);
-	screen_write_insertline(&ctx, ny);
-	window_copy_write_lines(wp, &ctx, 0, ny);
+	window_copy_defer_scroll(wp, ny);
 	if (s->sel.flag && screen_size_y(s) > ny)
-		window_copy_write_line(wp, &ctx, ny);
+		window_copy_redraw_lines(wp, ny, 1);
 	else if (ny == 1) /* nuke position */
-		window_copy_write_line(wp, &ctx, 1);
+		window_copy_redraw_lines(wp, 1, 1);
+}
+
+/*
+ * Scrolling is drawn at the end of the loop rather than as it happens, so a
+ * held key or the mouse wheel moving many lines costs one redraw. Until then
+ * dirty marks the lines to be written, in the coordinates of the screen after
+ * the pending scroll, and window_copy_redraw_lines only marks them.
+ */
+void
+window_copy_defer(struct window_pane *wp)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+	struct timeval			 tv = { 0, 0 };
+
+	if (data->dirty != NULL)
+		return;
+
+	data->dirty = bit_alloc(screen_size_y(&data->screen));
+	if (data->dirty == NULL)
+		fatal("bit_alloc failed");
+	data->scrolled = 0;
+
+	evtimer_set(&data->redraw_timer, window_copy_redraw_callback, wp);
+	evtimer_add(&data->redraw_timer, &tv);
+}
+
+/* Move the screen by ny lines, down if positive, marking the lines exposed. */
+void
+window_copy_defer_scroll(struct window_pane *wp, int ny)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+	u_int				 sy = screen_size_y(&data->screen);
+	int				 i, from;
+
+	window_copy_defer(wp);
+	data->scrolled += ny;
+
+	if (ny < 0) {
+		for (i = 0; i < (int)sy; i++) {
+			from = i - ny;
+			if (from < (int)sy && !bit_test(data->dirty, from))
+				bit_clear(data->dirty, i);
+			else
+				bit_set(data->dirty, i);
+		}
+	} else {
+		for (i = sy - 1; i >= 0; i--) {
+			from = i - ny;
+			if (from >= 0 && !bit_test(data->dirty, from))
+				bit_clear(data->dirty, i);
+			else
+				bit_set(data->dirty, i);
+		}
+	}
+}
+
+void
+window_copy_defer_cancel(struct window_pane *wp)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+
+	if (data->dirty == NULL)
+		return;
+	evtimer_del(&data->redraw_timer);
+	free(data->dirty);
+	data->dirty = NULL;
+}
+
+void
+window_copy_redraw_callback(__unused int fd, __unused short events, void *arg)
+{
+	struct window_pane		*wp = arg;
+	struct window_copy_mode_data	*data = wp->modedata;
+	struct screen_write_ctx		 ctx;
+	bitstr_t			*dirty = data->dirty;
+	u_int				 sy = screen_size_y(&data->screen), i;
+	int				 ny = data->scrolled;
+
+	data->dirty = NULL;
+
+	screen_write_start(&ctx, wp, NULL);
+	if (ny != 0 && (u_int)abs(ny) < sy) {
+		screen_write_cursormove(&ctx, 0, 0);
+		if (ny < 0)
+			screen_write_deleteline(&ctx, -ny);
+		else
+			screen_write_insertline(&ctx, ny);
+	}
+	for (i = 0; i < sy; i++) {
+		if (bit_test(dirty, i))
+			window_copy_write_line(wp, &ctx, i);
+	}
 	screen_write_cursormove(&ctx, data->cx, data->cy);
 	screen_write_stop(&ctx);
+
+	free(dirty);
 }
 
 int
@@ -2333,4 +2765,7 @@ window_copy_drag_update(__unused struct client *c, struct mouse_event *m)
 	window_copy_update_cursor(wp, x, y);
 	if (window_copy_update_selection(wp, 1))
 		window_copy_redraw_selection(wp, old_cy);
+#ifdef TMATE
+	tmate_sync_copy_mode(wp);
+#endif
 }
@@ -40,6 +40,15 @@ enum window_copy_input_type {
 typedef void (*copy_password_callback)(const char *password, void *private);
 #endif
 
+/* Classes of the cells of a line for word motions, see window-copy.c. */
+#define WINDOW_COPY_CLASS_LINES 64
+struct window_copy_classes {
+	uint64_t		 line;		/* absolute line + 1, 0 if none */
+	u_int			 length;
+	u_char			*classes;
+	u_int			 size;
+};
+
 struct window_copy_mode_data {
 	struct screen		 screen;
 
@@ -62,6 +71,10 @@ struct window_copy_mode_data {
 	u_int			 lastcx; /* position in last line w/ content */
 	u_int			 lastsx; /* size of last line w/ content */
 
+	bitstr_t		*dirty;	/* lines to draw, if deferred */
+	int			 scrolled; /* lines scrolled, not yet drawn */
+	struct event		 redraw_timer;
+
 	enum window_copy_input_type inputtype;
 	const char		*inputprompt;
 	char			*inputstr;
@@ -75,6 +88,10 @@ struct window_copy_mode_data {
 	enum window_copy_input_type jumptype;
 	char			 jumpchar;
 
+	struct window_copy_classes *classes;
+	char			*class_separators;
+	u_int			 class_generation;
+
 #ifdef TMATE
 	copy_password_callback	password_cb;
 	void        	    	*password_cb_private;
@@ -20,7 +20,6 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <fnmatch.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -53,17 +52,112 @@
 /* Global window list. */
 struct windows windows;
 
+/*
+ * Windows with something for server_client_loop to do: a redraw or layout
+ * change, a pane to resize, focus, clear or rename from. Whatever sets one of
+ * those queues the window, so the loop does not look at every window and pane.
+ */
+struct windows_dirty dirty_windows = TAILQ_HEAD_INITIALIZER(dirty_windows);
+
 /* Global panes tree. */
 struct window_pane_tree all_window_panes;
 u_int	next_window_pane_id;
+
+/*
+ * Paste buffers being fed to a pane. Only about WINDOW_PANE_PASTE_SIZE bytes
+ * are given to the pane at a time, and more is added as its output drains,
+ * so a large paste does not sit in the output buffer as a second copy and
+ * the program is not given more than it is reading. Pastes are queued and
+ * go to the pane in order.
+ */
+#define WINDOW_PANE_PASTE_SIZE 16384
+
+struct window_pane_paste {
+	struct paste_buffer	*pb;	/* held copy */
+	u_int			 piece;
+	size_t			 off;
+
+	char			*sepstr;
+	int			 bracket;
+	int			 started;
+
+	TAILQ_ENTRY(window_pane_paste) entry;
+};
+
+/* Longest a synchronized update may hold back output, in milliseconds. */
+#define WINDOW_PANE_SYNC_TIME 1000
+
+/*
+ * Panes indexed by id, for lookups. Ids are never reused so this only grows,
+ * but it is one pointer per pane ever created.
+ */
+struct window_pane **window_pane_table;
+u_int	window_pane_table_size;
 u_int	next_window_id;
 u_int	next_active_point;
 
+/* Time spent parsing pane output since the last loop, in microseconds. */
+long	window_pane_budget;
+
+/*
+ * After a resize, the history not reflowed straight away is reflowed a block
+ * at a time from this timer, so that it is mostly done before anything needs
+ * it, without holding up the redraw. A pane in a mode has all its history
+ * reflowed already, and the mode keeps positions in it.
+ */
+#define WINDOW_REFLOW_BLOCKS 4
+struct event	window_reflow_timer;
+
 void	window_pane_timer_callback(int, short, void *);
+void	window_pane_read_ready(int, short, void *);
+void	window_pane_read_update(struct window_pane *);
 void	window_pane_read_callback(struct bufferevent *, void *);
+void	window_pane_write_callback(struct bufferevent *, void *);
 void	window_pane_error_callback(struct bufferevent *, short, void *);
+void	window_pane_sync_callback(int, short, void *);
+void	window_pane_read_adapt(struct window_pane *, size_t);
+int	window_pane_throttle(struct window_pane *);
+void	window_reflow_callback(int, short, void *);
+void	window_reflow_schedule(void);
 
 struct window_pane *window_pane_choose_best(struct window_pane **, u_int);
+void	window_pane_paste1(struct window_pane *, const char *, size_t, int);
+void	window_pane_paste_fill(struct window_pane *);
+void	window_pane_paste_free(struct window_pane *, struct window_pane_paste *);
+
+enum window_cell_field {
+	WINDOW_CELL_PANE,
+	WINDOW_CELL_HIT,
+	WINDOW_CELL_BORDER
+};
+
+void	window_build_cellmap(struct window *);
+void	window_paint_cellmap(struct window *, u_int, u_int, u_int, u_int,
+	    enum window_cell_field, u_int);
+
+/*
+ * Border cell type from whether the cells to the left (bit 4), right, top and
+ * bottom (bit 1) are borders. Only one bit set doesn't make sense (can't have
+ * a border cell with no others connected).
+ */
+static const u_char window_cell_types[16] = {
+	CELL_OUTSIDE,		/* 0000 */
+	CELL_OUTSIDE,		/* 0001 */
+	CELL_OUTSIDE,		/* 0010 */
+	CELL_LEFTRIGHT,		/* 0011, top bottom */
+	CELL_OUTSIDE,		/* 0100 */
+	CELL_TOPLEFT,		/* 0101, right bottom */
+	CELL_BOTTOMLEFT,	/* 0110, right top */
+	CELL_LEFTJOIN,		/* 0111, right top bottom */
+	CELL_OUTSIDE,		/* 1000 */
+	CELL_TOPRIGHT,		/* 1001, left bottom */
+	CELL_BOTTOMRIGHT,	/* 1010, left top */
+	CELL_RIGHTJOIN,		/* 1011, left top bottom */
+	CELL_TOPBOTTOM,		/* 1100, left right */
+	CELL_TOPJOIN,		/* 1101, left right bottom */
+	CELL_BOTTOMJOIN,	/* 1110, left right top */
+	CELL_JOIN		/* 1111, left right top bottom */
+};
 
 RB_GENERATE(windows, window, entry, window_cmp);
 
@@ -92,14 +186,19 @@ window_pane_cmp(struct window_pane *wp1, struct window_pane *wp2)
 struct winlink *
 winlink_find_by_window(struct winlinks *wwl, struct window *w)
 {
-	struct winlink	*wl;
+	struct winlink	*wl, *found = NULL;
 
-	RB_FOREACH(wl, winlinks, wwl) {
-		if (wl->window == w)
-			return (wl);
+	/*
+	 * A window is linked to few places, so look through those for the
+	 * lowest index in this tree.
+	 */
+	TAILQ_FOREACH(wl, &w->winlinks, wentry) {
+		if (found != NULL && wl->idx >= found->idx)
+			continue;
+		if (winlink_find_by_index(wwl, wl->idx) == wl)
+			found = wl;
 	}
-
-	return (NULL);
+	return (found);
 }
 
 struct winlink *
@@ -117,13 +216,11 @@ winlink_find_by_index(struct winlinks *wwl, int idx)
 struct winlink *
 winlink_find_by_window_id(struct winlinks *wwl, u_int id)
 {
-	struct winlink *wl;
+	struct window	*w;
 
-	RB_FOREACH(wl, winlinks, wwl) {
-		if (wl->window->id == id)
-			return (wl);
-	}
-	return (NULL);
+	if ((w = window_find_by_id(id)) == NULL)
+		return (NULL);
+	return (winlink_find_by_window(wwl, w));
 }
 
 int
@@ -178,6 +275,7 @@ void
 winlink_set_window(struct winlink *wl, struct window *w)
 {
 	wl->window = w;
+	TAILQ_INSERT_TAIL(&w->winlinks, wl, wentry);
 	w->references++;
 }
 
@@ -187,6 +285,8 @@ winlink_remove(struct winlinks *wwl, struct winlink *wl)
 	struct window	*w = wl->window;
 
 	RB_REMOVE(winlinks, wwl, wl);
+	if (w != NULL)
+		TAILQ_REMOVE(&w->winlinks, wl, wentry);
 	free(wl->status_text);
 	free(wl);
 
@@ -281,10 +381,20 @@ window_find_by_id(u_int id)
 void
 window_update_activity(struct window *w)
 {
-	gettimeofday(&w->activity_time, NULL);
+	/* Called for every read from a pane, the loop time is close enough. */
+	event_base_gettimeofday_cached(NULL, &w->activity_time);
 	alerts_queue(w, WINDOW_ACTIVITY);
 }
 
+void
+window_enqueue(struct window *w)
+{
+	if (!w->dirty_queued) {
+		w->dirty_queued = 1;
+		TAILQ_INSERT_TAIL(&dirty_windows, w, dirty_entry);
+	}
+}
+
 struct window *
 window_create1(u_int sx, u_int sy)
 {
@@ -296,6 +406,7 @@ window_create1(u_int sx, u_int sy)
 
 	TAILQ_INIT(&w->panes);
 	w->active = NULL;
+	TAILQ_INIT(&w->winlinks);
 
 #ifdef TMATE
 	w->tmate_last_sync_active_pane = NULL;
@@ -303,6 +414,8 @@ window_create1(u_int sx, u_int sy)
 
 	w->lastlayout = -1;
 	w->layout_root = NULL;
+	w->layout_dump[0] = w->layout_dump[1] = NULL;
+	w->layout_dump_generation = 0;
 
 	w->sx = sx;
 	w->sy = sy;
@@ -313,6 +426,7 @@ window_create1(u_int sx, u_int sy)
 
 	w->id = next_window_id++;
 	RB_INSERT(windows, &windows, w);
+	window_enqueue(w);
 
 	window_update_activity(w);
 
@@ -351,12 +465,16 @@ void
 window_destroy(struct window *w)
 {
 	RB_REMOVE(windows, &windows, w);
+	if (w->dirty_queued)
+		TAILQ_REMOVE(&dirty_windows, w, dirty_entry);
 
 	if (w->layout_root != NULL)
 		layout_free_cell(w->layout_root);
 	if (w->saved_layout_root != NULL)
 		layout_free_cell(w->saved_layout_root);
 	free(w->old_layout);
+	free(w->layout_dump[0]);
+	free(w->layout_dump[1]);
 
 	if (event_initialized(&w->name_event))
 		evtimer_del(&w->name_event);
@@ -367,7 +485,9 @@ window_destroy(struct window *w)
 	options_free(w->options);
 
 	window_destroy_panes(w);
+	window_clear_cellmap(w);
 
+	free(w->name_format);
 	free(w->name);
 	free(w);
 }
@@ -398,8 +518,13 @@ window_set_name(struct window *w, const char *new_name)
 	free(w->name);
 	w->name = xstrdup(new_name);
 	notify_window_renamed(w);
+
+	/* Make the next automatic rename look again. */
+	free(w->name_format);
+	w->name_format = NULL;
 #ifdef TMATE
-	tmate_sync_layout();
+	w->flags |= WINDOW_RENAMED;
+	window_enqueue(w);
 #endif
 }
 
@@ -408,6 +533,7 @@ window_resize(struct window *w, u_int sx, u_int sy)
 {
 	w->sx = sx;
 	w->sy = sy;
+	window_clear_cellmap(w);
 }
 
 int
@@ -438,6 +564,7 @@ window_set_active_pane(struct window *w, struct window_pane *wp)
 	}
 	w->active->active_point = next_active_point++;
 	w->active->flags |= PANE_CHANGED;
+	window_enqueue(w);
 	return (1);
 }
 
@@ -463,23 +590,216 @@ window_redraw_active_switch(struct window *w, struct window_pane *wp)
 		w->active->flags |= PANE_REDRAW;
 	if (style_equal(&grid_default_cell, &wp->colgc))
 		wp->flags |= PANE_REDRAW;
+	window_enqueue(w);
 }
 
-struct window_pane *
-window_get_active_at(struct window *w, u_int x, u_int y)
+/* Free the cell map, it is rebuilt next time it is needed. */
+void
+window_clear_cellmap(struct window *w)
+{
+	free(w->cellmap);
+	w->cellmap = NULL;
+	free(w->cellpanes);
+	w->cellpanes = NULL;
+	w->cellmap_active = NULL;
+}
+
+/* Set one member of the cell map entries in a rectangle, clipped to the map. */
+void
+window_paint_cellmap(struct window *w, u_int x0, u_int y0, u_int x1, u_int y1,
+    enum window_cell_field field, u_int value)
+{
+	struct window_cell	*cell;
+	u_int			 x, y;
+
+	if (x1 >= w->cellmap_sx)
+		x1 = w->cellmap_sx - 1;
+	if (y1 >= w->cellmap_sy)
+		y1 = w->cellmap_sy - 1;
+
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++) {
+			cell = &w->cellmap[y * w->cellmap_sx + x];
+			switch (field) {
+			case WINDOW_CELL_PANE:
+				cell->pane = value;
+				break;
+			case WINDOW_CELL_HIT:
+				cell->hit = value;
+				break;
+			case WINDOW_CELL_BORDER:
+				cell->border = value;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Build the cell map. Each visible pane paints the cells it claims, last pane
+ * first, so where panes share a border the first in the list wins: this gives
+ * the same answers as walking the pane list for every cell.
+ */
+void
+window_build_cellmap(struct window *w)
 {
 	struct window_pane	*wp;
+	struct window_cell	*cell;
+	u_int			 n, i, x, y, x0, y0, sx, borders;
+
+	window_clear_cellmap(w);
 
+	/* Leave room for the cells just past the right and bottom edges. */
+	w->cellmap_sx = sx = w->sx + 2;
+	w->cellmap_sy = w->sy + 2;
+	w->cellmap = xcalloc(w->cellmap_sx * w->cellmap_sy, sizeof *w->cellmap);
+
+	n = 0;
 	TAILQ_FOREACH(wp, &w->panes, entry) {
 		if (!window_pane_visible(wp))
 			continue;
-		if (x < wp->xoff || x > wp->xoff + wp->sx)
-			continue;
-		if (y < wp->yoff || y > wp->yoff + wp->sy)
-			continue;
-		return (wp);
+		w->cellpanes = xreallocarray(w->cellpanes, n + 1,
+		    sizeof *w->cellpanes);
+		w->cellpanes[n++] = wp;
 	}
-	return (NULL);
+
+	for (i = n; i > 0; i--) {
+		wp = w->cellpanes[i - 1];
+		x0 = wp->xoff == 0 ? 0 : wp->xoff - 1;
+		y0 = wp->yoff == 0 ? 0 : wp->yoff - 1;
+
+		/* The pane and its borders. */
+		window_paint_cellmap(w, x0, y0, wp->xoff + wp->sx,
+		    wp->yoff + wp->sy, WINDOW_CELL_PANE, i);
+		window_paint_cellmap(w, wp->xoff, wp->yoff, wp->xoff + wp->sx,
+		    wp->yoff + wp->sy, WINDOW_CELL_HIT, i);
+
+		/* Left/right borders. */
+		if (wp->xoff != 0) {
+			window_paint_cellmap(w, wp->xoff - 1, y0, wp->xoff - 1,
+			    wp->yoff + wp->sy,
+			    WINDOW_CELL_BORDER, 1);
+		}
+		window_paint_cellmap(w, wp->xoff + wp->sx, y0,
+		    wp->xoff + wp->sx, wp->yoff + wp->sy,
+		    WINDOW_CELL_BORDER, 1);
+
+		/* Top/bottom borders. */
+		if (wp->yoff != 0) {
+			window_paint_cellmap(w, x0, wp->yoff - 1,
+			    wp->xoff + wp->sx, wp->yoff - 1,
+			    WINDOW_CELL_BORDER, 1);
+		}
+		window_paint_cellmap(w, x0, wp->yoff + wp->sy,
+		    wp->xoff + wp->sx, wp->yoff + wp->sy,
+		    WINDOW_CELL_BORDER, 1);
+
+		/* Inside pane. */
+		window_paint_cellmap(w, wp->xoff, wp->yoff,
+		    wp->xoff + wp->sx - 1, wp->yoff + wp->sy - 1,
+		    WINDOW_CELL_BORDER, 0);
+	}
+
+	for (y = 0; y <= w->sy; y++) {
+		for (x = 0; x <= w->sx; x++) {
+			cell = &w->cellmap[y * sx + x];
+			if (cell->pane == 0) {
+				cell->type = CELL_OUTSIDE;
+				continue;
+			}
+			if (!cell->border) {
+				cell->type = CELL_INSIDE;
+				continue;
+			}
+
+			borders = 0;
+			if (x == 0 || cell[-1].border)
+				borders |= 8;
+			if (cell[1].border)
+				borders |= 4;
+			if (y == 0 || cell[-(int)sx].border)
+				borders |= 2;
+			if (cell[sx].border)
+				borders |= 1;
+			cell->type = window_cell_types[borders];
+			if (cell->type == CELL_OUTSIDE)
+				cell->pane = 0;
+		}
+	}
+}
+
+/*
+ * Get the border cell type at a position and the pane it belongs to, or
+ * CELL_OUTSIDE.
+ */
+int
+window_get_cell_type(struct window *w, u_int x, u_int y,
+    struct window_pane **wpp)
+{
+	struct window_cell	*cell;
+
+	*wpp = NULL;
+	if (x > w->sx || y > w->sy)
+		return (CELL_OUTSIDE);
+
+	if (w->cellmap == NULL || w->cellmap_sx != w->sx + 2 ||
+	    w->cellmap_sy != w->sy + 2)
+		window_build_cellmap(w);
+	cell = &w->cellmap[y * w->cellmap_sx + x];
+	if (cell->pane != 0)
+		*wpp = w->cellpanes[cell->pane - 1];
+	return (cell->type);
+}
+
+/*
+ * Get whether a cell is drawn as the border of the active pane. This is kept
+ * in the cell map for all cells and worked out again when the active pane
+ * changes.
+ */
+int
+window_get_cell_active(struct window *w, u_int x, u_int y)
+{
+	struct window_pane	*wp;
+	struct window_cell	*cell;
+	u_int			 xx, yy;
+
+	if (x > w->sx || y > w->sy || w->active == NULL)
+		return (0);
+
+	if (w->cellmap == NULL || w->cellmap_sx != w->sx + 2 ||
+	    w->cellmap_sy != w->sy + 2)
+		window_build_cellmap(w);
+	if (w->cellmap_active != w->active) {
+		for (yy = 0; yy <= w->sy; yy++) {
+			for (xx = 0; xx <= w->sx; xx++) {
+				cell = &w->cellmap[yy * w->cellmap_sx + xx];
+				wp = NULL;
+				if (cell->pane != 0)
+					wp = w->cellpanes[cell->pane - 1];
+				cell->active = (screen_redraw_check_is(xx, yy,
+				    cell->type, w, w->active, wp) != 0);
+			}
+		}
+		w->cellmap_active = w->active;
+	}
+	return (w->cellmap[y * w->cellmap_sx + x].active);
+}
+
+struct window_pane *
+window_get_active_at(struct window *w, u_int x, u_int y)
+{
+	struct window_cell	*cell;
+
+	if (x > w->sx || y > w->sy)
+		return (NULL);
+
+	if (w->cellmap == NULL || w->cellmap_sx != w->sx + 2 ||
+	    w->cellmap_sy != w->sy + 2)
+		window_build_cellmap(w);
+	cell = &w->cellmap[y * w->cellmap_sx + x];
+	if (cell->hit == 0)
+		return (NULL);
+	return (w->cellpanes[cell->hit - 1]);
 }
 
 struct window_pane *
@@ -542,6 +862,7 @@ window_zoom(struct window_pane *wp)
 	w->saved_layout_root = w->layout_root;
 	layout_init(w, wp);
 	w->flags |= WINDOW_ZOOMED;
+	window_clear_cellmap(w);
 	notify_window_layout_changed(w);
 
 	return (0);
@@ -556,6 +877,7 @@ window_unzoom(struct window *w)
 		return (-1);
 
 	w->flags &= ~WINDOW_ZOOMED;
+	window_clear_cellmap(w);
 	layout_free(w);
 	w->layout_root = w->saved_layout_root;
 	w->saved_layout_root = NULL;
@@ -580,6 +902,7 @@ window_add_pane(struct window *w, u_int hlimit)
 		TAILQ_INSERT_HEAD(&w->panes, wp, entry);
 	else
 		TAILQ_INSERT_AFTER(&w->panes, w->active, wp, entry);
+	window_clear_cellmap(w);
 	return (wp);
 }
 
@@ -601,6 +924,7 @@ window_lost_pane(struct window *w, struct window_pane *wp)
 			w->active->flags |= PANE_CHANGED;
 	} else if (wp == w->last)
 		w->last = NULL;
+	window_enqueue(w);
 }
 
 void
@@ -610,6 +934,7 @@ window_remove_pane(struct window *w, struct window_pane *wp)
 
 	TAILQ_REMOVE(&w->panes, wp, entry);
 	window_pane_destroy(wp);
+	window_clear_cellmap(w);
 }
 
 struct window_pane *
@@ -689,6 +1014,7 @@ window_destroy_panes(struct window *w)
 		TAILQ_REMOVE(&w->panes, wp, entry);
 		window_pane_destroy(wp);
 	}
+	window_clear_cellmap(w);
 }
 
 /* Retuns the printable flags on a window, empty string if no flags set. */
@@ -713,6 +1039,8 @@ window_printable_flags(struct session *s, struct winlink *wl)
 		flags[pos++] = 'M';
 	if (wl->window->flags & WINDOW_ZOOMED)
 		flags[pos++] = 'Z';
+	if (window_throttled(wl->window))
+		flags[pos++] = 'T';
 	flags[pos] = '\0';
 	return (xstrdup(flags));
 }
@@ -735,10 +1063,42 @@ window_pane_find_by_id_str(const char *s)
 struct window_pane *
 window_pane_find_by_id(u_int id)
 {
-	struct window_pane	wp;
+	if (id >= window_pane_table_size)
+		return (NULL);
+	return (window_pane_table[id]);
+}
+
+/* Add a pane to the tree and table by its id. */
+void
+window_pane_add_id(struct window_pane *wp)
+{
+	u_int	size;
 
-	wp.id = id;
-	return (RB_FIND(window_pane_tree, &all_window_panes, &wp));
+	RB_INSERT(window_pane_tree, &all_window_panes, wp);
+	if (wp->id >= window_pane_table_size) {
+		size = window_pane_table_size * 2;
+		if (size <= wp->id)
+			size = wp->id + 64;
+		window_pane_table = xreallocarray(window_pane_table, size,
+		    sizeof *window_pane_table);
+		memset(window_pane_table + window_pane_table_size, 0,
+		    (size - window_pane_table_size) * sizeof *window_pane_table);
+		window_pane_table_size = size;
+	}
+	window_pane_table[wp->id] = wp;
+}
+
+/*
+ * Give a pane which has not been spawned yet another id, the one a shell
+ * from the pool was started with.
+ */
+void
+window_pane_set_id(struct window_pane *wp, u_int id)
+{
+	RB_REMOVE(window_pane_tree, &all_window_panes, wp);
+	window_pane_table[wp->id] = NULL;
+	wp->id = id;
+	window_pane_add_id(wp);
 }
 
 struct window_pane *
@@ -751,7 +1111,7 @@ window_pane_create(struct window *w, u_int sx, u_int sy, u_int hlimit)
 	wp->window = w;
 
 	wp->id = next_window_pane_id++;
-	RB_INSERT(window_pane_tree, &all_window_panes, wp);
+	window_pane_add_id(wp);
 
 	wp->argc = 0;
 	wp->argv = NULL;
@@ -775,15 +1135,24 @@ window_pane_create(struct window *w, u_int sx, u_int sy, u_int hlimit)
 	wp->pipe_off = 0;
 	wp->pipe_event = NULL;
 
+	TAILQ_INIT(&wp->pastes);
+
 #ifdef TMATE
 	wp->tmate_off = 0;
+	wp->tmate_copy_mode_pending = 0;
+	wp->tmate_pty_buf = NULL;
 #endif
 
 	wp->saved_grid = NULL;
+	wp->spare_grid = NULL;
 
 	memcpy(&wp->colgc, &grid_default_cell, sizeof wp->colgc);
 
 	screen_init(&wp->base, sx, sy, hlimit);
+	wp->base.grid->hwarm = options_get_number(global_options,
+	    "history-compress-after");
+	wp->base.grid->hspill = options_get_number(global_options,
+	    "history-spill");
 	wp->screen = &wp->base;
 
 	if (gethostname(host, sizeof host) == 0)
@@ -801,20 +1170,23 @@ window_pane_destroy(struct window_pane *wp)
 
 	if (event_initialized(&wp->timer))
 		evtimer_del(&wp->timer);
+	if (event_initialized(&wp->sync_timer))
+		evtimer_del(&wp->sync_timer);
 
-	if (wp->fd != -1) {
-#ifdef HAVE_UTEMPTER
-		utempter_remove_record(wp->fd);
-#endif
-		bufferevent_free(wp->event);
-		close(wp->fd);
-	}
+	window_pane_close(wp);
 
+	window_pane_paste_cancel(wp);
 	input_free(wp);
 
+#ifdef TMATE
+	tmate_free_pty_data(wp);
+#endif
+
 	screen_free(&wp->base);
 	if (wp->saved_grid != NULL)
 		grid_destroy(wp->saved_grid);
+	if (wp->spare_grid != NULL)
+		grid_destroy(wp->spare_grid);
 
 	if (wp->pipe_fd != -1) {
 		bufferevent_free(wp->pipe_event);
@@ -822,31 +1194,102 @@ window_pane_destroy(struct window_pane *wp)
 	}
 
 	RB_REMOVE(window_pane_tree, &all_window_panes, wp);
+	window_pane_table[wp->id] = NULL;
 
 	free((void *)wp->cwd);
 	free(wp->shell);
+	free(wp->name_cmd);
+	free(wp->path_cur);
 	cmd_free_argv(wp->argc, wp->argv);
 	free(wp);
 }
 
+/*
+ * Set up and run the command of a pane, in the child after forkpty. Shells
+ * for the pool are started the same way, with the id they will have.
+ */
+void
+window_pane_exec(u_int id, int argc, char **argv, const char *path,
+    const char *shell, const char *cwd, struct environ *env,
+    struct termios *tio)
+{
+	char		*argv0, **argvp;
+	const char	*ptr, *first, *home;
+	struct termios	 tio2;
+
+	if (chdir(cwd) != 0) {
+		if ((home = find_home()) == NULL || chdir(home) != 0)
+			chdir("/");
+	}
+
+	if (tcgetattr(STDIN_FILENO, &tio2) != 0)
+		fatal("tcgetattr failed");
+	if (tio != NULL)
+		memcpy(tio2.c_cc, tio->c_cc, sizeof tio2.c_cc);
+	tio2.c_cc[VERASE] = '\177';
+#ifdef IUTF8
+	tio2.c_iflag |= IUTF8;
+#endif
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &tio2) != 0)
+		fatal("tcgetattr failed");
+
+	closefrom(STDERR_FILENO + 1);
+
+	if (path != NULL)
+		environ_set(env, "PATH", "%s", path);
+	environ_set(env, "TMUX_PANE", "%%%u", id);
+	environ_push(env);
+
+	clear_signals(1);
+	log_close();
+
+	setenv("SHELL", shell, 1);
+	ptr = strrchr(shell, '/');
+
+	/*
+	 * If given one argument, assume it should be passed to sh -c; with more
+	 * than one argument, use execvp(). If there is no arguments, create a
+	 * login shell.
+	 */
+	if (argc > 0) {
+		if (argc != 1) {
+			/* Copy to ensure argv ends in NULL. */
+			argvp = cmd_copy_argv(argc, argv);
+			execvp(argvp[0], argvp);
+			fatal("execvp failed");
+		}
+		first = argv[0];
+
+		if (ptr != NULL && *(ptr + 1) != '\0')
+			xasprintf(&argv0, "%s", ptr + 1);
+		else
+			xasprintf(&argv0, "%s", shell);
+		execl(shell, argv0, "-c", first, (char *)NULL);
+		fatal("execl failed");
+	}
+	if (ptr != NULL && *(ptr + 1) != '\0')
+		xasprintf(&argv0, "-%s", ptr + 1);
+	else
+		xasprintf(&argv0, "-%s", shell);
+	execl(shell, argv0, (char *)NULL);
+	fatal("execl failed");
+}
+
 int
 window_pane_spawn(struct window_pane *wp, int argc, char **argv,
     const char *path, const char *shell, const char *cwd, struct environ *env,
     struct termios *tio, char **cause)
 {
 	struct winsize	 ws;
-	char		*argv0, *cmd, **argvp;
-	const char	*ptr, *first, *home;
-	struct termios	 tio2;
+	char		*cmd;
 #ifdef HAVE_UTEMPTER
 	char		 s[32];
 #endif
 	int		 i;
 
-	if (wp->fd != -1) {
-		bufferevent_free(wp->event);
-		close(wp->fd);
-	}
+	window_pane_close(wp);
+	window_pane_paste_cancel(wp);
+	window_pane_sync_end(wp);
 	if (argc > 0) {
 		cmd_free_argv(wp->argc, wp->argv);
 		wp->argc = argc;
@@ -870,69 +1313,17 @@ window_pane_spawn(struct window_pane *wp, int argc, char **argv,
 	ws.ws_col = screen_size_x(&wp->base);
 	ws.ws_row = screen_size_y(&wp->base);
 
-	switch (wp->pid = forkpty(&wp->fd, wp->tty, NULL, &ws)) {
-	case -1:
-		wp->fd = -1;
-		xasprintf(cause, "%s: %s", cmd, strerror(errno));
-		free(cmd);
-		return (-1);
-	case 0:
-		if (chdir(wp->cwd) != 0) {
-			if ((home = find_home()) == NULL || chdir(home) != 0)
-				chdir("/");
+	if (spawn_pool_take(wp, path, env, tio, &ws) != 0) {
+		switch (wp->pid = forkpty(&wp->fd, wp->tty, NULL, &ws)) {
+		case -1:
+			wp->fd = -1;
+			xasprintf(cause, "%s: %s", cmd, strerror(errno));
+			free(cmd);
+			return (-1);
+		case 0:
+			window_pane_exec(wp->id, wp->argc, wp->argv, path,
+			    wp->shell, wp->cwd, env, tio);
 		}
-
-		if (tcgetattr(STDIN_FILENO, &tio2) != 0)
-			fatal("tcgetattr failed");
-		if (tio != NULL)
-			memcpy(tio2.c_cc, tio->c_cc, sizeof tio2.c_cc);
-		tio2.c_cc[VERASE] = '\177';
-#ifdef IUTF8
-		tio2.c_iflag |= IUTF8;
-#endif
-		if (tcsetattr(STDIN_FILENO, TCSANOW, &tio2) != 0)
-			fatal("tcgetattr failed");
-
-		closefrom(STDERR_FILENO + 1);
-
-		if (path != NULL)
-			environ_set(env, "PATH", "%s", path);
-		environ_set(env, "TMUX_PANE", "%%%u", wp->id);
-		environ_push(env);
-
-		clear_signals(1);
-		log_close();
-
-		setenv("SHELL", wp->shell, 1);
-		ptr = strrchr(wp->shell, '/');
-
-		/*
-		 * If given one argument, assume it should be passed to sh -c;
-		 * with more than one argument, use execvp(). If there is no
-		 * arguments, create a login shell.
-		 */
-		if (wp->argc > 0) {
-			if (wp->argc != 1) {
-				/* Copy to ensure argv ends in NULL. */
-				argvp = cmd_copy_argv(wp->argc, wp->argv);
-				execvp(argvp[0], argvp);
-				fatal("execvp failed");
-			}
-			first = wp->argv[0];
-
-			if (ptr != NULL && *(ptr + 1) != '\0')
-				xasprintf(&argv0, "%s", ptr + 1);
-			else
-				xasprintf(&argv0, "%s", wp->shell);
-			execl(wp->shell, argv0, "-c", first, (char *)NULL);
-			fatal("execl failed");
-		}
-		if (ptr != NULL && *(ptr + 1) != '\0')
-			xasprintf(&argv0, "-%s", ptr + 1);
-		else
-			xasprintf(&argv0, "-%s", wp->shell);
-		execl(wp->shell, argv0, (char *)NULL);
-		fatal("execl failed");
 	}
 
 #ifdef HAVE_UTEMPTER
@@ -943,76 +1334,373 @@ window_pane_spawn(struct window_pane *wp, int argc, char **argv,
 
 	setblocking(wp->fd, 0);
 
-	wp->event = bufferevent_new(wp->fd, window_pane_read_callback, NULL,
+	/*
+	 * The bufferevent only writes, the pty is read by read_event into its
+	 * input buffer. That buffer is frozen at the end unless the
+	 * bufferevent reads itself, so unfreeze it.
+	 */
+	wp->event = bufferevent_new(wp->fd, NULL, window_pane_write_callback,
 	    window_pane_error_callback, wp);
-
-	bufferevent_setwatermark(wp->event, EV_READ, 0, READ_SIZE);
-	bufferevent_enable(wp->event, EV_READ|EV_WRITE);
+	evbuffer_unfreeze(wp->event->input, 0);
+
+	bufferevent_priority_set(wp->event, EVENT_PRI_OUTPUT);
+	wp->read_size = READ_SIZE;
+	wp->read_backoff = READ_BACKOFF;
+	wp->read_full = 0;
+	bufferevent_setwatermark(wp->event, EV_WRITE, WINDOW_PANE_PASTE_SIZE / 2,
+	    0);
+	bufferevent_enable(wp->event, EV_WRITE);
+
+	wp->flags &= ~(PANE_READSTOP|PANE_READFULL);
+	event_set(&wp->read_event, wp->fd, EV_READ|EV_PERSIST,
+	    window_pane_read_ready, wp);
+	event_priority_set(&wp->read_event, EVENT_PRI_OUTPUT);
+	event_add(&wp->read_event, NULL);
 
 	free(cmd);
 	return (0);
 }
 
+/*
+ * Grow the read size of a pane which keeps filling it, so bulk output is
+ * parsed and drawn in fewer larger pieces, and go back towards READ_SIZE as
+ * soon as reads are short again, so interactive panes stay responsive.
+ */
+void
+window_pane_read_adapt(struct window_pane *wp, size_t len)
+{
+	size_t	size = wp->read_size;
+
+	if (len >= wp->read_size) {
+		if (++wp->read_full >= READ_FULL && size < READ_SIZE_MAX) {
+			size *= 2;
+			wp->read_full = 0;
+		}
+	} else {
+		wp->read_full = 0;
+		if (len < wp->read_size / 4 && size > READ_SIZE)
+			size /= 2;
+	}
+	if (size == wp->read_size)
+		return;
+
+	log_debug_input("%%%u read size %zu -> %zu", wp->id, wp->read_size,
+	    size);
+	wp->read_size = size;
+	wp->read_backoff = size / (READ_SIZE / READ_BACKOFF);
+}
+
+/* Close the pty and stop reading and writing it. */
+void
+window_pane_close(struct window_pane *wp)
+{
+	if (wp->fd == -1)
+		return;
+
+#ifdef HAVE_UTEMPTER
+	utempter_remove_record(wp->fd);
+#endif
+	event_del(&wp->read_event);
+	bufferevent_free(wp->event);
+	wp->event = NULL;
+	close(wp->fd);
+	wp->fd = -1;
+}
+
+/* Stop or start reading the pty, for modes which freeze the pane. */
+void
+window_pane_read_enable(struct window_pane *wp, int enable)
+{
+	if (enable) {
+		wp->flags &= ~PANE_READSTOP;
+		bufferevent_enable(wp->event, EV_WRITE);
+	} else {
+		wp->flags |= PANE_READSTOP;
+		bufferevent_disable(wp->event, EV_WRITE);
+	}
+	window_pane_read_update(wp);
+}
+
+/*
+ * Read only while there is room in the input buffer, so output waiting to
+ * be parsed stays in the pty and the program writing it blocks.
+ */
+void
+window_pane_read_update(struct window_pane *wp)
+{
+	int	reading;
+
+	if (wp->fd == -1)
+		return;
+	if (EVBUFFER_LENGTH(wp->event->input) >= wp->read_size)
+		wp->flags |= PANE_READFULL;
+	else
+		wp->flags &= ~PANE_READFULL;
+
+	reading = event_pending(&wp->read_event, EV_READ, NULL);
+	if (wp->flags & (PANE_READSTOP|PANE_READFULL)) {
+		if (reading)
+			event_del(&wp->read_event);
+	} else if (!reading)
+		event_add(&wp->read_event, NULL);
+}
+
+/*
+ * The pty is readable. This reads it directly rather than through the
+ * bufferevent, which asks the kernel how much there is before each read and
+ * takes the fd off and back on the event loop each time the buffer fills.
+ */
+void
+window_pane_read_ready(int fd, __unused short events, void *data)
+{
+	struct window_pane	*wp = data;
+	struct evbuffer		*evb = wp->event->input;
+	struct evbuffer_iovec	 iov;
+	struct timeval		 start;
+	size_t			 len;
+	ssize_t			 n;
+	u_int			 id;
+
+	len = EVBUFFER_LENGTH(evb);
+	if (len >= wp->read_size) {
+		window_pane_read_update(wp);
+		return;
+	}
+
+	if (evbuffer_reserve_space(evb, wp->read_size - len, &iov, 1) != 1)
+		fatalx("evbuffer_reserve_space failed");
+	if (iov.iov_len > wp->read_size - len)
+		iov.iov_len = wp->read_size - len;
+	n = read(fd, iov.iov_base, iov.iov_len);
+	if (n <= 0) {
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		window_pane_error_callback(wp->event, EVBUFFER_READ |
+		    (n == 0 ? EVBUFFER_EOF : EVBUFFER_ERROR), wp);
+		return;
+	}
+	iov.iov_len = n;
+	if (evbuffer_commit_space(evb, &iov, 1) != 0)
+		fatalx("evbuffer_commit_space failed");
+
+	watchdog_start(&start);
+	id = wp->id;
+	window_pane_read_callback(wp->event, wp);
+	watchdog_stop(WATCHDOG_PANE_READ, &start, "%%%u, %zd bytes", id, n);
+}
+
+void
+window_pane_reset_budget(void)
+{
+	window_pane_budget = 0;
+}
+
 void
 window_pane_timer_callback(__unused int fd, __unused short events, void *data)
 {
 	window_pane_read_callback(NULL, data);
 }
 
+/* Whether any pane in the window is over its output budget. */
+int
+window_throttled(struct window *w)
+{
+	struct window_pane	*wp;
+
+	TAILQ_FOREACH(wp, &w->panes, entry) {
+		if (wp->flags & PANE_THROTTLED)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Check a pane against pane-rate-limit and pane-cpu-limit, returning 1 if it
+ * has used up its budget for this period. It stays marked as throttled until
+ * a whole period goes by under budget, so the flag doesn't come and go with
+ * each period while a program keeps printing.
+ */
+int
+window_pane_throttle(struct window_pane *wp)
+{
+	struct options	*oo = wp->window->options;
+	struct timeval	 now, tv;
+	uint64_t	 rate, cpu;
+	int		 over, throttled;
+
+	rate = options_get_number(oo, "pane-rate-limit");
+	cpu = options_get_number(oo, "pane-cpu-limit");
+	if (rate != 0 && (rate = rate * THROTTLE_PERIOD / 1000000) == 0)
+		rate = 1;
+	if (cpu != 0 && (cpu = cpu * THROTTLE_PERIOD / 1000) == 0)
+		cpu = 1;
+
+	throttled = !!(wp->flags & PANE_THROTTLED);
+	if (rate == 0 && cpu == 0)
+		over = throttled = 0;
+	else {
+		gettimeofday(&now, NULL);
+		timersub(&now, &wp->throttle_time, &tv);
+		if (tv.tv_sec != 0 || tv.tv_usec >= THROTTLE_PERIOD) {
+			if ((rate == 0 || wp->throttle_bytes < rate) &&
+			    (cpu == 0 || wp->throttle_us < cpu))
+				throttled = 0;
+			wp->throttle_time = now;
+			wp->throttle_bytes = 0;
+			wp->throttle_us = 0;
+		}
+		over = (rate != 0 && wp->throttle_bytes >= rate) ||
+		    (cpu != 0 && wp->throttle_us >= cpu);
+		if (over)
+			throttled = 1;
+	}
+
+	if (throttled != !!(wp->flags & PANE_THROTTLED)) {
+		log_debug("%%%u %sthrottled", wp->id, throttled ? "" : "not ");
+		if (throttled)
+			wp->flags |= PANE_THROTTLED;
+		else
+			wp->flags &= ~PANE_THROTTLED;
+		server_status_window(wp->window);
+	}
+	return (over);
+}
+
 void
 window_pane_read_callback(__unused struct bufferevent *bufev, void *data)
 {
 	struct window_pane	*wp = data;
 	struct evbuffer		*evb = wp->event->input;
 	char			*new_data;
-	size_t			 new_size, available;
+	size_t			 new_size, available, pipe_limit;
 	struct client		*c;
-	struct timeval		 tv;
+	struct timeval		 tv, start;
+	int			 pipe_full;
+	long			 delay = READ_TIME;
 
 	if (event_initialized(&wp->timer))
 		evtimer_del(&wp->timer);
 
-	log_debug("%%%u has %zu bytes", wp->id, EVBUFFER_LENGTH(evb));
+	log_debug_input("%%%u has %zu bytes", wp->id, EVBUFFER_LENGTH(evb));
+	PROBE2(pane_read, wp->id, EVBUFFER_LENGTH(evb));
+
+	if (window_pane_budget >= READ_BUDGET) {
+		log_debug_input("%%%u deferred (%ld us used)", wp->id,
+		    window_pane_budget);
+		goto start_timer;
+	}
+
+	if (window_pane_throttle(wp)) {
+		log_debug_input("%%%u over budget (%llu bytes, %llu us)",
+		    wp->id, (unsigned long long)wp->throttle_bytes,
+		    (unsigned long long)wp->throttle_us);
+		delay = THROTTLE_TIME;
+		goto start_timer;
+	}
 
 	TAILQ_FOREACH(c, &clients, entry) {
 		if (!tty_client_ready(c, wp))
 			continue;
 
-		available = EVBUFFER_LENGTH(c->tty.event->output);
-		if (available > READ_BACKOFF)
+		available = EVBUFFER_LENGTH(c->tty.event->output) +
+		    c->tty.olen;
+		if (available > wp->read_backoff) {
+			log_debug_input("%%%u backing off (%s %zu > %zu)",
+			    wp->id, c->ttyname, available, wp->read_backoff);
 			goto start_timer;
+		}
+	}
+
+#ifdef TMATE
+	if (!wp->tmate_diff && tmate_should_backoff(wp, &available)) {
+		log_debug_input("%%%u backing off (tmate %zu bytes pending)",
+		    wp->id, available);
+		goto start_timer;
+	}
+#endif
+
+	/*
+	 * If what is waiting for the pipe is over pipe-pane-limit, stop reading
+	 * until it has gone down or, with pipe-pane-drop, throw away what
+	 * would have been written to it.
+	 */
+	pipe_full = 0;
+	if (wp->pipe_fd != -1) {
+		pipe_limit = options_get_number(wp->window->options,
+		    "pipe-pane-limit");
+		available = EVBUFFER_LENGTH(wp->pipe_event->output);
+		if (pipe_limit != 0 && available > pipe_limit) {
+			if (!options_get_number(wp->window->options,
+			    "pipe-pane-drop")) {
+				log_debug_input("%%%u backing off (pipe %zu > "
+				    "%zu)", wp->id, available, pipe_limit);
+				goto start_timer;
+			}
+			pipe_full = 1;
+		}
 	}
 
 	new_size = EVBUFFER_LENGTH(evb) - wp->pipe_off;
 	if (wp->pipe_fd != -1 && new_size > 0) {
-		new_data = EVBUFFER_DATA(evb) + wp->pipe_off;
-		bufferevent_write(wp->pipe_event, new_data, new_size);
+		if (pipe_full) {
+			wp->pipe_dropped += new_size;
+			log_debug_input("%%%u pipe dropped %zu (%zu in total)",
+			    wp->id, new_size, wp->pipe_dropped);
+		} else {
+			new_data = EVBUFFER_DATA(evb) + wp->pipe_off;
+			bufferevent_write(wp->pipe_event, new_data, new_size);
+		}
 	}
 
 #ifdef TMATE
 	new_size = EVBUFFER_LENGTH(wp->event->input) - wp->tmate_off;
 	new_data = EVBUFFER_DATA(wp->event->input) + wp->tmate_off;
-	if (new_size > 0)
+	if (new_size > 0) {
 		tmate_pty_data(wp, new_data, new_size);
+		tmate_record_pty(wp, new_data, new_size);
+	}
 #endif
 
+	window_pane_read_adapt(wp, EVBUFFER_LENGTH(evb));
+	wp->throttle_bytes += EVBUFFER_LENGTH(evb);
+
+	gettimeofday(&start, NULL);
 	input_parse(wp);
+	gettimeofday(&tv, NULL);
+	timersub(&tv, &start, &tv);
+	window_pane_budget += tv.tv_sec * 1000000L + tv.tv_usec;
+	wp->throttle_us += tv.tv_sec * 1000000L + tv.tv_usec;
 
 	wp->pipe_off = EVBUFFER_LENGTH(evb);
 #ifdef TMATE
 	wp->tmate_off = EVBUFFER_LENGTH(evb);
 #endif
+	window_pane_read_update(wp);
+
+	/* Look again after a period to clear the flag if it has gone quiet. */
+	if (wp->flags & PANE_THROTTLED) {
+		delay = THROTTLE_PERIOD;
+		goto start_timer;
+	}
 	return;
 
 start_timer:
-	log_debug("%%%u backing off (%s %zu > %d)", wp->id, c->ttyname,
-	    available, READ_BACKOFF);
-
 	tv.tv_sec = 0;
-	tv.tv_usec = READ_TIME;
+	tv.tv_usec = delay;
 
 	evtimer_set(&wp->timer, window_pane_timer_callback, wp);
+	event_priority_set(&wp->timer, EVENT_PRI_OUTPUT);
 	evtimer_add(&wp->timer, &tv);
+	window_pane_read_update(wp);
+}
+
+void
+window_pane_write_callback(__unused struct bufferevent *bufev, void *data)
+{
+	struct window_pane	*wp = data;
+
+	if (!TAILQ_EMPTY(&wp->pastes))
+		window_pane_paste_fill(wp);
 }
 
 void
@@ -1033,21 +1721,67 @@ window_pane_resize(struct window_pane *wp, u_int sx, u_int sy)
 	wp->sy = sy;
 
 	screen_resize(&wp->base, sx, sy, wp->saved_grid == NULL);
-	if (wp->mode != NULL)
+	if (wp->mode != NULL) {
+		/* The mode may be showing any of the history. */
+		grid_reflow_history(wp->base.grid);
 		wp->mode->resize(wp, sx, sy);
+	}
 
 	wp->flags |= PANE_RESIZE;
+	window_enqueue(wp->window);
+
+	if (wp->base.grid->hpending != 0)
+		window_reflow_schedule();
+}
+
+/* Reflow some of the pending history in the panes next time round. */
+void
+window_reflow_schedule(void)
+{
+	struct timeval	tv = { .tv_sec = 0, .tv_usec = 1000 };
+
+	if (!event_initialized(&window_reflow_timer))
+		evtimer_set(&window_reflow_timer, window_reflow_callback, NULL);
+	if (!evtimer_pending(&window_reflow_timer, NULL))
+		evtimer_add(&window_reflow_timer, &tv);
+}
+
+void
+window_reflow_callback(__unused int fd, __unused short events,
+    __unused void *data)
+{
+	struct window_pane	*wp;
+	struct grid		*gd;
+	u_int			 blocks = 0;
+	int			 more = 0;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		gd = wp->base.grid;
+		if (gd->hpending == 0 || wp->mode != NULL)
+			continue;
+		if (blocks == WINDOW_REFLOW_BLOCKS) {
+			more = 1;
+			break;
+		}
+		if (grid_reflow_history_step(gd) != 0)
+			more = 1;
+		blocks++;
+	}
+	if (more)
+		window_reflow_schedule();
 }
 
 /*
- * Enter alternative screen mode. A copy of the visible screen is saved and the
- * history is not updated
+ * Enter alternate screen mode. The visible lines are moved into saved_grid,
+ * swapped with its empty ones, so the cells are not copied. The grid is kept
+ * for the next time when leaving.
  */
 void
 window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
     int cursor)
 {
 	struct screen	*s = &wp->base;
+	struct grid	*gd;
 	u_int		 sx, sy;
 
 	if (wp->saved_grid != NULL)
@@ -1057,30 +1791,41 @@ window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
 	sx = screen_size_x(s);
 	sy = screen_size_y(s);
 
-	wp->saved_grid = grid_create(sx, sy, 0);
-	grid_duplicate_lines(wp->saved_grid, 0, s->grid, screen_hsize(s), sy);
+	gd = wp->spare_grid;
+	wp->spare_grid = NULL;
+	if (gd != NULL && (gd->sx != sx || gd->sy != sy)) {
+		grid_destroy(gd);
+		gd = NULL;
+	}
+	if (gd == NULL)
+		gd = grid_create(sx, sy, 0);
+	if (gd->styles == NULL || gd->styles != s->grid->styles)
+		grid_styles_share(gd, s->grid);
+
+	wp->saved_grid = gd;
+	grid_swap_lines(gd, 0, s->grid, screen_hsize(s), sy);
 	if (cursor) {
 		wp->saved_cx = s->cx;
 		wp->saved_cy = s->cy;
 	}
 	memcpy(&wp->saved_cell, gc, sizeof wp->saved_cell);
 
-	grid_view_clear(s->grid, 0, 0, sx, sy);
-
 	wp->base.grid->flags &= ~GRID_HISTORY;
 
 	wp->flags |= PANE_REDRAW;
+	window_enqueue(wp->window);
 }
 
-/* Exit alternate screen mode and restore the copied grid. */
+/* Exit alternate screen mode and restore the saved lines. */
 void
 window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
     int cursor)
 {
 	struct screen	*s = &wp->base;
+	struct grid	*gd = wp->saved_grid;
 	u_int		 sx, sy;
 
-	if (wp->saved_grid == NULL)
+	if (gd == NULL)
 		return;
 	if (!options_get_number(wp->window->options, "alternate-screen"))
 		return;
@@ -1088,14 +1833,22 @@ window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
 	sy = screen_size_y(s);
 
 	/*
-	 * If the current size is bigger, temporarily resize to the old size
-	 * before copying back.
+	 * Drop the alternate screen, and if the size has changed, resize to
+	 * the old size before putting the lines back.
 	 */
-	if (sy > wp->saved_grid->sy)
-		screen_resize(s, sx, wp->saved_grid->sy, 1);
+	grid_clear_lines(s->grid, screen_hsize(s), sy);
+	if (sx != gd->sx || sy != gd->sy)
+		screen_resize(s, gd->sx, gd->sy, 0);
+
+	/* Restore the lines, leaving the saved grid empty. */
+	if (gd->styles == s->grid->styles)
+		grid_swap_lines(s->grid, screen_hsize(s), gd, 0, gd->sy);
+	else {
+		grid_duplicate_lines(s->grid, screen_hsize(s), gd, 0, gd->sy);
+		grid_clear_lines(gd, 0, gd->sy);
+	}
 
-	/* Restore the grid, cursor position and cell. */
-	grid_duplicate_lines(s->grid, screen_hsize(s), wp->saved_grid, 0, sy);
+	/* And the cursor position and cell. */
 	if (cursor)
 		s->cx = wp->saved_cx;
 	if (s->cx > screen_size_x(s) - 1)
@@ -1111,13 +1864,60 @@ window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
 	 * the current size.
 	 */
 	wp->base.grid->flags |= GRID_HISTORY;
-	if (sy > wp->saved_grid->sy || sx != wp->saved_grid->sx)
+	if (sx != gd->sx || sy != gd->sy)
 		screen_resize(s, sx, sy, 1);
 
-	grid_destroy(wp->saved_grid);
 	wp->saved_grid = NULL;
+	wp->spare_grid = gd;
 
 	wp->flags |= PANE_REDRAW;
+	window_enqueue(wp->window);
+}
+
+/*
+ * Start a synchronized update (mode 2026): until it ends, output is kept in
+ * the pane and its dirty lines rather than written to clients, so they see
+ * each frame drawn at once. An update which does not end is ended anyway
+ * after WINDOW_PANE_SYNC_TIME.
+ */
+void
+window_pane_sync_start(struct window_pane *wp)
+{
+	struct timeval	tv;
+
+	if (wp->flags & PANE_SYNC)
+		return;
+	wp->flags |= PANE_SYNC;
+
+	tv.tv_sec = WINDOW_PANE_SYNC_TIME / 1000;
+	tv.tv_usec = (WINDOW_PANE_SYNC_TIME % 1000) * 1000L;
+
+	evtimer_set(&wp->sync_timer, window_pane_sync_callback, wp);
+	evtimer_add(&wp->sync_timer, &tv);
+}
+
+/* End a synchronized update, the held lines are drawn by the next loop. */
+void
+window_pane_sync_end(struct window_pane *wp)
+{
+	if (!(wp->flags & PANE_SYNC))
+		return;
+	wp->flags &= ~PANE_SYNC;
+
+	if (event_initialized(&wp->sync_timer))
+		evtimer_del(&wp->sync_timer);
+#ifdef TMATE
+	tmate_pty_release(wp);
+#endif
+}
+
+void
+window_pane_sync_callback(__unused int fd, __unused short events, void *data)
+{
+	struct window_pane	*wp = data;
+
+	log_debug("%%%u synchronized update timed out", wp->id);
+	window_pane_sync_end(wp);
 }
 
 int
@@ -1132,6 +1932,7 @@ window_pane_set_mode(struct window_pane *wp, const struct window_mode *mode)
 	if ((s = wp->mode->init(wp)) != NULL)
 		wp->screen = s;
 	wp->flags |= (PANE_REDRAW|PANE_CHANGED);
+	window_enqueue(wp->window);
 
 	server_status_window(wp->window);
 	return (0);
@@ -1143,11 +1944,12 @@ window_pane_reset_mode(struct window_pane *wp)
 	if (wp->mode == NULL)
 		return;
 
-	wp->mode->free(wp);
+	(*wp->mode->free)(wp);	/* free may be a macro */
 	wp->mode = NULL;
 
 	wp->screen = &wp->base;
 	wp->flags |= (PANE_REDRAW|PANE_CHANGED);
+	window_enqueue(wp->window);
 
 	server_status_window(wp->window);
 
@@ -1190,6 +1992,170 @@ window_pane_key(struct window_pane *wp, struct client *c, struct session *s,
 	}
 }
 
+/*
+ * Write a string of keys to a pane in one go, as if each byte was a key. Only
+ * for panes not in a mode, returns -1 otherwise.
+ */
+int
+window_pane_key_literal(struct window_pane *wp, const char *buf, size_t len)
+{
+	struct window_pane	*wp2;
+
+	if (wp->mode != NULL)
+		return (-1);
+	if (wp->fd == -1 || wp->flags & PANE_INPUTOFF)
+		return (0);
+
+	bufferevent_write(wp->event, buf, len);
+
+	if (options_get_number(wp->window->options, "synchronize-panes")) {
+		TAILQ_FOREACH(wp2, &wp->window->panes, entry) {
+			if (wp2 == wp || wp2->mode != NULL)
+				continue;
+			if (wp2->fd == -1 || wp2->flags & PANE_INPUTOFF)
+				continue;
+			if (window_pane_visible(wp2))
+				bufferevent_write(wp2->event, buf, len);
+		}
+	}
+	return (0);
+}
+
+void
+window_pane_paste1(struct window_pane *wp, const char *buf, size_t len,
+    int flags)
+{
+	int	bracket;
+
+	bracket = (flags & PASTE_BRACKETED) &&
+	    (wp->screen->mode & MODE_BRACKETPASTE);
+	if (bracket && (flags & PASTE_START))
+		bufferevent_write(wp->event, "\033[200~", 6);
+	if (len != 0)
+		bufferevent_write(wp->event, buf, len);
+	if (bracket && (flags & PASTE_END))
+		bufferevent_write(wp->event, "\033[201~", 6);
+}
+
+/*
+ * Write a run of pasted text to a pane in one go rather than a key at a time.
+ * The caller has checked it contains nothing input_key would translate. The
+ * bracketed paste markers are only passed on to panes which asked for them.
+ */
+void
+window_pane_paste(struct window_pane *wp, const char *buf, size_t len,
+    int flags)
+{
+	struct window_pane	*wp2;
+
+	if (wp->mode != NULL || wp->fd == -1 || wp->flags & PANE_INPUTOFF)
+		return;
+	window_pane_paste1(wp, buf, len, flags);
+
+	if (options_get_number(wp->window->options, "synchronize-panes")) {
+		TAILQ_FOREACH(wp2, &wp->window->panes, entry) {
+			if (wp2 == wp || wp2->mode != NULL)
+				continue;
+			if (wp2->fd == -1 || wp2->flags & PANE_INPUTOFF)
+				continue;
+			if (window_pane_visible(wp2))
+				window_pane_paste1(wp2, buf, len, flags);
+		}
+	}
+}
+
+/* Queue a paste buffer for a pane, converting newlines to sepstr. */
+void
+window_pane_paste_buffer(struct window_pane *wp, struct paste_buffer *pb,
+    const char *sepstr, int bracket)
+{
+	struct window_pane_paste	*wpp;
+
+	if (wp->fd == -1)
+		return;
+
+	wpp = xcalloc(1, sizeof *wpp);
+	wpp->pb = paste_hold(pb);
+	wpp->sepstr = xstrdup(sepstr);
+	wpp->bracket = bracket;
+	TAILQ_INSERT_TAIL(&wp->pastes, wpp, entry);
+
+	window_pane_paste_fill(wp);
+}
+
+void
+window_pane_paste_free(struct window_pane *wp, struct window_pane_paste *wpp)
+{
+	TAILQ_REMOVE(&wp->pastes, wpp, entry);
+	paste_release(wpp->pb);
+	free(wpp->sepstr);
+	free(wpp);
+}
+
+/* Drop any pastes not yet given to the pane. */
+void
+window_pane_paste_cancel(struct window_pane *wp)
+{
+	struct window_pane_paste	*wpp, *wpp1;
+
+	TAILQ_FOREACH_SAFE(wpp, &wp->pastes, entry, wpp1)
+		window_pane_paste_free(wp, wpp);
+}
+
+/* Top up the pane output from the pastes queued, one chunk's worth. */
+void
+window_pane_paste_fill(struct window_pane *wp)
+{
+	struct window_pane_paste	*wpp;
+	struct evbuffer			*out = wp->event->output;
+	const char			*data, *line;
+	size_t				 size, seplen;
+
+	while ((wpp = TAILQ_FIRST(&wp->pastes)) != NULL) {
+		if (!wpp->started) {
+			wpp->bracket = wpp->bracket &&
+			    (wp->screen->mode & MODE_BRACKETPASTE);
+			if (wpp->bracket)
+				evbuffer_add(out, "\033[200~", 6);
+			wpp->started = 1;
+		}
+		seplen = strlen(wpp->sepstr);
+
+		while (EVBUFFER_LENGTH(out) < WINDOW_PANE_PASTE_SIZE) {
+			data = paste_buffer_piece(wpp->pb, wpp->piece, &size);
+			if (data == NULL)
+				break;
+			data += wpp->off;
+			size -= wpp->off;
+			if (size > WINDOW_PANE_PASTE_SIZE)
+				size = WINDOW_PANE_PASTE_SIZE;
+
+			line = memchr(data, '\n', size);
+			if (line != NULL)
+				size = line - data;
+			if (size != 0)
+				paste_buffer_add(wpp->pb, wpp->piece, data, size, out);
+			wpp->off += size;
+			if (line != NULL) {
+				evbuffer_add(out, wpp->sepstr, seplen);
+				wpp->off++;
+			}
+
+			paste_buffer_piece(wpp->pb, wpp->piece, &size);
+			if (wpp->off == size) {
+				wpp->piece++;
+				wpp->off = 0;
+			}
+		}
+		if (paste_buffer_piece(wpp->pb, wpp->piece, &size) != NULL)
+			break;
+
+		if (wpp->bracket)
+			evbuffer_add(out, "\033[201~", 6);
+		window_pane_paste_free(wp, wpp);
+	}
+}
+
 int
 window_pane_visible(struct window_pane *wp)
 {
@@ -1204,30 +2170,97 @@ window_pane_visible(struct window_pane *wp)
 	return (1);
 }
 
-char *
-window_pane_search(struct window_pane *wp, const char *searchstr,
-    u_int *lineno)
+/* Get the memory used by a pane's grids, including any mode screen. */
+size_t
+window_pane_grid_memory(struct window_pane *wp)
 {
-	struct screen	*s = &wp->base;
-	char		*newsearchstr, *line, *msg;
-	u_int	 	 i;
-
-	msg = NULL;
-	xasprintf(&newsearchstr, "*%s*", searchstr);
-
-	for (i = 0; i < screen_size_y(s); i++) {
-		line = grid_view_string_cells(s->grid, 0, i, screen_size_x(s));
-		if (fnmatch(newsearchstr, line, 0) == 0) {
-			msg = line;
-			if (lineno != NULL)
-				*lineno = i;
+	size_t	size;
+
+	size = wp->base.grid->memory;
+	if (wp->saved_grid != NULL)
+		size += wp->saved_grid->memory;
+	if (wp->spare_grid != NULL)
+		size += wp->spare_grid->memory;
+	if (wp->screen != &wp->base)
+		size += wp->screen->grid->memory;
+	return (size);
+}
+
+/*
+ * If the grids are using more than history-memory-limit, trim the history of
+ * the largest panes until back under 90% of the limit. Panes in a mode are
+ * left alone as the mode may be looking at the history.
+ */
+void
+window_check_history_memory(void)
+{
+	struct window_pane	*wp, *loser;
+	struct grid		*gd;
+	struct client		*c;
+	size_t			 limit, target, size;
+	u_int			 ny;
+
+	limit = options_get_number(global_options, "history-memory-limit");
+	if (limit == 0)
+		return;
+	limit *= 1024 * 1024;
+	if (grid_total_memory <= limit)
+		return;
+	target = limit - limit / 10;
+
+	while (grid_total_memory > target) {
+		loser = NULL;
+		RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+			if (wp->mode != NULL || wp->base.grid->hsize == 0)
+				continue;
+			if (loser == NULL ||
+			    wp->base.grid->memory > loser->base.grid->memory)
+				loser = wp;
+		}
+		if (loser == NULL)
 			break;
+
+		/* Drop the oldest quarter of the history. */
+		gd = loser->base.grid;
+		ny = gd->hsize / 4;
+		if (ny == 0)
+			ny = gd->hsize;
+		size = gd->memory;
+		grid_trim_history(gd, ny);
+		grid_free_spare(gd);
+		log_debug("%s: %%%u: trimmed %u lines, %zu bytes", __func__,
+		    loser->id, ny, size - gd->memory);
+
+		TAILQ_FOREACH(c, &clients, entry) {
+			if (c->session == NULL ||
+			    c->session->curw->window != loser->window)
+				continue;
+			status_message_set(c, "History of pane %%%u trimmed "
+			    "(history-memory-limit)", loser->id);
 		}
-		free(line);
 	}
+}
 
-	free(newsearchstr);
-	return (msg);
+/* Get the memory used by a pane's input and output buffers. */
+size_t
+window_pane_buffer_memory(struct window_pane *wp)
+{
+	size_t	size;
+
+	size = sizeof *wp + input_memory(wp);
+	if (wp->event != NULL) {
+		size += EVBUFFER_LENGTH(wp->event->input);
+		size += EVBUFFER_LENGTH(wp->event->output);
+	}
+	if (wp->pipe_event != NULL) {
+		size += EVBUFFER_LENGTH(wp->pipe_event->input);
+		size += EVBUFFER_LENGTH(wp->pipe_event->output);
+	}
+#ifdef TMATE
+	if (wp->tmate_pty_buf != NULL)
+		size += EVBUFFER_LENGTH(wp->tmate_pty_buf);
+#endif
+	return (size);
 }
 
 /* Get MRU pane from a list. */
@@ -23,11 +23,56 @@
 
 #include "tmux.h"
 
+#ifdef XMALLOC_STATS
+#include <pthread.h>
+
+/* The functions themselves, not the macros counting their callers. */
+#undef xmalloc
+#undef xcalloc
+#undef xrealloc
+#undef xreallocarray
+#undef xstrdup
+#undef xasprintf
+#undef xvasprintf
+#undef free
+
+#define XMALLOC_SITES 4096
+
+/* An allocation still live, in a hash table by address. */
+struct xmalloc_ptr {
+	void			*ptr;
+	size_t			 size;
+	struct xmalloc_site	*site;
+
+	struct xmalloc_ptr	*next;
+};
+
+/* Threads allocate too. */
+static pthread_mutex_t		 xmalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct xmalloc_site	*xmalloc_site_hash[XMALLOC_SITES];
+static u_int			 xmalloc_nsites;
+
+static struct xmalloc_ptr	**xmalloc_ptr_hash;
+static size_t			 xmalloc_ptr_size;
+static size_t			 xmalloc_ptr_count;
+
+static size_t			 xmalloc_live;
+static size_t			 xmalloc_peak;
+
+static void	xmalloc_track(void *, size_t, const char *, int);
+static void	xmalloc_untrack(void *);
+#endif
+
+/* Number of allocations made through these functions. */
+u_long xmalloc_calls;
+
 void *
 xmalloc(size_t size)
 {
 	void *ptr;
 
+	xmalloc_calls++;
 	if (size == 0)
 		fatal("xmalloc: zero size");
 	ptr = malloc(size);
@@ -42,6 +87,7 @@ xcalloc(size_t nmemb, size_t size)
 {
 	void *ptr;
 
+	xmalloc_calls++;
 	if (size == 0 || nmemb == 0)
 		fatal("xcalloc: zero size");
 	ptr = calloc(nmemb, size);
@@ -62,6 +108,7 @@ xreallocarray(void *ptr, size_t nmemb, size_t size)
 {
 	void *new_ptr;
 
+	xmalloc_calls++;
 	if (nmemb == 0 || size == 0)
 		fatal("xreallocarray: zero size");
 	new_ptr = reallocarray(ptr, nmemb, size);
@@ -76,6 +123,7 @@ xstrdup(const char *str)
 {
 	char *cp;
 
+	xmalloc_calls++;
 	if ((cp = strdup(str)) == NULL)
 		fatal("xstrdup: %s", strerror(errno));
 	return cp;
@@ -100,6 +148,7 @@ xvasprintf(char **ret, const char *fmt, va_list ap)
 {
 	int i;
 
+	xmalloc_calls++;
 	i = vasprintf(ret, fmt, ap);
 
 	if (i < 0 || *ret == NULL)
@@ -137,3 +186,224 @@ xvsnprintf(char *str, size_t len, const char *fmt, va_list ap)
 
 	return i;
 }
+
+#ifdef XMALLOC_STATS
+static u_int
+xmalloc_hash_ptr(void *ptr, size_t size)
+{
+	uintptr_t	h = (uintptr_t)ptr >> 4;
+
+	return ((h * 0x9e3779b1U) & (size - 1));
+}
+
+/* Find the site of a caller, adding it the first time. */
+static struct xmalloc_site *
+xmalloc_site(const char *file, int line)
+{
+	struct xmalloc_site	*site;
+	u_int			 h;
+
+	h = (((uintptr_t)file >> 3) * 31 + line) & (XMALLOC_SITES - 1);
+	for (site = xmalloc_site_hash[h]; site != NULL; site = site->next) {
+		if (site->line == line &&
+		    (site->file == file || strcmp(site->file, file) == 0))
+			return (site);
+	}
+
+	if ((site = calloc(1, sizeof *site)) == NULL)
+		return (NULL);
+	site->file = file;
+	site->line = line;
+	site->next = xmalloc_site_hash[h];
+	xmalloc_site_hash[h] = site;
+	xmalloc_nsites++;
+	return (site);
+}
+
+/* Double the pointer table once it is as full as it is big. */
+static void
+xmalloc_grow(void)
+{
+	struct xmalloc_ptr	**hash, *p, *p1;
+	size_t			 size, i;
+	u_int			 h;
+
+	size = xmalloc_ptr_size == 0 ? 1024 : xmalloc_ptr_size * 2;
+	if ((hash = calloc(size, sizeof *hash)) == NULL)
+		return;
+	for (i = 0; i < xmalloc_ptr_size; i++) {
+		for (p = xmalloc_ptr_hash[i]; p != NULL; p = p1) {
+			p1 = p->next;
+			h = xmalloc_hash_ptr(p->ptr, size);
+			p->next = hash[h];
+			hash[h] = p;
+		}
+	}
+	free(xmalloc_ptr_hash);
+	xmalloc_ptr_hash = hash;
+	xmalloc_ptr_size = size;
+}
+
+static void
+xmalloc_track(void *ptr, size_t size, const char *file, int line)
+{
+	struct xmalloc_site	*site;
+	struct xmalloc_ptr	*p;
+	u_int			 h;
+
+	pthread_mutex_lock(&xmalloc_lock);
+	if ((site = xmalloc_site(file, line)) == NULL)
+		goto out;
+	site->calls++;
+	site->bytes += size;
+
+	if (xmalloc_ptr_count >= xmalloc_ptr_size)
+		xmalloc_grow();
+	if (xmalloc_ptr_size == 0 || (p = malloc(sizeof *p)) == NULL)
+		goto out;
+	p->ptr = ptr;
+	p->size = size;
+	p->site = site;
+	h = xmalloc_hash_ptr(ptr, xmalloc_ptr_size);
+	p->next = xmalloc_ptr_hash[h];
+	xmalloc_ptr_hash[h] = p;
+	xmalloc_ptr_count++;
+
+	site->nlive++;
+	site->live += size;
+	xmalloc_live += size;
+	if (xmalloc_live > xmalloc_peak)
+		xmalloc_peak = xmalloc_live;
+
+out:
+	pthread_mutex_unlock(&xmalloc_lock);
+}
+
+static void
+xmalloc_untrack(void *ptr)
+{
+	struct xmalloc_ptr	*p, **pp;
+
+	pthread_mutex_lock(&xmalloc_lock);
+	if (xmalloc_ptr_size == 0)
+		goto out;
+	pp = &xmalloc_ptr_hash[xmalloc_hash_ptr(ptr, xmalloc_ptr_size)];
+	for (; (p = *pp) != NULL; pp = &p->next) {
+		if (p->ptr != ptr)
+			continue;
+		*pp = p->next;
+		xmalloc_ptr_count--;
+
+		p->site->nlive--;
+		p->site->live -= p->size;
+		xmalloc_live -= p->size;
+		free(p);
+		break;
+	}
+
+out:
+	pthread_mutex_unlock(&xmalloc_lock);
+}
+
+void *
+xmalloc_at(size_t size, const char *file, int line)
+{
+	void	*ptr;
+
+	ptr = xmalloc(size);
+	xmalloc_track(ptr, size, file, line);
+	return (ptr);
+}
+
+void *
+xcalloc_at(size_t nmemb, size_t size, const char *file, int line)
+{
+	void	*ptr;
+
+	ptr = xcalloc(nmemb, size);
+	xmalloc_track(ptr, nmemb * size, file, line);
+	return (ptr);
+}
+
+void *
+xreallocarray_at(void *ptr, size_t nmemb, size_t size, const char *file,
+    int line)
+{
+	void	*new_ptr;
+
+	if (ptr != NULL)
+		xmalloc_untrack(ptr);
+	new_ptr = xreallocarray(ptr, nmemb, size);
+	xmalloc_track(new_ptr, nmemb * size, file, line);
+	return (new_ptr);
+}
+
+char *
+xstrdup_at(const char *str, const char *file, int line)
+{
+	char	*cp;
+
+	cp = xstrdup(str);
+	xmalloc_track(cp, strlen(cp) + 1, file, line);
+	return (cp);
+}
+
+int
+xasprintf_at(const char *file, int line, char **ret, const char *fmt, ...)
+{
+	va_list	ap;
+	int	i;
+
+	va_start(ap, fmt);
+	i = xvasprintf_at(file, line, ret, fmt, ap);
+	va_end(ap);
+
+	return (i);
+}
+
+int
+xvasprintf_at(const char *file, int line, char **ret, const char *fmt,
+    va_list ap)
+{
+	int	i;
+
+	i = xvasprintf(ret, fmt, ap);
+	xmalloc_track(*ret, i + 1, file, line);
+	return (i);
+}
+
+void
+xfree(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	xmalloc_untrack(ptr);
+	free(ptr);
+}
+
+/*
+ * Copy the sites into an array for the caller to free and fill in the bytes
+ * live and the most there have been.
+ */
+u_int
+xmalloc_stats(struct xmalloc_site **list, size_t *live, size_t *peak)
+{
+	struct xmalloc_site	*site;
+	u_int			 i, n;
+
+	pthread_mutex_lock(&xmalloc_lock);
+	*list = reallocarray(NULL, xmalloc_nsites + 1, sizeof **list);
+	n = 0;
+	if (*list != NULL) {
+		for (i = 0; i < XMALLOC_SITES; i++) {
+			site = xmalloc_site_hash[i];
+			for (; site != NULL; site = site->next)
+				memcpy(&(*list)[n++], site, sizeof **list);
+		}
+	}
+	*live = xmalloc_live;
+	*peak = xmalloc_peak;
+	pthread_mutex_unlock(&xmalloc_lock);
+	return (n);
+}
+#endif
@@ -23,6 +23,8 @@
 # define __bounded__(x, y, z)
 #endif
 
+extern u_long	 xmalloc_calls;
+
 void	*xmalloc(size_t);
 void	*xcalloc(size_t, size_t);
 void	*xrealloc(void *, size_t);
@@ -41,4 +43,46 @@ int	 xvsnprintf(char *, size_t, const char *, va_list)
 		__attribute__((__nonnull__ (3)))
 		__attribute__((__bounded__ (__string__, 1, 2)));
 
+#ifdef XMALLOC_STATS
+/*
+ * Built with --enable-alloc-stats, allocations are counted by the file and
+ * line they are made from, and free looks up the pointers it is given so the
+ * memory still allocated is known. Pointers which did not come from here are
+ * freed as they are. show-allocations reports the counts.
+ */
+struct xmalloc_site {
+	const char		*file;
+	int			 line;
+
+	u_long			 calls;
+	size_t			 bytes;
+	u_long			 nlive;
+	size_t			 live;
+
+	struct xmalloc_site	*next;
+};
+
+void	*xmalloc_at(size_t, const char *, int);
+void	*xcalloc_at(size_t, size_t, const char *, int);
+void	*xreallocarray_at(void *, size_t, size_t, const char *, int);
+char	*xstrdup_at(const char *, const char *, int);
+int	 xasprintf_at(const char *, int, char **, const char *, ...)
+		__attribute__((__format__ (printf, 4, 5)))
+		__attribute__((__nonnull__ (4)));
+int	 xvasprintf_at(const char *, int, char **, const char *, va_list)
+		__attribute__((__nonnull__ (4)));
+void	 xfree(void *);
+u_int	 xmalloc_stats(struct xmalloc_site **, size_t *, size_t *);
+
+#define xmalloc(size) xmalloc_at(size, __FILE__, __LINE__)
+#define xcalloc(nmemb, size) xcalloc_at(nmemb, size, __FILE__, __LINE__)
+#define xrealloc(ptr, size) xreallocarray_at(ptr, 1, size, __FILE__, __LINE__)
+#define xreallocarray(ptr, nmemb, size) \
+	xreallocarray_at(ptr, nmemb, size, __FILE__, __LINE__)
+#define xstrdup(str) xstrdup_at(str, __FILE__, __LINE__)
+#define xasprintf(ret, ...) xasprintf_at(__FILE__, __LINE__, ret, __VA_ARGS__)
+#define xvasprintf(ret, fmt, ap) xvasprintf_at(__FILE__, __LINE__, ret, fmt, ap)
+#define free(ptr) xfree(ptr)
+#endif
+
 #endif	/* XMALLOC_H */
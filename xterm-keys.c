@@ -43,6 +43,7 @@
 int	xterm_keys_match(const char *, const char *, size_t, size_t *,
 	    key_code *);
 int	xterm_keys_modifiers(const char *, size_t, size_t *, key_code *);
+void	xterm_keys_build_index(void);
 
 struct xterm_keys_entry {
 	key_code	 key;
@@ -110,6 +111,32 @@ const struct xterm_keys_entry xterm_keys_table[] = {
 	{ '\t',		"\033[27;_;9~" },
 };
 
+/*
+ * The first entry for each ASCII key and each special key, built the first
+ * time a key is looked up.
+ */
+const struct xterm_keys_entry *xterm_keys_index[0x80 + KEYC_BASE_END -
+    KEYC_BASE];
+int xterm_keys_index_built;
+
+/* Build the index of xterm_keys_table. */
+void
+xterm_keys_build_index(void)
+{
+	const struct xterm_keys_entry	*entry;
+	u_int				 i;
+
+	/* Go backwards, so the first entry for a key wins. */
+	for (i = nitems(xterm_keys_table); i > 0; i--) {
+		entry = &xterm_keys_table[i - 1];
+		if (entry->key < 0x80)
+			xterm_keys_index[entry->key] = entry;
+		else
+			xterm_keys_index[0x80 + entry->key - KEYC_BASE] = entry;
+	}
+	xterm_keys_index_built = 1;
+}
+
 /*
  * Match key against buffer, treating _ as a wildcard. Return -1 for no match,
  * 0 for match, 1 if the end of the buffer is reached (need more data).
@@ -207,7 +234,6 @@ char *
 xterm_keys_lookup(key_code key)
 {
 	const struct xterm_keys_entry	*entry;
-	u_int				 i;
 	key_code			 modifiers;
 	char				*out;
 
@@ -227,13 +253,16 @@ xterm_keys_lookup(key_code key)
 		return (NULL);
 
 	/* Otherwise, find the key in the table. */
+	if (!xterm_keys_index_built)
+		xterm_keys_build_index();
 	key &= ~(KEYC_SHIFT|KEYC_ESCAPE|KEYC_CTRL);
-	for (i = 0; i < nitems(xterm_keys_table); i++) {
-		entry = &xterm_keys_table[i];
-		if (key == entry->key)
-			break;
-	}
-	if (i == nitems(xterm_keys_table))
+	if (key < 0x80)
+		entry = xterm_keys_index[key];
+	else if (key >= KEYC_BASE && key < KEYC_BASE_END)
+		entry = xterm_keys_index[0x80 + key - KEYC_BASE];
+	else
+		entry = NULL;
+	if (entry == NULL)
 		return (NULL);
 
 	/* Copy the template and replace the modifier. */